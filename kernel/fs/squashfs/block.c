@@ -29,7 +29,9 @@
 #include <linux/fs.h>
 #include <linux/vfs.h>
 #include <linux/slab.h>
-#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/list.h>
 #include <linux/string.h>
 #include <linux/buffer_head.h>
 #include <linux/zlib.h>
@@ -39,6 +41,103 @@
 #include "squashfs_fs_i.h"
 #include "squashfs.h"
 
+/*
+ * Decompression uses a pool of streams (one by default, set by the
+ * decompressors mount option), so reads of different blocks can be
+ * decompressed in parallel.  A stream can't be per-CPU because
+ * decompression sleeps waiting for buffers to be read.  The streams are
+ * zlib or zstd, depending on msblk->compression.
+ */
+int squashfs_decomp_init(struct squashfs_sb_info *msblk, int decompressors)
+{
+	int i;
+
+	spin_lock_init(&msblk->decomp_lock);
+	init_waitqueue_head(&msblk->decomp_wait);
+	INIT_LIST_HEAD(&msblk->decomp_free);
+
+	msblk->decomp = kcalloc(decompressors, sizeof(*msblk->decomp),
+		GFP_KERNEL);
+	if (msblk->decomp == NULL)
+		goto failed;
+	msblk->decompressors = decompressors;
+
+	for (i = 0; i < decompressors; i++) {
+		struct squashfs_stream *stream = &msblk->decomp[i];
+
+		if (msblk->compression == ZSTD_COMPRESSION) {
+			if (squashfs_zstd_init(msblk, stream))
+				goto failed;
+		} else {
+			stream->stream.workspace =
+				kmalloc(zlib_inflate_workspacesize(),
+				GFP_KERNEL);
+			if (stream->stream.workspace == NULL)
+				goto failed;
+		}
+		list_add(&stream->list, &msblk->decomp_free);
+	}
+
+	return 0;
+
+failed:
+	ERROR("Failed to allocate %s workspace\n",
+		msblk->compression == ZSTD_COMPRESSION ? "zstd" : "zlib");
+	squashfs_decomp_free(msblk);
+	return -ENOMEM;
+}
+
+
+void squashfs_decomp_free(struct squashfs_sb_info *msblk)
+{
+	int i;
+
+	if (msblk->decomp == NULL)
+		return;
+
+	for (i = 0; i < msblk->decompressors; i++) {
+		kfree(msblk->decomp[i].stream.workspace);
+		squashfs_zstd_free_stream(&msblk->decomp[i]);
+	}
+	kfree(msblk->decomp);
+	msblk->decomp = NULL;
+}
+
+
+/*
+ * Get a free stream from the pool, sleeping until one is available.
+ */
+static struct squashfs_stream *get_stream(struct squashfs_sb_info *msblk)
+{
+	struct squashfs_stream *stream;
+
+	spin_lock(&msblk->decomp_lock);
+	while (list_empty(&msblk->decomp_free)) {
+		spin_unlock(&msblk->decomp_lock);
+		wait_event(msblk->decomp_wait,
+			!list_empty(&msblk->decomp_free));
+		spin_lock(&msblk->decomp_lock);
+	}
+
+	stream = list_entry(msblk->decomp_free.next, struct squashfs_stream,
+		list);
+	list_del(&stream->list);
+	spin_unlock(&msblk->decomp_lock);
+
+	return stream;
+}
+
+
+static void put_stream(struct squashfs_sb_info *msblk,
+	struct squashfs_stream *stream)
+{
+	spin_lock(&msblk->decomp_lock);
+	list_add(&stream->list, &msblk->decomp_free);
+	spin_unlock(&msblk->decomp_lock);
+	wake_up(&msblk->decomp_wait);
+}
+
+
 /*
  * Read the metadata block length, this is stored in the first two
  * bytes of the metadata block.
@@ -71,6 +170,59 @@ static struct buffer_head *get_block_length(struct super_block *sb,
 }
 
 
+/*
+ * Start reading the device blocks covering bytes start to end of the
+ * filesystem, without waiting for them.  This is used to read the following
+ * datablocks of a file while the current one is being decompressed, so the
+ * device has more than one read queued.  The buffers are submitted in
+ * batches, which the block layer merges into large requests, and are found
+ * up to date (or in flight) by squashfs_read_data.  Buffers already up to
+ * date or locked are skipped, and like any readahead, reads the block layer
+ * can't queue immediately are dropped.
+ */
+void squashfs_read_ahead(struct super_block *sb, u64 start, u64 end)
+{
+	struct squashfs_sb_info *msblk = sb->s_fs_info;
+	struct buffer_head *bh[SQUASHFS_READAHEAD_BATCH];
+	u64 cur_index, last_index;
+	int b = 0;
+
+	if (end > msblk->bytes_used)
+		end = msblk->bytes_used;
+	if (start >= end)
+		return;
+
+	cur_index = start >> msblk->devblksize_log2;
+	last_index = (end - 1) >> msblk->devblksize_log2;
+
+	TRACE("Readahead @ 0x%llx, %llu bytes\n", start, end - start);
+
+	for (; cur_index <= last_index; cur_index++) {
+		bh[b] = sb_getblk(sb, cur_index);
+		if (bh[b] == NULL)
+			break;
+
+		if (buffer_uptodate(bh[b])) {
+			put_bh(bh[b]);
+			continue;
+		}
+
+		if (++b == SQUASHFS_READAHEAD_BATCH) {
+			ll_rw_block(READA, b, bh);
+			while (b)
+				put_bh(bh[--b]);
+		}
+	}
+
+	/* ll_rw_block holds its own reference until the read completes */
+	if (b) {
+		ll_rw_block(READA, b, bh);
+		while (b)
+			put_bh(bh[--b]);
+	}
+}
+
+
 /*
  * Read and decompress a metadata block or datablock.  Length is non-zero
  * if a datablock is being read (the size is stored elsewhere in the
@@ -78,6 +230,7 @@ static struct buffer_head *get_block_length(struct super_block *sb,
  * the metadata block.  A bit in the length field indicates if the block
  * is stored uncompressed in the filesystem (usually because compression
  * generated a larger block - this does occasionally happen with zlib).
+ * Compressed blocks are zlib, or zstd if msblk->compression says so.
  */
 int squashfs_read_data(struct super_block *sb, void **buffer, u64 index,
 			int length, u64 *next_index, int srclength)
@@ -87,6 +240,7 @@ int squashfs_read_data(struct super_block *sb, void **buffer, u64 index,
 	int offset = index & ((1 << msblk->devblksize_log2) - 1);
 	u64 cur_index = index >> msblk->devblksize_log2;
 	int bytes, compressed, b = 0, k = 0, page = 0, avail;
+	struct squashfs_stream *stream = NULL;
 
 
 	bh = kcalloc((msblk->block_size >> msblk->devblksize_log2) + 1,
@@ -152,26 +306,35 @@ int squashfs_read_data(struct super_block *sb, void **buffer, u64 index,
 		ll_rw_block(READ, b - 1, bh + 1);
 	}
 
-	if (compressed) {
+	if (compressed && msblk->compression == ZSTD_COMPRESSION) {
+		stream = get_stream(msblk);
+		length = squashfs_zstd_uncompress(msblk, stream, buffer, bh, b,
+			offset, length, srclength, &k);
+		if (length < 0)
+			goto release_stream;
+		put_stream(msblk, stream);
+	} else if (compressed) {
 		int zlib_err = 0, zlib_init = 0;
+		z_stream *zs;
 
 		/*
 		 * Uncompress block.
 		 */
 
-		mutex_lock(&msblk->read_data_mutex);
+		stream = get_stream(msblk);
+		zs = &stream->stream;
 
-		msblk->stream.avail_out = 0;
-		msblk->stream.avail_in = 0;
+		zs->avail_out = 0;
+		zs->avail_in = 0;
 
 		bytes = length;
 		do {
-			if (msblk->stream.avail_in == 0 && k < b) {
+			if (zs->avail_in == 0 && k < b) {
 				avail = min(bytes, msblk->devblksize - offset);
 				bytes -= avail;
 				wait_on_buffer(bh[k]);
 				if (!buffer_uptodate(bh[k]))
-					goto release_mutex;
+					goto release_stream;
 
 				if (avail == 0) {
 					offset = 0;
@@ -179,31 +342,31 @@ int squashfs_read_data(struct super_block *sb, void **buffer, u64 index,
 					continue;
 				}
 
-				msblk->stream.next_in = bh[k]->b_data + offset;
-				msblk->stream.avail_in = avail;
+				zs->next_in = bh[k]->b_data + offset;
+				zs->avail_in = avail;
 				offset = 0;
 			}
 
-			if (msblk->stream.avail_out == 0) {
-				msblk->stream.next_out = buffer[page++];
-				msblk->stream.avail_out = PAGE_CACHE_SIZE;
+			if (zs->avail_out == 0) {
+				zs->next_out = buffer[page++];
+				zs->avail_out = PAGE_CACHE_SIZE;
 			}
 
 			if (!zlib_init) {
-				zlib_err = zlib_inflateInit(&msblk->stream);
+				zlib_err = zlib_inflateInit(zs);
 				if (zlib_err != Z_OK) {
 					ERROR("zlib_inflateInit returned"
 						" unexpected result 0x%x,"
 						" srclength %d\n", zlib_err,
 						srclength);
-					goto release_mutex;
+					goto release_stream;
 				}
 				zlib_init = 1;
 			}
 
-			zlib_err = zlib_inflate(&msblk->stream, Z_NO_FLUSH);
+			zlib_err = zlib_inflate(zs, Z_NO_FLUSH);
 
-			if (msblk->stream.avail_in == 0 && k < b)
+			if (zs->avail_in == 0 && k < b)
 				put_bh(bh[k++]);
 		} while (zlib_err == Z_OK);
 
@@ -211,19 +374,18 @@ int squashfs_read_data(struct super_block *sb, void **buffer, u64 index,
 			ERROR("zlib_inflate returned unexpected result"
 				" 0x%x, srclength %d, avail_in %d,"
 				" avail_out %d\n", zlib_err, srclength,
-				msblk->stream.avail_in,
-				msblk->stream.avail_out);
-			goto release_mutex;
+				zs->avail_in, zs->avail_out);
+			goto release_stream;
 		}
 
-		zlib_err = zlib_inflateEnd(&msblk->stream);
+		zlib_err = zlib_inflateEnd(zs);
 		if (zlib_err != Z_OK) {
 			ERROR("zlib_inflateEnd returned unexpected result 0x%x,"
 				" srclength %d\n", zlib_err, srclength);
-			goto release_mutex;
+			goto release_stream;
 		}
-		length = msblk->stream.total_out;
-		mutex_unlock(&msblk->read_data_mutex);
+		length = zs->total_out;
+		put_stream(msblk, stream);
 	} else {
 		/*
 		 * Block is uncompressed.
@@ -260,8 +422,8 @@ int squashfs_read_data(struct super_block *sb, void **buffer, u64 index,
 	kfree(bh);
 	return length;
 
-release_mutex:
-	mutex_unlock(&msblk->read_data_mutex);
+release_stream:
+	put_stream(msblk, stream);
 
 block_release:
 	for (; k < b; k++)
@@ -53,12 +53,63 @@
 #include <linux/wait.h>
 #include <linux/zlib.h>
 #include <linux/pagemap.h>
+#include <linux/list.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
 
 #include "squashfs_fs.h"
 #include "squashfs_fs_sb.h"
 #include "squashfs_fs_i.h"
 #include "squashfs.h"
 
+/*
+ * Look-up block in the cache hash table.  Called with the cache lock held.
+ */
+static struct squashfs_cache_entry *squashfs_cache_lookup(
+	struct squashfs_cache *cache, u64 block)
+{
+	struct squashfs_cache_entry *entry;
+	struct hlist_node *node;
+
+	hlist_for_each_entry(entry, node, &cache->hash[hash_long(block,
+			cache->hash_bits)], hash_node)
+		if (entry->block == block)
+			return entry;
+
+	return NULL;
+}
+
+
+/*
+ * Choose an unused entry to evict using the CLOCK algorithm.  Entries
+ * which have been used since the clock hand last passed them are given a
+ * second chance, so frequently used (i.e. metadata) blocks are not evicted
+ * by a stream of once-only reads.  Called with the cache lock held, and at
+ * least one unused entry.
+ */
+static struct squashfs_cache_entry *squashfs_cache_evict(
+	struct squashfs_cache *cache)
+{
+	struct squashfs_cache_entry *entry;
+
+	while (1) {
+		entry = &cache->entry[cache->clock_hand];
+		cache->clock_hand = (cache->clock_hand + 1) % cache->entries;
+
+		if (entry->refcount)
+			continue;
+		if (!entry->referenced)
+			break;
+		entry->referenced = 0;
+	}
+
+	if (entry->block != SQUASHFS_INVALID_BLK)
+		hlist_del(&entry->hash_node);
+
+	return entry;
+}
+
+
 /*
  * Look-up block in cache, and increment usage count.  If not in cache, read
  * and decompress it from disk.
@@ -66,17 +117,14 @@
 struct squashfs_cache_entry *squashfs_cache_get(struct super_block *sb,
 	struct squashfs_cache *cache, u64 block, int length)
 {
-	int i, n;
 	struct squashfs_cache_entry *entry;
 
 	spin_lock(&cache->lock);
 
 	while (1) {
-		for (i = 0; i < cache->entries; i++)
-			if (cache->entry[i].block == block)
-				break;
+		entry = squashfs_cache_lookup(cache, block);
 
-		if (i == cache->entries) {
+		if (entry == NULL) {
 			/*
 			 * Block not in cache, if all cache entries are used
 			 * go to sleep waiting for one to become available.
@@ -91,19 +139,10 @@ struct squashfs_cache_entry *squashfs_cache_get(struct super_block *sb,
 			}
 
 			/*
-			 * At least one unused cache entry.  A simple
-			 * round-robin strategy is used to choose the entry to
+			 * At least one unused cache entry, choose the entry to
 			 * be evicted from the cache.
 			 */
-			i = cache->next_blk;
-			for (n = 0; n < cache->entries; n++) {
-				if (cache->entry[i].refcount == 0)
-					break;
-				i = (i + 1) % cache->entries;
-			}
-
-			cache->next_blk = (i + 1) % cache->entries;
-			entry = &cache->entry[i];
+			entry = squashfs_cache_evict(cache);
 
 			/*
 			 * Initialise choosen cache entry, and fill it in from
@@ -111,6 +150,9 @@ struct squashfs_cache_entry *squashfs_cache_get(struct super_block *sb,
 			 */
 			cache->unused--;
 			entry->block = block;
+			hlist_add_head(&entry->hash_node, &cache->hash[
+				hash_long(block, cache->hash_bits)]);
+			entry->referenced = 0;
 			entry->refcount = 1;
 			entry->pending = 1;
 			entry->num_waiters = 0;
@@ -148,10 +190,10 @@ struct squashfs_cache_entry *squashfs_cache_get(struct super_block *sb,
 		 * previously unused there's one less cache entry available
 		 * for reuse.
 		 */
-		entry = &cache->entry[i];
 		if (entry->refcount == 0)
 			cache->unused--;
 		entry->refcount++;
+		entry->referenced = 1;
 
 		/*
 		 * If the entry is currently being filled in by another process
@@ -169,7 +211,8 @@ struct squashfs_cache_entry *squashfs_cache_get(struct super_block *sb,
 
 out:
 	TRACE("Got %s %d, start block %lld, refcount %d, error %d\n",
-		cache->name, i, entry->block, entry->refcount, entry->error);
+		cache->name, (int) (entry - cache->entry), entry->block,
+		entry->refcount, entry->error);
 
 	if (entry->error)
 		ERROR("Unable to read %s cache entry [%llx]\n", cache->name,
@@ -221,6 +264,7 @@ void squashfs_cache_delete(struct squashfs_cache *cache)
 	}
 
 	kfree(cache->entry);
+	kfree(cache->hash);
 	kfree(cache);
 }
 
@@ -247,7 +291,19 @@ struct squashfs_cache *squashfs_cache_init(char *name, int entries,
 		goto cleanup;
 	}
 
-	cache->next_blk = 0;
+	/*
+	 * The hash table has at least twice as many chains as entries, so
+	 * lookup is cheap however large the cache is.
+	 */
+	cache->hash_bits = ilog2(roundup_pow_of_two(entries)) + 1;
+	cache->hash = kcalloc(1 << cache->hash_bits, sizeof(*(cache->hash)),
+		GFP_KERNEL);
+	if (cache->hash == NULL) {
+		ERROR("Failed to allocate %s cache\n", name);
+		goto cleanup;
+	}
+
+	cache->clock_hand = 0;
 	cache->unused = entries;
 	cache->entries = entries;
 	cache->block_size = block_size;
@@ -410,3 +466,29 @@ int squashfs_read_table(struct super_block *sb, void *buffer, u64 block,
 	kfree(data);
 	return res;
 }
+
+
+/*
+ * Read a whole lookup table of length bytes, stored in the metadata blocks
+ * located by the index table, into buffer
+ */
+int squashfs_read_lookup_table(struct super_block *sb, void *buffer,
+	__le64 *index, int length)
+{
+	int i, res;
+
+	for (i = 0; length; i++) {
+		u64 block = le64_to_cpu(index[i]);
+		int offset = 0, bytes = min(length, SQUASHFS_METADATA_SIZE);
+
+		res = squashfs_read_metadata(sb, buffer, &block, &offset,
+			bytes);
+		if (res < 0)
+			return res;
+
+		buffer += bytes;
+		length -= bytes;
+	}
+
+	return 0;
+}
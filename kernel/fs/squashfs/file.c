@@ -34,10 +34,12 @@
  *
  * The index cache allows Squashfs to handle large files (up to 1.75 TiB) while
  * retaining a simple and space-efficient block list on disk.  The cache
- * is split into slots, caching up to eight 224 GiB files (128 KiB blocks).
- * Larger files use multiple slots, with 1.75 TiB files using all 8 slots.
- * The index cache is designed to be memory efficient, and by default uses
- * 16 KiB.
+ * is split into slots, each caching up to a 224 GiB file (128 KiB blocks).
+ * Larger files use multiple slots, with 1.75 TiB files using 8 slots.
+ * The index cache is designed to be memory efficient, and by default has 8
+ * slots using 16 KiB.  The number of slots can be set by the meta_slots mount
+ * option, slots are looked up by inode in a hash table, and the least
+ * recently used slot is reused.
  */
 
 #include <linux/fs.h>
@@ -48,6 +50,9 @@
 #include <linux/pagemap.h>
 #include <linux/mutex.h>
 #include <linux/zlib.h>
+#include <linux/list.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
 
 #include "squashfs_fs.h"
 #include "squashfs_fs_sb.h"
@@ -61,9 +66,9 @@
 static struct meta_index *locate_meta_index(struct inode *inode, int offset,
 				int index)
 {
-	struct meta_index *meta = NULL;
+	struct meta_index *meta = NULL, *slot;
 	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
-	int i;
+	struct hlist_node *node;
 
 	mutex_lock(&msblk->meta_index_mutex);
 
@@ -72,20 +77,23 @@ static struct meta_index *locate_meta_index(struct inode *inode, int offset,
 	if (msblk->meta_index == NULL)
 		goto not_allocated;
 
-	for (i = 0; i < SQUASHFS_META_SLOTS; i++) {
-		if (msblk->meta_index[i].inode_number == inode->i_ino &&
-				msblk->meta_index[i].offset >= offset &&
-				msblk->meta_index[i].offset <= index &&
-				msblk->meta_index[i].locked == 0) {
-			TRACE("locate_meta_index: entry %d, offset %d\n", i,
-					msblk->meta_index[i].offset);
-			meta = &msblk->meta_index[i];
+	hlist_for_each_entry(slot, node, &msblk->meta_hash[
+			hash_long(inode->i_ino, msblk->meta_hash_bits)], hash) {
+		if (slot->inode_number == inode->i_ino &&
+				slot->offset >= offset &&
+				slot->offset <= index &&
+				slot->locked == 0) {
+			TRACE("locate_meta_index: entry %d, offset %d\n",
+				(int) (slot - msblk->meta_index), slot->offset);
+			meta = slot;
 			offset = meta->offset;
 		}
 	}
 
-	if (meta)
+	if (meta) {
 		meta->locked = 1;
+		list_move_tail(&meta->lru, &msblk->meta_lru);
+	}
 
 not_allocated:
 	mutex_unlock(&msblk->meta_index_mutex);
@@ -101,7 +109,7 @@ static struct meta_index *empty_meta_index(struct inode *inode, int offset,
 				int skip)
 {
 	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
-	struct meta_index *meta = NULL;
+	struct meta_index *meta = NULL, *slot;
 	int i;
 
 	mutex_lock(&msblk->meta_index_mutex);
@@ -115,36 +123,54 @@ static struct meta_index *empty_meta_index(struct inode *inode, int offset,
 		 * mount time but doing it here means it is allocated only
 		 * if a 'large' file is read.
 		 */
-		msblk->meta_index = kcalloc(SQUASHFS_META_SLOTS,
+		msblk->meta_hash_bits =
+			ilog2(roundup_pow_of_two(msblk->meta_slots)) + 1;
+		msblk->meta_hash = kcalloc(1 << msblk->meta_hash_bits,
+			sizeof(*(msblk->meta_hash)), GFP_KERNEL);
+		if (msblk->meta_hash == NULL) {
+			ERROR("Failed to allocate meta_index\n");
+			goto failed;
+		}
+
+		msblk->meta_index = kcalloc(msblk->meta_slots,
 			sizeof(*(msblk->meta_index)), GFP_KERNEL);
 		if (msblk->meta_index == NULL) {
 			ERROR("Failed to allocate meta_index\n");
+			kfree(msblk->meta_hash);
+			msblk->meta_hash = NULL;
 			goto failed;
 		}
-		for (i = 0; i < SQUASHFS_META_SLOTS; i++) {
+		for (i = 0; i < msblk->meta_slots; i++) {
 			msblk->meta_index[i].inode_number = 0;
 			msblk->meta_index[i].locked = 0;
+			INIT_HLIST_NODE(&msblk->meta_index[i].hash);
+			list_add_tail(&msblk->meta_index[i].lru,
+				&msblk->meta_lru);
 		}
-		msblk->next_meta_index = 0;
 	}
 
-	for (i = SQUASHFS_META_SLOTS; i &&
-			msblk->meta_index[msblk->next_meta_index].locked; i--)
-		msblk->next_meta_index = (msblk->next_meta_index + 1) %
-			SQUASHFS_META_SLOTS;
+	/*
+	 * Reuse the least recently used slot which isn't locked.
+	 */
+	list_for_each_entry(slot, &msblk->meta_lru, lru)
+		if (slot->locked == 0) {
+			meta = slot;
+			break;
+		}
 
-	if (i == 0) {
+	if (meta == NULL) {
 		TRACE("empty_meta_index: failed!\n");
 		goto failed;
 	}
 
 	TRACE("empty_meta_index: returned meta entry %d, %p\n",
-			msblk->next_meta_index,
-			&msblk->meta_index[msblk->next_meta_index]);
+			(int) (meta - msblk->meta_index), meta);
 
-	meta = &msblk->meta_index[msblk->next_meta_index];
-	msblk->next_meta_index = (msblk->next_meta_index + 1) %
-			SQUASHFS_META_SLOTS;
+	if (!hlist_unhashed(&meta->hash))
+		hlist_del_init(&meta->hash);
+	hlist_add_head(&meta->hash, &msblk->meta_hash[hash_long(inode->i_ino,
+		msblk->meta_hash_bits)]);
+	list_move_tail(&meta->lru, &msblk->meta_lru);
 
 	meta->inode_number = inode->i_ino;
 	meta->offset = offset;
@@ -497,6 +523,179 @@ out:
 }
 
 
+/*
+ * Get the page cache page for index i of a datablock being read by
+ * readahead.  The page is taken from the readahead list if it's next, otherwise
+ * it's grabbed from the page cache as in squashfs_readpage.  NULL is
+ * returned if the page is unavailable or already up to date.
+ */
+static struct page *squashfs_readahead_page(struct address_space *mapping,
+	struct list_head *pages, int i)
+{
+	struct page *page;
+
+	if (!list_empty(pages)) {
+		page = list_entry(pages->prev, struct page, lru);
+		if (page->index == i) {
+			list_del(&page->lru);
+			if (add_to_page_cache_lru(page, mapping, i, GFP_KERNEL)) {
+				page_cache_release(page);
+				return NULL;
+			}
+			return page;
+		}
+	}
+
+	page = grab_cache_page_nowait(mapping, i);
+	if (page && PageUptodate(page)) {
+		unlock_page(page);
+		page_cache_release(page);
+		return NULL;
+	}
+
+	return page;
+}
+
+
+/*
+ * Start reading the datablocks covered by the readahead list from disk.  The
+ * datablocks of a file are contiguous, so this is one range, from the first
+ * block to the end of the last.  Otherwise each block is only read when
+ * squashfs_read_data gets to it, and the device sits idle while the previous
+ * block is decompressed.
+ */
+static void squashfs_readahead_blocks(struct inode *inode,
+	struct list_head *pages)
+{
+	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
+	int shift = msblk->block_log - PAGE_CACHE_SHIFT;
+	int file_end = i_size_read(inode) >> msblk->block_log;
+	int first, last, bsize;
+	u64 start, end;
+
+	if (list_empty(pages))
+		return;
+
+	first = list_entry(pages->prev, struct page, lru)->index >> shift;
+	last = list_entry(pages->next, struct page, lru)->index >> shift;
+
+	/* the tail end in a fragment isn't a datablock */
+	if (last >= file_end && squashfs_i(inode)->fragment_block !=
+			SQUASHFS_INVALID_BLK)
+		last = file_end - 1;
+
+	/* a single block is read straight away anyway */
+	if (first >= last)
+		return;
+
+	if (read_blocklist(inode, first, &start) < 0)
+		return;
+
+	bsize = read_blocklist(inode, last, &end);
+	if (bsize < 0)
+		return;
+
+	squashfs_read_ahead(inode->i_sb, start, end +
+		SQUASHFS_COMPRESSED_SIZE_BLOCK(bsize));
+}
+
+
+/*
+ * Readahead.  Datablocks are decompressed straight into the page cache pages
+ * covering them, rather than into the read_page cache entry and then copied
+ * into the pages.  Pages in holes or fragments, and pages of datablocks which
+ * can't be read, are read by squashfs_readpage.
+ */
+static int squashfs_readpages(struct file *file, struct address_space *mapping,
+	struct list_head *pages, unsigned nr_pages)
+{
+	struct inode *inode = mapping->host;
+	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
+	int shift = msblk->block_log - PAGE_CACHE_SHIFT;
+	int mask = (1 << shift) - 1;
+	int file_end = i_size_read(inode) >> msblk->block_log;
+	int max_index = (i_size_read(inode) - 1) >> PAGE_CACHE_SHIFT;
+	struct page **push = kcalloc(1 << shift, sizeof(*push), GFP_KERNEL);
+	void **data = kcalloc(1 << shift, sizeof(*data), GFP_KERNEL);
+	void *scratch = kmalloc(PAGE_CACHE_SIZE, GFP_KERNEL);
+
+	TRACE("Entered squashfs_readpages, %u pages, start block %llx\n",
+				nr_pages, squashfs_i(inode)->start);
+
+	/* on failure the pages left on the list are released by the caller */
+	if (push == NULL || data == NULL || scratch == NULL)
+		goto out;
+
+	squashfs_readahead_blocks(inode, pages);
+
+	while (!list_empty(pages)) {
+		struct page *page = list_entry(pages->prev, struct page, lru);
+		int index = page->index >> shift;
+		int start_index = page->index & ~mask;
+		int end_index = min(start_index | mask, max_index);
+		int i, n = end_index - start_index + 1, length, bsize = 0;
+		u64 block = 0;
+
+		if (index < file_end || squashfs_i(inode)->fragment_block ==
+				SQUASHFS_INVALID_BLK)
+			bsize = read_blocklist(inode, index, &block);
+
+		if (bsize <= 0) {
+			/* fragment, hole or error */
+			list_del(&page->lru);
+			if (add_to_page_cache_lru(page, mapping, page->index,
+					GFP_KERNEL) == 0)
+				squashfs_readpage(file, page);
+			page_cache_release(page);
+			continue;
+		}
+
+		/*
+		 * Pages which aren't available decompress into the scratch
+		 * page.  The pages are kmapped rather than atomically mapped
+		 * because squashfs_read_data sleeps.
+		 */
+		for (i = 0; i < 1 << shift; i++) {
+			push[i] = i < n ? squashfs_readahead_page(mapping,
+				pages, start_index + i) : NULL;
+			data[i] = push[i] ? kmap(push[i]) : scratch;
+		}
+
+		length = squashfs_read_data(inode->i_sb, data, block, bsize,
+			NULL, msblk->block_size);
+		if (length < 0)
+			ERROR("Unable to read page, block %llx, size %x\n",
+				block, bsize);
+
+		for (i = 0; i < n; i++) {
+			int avail = length < 0 ? 0 :
+				clamp_t(int, length - (i << PAGE_CACHE_SHIFT), 0,
+				PAGE_CACHE_SIZE);
+
+			if (push[i] == NULL)
+				continue;
+
+			memset(data[i] + avail, 0, PAGE_CACHE_SIZE - avail);
+			kunmap(push[i]);
+			flush_dcache_page(push[i]);
+			if (length < 0)
+				SetPageError(push[i]);
+			else
+				SetPageUptodate(push[i]);
+			unlock_page(push[i]);
+			page_cache_release(push[i]);
+		}
+	}
+
+out:
+	kfree(scratch);
+	kfree(data);
+	kfree(push);
+	return 0;
+}
+
+
 const struct address_space_operations squashfs_aops = {
-	.readpage = squashfs_readpage
+	.readpage = squashfs_readpage,
+	.readpages = squashfs_readpages
 };
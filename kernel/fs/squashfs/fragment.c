@@ -30,12 +30,14 @@
  * Like everything in Squashfs this fragment lookup table is itself stored
  * compressed into metadata blocks.  A second index table is used to locate
  * these.  This second index table for speed of access (and because it
- * is small) is read at mount time and cached in memory.
+ * is small) is read at mount time and cached in memory.  With the
+ * cache_tables mount option the whole fragment lookup table is too.
  */
 
 #include <linux/fs.h>
 #include <linux/vfs.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include <linux/zlib.h>
 
 #include "squashfs_fs.h"
@@ -57,6 +59,16 @@ int squashfs_frag_lookup(struct super_block *sb, unsigned int fragment,
 	struct squashfs_fragment_entry fragment_entry;
 	int size;
 
+	if (msblk->fragments) {
+		struct squashfs_fragment_entry *entry;
+
+		if (fragment >= msblk->no_fragments)
+			return -EINVAL;
+		entry = &msblk->fragments[fragment];
+		*fragment_block = le64_to_cpu(entry->start_block);
+		return le32_to_cpu(entry->size);
+	}
+
 	size = squashfs_read_metadata(sb, &fragment_entry, &start_block,
 					&offset, sizeof(fragment_entry));
 	if (size < 0)
@@ -96,3 +108,33 @@ __le64 *squashfs_read_fragment_index_table(struct super_block *sb,
 
 	return fragment_index;
 }
+
+
+/*
+ * Read the whole fragment lookup table into memory (cache_tables mount
+ * option), so squashfs_frag_lookup doesn't go through the metadata cache
+ */
+struct squashfs_fragment_entry *squashfs_cache_fragment_table(
+	struct super_block *sb, unsigned int fragments)
+{
+	struct squashfs_sb_info *msblk = sb->s_fs_info;
+	unsigned int length = SQUASHFS_FRAGMENT_BYTES(fragments);
+	struct squashfs_fragment_entry *fragment_table;
+	int err;
+
+	fragment_table = vmalloc(length);
+	if (fragment_table == NULL) {
+		ERROR("Failed to allocate fragment table\n");
+		return ERR_PTR(-ENOMEM);
+	}
+
+	err = squashfs_read_lookup_table(sb, fragment_table,
+		msblk->fragment_index, length);
+	if (err < 0) {
+		ERROR("unable to read fragment table\n");
+		vfree(fragment_table);
+		return ERR_PTR(err);
+	}
+
+	return fragment_table;
+}
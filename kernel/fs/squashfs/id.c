@@ -34,6 +34,7 @@
 #include <linux/fs.h>
 #include <linux/vfs.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include <linux/zlib.h>
 
 #include "squashfs_fs.h"
@@ -54,6 +55,13 @@ int squashfs_get_id(struct super_block *sb, unsigned int index,
 	__le32 disk_id;
 	int err;
 
+	if (msblk->ids) {
+		if (index >= msblk->no_ids)
+			return -EINVAL;
+		*id = le32_to_cpu(msblk->ids[index]);
+		return 0;
+	}
+
 	err = squashfs_read_metadata(sb, &disk_id, &start_block, &offset,
 							sizeof(disk_id));
 	if (err < 0)
@@ -92,3 +100,33 @@ __le64 *squashfs_read_id_index_table(struct super_block *sb,
 
 	return id_table;
 }
+
+
+/*
+ * Read the whole id lookup table into memory (cache_tables mount option), so
+ * squashfs_get_id doesn't go through the metadata cache
+ */
+__le32 *squashfs_cache_id_table(struct super_block *sb, unsigned short no_ids)
+{
+	struct squashfs_sb_info *msblk = sb->s_fs_info;
+	unsigned int length = SQUASHFS_ID_BYTES(no_ids);
+	__le32 *ids;
+	int err;
+
+	TRACE("In cache_id_table, length %d\n", length);
+
+	ids = vmalloc(length);
+	if (ids == NULL) {
+		ERROR("Failed to allocate id table\n");
+		return ERR_PTR(-ENOMEM);
+	}
+
+	err = squashfs_read_lookup_table(sb, ids, msblk->id_table, length);
+	if (err < 0) {
+		ERROR("unable to read id table\n");
+		vfree(ids);
+		return ERR_PTR(err);
+	}
+
+	return ids;
+}
@@ -50,6 +50,15 @@
  * decompressed to do a lookup irrespective of the length of the directory.
  * This scheme has the advantage that it doesn't require extra memory overhead
  * and doesn't require much extra storage on disk.
+ *
+ * An index entry can mark any directory header, not just the first in each
+ * metadata block, and mksquashfs -dir-index writes denser indexes, which
+ * leave fewer entries to scan after the index lookup.  Directories with more
+ * than a few index entries have their index read into memory by their first
+ * lookup, and it is then binary searched rather than scanned.  The index bounds
+ * the part of the directory the filename can be in, and if this is small it is
+ * read in one go and its directory headers binary searched by their first
+ * filename, otherwise it is scanned until past the filename.
  */
 
 #include <linux/fs.h>
@@ -58,6 +67,7 @@
 #include <linux/string.h>
 #include <linux/dcache.h>
 #include <linux/zlib.h>
+#include <asm/unaligned.h>
 
 #include "squashfs_fs.h"
 #include "squashfs_fs_sb.h"
@@ -66,7 +76,9 @@
 
 /*
  * Lookup name in the directory index, returning the location of the metadata
- * block containing it, and the directory index this represents.
+ * block containing it, and the directory index this represents.  If the
+ * index has a later entry, *end is set to the index it represents, which
+ * the name must be before.
  *
  * If we get an error reading the index then return the part of the index
  * (if any) we have managed to read - the index isn't essential, just
@@ -75,7 +87,7 @@
 static int get_dir_index_using_name(struct super_block *sb,
 			u64 *next_block, int *next_offset, u64 index_start,
 			int index_offset, int i_count, const char *name,
-			int len)
+			int len, int *end)
 {
 	struct squashfs_sb_info *msblk = sb->s_fs_info;
 	int i, size, length = 0, err;
@@ -110,8 +122,10 @@ static int get_dir_index_using_name(struct super_block *sb,
 
 		index->name[size] = '\0';
 
-		if (strcmp(index->name, str) > 0)
+		if (strcmp(index->name, str) > 0) {
+			*end = le32_to_cpu(index->index) + 3;
 			break;
+		}
 
 		length = le32_to_cpu(index->index);
 		*next_block = le32_to_cpu(index->start_block) +
@@ -132,6 +146,244 @@ out:
 }
 
 
+/*
+ * Read the directory index into memory, so lookups can binary search it
+ * rather than read it linearly.  This pays off for the large directories,
+ * which are likely to be looked up in many times, and which mksquashfs
+ * -dir-index can give thousands of index entries.  Short indexes, and
+ * indexes which can't be read, are left to get_dir_index_using_name().
+ */
+static struct squashfs_dir_idx_cache *read_dir_idx_cache(struct inode *dir)
+{
+	struct squashfs_inode_info *info = squashfs_i(dir);
+	struct squashfs_dir_idx_cache *cache;
+	struct squashfs_dir_index index;
+	u64 block;
+	int offset, i, size, err, names = 0;
+	char *name;
+
+	if (info->dir_idx_cache)
+		return info->dir_idx_cache;
+	if (info->dir_idx_cnt < SQUASHFS_DIR_IDX_CACHE_MIN)
+		return NULL;
+
+	/* First pass sizes the names */
+	block = info->dir_idx_start;
+	offset = info->dir_idx_offset;
+	for (i = 0; i < info->dir_idx_cnt; i++) {
+		err = squashfs_read_metadata(dir->i_sb, &index, &block,
+					&offset, sizeof(index));
+		if (err < 0)
+			return NULL;
+
+		size = le32_to_cpu(index.size) + 1;
+		if (size > SQUASHFS_NAME_LEN)
+			return NULL;
+
+		err = squashfs_read_metadata(dir->i_sb, NULL, &block, &offset,
+					size);
+		if (err < 0)
+			return NULL;
+		names += size + 1;
+	}
+
+	cache = kmalloc(sizeof(*cache) + info->dir_idx_cnt *
+		sizeof(cache->entry[0]) + names, GFP_KERNEL | __GFP_NOWARN);
+	if (cache == NULL)
+		return NULL;
+
+	/* Second pass reads the index, its blocks are now cached */
+	cache->count = info->dir_idx_cnt;
+	name = (char *) &cache->entry[cache->count];
+	block = info->dir_idx_start;
+	offset = info->dir_idx_offset;
+	for (i = 0; i < cache->count; i++) {
+		err = squashfs_read_metadata(dir->i_sb, &index, &block,
+					&offset, sizeof(index));
+		if (err < 0)
+			goto failed;
+
+		size = le32_to_cpu(index.size) + 1;
+		err = squashfs_read_metadata(dir->i_sb, name, &block, &offset,
+					size);
+		if (err < 0)
+			goto failed;
+
+		name[size] = '\0';
+		cache->entry[i].index = le32_to_cpu(index.index);
+		cache->entry[i].start_block = le32_to_cpu(index.start_block);
+		cache->entry[i].name = name;
+		name += size + 1;
+	}
+
+	/* Lookups in the same directory may race to read the index */
+	if (cmpxchg(&info->dir_idx_cache, NULL, cache) != NULL) {
+		kfree(cache);
+		cache = info->dir_idx_cache;
+	}
+
+	return cache;
+
+failed:
+	kfree(cache);
+	return NULL;
+}
+
+
+/*
+ * Binary search the in-memory directory index for the last entry whose
+ * filename isn't alphabetically larger than the filename being looked up.
+ * Returns the same as get_dir_index_using_name().
+ */
+static int get_dir_index_using_cache(struct super_block *sb,
+			struct squashfs_dir_idx_cache *cache, u64 *next_block,
+			int *next_offset, const char *name, int len, int *end)
+{
+	struct squashfs_sb_info *msblk = sb->s_fs_info;
+	int low = 0, high = cache->count, length = 0;
+
+	while (low < high) {
+		int mid = low + (high - low) / 2;
+		char *entry = cache->entry[mid].name;
+		int res = strncmp(entry, name, len);
+
+		/* the filename being looked up isn't NUL terminated */
+		if (res == 0 && entry[len] != '\0')
+			res = 1;
+
+		if (res > 0)
+			high = mid;
+		else
+			low = mid + 1;
+	}
+
+	if (low) {
+		length = cache->entry[low - 1].index;
+		*next_block = cache->entry[low - 1].start_block +
+					msblk->directory_table;
+	}
+	if (low < cache->count)
+		*end = cache->entry[low].index + 3;
+
+	*next_offset = (length + *next_offset) % SQUASHFS_METADATA_SIZE;
+	return length + 3;
+}
+
+
+/*
+ * Directories are sorted by strcmp() of the filenames, which compares them
+ * as unsigned chars, as memcmp() does.  Neither filename is NUL terminated
+ */
+static int squashfs_name_cmp(const char *a, int alen, const char *b, int blen)
+{
+	int res = memcmp(a, b, min(alen, blen));
+
+	return res ? res : alen - blen;
+}
+
+
+/*
+ * Lookup name in the <bytes> of directory at <block, offset>, a range
+ * bounded by the directory index.  The range is read in one go, and its
+ * directory headers are binary searched by their first filename, so only
+ * the entries of one header are compared, and only until they pass the
+ * filename.  Returns 1 and the inode if found, 0 if not found.
+ */
+static int lookup_range(struct super_block *sb, u64 block, int offset,
+			int bytes, const char *name, int len, long long *ino,
+			unsigned int *ino_num)
+{
+	struct squashfs_dir_header *dirh;
+	struct squashfs_dir_entry *dire;
+	int headers = 0, max_headers, pos, low, high, i, count, size, err;
+	int *header;
+	char *buffer;
+
+	/*
+	 * A header is followed by at least one entry, with a filename of at
+	 * least one character
+	 */
+	max_headers = bytes / (sizeof(*dirh) + sizeof(*dire) + 1) + 1;
+	header = kmalloc(max_headers * sizeof(int) + bytes, GFP_KERNEL);
+	if (header == NULL)
+		return -ENOMEM;
+	buffer = (char *) &header[max_headers];
+
+	err = squashfs_read_metadata(sb, buffer, &block, &offset, bytes);
+	if (err < 0)
+		goto out;
+
+	err = -EIO;
+	for (pos = 0; pos < bytes; ) {
+		if (bytes - pos < sizeof(*dirh) || headers == max_headers)
+			goto out;
+
+		dirh = (struct squashfs_dir_header *) (buffer + pos);
+		header[headers++] = pos;
+		count = get_unaligned_le32(&dirh->count) + 1;
+		pos += sizeof(*dirh);
+
+		for (i = 0; i < count; i++) {
+			if (bytes - pos < sizeof(*dire))
+				goto out;
+			dire = (struct squashfs_dir_entry *) (buffer + pos);
+			pos += sizeof(*dire) + get_unaligned_le16(&dire->size)
+				+ 1;
+			if (pos > bytes)
+				goto out;
+		}
+	}
+
+	/* Find the last header whose first filename isn't larger */
+	low = 0;
+	high = headers;
+	while (low < high) {
+		int mid = low + (high - low) / 2;
+
+		dire = (struct squashfs_dir_entry *) (buffer + header[mid] +
+			sizeof(*dirh));
+		size = get_unaligned_le16(&dire->size) + 1;
+		if (squashfs_name_cmp(dire->name, size, name, len) > 0)
+			high = mid;
+		else
+			low = mid + 1;
+	}
+
+	err = 0;
+	if (low == 0)
+		goto out;
+
+	pos = header[low - 1];
+	dirh = (struct squashfs_dir_header *) (buffer + pos);
+	count = get_unaligned_le32(&dirh->count) + 1;
+	pos += sizeof(*dirh);
+
+	for (i = 0; i < count; i++) {
+		int res;
+
+		dire = (struct squashfs_dir_entry *) (buffer + pos);
+		size = get_unaligned_le16(&dire->size) + 1;
+		res = squashfs_name_cmp(dire->name, size, name, len);
+		if (res > 0)
+			break;
+		if (res == 0) {
+			*ino = SQUASHFS_MKINODE(
+				get_unaligned_le32(&dirh->start_block),
+				get_unaligned_le16(&dire->offset));
+			*ino_num = get_unaligned_le32(&dirh->inode_number) +
+				(short) get_unaligned_le16(&dire->inode_number);
+			err = 1;
+			break;
+		}
+		pos += sizeof(*dire) + size;
+	}
+
+out:
+	kfree(header);
+	return err;
+}
+
+
 static struct dentry *squashfs_lookup(struct inode *dir, struct dentry *dentry,
 				 struct nameidata *nd)
 {
@@ -141,9 +393,12 @@ static struct dentry *squashfs_lookup(struct inode *dir, struct dentry *dentry,
 	struct squashfs_sb_info *msblk = dir->i_sb->s_fs_info;
 	struct squashfs_dir_header dirh;
 	struct squashfs_dir_entry *dire;
+	struct squashfs_dir_idx_cache *cache;
 	u64 block = squashfs_i(dir)->start + msblk->directory_table;
 	int offset = squashfs_i(dir)->offset;
-	int err, length = 0, dir_count, size;
+	int err, length = 0, dir_count, size, res, end = i_size_read(dir);
+	unsigned int ino_num;
+	long long ino;
 
 	TRACE("Entered squashfs_lookup [%llx:%x]\n", block, offset);
 
@@ -158,12 +413,37 @@ static struct dentry *squashfs_lookup(struct inode *dir, struct dentry *dentry,
 		goto failed;
 	}
 
-	length = get_dir_index_using_name(dir->i_sb, &block, &offset,
+	cache = read_dir_idx_cache(dir);
+	if (cache)
+		length = get_dir_index_using_cache(dir->i_sb, cache, &block,
+				&offset, name, len, &end);
+	else
+		length = get_dir_index_using_name(dir->i_sb, &block, &offset,
 				squashfs_i(dir)->dir_idx_start,
 				squashfs_i(dir)->dir_idx_offset,
-				squashfs_i(dir)->dir_idx_cnt, name, len);
+				squashfs_i(dir)->dir_idx_cnt, name, len, &end);
+
+	if (end < length || end > i_size_read(dir))
+		end = i_size_read(dir);
+
+	/*
+	 * If the index has bounded the name to a small enough range, search
+	 * it in memory, otherwise scan the directory from the index, stopping
+	 * once past the name
+	 */
+	if (end - length <= SQUASHFS_LOOKUP_RANGE_MAX) {
+		err = lookup_range(dir->i_sb, block, offset, end - length,
+				name, len, &ino, &ino_num);
+		if (err == -ENOMEM)
+			goto failed;
+		else if (err < 0)
+			goto read_failure;
+		else if (err)
+			goto found;
+		goto exit_lookup;
+	}
 
-	while (length < i_size_read(dir)) {
+	while (length < end) {
 		/*
 		 * Read directory header.
 		 */
@@ -193,32 +473,32 @@ static struct dentry *squashfs_lookup(struct inode *dir, struct dentry *dentry,
 
 			length += sizeof(*dire) + size;
 
-			if (name[0] < dire->name[0])
+			/* Directories are sorted, so stop once past the name */
+			res = squashfs_name_cmp(dire->name, size, name, len);
+			if (res > 0)
 				goto exit_lookup;
 
-			if (len == size && !strncmp(name, dire->name, len)) {
-				unsigned int blk, off, ino_num;
-				long long ino;
-				blk = le32_to_cpu(dirh.start_block);
-				off = le16_to_cpu(dire->offset);
+			if (res == 0) {
+				ino = SQUASHFS_MKINODE(
+					le32_to_cpu(dirh.start_block),
+					le16_to_cpu(dire->offset));
 				ino_num = le32_to_cpu(dirh.inode_number) +
 					(short) le16_to_cpu(dire->inode_number);
-				ino = SQUASHFS_MKINODE(blk, off);
-
-				TRACE("calling squashfs_iget for directory "
-					"entry %s, inode  %x:%x, %d\n", name,
-					blk, off, ino_num);
-
-				inode = squashfs_iget(dir->i_sb, ino, ino_num);
-				if (IS_ERR(inode)) {
-					err = PTR_ERR(inode);
-					goto failed;
-				}
-
-				goto exit_lookup;
+				goto found;
 			}
 		}
 	}
+	goto exit_lookup;
+
+found:
+	TRACE("calling squashfs_iget for directory entry %s, inode %llx, %d\n",
+		name, ino, ino_num);
+
+	inode = squashfs_iget(dir->i_sb, ino, ino_num);
+	if (IS_ERR(inode)) {
+		err = PTR_ERR(inode);
+		goto failed;
+	}
 
 exit_lookup:
 	kfree(dire);
@@ -35,6 +35,51 @@ static inline struct squashfs_inode_info *squashfs_i(struct inode *inode)
 /* block.c */
 extern int squashfs_read_data(struct super_block *, void **, u64, int, u64 *,
 				int);
+extern void squashfs_read_ahead(struct super_block *, u64, u64);
+extern int squashfs_decomp_init(struct squashfs_sb_info *, int);
+extern void squashfs_decomp_free(struct squashfs_sb_info *);
+
+/* zstd.c */
+struct buffer_head;
+
+#ifdef CONFIG_SQUASHFS_ZSTD
+extern int squashfs_zstd_read_options(struct super_block *);
+extern void squashfs_zstd_free(struct squashfs_sb_info *);
+extern int squashfs_zstd_init(struct squashfs_sb_info *,
+				struct squashfs_stream *);
+extern void squashfs_zstd_free_stream(struct squashfs_stream *);
+extern int squashfs_zstd_uncompress(struct squashfs_sb_info *,
+				struct squashfs_stream *, void **,
+				struct buffer_head **, int, int, int, int,
+				int *);
+#else
+static inline int squashfs_zstd_read_options(struct super_block *sb)
+{
+	return -EINVAL;
+}
+
+static inline void squashfs_zstd_free(struct squashfs_sb_info *msblk)
+{
+}
+
+static inline int squashfs_zstd_init(struct squashfs_sb_info *msblk,
+	struct squashfs_stream *stream)
+{
+	return -EINVAL;
+}
+
+static inline void squashfs_zstd_free_stream(struct squashfs_stream *stream)
+{
+}
+
+static inline int squashfs_zstd_uncompress(struct squashfs_sb_info *msblk,
+	struct squashfs_stream *stream, void **buffer,
+	struct buffer_head **bh, int b, int offset, int length,
+	int srclength, int *k)
+{
+	return -EIO;
+}
+#endif
 
 /* cache.c */
 extern struct squashfs_cache *squashfs_cache_init(char *, int, int);
@@ -50,6 +95,8 @@ extern struct squashfs_cache_entry *squashfs_get_fragment(struct super_block *,
 extern struct squashfs_cache_entry *squashfs_get_datablock(struct super_block *,
 				u64, int);
 extern int squashfs_read_table(struct super_block *, void *, u64, int);
+extern int squashfs_read_lookup_table(struct super_block *, void *, __le64 *,
+				int);
 
 /* export.c */
 extern __le64 *squashfs_read_inode_lookup_table(struct super_block *, u64,
@@ -59,11 +106,14 @@ extern __le64 *squashfs_read_inode_lookup_table(struct super_block *, u64,
 extern int squashfs_frag_lookup(struct super_block *, unsigned int, u64 *);
 extern __le64 *squashfs_read_fragment_index_table(struct super_block *,
 				u64, unsigned int);
+extern struct squashfs_fragment_entry *squashfs_cache_fragment_table(
+				struct super_block *, unsigned int);
 
 /* id.c */
 extern int squashfs_get_id(struct super_block *, unsigned int, unsigned int *);
 extern __le64 *squashfs_read_id_index_table(struct super_block *, u64,
 				unsigned short);
+extern __le32 *squashfs_cache_id_table(struct super_block *, unsigned short);
 
 /* inode.c */
 extern struct inode *squashfs_iget(struct super_block *, long long,
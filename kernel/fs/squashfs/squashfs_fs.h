@@ -57,6 +57,7 @@
 #define SQUASHFS_ALWAYS_FRAG		5
 #define SQUASHFS_DUPLICATE		6
 #define SQUASHFS_EXPORT			7
+#define SQUASHFS_COMP_OPT		10
 
 #define SQUASHFS_BIT(flag, bit)		((flag >> bit) & 1)
 
@@ -81,6 +82,9 @@
 #define SQUASHFS_EXPORTABLE(flags)		SQUASHFS_BIT(flags, \
 						SQUASHFS_EXPORT)
 
+#define SQUASHFS_COMP_OPTS(flags)		SQUASHFS_BIT(flags, \
+						SQUASHFS_COMP_OPT)
+
 /* Max number of types and file types */
 #define SQUASHFS_DIR_TYPE		1
 #define SQUASHFS_REG_TYPE		2
@@ -179,6 +183,12 @@
 /* cached data constants for filesystem */
 #define SQUASHFS_CACHED_BLKS		8
 
+/* maximum number of decompressors (decompressors mount option) */
+#define SQUASHFS_MAX_DECOMPRESSORS	64
+
+/* buffer heads submitted at a time by datablock readahead */
+#define SQUASHFS_READAHEAD_BATCH	32
+
 #define SQUASHFS_MAX_FILE_SIZE_LOG	64
 
 #define SQUASHFS_MAX_FILE_SIZE		(1LL << \
@@ -190,6 +200,13 @@
 #define SQUASHFS_META_INDEXES	(SQUASHFS_METADATA_SIZE / sizeof(unsigned int))
 #define SQUASHFS_META_ENTRIES	127
 #define SQUASHFS_META_SLOTS	8
+#define SQUASHFS_MAX_META_SLOTS	1024
+
+/* directory indexes shorter than this are scanned rather than cached */
+#define SQUASHFS_DIR_IDX_CACHE_MIN	16
+
+/* largest directory range squashfs_lookup() searches in memory */
+#define SQUASHFS_LOOKUP_RANGE_MAX	(SQUASHFS_METADATA_SIZE * 2)
 
 struct meta_entry {
 	u64			data_block;
@@ -205,6 +222,8 @@ struct meta_index {
 	unsigned short		skip;
 	unsigned short		locked;
 	unsigned short		pad;
+	struct hlist_node	hash;
+	struct list_head	lru;
 	struct meta_entry	meta_entry[SQUASHFS_META_ENTRIES];
 };
 
@@ -213,6 +232,18 @@ struct meta_index {
  * definitions for structures on disk
  */
 #define ZLIB_COMPRESSION	 1
+#define ZSTD_COMPRESSION	 6
+
+/*
+ * zstd compression options, stored uncompressed in a metadata block after
+ * the superblock.  Either just the compression level, or this structure
+ * followed by dictionary_size bytes of dictionary
+ */
+struct squashfs_zstd_opts {
+	__le32			compression_level;
+	__le16			window_log;
+	__le16			dictionary_size;
+};
 
 struct squashfs_super_block {
 	__le32			s_magic;
@@ -23,6 +23,21 @@
  * squashfs_fs_i.h
  */
 
+/*
+ * In-memory copy of a directory's index, read by the first lookup in
+ * the directory, and freed with the inode
+ */
+struct squashfs_dir_idx_entry {
+	unsigned int	index;
+	unsigned int	start_block;
+	char		*name;
+};
+
+struct squashfs_dir_idx_cache {
+	int				count;
+	struct squashfs_dir_idx_entry	entry[0];
+};
+
 struct squashfs_inode_info {
 	u64		start;
 	int		offset;
@@ -38,6 +53,7 @@ struct squashfs_inode_info {
 			int		dir_idx_offset;
 			int		dir_idx_cnt;
 			int		parent;
+			struct squashfs_dir_idx_cache	*dir_idx_cache;
 		};
 	};
 	struct inode	vfs_inode;
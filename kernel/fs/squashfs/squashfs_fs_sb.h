@@ -28,14 +28,16 @@
 struct squashfs_cache {
 	char			*name;
 	int			entries;
-	int			next_blk;
+	int			clock_hand;
 	int			num_waiters;
 	int			unused;
 	int			block_size;
 	int			pages;
+	int			hash_bits;
 	spinlock_t		lock;
 	wait_queue_head_t	wait_queue;
 	struct squashfs_cache_entry *entry;
+	struct hlist_head	*hash;
 };
 
 struct squashfs_cache_entry {
@@ -46,25 +48,48 @@ struct squashfs_cache_entry {
 	int			pending;
 	int			error;
 	int			num_waiters;
+	int			referenced;
 	wait_queue_head_t	wait_queue;
+	struct hlist_node	hash_node;
 	struct squashfs_cache	*cache;
 	void			**data;
 };
 
+struct squashfs_stream {
+	z_stream		stream;
+	void			*zstd_workspace;
+	void			*zstd;
+	struct list_head	list;
+};
+
 struct squashfs_sb_info {
 	int			devblksize;
 	int			devblksize_log2;
 	struct squashfs_cache	*block_cache;
 	struct squashfs_cache	*fragment_cache;
 	struct squashfs_cache	*read_page;
-	int			next_meta_index;
 	__le64			*id_table;
 	__le64			*fragment_index;
+	__le32			*ids;
+	unsigned int		no_ids;
+	struct squashfs_fragment_entry	*fragments;
+	unsigned int		no_fragments;
 	unsigned int		*fragment_index_2;
-	struct mutex		read_data_mutex;
+	spinlock_t		decomp_lock;
+	wait_queue_head_t	decomp_wait;
+	struct list_head	decomp_free;
+	struct squashfs_stream	*decomp;
+	int			decompressors;
+	unsigned short		compression;
+	void			*zstd_dict;
+	void			*zstd_ddict_workspace;
+	void			*zstd_ddict;
 	struct mutex		meta_index_mutex;
 	struct meta_index	*meta_index;
-	z_stream		stream;
+	int			meta_slots;
+	int			meta_hash_bits;
+	struct hlist_head	*meta_hash;
+	struct list_head	meta_lru;
 	__le64			*inode_lookup_table;
 	u64			inode_table;
 	u64			directory_table;
@@ -34,7 +34,9 @@
 #include <linux/pagemap.h>
 #include <linux/init.h>
 #include <linux/module.h>
+#include <linux/vmalloc.h>
 #include <linux/zlib.h>
+#include <linux/parser.h>
 
 #include "squashfs_fs.h"
 #include "squashfs_fs_sb.h"
@@ -57,8 +59,82 @@ static int supported_squashfs_filesystem(short major, short minor, short comp)
 		return -EINVAL;
 	}
 
-	if (comp != ZLIB_COMPRESSION)
-		return -EINVAL;
+	if (comp == ZLIB_COMPRESSION)
+		return 0;
+
+#ifdef CONFIG_SQUASHFS_ZSTD
+	if (comp == ZSTD_COMPRESSION)
+		return 0;
+#endif
+
+	ERROR("Filesystem uses unsupported compression type %d\n", comp);
+	return -EINVAL;
+}
+
+
+enum {
+	Opt_decompressors, Opt_meta_slots, Opt_cache_tables, Opt_err
+};
+
+static const match_table_t tokens = {
+	{Opt_decompressors, "decompressors=%u"},
+	{Opt_meta_slots, "meta_slots=%u"},
+	{Opt_cache_tables, "cache_tables"},
+	{Opt_err, NULL}
+};
+
+
+/*
+ * Parse the mount options.  decompressors=N sets the number of blocks which
+ * can be decompressed in parallel (default 1), meta_slots=N the number
+ * of large file block list index cache slots (default 8), and cache_tables
+ * reads the whole id and fragment lookup tables into memory.
+ */
+static int squashfs_parse_options(char *options, int *decompressors,
+	int *meta_slots, int *cache_tables)
+{
+	substring_t args[MAX_OPT_ARGS];
+	char *p;
+	int option;
+
+	*decompressors = 1;
+	*meta_slots = SQUASHFS_META_SLOTS;
+	*cache_tables = 0;
+
+	if (options == NULL)
+		return 0;
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (*p == '\0')
+			continue;
+
+		switch (match_token(p, tokens, args)) {
+		case Opt_decompressors:
+			if (match_int(&args[0], &option) || option < 1 ||
+					option > SQUASHFS_MAX_DECOMPRESSORS) {
+				ERROR("decompressors should be 1 .. %d\n",
+					SQUASHFS_MAX_DECOMPRESSORS);
+				return -EINVAL;
+			}
+			*decompressors = option;
+			break;
+		case Opt_meta_slots:
+			if (match_int(&args[0], &option) || option < 1 ||
+					option > SQUASHFS_MAX_META_SLOTS) {
+				ERROR("meta_slots should be 1 .. %d\n",
+					SQUASHFS_MAX_META_SLOTS);
+				return -EINVAL;
+			}
+			*meta_slots = option;
+			break;
+		case Opt_cache_tables:
+			*cache_tables = 1;
+			break;
+		default:
+			ERROR("Unrecognised mount option \"%s\"\n", p);
+			return -EINVAL;
+		}
+	}
 
 	return 0;
 }
@@ -74,7 +150,7 @@ static int squashfs_fill_super(struct super_block *sb, void *data, int silent)
 	unsigned short flags;
 	unsigned int fragments;
 	u64 lookup_table_start;
-	int err;
+	int err, decompressors, cache_tables;
 
 	TRACE("Entered squashfs_fill_superblock\n");
 
@@ -85,11 +161,12 @@ static int squashfs_fill_super(struct super_block *sb, void *data, int silent)
 	}
 	msblk = sb->s_fs_info;
 
-	msblk->stream.workspace = kmalloc(zlib_inflate_workspacesize(),
-		GFP_KERNEL);
-	if (msblk->stream.workspace == NULL) {
-		ERROR("Failed to allocate zlib workspace\n");
-		goto failure;
+	err = squashfs_parse_options(data, &decompressors,
+		&msblk->meta_slots, &cache_tables);
+	if (err) {
+		kfree(sb->s_fs_info);
+		sb->s_fs_info = NULL;
+		return err;
 	}
 
 	sblk = kzalloc(sizeof(*sblk), GFP_KERNEL);
@@ -101,8 +178,8 @@ static int squashfs_fill_super(struct super_block *sb, void *data, int silent)
 	msblk->devblksize = sb_min_blocksize(sb, BLOCK_SIZE);
 	msblk->devblksize_log2 = ffz(~msblk->devblksize);
 
-	mutex_init(&msblk->read_data_mutex);
 	mutex_init(&msblk->meta_index_mutex);
+	INIT_LIST_HEAD(&msblk->meta_lru);
 
 	/*
 	 * msblk->bytes_used is checked in squashfs_read_table to ensure reads
@@ -170,6 +247,30 @@ static int squashfs_fill_super(struct super_block *sb, void *data, int silent)
 	msblk->inodes = le32_to_cpu(sblk->inodes);
 	flags = le16_to_cpu(sblk->flags);
 
+	/*
+	 * The decompressors are allocated once the compression type is
+	 * known.  Zstd compression options may hold a dictionary, in which
+	 * case they are allocated again to use it
+	 */
+	msblk->compression = le16_to_cpu(sblk->compression);
+	err = squashfs_decomp_init(msblk, decompressors);
+	if (err)
+		goto failed_mount;
+
+	if (msblk->compression == ZSTD_COMPRESSION &&
+			SQUASHFS_COMP_OPTS(flags)) {
+		err = squashfs_zstd_read_options(sb);
+		if (err)
+			goto failed_mount;
+
+		if (msblk->zstd_ddict) {
+			squashfs_decomp_free(msblk);
+			err = squashfs_decomp_init(msblk, decompressors);
+			if (err)
+				goto failed_mount;
+		}
+	}
+
 	TRACE("Found valid superblock on %s\n", bdevname(sb->s_bdev, b));
 	TRACE("Inodes are %scompressed\n", SQUASHFS_UNCOMPRESSED_INODES(flags)
 				? "un" : "");
@@ -198,8 +299,12 @@ static int squashfs_fill_super(struct super_block *sb, void *data, int silent)
 	if (msblk->block_cache == NULL)
 		goto failed_mount;
 
-	/* Allocate read_page block */
-	msblk->read_page = squashfs_cache_init("data", 1, msblk->block_size);
+	/*
+	 * Allocate read_page blocks, one per decompressor so reads of
+	 * different datablocks don't wait for each other
+	 */
+	msblk->read_page = squashfs_cache_init("data", msblk->decompressors,
+		msblk->block_size);
 	if (msblk->read_page == NULL) {
 		ERROR("Failed to allocate read_page block\n");
 		goto failed_mount;
@@ -214,6 +319,17 @@ static int squashfs_fill_super(struct super_block *sb, void *data, int silent)
 		goto failed_mount;
 	}
 
+	/* Read the whole id table, if it's to be kept in memory */
+	msblk->no_ids = le16_to_cpu(sblk->no_ids);
+	if (cache_tables && msblk->no_ids) {
+		msblk->ids = squashfs_cache_id_table(sb, msblk->no_ids);
+		if (IS_ERR(msblk->ids)) {
+			err = PTR_ERR(msblk->ids);
+			msblk->ids = NULL;
+			goto failed_mount;
+		}
+	}
+
 	fragments = le32_to_cpu(sblk->fragments);
 	if (fragments == 0)
 		goto allocate_lookup_table;
@@ -234,6 +350,17 @@ static int squashfs_fill_super(struct super_block *sb, void *data, int silent)
 		goto failed_mount;
 	}
 
+	/* Read the whole fragment table, if it's to be kept in memory */
+	msblk->no_fragments = fragments;
+	if (cache_tables) {
+		msblk->fragments = squashfs_cache_fragment_table(sb, fragments);
+		if (IS_ERR(msblk->fragments)) {
+			err = PTR_ERR(msblk->fragments);
+			msblk->fragments = NULL;
+			goto failed_mount;
+		}
+	}
+
 allocate_lookup_table:
 	lookup_table_start = le64_to_cpu(sblk->lookup_table_start);
 	if (lookup_table_start == SQUASHFS_INVALID_BLK)
@@ -281,16 +408,18 @@ failed_mount:
 	squashfs_cache_delete(msblk->fragment_cache);
 	squashfs_cache_delete(msblk->read_page);
 	kfree(msblk->inode_lookup_table);
+	vfree(msblk->fragments);
 	kfree(msblk->fragment_index);
+	vfree(msblk->ids);
 	kfree(msblk->id_table);
-	kfree(msblk->stream.workspace);
+	squashfs_decomp_free(msblk);
+	squashfs_zstd_free(msblk);
 	kfree(sb->s_fs_info);
 	sb->s_fs_info = NULL;
 	kfree(sblk);
 	return err;
 
 failure:
-	kfree(msblk->stream.workspace);
 	kfree(sb->s_fs_info);
 	sb->s_fs_info = NULL;
 	return -ENOMEM;
@@ -331,8 +460,12 @@ static void squashfs_put_super(struct super_block *sb)
 		squashfs_cache_delete(sbi->read_page);
 		kfree(sbi->id_table);
 		kfree(sbi->fragment_index);
+		vfree(sbi->ids);
+		vfree(sbi->fragments);
 		kfree(sbi->meta_index);
-		kfree(sbi->stream.workspace);
+		kfree(sbi->meta_hash);
+		squashfs_decomp_free(sbi);
+		squashfs_zstd_free(sbi);
 		kfree(sb->s_fs_info);
 		sb->s_fs_info = NULL;
 	}
@@ -413,6 +546,8 @@ static struct inode *squashfs_alloc_inode(struct super_block *sb)
 
 static void squashfs_destroy_inode(struct inode *inode)
 {
+	if (S_ISDIR(inode->i_mode))
+		kfree(squashfs_i(inode)->dir_idx_cache);
 	kmem_cache_free(squashfs_inode_cachep, squashfs_i(inode));
 }
 
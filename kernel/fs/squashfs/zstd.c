@@ -0,0 +1,260 @@
+/*
+ * Squashfs - a compressed read only filesystem for Linux
+ *
+ * Copyright (c) 2014
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * zstd.c
+ */
+
+/*
+ * This file implements zstd decompression of datablocks and metadata
+ * blocks (compression type 6, as written by mksquashfs -comp zstd).  It
+ * uses the kernel zstd library (lib/zstd, CONFIG_ZSTD_DECOMPRESS), which
+ * mainline added in 4.14, with this interface until 5.15.  That is much
+ * newer than the rest of this tree, and so it is only built with
+ * CONFIG_SQUASHFS_ZSTD, on kernels which have (or have backported) it.
+ */
+
+#include <linux/fs.h>
+#include <linux/vfs.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/list.h>
+#include <linux/buffer_head.h>
+#include <linux/zlib.h>
+#include <linux/zstd.h>
+
+#include "squashfs_fs.h"
+#include "squashfs_fs_sb.h"
+#include "squashfs_fs_i.h"
+#include "squashfs.h"
+
+/*
+ * Blocks are compressed one at a time, and so zstd never uses a window
+ * larger than the block (mksquashfs -Xwindow-log is limited to the block
+ * size too)
+ */
+static size_t zstd_window(struct squashfs_sb_info *msblk)
+{
+	return max_t(size_t, msblk->block_size, SQUASHFS_METADATA_SIZE);
+}
+
+
+/*
+ * Read the compression options, if any.  Only the window log and the
+ * dictionary matter to decompression.  A dictionary is kept for the life
+ * of the mount, because the digested dictionary refers to it.  The streams
+ * must already be allocated, in case the options block is compressed, and
+ * are reallocated by the caller to use the dictionary.
+ */
+int squashfs_zstd_read_options(struct super_block *sb)
+{
+	struct squashfs_sb_info *msblk = sb->s_fs_info;
+	void *buffer[(SQUASHFS_METADATA_SIZE + PAGE_CACHE_SIZE - 1) /
+		PAGE_CACHE_SIZE];
+	struct squashfs_zstd_opts *opts;
+	int i, length, window_log, dictionary_size, err = -EINVAL;
+	char *data;
+	size_t size;
+
+	data = kmalloc(SQUASHFS_METADATA_SIZE, GFP_KERNEL);
+	if (data == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < ARRAY_SIZE(buffer); i++)
+		buffer[i] = data + i * PAGE_CACHE_SIZE;
+
+	length = squashfs_read_data(sb, buffer, SQUASHFS_START +
+		sizeof(struct squashfs_super_block), 0, NULL,
+		SQUASHFS_METADATA_SIZE);
+	if (length < 0) {
+		err = length;
+		goto failed;
+	}
+
+	/* only the compression level */
+	if (length == sizeof(opts->compression_level))
+		goto done;
+
+	opts = (struct squashfs_zstd_opts *) data;
+	if (length < sizeof(*opts))
+		goto bad_options;
+
+	window_log = le16_to_cpu(opts->window_log);
+	dictionary_size = le16_to_cpu(opts->dictionary_size);
+	if (length != sizeof(*opts) + dictionary_size ||
+			window_log > SQUASHFS_FILE_MAX_LOG || (window_log &&
+			(1 << window_log) > zstd_window(msblk)))
+		goto bad_options;
+
+	if (dictionary_size == 0)
+		goto done;
+
+	memmove(data, data + sizeof(*opts), dictionary_size);
+
+	size = ZSTD_DDictWorkspaceBound();
+	msblk->zstd_ddict_workspace = vmalloc(size);
+	if (msblk->zstd_ddict_workspace == NULL) {
+		err = -ENOMEM;
+		goto failed;
+	}
+
+	msblk->zstd_ddict = ZSTD_initDDict(data, dictionary_size,
+		msblk->zstd_ddict_workspace, size);
+	if (msblk->zstd_ddict == NULL) {
+		ERROR("zstd dictionary in compression options is corrupt\n");
+		vfree(msblk->zstd_ddict_workspace);
+		msblk->zstd_ddict_workspace = NULL;
+		goto failed;
+	}
+
+	msblk->zstd_dict = data;
+	return 0;
+
+done:
+	kfree(data);
+	return 0;
+
+bad_options:
+	ERROR("zstd compression options are corrupt\n");
+
+failed:
+	kfree(data);
+	return err;
+}
+
+
+void squashfs_zstd_free(struct squashfs_sb_info *msblk)
+{
+	vfree(msblk->zstd_ddict_workspace);
+	kfree(msblk->zstd_dict);
+	msblk->zstd_ddict_workspace = msblk->zstd_ddict = NULL;
+	msblk->zstd_dict = NULL;
+}
+
+
+int squashfs_zstd_init(struct squashfs_sb_info *msblk,
+	struct squashfs_stream *stream)
+{
+	size_t window = zstd_window(msblk);
+	size_t size = ZSTD_DStreamWorkspaceBound(window);
+
+	stream->zstd_workspace = vmalloc(size);
+	if (stream->zstd_workspace == NULL)
+		return -ENOMEM;
+
+	if (msblk->zstd_ddict)
+		stream->zstd = ZSTD_initDStream_usingDDict(window,
+			msblk->zstd_ddict, stream->zstd_workspace, size);
+	else
+		stream->zstd = ZSTD_initDStream(window,
+			stream->zstd_workspace, size);
+
+	if (stream->zstd == NULL) {
+		vfree(stream->zstd_workspace);
+		stream->zstd_workspace = NULL;
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+
+void squashfs_zstd_free_stream(struct squashfs_stream *stream)
+{
+	vfree(stream->zstd_workspace);
+	stream->zstd_workspace = stream->zstd = NULL;
+}
+
+
+/*
+ * Decompress length bytes starting at offset in the first of the b buffer
+ * heads (in the same way as the zlib code in squashfs_read_data), into the
+ * pages of buffer, no more than srclength bytes.  *k is the next buffer head
+ * to be released, those before it have been.  Returns the decompressed
+ * length, or -EIO.
+ */
+int squashfs_zstd_uncompress(struct squashfs_sb_info *msblk,
+	struct squashfs_stream *stream, void **buffer,
+	struct buffer_head **bh, int b, int offset, int length,
+	int srclength, int *k)
+{
+	ZSTD_DStream *zstd = stream->zstd;
+	ZSTD_inBuffer in = { NULL, 0, 0 };
+	ZSTD_outBuffer out = { NULL, 0, 0 };
+	int avail, page = 0, total = 0;
+	int pages = (srclength + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
+	size_t res = ZSTD_resetDStream(zstd);
+
+	if (ZSTD_isError(res))
+		goto failed;
+
+	do {
+		if (in.pos == in.size && *k < b) {
+			avail = min(length, msblk->devblksize - offset);
+			length -= avail;
+			wait_on_buffer(bh[*k]);
+			if (!buffer_uptodate(bh[*k]))
+				return -EIO;
+
+			if (avail == 0) {
+				offset = 0;
+				put_bh(bh[(*k)++]);
+				continue;
+			}
+
+			in.src = bh[*k]->b_data + offset;
+			in.size = avail;
+			in.pos = 0;
+			offset = 0;
+		}
+
+		if (out.pos == out.size) {
+			if (page == pages) {
+				ERROR("zstd block decompresses to more than "
+					"%d bytes\n", srclength);
+				return -EIO;
+			}
+			total += out.pos;
+			out.dst = buffer[page++];
+			out.size = PAGE_CACHE_SIZE;
+			out.pos = 0;
+		}
+
+		res = ZSTD_decompressStream(zstd, &out, &in);
+
+		if (in.pos == in.size && *k < b)
+			put_bh(bh[(*k)++]);
+		else if (in.pos == in.size && out.pos < out.size &&
+				res != 0 && !ZSTD_isError(res)) {
+			/* wants more input, and there is none */
+			ERROR("zstd block is truncated\n");
+			return -EIO;
+		}
+	} while (res != 0 && !ZSTD_isError(res));
+
+	if (ZSTD_isError(res))
+		goto failed;
+
+	return total + out.pos;
+
+failed:
+	ERROR("zstd decompression failed, error %d, data probably corrupt\n",
+		(int) ZSTD_getErrorCode(res));
+	return -EIO;
+}
@@ -12,7 +12,9 @@ LOCAL_MODULE := mksquashfs
 
 mksquashfs_files := mksquashfs.c squashfs_fs.h squashfs_swap.h mksquashfs.h \
                     sort.h pseudo.h compressor.h xattr.h action.h error.h progressbar.h \
-                    info.h caches-queues-lists.h read_fs.h restore.h process_fragments.h
+                    info.h caches-queues-lists.h read_fs.h restore.h process_fragments.h \
+                    process_duplicates.h hash.h arena.h dedup_index.h numa.h \
+                    stats.h archive.h verity.h pool.h remote.h
 
 read_fs_files := read_fs.c squashfs_fs.h squashfs_swap.h compressor.h xattr.h \
                  error.h mksquashfs.h
@@ -21,32 +23,73 @@ sort_files := sort.c squashfs_fs.h mksquashfs.h sort.h error.h progressbar.h
 
 swap_files := swap.c
 
-pseudo_files := pseudo.c pseudo.h error.h progressbar.h
+pseudo_files := pseudo.c pseudo.h error.h progressbar.h hash.h
 
 compressor_files := compressor.c compressor.h squashfs_fs.h
 
 xattr_files := xattr.c squashfs_fs.h squashfs_swap.h mksquashfs.h xattr.h error.h \
-               progressbar.h
+               progressbar.h hash.h
 
 read_xattrs_files := read_xattrs.c squashfs_fs.h squashfs_swap.h xattr.h error.h
 
-action_files := action.c squashfs_fs.h mksquashfs.h action.h error.h
+action_files := action.c squashfs_fs.h mksquashfs.h action.h filetype.h error.h
+
+filetype_files := filetype.c squashfs_fs.h mksquashfs.h filetype.h error.h
 
 progressbar_files := progressbar.c error.h
 
 read_file_files := read_file.c error.h
 
 info_files := info.c squashfs_fs.h mksquashfs.h error.h progressbar.h \
-              caches-queues-lists.h
+              caches-queues-lists.h numa.h
 
 restore_files := restore.c caches-queues-lists.h squashfs_fs.h mksquashfs.h error.h \
-                 progressbar.h info.h
+                 progressbar.h info.h numa.h
+
+process_fragments_files := process_fragments.c process_fragments.h hash.h numa.h \
+                           stats.h
+
+process_duplicates_files := process_duplicates.c process_duplicates.h \
+                            process_fragments.h caches-queues-lists.h mksquashfs.h \
+                            error.h hash.h compressor.h stats.h
+
+caches_queues_lists_files := caches-queues-lists.c error.h caches-queues-lists.h \
+                             queue.h numa.h stats.h pool.h
+
+queue_files := queue.c error.h queue.h
+
+hash_files := hash.c hash.h
+
+arena_files := arena.c error.h arena.h
+
+spill_files := spill.c squashfs_fs.h mksquashfs.h arena.h xattr.h spill.h error.h
+
+deadline_files := deadline.c caches-queues-lists.h queue.h compressor.h stats.h \
+                  deadline.h error.h
+
+probe_files := probe.c squashfs_fs.h mksquashfs.h caches-queues-lists.h queue.h \
+               compressor.h stats.h probe.h error.h
+
+pool_files := pool.c pool.h queue.h
+
+remote_files := remote.c squashfs_fs.h mksquashfs.h compressor.h queue.h remote.h \
+                error.h
+
+dedup_index_files := dedup_index.c squashfs_fs.h mksquashfs.h process_fragments.h \
+                     dedup_index.h error.h
+
+numa_files := numa.c numa.h error.h
+
+stats_files := stats.c caches-queues-lists.h queue.h stats.h error.h
+
+archive_files := archive.c squashfs_fs.h xattr.h archive.h error.h progressbar.h
 
-process_fragments_files := process_fragments.c process_fragments.h
+sha256_files := sha256.c sha256.h
 
-caches_queues_lists_files := caches-queues-lists.c error.h caches-queues-lists.h
+verity_files := verity.c squashfs_fs.h sha256.h verity.h error.h
 
-gzip_wrapper_files := gzip_wrapper.c squashfs_fs.h gzip_wrapper.h compressor.h
+gzip_wrapper_files := gzip_wrapper.c squashfs_fs.h gzip_wrapper.h gzip_offload.h \
+                      compressor.h
 
 android_files := android.c android.h
 
@@ -55,7 +98,14 @@ lz4_wrapper_files := lz4_wrapper.c squashfs_fs.h lz4_wrapper.h compressor.h
 LOCAL_SRC_FILES := $(mksquashfs_files) $(read_fs_files) $(action_files) $(swap_files) \
                    $(pseudo_files) $(compressor_files) $(sort_files) $(progressbar_files) \
                    $(read_file_files) $(info_files) $(restore_files) \
-                   $(process_fragments_files) $(caches_queues_lists_files) $(xattr_files) \
+                   $(process_fragments_files) $(process_duplicates_files) \
+                   $(caches_queues_lists_files) $(queue_files) $(hash_files) \
+                   $(arena_files) $(spill_files) $(deadline_files) $(probe_files) \
+                   $(dedup_index_files) $(numa_files) \
+                   $(stats_files) $(filetype_files) $(archive_files) \
+                   $(sha256_files) $(verity_files) $(pool_files) \
+                   $(remote_files) \
+                   $(xattr_files) \
                    $(read_xattrs_files) $(gzip_wrapper_files) $(android_files) \
                    $(lz4_wrapper_files)
 
@@ -42,6 +42,7 @@
 #include "squashfs_fs.h"
 #include "mksquashfs.h"
 #include "action.h"
+#include "filetype.h"
 #include "error.h"
 
 /*
@@ -65,6 +66,15 @@ static struct action_entry *parsing_action;
 
 static struct file_buffer *def_fragment = NULL;
 
+/* patterns used by the name, pathname and subpathname tests */
+static struct glob **glob_table = NULL;
+static int glob_count = 0;
+
+/* glob match results for the file each thread is evaluating */
+static __thread struct glob_memo *glob_memo = NULL;
+static __thread int glob_memo_size = 0;
+static __thread int action_generation = 0;
+
 static struct token_entry token_table[] = {
 	{ "(", TOK_OPEN_BRACKET, 1, },
 	{ ")", TOK_CLOSE_BRACKET, 1 },
@@ -210,6 +220,7 @@ static void free_parse_tree(struct expr *expr)
 			free(expr->atom.argv[i]);
 
 		free(expr->atom.argv);
+		free(expr->atom.program);
 	} else if (expr->type == UNARY_TYPE)
 		free_parse_tree(expr->unary_op.expr);
 	else {
@@ -262,6 +273,78 @@ static struct expr *create_unary_op(struct expr *lhs, int op)
 }
 
 
+/*
+ * Expression compiler
+ */
+static int program_size(struct expr *expr)
+{
+	switch (expr->type) {
+	case ATOM_TYPE:
+		return 1;
+	case UNARY_TYPE:
+		return program_size(expr->unary_op.expr) + 1;
+	default:
+		return program_size(expr->expr_op.lhs) + 1 +
+			program_size(expr->expr_op.rhs);
+	}
+}
+
+
+static int emit_program(struct expr *expr, struct instruction *program,
+	int pc)
+{
+	int jump;
+
+	switch (expr->type) {
+	case ATOM_TYPE:
+		program[pc].op = PROG_TEST;
+		program[pc].atom = &expr->atom;
+		return pc + 1;
+	case UNARY_TYPE:
+		pc = emit_program(expr->unary_op.expr, program, pc);
+		program[pc].op = PROG_NOT;
+		return pc + 1;
+	default:
+		/*
+		 * lhs && rhs skips rhs if lhs is false, and lhs || rhs skips
+		 * rhs if lhs is true, leaving the result of lhs as the result
+		 */
+		jump = emit_program(expr->expr_op.lhs, program, pc);
+		program[jump].op = expr->expr_op.op == TOK_AND ?
+			PROG_JUMP_FALSE : PROG_JUMP_TRUE;
+		pc = emit_program(expr->expr_op.rhs, program, jump + 1);
+		program[jump].target = pc;
+		return pc;
+	}
+}
+
+
+static struct instruction *compile_expr(struct expr *expr)
+{
+	int i, size = program_size(expr) + 1;
+	struct instruction *program = malloc(size * sizeof(*program));
+
+	if (program == NULL)
+		MEM_ERROR();
+
+	program[emit_program(expr, program, 0)].op = PROG_END;
+
+	/*
+	 * A jump to a jump on the same condition will take that jump too,
+	 * so jump straight to its target.  This makes chains like
+	 * a && b && c skip to the end at the first false test
+	 */
+	for (i = 0; i < size; i++)
+		if (program[i].op == PROG_JUMP_FALSE ||
+					program[i].op == PROG_JUMP_TRUE)
+			while (program[program[i].target].op == program[i].op)
+				program[i].target =
+					program[program[i].target].target;
+
+	return program;
+}
+
+
 static struct expr *parse_test(char *name)
 {
 	char *string, **argv = NULL;
@@ -297,6 +380,7 @@ static struct expr *parse_test(char *name)
 
 	expr->atom.test = test;
 	expr->atom.data = NULL;
+	expr->atom.program = NULL;
 
 	/*
 	 * If the test has no arguments, then go straight to checking if there's
@@ -586,6 +670,7 @@ skip_args:
 	(*spec_list)[spec_count].args = args;
 	(*spec_list)[spec_count].argv = argv;
 	(*spec_list)[spec_count].expr = expr;
+	(*spec_list)[spec_count].program = compile_expr(expr);
 	(*spec_list)[spec_count].data = data;
 	(*spec_list)[spec_count].verbose = verbose;
 
@@ -693,6 +778,55 @@ void expr_log_match(int match)
 }
 
 
+/*
+ * The pathname and subpathname of the file are only made if a test uses
+ * them
+ */
+static char *action_pathname(struct action_data *action_data)
+{
+	if (action_data->pathname == NULL) {
+		action_data->pathname = strdup(pathname(action_data->dir_ent));
+		if (action_data->pathname == NULL)
+			MEM_ERROR();
+	}
+
+	return action_data->pathname;
+}
+
+
+static char *action_subpath(struct action_data *action_data)
+{
+	if (action_data->subpath == NULL) {
+		action_data->subpath = strdup(subpathname(action_data->dir_ent));
+		if (action_data->subpath == NULL)
+			MEM_ERROR();
+	}
+
+	return action_data->subpath;
+}
+
+
+static void init_action_data(struct action_data *action_data,
+	struct dir_info *root, struct dir_ent *dir_ent)
+{
+	action_data->name = dir_ent->name;
+	action_data->pathname = NULL;
+	action_data->subpath = NULL;
+	action_data->buf = &dir_ent->inode->buf;
+	action_data->depth = dir_ent->our_dir->depth;
+	action_data->dir_ent = dir_ent;
+	action_data->root = root;
+	action_data->generation = ++ action_generation;
+}
+
+
+static void free_action_data(struct action_data *action_data)
+{
+	free(action_data->pathname);
+	free(action_data->subpath);
+}
+
+
 static int eval_expr_log(struct expr *expr, struct action_data *action_data)
 {
 	int match;
@@ -724,27 +858,32 @@ static int eval_expr_log(struct expr *expr, struct action_data *action_data)
 }
 
 
-static int eval_expr(struct expr *expr, struct action_data *action_data)
+static int eval_program(struct instruction *program,
+	struct action_data *action_data)
 {
-	int match;
+	int pc = 0, match = 0;
 
-	switch (expr->type) {
-	case ATOM_TYPE:
-		match = expr->atom.test->fn(&expr->atom, action_data);
-		break;
-	case UNARY_TYPE:
-		match = !eval_expr(expr->unary_op.expr, action_data);
-		break;
-	default:
-		match = eval_expr(expr->expr_op.lhs, action_data);
-
-		if ((expr->expr_op.op == TOK_AND && match) ||
-					(expr->expr_op.op == TOK_OR && !match))
-			match = eval_expr(expr->expr_op.rhs, action_data);
-		break;
+	while (1) {
+		switch (program[pc].op) {
+		case PROG_TEST:
+			match = program[pc].atom->test->fn(program[pc].atom,
+				action_data);
+			pc ++;
+			break;
+		case PROG_NOT:
+			match = !match;
+			pc ++;
+			break;
+		case PROG_JUMP_FALSE:
+			pc = match ? pc + 1 : program[pc].target;
+			break;
+		case PROG_JUMP_TRUE:
+			pc = match ? program[pc].target : pc + 1;
+			break;
+		default:
+			return match;
+		}
 	}
-
-	return match;
 }
 
 
@@ -755,8 +894,7 @@ static int eval_expr_top(struct action *action, struct action_data *action_data)
 
 		expr_log_cmnd(LOG_ENABLE);
 
-		if(action_data->subpath)
-			expr_log(action_data->subpath);
+		expr_log(action_subpath(action_data));
 
 		expr_log("=");
 		expr_log(action->action->name);
@@ -787,7 +925,7 @@ static int eval_expr_top(struct action *action, struct action_data *action_data)
 
 		return match;
 	} else
-		return eval_expr(action->expr, action_data);
+		return eval_program(action->program, action_data);
 }
 
 
@@ -879,13 +1017,7 @@ void eval_actions(struct dir_info *root, struct dir_ent *dir_ent)
 	struct action_data action_data;
 	int st_mode = dir_ent->inode->buf.st_mode;
 
-	action_data.name = dir_ent->name;
-	action_data.pathname = strdup(pathname(dir_ent));
-	action_data.subpath = strdup(subpathname(dir_ent));
-	action_data.buf = &dir_ent->inode->buf;
-	action_data.depth = dir_ent->our_dir->depth;
-	action_data.dir_ent = dir_ent;
-	action_data.root = root;
+	init_action_data(&action_data, root, dir_ent);
 
 	for (i = 0; i < other_count; i++) {
 		struct action *action = &other_spec[i];
@@ -900,8 +1032,7 @@ void eval_actions(struct dir_info *root, struct dir_ent *dir_ent)
 			action->action->run_action(action, dir_ent);
 	}
 
-	free(action_data.pathname);
-	free(action_data.subpath);
+	free_action_data(&action_data);
 }
 
 
@@ -913,25 +1044,17 @@ void *eval_frag_actions(struct dir_info *root, struct dir_ent *dir_ent)
 	int i, match;
 	struct action_data action_data;
 
-	action_data.name = dir_ent->name;
-	action_data.pathname = strdup(pathname(dir_ent));
-	action_data.subpath = strdup(subpathname(dir_ent));
-	action_data.buf = &dir_ent->inode->buf;
-	action_data.depth = dir_ent->our_dir->depth;
-	action_data.dir_ent = dir_ent;
-	action_data.root = root;
+	init_action_data(&action_data, root, dir_ent);
 
 	for (i = 0; i < fragment_count; i++) {
 		match = eval_expr_top(&fragment_spec[i], &action_data);
 		if (match) {
-			free(action_data.pathname);
-			free(action_data.subpath);
+			free_action_data(&action_data);
 			return &fragment_spec[i].data;
 		}
 	}
 
-	free(action_data.pathname);
-	free(action_data.subpath);
+	free_action_data(&action_data);
 	return &def_fragment;
 }
 
@@ -973,13 +1096,17 @@ int eval_exclude_actions(char *name, char *pathname, char *subpath,
 {
 	int i, match = 0;
 	struct action_data action_data;
+	struct inode_stat ibuf;
+
+	copy_inode_stat(&ibuf, buf);
 
 	action_data.name = name;
 	action_data.pathname = pathname;
 	action_data.subpath = subpath;
-	action_data.buf = buf;
+	action_data.buf = &ibuf;
 	action_data.depth = depth;
 	action_data.dir_ent = dir_ent;
+	action_data.generation = ++ action_generation;
 
 	for (i = 0; i < exclude_count && !match; i++)
 		match = eval_expr_top(&exclude_spec[i], &action_data);
@@ -1516,13 +1643,7 @@ int eval_empty_actions(struct dir_info *root, struct dir_ent *dir_ent)
 	if (dir->count != 0)
 		return 0;
 
-	action_data.name = dir_ent->name;
-	action_data.pathname = strdup(pathname(dir_ent));
-	action_data.subpath = strdup(subpathname(dir_ent));
-	action_data.buf = &dir_ent->inode->buf;
-	action_data.depth = dir_ent->our_dir->depth;
-	action_data.dir_ent = dir_ent;
-	action_data.root = root;
+	init_action_data(&action_data, root, dir_ent);
 
 	for (i = 0; i < empty_count && !match; i++) {
 		data = empty_spec[i].data;
@@ -1548,8 +1669,7 @@ int eval_empty_actions(struct dir_info *root, struct dir_ent *dir_ent)
 		match = eval_expr_top(&empty_spec[i], &action_data);
 	}
 
-	free(action_data.pathname);
-	free(action_data.subpath);
+	free_action_data(&action_data);
 
 	return match;
 }
@@ -1685,11 +1805,11 @@ void eval_move(struct action_data *action_data, struct move_ent *move,
 			if (comp_ent == NULL)
 				ERROR("Move action: cannot move %s to %s, no "
 					"such directory %s\n",
-					action_data->subpath, path, comp);
+					action_subpath(action_data), path, comp);
 			else
 				ERROR("Move action: cannot move %s to %s, %s "
 					"is not a directory\n",
-					action_data->subpath, path, comp);
+					action_subpath(action_data), path, comp);
 			free(comp);
 			return;
 		}
@@ -1705,7 +1825,8 @@ void eval_move(struct action_data *action_data, struct move_ent *move,
 				ERROR("Move action: Cannot move %s to %s, "
 					"conflicting move, already moving "
 					"to %s via another move action!\n",
-					action_data->subpath, path, conf_path);
+					action_subpath(action_data), path,
+					conf_path);
 				free(conf_path);
 				free(comp);
 				return;
@@ -1729,7 +1850,8 @@ void eval_move(struct action_data *action_data, struct move_ent *move,
 				ERROR("Move action: Cannot move %s to %s, "
 					"conflicting move, already moving "
 					"to %s via another move action!\n",
-					action_data->subpath, path, conf_path);
+					action_subpath(action_data), path,
+					conf_path);
 				free(conf_path);
 				return;
 			}
@@ -1760,13 +1882,7 @@ void eval_move_actions(struct dir_info *root, struct dir_ent *dir_ent)
 	struct action_data action_data;
 	struct move_ent *move = NULL;
 
-	action_data.name = dir_ent->name;
-	action_data.pathname = strdup(pathname(dir_ent));
-	action_data.subpath = strdup(subpathname(dir_ent));
-	action_data.buf = &dir_ent->inode->buf;
-	action_data.depth = dir_ent->our_dir->depth;
-	action_data.dir_ent = dir_ent;
-	action_data.root = root;
+	init_action_data(&action_data, root, dir_ent);
 
 	/*
 	 * Evaluate each move action against the current file.  For any
@@ -1818,7 +1934,7 @@ void eval_move_actions(struct dir_info *root, struct dir_ent *dir_ent)
 			char *conf_path = move_pathname(move);
 			ERROR("Move action: Cannot move %s to %s, "
 				"destination already exists\n",
-				action_data.subpath, conf_path);
+				action_subpath(&action_data), conf_path);
 			free(conf_path);
 			free(move);
 			goto finish;
@@ -1832,7 +1948,7 @@ void eval_move_actions(struct dir_info *root, struct dir_ent *dir_ent)
 			char *conf_path = move_pathname(move);
 			ERROR("Move action: Cannot move %s to %s, this is a "
 				"subdirectory of itself\n",
-				action_data.subpath, conf_path);
+				action_subpath(&action_data), conf_path);
 			free(conf_path);
 			free(move);
 			goto finish;
@@ -1842,8 +1958,7 @@ void eval_move_actions(struct dir_info *root, struct dir_ent *dir_ent)
 	}
 
 finish:
-	free(action_data.pathname);
-	free(action_data.subpath);
+	free_action_data(&action_data);
 }
 
 
@@ -1984,19 +2099,12 @@ int eval_prune_actions(struct dir_info *root, struct dir_ent *dir_ent)
 	int i, match = 0;
 	struct action_data action_data;
 
-	action_data.name = dir_ent->name;
-	action_data.pathname = strdup(pathname(dir_ent));
-	action_data.subpath = strdup(subpathname(dir_ent));
-	action_data.buf = &dir_ent->inode->buf;
-	action_data.depth = dir_ent->our_dir->depth;
-	action_data.dir_ent = dir_ent;
-	action_data.root = root;
+	init_action_data(&action_data, root, dir_ent);
 
 	for (i = 0; i < prune_count && !match; i++)
 		match = eval_expr_top(&prune_spec[i], &action_data);
 
-	free(action_data.pathname);
-	free(action_data.subpath);
+	free_action_data(&action_data);
 
 	return match;
 }
@@ -2237,13 +2345,153 @@ static int check_pathname(struct test_entry *test, struct atom *atom)
 }
 
 
-TEST_FN(name, ACTION_ALL_LNK, \
-	return fnmatch(atom->argv[0], action_data->name,
-				FNM_PATHNAME|FNM_PERIOD|FNM_EXTMATCH) == 0;)
+#define GLOB_SPECIAL "*?[\\("
+
+static int count_components(char *path);
+
+/*
+ * Find or add pattern to the glob table, and work out how it can be matched.
+ * A literal can't contain any characters which are special to fnmatch()
+ * (with FNM_EXTMATCH "(" is special after "+", "@" and "!")
+ */
+static int parse_glob_arg(struct test_entry *test, struct atom *atom)
+{
+	char *pattern = atom->argv[0];
+	int i, length = strlen(pattern);
+	struct glob *glob;
+
+	for (i = 0; i < glob_count; i++)
+		if (glob_table[i]->test == test &&
+				strcmp(glob_table[i]->pattern, pattern) == 0) {
+			atom->data = glob_table[i];
+			return 1;
+		}
+
+	glob = malloc(sizeof(*glob));
+	if (glob == NULL)
+		MEM_ERROR();
+
+	glob->test = test;
+	glob->pattern = strdup(pattern);
+	glob->components = count_components(pattern);
+	glob->id = glob_count;
+
+	if (strcspn(pattern, GLOB_SPECIAL) == length) {
+		glob->type = GLOB_LITERAL;
+		glob->literal = glob->pattern;
+	} else if (pattern[0] == '*' && strcspn(pattern + 1, GLOB_SPECIAL) ==
+							length - 1) {
+		glob->type = GLOB_SUFFIX;
+		glob->literal = glob->pattern + 1;
+	} else if (pattern[length - 1] == '*' && strcspn(pattern,
+					GLOB_SPECIAL) == length - 1) {
+		glob->type = GLOB_PREFIX;
+		glob->literal = strndup(pattern, length - 1);
+	} else {
+		glob->type = GLOB_FNMATCH;
+		glob->literal = NULL;
+	}
+
+	if (glob->pattern == NULL || (glob->type == GLOB_PREFIX &&
+						glob->literal == NULL))
+		MEM_ERROR();
+
+	glob->length = glob->literal ? strlen(glob->literal) : 0;
+
+	glob_table = realloc(glob_table, (glob_count + 1) *
+						sizeof(struct glob *));
+	if (glob_table == NULL)
+		MEM_ERROR();
+
+	glob_table[glob_count ++] = glob;
+	atom->data = glob;
+
+	return 1;
+}
+
+
+static int parse_path_glob_arg(struct test_entry *test, struct atom *atom)
+{
+	return check_pathname(test, atom) && parse_glob_arg(test, atom);
+}
+
+
+/*
+ * Match subject against glob, as fnmatch() with FNM_PATHNAME, FNM_PERIOD and
+ * FNM_EXTMATCH would.  "*" can't match "/", or a leading "." (at the start
+ * or after a "/")
+ */
+static int match_glob(struct glob *glob, char *subject)
+{
+	int length;
+
+	switch (glob->type) {
+	case GLOB_LITERAL:
+		return strcmp(subject, glob->literal) == 0;
+	case GLOB_SUFFIX:
+		length = strlen(subject);
+
+		return subject[0] != '.' && length >= glob->length &&
+			strchr(subject, '/') == NULL &&
+			strcmp(subject + length - glob->length,
+						glob->literal) == 0;
+	case GLOB_PREFIX:
+		if (strncmp(subject, glob->literal, glob->length) != 0)
+			return 0;
+
+		subject += glob->length;
+
+		return strchr(subject, '/') == NULL && (subject[0] != '.' ||
+				glob->literal[glob->length - 1] != '/');
+	default:
+		return fnmatch(glob->pattern, subject,
+				FNM_PATHNAME|FNM_PERIOD|FNM_EXTMATCH) == 0;
+	}
+}
+
+
+/*
+ * Return the memo of glob for this thread.  The memo holds a valid result
+ * if its generation is that of the file being evaluated
+ */
+static struct glob_memo *get_glob_memo(struct glob *glob)
+{
+	if (glob_memo_size < glob_count) {
+		glob_memo = realloc(glob_memo, glob_count *
+						sizeof(struct glob_memo));
+		if (glob_memo == NULL)
+			MEM_ERROR();
+
+		memset(glob_memo + glob_memo_size, 0, (glob_count -
+			glob_memo_size) * sizeof(struct glob_memo));
+		glob_memo_size = glob_count;
+	}
+
+	return &glob_memo[glob->id];
+}
+
+
+/*
+ * Generic glob test code macro, matching the glob against SUBJECT, which is
+ * only evaluated if the glob hasn't already been matched against this file
+ */
+#define GLOB_TEST_FN(NAME, SUBJECT) \
+static int NAME##_fn(struct atom *atom, struct action_data *action_data) \
+{ \
+	struct glob *glob = atom->data; \
+	struct glob_memo *memo = get_glob_memo(glob); \
+ \
+	if (memo->generation != action_data->generation) { \
+		memo->generation = action_data->generation; \
+		memo->match = match_glob(glob, SUBJECT); \
+	} \
+ \
+	return memo->match; \
+}
+
+GLOB_TEST_FN(name, action_data->name)
 
-TEST_FN(pathname, ACTION_ALL_LNK, \
-	return fnmatch(atom->argv[0], action_data->subpath,
-				FNM_PATHNAME|FNM_PERIOD|FNM_EXTMATCH) == 0;)
+GLOB_TEST_FN(pathname, action_subpath(action_data))
 
 
 static int count_components(char *path)
@@ -2282,12 +2530,8 @@ static char *get_start(char *s, int n)
 }
 	
 
-static int subpathname_fn(struct atom *atom, struct action_data *action_data)
-{
-	return fnmatch(atom->argv[0], get_start(strdupa(action_data->subpath),
-		count_components(atom->argv[0])),
-		FNM_PATHNAME|FNM_PERIOD|FNM_EXTMATCH) == 0;
-}
+GLOB_TEST_FN(subpathname, get_start(strdupa(action_subpath(action_data)),
+	glob->components))
 
 /*
  * Inode attribute test operations using generic
@@ -2523,72 +2767,9 @@ static int parse_file_arg(struct test_entry *test, struct atom *atom)
 
 static int file_fn(struct atom *atom, struct action_data *action_data)
 {
-	int child, res, size = 0, status;
-	int pipefd[2];
-	char *buffer = NULL;
-	regex_t *preg = atom->data;
-
-	res = pipe(pipefd);
-	if (res == -1)
-		BAD_ERROR("file_fn pipe failed\n");
+	char *type = file_type(action_pathname(action_data), action_data->buf);
 
-	child = fork();
-	if (child == -1)
-		BAD_ERROR("file_fn fork_failed\n");
-
-	if (child == 0) {
-		/*
-		 * Child process
-		 * Connect stdout to pipefd[1] and execute file command
-		 */
-		close(STDOUT_FILENO);
-		res = dup(pipefd[1]);
-		if (res == -1)
-			exit(EXIT_FAILURE);
-
-		execlp("file", "file", "-b", action_data->pathname,
-			(char *) NULL);
-		exit(EXIT_FAILURE);
-	}
-
-	/*
-	 * Parent process.  Read stdout from file command
- 	 */
-	close(pipefd[1]);
-
-	do {
-		buffer = realloc(buffer, size + 512);
-		if (buffer == NULL)
-			MEM_ERROR();
-
-		res = read_bytes(pipefd[0], buffer + size, 512);
-
-		if (res == -1)
-			BAD_ERROR("file_fn pipe read error\n");
-
-		size += 512;
-
-	} while (res == 512);
-
-	size = size + res - 512;
-
-	buffer[size] = '\0';
-
-	res = waitpid(child,  &status, 0);
-
-	if (res == -1)
-		BAD_ERROR("file_fn waitpid failed\n");
- 
-	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
-		BAD_ERROR("file_fn file returned error\n");
-
-	close(pipefd[0]);
-
-	res = regexec(preg, buffer, (size_t) 0, NULL, 0);
-
-	free(buffer);
-
-	return res == 0;
+	return regexec(atom->data, type, (size_t) 0, NULL, 0) == 0;
 }
 
 
@@ -2634,11 +2815,12 @@ static int exec_fn(struct atom *atom, struct action_data *action_data)
 		if(res == -1)
 			exit(EXIT_FAILURE);
 
-		res = setenv("PATHNAME", action_data->subpath, 1);
+		res = setenv("PATHNAME", action_subpath(action_data), 1);
 		if(res == -1)
 			exit(EXIT_FAILURE);
 
-		res = setenv("SOURCE_PATHNAME", action_data->pathname, 1);
+		res = setenv("SOURCE_PATHNAME", action_pathname(action_data),
+			1);
 		if(res == -1)
 			exit(EXIT_FAILURE);
 
@@ -2804,6 +2986,8 @@ static int parse_expr_argX(struct test_entry *test, struct atom *atom,
 
 	cur_ptr = source = atom->argv[argno];
 	atom->data = parse_expr(0);
+	if(atom->data)
+		atom->program = compile_expr(atom->data);
 
 	cur_ptr = save_cur_ptr;
 	source = save_source;
@@ -2837,6 +3021,7 @@ static int parse_expr_arg1(struct test_entry *test, struct atom *atom)
 static int stat_fn(struct atom *atom, struct action_data *action_data)
 {
 	struct stat buf;
+	struct inode_stat ibuf;
 	struct action_data eval_action;
 	int match, res;
 
@@ -2855,7 +3040,7 @@ static int stat_fn(struct atom *atom, struct action_data *action_data)
 	/* if this isn't a symlink then stat will just return the current
 	 * information, i.e. stat(expr) == expr.  This is harmless and
 	 * is better than returning TRUE or FALSE in a non symlink case */
-	res = stat(action_data->pathname, &buf);
+	res = stat(action_pathname(action_data), &buf);
 	if(res == -1) {
 		if(expr_log_cmnd(LOG_ENABLED)) {
 			expr_log(atom->test->name);
@@ -2868,8 +3053,9 @@ static int stat_fn(struct atom *atom, struct action_data *action_data)
 
 	/* fill in the inode values of the file pointed to by the
 	 * symlink, but, leave everything else the same */
+	copy_inode_stat(&ibuf, &buf);
 	memcpy(&eval_action, action_data, sizeof(struct action_data));
-	eval_action.buf = &buf;
+	eval_action.buf = &ibuf;
 
 	if(expr_log_cmnd(LOG_ENABLED)) {
 		expr_log(atom->test->name);
@@ -2877,7 +3063,10 @@ static int stat_fn(struct atom *atom, struct action_data *action_data)
 		match = eval_expr_log(atom->data, &eval_action);
 		expr_log(")");
 	} else
-		match = eval_expr(atom->data, &eval_action);
+		match = eval_program(atom->program, &eval_action);
+
+	/* keep the subpathname if the expression made it */
+	action_data->subpath = eval_action.subpath;
 
 	return match;
 }
@@ -2913,13 +3102,7 @@ static int readlink_fn(struct atom *atom, struct action_data *action_data)
 	if(dir_ent == NULL)
 		goto finish;
 
-	eval_action.name = dir_ent->name;
-	eval_action.pathname = strdup(pathname(dir_ent));
-	eval_action.subpath = strdup(subpathname(dir_ent));
-	eval_action.buf = &dir_ent->inode->buf;
-	eval_action.depth = dir_ent->our_dir->depth;
-	eval_action.dir_ent = dir_ent;
-	eval_action.root = action_data->root;
+	init_action_data(&eval_action, action_data->root, dir_ent);
 
 	if(expr_log_cmnd(LOG_ENABLED)) {
 		expr_log(atom->test->name);
@@ -2927,10 +3110,9 @@ static int readlink_fn(struct atom *atom, struct action_data *action_data)
 		match = eval_expr_log(atom->data, &eval_action);
 		expr_log(")");
 	} else
-		match = eval_expr(atom->data, &eval_action);
+		match = eval_program(atom->program, &eval_action);
 
-	free(eval_action.pathname);
-	free(eval_action.subpath);
+	free_action_data(&eval_action);
 
 	return match;
 
@@ -2951,7 +3133,7 @@ static int eval_fn(struct atom *atom, struct action_data *action_data)
 	int match;
 	char *path = atom->argv[0];
 	struct dir_ent *dir_ent = action_data->dir_ent;
-	struct stat *buf = action_data->buf;
+	struct inode_stat *buf = action_data->buf;
 	struct action_data eval_action;
 
 	/* Follow path (arg1) and evaluate the expression (arg2)
@@ -3015,26 +3197,19 @@ static int eval_fn(struct atom *atom, struct action_data *action_data)
 		return 0;
 	}
 
-	eval_action.name = dir_ent->name;
-	eval_action.pathname = strdup(pathname(dir_ent));
-	eval_action.subpath = strdup(subpathname(dir_ent));
-	eval_action.buf = &dir_ent->inode->buf;
-	eval_action.depth = dir_ent->our_dir->depth;
-	eval_action.dir_ent = dir_ent;
-	eval_action.root = action_data->root;
+	init_action_data(&eval_action, action_data->root, dir_ent);
 
 	if(expr_log_cmnd(LOG_ENABLED)) {
 		expr_log(atom->test->name);
 		expr_log("(");
-		expr_log(eval_action.subpath);
+		expr_log(action_subpath(&eval_action));
 		expr_log(",");
 		match = eval_expr_log(atom->data, &eval_action);
 		expr_log(")");
 	} else
-		match = eval_expr(atom->data, &eval_action);
+		match = eval_program(atom->program, &eval_action);
 
-	free(eval_action.pathname);
-	free(eval_action.subpath);
+	free_action_data(&eval_action);
 
 	return match;
 }
@@ -3109,7 +3284,7 @@ finish:
 static int perm_fn(struct atom *atom, struct action_data *action_data)
 {
 	struct perm_data *perm_data = atom->data;
-	struct stat *buf = action_data->buf;
+	struct inode_stat *buf = action_data->buf;
 
 	switch(perm_data->op) {
 	case PERM_EXACT:
@@ -3198,9 +3373,9 @@ void dump_actions()
 
 
 static struct test_entry test_table[] = {
-	{ "name", 1, name_fn, NULL, 1},
-	{ "pathname", 1, pathname_fn, check_pathname, 1, 0},
-	{ "subpathname", 1, subpathname_fn, check_pathname, 1, 0},
+	{ "name", 1, name_fn, parse_glob_arg, 1},
+	{ "pathname", 1, pathname_fn, parse_path_glob_arg, 1, 0},
+	{ "subpathname", 1, subpathname_fn, parse_path_glob_arg, 1, 0},
 	{ "filesize", 1, filesize_fn, parse_number_arg, 1, 0},
 	{ "dirsize", 1, dirsize_fn, parse_number_arg, 1, 0},
 	{ "size", 1, size_fn, parse_number_arg, 1, 0},
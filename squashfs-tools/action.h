@@ -101,6 +101,7 @@ struct atom {
 	int args;
 	char **argv;
 	void *data;
+	struct instruction *program;
 };
 
 
@@ -119,6 +120,52 @@ struct expr {
 	};
 };
 
+/*
+ * Compiled expression definitions.  Each expression is compiled once into
+ * a flat program, which is evaluated without walking the expression tree.
+ * The result of the last test is kept in a single register, && and ||
+ * become conditional jumps over their right hand side
+ */
+#define PROG_TEST		0
+#define PROG_NOT		1
+#define PROG_JUMP_FALSE		2
+#define PROG_JUMP_TRUE		3
+#define PROG_END		4
+
+struct instruction {
+	int op;
+	union {
+		struct atom *atom;
+		int target;
+	};
+};
+
+/*
+ * Name, pathname and subpathname test definitions.  The patterns are shared
+ * between all the tests using them, and each pattern is matched at most once
+ * per file.  Patterns which are a literal, or a literal followed or preceded
+ * by "*", are matched without fnmatch()
+ */
+#define GLOB_FNMATCH	0
+#define GLOB_LITERAL	1
+#define GLOB_PREFIX	2
+#define GLOB_SUFFIX	3
+
+struct glob {
+	struct test_entry *test;
+	char *pattern;
+	char *literal;
+	int length;
+	int components;
+	int type;
+	int id;
+};
+
+struct glob_memo {
+	int generation;
+	int match;
+};
+
 /*
  * Test operation definitions
  */
@@ -208,14 +255,20 @@ struct action_entry {
 };
 
 
+/*
+ * pathname and subpath are only computed from dir_ent by the first test
+ * which uses them (if they are NULL).  generation identifies the file being
+ * evaluated to the glob memo
+ */
 struct action_data {
 	int depth;
 	char *name;
 	char *pathname;
 	char *subpath;
-	struct stat *buf;
+	struct inode_stat *buf;
 	struct dir_ent *dir_ent;
 	struct dir_info *root;
+	int generation;
 };
 
 
@@ -225,6 +278,7 @@ struct action {
 	int args;
 	char **argv;
 	struct expr *expr;
+	struct instruction *program;
 	void *data;
 	int verbose;
 };
@@ -35,14 +35,36 @@
 
 extern char *mount_point;
 
-void alloc_mounted_path(const char *mount_point, const char *subpath, char **mounted_path) {
-    *mounted_path = malloc(strlen(mount_point) + strlen(subpath) + 1);
-    if (*mounted_path == NULL) {
-        perror("Malloc Failure.");
-        exit(EXIT_FAILURE);
+/*
+ * Grow a per-thread path buffer to at least size bytes.  The paths are built
+ * for every inode, so the buffers are reused rather than allocated per call.
+ */
+static char *path_buffer(char **buffer, size_t *buffer_size, size_t size) {
+    if (size > *buffer_size) {
+        *buffer = realloc(*buffer, size);
+        if (*buffer == NULL) {
+            perror("Malloc Failure.");
+            exit(EXIT_FAILURE);
+        }
+        *buffer_size = size;
     }
-    strcpy(*mounted_path, mount_point);
-    strcat(*mounted_path, subpath);
+    return *buffer;
+}
+
+/*
+ * Return mount_point followed by subpath.  The result is valid until the
+ * next call from the same thread.
+ */
+char *mounted_path(const char *mount_point, const char *subpath) {
+    static __thread char *buffer = NULL;
+    static __thread size_t buffer_size = 0;
+    size_t mount_size = strlen(mount_point);
+    char *path = path_buffer(&buffer, &buffer_size,
+            mount_size + strlen(subpath) + 1);
+
+    memcpy(path, mount_point, mount_size);
+    strcpy(path + mount_size, subpath);
+    return path;
 }
 
 void android_fs_config(const char *path, struct stat *stat) {
@@ -74,17 +96,15 @@ struct selabel_handle *get_sehnd(const char *context_file) {
 
 
 char *set_selabel(const char *path, unsigned int mode, struct selabel_handle *sehnd) {
+    static __thread char *buffer = NULL;
+    static __thread size_t buffer_size = 0;
     char *secontext;
     if (sehnd != NULL) {
-        int full_name_size = strlen(path) + 2;
-        char* full_name = (char*) malloc(full_name_size);
-        if (full_name == NULL) {
-            perror("Malloc Failure.");
-            exit(EXIT_FAILURE);
-        }
+        size_t path_size = strlen(path) + 1;
+        char *full_name = path_buffer(&buffer, &buffer_size, path_size + 1);
 
         full_name[0] = '/';
-        strncpy(full_name + 1, path, full_name_size - 1);
+        memcpy(full_name + 1, path, path_size);
 
         if (selabel_lookup(sehnd, &secontext, full_name, mode)) {
             if (mount_point && mount_point[0] == '/')
@@ -93,7 +113,6 @@ char *set_selabel(const char *path, unsigned int mode, struct selabel_handle *se
                 secontext = strdup("u:object_r:unlabeled:s0");
         }
 
-        free(full_name);
         return secontext;
     }
     perror("Selabel handle is NULL.");
@@ -0,0 +1,880 @@
+/*
+ * Create a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2014
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * archive.c
+ *
+ * Reads the entries of a tar or cpio archive as a stream, so that
+ * Mksquashfs can build a filesystem directly from an archive on stdin.
+ * Tar archives may be v7, ustar, GNU (long names and links) or pax
+ * (including SCHILY.xattr extended attributes).  Cpio archives may be
+ * "newc", "crc" or "odc" (portable ASCII) format.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ctype.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "squashfs_fs.h"
+#include "xattr.h"
+#include "archive.h"
+#include "error.h"
+#include "progressbar.h"
+
+#define TRUE 1
+#define FALSE 0
+
+extern int read_bytes(int, void *, int);
+extern int no_xattrs;
+
+struct tar_header {
+	char	name[100];
+	char	mode[8];
+	char	uid[8];
+	char	gid[8];
+	char	size[12];
+	char	mtime[12];
+	char	checksum[8];
+	char	type;
+	char	link[100];
+	char	magic[6];
+	char	version[2];
+	char	uname[32];
+	char	gname[32];
+	char	major[8];
+	char	minor[8];
+	char	prefix[155];
+	char	padding[12];
+};
+
+/* values from a pax extended header, which override the tar header */
+struct pax {
+	char		*path;
+	char		*linkpath;
+	long long	size;
+	long long	uid;
+	long long	gid;
+	long long	mtime;
+	char		have_size;
+	char		have_uid;
+	char		have_gid;
+	char		have_mtime;
+};
+
+struct archive *archive_open(char *filename, int format)
+{
+	struct archive *archive = malloc(sizeof(struct archive));
+
+	if(archive == NULL)
+		MEM_ERROR();
+
+	if(strcmp(filename, "-") == 0)
+		archive->fd = STDIN_FILENO;
+	else {
+		archive->fd = open(filename, O_RDONLY);
+		if(archive->fd == -1) {
+			ERROR("Could not open archive \"%s\" because %s\n",
+				filename, strerror(errno));
+			free(archive);
+			return NULL;
+		}
+	}
+
+	archive->buffer = malloc(ARCHIVE_BUFFER_SIZE);
+	if(archive->buffer == NULL)
+		MEM_ERROR();
+
+	archive->format = format;
+	archive->filename = filename;
+	archive->start = archive->end = 0;
+	archive->offset = 0;
+	archive->remaining = 0;
+	archive->padding = 0;
+	archive->name = archive->link = NULL;
+	archive->xattrs = 0;
+	archive->xattr_list = NULL;
+
+	return archive;
+}
+
+
+void archive_close(struct archive *archive)
+{
+	if(archive->fd != STDIN_FILENO)
+		close(archive->fd);
+	free(archive->name);
+	free(archive->link);
+	free(archive->buffer);
+	free(archive);
+}
+
+
+/*
+ * Get bytes from the archive into data, or discard them if data is NULL.
+ * Returns the number of bytes got, which is less than bytes at the end of
+ * the archive, or -1 on failure.  Large reads bypass the buffer
+ */
+static int archive_get(struct archive *archive, void *data, int bytes)
+{
+	int count = 0;
+
+	while(count < bytes) {
+		int avail = archive->end - archive->start;
+
+		if(avail == 0) {
+			if(data && bytes - count >= ARCHIVE_BUFFER_SIZE) {
+				avail = read_bytes(archive->fd, data + count,
+					bytes - count);
+				if(avail == -1)
+					return -1;
+				archive->offset += avail;
+				return count + avail;
+			}
+
+			avail = read_bytes(archive->fd, archive->buffer,
+				ARCHIVE_BUFFER_SIZE);
+			if(avail == -1)
+				return -1;
+			if(avail == 0)
+				break;
+
+			archive->start = 0;
+			archive->end = avail;
+		}
+
+		if(avail > bytes - count)
+			avail = bytes - count;
+
+		if(data)
+			memcpy(data + count, archive->buffer + archive->start,
+				avail);
+		archive->start += avail;
+		archive->offset += avail;
+		count += avail;
+	}
+
+	return count;
+}
+
+
+static void archive_skip(struct archive *archive, long long bytes)
+{
+	while(bytes) {
+		int size = bytes > ARCHIVE_BUFFER_SIZE ? ARCHIVE_BUFFER_SIZE :
+			bytes;
+
+		if(archive_get(archive, NULL, size) != size)
+			BAD_ERROR("Unexpected end of archive \"%s\"\n",
+				archive->filename);
+		bytes -= size;
+	}
+}
+
+
+/*
+ * Read the data of the current entry.  Returns the number of bytes read,
+ * which is less than bytes if the archive is truncated, or -1 on failure
+ */
+int archive_read(struct archive *archive, void *data, int bytes)
+{
+	int res;
+
+	if(bytes > archive->remaining)
+		bytes = archive->remaining;
+
+	res = archive_get(archive, data, bytes);
+	if(res > 0)
+		archive->remaining -= res;
+
+	return res;
+}
+
+
+/*
+ * Read the rest of the archive, so that whatever is writing it to a pipe
+ * sees it consumed rather than getting a broken pipe after the end of
+ * archive marker
+ */
+static void archive_drain(struct archive *archive)
+{
+	while(archive_get(archive, NULL, ARCHIVE_BUFFER_SIZE) > 0);
+}
+
+
+/*
+ * Read the data of a tar long name or extended header, and the padding
+ * after it
+ */
+static char *archive_data(struct archive *archive, long long size)
+{
+	char *data;
+
+	if(size < 0 || size > (1 << 30))
+		BAD_ERROR("Corrupted or too large extended header in archive "
+			"\"%s\"\n", archive->filename);
+
+	data = malloc(size + 1);
+	if(data == NULL)
+		MEM_ERROR();
+
+	if(archive_get(archive, data, size) != size)
+		BAD_ERROR("Unexpected end of archive \"%s\"\n",
+			archive->filename);
+
+	data[size] = '\0';
+	archive_skip(archive, archive->padding);
+	archive->padding = 0;
+
+	return data;
+}
+
+
+/*
+ * Return the canonical form of name, without leading "/", empty or "."
+ * components, and trailing "/".  Names containing ".." are rejected,
+ * returning NULL, so entries can't be placed outside the filesystem root
+ */
+static char *canonical_name(char *name)
+{
+	char *result = malloc(strlen(name) + 1), *p = result;
+
+	if(result == NULL)
+		MEM_ERROR();
+
+	while(*name) {
+		char *start;
+		int len;
+
+		while(*name == '/')
+			name ++;
+
+		start = name;
+		while(*name != '/' && *name != '\0')
+			name ++;
+		len = name - start;
+
+		if(len == 0 || (len == 1 && start[0] == '.'))
+			continue;
+
+		if(len == 2 && start[0] == '.' && start[1] == '.') {
+			free(result);
+			return NULL;
+		}
+
+		if(p != result)
+			*p ++ = '/';
+		memcpy(p, start, len);
+		p += len;
+	}
+
+	*p = '\0';
+	return result;
+}
+
+
+static void add_xattr(struct archive *archive, char *name, void *value,
+	int vsize)
+{
+	struct xattr_list *x;
+
+	if(no_xattrs)
+		return;
+
+	x = realloc(archive->xattr_list, (archive->xattrs + 1) *
+		sizeof(struct xattr_list));
+	if(x == NULL)
+		MEM_ERROR();
+	archive->xattr_list = x;
+
+	x = &x[archive->xattrs ++];
+	x->full_name = strdup(name);
+	x->value = malloc(vsize ? : 1);
+	if(x->full_name == NULL || x->value == NULL)
+		MEM_ERROR();
+	memcpy(x->value, value, vsize);
+	x->vsize = vsize;
+}
+
+
+/*
+ * Parse a tar number field.  Numbers are octal, optionally surrounded by
+ * spaces and NUL terminated, or the GNU base-256 extension if the top bit
+ * of the first byte is set
+ */
+static int tar_number(char *field, int size, long long *value)
+{
+	long long res = 0;
+	int i = 0;
+
+	if(field[0] & 0x80) {
+		/* negative base-256 numbers aren't supported */
+		if(field[0] & 0x40)
+			return FALSE;
+
+		res = field[0] & 0x3f;
+		for(i = 1; i < size; i++) {
+			if(res >> 55)
+				return FALSE;
+			res = (res << 8) | (unsigned char) field[i];
+		}
+
+		*value = res;
+		return TRUE;
+	}
+
+	for(; i < size && field[i] == ' '; i++);
+
+	for(; i < size && field[i] >= '0' && field[i] <= '7'; i++) {
+		if(res >> 60)
+			return FALSE;
+		res = (res << 3) + field[i] - '0';
+	}
+
+	if(i < size && field[i] != ' ' && field[i] != '\0')
+		return FALSE;
+
+	*value = res;
+	return TRUE;
+}
+
+
+static int tar_checksum(struct tar_header *header)
+{
+	unsigned char *p = (unsigned char *) header;
+	unsigned int sum = 0;
+	int i, ssum = 0;
+	long long checksum;
+
+	if(tar_number(header->checksum, 8, &checksum) == FALSE)
+		return FALSE;
+
+	/* the checksum is calculated with the checksum field as spaces */
+	for(i = 0; i < sizeof(struct tar_header); i++) {
+		int c = i >= offsetof(struct tar_header, checksum) &&
+			i < offsetof(struct tar_header, type) ? ' ' : p[i];
+
+		sum += (unsigned char) c;
+		ssum += (signed char) c;
+	}
+
+	/* some old tars calculated the checksum with signed chars */
+	return checksum == sum || checksum == ssum;
+}
+
+
+static int tar_zero(struct tar_header *header)
+{
+	unsigned char *p = (unsigned char *) header;
+	int i;
+
+	for(i = 0; i < sizeof(struct tar_header); i++)
+		if(p[i])
+			return FALSE;
+
+	return TRUE;
+}
+
+
+static void tar_pax(struct archive *archive, char *data, long long size,
+	struct pax *pax)
+{
+	char *p = data, *end = data + size;
+
+	while(p < end) {
+		char *q, *key, *value, *record_end;
+		long long len = 0;
+
+		for(q = p; q < end && isdigit(*q) && len <= size; q++)
+			len = len * 10 + *q - '0';
+
+		if(q == p || q == end || *q != ' ' || len <= q - p + 1 ||
+							len > end - p)
+			goto corrupted;
+
+		record_end = p + len;
+		if(record_end[-1] != '\n')
+			goto corrupted;
+
+		key = q + 1;
+		value = memchr(key, '=', record_end - key);
+		if(value == NULL)
+			goto corrupted;
+
+		*value ++ = '\0';
+		record_end[-1] = '\0';
+
+		if(strcmp(key, "path") == 0) {
+			free(pax->path);
+			pax->path = strdup(value);
+		} else if(strcmp(key, "linkpath") == 0) {
+			free(pax->linkpath);
+			pax->linkpath = strdup(value);
+		} else if(strcmp(key, "size") == 0) {
+			pax->size = strtoll(value, NULL, 10);
+			pax->have_size = TRUE;
+		} else if(strcmp(key, "uid") == 0) {
+			pax->uid = strtoll(value, NULL, 10);
+			pax->have_uid = TRUE;
+		} else if(strcmp(key, "gid") == 0) {
+			pax->gid = strtoll(value, NULL, 10);
+			pax->have_gid = TRUE;
+		} else if(strcmp(key, "mtime") == 0) {
+			/* any fractional part is dropped */
+			pax->mtime = strtoll(value, NULL, 10);
+			pax->have_mtime = TRUE;
+		} else if(strncmp(key, "SCHILY.xattr.", 13) == 0)
+			add_xattr(archive, key + 13, value, record_end - 1 -
+				value);
+		else if(strncmp(key, "GNU.sparse.", 11) == 0)
+			BAD_ERROR("Sparse files in tar archive \"%s\" are not "
+				"supported\n", archive->filename);
+
+		p = record_end;
+	}
+
+	return;
+
+corrupted:
+	ERROR("Corrupted pax extended header in archive \"%s\" at offset "
+		"%lld, ignoring the rest of it\n", archive->filename,
+		archive->offset);
+}
+
+
+static char *tar_string(char *field, int size)
+{
+	char *string = strndup(field, size);
+
+	if(string == NULL)
+		MEM_ERROR();
+
+	return string;
+}
+
+
+static int tar_next(struct archive *archive, struct archive_entry *entry)
+{
+	struct tar_header header;
+	struct pax pax;
+	char *long_name = NULL, *long_link = NULL, *name, *link;
+	long long mode, uid, gid, size, mtime, major, minor;
+	int res, type;
+
+again:
+	memset(&pax, 0, sizeof(pax));
+
+	while(1) {
+		res = archive_get(archive, &header, sizeof(header));
+		if(res == -1)
+			BAD_ERROR("Reading archive \"%s\" failed\n",
+				archive->filename);
+
+		/* some archivers omit the end of archive marker */
+		if(res == 0 && long_name == NULL && long_link == NULL &&
+						pax.path == NULL)
+			return FALSE;
+
+		if(res != sizeof(header))
+			BAD_ERROR("Unexpected end of archive \"%s\"\n",
+				archive->filename);
+
+		if(tar_zero(&header)) {
+			archive_drain(archive);
+			free(long_name);
+			free(long_link);
+			free(pax.path);
+			free(pax.linkpath);
+			return FALSE;
+		}
+
+		if(tar_checksum(&header) == FALSE ||
+				tar_number(header.size, 12, &size) == FALSE)
+			BAD_ERROR("Corrupted tar header in archive \"%s\" at "
+				"offset %lld\n", archive->filename,
+				archive->offset - (long long) sizeof(header));
+
+		archive->padding = (512 - size % 512) % 512;
+
+		if(header.type == 'L') {
+			free(long_name);
+			long_name = archive_data(archive, size);
+		} else if(header.type == 'K') {
+			free(long_link);
+			long_link = archive_data(archive, size);
+		} else if(header.type == 'x') {
+			char *data = archive_data(archive, size);
+			tar_pax(archive, data, size, &pax);
+			free(data);
+		} else if(header.type == 'g' || header.type == 'V')
+			/* global extended headers and volume labels */
+			archive_skip(archive, size + archive->padding);
+		else
+			break;
+	}
+
+	if(pax.path)
+		name = pax.path;
+	else if(long_name)
+		name = long_name;
+	else if(memcmp(header.magic, "ustar", 5) == 0 && header.prefix[0]) {
+		int prefix = strnlen(header.prefix, sizeof(header.prefix));
+		int len = strnlen(header.name, sizeof(header.name));
+
+		name = malloc(prefix + len + 2);
+		if(name == NULL)
+			MEM_ERROR();
+		memcpy(name, header.prefix, prefix);
+		name[prefix] = '/';
+		memcpy(name + prefix + 1, header.name, len);
+		name[prefix + len + 1] = '\0';
+	} else
+		name = tar_string(header.name, sizeof(header.name));
+
+	if(pax.linkpath)
+		link = pax.linkpath;
+	else if(long_link)
+		link = long_link;
+	else
+		link = tar_string(header.link, sizeof(header.link));
+
+	if(name != pax.path)
+		free(pax.path);
+	if(name != long_name)
+		free(long_name);
+	if(link != pax.linkpath)
+		free(pax.linkpath);
+	if(link != long_link)
+		free(long_link);
+	long_name = long_link = NULL;
+
+	if(tar_number(header.mode, 8, &mode) == FALSE ||
+			tar_number(header.uid, 8, &uid) == FALSE ||
+			tar_number(header.gid, 8, &gid) == FALSE ||
+			tar_number(header.mtime, 12, &mtime) == FALSE ||
+			tar_number(header.major, 8, &major) == FALSE ||
+			tar_number(header.minor, 8, &minor) == FALSE)
+		BAD_ERROR("Corrupted tar header for \"%s\" in archive \"%s\"\n",
+			name, archive->filename);
+
+	if(pax.have_size) {
+		size = pax.size;
+		archive->padding = (512 - size % 512) % 512;
+	}
+	if(pax.have_uid)
+		uid = pax.uid;
+	if(pax.have_gid)
+		gid = pax.gid;
+	if(pax.have_mtime)
+		mtime = pax.mtime;
+
+	switch(header.type) {
+	case '0':
+	case '\0':
+		/* v7 tar marks directories with a trailing "/" */
+		type = name[0] && name[strlen(name) - 1] == '/' ? S_IFDIR :
+			S_IFREG;
+		break;
+	case '1':
+	case '7':
+		type = S_IFREG;
+		break;
+	case '2':
+		type = S_IFLNK;
+		break;
+	case '3':
+		type = S_IFCHR;
+		break;
+	case '4':
+		type = S_IFBLK;
+		break;
+	case '5':
+	case 'D':
+		type = S_IFDIR;
+		break;
+	case '6':
+		type = S_IFIFO;
+		break;
+	case 'S':
+		BAD_ERROR("Sparse files in tar archive \"%s\" are not "
+			"supported\n", archive->filename);
+	case 'M':
+		BAD_ERROR("Multi-volume tar archive \"%s\" is not supported\n",
+			archive->filename);
+	default:
+		ERROR("Skipping \"%s\" in archive \"%s\", unsupported tar "
+			"type '%c'\n", name, archive->filename, header.type);
+		goto skip;
+	}
+
+	entry->hardlink = header.type == '1';
+	entry->name = canonical_name(name);
+	if(entry->name == NULL) {
+		ERROR("Skipping \"%s\" in archive \"%s\", it refers to "
+			"\"..\"\n", name, archive->filename);
+		goto skip;
+	}
+
+	if(entry->hardlink) {
+		entry->link = canonical_name(link);
+		free(link);
+		if(entry->link == NULL) {
+			ERROR("Skipping hard link \"%s\" in archive \"%s\", "
+				"its target refers to \"..\"\n", name,
+				archive->filename);
+			free(entry->name);
+			link = NULL;
+			goto skip;
+		}
+	} else
+		entry->link = link;
+
+	free(name);
+	free(archive->name);
+	free(archive->link);
+	archive->name = entry->name;
+	archive->link = entry->link;
+
+	entry->mode = (mode & 07777) | type;
+	entry->uid = uid;
+	entry->gid = gid;
+	entry->mtime = mtime;
+	entry->major = major;
+	entry->minor = minor;
+	entry->dev = entry->ino = 0;
+	entry->nlink = 1;
+	entry->size = type == S_IFREG && !entry->hardlink ? size : 0;
+	entry->xattrs = archive->xattrs;
+	entry->xattr_list = archive->xattr_list;
+	archive->xattrs = 0;
+	archive->xattr_list = NULL;
+
+	/* anything not read as file data is skipped by the next call */
+	archive->remaining = size;
+
+	return TRUE;
+
+skip:
+	free(name);
+	free(link);
+	free_prefetched_xattrs(archive->xattrs, archive->xattr_list);
+	archive->xattrs = 0;
+	archive->xattr_list = NULL;
+	archive_skip(archive, size + archive->padding);
+	archive->padding = 0;
+	goto again;
+}
+
+
+static long long cpio_number(char *field, int size, int base)
+{
+	char buffer[16], *end;
+	long long res;
+
+	memcpy(buffer, field, size);
+	buffer[size] = '\0';
+
+	res = strtoll(buffer, &end, base);
+	if(*end != '\0' || res < 0)
+		return -1;
+
+	return res;
+}
+
+
+static int cpio_next(struct archive *archive, struct archive_entry *entry)
+{
+	char header[110], *name;
+	long long mode, namesize, size, dev_major, dev_minor, rdev_major,
+		rdev_minor;
+	int res, newc, hsize;
+
+again:
+	res = archive_get(archive, header, 6);
+	if(res == -1)
+		BAD_ERROR("Reading archive \"%s\" failed\n", archive->filename);
+
+	if(res != 6)
+		BAD_ERROR("Unexpected end of archive \"%s\", no cpio trailer\n",
+			archive->filename);
+
+	if(memcmp(header, "070701", 6) == 0 || memcmp(header, "070702", 6) == 0)
+		newc = TRUE;
+	else if(memcmp(header, "070707", 6) == 0)
+		newc = FALSE;
+	else
+		BAD_ERROR("Unrecognised cpio header in archive \"%s\" at "
+			"offset %lld, only newc, crc and odc formats are "
+			"supported\n", archive->filename, archive->offset - 6);
+
+	hsize = newc ? 110 : 76;
+	if(archive_get(archive, header + 6, hsize - 6) != hsize - 6)
+		BAD_ERROR("Unexpected end of archive \"%s\"\n",
+			archive->filename);
+
+	if(newc) {
+		entry->ino = cpio_number(header + 6, 8, 16);
+		mode = cpio_number(header + 14, 8, 16);
+		entry->uid = cpio_number(header + 22, 8, 16);
+		entry->gid = cpio_number(header + 30, 8, 16);
+		entry->nlink = cpio_number(header + 38, 8, 16);
+		entry->mtime = cpio_number(header + 46, 8, 16);
+		size = cpio_number(header + 54, 8, 16);
+		dev_major = cpio_number(header + 62, 8, 16);
+		dev_minor = cpio_number(header + 70, 8, 16);
+		rdev_major = cpio_number(header + 78, 8, 16);
+		rdev_minor = cpio_number(header + 86, 8, 16);
+		namesize = cpio_number(header + 94, 8, 16);
+	} else {
+		long long dev = cpio_number(header + 6, 6, 8);
+		long long rdev = cpio_number(header + 42, 6, 8);
+
+		dev_major = dev == -1 ? -1 : dev >> 8;
+		dev_minor = dev & 0xff;
+		rdev_major = rdev == -1 ? -1 : rdev >> 8;
+		rdev_minor = rdev & 0xff;
+		entry->ino = cpio_number(header + 12, 6, 8);
+		mode = cpio_number(header + 18, 6, 8);
+		entry->uid = cpio_number(header + 24, 6, 8);
+		entry->gid = cpio_number(header + 30, 6, 8);
+		entry->nlink = cpio_number(header + 36, 6, 8);
+		entry->mtime = cpio_number(header + 48, 11, 8);
+		namesize = cpio_number(header + 59, 6, 8);
+		size = cpio_number(header + 65, 11, 8);
+	}
+
+	if(mode == -1 || size == -1 || namesize < 1 || namesize > 65536 ||
+				dev_major == -1 || dev_minor == -1 ||
+				rdev_major == -1 || rdev_minor == -1)
+		BAD_ERROR("Corrupted cpio header in archive \"%s\"\n",
+			archive->filename);
+
+	name = malloc(namesize);
+	if(name == NULL)
+		MEM_ERROR();
+
+	if(archive_get(archive, name, namesize) != namesize)
+		BAD_ERROR("Unexpected end of archive \"%s\"\n",
+			archive->filename);
+	name[namesize - 1] = '\0';
+
+	/* newc pads the header and name, and the data, to 4 bytes */
+	if(newc)
+		archive_skip(archive, (4 - (hsize + namesize) % 4) % 4);
+	archive->padding = newc ? (4 - size % 4) % 4 : 0;
+
+	if(strcmp(name, "TRAILER!!!") == 0) {
+		free(name);
+		archive_drain(archive);
+		return FALSE;
+	}
+
+	entry->name = canonical_name(name);
+	if(entry->name == NULL) {
+		ERROR("Skipping \"%s\" in archive \"%s\", it refers to "
+			"\"..\"\n", name, archive->filename);
+		goto skip;
+	}
+
+	switch(mode & S_IFMT) {
+	case S_IFREG:
+	case S_IFDIR:
+	case S_IFCHR:
+	case S_IFBLK:
+	case S_IFIFO:
+	case S_IFSOCK:
+		entry->link = NULL;
+		break;
+	case S_IFLNK:
+		/* the symbolic link target is stored as the file data */
+		if(size > ARCHIVE_LINK_MAX) {
+			ERROR("Skipping \"%s\" in archive \"%s\", symbolic link"
+				" target too long\n", name, archive->filename);
+			free(entry->name);
+			goto skip;
+		}
+
+		entry->link = malloc(size + 1);
+		if(entry->link == NULL)
+			MEM_ERROR();
+		if(archive_get(archive, entry->link, size) != size)
+			BAD_ERROR("Unexpected end of archive \"%s\"\n",
+				archive->filename);
+		entry->link[size] = '\0';
+		archive_skip(archive, archive->padding);
+		archive->padding = 0;
+		size = 0;
+		break;
+	default:
+		ERROR("Skipping \"%s\" in archive \"%s\", unsupported file type"
+			" 0%llo\n", name, archive->filename, mode & S_IFMT);
+		free(entry->name);
+		goto skip;
+	}
+
+	free(name);
+	free(archive->name);
+	free(archive->link);
+	archive->name = entry->name;
+	archive->link = entry->link;
+
+	entry->hardlink = FALSE;
+	entry->mode = mode & (S_IFMT | 07777);
+	entry->dev = (dev_major << 32) | dev_minor;
+	entry->major = rdev_major;
+	entry->minor = rdev_minor;
+	entry->size = (mode & S_IFMT) == S_IFREG ? size : 0;
+	entry->xattrs = 0;
+	entry->xattr_list = NULL;
+	archive->remaining = size;
+
+	return TRUE;
+
+skip:
+	free(name);
+	archive_skip(archive, size + archive->padding);
+	archive->padding = 0;
+	goto again;
+}
+
+
+/*
+ * Get the next entry from the archive, skipping any of the data of the
+ * previous entry which hasn't been read.  Returns FALSE at the end of the
+ * archive.  The entry's name and link are valid until the next call, the
+ * xattr list belongs to the caller
+ */
+int archive_next(struct archive *archive, struct archive_entry *entry)
+{
+	archive_skip(archive, archive->remaining + archive->padding);
+	archive->remaining = 0;
+	archive->padding = 0;
+
+	if(archive->format == ARCHIVE_TAR)
+		return tar_next(archive, entry);
+	else
+		return cpio_next(archive, entry);
+}
@@ -0,0 +1,83 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+/*
+ * Create a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2014
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * archive.h
+ */
+
+#define ARCHIVE_TAR		1
+#define ARCHIVE_CPIO		2
+
+#define ARCHIVE_BUFFER_SIZE	(128 * 1024)
+
+/* largest cpio symbolic link target, which is stored as the file data */
+#define ARCHIVE_LINK_MAX	65536
+
+struct xattr_list;
+
+/*
+ * An entry read from a tar or cpio archive.  Name is the canonical
+ * pathname within the archive, with no leading "/" or "./", and "" for
+ * the root directory.  If hardlink is set, link is the canonical pathname
+ * of an earlier entry this is a hard link to, otherwise for symbolic links
+ * it is the link target.  Cpio archives identify hard links by dev and
+ * ino instead, with the file data stored with one of the links
+ */
+struct archive_entry {
+	char			*name;
+	char			*link;
+	int			hardlink;
+	unsigned int		mode;
+	unsigned int		uid;
+	unsigned int		gid;
+	long long		mtime;
+	long long		size;
+	unsigned int		major;
+	unsigned int		minor;
+	unsigned long long	dev;
+	unsigned long long	ino;
+	unsigned int		nlink;
+	int			xattrs;
+	struct xattr_list	*xattr_list;
+};
+
+struct archive {
+	int			fd;
+	int			format;
+	char			*filename;
+	char			*buffer;
+	int			start;
+	int			end;
+	long long		offset;
+	long long		remaining;
+	int			padding;
+	char			*name;
+	char			*link;
+	int			xattrs;
+	struct xattr_list	*xattr_list;
+};
+
+extern struct archive *archive_open(char *, int);
+extern int archive_next(struct archive *, struct archive_entry *);
+extern int archive_read(struct archive *, void *, int);
+extern void archive_close(struct archive *);
+#endif
@@ -0,0 +1,133 @@
+/*
+ * Create a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2014
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * arena.c
+ *
+ * Arena allocation of the many small structures built when scanning the
+ * source directories.  Allocating these one by one with malloc costs
+ * a header per structure and fragments the heap, with millions of
+ * files this is a significant part of the memory used.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "error.h"
+#include "arena.h"
+
+struct arena *arena_init()
+{
+	struct arena *arena = malloc(sizeof(struct arena));
+
+	if(arena == NULL)
+		MEM_ERROR();
+
+	arena->blocks = NULL;
+	arena->next = NULL;
+	arena->left = 0;
+
+	return arena;
+}
+
+
+static struct arena_block *arena_add_block(struct arena *arena, size_t size)
+{
+	struct arena_block *block = malloc(sizeof(struct arena_block) + size);
+
+	if(block == NULL)
+		MEM_ERROR();
+
+	block->next = arena->blocks;
+	arena->blocks = block;
+
+	return block;
+}
+
+
+void *arena_alloc(struct arena *arena, size_t size)
+{
+	void *ptr;
+
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+	if(size > arena->left) {
+		struct arena_block *block;
+
+		/*
+		 * Large allocations get a block of their own, so as not to
+		 * waste the remainder of the current block
+		 */
+		if(size > ARENA_BLOCK_SIZE / 4)
+			return arena_add_block(arena, size)->data;
+
+		block = arena_add_block(arena, ARENA_BLOCK_SIZE);
+		arena->next = (char *) block->data;
+		arena->left = ARENA_BLOCK_SIZE;
+	}
+
+	ptr = arena->next;
+	arena->next += size;
+	arena->left -= size;
+
+	return ptr;
+}
+
+
+void arena_free(struct arena *arena)
+{
+	struct arena_block *block = arena->blocks;
+
+	while(block) {
+		struct arena_block *next = block->next;
+
+		free(block);
+		block = next;
+	}
+
+	free(arena);
+}
+
+
+void slab_init(struct slab *slab, struct arena *arena, size_t size)
+{
+	slab->arena = arena;
+	slab->size = size < sizeof(void *) ? sizeof(void *) : size;
+	slab->free_list = NULL;
+}
+
+
+void *slab_alloc(struct slab *slab)
+{
+	void *ptr = slab->free_list;
+
+	if(ptr == NULL)
+		return arena_alloc(slab->arena, slab->size);
+
+	slab->free_list = *(void **) ptr;
+	return ptr;
+}
+
+
+void slab_free(struct slab *slab, void *ptr)
+{
+	*(void **) ptr = slab->free_list;
+	slab->free_list = ptr;
+}
@@ -0,0 +1,66 @@
+#ifndef ARENA_H
+#define ARENA_H
+/*
+ * Create a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2014
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * arena.h
+ */
+
+#define ARENA_BLOCK_SIZE (1024 * 1024)
+#define ARENA_ALIGN 8
+
+/* struct describing a block of memory allocated from by an arena */
+struct arena_block {
+	struct arena_block	*next;
+	long long		data[0];
+};
+
+
+/*
+ * struct describing an arena.  Memory is handed out from large blocks,
+ * and is only ever freed all at once.  An arena isn't locked, and must
+ * only be used by one thread at a time
+ */
+struct arena {
+	struct arena_block	*blocks;
+	char			*next;
+	size_t			left;
+};
+
+
+/*
+ * struct describing a slab of same sized objects allocated from an arena.
+ * Freed objects are kept on a free list and reused
+ */
+struct slab {
+	struct arena		*arena;
+	size_t			size;
+	void			*free_list;
+};
+
+
+extern struct arena *arena_init();
+extern void *arena_alloc(struct arena *, size_t);
+extern void arena_free(struct arena *);
+extern void slab_init(struct slab *, struct arena *, size_t);
+extern void *slab_alloc(struct slab *);
+extern void slab_free(struct slab *, void *);
+#endif
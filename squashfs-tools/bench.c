@@ -0,0 +1,370 @@
+/*
+ * Create a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2014
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * bench.c
+ */
+
+/*
+ * Mksquashfs benchmarks.  This generates the synthetic source trees used
+ * by benchmark.sh, and micro-benchmarks the functions mksquashfs spends
+ * its time in.  It is linked with the mksquashfs objects (mksquashfs.c
+ * being compiled with its main() renamed), so the functions measured are
+ * exactly those built into mksquashfs
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "squashfs_fs.h"
+#include "mksquashfs.h"
+#include "caches-queues-lists.h"
+#include "compressor.h"
+#include "hash.h"
+#include "error.h"
+
+#define FALSE 0
+#define TRUE 1
+
+/* size of the buffers the micro-benchmarks work on */
+#define BENCH_BLOCK SQUASHFS_FILE_SIZE
+
+/* minimum time each micro-benchmark is run for, in nanoseconds */
+#define BENCH_TIME 500000000LL
+
+extern struct compressor *compressor[];
+extern unsigned short get_checksum(char *, int, unsigned short);
+extern int all_zero(struct file_buffer *);
+extern int mangle2(void *, char *, char *, int, int, int, int, int);
+
+static unsigned long long seed = 0x9e3779b97f4a7c15ULL;
+
+static char *words[] = {
+	"the", "squashfs", "filesystem", "block", "fragment", "inode",
+	"directory", "compressed", "data", "of", "and", "to", "is", "a",
+	"file", "table", "size", "with", "for", "in", "read", "write",
+	"kernel", "cache", "queue", "thread", "\n", "0x", "int", "return"
+};
+
+
+static unsigned long long bench_random()
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+
+	return seed;
+}
+
+
+static long long bench_time()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+/* Fill buffer with compressible text-like data */
+static void fill_text(char *buffer, int size)
+{
+	int i = 0;
+
+	while(i < size) {
+		char *word = words[bench_random() % (sizeof(words) /
+			sizeof(char *))];
+		int len = strlen(word);
+
+		if(len > size - i - 1)
+			len = size - i - 1;
+		memcpy(buffer + i, word, len);
+		i += len;
+		if(i < size)
+			buffer[i ++] = ' ';
+	}
+}
+
+
+/* Fill buffer with incompressible data */
+static void fill_random(char *buffer, int size)
+{
+	int i;
+
+	for(i = 0; i < size; i++)
+		buffer[i] = bench_random() >> 32;
+}
+
+
+static void write_file(char *pathname, char *buffer, long long size,
+	int sparse)
+{
+	/*
+	 * Write a file of size bytes of buffer.  Sparse files only have
+	 * one buffer written every 16 buffers
+	 */
+	int fd = open(pathname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	long long offset;
+
+	if(fd == -1) {
+		fprintf(stderr, "bench: failed to create %s because %s\n",
+			pathname, strerror(errno));
+		exit(1);
+	}
+
+	for(offset = 0; offset < size; offset += BENCH_BLOCK) {
+		int bytes = size - offset < BENCH_BLOCK ? size - offset :
+			BENCH_BLOCK;
+
+		if(sparse && (offset / BENCH_BLOCK) % 16)
+			continue;
+
+		if(pwrite(fd, buffer, bytes, offset) != bytes) {
+			fprintf(stderr, "bench: failed to write %s because "
+				"%s\n", pathname, strerror(errno));
+			exit(1);
+		}
+	}
+
+	if(ftruncate(fd, size) == -1 || close(fd) == -1) {
+		fprintf(stderr, "bench: failed to write %s because %s\n",
+			pathname, strerror(errno));
+		exit(1);
+	}
+}
+
+
+static void make_dir(char *pathname)
+{
+	if(mkdir(pathname, 0755) == -1 && errno != EEXIST) {
+		fprintf(stderr, "bench: failed to create %s because %s\n",
+			pathname, strerror(errno));
+		exit(1);
+	}
+}
+
+
+static int generate(char *corpus, char *dir, int scale)
+{
+	/*
+	 * Generate one of the synthetic source trees in dir.  The trees
+	 * only depend on the corpus and scale, and so are the same on every
+	 * run
+	 */
+	char *buffer = malloc(BENCH_BLOCK), pathname[4096];
+	int i;
+
+	if(buffer == NULL)
+		MEM_ERROR();
+
+	make_dir(dir);
+
+	if(strcmp(corpus, "tiny") == 0) {
+		/* many tiny files, in 100 directories */
+		for(i = 0; i < 100 * scale; i++) {
+			int j;
+
+			sprintf(pathname, "%s/%d", dir, i);
+			make_dir(pathname);
+			for(j = 0; j < 200; j++) {
+				int size = bench_random() % 1024;
+
+				fill_text(buffer, size);
+				sprintf(pathname, "%s/%d/file%d", dir, i, j);
+				write_file(pathname, buffer, size, FALSE);
+			}
+		}
+	} else if(strcmp(corpus, "huge") == 0) {
+		/* a few huge files */
+		for(i = 0; i < 4; i++) {
+			fill_text(buffer, BENCH_BLOCK);
+			sprintf(pathname, "%s/huge%d", dir, i);
+			write_file(pathname, buffer, 64LL * scale << 20, FALSE);
+		}
+	} else if(strcmp(corpus, "sparse") == 0) {
+		/* sparse files, with one block in 16 written */
+		for(i = 0; i < 4; i++) {
+			fill_text(buffer, BENCH_BLOCK);
+			sprintf(pathname, "%s/sparse%d", dir, i);
+			write_file(pathname, buffer, 64LL * scale << 20, TRUE);
+		}
+	} else if(strcmp(corpus, "dup") == 0) {
+		/* files with only 50 different contents */
+		for(i = 0; i < 2000 * scale; i++) {
+			int content = i % 50, size = (content % 32 + 1) * 4096;
+
+			seed = content + 1;
+			fill_text(buffer, size);
+			sprintf(pathname, "%s/dup%d", dir, i);
+			write_file(pathname, buffer, size, FALSE);
+		}
+	} else if(strcmp(corpus, "random") == 0) {
+		/* incompressible data */
+		for(i = 0; i < 16 * scale; i++) {
+			char *data = malloc(4 << 20);
+
+			if(data == NULL)
+				MEM_ERROR();
+
+			fill_random(data, 4 << 20);
+			sprintf(pathname, "%s/random%d", dir, i);
+			write_file(pathname, data, 4 << 20, FALSE);
+			free(data);
+		}
+	} else {
+		fprintf(stderr, "bench: unknown corpus %s\n", corpus);
+		return 1;
+	}
+
+	free(buffer);
+	return 0;
+}
+
+
+static void report(char *name, long long ops, long long bytes,
+	long long elapsed)
+{
+	printf("%-28s %10.1f ns/op", name, (double) elapsed / ops);
+	if(bytes)
+		printf(" %10.1f MB/s", bytes * 1000.0 / elapsed);
+	printf("\n");
+}
+
+
+/* Run statement repeatedly for at least BENCH_TIME, and report it */
+#define BENCH(name, bytes, statement) do { \
+	long long ops = 0, start = bench_time(), elapsed; \
+	do { \
+		int _i; \
+		for(_i = 0; _i < 16; _i++) { \
+			statement; \
+		} \
+		ops += 16; \
+		elapsed = bench_time() - start; \
+	} while(elapsed < BENCH_TIME); \
+	report(name, ops, (long long) (bytes) * ops, elapsed); \
+} while(0)
+
+
+static void bench_compressor(struct compressor *comp_ops, char *text,
+	char *data, char *dest)
+{
+	void *stream = NULL;
+	char name[64];
+	volatile int c_byte;
+
+	comp = comp_ops;
+	if(compressor_options_post(comp, BENCH_BLOCK) == -1 ||
+			compressor_init(comp, &stream, BENCH_BLOCK, 1)) {
+		fprintf(stderr, "bench: failed to initialise %s\n", comp->name);
+		return;
+	}
+
+	sprintf(name, "mangle2 %s text", comp->name);
+	BENCH(name, BENCH_BLOCK, c_byte = mangle2(stream, dest, text,
+		BENCH_BLOCK, BENCH_BLOCK, FALSE, TRUE, -1));
+
+	sprintf(name, "mangle2 %s random", comp->name);
+	BENCH(name, BENCH_BLOCK, c_byte = mangle2(stream, dest, data,
+		BENCH_BLOCK, BENCH_BLOCK, FALSE, TRUE, -1));
+
+	(void) c_byte;
+}
+
+
+static int micro(char *comp_name)
+{
+	struct file_buffer *zero, *text;
+	struct queue *queue = queue_init(1024);
+	struct cache *cache = cache_init(BENCH_BLOCK, 64, 1, 0);
+	char *random = malloc(BENCH_BLOCK), *dest = malloc(BENCH_BLOCK);
+	volatile unsigned long long result;
+	int i;
+
+	zero = calloc(1, sizeof(struct file_buffer) + BENCH_BLOCK);
+	text = calloc(1, sizeof(struct file_buffer) + BENCH_BLOCK);
+	if(zero == NULL || text == NULL || random == NULL || dest == NULL)
+		MEM_ERROR();
+
+	zero->data = zero->buffer;
+	zero->size = BENCH_BLOCK;
+	text->data = text->buffer;
+	text->size = BENCH_BLOCK;
+	fill_text(text->data, BENCH_BLOCK);
+	fill_random(random, BENCH_BLOCK);
+
+	BENCH("get_checksum", BENCH_BLOCK,
+		result = get_checksum(text->data, BENCH_BLOCK, 0));
+	BENCH("hash64", BENCH_BLOCK,
+		result = hash64(text->data, BENCH_BLOCK, 0));
+	BENCH("all_zero zero block", BENCH_BLOCK, result = all_zero(zero));
+	BENCH("all_zero data block", 0, result = all_zero(text));
+	BENCH("queue_put/queue_get", 0,
+		queue_put(queue, text); result = (long) queue_get(queue));
+	BENCH("cache_get_nohash/put", 0,
+		cache_block_put(cache_get_nohash(cache)));
+	BENCH("cache_get/lookup/put", 0, do {
+		struct file_buffer *entry = cache_get(cache, _i);
+
+		cache_block_put(cache_lookup(cache, _i));
+		cache_block_put(entry);
+	} while(0));
+
+	for(i = 0; compressor[i]->id; i++)
+		if(compressor[i]->supported && (comp_name == NULL ||
+				strcmp(comp_name, compressor[i]->name) == 0))
+			bench_compressor(compressor[i], text->data, random,
+				dest);
+
+	(void) result;
+	return 0;
+}
+
+
+static void usage(char *name)
+{
+	fprintf(stderr, "SYNTAX: %s -generate tiny|huge|sparse|dup|random "
+		"<dir> [scale]\n", name);
+	fprintf(stderr, "        %s -micro [compressor]\n", name);
+	exit(1);
+}
+
+
+int main(int argc, char *argv[])
+{
+	if(argc >= 4 && strcmp(argv[1], "-generate") == 0)
+		return generate(argv[2], argv[3], argc > 4 ? atoi(argv[4]) : 1);
+
+	if(argc >= 2 && strcmp(argv[1], "-micro") == 0)
+		return micro(argc > 2 ? argv[2] : NULL);
+
+	usage(argv[0]);
+	return 1;
+}
@@ -0,0 +1,72 @@
+#!/bin/sh
+#
+# Squashfs benchmarks, run by "make benchmark".
+#
+# Generates the synthetic source trees (once, they're kept in $BENCH_DIR),
+# times mksquashfs and unsquashfs on each of them with each compressor and
+# number of processors, and then runs the bench micro-benchmarks.  Each
+# extracted filesystem is compared against its source tree, a benchmark of
+# a broken build is worth nothing.
+#
+
+BENCH_DIR=${BENCH_DIR:-/tmp/squashfs-benchmark}
+BENCH_CORPORA=${BENCH_CORPORA:-"tiny huge sparse dup random"}
+BENCH_COMPRESSORS=${BENCH_COMPRESSORS:-gzip}
+BENCH_PROCESSORS=${BENCH_PROCESSORS:-1}
+BENCH_SCALE=${BENCH_SCALE:-1}
+
+now() {
+	date +%s.%N
+}
+
+elapsed() {
+	echo "$1 $2" | awk '{ printf "%.2f", $2 - $1 }'
+}
+
+mkdir -p "$BENCH_DIR" || exit 1
+
+for corpus in $BENCH_CORPORA; do
+	if [ ! -d "$BENCH_DIR/$corpus" ]; then
+		echo "Generating $corpus corpus"
+		./bench -generate $corpus "$BENCH_DIR/$corpus" $BENCH_SCALE ||
+			exit 1
+	fi
+done
+
+printf "\n%-8s %-6s %5s %12s %10s %10s\n" corpus comp procs "image size" \
+	mksquashfs unsquashfs
+
+for corpus in $BENCH_CORPORA; do
+	for comp in $BENCH_COMPRESSORS; do
+		for procs in $BENCH_PROCESSORS; do
+			image="$BENCH_DIR/$corpus.sqsh"
+			output="$BENCH_DIR/$corpus.out"
+
+			rm -rf "$image" "$output"
+
+			start=$(now)
+			./mksquashfs "$BENCH_DIR/$corpus" "$image" -noappend \
+				-no-progress -comp $comp -processors $procs \
+				> /dev/null || exit 1
+			middle=$(now)
+			./unsquashfs -d "$output" -no-progress -processors \
+				$procs "$image" > /dev/null || exit 1
+			end=$(now)
+
+			if ! diff -rq "$BENCH_DIR/$corpus" "$output" > /dev/null
+			then
+				echo "$corpus: extracted filesystem differs" >&2
+				exit 1
+			fi
+
+			printf "%-8s %-6s %5s %12s %10s %10s\n" $corpus $comp \
+				$procs $(wc -c < "$image") \
+				$(elapsed $start $middle) $(elapsed $middle $end)
+
+			rm -rf "$image" "$output"
+		done
+	done
+done
+
+echo
+./bench -micro
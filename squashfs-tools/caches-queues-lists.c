@@ -26,9 +26,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "error.h"
 #include "caches-queues-lists.h"
+#include "numa.h"
+#include "stats.h"
 
 extern int add_overflow(int, int);
 extern int multiply_overflow(int, int);
@@ -36,121 +41,28 @@ extern int multiply_overflow(int, int);
 #define TRUE 1
 #define FALSE 0
 
-struct queue *queue_init(int size)
-{
-	struct queue *queue = malloc(sizeof(struct queue));
-
-	if(queue == NULL)
-		MEM_ERROR();
-
-	if(add_overflow(size, 1) ||
-				multiply_overflow(size + 1, sizeof(void *)))
-		BAD_ERROR("Size too large in queue_init\n");
-
-	queue->data = malloc(sizeof(void *) * (size + 1));
-	if(queue->data == NULL)
-		MEM_ERROR();
-
-	queue->size = size + 1;
-	queue->readp = queue->writep = 0;
-	pthread_mutex_init(&queue->mutex, NULL);
-	pthread_cond_init(&queue->empty, NULL);
-	pthread_cond_init(&queue->full, NULL);
-
-	return queue;
-}
-
-
-void queue_put(struct queue *queue, void *data)
-{
-	int nextp;
-
-	pthread_cleanup_push((void *) pthread_mutex_unlock, &queue->mutex);
-	pthread_mutex_lock(&queue->mutex);
-
-	while((nextp = (queue->writep + 1) % queue->size) == queue->readp)
-		pthread_cond_wait(&queue->full, &queue->mutex);
-
-	queue->data[queue->writep] = data;
-	queue->writep = nextp;
-	pthread_cond_signal(&queue->empty);
-	pthread_cleanup_pop(1);
-}
-
-
-void *queue_get(struct queue *queue)
-{
-	void *data;
-
-	pthread_cleanup_push((void *) pthread_mutex_unlock, &queue->mutex);
-	pthread_mutex_lock(&queue->mutex);
-
-	while(queue->readp == queue->writep)
-		pthread_cond_wait(&queue->empty, &queue->mutex);
-
-	data = queue->data[queue->readp];
-	queue->readp = (queue->readp + 1) % queue->size;
-	pthread_cond_signal(&queue->full);
-	pthread_cleanup_pop(1);
-
-	return data;
-}
-
-
-int queue_empty(struct queue *queue)
-{
-	int empty;
-
-	pthread_cleanup_push((void *) pthread_mutex_unlock, &queue->mutex);
-	pthread_mutex_lock(&queue->mutex);
-
-	empty = queue->readp == queue->writep;
-
-	pthread_cleanup_pop(1);
-
-	return empty;
-}
-
-
-void queue_flush(struct queue *queue)
-{
-	pthread_cleanup_push((void *) pthread_mutex_unlock, &queue->mutex);
-	pthread_mutex_lock(&queue->mutex);
-
-	queue->readp = queue->writep;
-
-	pthread_cleanup_pop(1);
-}
-
-
-void dump_queue(struct queue *queue)
-{
-	pthread_cleanup_push((void *) pthread_mutex_unlock, &queue->mutex);
-	pthread_mutex_lock(&queue->mutex);
-
-	printf("\tMax size %d, size %d%s\n", queue->size - 1,  
-		queue->readp <= queue->writep ? queue->writep - queue->readp :
-			queue->size - queue->readp + queue->writep,
-		queue->readp == queue->writep ? " (EMPTY)" :
-			((queue->writep + 1) % queue->size) == queue->readp ?
-			" (FULL)" : "");
-
-	pthread_cleanup_pop(1);
-}
-
-
-/* define seq queue hash tables */
-#define CALCULATE_SEQ_HASH(N) CALCULATE_HASH(N)
-
-/* Called with the seq queue mutex held */
-INSERT_HASH_TABLE(seq, struct seq_queue, CALCULATE_SEQ_HASH, sequence, seq)
-
-/* Called with the cache mutex held */
-REMOVE_HASH_TABLE(seq, struct seq_queue, CALCULATE_SEQ_HASH, sequence, seq);
-
-static unsigned int sequence = 0;
+static pthread_mutex_t map_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/*
+ * Every file_map allocated, newest first, and the ones not in use (both
+ * protected by map_mutex, but map_list is also walked by the SIGBUS handler
+ * without locking)
+ */
+static struct file_map *map_list = NULL;
+static struct file_map *free_maps = NULL;
+static pthread_once_t map_once = PTHREAD_ONCE_INIT;
+static long page_size;
 
+/*
+ * The seq queue is a reorder buffer of SEQ_QUEUE_SLOTS slots, indexed by
+ * sequence.  Each slot is a list of the buffers for that slot, which the
+ * threads putting buffers push onto without locking.  There's only one
+ * thread getting buffers from a seq queue, and it only ever removes the
+ * buffer with the next sequence, and so it is the only thread changing a
+ * list other than at its head.  The getting thread only sleeps if the
+ * buffer it wants hasn't arrived, setting waiting to its sequence, and only
+ * the thread putting that buffer takes the mutex and wakes it
+ */
 struct seq_queue *seq_queue_init()
 {
 	struct seq_queue *queue = malloc(sizeof(struct seq_queue));
@@ -158,6 +70,7 @@ struct seq_queue *seq_queue_init()
 		MEM_ERROR();
 
 	memset(queue, 0, sizeof(struct seq_queue));
+	queue->waiting = -1;
 
 	pthread_mutex_init(&queue->mutex, NULL);
 	pthread_cond_init(&queue->wait, NULL);
@@ -168,20 +81,65 @@ struct seq_queue *seq_queue_init()
 
 void seq_queue_put(struct seq_queue *queue, struct file_buffer *entry)
 {
-	pthread_cleanup_push((void *) pthread_mutex_unlock, &queue->mutex);
-	pthread_mutex_lock(&queue->mutex);
+	long long sequence = entry->sequence;
+	struct file_buffer **slot = &queue->slot[SEQ_QUEUE_SLOT(sequence)];
 
-	insert_seq_hash_table(queue, entry);
+	int depth;
 
 	if(entry->fragment)
-		queue->fragment_count ++;
+		depth = __atomic_add_fetch(&queue->fragment_count, 1,
+			__ATOMIC_RELAXED);
 	else
-		queue->block_count ++;
-
-	if(entry->sequence == sequence)
+		depth = __atomic_add_fetch(&queue->block_count, 1,
+			__ATOMIC_RELAXED);
+
+	if(queue->depth)
+		__atomic_add_fetch(&queue->depth[QUEUE_DEPTH_BUCKET(depth)], 1,
+			__ATOMIC_RELAXED);
+
+	/* once pushed, the entry may be got (and freed) at any time */
+	entry->seq_next = __atomic_load_n(slot, __ATOMIC_RELAXED);
+	while(!__atomic_compare_exchange_n(slot, &entry->seq_next, entry, TRUE,
+					__ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+	if(__atomic_load_n(&queue->waiting, __ATOMIC_SEQ_CST) == sequence) {
+		pthread_cleanup_push((void *) pthread_mutex_unlock,
+							&queue->mutex);
+		pthread_mutex_lock(&queue->mutex);
 		pthread_cond_signal(&queue->wait);
+		pthread_cleanup_pop(1);
+	}
+}
 
-	pthread_cleanup_pop(1);
+
+/* Remove and return the buffer with sequence from its slot, if there */
+static struct file_buffer *seq_queue_take(struct seq_queue *queue,
+	long long sequence)
+{
+	struct file_buffer **slot = &queue->slot[SEQ_QUEUE_SLOT(sequence)];
+	struct file_buffer *head, *prev, *entry;
+
+	while(1) {
+		head = __atomic_load_n(slot, __ATOMIC_SEQ_CST);
+		if(head == NULL)
+			return NULL;
+
+		if(head->sequence != sequence)
+			break;
+
+		/* fails (and retries) if a buffer has been pushed since */
+		if(__atomic_compare_exchange_n(slot, &head, head->seq_next,
+				FALSE, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return head;
+	}
+
+	for(prev = head; (entry = prev->seq_next); prev = entry)
+		if(entry->sequence == sequence) {
+			prev->seq_next = entry->seq_next;
+			return entry;
+		}
+
+	return NULL;
 }
 
 
@@ -191,40 +149,34 @@ struct file_buffer *seq_queue_get(struct seq_queue *queue)
 	 * Look-up buffer matching sequence in the queue, if found return
 	 * it, otherwise wait until it arrives
 	 */
-	int hash = CALCULATE_SEQ_HASH(sequence);
-	struct file_buffer *entry;
-
-	pthread_cleanup_push((void *) pthread_mutex_unlock, &queue->mutex);
-	pthread_mutex_lock(&queue->mutex);
-
-	while(1) {
-		for(entry = queue->hash_table[hash]; entry;
-						entry = entry->seq_next)
-			if(entry->sequence == sequence)
-				break;
+	long long sequence = queue->sequence;
+	struct file_buffer *entry = seq_queue_take(queue, sequence);
 
-		if(entry) {
-			/*
-			 * found the buffer in the queue, decrement the
-			 * appropriate count, and remove from hash list
-			 */
-			if(entry->fragment)
-				queue->fragment_count --;
-			else
-				queue->block_count --;
+	if(entry == NULL) {
+		long long start = queue_get_wait ? stats_time() : 0;
 
-			remove_seq_hash_table(queue, entry);
+		pthread_cleanup_push((void *) pthread_mutex_unlock,
+							&queue->mutex);
+		pthread_mutex_lock(&queue->mutex);
 
-			sequence ++;
+		__atomic_store_n(&queue->waiting, sequence, __ATOMIC_SEQ_CST);
+		while((entry = seq_queue_take(queue, sequence)) == NULL)
+			pthread_cond_wait(&queue->wait, &queue->mutex);
+		__atomic_store_n(&queue->waiting, -1, __ATOMIC_RELAXED);
 
-			break;
-		}
+		pthread_cleanup_pop(1);
 
-		/* entry not found, wait for it to arrive */	
-		pthread_cond_wait(&queue->wait, &queue->mutex);
+		if(queue_get_wait)
+			__atomic_add_fetch(queue_get_wait, stats_time() - start,
+				__ATOMIC_RELAXED);
 	}
 
-	pthread_cleanup_pop(1);
+	if(entry->fragment)
+		__atomic_sub_fetch(&queue->fragment_count, 1, __ATOMIC_RELAXED);
+	else
+		__atomic_sub_fetch(&queue->block_count, 1, __ATOMIC_RELAXED);
+
+	queue->sequence ++;
 
 	return entry;
 }
@@ -234,15 +186,20 @@ void seq_queue_flush(struct seq_queue *queue)
 {
 	int i;
 
-	pthread_cleanup_push((void *) pthread_mutex_unlock, &queue->mutex);
-	pthread_mutex_lock(&queue->mutex);
+	for(i = 0; i < SEQ_QUEUE_SLOTS; i++)
+		__atomic_store_n(&queue->slot[i], NULL, __ATOMIC_RELAXED);
 
-	for(i = 0; i < HASH_SIZE; i++)
-		queue->hash_table[i] = NULL;
+	__atomic_store_n(&queue->fragment_count, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&queue->block_count, 0, __ATOMIC_RELAXED);
+}
 
-	queue->fragment_count = queue->block_count = 0;
 
-	pthread_cleanup_pop(1);
+/* As queue_count_depth(), the depth counting blocks and fragments */
+void seq_queue_count_depth(struct seq_queue *queue)
+{
+	queue->depth = calloc(QUEUE_DEPTH_BUCKETS, sizeof(long long));
+	if(queue->depth == NULL)
+		MEM_ERROR();
 }
 
 
@@ -250,40 +207,88 @@ void dump_seq_queue(struct seq_queue *queue, int fragment_queue)
 {
 	int size;
 
-	pthread_cleanup_push((void *) pthread_mutex_unlock, &queue->mutex);
-	pthread_mutex_lock(&queue->mutex);
-
-	size = fragment_queue ? queue->fragment_count : queue->block_count;
+	size = __atomic_load_n(fragment_queue ? &queue->fragment_count :
+		&queue->block_count, __ATOMIC_RELAXED);
 
 	printf("\tMax size unlimited, size %d%s\n", size,
 						size == 0 ? " (EMPTY)" : "");
-
-	pthread_cleanup_pop(1);
 }
 
 
+/*
+ * Caches are sharded.  The hash table buckets and the free lists are
+ * split into CACHE_SHARDS sets, each protected by its own mutex, and a
+ * block is kept in the shard its index hashes to.  The buffer counts are
+ * updated atomically, and so getting, looking up and putting blocks
+ * only takes the lock of the one shard involved.  The cache mutex is
+ * only used by threads waiting for a free block.
+ *
+ * Unhashed blocks are put onto the free list of a shard chosen per
+ * thread, and threads look for free blocks starting at their own shard,
+ * so different threads mostly work on different free lists
+ *
+ * A cache may be governed.  Once a governed cache has used up its own
+ * max_buffers and has no free blocks it borrows a buffer from the
+ * governor's pool, or failing that takes a free block from another
+ * governed cache which holds borrowed buffers.  Buffers therefore move
+ * to whichever cache is busy, while each cache can always grow to its own
+ * max_buffers, and the governed caches in total never exceed the sum of
+ * their max_buffers and the pool
+ */
+
 /* define cache hash tables */
 #define CALCULATE_CACHE_HASH(N) CALCULATE_HASH(llabs(N))
 
-/* Called with the cache mutex held */
+/* Called with the cache shard mutex held */
 INSERT_HASH_TABLE(cache, struct cache, CALCULATE_CACHE_HASH, index, hash)
 
-/* Called with the cache mutex held */
+/* Called with the cache shard mutex held */
 REMOVE_HASH_TABLE(cache, struct cache, CALCULATE_CACHE_HASH, index, hash);
 
 /* define cache free list */
 
-/* Called with the cache mutex held */
+/* Called with the cache shard mutex held */
 INSERT_LIST(free, struct file_buffer)
 
-/* Called with the cache mutex held */
+/* Called with the cache shard mutex held */
 REMOVE_LIST(free, struct file_buffer)
 
 
+static __thread int thread_shard = -1;
+static int next_shard = 0;
+
+
+static int cache_thread_shard()
+{
+	/*
+	 * With -numa the shards are divided between the nodes, so
+	 * unhashed blocks are put onto, and mostly taken from, the free
+	 * lists of the node they were used on
+	 */
+	if(thread_shard == -1) {
+		int shards = CACHE_SHARDS / numa_nodes;
+
+		thread_shard = numa_this_node() * shards +
+			__atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) %
+			shards;
+	}
+
+	return thread_shard;
+}
+
+
+static struct cache_shard *cache_index_shard(struct cache *cache,
+	long long index)
+{
+	return &cache->shard[CACHE_SHARD(CALCULATE_CACHE_HASH(index))];
+}
+
+
 struct cache *cache_init(int buffer_size, int max_buffers, int noshrink_lookup,
 	int first_freelist)
 {
 	struct cache *cache = malloc(sizeof(struct cache));
+	int i;
 
 	if(cache == NULL)
 		MEM_ERROR();
@@ -291,8 +296,12 @@ struct cache *cache_init(int buffer_size, int max_buffers, int noshrink_lookup,
 	cache->max_buffers = max_buffers;
 	cache->buffer_size = buffer_size;
 	cache->count = 0;
+	cache->borrowed = 0;
+	cache->governor = NULL;
+	cache->pool = NULL;
 	cache->used = 0;
-	cache->free_list = NULL;
+	cache->free_count = 0;
+	cache->waiting = 0;
 
 	/*
 	 * The cache will grow up to max_buffers in size in response to
@@ -322,23 +331,29 @@ struct cache *cache_init(int buffer_size, int max_buffers, int noshrink_lookup,
 	memset(cache->hash_table, 0, sizeof(struct file_buffer *) * 65536);
 	pthread_mutex_init(&cache->mutex, NULL);
 	pthread_cond_init(&cache->wait_for_free, NULL);
-	pthread_cond_init(&cache->wait_for_unlock, NULL);
+
+	for(i = 0; i < CACHE_SHARDS; i++) {
+		pthread_mutex_init(&cache->shard[i].mutex, NULL);
+		pthread_cond_init(&cache->shard[i].wait_for_unlock, NULL);
+		cache->shard[i].free_list = NULL;
+	}
 
 	return cache;
 }
 
 
-struct file_buffer *cache_lookup(struct cache *cache, long long index)
+/* Called with the cache shard mutex held */
+static struct file_buffer *cache_find(struct cache *cache,
+	struct cache_shard *shard, long long index)
 {
-	/* Lookup block in the cache, if found return with usage count
- 	 * incremented, if not found return NULL */
-	int hash = CALCULATE_CACHE_HASH(index);
+	/*
+	 * Lookup block in the hash table, if found return with usage
+	 * count incremented, if not found return NULL
+	 */
 	struct file_buffer *entry;
 
-	pthread_cleanup_push((void *) pthread_mutex_unlock, &cache->mutex);
-	pthread_mutex_lock(&cache->mutex);
-
-	for(entry = cache->hash_table[hash]; entry; entry = entry->hash_next)
+	for(entry = cache->hash_table[CALCULATE_CACHE_HASH(index)]; entry;
+						entry = entry->hash_next)
 		if(entry->index == index)
 			break;
 
@@ -347,12 +362,26 @@ struct file_buffer *cache_lookup(struct cache *cache, long long index)
  		 * if necessary remove from free list so it won't disappear
  		 */
 		if(entry->used == 0) {
-			remove_free_list(&cache->free_list, entry);
-			cache->used ++;
+			remove_free_list(&shard->free_list, entry);
+			__atomic_sub_fetch(&cache->free_count, 1,
+				__ATOMIC_RELAXED);
+			__atomic_add_fetch(&cache->used, 1, __ATOMIC_RELAXED);
 		}
 		entry->used ++;
 	}
 
+	return entry;
+}
+
+
+struct file_buffer *cache_lookup(struct cache *cache, long long index)
+{
+	struct cache_shard *shard = cache_index_shard(cache, index);
+	struct file_buffer *entry;
+
+	pthread_cleanup_push((void *) pthread_mutex_unlock, &shard->mutex);
+	pthread_mutex_lock(&shard->mutex);
+	entry = cache_find(cache, shard, index);
 	pthread_cleanup_pop(1);
 
 	return entry;
@@ -361,64 +390,285 @@ struct file_buffer *cache_lookup(struct cache *cache, long long index)
 
 static struct file_buffer *cache_freelist(struct cache *cache)
 {
-	struct file_buffer *entry = cache->free_list;
+	/*
+	 * Take a block off a free list, starting with this thread's
+	 * shard.  Returns NULL if there are no free blocks
+	 */
+	int first = cache_thread_shard(), i;
+	struct file_buffer *entry = NULL;
+
+	if(__atomic_load_n(&cache->free_count, __ATOMIC_RELAXED) == 0)
+		return NULL;
 
-	remove_free_list(&cache->free_list, entry);
+	for(i = 0; i < CACHE_SHARDS && entry == NULL; i++) {
+		struct cache_shard *shard = &cache->shard[(first + i) &
+							(CACHE_SHARDS - 1)];
 
-	/* a block on the free_list is hashed */
-	remove_cache_hash_table(cache, entry);
+		pthread_cleanup_push((void *) pthread_mutex_unlock,
+								&shard->mutex);
+		pthread_mutex_lock(&shard->mutex);
+
+		entry = shard->free_list;
+		if(entry) {
+			remove_free_list(&shard->free_list, entry);
+
+			/* a hashed block is in the hash table of its shard */
+			if(entry->hashed) {
+				remove_cache_hash_table(cache, entry);
+				entry->hashed = FALSE;
+			}
+
+			__atomic_sub_fetch(&cache->free_count, 1,
+				__ATOMIC_RELAXED);
+			__atomic_add_fetch(&cache->used, 1, __ATOMIC_RELAXED);
+		}
+
+		pthread_cleanup_pop(1);
+	}
 
-	cache->used ++;
 	return entry;
 }
 
 
-static struct file_buffer *cache_alloc(struct cache *cache)
+static int cache_reserve(struct cache *cache)
 {
-	struct file_buffer *entry = malloc(sizeof(struct file_buffer) +
-							cache->buffer_size);
+	/* Count a new block, if the cache hasn't reached max_buffers */
+	int count = __atomic_load_n(&cache->count, __ATOMIC_RELAXED);
+
+	while(count < cache->max_buffers)
+		if(__atomic_compare_exchange_n(&cache->count, &count,
+				count + 1, TRUE, __ATOMIC_RELAXED,
+				__ATOMIC_RELAXED))
+			return TRUE;
+
+	return FALSE;
+}
+
+
+static struct file_buffer *cache_alloc(struct cache *cache, int size)
+{
+	struct file_buffer *entry = pool_alloc(cache->pool, FILE_BUFFER_DATA +
+		size);
 	if(entry == NULL)
 			MEM_ERROR();
 
 	entry->cache = cache;
+	entry->pool = cache->pool;
 	entry->free_prev = entry->free_next = NULL;
-	cache->count ++;
+	entry->data = (char *) entry + FILE_BUFFER_DATA;
+	entry->map = NULL;
+	entry->hashed = FALSE;
 	return entry;
 }
 
 
-static struct file_buffer *_cache_get(struct cache *cache, long long index,
-	int hash)
+static struct file_buffer *cache_reclaim(struct cache *cache)
 {
-	/* Get a free block out of the cache indexed on index. */
+	/*
+	 * Take a free block from another governed cache which holds
+	 * borrowed buffers, taking over the loan.  Returns NULL if there
+	 * are no such blocks
+	 */
+	struct cache_governor *governor = cache->governor;
+	int i;
+
+	for(i = 0; i < governor->caches; i++) {
+		struct cache *victim = governor->cache[i];
+		struct file_buffer *entry;
+		int borrowed;
+
+		/* blocks in shrinking caches are never free */
+		if(victim == cache || !victim->noshrink_lookup)
+			continue;
+
+		borrowed = __atomic_load_n(&victim->borrowed, __ATOMIC_RELAXED);
+		while(borrowed && !__atomic_compare_exchange_n(
+				&victim->borrowed, &borrowed, borrowed - 1,
+				TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+		if(borrowed == 0)
+			continue;
+
+		entry = cache_freelist(victim);
+		if(entry == NULL) {
+			__atomic_add_fetch(&victim->borrowed, 1,
+				__ATOMIC_RELAXED);
+			continue;
+		}
+
+		__atomic_sub_fetch(&victim->used, 1, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&victim->count, 1, __ATOMIC_RELAXED);
+		entry->cache = cache;
+		return entry;
+	}
+
+	return NULL;
+}
+
+
+static struct file_buffer *cache_borrow(struct cache *cache, int size)
+{
+	/*
+	 * Borrow a buffer from the governor, or NULL if the pool is
+	 * used up and no other cache has a borrowed buffer free.  No cache
+	 * may borrow more than half the pool, otherwise the reader, which
+	 * is always ahead of the rest of the pipeline, will borrow all of it
+	 */
+	struct cache_governor *governor = cache->governor;
+	struct file_buffer *entry = NULL;
+	int lent = __atomic_load_n(&governor->lent, __ATOMIC_RELAXED);
+
+	if(__atomic_load_n(&cache->borrowed, __ATOMIC_RELAXED) >=
+							governor->pool / 2)
+		return NULL;
+
+	while(lent < governor->pool)
+		if(__atomic_compare_exchange_n(&governor->lent, &lent,
+				lent + 1, TRUE, __ATOMIC_RELAXED,
+				__ATOMIC_RELAXED)) {
+			entry = cache_alloc(cache, size);
+			break;
+		}
+
+	if(entry == NULL)
+		entry = cache_reclaim(cache);
+
+	if(entry) {
+		__atomic_add_fetch(&cache->count, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&cache->borrowed, 1, __ATOMIC_RELAXED);
+		if(cache->noshrink_lookup)
+			__atomic_add_fetch(&cache->used, 1, __ATOMIC_RELAXED);
+	}
+
+	return entry;
+}
+
+
+static struct file_buffer *cache_try_get(struct cache *cache,
+	struct file_map *map)
+{
+	/* Get a free block out of the cache, or NULL if there isn't one */
 	struct file_buffer *entry = NULL;
- 
+
+	if(cache->noshrink_lookup) {
+		/* first try to get a block from the free list */
+		if(cache->first_freelist)
+			entry = cache_freelist(cache);
+		if(entry == NULL && cache_reserve(cache)) {
+			entry = cache_alloc(cache, cache->buffer_size);
+			__atomic_add_fetch(&cache->used, 1, __ATOMIC_RELAXED);
+		} else if(entry == NULL && !cache->first_freelist)
+			entry = cache_freelist(cache);
+		if(entry == NULL && cache->governor)
+			entry = cache_borrow(cache, cache->buffer_size);
+	} else { /* shrinking non-lookup cache */
+		/*
+		 * A buffer viewing a file mapping doesn't need any
+		 * space of its own for the data
+		 */
+		int size = map ? 0 : cache->buffer_size;
+
+		if(cache_reserve(cache))
+			entry = cache_alloc(cache, size);
+		else if(cache->governor)
+			entry = cache_borrow(cache, size);
+
+		if(entry) {
+			int count = __atomic_load_n(&cache->count,
+				__ATOMIC_RELAXED);
+			int max_count = __atomic_load_n(&cache->max_count,
+				__ATOMIC_RELAXED);
+
+			while(count > max_count && !__atomic_compare_exchange_n(
+					&cache->max_count, &max_count, count,
+					TRUE, __ATOMIC_RELAXED,
+					__ATOMIC_RELAXED));
+		}
+	}
+
+	return entry;
+}
+
+
+static void cache_wait_cleanup(void *arg)
+{
+	struct cache *cache = arg;
+
+	__atomic_sub_fetch(&cache->waiting, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+
+/*
+ * Wake a thread waiting for a free block, if there is one.  The fence
+ * orders the preceding release of the block before the read of the waiting
+ * count, and pairs with the fence in _cache_get()
+ */
+static void cache_wake(struct cache *cache)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if(__atomic_load_n(&cache->waiting, __ATOMIC_RELAXED) == 0)
+		return;
+
 	pthread_cleanup_push((void *) pthread_mutex_unlock, &cache->mutex);
 	pthread_mutex_lock(&cache->mutex);
+	pthread_cond_signal(&cache->wait_for_free);
+	pthread_cleanup_pop(1);
+}
 
-	while(1) {
-		if(cache->noshrink_lookup) {	
-			/* first try to get a block from the free list */
-			if(cache->first_freelist && cache->free_list)
-				entry = cache_freelist(cache);
-			else if(cache->count < cache->max_buffers) {
-				entry = cache_alloc(cache);
-				cache->used ++;
-			} else if(!cache->first_freelist && cache->free_list)
-				entry = cache_freelist(cache);
-		} else { /* shrinking non-lookup cache */
-			if(cache->count < cache->max_buffers) {
-				entry = cache_alloc(cache);
-				if(cache->count > cache->max_count)
-					cache->max_count = cache->count;
-			}
-		}
 
-		if(entry)
-			break;
+/*
+ * Wake threads waiting for a free block in the other governed caches,
+ * which may now be able to borrow or reclaim a buffer
+ */
+static void governor_wake(struct cache *cache)
+{
+	struct cache_governor *governor = cache->governor;
+	int i;
+
+	for(i = 0; i < governor->caches; i++)
+		if(governor->cache[i] != cache)
+			cache_wake(governor->cache[i]);
+}
+
+
+static void cache_insert_hash(struct file_buffer *entry, long long index)
+{
+	struct cache_shard *shard = cache_index_shard(entry->cache, index);
 
+	pthread_cleanup_push((void *) pthread_mutex_unlock, &shard->mutex);
+	pthread_mutex_lock(&shard->mutex);
+
+	entry->index = index;
+	entry->hashed = TRUE;
+	insert_cache_hash_table(entry->cache, entry);
+
+	pthread_cleanup_pop(1);
+}
+
+
+static struct file_buffer *_cache_get(struct cache *cache, long long index,
+	int hash, struct file_map *map)
+{
+	/* Get a free block out of the cache indexed on index. */
+	struct file_buffer *entry = cache_try_get(cache, map);
+
+	if(entry == NULL) {
 		/* wait for a block */
-		pthread_cond_wait(&cache->wait_for_free, &cache->mutex);
+		long long start = thread_stats ? stats_time() : 0;
+
+		pthread_mutex_lock(&cache->mutex);
+		__atomic_add_fetch(&cache->waiting, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+		pthread_cleanup_push(cache_wait_cleanup, cache);
+		while((entry = cache_try_get(cache, map)) == NULL)
+			pthread_cond_wait(&cache->wait_for_free, &cache->mutex);
+		pthread_cleanup_pop(1);
+
+		if(thread_stats)
+			__atomic_add_fetch(&thread_stats->cache_wait,
+				stats_time() - start, __ATOMIC_RELAXED);
 	}
 
 	/* initialise block and if hash is set insert into the hash table */
@@ -426,12 +676,8 @@ static struct file_buffer *_cache_get(struct cache *cache, long long index,
 	entry->locked = FALSE;
 	entry->wait_on_unlock = FALSE;
 	entry->error = FALSE;
-	if(hash) {
-		entry->index = index;
-		insert_cache_hash_table(cache, entry);
-	}
-
-	pthread_cleanup_pop(1);
+	if(hash)
+		cache_insert_hash(entry, index);
 
 	return entry;
 }
@@ -439,33 +685,49 @@ static struct file_buffer *_cache_get(struct cache *cache, long long index,
 
 struct file_buffer *cache_get(struct cache *cache, long long index)
 {
-	return _cache_get(cache, index, 1);
+	return _cache_get(cache, index, 1, NULL);
 }
 
 
 struct file_buffer *cache_get_nohash(struct cache *cache)
 {
-	return _cache_get(cache, 0, 0);
+	return _cache_get(cache, 0, 0, NULL);
 }
 
 
-void cache_hash(struct file_buffer *entry, long long index)
+struct file_buffer *cache_get_view(struct cache *cache, struct file_map *map,
+	long long offset)
 {
-	struct cache *cache = entry->cache;
+	/*
+	 * Get a block out of the (shrinking non-lookup) cache which views
+	 * the file mapping at offset, rather than holding the data itself.
+	 * The block holds a reference to the mapping until it is put
+	 */
+	struct file_buffer *entry = _cache_get(cache, 0, 0, map);
 
-	pthread_cleanup_push((void *) pthread_mutex_unlock, &cache->mutex);
-	pthread_mutex_lock(&cache->mutex);
+	pthread_cleanup_push((void *) pthread_mutex_unlock, &map_mutex);
+	pthread_mutex_lock(&map_mutex);
+	map->count ++;
+	pthread_cleanup_pop(1);
 
-	entry->index = index;
-	insert_cache_hash_table(cache, entry);
+	entry->map = map;
+	entry->data = (char *) map->addr + offset;
 
-	pthread_cleanup_pop(1);
+	return entry;
+}
+
+
+void cache_hash(struct file_buffer *entry, long long index)
+{
+	cache_insert_hash(entry, index);
 }
 
 
 void cache_block_put(struct file_buffer *entry)
 {
 	struct cache *cache;
+	struct cache_shard *shard;
+	int freed;
 
 	/*
 	 * Finished with this cache entry, once the usage count reaches zero it
@@ -475,7 +737,8 @@ void cache_block_put(struct file_buffer *entry)
  	 * As blocks remain accessible via the hash table they can be found
  	 * getting a new lease of life before they are reused.
 	 *
-	 * if noshrink_lookup is not set then shrink the cache.
+	 * if noshrink_lookup is not set then shrink the cache.  Blocks in
+	 * a shrinking cache are never looked up, and so have only one user.
 	 */
 
 	if(entry == NULL)
@@ -483,48 +746,131 @@ void cache_block_put(struct file_buffer *entry)
 
 	cache = entry->cache;
 
-	pthread_cleanup_push((void *) pthread_mutex_unlock, &cache->mutex);
-	pthread_mutex_lock(&cache->mutex);
-
-	entry->used --;
-	if(entry->used == 0) {
-		if(cache->noshrink_lookup) {
-			insert_free_list(&cache->free_list, entry);
-			cache->used --;
-		} else {
-			free(entry);
-			cache->count --;
+	if(!cache->noshrink_lookup) {
+		int borrowed = 0;
+
+		unmap_file(entry->map);
+		pool_free(entry->pool, entry);
+
+		/* return a borrowed buffer to the governor */
+		if(cache->governor) {
+			borrowed = __atomic_load_n(&cache->borrowed,
+				__ATOMIC_RELAXED);
+			while(borrowed && !__atomic_compare_exchange_n(
+					&cache->borrowed, &borrowed,
+					borrowed - 1, TRUE, __ATOMIC_RELAXED,
+					__ATOMIC_RELAXED));
+			if(borrowed)
+				__atomic_sub_fetch(&cache->governor->lent, 1,
+					__ATOMIC_RELAXED);
 		}
 
-		/* One or more threads may be waiting on this block */
-		pthread_cond_signal(&cache->wait_for_free);
+		__atomic_sub_fetch(&cache->count, 1, __ATOMIC_RELAXED);
+		cache_wake(cache);
+		if(borrowed)
+			governor_wake(cache);
+		return;
+	}
+
+	/*
+	 * A hashed block can be found by lookups, and must go onto the free
+	 * list of its own shard
+	 */
+	if(entry->hashed)
+		shard = cache_index_shard(cache, entry->index);
+	else
+		shard = &cache->shard[cache_thread_shard()];
+
+	pthread_cleanup_push((void *) pthread_mutex_unlock, &shard->mutex);
+	pthread_mutex_lock(&shard->mutex);
+
+	entry->used --;
+	freed = entry->used == 0;
+	if(freed) {
+		insert_free_list(&shard->free_list, entry);
+		__atomic_add_fetch(&cache->free_count, 1, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&cache->used, 1, __ATOMIC_RELAXED);
 	}
 
 	pthread_cleanup_pop(1);
+
+	/* One or more threads may be waiting on this block */
+	if(freed)
+		cache_wake(cache);
+
+	/* and if borrowed, so may threads in the other governed caches */
+	if(freed && cache->governor &&
+			__atomic_load_n(&cache->borrowed, __ATOMIC_RELAXED))
+		governor_wake(cache);
 }
 
 
 void dump_cache(struct cache *cache)
 {
-	pthread_cleanup_push((void *) pthread_mutex_unlock, &cache->mutex);
-	pthread_mutex_lock(&cache->mutex);
+	int count = __atomic_load_n(&cache->count, __ATOMIC_RELAXED);
+	int used = __atomic_load_n(&cache->used, __ATOMIC_RELAXED);
 
 	if(cache->noshrink_lookup)
 		printf("\tMax buffers %d, Current size %d, Used %d,  %s\n",
-			cache->max_buffers, cache->count, cache->used,
-			cache->free_list ?  "Free buffers" : "No free buffers");
+			cache->max_buffers, count, used,
+			__atomic_load_n(&cache->free_count, __ATOMIC_RELAXED) ?
+			"Free buffers" : "No free buffers");
 	else
 		printf("\tMax buffers %d, Current size %d, Maximum historical "
-			"size %d\n", cache->max_buffers, cache->count,
-			cache->max_count);
+			"size %d\n", cache->max_buffers, count, used);
 
-	pthread_cleanup_pop(1);
+	if(cache->governor)
+		printf("\tBorrowed buffers %d\n",
+			__atomic_load_n(&cache->borrowed, __ATOMIC_RELAXED));
+}
+
+
+struct cache_governor *governor_init(int pool)
+{
+	struct cache_governor *governor = malloc(sizeof(struct cache_governor));
+
+	if(governor == NULL)
+		MEM_ERROR();
+
+	governor->pool = pool;
+	governor->lent = 0;
+	governor->caches = 0;
+
+	return governor;
+}
+
+
+void cache_govern(struct cache *cache, struct cache_governor *governor)
+{
+	/* Called before the cache is used */
+	if(governor->caches == GOVERNOR_CACHES)
+		BAD_ERROR("Too many caches for memory governor\n");
+
+	governor->cache[governor->caches ++] = cache;
+	cache->governor = governor;
+}
+
+
+void cache_pool(struct cache *cache, struct buffer_pool *pool)
+{
+	/*
+	 * Called before the cache is used.  Blocks not bigger than the
+	 * pool's buffers are allocated from it, and blocks can move between
+	 * caches sharing a governor, so they should share a pool too
+	 */
+	cache->pool = pool;
+}
+
+
+void dump_governor(struct cache_governor *governor)
+{
+	printf("\tPool buffers %d, Lent %d\n", governor->pool,
+		__atomic_load_n(&governor->lent, __ATOMIC_RELAXED));
 }
 
 
 struct file_buffer *cache_get_nowait(struct cache *cache, long long index)
 {
-	struct file_buffer *entry = NULL;
 	/*
 	 * block doesn't exist, create it, but return it with the
 	 * locked flag set, so nothing tries to use it while it doesn't
@@ -532,18 +878,7 @@ struct file_buffer *cache_get_nowait(struct cache *cache, long long index)
 	 *
 	 * If there's no space in the cache then return NULL.
 	 */
-
-	pthread_cleanup_push((void *) pthread_mutex_unlock, &cache->mutex);
-	pthread_mutex_lock(&cache->mutex);
-
-	/* first try to get a block from the free list */
-	if(cache->first_freelist && cache->free_list)
-		entry = cache_freelist(cache);
-	else if(cache->count < cache->max_buffers) {
-		entry = cache_alloc(cache);
-		cache->used ++;
-	} else if(!cache->first_freelist && cache->free_list)
-		entry = cache_freelist(cache);
+	struct file_buffer *entry = cache_try_get(cache, NULL);
 
 	if(entry) {
 		/* initialise block and insert into the hash table */
@@ -551,11 +886,27 @@ struct file_buffer *cache_get_nowait(struct cache *cache, long long index)
 		entry->locked = TRUE;
 		entry->wait_on_unlock = FALSE;
 		entry->error = FALSE;
-		entry->index = index;
-		insert_cache_hash_table(cache, entry);
+		cache_insert_hash(entry, index);
 	}
 
-	pthread_cleanup_pop(1);
+	return entry;
+}
+
+
+/*
+ * As cache_get_nohash(), but if there's no space in the cache return NULL
+ * rather than waiting
+ */
+struct file_buffer *cache_get_nohash_nowait(struct cache *cache)
+{
+	struct file_buffer *entry = cache_try_get(cache, NULL);
+
+	if(entry) {
+		entry->used = 1;
+		entry->locked = FALSE;
+		entry->wait_on_unlock = FALSE;
+		entry->error = FALSE;
+	}
 
 	return entry;
 }
@@ -571,25 +922,15 @@ struct file_buffer *cache_lookup_nowait(struct cache *cache, long long index,
 	 *
 	 * If it doesn't exist in the cache return NULL;
 	 */
-	int hash = CALCULATE_CACHE_HASH(index);
+	struct cache_shard *shard = cache_index_shard(cache, index);
 	struct file_buffer *entry;
 
-	pthread_cleanup_push((void *) pthread_mutex_unlock, &cache->mutex);
-	pthread_mutex_lock(&cache->mutex);
-
-	/* first check if the entry already exists */
-	for(entry = cache->hash_table[hash]; entry; entry = entry->hash_next)
-		if(entry->index == index)
-			break;
+	pthread_cleanup_push((void *) pthread_mutex_unlock, &shard->mutex);
+	pthread_mutex_lock(&shard->mutex);
 
-	if(entry) {
-		if(entry->used == 0) {
-			remove_free_list(&cache->free_list, entry);
-			cache->used ++;
-		}
-		entry->used ++;
+	entry = cache_find(cache, shard, index);
+	if(entry)
 		*locked = entry->locked;
-	}
 
 	pthread_cleanup_pop(1);
 
@@ -599,10 +940,11 @@ struct file_buffer *cache_lookup_nowait(struct cache *cache, long long index,
 
 void cache_wait_unlock(struct file_buffer *buffer)
 {
-	struct cache *cache = buffer->cache;
+	struct cache_shard *shard = cache_index_shard(buffer->cache,
+		buffer->index);
 
-	pthread_cleanup_push((void *) pthread_mutex_unlock, &cache->mutex);
-	pthread_mutex_lock(&cache->mutex);
+	pthread_cleanup_push((void *) pthread_mutex_unlock, &shard->mutex);
+	pthread_mutex_lock(&shard->mutex);
 
 	while(buffer->locked) {
 		/*
@@ -615,7 +957,7 @@ void cache_wait_unlock(struct file_buffer *buffer)
 		 * incremented
 		 */
 		buffer->wait_on_unlock = TRUE;
-		pthread_cond_wait(&cache->wait_for_unlock, &cache->mutex);
+		pthread_cond_wait(&shard->wait_for_unlock, &shard->mutex);
 	}
 
 	pthread_cleanup_pop(1);
@@ -624,21 +966,187 @@ void cache_wait_unlock(struct file_buffer *buffer)
 
 void cache_unlock(struct file_buffer *entry)
 {
-	struct cache *cache = entry->cache;
+	struct cache_shard *shard = cache_index_shard(entry->cache,
+		entry->index);
 
 	/*
 	 * Unlock this locked cache entry.  If anything is waiting for this
 	 * to become unlocked, wake it up.
 	 */
-	pthread_cleanup_push((void *) pthread_mutex_unlock, &cache->mutex);
-	pthread_mutex_lock(&cache->mutex);
+	pthread_cleanup_push((void *) pthread_mutex_unlock, &shard->mutex);
+	pthread_mutex_lock(&shard->mutex);
 
 	entry->locked = FALSE;
 
 	if(entry->wait_on_unlock) {
 		entry->wait_on_unlock = FALSE;
-		pthread_cond_broadcast(&cache->wait_for_unlock);
+		pthread_cond_broadcast(&shard->wait_for_unlock);
 	}
 
 	pthread_cleanup_pop(1);
 }
+
+
+static void map_sigbus(int sig, siginfo_t *info, void *context)
+{
+	/*
+	 * A mapped file has been truncated, and a thread has touched a page
+	 * past its new end.  Replace the page with a zero-filled one so the
+	 * access can carry on, and mark the map as truncated.  A SIGBUS
+	 * outside the maps is fatal as before.
+	 *
+	 * The faulting thread holds a reference to the map, and so it is
+	 * live and on map_list.  Mmap() isn't on the async-signal-safe list,
+	 * but it is a plain system call, and is not interrupting anything
+	 * here but a memory access
+	 */
+	char *addr = info->si_addr;
+	struct file_map *map = __atomic_load_n(&map_list, __ATOMIC_ACQUIRE);
+	void *page;
+
+	for(; map; map = map->list)
+		if(__atomic_load_n(&map->live, __ATOMIC_ACQUIRE) &&
+				addr >= (char *) map->addr &&
+				addr < (char *) map->addr + map->length)
+			break;
+
+	if(map == NULL)
+		goto fatal;
+
+	page = (void *) ((unsigned long) addr & ~(page_size - 1));
+	if(mmap(page, page_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS |
+			MAP_FIXED, -1, 0) == MAP_FAILED)
+		goto fatal;
+
+	__atomic_store_n(&map->truncated, TRUE, __ATOMIC_RELAXED);
+	return;
+
+fatal:
+	/* returning re-raises the signal, which now kills the process */
+	signal(SIGBUS, SIG_DFL);
+}
+
+
+static void map_init()
+{
+	struct sigaction action;
+
+	page_size = sysconf(_SC_PAGESIZE);
+
+	memset(&action, 0, sizeof(action));
+	action.sa_sigaction = map_sigbus;
+	action.sa_flags = SA_SIGINFO;
+	sigemptyset(&action.sa_mask);
+	if(sigaction(SIGBUS, &action, NULL) == -1)
+		BAD_ERROR("Failed to install SIGBUS handler\n");
+}
+
+
+struct file_map *map_file(int fd, size_t length, char *name)
+{
+	/*
+	 * Map length bytes of the file read-only, returning the mapping with
+	 * a reference held by the caller.  Returns NULL if the file cannot
+	 * be mapped, and the caller should fall back to read().  Name is
+	 * only used in warnings
+	 */
+	struct file_map *map;
+	void *addr;
+
+	pthread_once(&map_once, map_init);
+
+	addr = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(addr == MAP_FAILED)
+		return NULL;
+
+	madvise(addr, length, MADV_SEQUENTIAL);
+
+	pthread_cleanup_push((void *) pthread_mutex_unlock, &map_mutex);
+	pthread_mutex_lock(&map_mutex);
+	map = free_maps;
+	if(map)
+		free_maps = map->free_next;
+	pthread_cleanup_pop(1);
+
+	if(map == NULL) {
+		map = malloc(sizeof(struct file_map));
+		if(map == NULL)
+			MEM_ERROR();
+
+		map->live = FALSE;
+		map->list = NULL;
+	}
+
+	map->addr = addr;
+	map->length = length;
+	map->count = 1;
+	map->truncated = FALSE;
+	map->discarded = FALSE;
+	map->name = strdup(name);
+	if(map->name == NULL)
+		MEM_ERROR();
+
+	__atomic_store_n(&map->live, TRUE, __ATOMIC_RELEASE);
+
+	if(map->list == NULL) {
+		pthread_cleanup_push((void *) pthread_mutex_unlock, &map_mutex);
+		pthread_mutex_lock(&map_mutex);
+		map->list = map_list;
+		__atomic_store_n(&map_list, map, __ATOMIC_RELEASE);
+		pthread_cleanup_pop(1);
+	}
+
+	return map;
+}
+
+
+int map_truncated(struct file_map *map)
+{
+	/*
+	 * Return whether any page of the mapping has been found past the end
+	 * of the file (and zero-filled) since the last call
+	 */
+	return __atomic_exchange_n(&map->truncated, FALSE, __ATOMIC_RELAXED);
+}
+
+
+void discard_map(struct file_map *map)
+{
+	/*
+	 * The file is being re-read, and the data through this mapping will
+	 * be thrown away, so don't warn if it is truncated
+	 */
+	__atomic_store_n(&map->discarded, TRUE, __ATOMIC_RELAXED);
+}
+
+
+void unmap_file(struct file_map *map)
+{
+	int count;
+
+	if(map == NULL)
+		return;
+
+	pthread_cleanup_push((void *) pthread_mutex_unlock, &map_mutex);
+	pthread_mutex_lock(&map_mutex);
+	count = -- map->count;
+	pthread_cleanup_pop(1);
+
+	if(count)
+		return;
+
+	if(__atomic_load_n(&map->truncated, __ATOMIC_RELAXED) &&
+			!__atomic_load_n(&map->discarded, __ATOMIC_RELAXED))
+		ERROR("%s was truncated while being read, the missing data "
+			"has been stored as zeros\n", map->name);
+
+	__atomic_store_n(&map->live, FALSE, __ATOMIC_RELEASE);
+	munmap(map->addr, map->length);
+	free(map->name);
+
+	pthread_cleanup_push((void *) pthread_mutex_unlock, &map_mutex);
+	pthread_mutex_lock(&map_mutex);
+	map->free_next = free_maps;
+	free_maps = map;
+	pthread_cleanup_pop(1);
+}
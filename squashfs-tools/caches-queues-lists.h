@@ -24,6 +24,9 @@
  * caches-queues-lists.h
  */
 
+#include "queue.h"
+#include "pool.h"
+
 #define INSERT_LIST(NAME, TYPE) \
 void insert_##NAME##_list(TYPE **list, TYPE *entry) { \
 	if(*list) { \
@@ -85,6 +88,29 @@ void remove_##NAME##_hash_table(TYPE *container, struct file_buffer *entry) \
 #define CALCULATE_HASH(n) ((n) & 0xffff)
 
 
+/*
+ * struct describing a read-only mapping of an input file.  File buffers
+ * which view the mapping (rather than holding a copy of the data) keep a
+ * reference, and the mapping is removed when the last reference is dropped.
+ *
+ * Pages past the end of a file truncated while it is mapped are replaced
+ * with zero-filled pages by the SIGBUS handler, which sets truncated.
+ * Maps are never freed, but kept on a list for reuse, which the handler
+ * walks
+ */
+struct file_map {
+	void			*addr;
+	size_t			length;
+	int			count;
+	int			live;
+	int			truncated;
+	int			discarded;
+	char			*name;
+	struct file_map		*list;
+	struct file_map		*free_next;
+};
+
+
 /* struct describing a cache entry passed between threads */
 struct file_buffer {
 	union {
@@ -96,7 +122,11 @@ struct file_buffer {
 		long long block;
 		unsigned short checksum;
 	};
+	unsigned long long hash;
+	unsigned long long file_hash;
+	struct file_info *file_dupl;
 	struct cache *cache;
+	struct buffer_pool *pool;
 	union {
 		struct file_info *dupl_start;
 		struct file_buffer *hash_next;
@@ -112,7 +142,6 @@ struct file_buffer {
 		};
 		struct {
 			struct file_buffer *seq_next;
-			struct file_buffer *seq_prev;
 		};
 	};
 	int size;
@@ -123,66 +152,119 @@ struct file_buffer {
 	char locked;
 	char wait_on_unlock;
 	char noD;
-	char data[0];
+	char checked;
+	char file_dup;
+	char hole;
+	char hashed;
+	char effort;
+	char *data;
+	struct file_map *map;
+	char buffer[0];
 };
 
 
-/* struct describing queues used to pass data between threads */
-struct queue {
-	int			size;
-	int			readp;
-	int			writep;
-	pthread_mutex_t		mutex;
-	pthread_cond_t		empty;
-	pthread_cond_t		full;
-	void			**data;
-};
+/*
+ * The data of a cache block follows the file_buffer, starting on the next
+ * POOL_ALIGN boundary
+ */
+#define FILE_BUFFER_DATA POOL_ROUND(sizeof(struct file_buffer))
 
 
 /*
  * struct describing seq_queues used to pass data between the read
  * thread and the deflate and main threads
  */
+#define SEQ_QUEUE_SLOTS 65536
+#define SEQ_QUEUE_SLOT(n) ((n) & (SEQ_QUEUE_SLOTS - 1))
+
+/*
+ * The counts are updated by every put and get, and are kept on their own
+ * cache line.  waiting, which every put reads, only changes when the
+ * getting thread has to sleep
+ */
 struct seq_queue {
-	int			fragment_count;
-	int			block_count;
-	struct file_buffer	*hash_table[HASH_SIZE];
+	long long		waiting;
+	long long		*depth;
 	pthread_mutex_t		mutex;
 	pthread_cond_t		wait;
+	char			pad1[QUEUE_CACHE_LINE];
+	int			fragment_count;
+	int			block_count;
+	unsigned int		sequence;
+	char			pad2[QUEUE_CACHE_LINE];
+	struct file_buffer	*slot[SEQ_QUEUE_SLOTS];
+};
+
+
+#define CACHE_SHARDS 16
+#define CACHE_SHARD(hash) ((hash) & (CACHE_SHARDS - 1))
+
+/*
+ * struct describing one shard of a cache.  The mutex protects the hash
+ * table buckets belonging to the shard, the shard free list, and the
+ * locked state of the blocks in the shard
+ */
+struct cache_shard {
+	pthread_mutex_t	mutex;
+	pthread_cond_t wait_for_unlock;
+	struct file_buffer *free_list;
+	char pad[QUEUE_CACHE_LINE];
+};
+
+
+/*
+ * struct describing a memory governor.  A governor lends up to pool
+ * buffers between the caches it governs, over and above their own
+ * max_buffers
+ */
+#define GOVERNOR_CACHES 8
+
+struct cache_governor {
+	int		pool;
+	int		lent;
+	int		caches;
+	struct cache	*cache[GOVERNOR_CACHES];
 };
 
 
 /* Cache status struct.  Caches are used to keep
-  track of memory buffers passed between different threads */
+  track of memory buffers passed between different threads.
+
+  The fields which never change after cache_init(), the counters every
+  thread updates, and the mutex only used by waiting threads are on
+  separate cache lines, so updating the counters doesn't bounce the
+  lines read on every cache access */
 struct cache {
 	int	max_buffers;
-	int	count;
+	struct cache_governor *governor;
+	struct buffer_pool *pool;
 	int	buffer_size;
 	int	noshrink_lookup;
 	int	first_freelist;
+	char	pad1[QUEUE_CACHE_LINE];
+	int	count;
+	int	borrowed;
 	union {
 		int	used;
 		int	max_count;
 	};
+	int	free_count;
+	char	pad2[QUEUE_CACHE_LINE];
+	int	waiting;
 	pthread_mutex_t	mutex;
 	pthread_cond_t wait_for_free;
-	pthread_cond_t wait_for_unlock;
-	struct file_buffer *free_list;
+	char	pad3[QUEUE_CACHE_LINE];
+	struct cache_shard shard[CACHE_SHARDS];
 	struct file_buffer *hash_table[HASH_SIZE];
 };
 
 
-extern struct queue *queue_init(int);
-extern void queue_put(struct queue *, void *);
-extern void *queue_get(struct queue *);
-extern int queue_empty(struct queue *);
-extern void queue_flush(struct queue *);
-extern void dump_queue(struct queue *);
 extern struct seq_queue *seq_queue_init();
 extern void seq_queue_put(struct seq_queue *, struct file_buffer *);
 extern void dump_seq_queue(struct seq_queue *, int);
 extern struct file_buffer *seq_queue_get(struct seq_queue *);
 extern void seq_queue_flush(struct seq_queue *);
+extern void seq_queue_count_depth(struct seq_queue *);
 extern struct cache *cache_init(int, int, int, int);
 extern struct file_buffer *cache_lookup(struct cache *, long long);
 extern struct file_buffer *cache_get(struct cache *, long long);
@@ -190,11 +272,22 @@ extern struct file_buffer *cache_get_nohash(struct cache *);
 extern void cache_hash(struct file_buffer *, long long);
 extern void cache_block_put(struct file_buffer *);
 extern void dump_cache(struct cache *);
+extern struct cache_governor *governor_init(int);
+extern void cache_govern(struct cache *, struct cache_governor *);
+extern void cache_pool(struct cache *, struct buffer_pool *);
+extern void dump_governor(struct cache_governor *);
 extern struct file_buffer *cache_get_nowait(struct cache *, long long);
+extern struct file_buffer *cache_get_nohash_nowait(struct cache *);
 extern struct file_buffer *cache_lookup_nowait(struct cache *, long long,
 	char *);
 extern void cache_wait_unlock(struct file_buffer *);
 extern void cache_unlock(struct file_buffer *);
+extern struct file_buffer *cache_get_view(struct cache *, struct file_map *,
+	long long);
+extern struct file_map *map_file(int, size_t, char *);
+extern void unmap_file(struct file_map *);
+extern int map_truncated(struct file_map *);
+extern void discard_map(struct file_map *);
 
 extern int first_freelist;
 #endif
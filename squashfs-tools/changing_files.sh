@@ -0,0 +1,80 @@
+#!/bin/sh
+#
+# Checks of mksquashfs reading files which change while it reads them, run
+# by "make check".
+#
+# A large file is appended to (and with -mmap, also truncated) while
+# mksquashfs is reading it.  Mksquashfs must re-read it until it gets a
+# consistent copy, finish in reasonable time, and not be killed by the
+# truncation.  The file in the image must be a copy of the file as it was
+# at some point, i.e. a prefix of the final file when it is only appended
+# to.
+#
+
+CHECK_DIR=${CHECK_DIR:-/tmp/squashfs-check}
+CHECK_TIMEOUT=${CHECK_TIMEOUT:-300}
+CHECK_SIZE=${CHECK_SIZE:-30}
+
+fail() {
+	echo "FAILED: $*" >&2
+	exit 1
+}
+
+# append to the file every few milliseconds, $1 times, in the background
+append() {
+	(i=0; while [ $i -lt $1 ]; do
+		head -c 4096 /dev/urandom >> "$CHECK_DIR/source/file"
+		sleep 0.01
+		i=$((i + 1))
+	done) &
+	changer=$!
+}
+
+# once mksquashfs has started reading, truncate the file and grow it again
+truncate_grow() {
+	(sleep 0.2
+	truncate -s 1M "$CHECK_DIR/source/file"
+	sleep 0.5
+	truncate -s ${CHECK_SIZE}M "$CHECK_DIR/source/file") &
+	changer=$!
+}
+
+# $1 is the change to make, and the rest are mksquashfs options
+check() {
+	change=$1
+	shift
+
+	rm -rf "$CHECK_DIR"
+	mkdir -p "$CHECK_DIR/source" || exit 1
+	head -c ${CHECK_SIZE}M /dev/urandom > "$CHECK_DIR/source/file" ||
+		exit 1
+
+	$change 200
+	timeout $CHECK_TIMEOUT ./mksquashfs "$CHECK_DIR/source" \
+		"$CHECK_DIR/image" -noappend -no-progress "$@" > /dev/null
+	res=$?
+	wait $changer
+
+	[ $res -eq 0 ] || fail "$change $*: mksquashfs exited with $res"
+
+	./unsquashfs -d "$CHECK_DIR/output" -no-progress "$CHECK_DIR/image" \
+		> /dev/null || fail "$change $*: unsquashfs failed"
+
+	if [ $change = append ]; then
+		size=$(stat -c %s "$CHECK_DIR/output/file")
+		[ $size -ge $((CHECK_SIZE * 1048576)) ] ||
+			fail "$change $*: file is only $size bytes"
+
+		cmp -n $size "$CHECK_DIR/source/file" "$CHECK_DIR/output/file" \
+			> /dev/null || fail "$change $*: file differs"
+	fi
+
+	echo "$change $*: ok"
+}
+
+check append
+check append -mmap
+check truncate_grow
+check truncate_grow -mmap
+
+rm -rf "$CHECK_DIR"
@@ -28,13 +28,23 @@ struct compressor {
 	int supported;
 	int (*init)(void **, int, int);
 	int (*compress)(void *, void *, void *, int, int, int *);
-	int (*uncompress)(void *, void *, int, int, int *);
+	int (*compress_fast)(void *, void *, void *, int, int, int *);
+	int (*efforts)();
+	void (*effort)(void *, int);
+	int (*queue_depth)(void *);
+	int (*submit)(void *, void *, void *, int, int, void *, int *);
+	int (*collect)(void *, void **, int, int *);
+	int (*uncompress_init)(void **);
+	void (*uncompress_free)(void *);
+	int (*uncompress)(void *, void *, void *, int, int, int *);
 	int (*options)(char **, int);
 	int (*options_post)(int);
 	void *(*dump_options)(int, int *);
 	int (*extract_options)(int, void *, int);
 	int (*check_options)(int, void *, int);
 	void (*display_options)(void *, int);
+	int (*sample_size)();
+	int (*train)(void *, size_t *, int);
 	void (*usage)();
 };
 
@@ -59,10 +69,117 @@ static inline int compressor_compress(struct compressor *comp, void *strm,
 }
 
 
-static inline int compressor_uncompress(struct compressor *comp, void *dest,
-	void *src, int size, int block_size, int *error)
+/*
+ * Compress using only the compressor's first choice of options, rather
+ * than trying every candidate (gzip -Xstrategy, xz -Xbcj).  Used by
+ * mksquashfs -adaptive for blocks which look poorly compressible
+ */
+static inline int compressor_compress_fast(struct compressor *comp,
+	void *strm, void *dest, void *src, int size, int block_size,
+	int *error)
+{
+	if(comp->compress_fast == NULL)
+		return comp->compress(strm, dest, src, size, block_size, error);
+	return comp->compress_fast(strm, dest, src, size, block_size, error);
+}
+
+
+/*
+ * Compressors which can trade compression for speed without changing how
+ * the blocks are decompressed (the compression level, and how many of the
+ * strategies or filters given are tried) return how many steps of effort
+ * they have from compressor_efforts().  The highest effort compresses
+ * with the options given, and is what a stream starts with.
+ * compressor_effort() sets the effort the stream compresses data blocks
+ * with from then on.  Used by mksquashfs -deadline
+ */
+static inline int compressor_efforts(struct compressor *comp)
+{
+	if(comp->efforts == NULL)
+		return 1;
+	return comp->efforts();
+}
+
+
+static inline void compressor_effort(struct compressor *comp, void *strm,
+	int effort)
+{
+	if(comp->effort)
+		comp->effort(strm, effort);
+}
+
+
+/*
+ * Compressors which can have several blocks in flight at once (gzip
+ * -Xoffload) return how many from compressor_queue_depth(), which is 0
+ * for the others.  Up to that many blocks are passed to
+ * compressor_submit(), each with a tag, and compressor_collect() returns
+ * the compressed size of one of them once it has finished, in no
+ * particular order, and its tag.  If wait isn't set, and no block has
+ * finished, compressor_collect() returns COMPRESSOR_PENDING rather than
+ * waiting.  The sizes and errors are as compressor_compress(), and
+ * compressor_submit() returns 0 on success.  The deflators submit blocks
+ * in batches, before collecting any, and so a compressor which is only
+ * efficient given many blocks at once can compress the blocks submitted
+ * so far when first asked to collect one
+ */
+#define COMPRESSOR_PENDING -2
+
+static inline int compressor_queue_depth(struct compressor *comp, void *strm)
+{
+	if(comp->queue_depth == NULL)
+		return 0;
+	return comp->queue_depth(strm);
+}
+
+
+static inline int compressor_submit(struct compressor *comp, void *strm,
+	void *dest, void *src, int size, int block_size, void *tag, int *error)
+{
+	return comp->submit(strm, dest, src, size, block_size, tag, error);
+}
+
+
+static inline int compressor_collect(struct compressor *comp, void *strm,
+	void **tag, int wait, int *error)
+{
+	return comp->collect(strm, tag, wait, error);
+}
+
+
+/*
+ * Decompression contexts are created once per decompressing thread, so
+ * library state isn't allocated and initialised for every block.  A NULL
+ * context (if the compressor has no contexts, or the caller isn't a
+ * decompressing thread) makes the compressor decompress each block
+ * from scratch
+ */
+static inline int compressor_uncompress_init(struct compressor *comp,
+	void **stream)
 {
-	return comp->uncompress(dest, src, size, block_size, error);
+	*stream = NULL;
+	if(comp->uncompress_init == NULL)
+		return 0;
+	return comp->uncompress_init(stream);
+}
+
+
+/*
+ * Free a decompression context, when its thread exits (or the
+ * filesystem is closed)
+ */
+static inline void compressor_uncompress_free(struct compressor *comp,
+	void *stream)
+{
+	if(stream && comp->uncompress_free)
+		comp->uncompress_free(stream);
+}
+
+
+static inline int compressor_uncompress(struct compressor *comp, void *strm,
+	void *dest, void *src, int size, int block_size, int *error)
+{
+	return comp->uncompress(strm, dest, src, size, block_size, error);
 }
 
 
@@ -121,4 +238,27 @@ static inline void compressor_display_options(struct compressor *comp,
 	if(comp->display_options != NULL)
 		comp->display_options(buffer, size);
 }
+
+
+/*
+ * Compressors which can train a dictionary return the number of bytes of
+ * sample data they want (if training was asked for), mksquashfs then
+ * passes the samples to compressor_train() before initialising the
+ * compressor.  See the zstd compressor
+ */
+static inline int compressor_sample_size(struct compressor *comp)
+{
+	if(comp->sample_size == NULL)
+		return 0;
+	return comp->sample_size();
+}
+
+
+static inline int compressor_train(struct compressor *comp, void *samples,
+	size_t *sizes, int count)
+{
+	if(comp->train == NULL)
+		return -1;
+	return comp->train(samples, sizes, count);
+}
 #endif
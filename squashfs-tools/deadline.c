@@ -0,0 +1,225 @@
+/*
+ * Create a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2014
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * deadline.c
+ *
+ * Deadline mode (-deadline).  The deflator threads time every data block
+ * they compress, and count the time and bytes against the effort it was
+ * compressed at.  Twice a second the deadline thread works out the cost
+ * per byte of each effort used since it last looked, and from the blocks
+ * the progress bar has still to count, how long compressing the rest
+ * will take.  If that won't fit in the time left the effort is lowered to
+ * the highest expected to fit, and if the next effort up is expected to
+ * fit comfortably, it is raised a step.  Only the compression time is
+ * considered, lowering the effort doesn't help if the reader or writer
+ * are the bottleneck
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "caches-queues-lists.h"
+#include "compressor.h"
+#include "stats.h"
+#include "deadline.h"
+#include "error.h"
+
+#define FALSE 0
+#define TRUE 1
+
+/* the deadline, as a stats_time(), 0 if there isn't one */
+long long deadline_end = 0;
+
+static struct deadline_effort *effort_list;
+static int efforts, effort_now, threads;
+
+extern struct compressor *comp;
+extern int cur_uncompressed, estimated_uncompressed;
+
+
+/*
+ * The current effort.  The reader takes this once for each file, and all
+ * of its data blocks are compressed at it, otherwise a file straddling an
+ * effort change would never be found to be a duplicate of another copy
+ */
+int deadline_effort()
+{
+	return __atomic_load_n(&effort_now, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Compress a data block for mangle2() at effort, or at the current effort
+ * if it is -1 (fragment blocks, which are shared between files)
+ */
+int deadline_compress(void *strm, char *d, char *s, int size, int block_size,
+	int effort, int *error)
+{
+	struct deadline_effort *entry;
+	long long start;
+	int c_byte;
+
+	if(effort == -1)
+		effort = deadline_effort();
+
+	entry = &effort_list[effort];
+	start = stats_time();
+
+	compressor_effort(comp, strm, effort);
+	c_byte = compressor_compress(comp, strm, d, s, size, block_size,
+		error);
+
+	__atomic_add_fetch(&entry->ns, stats_time() - start, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&entry->bytes, size, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&entry->blocks, 1, __ATOMIC_RELAXED);
+
+	return c_byte;
+}
+
+
+static void deadline_adjust(long long now)
+{
+	long long left = deadline_end - now, blocks = 0, bytes = 0;
+	int i, effort = effort_now;
+	double remaining, time, cost;
+
+	/*
+	 * The cost (nanoseconds per byte) of each effort is averaged with
+	 * its cost since last time, so it follows changes in the data
+	 */
+	for(i = 0; i < efforts; i++) {
+		struct deadline_effort *entry = &effort_list[i];
+		long long ns = __atomic_load_n(&entry->ns, __ATOMIC_RELAXED);
+		long long used = __atomic_load_n(&entry->bytes,
+			__ATOMIC_RELAXED);
+
+		if(used > entry->last_bytes) {
+			double cost = (double) (ns - entry->last_ns) /
+				(used - entry->last_bytes);
+
+			entry->cost = entry->cost ? (entry->cost + cost) / 2 :
+				cost;
+			entry->last_ns = ns;
+			entry->last_bytes = used;
+		}
+
+		blocks += __atomic_load_n(&entry->blocks, __ATOMIC_RELAXED);
+		bytes += used;
+	}
+
+	/* nothing to go on until the current effort has been measured */
+	if(effort_list[effort].cost == 0)
+		return;
+
+	/* the blocks left, at the average size of the blocks so far */
+	remaining = (double) (estimated_uncompressed - cur_uncompressed) *
+		bytes / blocks;
+	if(remaining <= 0)
+		return;
+
+	cost = effort_list[effort].cost;
+	time = remaining * cost / threads;
+
+	if(left <= 0 || time > (double) left * DEADLINE_LOWER / 100) {
+		/*
+		 * Drop to the highest effort expected to fit, each effort
+		 * which hasn't been measured costing DEADLINE_UNKNOWN times
+		 * less than the one above
+		 */
+		while(effort > 0) {
+			effort --;
+			cost = effort_list[effort].cost ?
+				effort_list[effort].cost : cost /
+				DEADLINE_UNKNOWN;
+			if(remaining * cost / threads <= (double) left *
+					DEADLINE_LOWER / 100)
+				break;
+		}
+	} else if(effort + 1 < efforts) {
+		cost = effort_list[effort + 1].cost ?
+			effort_list[effort + 1].cost : cost * DEADLINE_UNKNOWN;
+
+		if(remaining * cost / threads < (double) left *
+				DEADLINE_RAISE / 100)
+			effort ++;
+	}
+
+	__atomic_store_n(&effort_now, effort, __ATOMIC_RELAXED);
+}
+
+
+static void *deadline_thrd(void *arg)
+{
+	struct timespec interval = {
+		DEADLINE_INTERVAL / 1000000000, DEADLINE_INTERVAL % 1000000000
+	};
+
+	while(1) {
+		if(nanosleep(&interval, NULL) == -1 && errno != EINTR)
+			BAD_ERROR("nanosleep failed in deadline thread\n");
+
+		deadline_adjust(stats_time());
+	}
+}
+
+
+/*
+ * Start the deadline thread.  Compressing starts at the highest effort,
+ * the options given.  Deflators is the number of deflator threads
+ */
+void deadline_init(int deflators)
+{
+	pthread_t thread;
+
+	efforts = compressor_efforts(comp);
+	if(efforts == 1)
+		BAD_ERROR("-deadline: the %s compressor can't trade "
+			"compression for speed with the options given\n",
+			comp->name);
+
+	effort_list = calloc(efforts, sizeof(struct deadline_effort));
+	if(effort_list == NULL)
+		MEM_ERROR();
+
+	effort_now = efforts - 1;
+	threads = deflators;
+
+	if(pthread_create(&thread, NULL, deadline_thrd, NULL) != 0)
+		BAD_ERROR("Failed to create thread\n");
+}
+
+
+void deadline_report()
+{
+	long long left = deadline_end - stats_time();
+	int i;
+
+	printf("Deadline %s by %.1f seconds, data blocks at each effort "
+		"(lowest first):\n\t", left >= 0 ? "met" : "missed",
+		(left >= 0 ? left : -left) / 1000000000.0);
+	for(i = 0; i < efforts; i++)
+		printf("%s%lld", i ? " " : "", effort_list[i].blocks);
+	printf("\n");
+}
@@ -0,0 +1,61 @@
+#ifndef DEADLINE_H
+#define DEADLINE_H
+/*
+ * Create a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2014
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * deadline.h
+ */
+
+/*
+ * Deadline mode (-deadline).  The data blocks are compressed at the
+ * highest compressor effort (see compressor_efforts()) which is expected
+ * to finish compressing the remaining blocks by the deadline
+ */
+
+/* how often the effort is reconsidered, in nanoseconds */
+#define DEADLINE_INTERVAL 500000000LL
+
+/*
+ * The effort is lowered if compressing the remaining blocks is projected
+ * to take longer than DEADLINE_LOWER percent of the time left, and raised
+ * if at the next effort it is projected to take less than DEADLINE_RAISE
+ * percent.  An effort which hasn't been measured yet is assumed to cost
+ * DEADLINE_UNKNOWN times the effort below it
+ */
+#define DEADLINE_LOWER 90
+#define DEADLINE_RAISE 75
+#define DEADLINE_UNKNOWN 2
+
+struct deadline_effort {
+	long long	ns;
+	long long	bytes;
+	long long	blocks;
+	long long	last_ns;
+	long long	last_bytes;
+	double		cost;
+};
+
+extern long long deadline_end;
+extern int deadline_effort();
+extern int deadline_compress(void *, char *, char *, int, int, int, int *);
+extern void deadline_init(int);
+extern void deadline_report();
+#endif
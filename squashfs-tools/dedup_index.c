@@ -0,0 +1,259 @@
+/*
+ * Create a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2014
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * dedup_index.c
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+#include "squashfs_fs.h"
+#include "mksquashfs.h"
+#include "process_fragments.h"
+#include "dedup_index.h"
+#include "error.h"
+
+#define FALSE 0
+#define TRUE 1
+
+static int compare_entry(const void *a, const void *b)
+{
+	const struct dedup_index_entry *entry_a = a, *entry_b = b;
+
+	if(entry_a->start != entry_b->start)
+		return entry_a->start < entry_b->start ? -1 : 1;
+
+	if(entry_a->file_size != entry_b->file_size)
+		return entry_a->file_size < entry_b->file_size ? -1 : 1;
+
+	if(entry_a->fragment != entry_b->fragment)
+		return entry_a->fragment < entry_b->fragment ? -1 : 1;
+
+	return entry_a->offset - entry_b->offset;
+}
+
+
+static void index_entry(struct dedup_index_entry *entry,
+	struct file_info *file)
+{
+	memset(entry, 0, sizeof(*entry));
+	entry->file_size = file->file_size;
+	entry->start = file->start;
+	entry->hash = file->hash;
+	entry->fragment = file->fragment->index;
+	entry->offset = file->fragment->offset;
+	entry->size = file->fragment->size;
+}
+
+
+static int check_header(char *filename, struct dedup_index_header *header,
+	struct squashfs_super_block *sBlk)
+{
+	if(strcmp(header->magic, DEDUP_INDEX_MAGIC) != 0 ||
+			header->version != DEDUP_INDEX_VERSION ||
+			header->byte_order != DEDUP_INDEX_BYTE_ORDER) {
+		ERROR("%s is not a duplicate index (or was written on a "
+			"machine of different byte order), ignoring it\n",
+			filename);
+		return FALSE;
+	}
+
+	if(header->block_size != sBlk->block_size || header->mkfs_time !=
+			sBlk->mkfs_time || header->bytes_used !=
+			sBlk->bytes_used || header->inode_table_start !=
+			sBlk->inode_table_start || header->entries < 0) {
+		ERROR("Duplicate index %s doesn't match the filesystem being "
+			"appended to, ignoring it\n", filename);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+
+/*
+ * Give the files read from the filesystem being appended to their
+ * content hash from the index, so they're found by the duplicate hash
+ * lookup rather than checksummed (and so re-read) whenever a file of the
+ * same size is written
+ */
+void read_dedup_index(char *filename, struct squashfs_super_block *sBlk)
+{
+	struct dedup_index_header header;
+	struct dedup_index_entry *entries, key;
+	struct file_info *dupl_ptr;
+	struct stat buf;
+	FILE *file;
+	int i, matched = 0;
+
+	file = fopen(filename, "r");
+	if(file == NULL) {
+		ERROR("Failed to open duplicate index %s, because %s\n",
+			filename, strerror(errno));
+		return;
+	}
+
+	if(fread(&header, sizeof(header), 1, file) != 1) {
+		ERROR("Failed to read duplicate index %s\n", filename);
+		goto failed;
+	}
+
+	header.magic[sizeof(header.magic) - 1] = '\0';
+	if(!check_header(filename, &header, sBlk))
+		goto failed;
+
+	/*
+	 * The index is only a cache, and so a corrupt one is ignored rather
+	 * than trusting its entry count to allocate, or failing the build
+	 */
+	if(fstat(fileno(file), &buf) == -1) {
+		ERROR("Failed to stat duplicate index %s, because %s\n",
+			filename, strerror(errno));
+		goto failed;
+	}
+
+	if((buf.st_size - sizeof(header)) / sizeof(struct dedup_index_entry) !=
+			header.entries || (buf.st_size - sizeof(header)) %
+			sizeof(struct dedup_index_entry)) {
+		ERROR("Duplicate index %s is the wrong size for its %lld "
+			"entries, ignoring it\n", filename, header.entries);
+		goto failed;
+	}
+
+	entries = malloc(header.entries * sizeof(struct dedup_index_entry));
+	if(entries == NULL && header.entries) {
+		ERROR("Out of memory reading duplicate index %s, ignoring "
+			"it\n", filename);
+		goto failed;
+	}
+
+	if(fread(entries, sizeof(struct dedup_index_entry), header.entries,
+						file) != header.entries) {
+		ERROR("Failed to read duplicate index %s\n", filename);
+		free(entries);
+		goto failed;
+	}
+
+	fclose(file);
+
+	qsort(entries, header.entries, sizeof(struct dedup_index_entry),
+		compare_entry);
+
+	pthread_cleanup_push((void *) pthread_mutex_unlock, &dup_mutex);
+	pthread_mutex_lock(&dup_mutex);
+
+	for(i = 0; i < 65536; i++)
+		for(dupl_ptr = dupl[i]; dupl_ptr; dupl_ptr = dupl_ptr->next) {
+			struct dedup_index_entry *entry;
+
+			if(dupl_ptr->have_hash)
+				continue;
+
+			index_entry(&key, dupl_ptr);
+			entry = bsearch(&key, entries, header.entries,
+				sizeof(struct dedup_index_entry),
+				compare_entry);
+			if(entry == NULL || entry->size != key.size)
+				continue;
+
+			dupl_ptr->hash = entry->hash;
+			dupl_ptr->have_hash = TRUE;
+			dupl_ptr->hash_next = dupl_hash[DUP_HASH(entry->hash)];
+			dupl_hash[DUP_HASH(entry->hash)] = dupl_ptr;
+			unhashed_files --;
+			matched ++;
+		}
+
+	pthread_cleanup_pop(1);
+
+	free(entries);
+
+	printf("Read duplicate index %s, %d files indexed, %d unindexed\n",
+		filename, matched, unhashed_files);
+
+	return;
+
+failed:
+	fclose(file);
+}
+
+
+/*
+ * Write the content hashes of the files in the filesystem just written.
+ * Files appended to without an index have no content hash, and are left
+ * out, to be checksummed on the next append as before
+ */
+void write_dedup_index(char *filename, struct squashfs_super_block *sBlk)
+{
+	struct dedup_index_header header;
+	struct dedup_index_entry entry;
+	struct file_info *dupl_ptr;
+	FILE *file;
+	int i;
+
+	memset(&header, 0, sizeof(header));
+	strcpy(header.magic, DEDUP_INDEX_MAGIC);
+	header.version = DEDUP_INDEX_VERSION;
+	header.byte_order = DEDUP_INDEX_BYTE_ORDER;
+	header.block_size = sBlk->block_size;
+	header.mkfs_time = sBlk->mkfs_time;
+	header.bytes_used = sBlk->bytes_used;
+	header.inode_table_start = sBlk->inode_table_start;
+
+	for(i = 0; i < 65536; i++)
+		for(dupl_ptr = dupl[i]; dupl_ptr; dupl_ptr = dupl_ptr->next)
+			if(dupl_ptr->have_hash)
+				header.entries ++;
+
+	file = fopen(filename, "w");
+	if(file == NULL)
+		goto failed;
+
+	if(fwrite(&header, sizeof(header), 1, file) != 1)
+		goto failed;
+
+	for(i = 0; i < 65536; i++)
+		for(dupl_ptr = dupl[i]; dupl_ptr; dupl_ptr = dupl_ptr->next)
+			if(dupl_ptr->have_hash) {
+				index_entry(&entry, dupl_ptr);
+				if(fwrite(&entry, sizeof(entry), 1, file) != 1)
+					goto failed;
+			}
+
+	if(fclose(file) == 0)
+		return;
+
+	file = NULL;
+
+failed:
+	ERROR("Failed to write duplicate index %s, because %s\n", filename,
+		strerror(errno));
+	if(file)
+		fclose(file);
+	unlink(filename);
+}
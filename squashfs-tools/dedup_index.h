@@ -0,0 +1,61 @@
+#ifndef DEDUP_INDEX_H
+#define DEDUP_INDEX_H
+/*
+ * Create a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2014
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * dedup_index.h
+ */
+
+/*
+ * The duplicate index file (-dedup-index) records the content hash of each
+ * file in a filesystem, so that when appending the files already in the
+ * filesystem can be hash matched without re-reading them.  The content
+ * hashes are host byte order (see hash.c), and so is the index, which is
+ * only read back on a machine of the same byte order
+ */
+#define DEDUP_INDEX_MAGIC "SQDEDUP"
+#define DEDUP_INDEX_VERSION 1
+#define DEDUP_INDEX_BYTE_ORDER 0x01020304
+
+struct dedup_index_header {
+	char			magic[8];
+	unsigned int		version;
+	unsigned int		byte_order;
+	unsigned int		block_size;
+	unsigned int		mkfs_time;
+	long long		bytes_used;
+	long long		inode_table_start;
+	long long		entries;
+};
+
+struct dedup_index_entry {
+	long long		file_size;
+	long long		start;
+	unsigned long long	hash;
+	unsigned int		fragment;
+	int			offset;
+	int			size;
+	int			pad;
+};
+
+extern void read_dedup_index(char *, struct squashfs_super_block *);
+extern void write_dedup_index(char *, struct squashfs_super_block *);
+#endif
@@ -0,0 +1,749 @@
+/*
+ * Make and apply block level deltas between squashfs filesystems.
+ *
+ * Copyright (c) 2014
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * deltasquashfs.c
+ *
+ * A delta rebuilds the new filesystem byte for byte from the old one.  The
+ * data and fragment blocks of both filesystems are found from their block
+ * lists and fragment tables (read with libsquashfs), and each compressed
+ * block of the new filesystem which is also in the old filesystem (found
+ * by hashing the compressed blocks, so files which have moved are found
+ * too) is copied from the old filesystem.  Everything else, new blocks and
+ * the metadata, is stored in the delta.  Blocks are never decompressed,
+ * and applying a delta only reads the old blocks it uses
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "squashfs_fs.h"
+#include "squashfs_swap.h"
+#include "libsquashfs.h"
+
+#define TRUE 1
+#define FALSE 0
+
+#define DELTA_MAGIC 0x4c445153	/* "SQDL" */
+#define DELTA_VERSION 1
+#define DELTA_SUPER sizeof(struct squashfs_super_block)
+
+#define DELTA_COPY 1
+#define DELTA_DATA 2
+#define DELTA_END 3
+
+/* entries added to a directory listing at a time */
+#define LISTING_ALLOC 16
+
+/* size of the buffer used to copy data if copy_file_range() can't */
+#define COPY_BUFFER (1024 * 1024)
+
+#define BAD_ERROR(s, args...) \
+	do { \
+		fprintf(stderr, "FATAL ERROR: " s, ##args); \
+		prep_exit(); \
+		exit(1); \
+	} while(0)
+
+#define MEM_ERROR() BAD_ERROR("Out of memory (%s)\n", __func__)
+
+/*
+ * The delta header.  The old filesystem's superblock is stored, so a
+ * delta is only applied to the filesystem it was made from.  All fields
+ * are little endian
+ */
+struct delta_header {
+	unsigned int		magic;
+	unsigned int		version;
+	long long		old_size;
+	long long		new_size;
+	char			old_super[DELTA_SUPER];
+};
+
+/*
+ * The header is followed by operations, each writing the next length
+ * bytes of the new filesystem.  DELTA_COPY copies them from offset in
+ * the old filesystem, DELTA_DATA is followed by the bytes.  DELTA_END
+ * ends the delta
+ */
+struct delta_op {
+	unsigned int		type;
+	unsigned int		unused;
+	long long		offset;
+	long long		length;
+};
+
+/* a data or fragment block, as stored (compressed) in a filesystem */
+struct block {
+	long long		start;
+	unsigned int		size;
+	unsigned long long	hash;
+};
+
+struct image {
+	char			*name;
+	struct sqfs		*fs;
+	int			fd;
+	long long		size;
+	struct block		*block;
+	int			blocks;
+	int			blocks_size;
+};
+
+struct listing {
+	int			count;
+	int			size;
+	struct listing_entry {
+		long long	ref;
+		mode_t		type;
+	}			*entry;
+};
+
+static char *destination;
+static int dest_fd = -1;
+static int copy_range = TRUE;
+
+/* the operation not yet written, so runs of operations are joined */
+static struct delta_op pending;
+static long long delta_bytes, copied_bytes, new_bytes;
+
+
+static void prep_exit()
+{
+	if(dest_fd != -1) {
+		close(dest_fd);
+		unlink(destination);
+	}
+}
+
+
+static void read_bytes(int fd, long long offset, int count, void *buff,
+	char *name)
+{
+	char *p = buff;
+
+	while(count) {
+		ssize_t res = pread(fd, p, count, offset);
+
+		if(res == -1 && errno == EINTR)
+			continue;
+
+		if(res == -1)
+			BAD_ERROR("Failed to read %s, because %s\n", name,
+				strerror(errno));
+
+		if(res == 0)
+			BAD_ERROR("Unexpected end of file reading %s\n",
+				name);
+
+		p += res;
+		offset += res;
+		count -= res;
+	}
+}
+
+
+static void write_bytes(long long offset, long long count, void *buff)
+{
+	char *p = buff;
+
+	while(count) {
+		ssize_t res = pwrite(dest_fd, p, count, offset);
+
+		if(res == -1) {
+			if(errno == EINTR)
+				continue;
+			BAD_ERROR("Failed to write to %s, because %s\n",
+				destination, strerror(errno));
+		}
+
+		p += res;
+		offset += res;
+		count -= res;
+	}
+}
+
+
+/*
+ * Copy length bytes at offset in from to out in the destination, with
+ * copy_file_range() if the kernel can (sharing the extents on filesystems
+ * with reflinks), otherwise reading and writing them
+ */
+static void copy_data(int fd, long long offset, long long dest,
+	long long length, char *name)
+{
+	static char *buffer = NULL;
+	loff_t in = offset, out = dest;
+
+	while(copy_range && length) {
+		ssize_t res = copy_file_range(fd, &in, dest_fd, &out, length,
+			0);
+
+		if(res == -1 && errno == EINTR)
+			continue;
+
+		if(res == -1 && (errno == ENOSYS || errno == EXDEV ||
+				errno == EINVAL || errno == EOPNOTSUPP)) {
+			copy_range = FALSE;
+			break;
+		}
+
+		if(res == -1)
+			BAD_ERROR("Failed to copy data from %s, because %s\n",
+				name, strerror(errno));
+
+		if(res == 0)
+			BAD_ERROR("Unexpected end of file reading %s\n", name);
+
+		length -= res;
+	}
+
+	if(length && buffer == NULL) {
+		buffer = malloc(COPY_BUFFER);
+		if(buffer == NULL)
+			MEM_ERROR();
+	}
+
+	while(length) {
+		int count = length > COPY_BUFFER ? COPY_BUFFER : length;
+
+		read_bytes(fd, in, count, buffer, name);
+		write_bytes(out, count, buffer);
+		in += count;
+		out += count;
+		length -= count;
+	}
+}
+
+
+/*
+ * The hash of a compressed block.  It only needs to find the candidate
+ * old blocks, which are compared with the new block before being used
+ */
+static unsigned long long hash_block(unsigned char *data, int size)
+{
+	unsigned long long hash = 0xcbf29ce484222325ULL ^ size, word;
+	int n;
+
+	for(n = 0; n + 8 <= size; n += 8) {
+		memcpy(&word, data + n, 8);
+		hash = (hash ^ word) * 0x100000001b3ULL;
+		hash ^= hash >> 29;
+	}
+
+	for(; n < size; n++)
+		hash = (hash ^ data[n]) * 0x100000001b3ULL;
+
+	return hash ^ (hash >> 32);
+}
+
+
+static void add_block(struct image *im, long long start, unsigned int size)
+{
+	if(im->blocks == im->blocks_size) {
+		im->blocks_size = im->blocks_size ? im->blocks_size * 2 : 1024;
+		im->block = realloc(im->block, im->blocks_size *
+			sizeof(struct block));
+		if(im->block == NULL)
+			MEM_ERROR();
+	}
+
+	im->block[im->blocks].start = start;
+	im->block[im->blocks++].size = SQUASHFS_COMPRESSED_SIZE_BLOCK(size);
+}
+
+
+static int listing_fn(void *arg, char *name, long long ref, mode_t type)
+{
+	struct listing *listing = arg;
+
+	if(listing->count == listing->size) {
+		listing->size += LISTING_ALLOC;
+		listing->entry = realloc(listing->entry, listing->size *
+			sizeof(struct listing_entry));
+		if(listing->entry == NULL)
+			MEM_ERROR();
+	}
+
+	listing->entry[listing->count].ref = ref;
+	listing->entry[listing->count++].type = type;
+	return 0;
+}
+
+
+/* Add the data blocks of the files in the directory i to the blocks */
+static void scan_dir(struct image *im, struct sqfs_inode *i)
+{
+	struct listing listing = { 0, 0, NULL };
+	unsigned int block_size = sqfs_block_size(im->fs), *list = NULL;
+	int n, res, list_size = 0;
+
+	res = sqfs_readdir(im->fs, i, listing_fn, &listing);
+	if(res < 0)
+		BAD_ERROR("Failed to read directory in %s, because %s\n",
+			im->name, strerror(-res));
+
+	for(n = 0; n < listing.count; n++) {
+		struct sqfs_inode child;
+		long long start;
+		int blocks, b;
+
+		if(!S_ISDIR(listing.entry[n].type) &&
+				!S_ISREG(listing.entry[n].type))
+			continue;
+
+		res = sqfs_read_inode(im->fs, listing.entry[n].ref, &child);
+		if(res)
+			BAD_ERROR("Failed to read inode in %s, because %s\n",
+				im->name, strerror(-res));
+
+		if(S_ISDIR(child.mode)) {
+			scan_dir(im, &child);
+			continue;
+		}
+
+		blocks = child.fragment == SQUASHFS_INVALID_FRAG ?
+			(child.size + block_size - 1) / block_size :
+			child.size / block_size;
+
+		if(blocks > list_size) {
+			list_size = blocks;
+			list = realloc(list, list_size * sizeof(unsigned int));
+			if(list == NULL)
+				MEM_ERROR();
+		}
+
+		res = sqfs_block_list(im->fs, &child, list, blocks);
+		if(res)
+			BAD_ERROR("Failed to read block list in %s, because "
+				"%s\n", im->name, strerror(-res));
+
+		for(start = child.start, b = 0; b < blocks; b++) {
+			if(list[b] == 0)
+				continue;
+			add_block(im, start, list[b]);
+			start += SQUASHFS_COMPRESSED_SIZE_BLOCK(list[b]);
+		}
+	}
+
+	free(list);
+	free(listing.entry);
+}
+
+
+static int compare_block(const void *a, const void *b)
+{
+	const struct block *block_a = a, *block_b = b;
+
+	return block_a->start < block_b->start ? -1 :
+		block_a->start > block_b->start;
+}
+
+
+/*
+ * Open the filesystem, and find its data and fragment blocks, sorted in
+ * the order they're in the filesystem, each once
+ */
+static void open_image(struct image *im, char *name)
+{
+	struct sqfs_info info;
+	struct sqfs_inode root;
+	struct stat buf;
+	unsigned int n, size;
+	long long start;
+	int res, unique;
+
+	im->name = name;
+	im->fs = sqfs_open(name, &res);
+	if(im->fs == NULL)
+		BAD_ERROR("Failed to open %s, because %s\n", name,
+			strerror(-res));
+
+	im->fd = sqfs_fd(im->fs);
+	if(fstat(im->fd, &buf) == -1)
+		BAD_ERROR("Failed to stat %s, because %s\n", name,
+			strerror(errno));
+	im->size = buf.st_size;
+
+	sqfs_get_info(im->fs, &info);
+	for(n = 0; n < info.fragments; n++) {
+		res = sqfs_fragment(im->fs, n, &start, &size);
+		if(res)
+			BAD_ERROR("Failed to read fragment table in %s, "
+				"because %s\n", name, strerror(-res));
+		add_block(im, start, size);
+	}
+
+	res = sqfs_root(im->fs, &root);
+	if(res)
+		BAD_ERROR("Failed to read root inode of %s, because %s\n",
+			name, strerror(-res));
+	scan_dir(im, &root);
+
+	qsort(im->block, im->blocks, sizeof(struct block), compare_block);
+
+	for(unique = 0, res = 0; res < im->blocks; res++)
+		if(unique == 0 || im->block[unique - 1].start !=
+				im->block[res].start)
+			im->block[unique++] = im->block[res];
+	im->blocks = unique;
+}
+
+
+static void write_delta(void *data, int size)
+{
+	write_bytes(delta_bytes, size, data);
+	delta_bytes += size;
+}
+
+
+static void flush_op(struct image *new)
+{
+	struct delta_op op;
+
+	if(pending.length == 0)
+		return;
+
+	op.type = pending.type;
+	op.unused = 0;
+	op.offset = pending.offset;
+	op.length = pending.length;
+	SQUASHFS_INSWAP_INTS(&op.type, 2);
+	SQUASHFS_INSWAP_LONG_LONGS(&op.offset, 2);
+	write_delta(&op, sizeof(op));
+
+	if(pending.type == DELTA_DATA) {
+		copy_data(new->fd, pending.offset, delta_bytes,
+			pending.length, new->name);
+		delta_bytes += pending.length;
+		new_bytes += pending.length;
+	} else
+		copied_bytes += pending.length;
+
+	pending.length = 0;
+}
+
+
+/*
+ * Add an operation, joining it to the pending operation if it follows on
+ * from it.  offset is in the old filesystem for DELTA_COPY, and in the new
+ * filesystem for DELTA_DATA
+ */
+static void add_op(struct image *new, int type, long long offset,
+	long long length)
+{
+	if(length == 0)
+		return;
+
+	if(pending.length && (pending.type != type || pending.offset +
+			pending.length != offset))
+		flush_op(new);
+
+	if(pending.length == 0) {
+		pending.type = type;
+		pending.offset = offset;
+	}
+
+	pending.length += length;
+}
+
+
+/*
+ * Find the old block the same as the new block in buffer, using a hash
+ * table of the old blocks (open addressing, holding the index of the
+ * block plus one)
+ */
+static int *hash_table;
+static unsigned int hash_mask;
+
+static struct block *lookup_old(struct image *old, unsigned long long hash,
+	unsigned char *buffer, unsigned char *old_buffer, int size)
+{
+	unsigned int slot;
+
+	for(slot = hash & hash_mask; hash_table[slot];
+			slot = (slot + 1) & hash_mask) {
+		struct block *block = &old->block[hash_table[slot] - 1];
+
+		if(block->hash != hash || block->size != size)
+			continue;
+
+		read_bytes(old->fd, block->start, size, old_buffer, old->name);
+		if(memcmp(buffer, old_buffer, size) == 0)
+			return block;
+	}
+
+	return NULL;
+}
+
+
+static void make_delta(char *old_name, char *new_name)
+{
+	struct image old, new;
+	struct delta_header header;
+	struct delta_op op;
+	unsigned char *buffer, *old_buffer;
+	unsigned int block_size, slot;
+	long long pos;
+	int n;
+
+	memset(&old, 0, sizeof(old));
+	memset(&new, 0, sizeof(new));
+	open_image(&old, old_name);
+	open_image(&new, new_name);
+
+	block_size = sqfs_block_size(old.fs) > sqfs_block_size(new.fs) ?
+		sqfs_block_size(old.fs) : sqfs_block_size(new.fs);
+	buffer = malloc(block_size);
+	old_buffer = malloc(block_size);
+	for(hash_mask = 1; hash_mask < old.blocks * 2; hash_mask <<= 1);
+	hash_table = calloc(hash_mask, sizeof(int));
+	if(buffer == NULL || old_buffer == NULL || hash_table == NULL)
+		MEM_ERROR();
+	hash_mask --;
+
+	for(n = 0; n < old.blocks; n++) {
+		struct block *block = &old.block[n];
+
+		if(block->size > block_size)
+			BAD_ERROR("Block at %lld in %s is corrupt\n",
+				block->start, old.name);
+
+		read_bytes(old.fd, block->start, block->size, buffer,
+			old.name);
+		block->hash = hash_block(buffer, block->size);
+
+		for(slot = block->hash & hash_mask; hash_table[slot];
+				slot = (slot + 1) & hash_mask);
+		hash_table[slot] = n + 1;
+	}
+
+	header.magic = DELTA_MAGIC;
+	header.version = DELTA_VERSION;
+	header.old_size = old.size;
+	header.new_size = new.size;
+	read_bytes(old.fd, 0, sizeof(header.old_super), header.old_super,
+		old.name);
+	SQUASHFS_INSWAP_INTS(&header.magic, 2);
+	SQUASHFS_INSWAP_LONG_LONGS(&header.old_size, 2);
+	write_delta(&header, sizeof(header));
+
+	/*
+	 * Go through the new filesystem in order, copying the blocks in the
+	 * old filesystem, and storing everything else
+	 */
+	for(pos = n = 0; n < new.blocks; n++) {
+		struct block *block = &new.block[n], *match;
+
+		/* blocks inside another block mean a corrupt filesystem */
+		if(block->start < pos || block->size > block_size ||
+				block->start + block->size > new.size)
+			BAD_ERROR("Block at %lld in %s is corrupt\n",
+				block->start, new.name);
+
+		add_op(&new, DELTA_DATA, pos, block->start - pos);
+
+		read_bytes(new.fd, block->start, block->size, buffer,
+			new.name);
+		match = lookup_old(&old, hash_block(buffer, block->size),
+			buffer, old_buffer, block->size);
+		if(match)
+			add_op(&new, DELTA_COPY, match->start, block->size);
+		else
+			add_op(&new, DELTA_DATA, block->start, block->size);
+
+		pos = block->start + block->size;
+	}
+
+	add_op(&new, DELTA_DATA, pos, new.size - pos);
+	flush_op(&new);
+
+	memset(&op, 0, sizeof(op));
+	op.type = DELTA_END;
+	SQUASHFS_INSWAP_INTS(&op.type, 1);
+	write_delta(&op, sizeof(op));
+
+	printf("Delta of %lld bytes, %lld bytes copied from %s, %lld bytes "
+		"new\n", delta_bytes, copied_bytes, old.name, new_bytes);
+
+	free(buffer);
+	free(old_buffer);
+	free(hash_table);
+	free(old.block);
+	free(new.block);
+	sqfs_close(old.fs);
+	sqfs_close(new.fs);
+}
+
+
+static void apply_delta(char *old_name, char *delta_name)
+{
+	struct delta_header header;
+	struct delta_op op;
+	char super[DELTA_SUPER];
+	long long offset = sizeof(header), pos = 0;
+	struct stat buf;
+	int old_fd, delta_fd;
+
+	old_fd = open(old_name, O_RDONLY);
+	if(old_fd == -1)
+		BAD_ERROR("Failed to open %s, because %s\n", old_name,
+			strerror(errno));
+
+	delta_fd = open(delta_name, O_RDONLY);
+	if(delta_fd == -1)
+		BAD_ERROR("Failed to open %s, because %s\n", delta_name,
+			strerror(errno));
+
+	read_bytes(delta_fd, 0, sizeof(header), &header, delta_name);
+	SQUASHFS_INSWAP_INTS(&header.magic, 2);
+	SQUASHFS_INSWAP_LONG_LONGS(&header.old_size, 2);
+	if(header.magic != DELTA_MAGIC || header.version != DELTA_VERSION)
+		BAD_ERROR("%s is not a delta, or is an unsupported version\n",
+			delta_name);
+
+	if(fstat(old_fd, &buf) == -1)
+		BAD_ERROR("Failed to stat %s, because %s\n", old_name,
+			strerror(errno));
+
+	read_bytes(old_fd, 0, sizeof(super), super, old_name);
+	if(buf.st_size != header.old_size || memcmp(super, header.old_super,
+			sizeof(super)))
+		BAD_ERROR("%s is not the filesystem the delta was made "
+			"from\n", old_name);
+
+	while(1) {
+		read_bytes(delta_fd, offset, sizeof(op), &op, delta_name);
+		SQUASHFS_INSWAP_INTS(&op.type, 2);
+		SQUASHFS_INSWAP_LONG_LONGS(&op.offset, 2);
+		offset += sizeof(op);
+
+		if(op.type == DELTA_END)
+			break;
+
+		if(op.length < 0 || pos + op.length > header.new_size)
+			BAD_ERROR("%s is corrupt\n", delta_name);
+
+		if(op.type == DELTA_COPY) {
+			if(op.offset < 0 || op.offset + op.length >
+					header.old_size)
+				BAD_ERROR("%s is corrupt\n", delta_name);
+			copy_data(old_fd, op.offset, pos, op.length, old_name);
+			copied_bytes += op.length;
+		} else if(op.type == DELTA_DATA) {
+			copy_data(delta_fd, offset, pos, op.length,
+				delta_name);
+			offset += op.length;
+			new_bytes += op.length;
+		} else
+			BAD_ERROR("%s is corrupt\n", delta_name);
+
+		pos += op.length;
+	}
+
+	if(pos != header.new_size)
+		BAD_ERROR("%s is corrupt\n", delta_name);
+
+	printf("Wrote %s, %lld bytes copied from %s, %lld bytes from %s\n",
+		destination, copied_bytes, old_name, new_bytes, delta_name);
+
+	close(old_fd);
+	close(delta_fd);
+}
+
+
+#define VERSION() \
+	printf("deltasquashfs version 4.3 (2014/05/12)\n");\
+	printf("copyright (C) 2014 Phillip Lougher "\
+		"<phillip@squashfs.org.uk>\n\n");\
+    	printf("This program is free software; you can redistribute it and/or"\
+		"\n");\
+	printf("modify it under the terms of the GNU General Public License"\
+		"\n");\
+	printf("as published by the Free Software Foundation; either version "\
+		"2,\n");\
+	printf("or (at your option) any later version.\n\n");\
+	printf("This program is distributed in the hope that it will be "\
+		"useful,\n");\
+	printf("but WITHOUT ANY WARRANTY; without even the implied warranty of"\
+		"\n");\
+	printf("MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the"\
+		"\n");\
+	printf("GNU General Public License for more details.\n");
+int main(int argc, char *argv[])
+{
+	int n, apply = FALSE;
+
+	for(n = 1; n < argc; n++) {
+		if(*argv[n] != '-')
+			break;
+		if(strcmp(argv[n], "-version") == 0 ||
+				strcmp(argv[n], "-v") == 0) {
+			VERSION();
+			exit(0);
+		} else if(strcmp(argv[n], "-apply") == 0 ||
+				strcmp(argv[n], "-a") == 0)
+			apply = TRUE;
+		else
+			goto options;
+	}
+
+	if(n + 3 != argc)
+		goto options;
+
+	destination = argv[n + 2];
+	dest_fd = open(destination, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR |
+		S_IWUSR | S_IRGRP | S_IROTH);
+	if(dest_fd == -1) {
+		fprintf(stderr, "FATAL ERROR: Failed to create %s, because "
+			"%s\n", destination, strerror(errno));
+		exit(1);
+	}
+
+	if(apply)
+		apply_delta(argv[n], argv[n + 1]);
+	else
+		make_delta(argv[n], argv[n + 1]);
+
+	if(close(dest_fd) == -1) {
+		fprintf(stderr, "FATAL ERROR: Failed to close %s, because "
+			"%s\n", destination, strerror(errno));
+		unlink(destination);
+		exit(1);
+	}
+
+	return 0;
+
+options:
+	fprintf(stderr, "SYNTAX: %s [options] old-filesystem new-filesystem "
+		"delta\n", argv[0]);
+	fprintf(stderr, "        %s -apply old-filesystem delta "
+		"new-filesystem\n\n", argv[0]);
+	fprintf(stderr, "\t-v[ersion]\t\tprint version, licence and "
+		"copyright information\n");
+	fprintf(stderr, "\t-a[pply]\t\tapply the delta to old-filesystem, "
+		"writing\n\t\t\t\tnew-filesystem\n");
+	exit(1);
+}
@@ -0,0 +1,443 @@
+/*
+ * Create a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2014
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * filetype.c
+ *
+ * Classify files for the action file() test.  Built with MAGIC_SUPPORT the
+ * classification is done by libmagic, which gives the same descriptions as
+ * file(1).  Otherwise common file types are recognised by a built-in magic
+ * table, and only the files it doesn't recognise are passed to file(1)
+ */
+
+#include <fcntl.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+
+#ifdef MAGIC_SUPPORT
+#include <magic.h>
+#endif
+
+#include "squashfs_fs.h"
+#include "mksquashfs.h"
+#include "filetype.h"
+#include "error.h"
+
+static struct filetype_entry *filetype_table[FILETYPE_HASH_SIZE];
+
+#ifdef MAGIC_SUPPORT
+static magic_t cookie = NULL;
+
+static char *classify(char *pathname, struct inode_stat *buf)
+{
+	const char *type;
+	char *res;
+
+	if (cookie == NULL) {
+		cookie = magic_open(MAGIC_NONE);
+		if (cookie == NULL)
+			BAD_ERROR("file_type: magic_open failed\n");
+
+		if (magic_load(cookie, NULL) == -1)
+			BAD_ERROR("file_type: failed to load magic database, "
+				"because %s\n", magic_error(cookie));
+	}
+
+	type = magic_file(cookie, pathname);
+	if (type == NULL)
+		BAD_ERROR("file_type: failed to classify %s, because %s\n",
+			pathname, magic_error(cookie));
+
+	res = strdup(type);
+	if (res == NULL)
+		MEM_ERROR();
+
+	return res;
+}
+#else
+/*
+ * The built-in magic table.  Each entry matches length bytes at offset,
+ * and gives the leading part of the description file(1) prints for the
+ * type.  ELF is handled separately, as its description is built from the
+ * header fields
+ */
+static struct magic {
+	int offset;
+	int length;
+	char *bytes;
+	char *type;
+} magic_table[] = {
+	{ 0, 2, "\x1f\x8b", "gzip compressed data" },
+	{ 0, 3, "BZh", "bzip2 compressed data" },
+	{ 0, 6, "\xfd" "7zXZ\0", "XZ compressed data" },
+	{ 0, 4, "\x28\xb5\x2f\xfd", "Zstandard compressed data" },
+	{ 0, 4, "\x04\x22\x4d\x18", "LZ4 compressed data" },
+	{ 0, 4, "\x89LZO", "lzop compressed data" },
+	{ 0, 6, "7z\xbc\xaf\x27\x1c", "7-zip archive data" },
+	{ 257, 6, "ustar\0", "POSIX tar archive" },
+	{ 257, 8, "ustar  \0", "POSIX tar archive (GNU)" },
+	{ 0, 6, "070701", "ASCII cpio archive (SVR4 with no CRC)" },
+	{ 0, 6, "070702", "ASCII cpio archive (SVR4 with CRC)" },
+	{ 0, 4, "hsqs", "Squashfs filesystem, little endian" },
+	{ 0, 4, "sqsh", "Squashfs filesystem, big endian" },
+	{ 0, 8, "\x89PNG\r\n\x1a\n", "PNG image data" },
+	{ 0, 3, "\xff\xd8\xff", "JPEG image data" },
+	{ 0, 6, "GIF87a", "GIF image data, version 87a" },
+	{ 0, 6, "GIF89a", "GIF image data, version 89a" },
+	{ 0, 5, "%PDF-", "PDF document" },
+	{ 0, 4, "dex\n", "Dalvik dex file" },
+	{ 0, 0, NULL, NULL }
+};
+
+
+static char *elf_machine(int machine)
+{
+	switch(machine) {
+	case 2:
+		return "SPARC";
+	case 3:
+		return "Intel 80386";
+	case 8:
+		return "MIPS";
+	case 20:
+		return "PowerPC or cisco 4500";
+	case 21:
+		return "64-bit PowerPC or cisco 7500";
+	case 22:
+		return "IBM S/390";
+	case 40:
+		return "ARM";
+	case 43:
+		return "SPARC V9";
+	case 62:
+		return "x86-64";
+	case 183:
+		return "ARM aarch64";
+	case 243:
+		return "UCB RISC-V";
+	default:
+		return NULL;
+	}
+}
+
+
+static unsigned long long elf_field(unsigned char *p, int size, int msb)
+{
+	unsigned long long value = 0;
+	int i;
+
+	for(i = 0; i < size; i++)
+		value |= (unsigned long long) p[msb ? i : size - 1 - i] <<
+			((size - 1 - i) * 8);
+
+	return value;
+}
+
+
+/*
+ * Describe an ELF file as "ELF <class> <data> <type>, <machine>, version 1
+ * (<abi>)[, dynamically linked|statically linked]".  This is the leading
+ * part of the file(1) description, without the interpreter, build-id and
+ * stripped fields, which would need the section headers
+ */
+static char *elf_type(unsigned char *buffer, int bytes)
+{
+	int is64, msb, type, machine, phentsize, phnum, i;
+	long long phoff;
+	int interp = 0, dynamic = 0;
+	char *type_str, *machine_str, *abi_str, *link_str = "";
+	char *res;
+
+	if(bytes < 52 || buffer[4] < 1 || buffer[4] > 2 || buffer[5] < 1 ||
+			buffer[5] > 2)
+		return NULL;
+
+	is64 = buffer[4] == 2;
+	msb = buffer[5] == 2;
+	type = elf_field(buffer + 16, 2, msb);
+	machine = elf_field(buffer + 18, 2, msb);
+
+	if(is64 && bytes < 64)
+		return NULL;
+
+	phoff = elf_field(buffer + (is64 ? 32 : 28), is64 ? 8 : 4, msb);
+	phentsize = elf_field(buffer + (is64 ? 54 : 42), 2, msb);
+	phnum = elf_field(buffer + (is64 ? 56 : 44), 2, msb);
+
+	/* leave files whose program headers aren't in the buffer to file(1) */
+	if(phentsize < 4 || phoff + phnum * phentsize > bytes)
+		return NULL;
+
+	for(i = 0; i < phnum; i++) {
+		int p_type = elf_field(buffer + phoff + i * phentsize, 4, msb);
+
+		if(p_type == 2)
+			dynamic = 1;
+		else if(p_type == 3)
+			interp = 1;
+	}
+
+	switch(type) {
+	case 1:
+		type_str = "relocatable";
+		break;
+	case 2:
+		type_str = "executable";
+		break;
+	case 3:
+		type_str = interp ? "pie executable" : "shared object";
+		break;
+	case 4:
+		type_str = "core file";
+		break;
+	default:
+		return NULL;
+	}
+
+	machine_str = elf_machine(machine);
+	if(machine_str == NULL)
+		return NULL;
+
+	switch(buffer[7]) {
+	case 0:
+		abi_str = "SYSV";
+		break;
+	case 3:
+		abi_str = "GNU/Linux";
+		break;
+	default:
+		return NULL;
+	}
+
+	if(type == 2 || type == 3)
+		link_str = dynamic ? ", dynamically linked" :
+			", statically linked";
+
+	if(asprintf(&res, "ELF %d-bit %s %s, %s, version %d (%s)%s",
+			is64 ? 64 : 32, msb ? "MSB" : "LSB", type_str,
+			machine_str, buffer[6], abi_str, link_str) == -1)
+		MEM_ERROR();
+
+	return res;
+}
+
+
+static char *builtin_type(char *pathname, struct inode_stat *buf)
+{
+	unsigned char buffer[FILETYPE_READ_SIZE];
+	char link[PATH_MAX + 1];
+	char *res = NULL;
+	int fd, bytes, i;
+
+	switch(buf->st_mode & S_IFMT) {
+	case S_IFDIR:
+		res = strdup("directory");
+		break;
+	case S_IFLNK:
+		bytes = readlink(pathname, link, PATH_MAX);
+		if(bytes == -1)
+			return NULL;
+		link[bytes] = '\0';
+		if(asprintf(&res, "symbolic link to %s", link) == -1)
+			MEM_ERROR();
+		return res;
+	case S_IFCHR:
+		if(asprintf(&res, "character special (%d/%d)",
+				major(buf->st_rdev), minor(buf->st_rdev)) == -1)
+			MEM_ERROR();
+		return res;
+	case S_IFBLK:
+		if(asprintf(&res, "block special (%d/%d)",
+				major(buf->st_rdev), minor(buf->st_rdev)) == -1)
+			MEM_ERROR();
+		return res;
+	case S_IFIFO:
+		res = strdup("fifo (named pipe)");
+		break;
+	case S_IFSOCK:
+		res = strdup("socket");
+		break;
+	case S_IFREG:
+		if(buf->st_size != 0)
+			goto regular;
+		res = strdup("empty");
+		break;
+	default:
+		return NULL;
+	}
+
+	if(res == NULL)
+		MEM_ERROR();
+
+	return res;
+
+regular:
+	fd = open(pathname, O_RDONLY);
+	if(fd == -1)
+		return NULL;
+
+	bytes = read_bytes(fd, buffer, FILETYPE_READ_SIZE);
+	close(fd);
+	if(bytes == -1)
+		return NULL;
+
+	if(bytes >= 4 && memcmp(buffer, "\x7f" "ELF", 4) == 0)
+		return elf_type(buffer, bytes);
+
+	for(i = 0; magic_table[i].bytes; i++) {
+		struct magic *magic = &magic_table[i];
+
+		if(magic->offset + magic->length <= bytes &&
+				memcmp(buffer + magic->offset, magic->bytes,
+				magic->length) == 0) {
+			res = strdup(magic->type);
+			if(res == NULL)
+				MEM_ERROR();
+			return res;
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Run file -b on the file and return its output, without the trailing
+ * newline
+ */
+static char *run_file(char *pathname)
+{
+	int child, res, size = 0, status;
+	int pipefd[2];
+	char *buffer = NULL;
+
+	res = pipe(pipefd);
+	if (res == -1)
+		BAD_ERROR("file_fn pipe failed\n");
+
+	child = fork();
+	if (child == -1)
+		BAD_ERROR("file_fn fork_failed\n");
+
+	if (child == 0) {
+		/*
+		 * Child process
+		 * Connect stdout to pipefd[1] and execute file command
+		 */
+		close(STDOUT_FILENO);
+		res = dup(pipefd[1]);
+		if (res == -1)
+			exit(EXIT_FAILURE);
+
+		execlp("file", "file", "-b", pathname, (char *) NULL);
+		exit(EXIT_FAILURE);
+	}
+
+	/*
+	 * Parent process.  Read stdout from file command
+ 	 */
+	close(pipefd[1]);
+
+	do {
+		buffer = realloc(buffer, size + 512);
+		if (buffer == NULL)
+			MEM_ERROR();
+
+		res = read_bytes(pipefd[0], buffer + size, 512);
+
+		if (res == -1)
+			BAD_ERROR("file_fn pipe read error\n");
+
+		size += 512;
+
+	} while (res == 512);
+
+	size = size + res - 512;
+
+	if (size && buffer[size - 1] == '\n')
+		size --;
+
+	buffer[size] = '\0';
+
+	res = waitpid(child,  &status, 0);
+
+	if (res == -1)
+		BAD_ERROR("file_fn waitpid failed\n");
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		BAD_ERROR("file_fn file returned error\n");
+
+	close(pipefd[0]);
+
+	return buffer;
+}
+
+
+static char *classify(char *pathname, struct inode_stat *buf)
+{
+	char *res = builtin_type(pathname, buf);
+
+	return res ? res : run_file(pathname);
+}
+#endif
+
+
+/*
+ * Return the description of the file at pathname.  The description is
+ * cached by source inode, and the returned string remains valid.  Pseudo
+ * files (st_dev 0) have no source inode and are not cached
+ */
+char *file_type(char *pathname, struct inode_stat *buf)
+{
+	int hash = FILETYPE_HASH(buf->st_dev, buf->st_ino);
+	struct filetype_entry *entry;
+
+	if(buf->st_dev == 0) {
+		static char *type = NULL;
+
+		free(type);
+		return type = classify(pathname, buf);
+	}
+
+	for(entry = filetype_table[hash]; entry; entry = entry->next)
+		if(entry->st_ino == buf->st_ino && entry->st_dev == buf->st_dev)
+			return entry->type;
+
+	entry = malloc(sizeof(struct filetype_entry));
+	if(entry == NULL)
+		MEM_ERROR();
+
+	entry->st_dev = buf->st_dev;
+	entry->st_ino = buf->st_ino;
+	entry->type = classify(pathname, buf);
+	entry->next = filetype_table[hash];
+	filetype_table[hash] = entry;
+
+	return entry->type;
+}
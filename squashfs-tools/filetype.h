@@ -0,0 +1,46 @@
+#ifndef FILETYPE_H
+#define FILETYPE_H
+/*
+ * Create a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2014
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * filetype.h
+ */
+
+#define FILETYPE_READ_SIZE 4096
+#define FILETYPE_HASH_SIZE 65536
+#define FILETYPE_HASH(dev, ino) (((ino) ^ ((dev) << 8)) & \
+					(FILETYPE_HASH_SIZE - 1))
+
+/*
+ * Cache of the descriptions already obtained, indexed by source inode, so
+ * hard links and repeated file() tests only classify a file once
+ */
+struct filetype_entry {
+	dev_t			st_dev;
+	ino_t			st_ino;
+	char			*type;
+	struct filetype_entry	*next;
+};
+
+struct inode_stat;
+
+extern char *file_type(char *, struct inode_stat *);
+#endif
@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2014
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * gzip_offload.c
+ *
+ * Support for offloading gzip compression to a hardware deflate
+ * accelerator (Intel IAA), using the Intel Query Processing Library
+ * https://github.com/intel/qpl
+ *
+ * The accelerator is asynchronous, each compressing thread submits up to
+ * its queue depth of blocks, and then collects them as they finish, in
+ * whatever order that is.  The accelerator produces raw deflate data,
+ * which is made into a zlib stream (as produced by zlib's deflate())
+ * by adding the zlib header and adler32 trailer.  The filesystem is
+ * therefore an ordinary gzip filesystem
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <zlib.h>
+#include <qpl/qpl.h>
+
+#include "gzip_offload.h"
+
+/* deflate, 32K window, default compression, (0x78 << 8 | 0x9c) % 31 == 0 */
+#define ZLIB_CMF 0x78
+#define ZLIB_FLG 0x9c
+
+struct offload_job {
+	qpl_job		*job;
+	void		*tag;
+	unsigned char	*dest;
+	void		*src;
+	int		size;
+	int		busy;
+	long long	sequence;
+};
+
+struct gzip_offload {
+	int			depth;
+	long long		submitted;
+	struct offload_job	job[0];
+};
+
+
+/*
+ * Create a thread's set of accelerator jobs.  This returns NULL if
+ * there's no accelerator, in which case the thread compresses in software
+ */
+struct gzip_offload *gzip_offload_init(int depth)
+{
+	struct gzip_offload *offload;
+	uint32_t size;
+	int i;
+
+	if(qpl_get_job_size(qpl_path_hardware, &size) != QPL_STS_OK)
+		return NULL;
+
+	offload = malloc(sizeof(*offload) + depth * sizeof(struct offload_job));
+	if(offload == NULL)
+		return NULL;
+
+	offload->depth = depth;
+	offload->submitted = 0;
+
+	for(i = 0; i < depth; i++) {
+		offload->job[i].job = malloc(size);
+		offload->job[i].busy = 0;
+		if(offload->job[i].job == NULL)
+			goto failed;
+
+		if(qpl_init_job(qpl_path_hardware, offload->job[i].job) !=
+								QPL_STS_OK) {
+			free(offload->job[i].job);
+			goto failed;
+		}
+	}
+
+	return offload;
+
+failed:
+	while(i--) {
+		qpl_fini_job(offload->job[i].job);
+		free(offload->job[i].job);
+	}
+	free(offload);
+	return NULL;
+}
+
+
+/*
+ * Submit a block to the accelerator.  This returns GZIP_OFFLOAD_OK,
+ * GZIP_OFFLOAD_BUSY if the accelerator can't take the block (it should be
+ * compressed in software), or -1 on error, with the QPL status in *error
+ */
+int gzip_offload_submit(struct gzip_offload *offload, void *d, void *s,
+	int size, int block_size, void *tag, int *error)
+{
+	struct offload_job *job;
+	qpl_status res;
+	int i;
+
+	for(i = 0; i < offload->depth && offload->job[i].busy; i++);
+	if(i == offload->depth)
+		return GZIP_OFFLOAD_BUSY;
+
+	job = &offload->job[i];
+	job->job->op = qpl_op_compress;
+	job->job->level = qpl_default_level;
+	job->job->next_in_ptr = s;
+	job->job->available_in = size;
+	job->job->next_out_ptr = (uint8_t *) d + GZIP_OFFLOAD_HEADER;
+	job->job->available_out = block_size - GZIP_OFFLOAD_HEADER -
+		GZIP_OFFLOAD_TRAILER;
+	job->job->flags = QPL_FLAG_FIRST | QPL_FLAG_LAST |
+		QPL_FLAG_DYNAMIC_HUFFMAN;
+
+	res = qpl_submit_job(job->job);
+	if(res == QPL_STS_QUEUES_ARE_BUSY_ERR)
+		return GZIP_OFFLOAD_BUSY;
+	if(res != QPL_STS_OK) {
+		*error = res;
+		return -1;
+	}
+
+	job->tag = tag;
+	job->dest = d;
+	job->src = s;
+	job->size = size;
+	job->busy = 1;
+	job->sequence = offload->submitted ++;
+
+	return GZIP_OFFLOAD_OK;
+}
+
+
+static int offload_finish(struct offload_job *job, qpl_status res, void **tag,
+	int *error)
+{
+	unsigned long adler;
+	int bytes;
+
+	job->busy = 0;
+	*tag = job->tag;
+
+	/* the block didn't compress to less than the block size */
+	if(res == QPL_STS_MORE_OUTPUT_NEEDED || res == QPL_STS_DST_IS_SHORT_ERR)
+		return 0;
+
+	if(res != QPL_STS_OK) {
+		*error = res;
+		return -1;
+	}
+
+	adler = adler32(1, job->src, job->size);
+	bytes = job->job->total_out + GZIP_OFFLOAD_HEADER;
+
+	job->dest[0] = ZLIB_CMF;
+	job->dest[1] = ZLIB_FLG;
+	job->dest[bytes] = adler >> 24;
+	job->dest[bytes + 1] = adler >> 16;
+	job->dest[bytes + 2] = adler >> 8;
+	job->dest[bytes + 3] = adler;
+
+	return bytes + GZIP_OFFLOAD_TRAILER;
+}
+
+
+/*
+ * Collect a block from the accelerator, the first one found to have
+ * finished, or if none have, and wait is set, the longest outstanding.
+ * This returns the compressed size (0 if the block didn't compress), and
+ * the block's tag in *tag, GZIP_OFFLOAD_PENDING if no block has finished
+ * (and wait isn't set), or -1 on error
+ */
+int gzip_offload_collect(struct gzip_offload *offload, void **tag, int wait,
+	int *error)
+{
+	struct offload_job *oldest = NULL;
+	int i;
+
+	for(i = 0; i < offload->depth; i++) {
+		struct offload_job *job = &offload->job[i];
+		qpl_status res;
+
+		if(!job->busy)
+			continue;
+
+		res = qpl_check_job(job->job);
+		if(res != QPL_STS_BEING_PROCESSED)
+			return offload_finish(job, res, tag, error);
+
+		if(oldest == NULL || job->sequence < oldest->sequence)
+			oldest = job;
+	}
+
+	if(!wait || oldest == NULL)
+		return GZIP_OFFLOAD_PENDING;
+
+	return offload_finish(oldest, qpl_wait_job(oldest->job), tag, error);
+}
@@ -0,0 +1,52 @@
+#ifndef GZIP_OFFLOAD_H
+#define GZIP_OFFLOAD_H
+/*
+ * Squashfs
+ *
+ * Copyright (c) 2014
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * gzip_offload.h
+ *
+ */
+
+/* blocks each compressing thread can have in flight on the accelerator */
+#define GZIP_OFFLOAD_DEPTH 8
+
+/*
+ * A zlib stream is the raw deflate data between a 2 byte header and a
+ * 4 byte adler32 trailer
+ */
+#define GZIP_OFFLOAD_HEADER 2
+#define GZIP_OFFLOAD_TRAILER 4
+
+/* gzip_offload_submit() results */
+#define GZIP_OFFLOAD_OK 0
+#define GZIP_OFFLOAD_BUSY 1
+
+/* gzip_offload_collect() result if no block has finished */
+#define GZIP_OFFLOAD_PENDING -2
+
+struct gzip_offload;
+
+#ifdef GZIP_OFFLOAD
+extern struct gzip_offload *gzip_offload_init(int);
+extern int gzip_offload_submit(struct gzip_offload *, void *, void *, int,
+	int, void *, int *);
+extern int gzip_offload_collect(struct gzip_offload *, void **, int, int *);
+#endif
+#endif
@@ -25,8 +25,12 @@
 #include <string.h>
 #include <stdlib.h>
 #include <zlib.h>
+#ifdef LIBDEFLATE_SUPPORT
+#include <libdeflate.h>
+#endif
 
 #include "squashfs_fs.h"
+#include "gzip_offload.h"
 #include "gzip_wrapper.h"
 #include "compressor.h"
 
@@ -47,6 +51,14 @@ static int compression_level = GZIP_DEFAULT_COMPRESSION_LEVEL;
 /* default window size */
 static int window_size = GZIP_DEFAULT_WINDOW_SIZE;
 
+/* compress using a hardware accelerator, if there is one */
+static int offload = 0;
+
+#ifdef LIBDEFLATE_SUPPORT
+/* compress using zlib rather than libdeflate */
+static int use_zlib = 0;
+#endif
+
 /*
  * This function is called by the options parsing code in mksquashfs.c
  * to parse any -X compressor option.
@@ -130,6 +142,16 @@ static int gzip_options(char *argv[], int argc)
 		}
 	
 		return 1;
+#ifdef LIBDEFLATE_SUPPORT
+	} else if(strcmp(argv[0], "-Xzlib") == 0) {
+		use_zlib = 1;
+		return 0;
+#endif
+#ifdef GZIP_OFFLOAD
+	} else if(strcmp(argv[0], "-Xoffload") == 0) {
+		offload = 1;
+		return 0;
+#endif
 	}
 
 	return -1;
@@ -154,6 +176,13 @@ static int gzip_options_post(int block_size)
 		strategy[0].selected = 0;
 	}
 
+	/* the accelerator compresses each block once, with its own strategy */
+	if(offload && strategy_count) {
+		fprintf(stderr, "gzip: -Xoffload can't be used with "
+			"-Xstrategy\n");
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -381,9 +410,45 @@ static int gzip_init(void **strm, int block_size, int datablock)
 	if(res != Z_OK)
 		goto failed2;
 
+	stream->offload = NULL;
+	stream->done = 0;
+	stream->libdeflate = NULL;
+	stream->level = compression_level;
+	stream->tries = stream->strategies;
+
+#ifdef LIBDEFLATE_SUPPORT
+	/*
+	 * libdeflate only has the one strategy, and always uses the largest
+	 * window, so if either were chosen, compress using zlib
+	 */
+	if(!use_zlib && stream->strategies == 1 &&
+				window_size == GZIP_DEFAULT_WINDOW_SIZE) {
+		stream->libdeflate =
+			libdeflate_alloc_compressor(compression_level);
+		if(stream->libdeflate == NULL)
+			goto failed3;
+	}
+#endif
+
+#ifdef GZIP_OFFLOAD
+	if(offload) {
+		static int warned = 0;
+
+		stream->offload = gzip_offload_init(GZIP_OFFLOAD_DEPTH);
+		if(stream->offload == NULL && !__atomic_exchange_n(&warned, 1,
+							__ATOMIC_RELAXED))
+			fprintf(stderr, "gzip: -Xoffload no accelerator "
+				"available, compressing in software\n");
+	}
+#endif
+
 	*strm = stream;
 	return 0;
 
+#ifdef LIBDEFLATE_SUPPORT
+failed3:
+	deflateEnd(&stream->stream);
+#endif
 failed2:
 	for(i = 1; i < stream->strategies; i++)
 		free(stream->strategy[i].buffer);
@@ -393,16 +458,25 @@ failed:
 }
 
 
-static int gzip_compress(void *strm, void *d, void *s, int size, int block_size,
-		int *error)
+/*
+ * Compress trying the first count strategies, and select the best
+ */
+static int compress_strategies(struct gzip_stream *stream, void *d, void *s,
+	int size, int block_size, int count, int *error)
 {
 	int i, res;
-	struct gzip_stream *stream = strm;
 	struct gzip_strategy *selected = NULL;
 
+#ifdef LIBDEFLATE_SUPPORT
+	/* libdeflate returns 0 if the output buffer overflowed */
+	if(stream->libdeflate)
+		return libdeflate_zlib_compress(stream->libdeflate, s, size, d,
+			block_size);
+#endif
+
 	stream->strategy[0].buffer = d;
 
-	for(i = 0; i < stream->strategies; i++) {
+	for(i = 0; i < count; i++) {
 		struct gzip_strategy *strategy = &stream->strategy[i];
 
 		res = deflateReset(&stream->stream);
@@ -416,7 +490,7 @@ static int gzip_compress(void *strm, void *d, void *s, int size, int block_size,
 
 		if(stream->strategies > 1) {
 			res = deflateParams(&stream->stream,
-				compression_level, strategy->strategy);
+				stream->level, strategy->strategy);
 			if(res != Z_OK)
 				goto failed;
 		}
@@ -451,19 +525,237 @@ failed:
 }
 
 
-static int gzip_uncompress(void *d, void *s, int size, int outsize, int *error)
+#ifdef GZIP_OFFLOAD
+static int gzip_queue_depth(void *strm)
+{
+	struct gzip_stream *stream = strm;
+
+	return stream->offload ? GZIP_OFFLOAD_DEPTH : 0;
+}
+
+
+static int gzip_submit(void *strm, void *d, void *s, int size, int block_size,
+	void *tag, int *error)
+{
+	struct gzip_stream *stream = strm;
+	int res = gzip_offload_submit(stream->offload, d, s, size, block_size,
+		tag, error);
+
+	if(res != GZIP_OFFLOAD_BUSY)
+		return res;
+
+	/* the accelerator can't take the block, compress it here */
+	res = compress_strategies(stream, d, s, size, block_size, 1, error);
+	if(res == -1)
+		return -1;
+
+	stream->done_list[stream->done].tag = tag;
+	stream->done_list[stream->done++].bytes = res;
+	return 0;
+}
+
+
+static int gzip_collect(void *strm, void **tag, int wait, int *error)
+{
+	struct gzip_stream *stream = strm;
+	int res;
+
+	if(stream->done) {
+		*tag = stream->done_list[--stream->done].tag;
+		return stream->done_list[stream->done].bytes;
+	}
+
+	res = gzip_offload_collect(stream->offload, tag, wait, error);
+
+	return res == GZIP_OFFLOAD_PENDING ? COMPRESSOR_PENDING : res;
+}
+#endif
+
+
+static int gzip_compress(void *strm, void *d, void *s, int size, int block_size,
+		int *error)
+{
+	struct gzip_stream *stream = strm;
+
+#ifdef GZIP_OFFLOAD
+	if(stream->offload) {
+		void *tag;
+
+		if(gzip_submit(stream, d, s, size, block_size, NULL,
+							error) == -1)
+			return -1;
+		return gzip_collect(stream, &tag, 1, error);
+	}
+#endif
+
+	return compress_strategies(stream, d, s, size, block_size,
+		stream->tries, error);
+}
+
+
+static int gzip_compress_fast(void *strm, void *d, void *s, int size,
+	int block_size, int *error)
+{
+	struct gzip_stream *stream = strm;
+
+	/* with -Xoffload there's only the one choice */
+	if(stream->offload)
+		return gzip_compress(strm, d, s, size, block_size, error);
+
+	return compress_strategies(strm, d, s, size, block_size, 1, error);
+}
+
+
+/*
+ * The efforts are compression levels 1 to the level given, trying only the
+ * first strategy, and then the level given with all the strategies (if
+ * there is more than one).  Neither changes how the blocks decompress
+ */
+static int gzip_efforts()
+{
+	return compression_level + (strategy_count > 1);
+}
+
+
+static void gzip_effort(void *strm, int effort)
+{
+	struct gzip_stream *stream = strm;
+	int level = effort < compression_level ? effort + 1 :
+		compression_level;
+
+	stream->tries = effort < compression_level ? 1 : stream->strategies;
+
+	if(level == stream->level)
+		return;
+
+	/* if the level can't be changed, the stream stays at the old level */
+#ifdef LIBDEFLATE_SUPPORT
+	if(stream->libdeflate) {
+		struct libdeflate_compressor *libdeflate =
+			libdeflate_alloc_compressor(level);
+
+		if(libdeflate) {
+			libdeflate_free_compressor(stream->libdeflate);
+			stream->libdeflate = libdeflate;
+			stream->level = level;
+		}
+		return;
+	}
+#endif
+
+	/*
+	 * The level is kept by deflateReset(), the stream is reset first
+	 * so deflateParams() doesn't try to flush the previous block
+	 */
+	if(deflateReset(&stream->stream) == Z_OK && deflateParams(
+			&stream->stream, level, stream->strategy[0].strategy)
+			== Z_OK)
+		stream->level = level;
+}
+
+
+/*
+ * This function is called by each decompressing thread to create its
+ * decompression context, which is reset rather than initialised for
+ * each block
+ *
+ * This function returns 0 on success, and
+ *			-1 on error
+ */
+#ifdef LIBDEFLATE_SUPPORT
+static int gzip_uncompress_init(void **strm)
+{
+	*strm = libdeflate_alloc_decompressor();
+
+	return *strm == NULL ? -1 : 0;
+}
+#else
+static int gzip_uncompress_init(void **strm)
+{
+	z_stream *stream = malloc(sizeof(z_stream));
+
+	if(stream == NULL)
+		return -1;
+
+	stream->zalloc = Z_NULL;
+	stream->zfree = Z_NULL;
+	stream->opaque = 0;
+	stream->next_in = Z_NULL;
+	stream->avail_in = 0;
+
+	if(inflateInit(stream) != Z_OK) {
+		free(stream);
+		return -1;
+	}
+
+	*strm = stream;
+	return 0;
+}
+#endif
+
+
+#ifdef LIBDEFLATE_SUPPORT
+static void gzip_uncompress_free(void *strm)
+{
+	libdeflate_free_decompressor(strm);
+}
+#else
+static void gzip_uncompress_free(void *strm)
+{
+	inflateEnd(strm);
+	free(strm);
+}
+#endif
+
+
+static int gzip_uncompress(void *strm, void *d, void *s, int size, int outsize,
+	int *error)
 {
 	int res;
 	unsigned long bytes = outsize;
 
+#ifdef LIBDEFLATE_SUPPORT
+	if(strm) {
+		size_t actual;
+
+		res = libdeflate_zlib_decompress(strm, s, size, d, outsize,
+			&actual);
+		if(res == LIBDEFLATE_SUCCESS)
+			return (int) actual;
+		goto failed;
+	}
+#else
+	z_stream *stream = strm;
+
+	if(stream) {
+		res = inflateReset(stream);
+		if(res != Z_OK)
+			goto failed;
+
+		stream->next_in = s;
+		stream->avail_in = size;
+		stream->next_out = d;
+		stream->avail_out = outsize;
+
+		res = inflate(stream, Z_FINISH);
+		if(res == Z_STREAM_END)
+			return (int) stream->total_out;
+
+		/* as uncompress(), a truncated stream or output overflow */
+		if(res == Z_OK || res == Z_BUF_ERROR)
+			res = Z_BUF_ERROR;
+		goto failed;
+	}
+#endif
+
 	res = uncompress(d, &bytes, s, size);
 
 	if(res == Z_OK)
 		return (int) bytes;
-	else {
-		*error = res;
-		return -1;
-	}
+
+failed:
+	*error = res;
+	return -1;
 }
 
 
@@ -481,12 +773,32 @@ void gzip_usage()
 	fprintf(stderr, "\t\tand choose the best compression.\n");
 	fprintf(stderr, "\t\tAvailable strategies: default, filtered, "
 		"huffman_only,\n\t\trun_length_encoded and fixed\n");
+#ifdef LIBDEFLATE_SUPPORT
+	fprintf(stderr, "\t  -Xzlib\n");
+	fprintf(stderr, "\t\tCompress using zlib rather than libdeflate\n");
+#endif
+#ifdef GZIP_OFFLOAD
+	fprintf(stderr, "\t  -Xoffload\n");
+	fprintf(stderr, "\t\tCompress using a hardware accelerator (Intel "
+		"IAA), if there is\n\t\tone.  The filesystem is an ordinary "
+		"gzip filesystem\n");
+#endif
 }
 
 
 struct compressor gzip_comp_ops = {
 	.init = gzip_init,
 	.compress = gzip_compress,
+	.compress_fast = gzip_compress_fast,
+	.efforts = gzip_efforts,
+	.effort = gzip_effort,
+#ifdef GZIP_OFFLOAD
+	.queue_depth = gzip_queue_depth,
+	.submit = gzip_submit,
+	.collect = gzip_collect,
+#endif
+	.uncompress_init = gzip_uncompress_init,
+	.uncompress_free = gzip_uncompress_free,
 	.uncompress = gzip_uncompress,
 	.options = gzip_options,
 	.options_post = gzip_options_post,
@@ -67,8 +67,20 @@ struct gzip_strategy {
 	void *buffer;
 };
 
+/* -Xoffload blocks the accelerator was too busy for, compressed in software */
+struct gzip_done {
+	void *tag;
+	int bytes;
+};
+
 struct gzip_stream {
 	z_stream stream;
+	struct gzip_offload *offload;
+	struct libdeflate_compressor *libdeflate;
+	int done;
+	struct gzip_done done_list[GZIP_OFFLOAD_DEPTH];
+	int level;
+	int tries;
 	int strategies;
 	struct gzip_strategy strategy[0];
 };
@@ -0,0 +1,142 @@
+/*
+ * Create a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2014
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * hash.c
+ *
+ * Fast 64 bit non-cryptographic hash (the xxHash64 algorithm), used to
+ * index file contents for duplicate detection.  The hashes are only
+ * used in memory and are never stored in the filesystem, so they
+ * are computed in host byte order.
+ */
+
+#include <string.h>
+
+#include "hash.h"
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static inline unsigned long long read64(unsigned char *p)
+{
+	unsigned long long value;
+
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+
+static inline unsigned int read32(unsigned char *p)
+{
+	unsigned int value;
+
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+
+static inline unsigned long long round64(unsigned long long acc,
+	unsigned long long input)
+{
+	acc += input * PRIME2;
+	acc = ROTL64(acc, 31);
+	return acc * PRIME1;
+}
+
+
+static inline unsigned long long merge64(unsigned long long acc,
+	unsigned long long value)
+{
+	acc ^= round64(0, value);
+	return acc * PRIME1 + PRIME4;
+}
+
+
+unsigned long long hash64(void *data, int bytes, unsigned long long seed)
+{
+	unsigned char *p = data, *end = p + bytes;
+	unsigned long long hash;
+
+	if(bytes >= 32) {
+		unsigned char *limit = end - 32;
+		unsigned long long v1 = seed + PRIME1 + PRIME2;
+		unsigned long long v2 = seed + PRIME2;
+		unsigned long long v3 = seed;
+		unsigned long long v4 = seed - PRIME1;
+
+		do {
+			v1 = round64(v1, read64(p));
+			v2 = round64(v2, read64(p + 8));
+			v3 = round64(v3, read64(p + 16));
+			v4 = round64(v4, read64(p + 24));
+			p += 32;
+		} while(p <= limit);
+
+		hash = ROTL64(v1, 1) + ROTL64(v2, 7) + ROTL64(v3, 12) +
+			ROTL64(v4, 18);
+		hash = merge64(hash, v1);
+		hash = merge64(hash, v2);
+		hash = merge64(hash, v3);
+		hash = merge64(hash, v4);
+	} else
+		hash = seed + PRIME5;
+
+	hash += (unsigned long long) bytes;
+
+	for(; p + 8 <= end; p += 8) {
+		hash ^= round64(0, read64(p));
+		hash = ROTL64(hash, 27) * PRIME1 + PRIME4;
+	}
+
+	if(p + 4 <= end) {
+		hash ^= (unsigned long long) read32(p) * PRIME1;
+		hash = ROTL64(hash, 23) * PRIME2 + PRIME3;
+		p += 4;
+	}
+
+	for(; p < end; p++) {
+		hash ^= *p * PRIME5;
+		hash = ROTL64(hash, 11) * PRIME1;
+	}
+
+	hash ^= hash >> 33;
+	hash *= PRIME2;
+	hash ^= hash >> 29;
+	hash *= PRIME3;
+	hash ^= hash >> 32;
+
+	return hash;
+}
+
+
+/*
+ * Fold the hash of the next block of a file into the hash of the file
+ * so far
+ */
+unsigned long long hash64_combine(unsigned long long hash,
+	unsigned long long value)
+{
+	return merge64(ROTL64(hash, 27), value);
+}
@@ -42,6 +42,7 @@
 #include "error.h"
 #include "progressbar.h"
 #include "caches-queues-lists.h"
+#include "numa.h"
 
 static int silent = 0;
 static struct dir_ent *ent = NULL;
@@ -77,17 +78,32 @@ void print_filename()
 
 void dump_state()
 {
+	int i;
+
 	disable_progress_bar();
 
 	printf("Queue and Cache status dump\n");
 	printf("===========================\n");
 
-	printf("file buffer queue (reader thread -> deflate thread(s))\n");
-	dump_queue(to_deflate);
+	printf("file queue (reader thread -> reader pool thread(s))\n");
+	dump_queue(to_read);
 
-	printf("uncompressed fragment queue (reader thread -> fragment"
-						" thread(s))\n");
-	dump_queue(to_process_frag);
+	for(i = 0; i < numa_nodes; i++) {
+		printf("file buffer queue (reader thread -> deflate thread(s))");
+		if(numa_nodes > 1)
+			printf(" node %d", i);
+		printf("\n");
+		dump_queue(to_deflate[i]);
+	}
+
+	for(i = 0; i < numa_nodes; i++) {
+		printf("uncompressed fragment queue (reader thread -> fragment"
+						" thread(s))");
+		if(numa_nodes > 1)
+			printf(" node %d", i);
+		printf("\n");
+		dump_queue(to_process_frag[i]);
+	}
 
 	printf("processed fragment queue (fragment thread(s) -> main"
 						" thread)\n");
@@ -96,6 +112,20 @@ void dump_state()
 	printf("compressed block queue (deflate thread(s) -> main thread)\n");
 	dump_seq_queue(to_main, 0);
 
+	if(from_dup) {
+		printf("duplicate check queue (duplicate collector thread -> "
+						"duplicate thread(s))\n");
+		dump_queue(to_dup);
+
+		printf("checked fragment queue (duplicate thread(s) -> main "
+						"thread)\n");
+		dump_seq_queue(from_dup, 1);
+
+		printf("checked block queue (duplicate thread(s) -> main "
+						"thread)\n");
+		dump_seq_queue(from_dup, 0);
+	}
+
 	printf("uncompressed packed fragment queue (main thread -> fragment"
 						" deflate thread(s))\n");
 	dump_queue(to_frag);
@@ -127,6 +157,10 @@ void dump_state()
 						" full in dup check)\n");
 	dump_cache(reserve_cache);
 
+	printf("memory governor (buffers lent between the read, write and"
+						" fragment caches)\n");
+	dump_governor(mem_governor);
+
 	enable_progress_bar();
 }
 
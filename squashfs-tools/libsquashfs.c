@@ -0,0 +1,2012 @@
+/*
+ * Copyright (c) 2014
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * libsquashfs.c
+ *
+ * Reentrant reading of Squashfs 4.0 filesystems.  This follows unsquash-4.c,
+ * but everything Unsquashfs keeps in globals (the superblock, the
+ * fragment and id tables, and the inode, directory and data caches) is
+ * kept in the struct sqfs handle, and errors are returned rather than
+ * exiting.
+ *
+ * Squashfs 3.x filesystems can be read too, following unsquash-3.c.  Their
+ * superblock, uid/gid tables and fragment table are converted to their 4.0
+ * equivalents when the filesystem is opened, and only their inodes and
+ * directories are read differently.  The data and fragment blocks are the
+ * same as 4.0 gzip blocks, and are described the same way
+ *
+ *
+ * The caches are protected by a mutex each, but blocks are read and
+ * decompressed outside the mutex, so threads reading different blocks
+ * don't wait for each other.  The data cache is split into shards by block,
+ * so threads reading different blocks don't contend for the same mutex
+ * either.
+ *
+ * A filesystem opened with sqfs_open_cache() can have a pool of inflator
+ * threads, which read ahead of sqfs_pread(), decompressing the following
+ * blocks of the file (and the other blocks of large reads) in parallel
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/statvfs.h>
+#include <endian.h>
+
+#include "squashfs_fs.h"
+#include "squashfs_swap.h"
+#include "squashfs_compat.h"
+#include "compressor.h"
+#include "libsquashfs.h"
+
+#define TRUE 1
+#define FALSE 0
+
+/* metadata blocks cached for each of the inode and directory tables */
+#define METADATA_CACHE_BLOCKS 256
+
+/* data and fragment blocks cached by sqfs_open() */
+#define DATA_CACHE_BLOCKS 64
+
+/*
+ * Maximum shards the data cache is split into, each shard holds at least
+ * DATA_SHARD_BLOCKS blocks
+ */
+#define DATA_CACHE_SHARDS 16
+#define DATA_SHARD_BLOCKS 8
+
+/* readahead requests queued for the inflator threads */
+#define READAHEAD_QUEUE 256
+
+#define BLOCK_HASH_SIZE 1024
+#define CALCULATE_HASH(start)	((start) & (BLOCK_HASH_SIZE - 1))
+
+struct block {
+	long long	start;
+	long long	next;
+	int		length;
+	int		pending;
+	int		waiters;
+	struct block	*hash_next;
+	struct block	*lru_next;
+	struct block	*lru_prev;
+	char		data[0];
+};
+
+/*
+ * LRU cache of decompressed blocks.  Metadata caches are of the inode or
+ * directory table, which lies between start and end on disk
+ */
+struct block_cache {
+	pthread_mutex_t	mutex;
+	pthread_cond_t	wait;
+	int		metadata;
+	int		buffer_size;
+	int		max_entries;
+	int		count;
+	long long	start;
+	long long	end;
+	struct block	*lru;
+	struct block	*hash_table[BLOCK_HASH_SIZE];
+};
+
+struct sqfs {
+	int				fd;
+	struct squashfs_super_block	sBlk;
+	struct compressor		*comp;
+	struct squashfs_fragment_entry	*fragment_table;
+	unsigned int			*id_table;
+
+	/*
+	 * The major version.  3.x filesystems are in the byte order of the
+	 * machine which made them, swap is set if that isn't this machine's.
+	 * Their metadata blocks have a check byte after the length if check
+	 * is set, and id_table is the uid table followed by the gid table
+	 */
+	int				major;
+	int				swap;
+	int				check;
+	unsigned int			no_uids;
+
+	struct block_cache		*inode_cache;
+	struct block_cache		*directory_cache;
+	int				shards;
+	struct block_cache		*data_cache[DATA_CACHE_SHARDS];
+
+	/* readahead, and the inflator threads doing it */
+	int				readahead;
+	int				inflators;
+	pthread_t			*thread;
+	pthread_mutex_t			request_mutex;
+	pthread_cond_t			request_wait;
+	int				exiting;
+	int				readp;
+	int				count;
+	struct request {
+		long long		start;
+		unsigned int		size;
+	}				request[READAHEAD_QUEUE];
+};
+
+struct sqfs_file {
+	struct sqfs		*fs;
+	struct sqfs_inode	inode;
+	int			blocks;
+	unsigned int		*block_list;
+	long long		*block_start;
+
+	/* the first block not yet queued for readahead */
+	long long		ahead;
+};
+
+static mode_t lookup_type[] = {
+	0,
+	S_IFDIR,
+	S_IFREG,
+	S_IFLNK,
+	S_IFBLK,
+	S_IFCHR,
+	S_IFIFO,
+	S_IFSOCK,
+	S_IFDIR,
+	S_IFREG,
+	S_IFLNK,
+	S_IFBLK,
+	S_IFCHR,
+	S_IFIFO,
+	S_IFSOCK
+};
+
+/*
+ * The compressors keep their options (e.g. a dictionary) in globals, so
+ * checking the options of filesystems opened at the same time is
+ * serialised.  This means filesystems using compressor dictionaries can
+ * only be opened together if they use the same dictionary
+ */
+static pthread_mutex_t options_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+ * Convert table entries to this machine's byte order, 4.0 filesystems
+ * being little endian
+ */
+static void swap_shorts(struct sqfs *fs, unsigned short *s, int n)
+{
+	int i;
+
+	if(fs->major == 4)
+		SQUASHFS_INSWAP_SHORTS(s, n);
+	else if(fs->swap)
+		for(i = 0; i < n; i++)
+			s[i] = __builtin_bswap16(s[i]);
+}
+
+
+static void swap_ints(struct sqfs *fs, unsigned int *s, int n)
+{
+	int i;
+
+	if(fs->major == 4)
+		SQUASHFS_INSWAP_INTS(s, n);
+	else if(fs->swap)
+		for(i = 0; i < n; i++)
+			s[i] = __builtin_bswap32(s[i]);
+}
+
+
+static void swap_long_longs(struct sqfs *fs, long long *s, int n)
+{
+	int i;
+
+	if(fs->major == 4)
+		SQUASHFS_INSWAP_LONG_LONGS(s, n);
+	else if(fs->swap)
+		for(i = 0; i < n; i++)
+			s[i] = __builtin_bswap64(s[i]);
+}
+
+
+static int read_fs_bytes(struct sqfs *fs, long long byte, int bytes,
+	void *buff)
+{
+	int res, count;
+
+	for(count = 0; count < bytes; count += res) {
+		res = pread(fs->fd, buff + count, bytes - count, byte + count);
+		if(res == 0)
+			return -EIO;
+		else if(res == -1) {
+			if(errno != EINTR)
+				return -errno;
+			res = 0;
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ * Read and decompress the metadata block at start, returning its
+ * (uncompressed) length, and the start of the following block in *next
+ */
+static int read_metadata_block(struct sqfs *fs, void *strm, long long start,
+	long long *next, int outlen, void *block)
+{
+	unsigned short c_byte;
+	int res, compressed, offset = fs->check ? 3 : 2;
+
+	res = read_fs_bytes(fs, start, 2, &c_byte);
+	if(res)
+		return res;
+	swap_shorts(fs, &c_byte, 1);
+
+	compressed = SQUASHFS_COMPRESSED(c_byte);
+	c_byte = SQUASHFS_COMPRESSED_SIZE(c_byte);
+
+	if(c_byte > outlen)
+		return -EIO;
+
+	if(compressed) {
+		char buffer[c_byte];
+		int error;
+
+		res = read_fs_bytes(fs, start + offset, c_byte, buffer);
+		if(res)
+			return res;
+
+		res = compressor_uncompress(fs->comp, strm, block, buffer,
+			c_byte, outlen, &error);
+		if(res == -1)
+			return -EIO;
+	} else {
+		res = read_fs_bytes(fs, start + offset, c_byte, block);
+		if(res)
+			return res;
+		res = c_byte;
+	}
+
+	*next = start + offset + c_byte;
+	return res;
+}
+
+
+/*
+ * Read and decompress the data or fragment block at start, size being its
+ * block list (or fragment table) entry.  Strm is the decompressing thread's
+ * decompression context, or NULL
+ */
+static int read_data_block(struct sqfs *fs, void *strm, long long start,
+	unsigned int size, void *block)
+{
+	int c_byte = SQUASHFS_COMPRESSED_SIZE_BLOCK(size);
+	int res, error;
+
+	if(c_byte > fs->sBlk.block_size)
+		return -EIO;
+
+	if(SQUASHFS_COMPRESSED_BLOCK(size)) {
+		char *buffer = malloc(c_byte);
+
+		if(buffer == NULL)
+			return -ENOMEM;
+
+		res = read_fs_bytes(fs, start, c_byte, buffer);
+		if(res == 0) {
+			res = compressor_uncompress(fs->comp, strm, block,
+				buffer, c_byte, fs->sBlk.block_size, &error);
+			if(res == -1)
+				res = -EIO;
+		}
+
+		free(buffer);
+		return res;
+	}
+
+	res = read_fs_bytes(fs, start, c_byte, block);
+	return res ? res : c_byte;
+}
+
+
+static struct block_cache *cache_init(int metadata, int buffer_size,
+	int max_entries, long long start, long long end)
+{
+	struct block_cache *cache = calloc(1, sizeof(struct block_cache));
+
+	if(cache == NULL)
+		return NULL;
+
+	pthread_mutex_init(&cache->mutex, NULL);
+	pthread_cond_init(&cache->wait, NULL);
+	cache->metadata = metadata;
+	cache->buffer_size = buffer_size;
+	cache->max_entries = max_entries;
+	cache->start = start;
+	cache->end = end;
+
+	return cache;
+}
+
+
+static void lru_remove(struct block_cache *cache, struct block *entry)
+{
+	if(entry->lru_next == entry)
+		cache->lru = NULL;
+	else {
+		entry->lru_prev->lru_next = entry->lru_next;
+		entry->lru_next->lru_prev = entry->lru_prev;
+		if(cache->lru == entry)
+			cache->lru = entry->lru_next;
+	}
+}
+
+
+static void lru_insert(struct block_cache *cache, struct block *entry)
+{
+	/* the head of the lru list is the most recently used block */
+	if(cache->lru) {
+		entry->lru_next = cache->lru;
+		entry->lru_prev = cache->lru->lru_prev;
+		cache->lru->lru_prev->lru_next = entry;
+		cache->lru->lru_prev = entry;
+	} else
+		entry->lru_next = entry->lru_prev = entry;
+
+	cache->lru = entry;
+}
+
+
+static void cache_free(struct block_cache *cache)
+{
+	if(cache == NULL)
+		return;
+
+	while(cache->lru) {
+		struct block *entry = cache->lru;
+
+		lru_remove(cache, entry);
+		free(entry);
+	}
+
+	pthread_cond_destroy(&cache->wait);
+	pthread_mutex_destroy(&cache->mutex);
+	free(cache);
+}
+
+
+static void hash_remove(struct block_cache *cache, struct block *entry)
+{
+	struct block **ptr = &cache->hash_table[CALCULATE_HASH(entry->start)];
+
+	while(*ptr != entry)
+		ptr = &(*ptr)->hash_next;
+
+	*ptr = entry->hash_next;
+}
+
+
+/* Called with the cache mutex held */
+static struct block *cache_lookup(struct block_cache *cache, long long start)
+{
+	struct block *entry;
+
+	for(entry = cache->hash_table[CALCULATE_HASH(start)]; entry;
+						entry = entry->hash_next)
+		if(entry->start == start) {
+			lru_remove(cache, entry);
+			lru_insert(cache, entry);
+			break;
+		}
+
+	return entry;
+}
+
+
+/*
+ * Add an entry for the block at start, which the caller then reads.  The
+ * entry is pending until then, and threads wanting the block wait for it.
+ * The least recently used block is thrown away if the cache is full, but
+ * blocks being read or waited for are kept.  Called with the cache mutex
+ * held
+ */
+static struct block *cache_add(struct block_cache *cache, long long start)
+{
+	struct block *entry = malloc(sizeof(struct block) + cache->buffer_size);
+	int hash = CALCULATE_HASH(start);
+
+	if(entry == NULL)
+		return NULL;
+
+	if(cache->count >= cache->max_entries) {
+		struct block *old = cache->lru->lru_prev;
+
+		while(old->pending || old->waiters) {
+			if(old == cache->lru) {
+				old = NULL;
+				break;
+			}
+			old = old->lru_prev;
+		}
+
+		if(old) {
+			lru_remove(cache, old);
+			hash_remove(cache, old);
+			free(old);
+			cache->count --;
+		}
+	}
+
+	entry->start = start;
+	entry->pending = TRUE;
+	entry->waiters = 0;
+	entry->hash_next = cache->hash_table[hash];
+	cache->hash_table[hash] = entry;
+	lru_insert(cache, entry);
+	cache->count ++;
+
+	return entry;
+}
+
+
+/*
+ * Read the block of a new (pending) entry, without the cache mutex held.
+ * Size is the block list entry of data blocks (and unused for metadata
+ * blocks)
+ */
+static int fill_block(struct sqfs *fs, struct block_cache *cache,
+	struct block *entry, unsigned int size, void *strm)
+{
+	int length;
+
+	if(!cache->metadata) {
+		entry->next = entry->start +
+			SQUASHFS_COMPRESSED_SIZE_BLOCK(size);
+		return read_data_block(fs, strm, entry->start, size,
+			entry->data);
+	}
+
+	if(entry->start < cache->start || entry->start >= cache->end)
+		return -EIO;
+
+	length = read_metadata_block(fs, strm, entry->start, &entry->next,
+		cache->buffer_size, entry->data);
+
+	/*
+	 * If this is not the last metadata block in the table then it
+	 * should be SQUASHFS_METADATA_SIZE in size
+	 */
+	if(length >= 0 && entry->next != cache->end &&
+				length != SQUASHFS_METADATA_SIZE)
+		return -EIO;
+
+	return length;
+}
+
+
+/*
+ * The block of a pending entry has been read, wake any threads waiting
+ * for it.  Errors aren't kept in the cache, the failed entry is freed
+ * by the last thread to use it (see cache_put()).  Called with the cache
+ * mutex held
+ */
+static void cache_ready(struct block_cache *cache, struct block *entry,
+	int length)
+{
+	entry->length = length;
+	entry->pending = FALSE;
+
+	if(length < 0) {
+		lru_remove(cache, entry);
+		hash_remove(cache, entry);
+		cache->count --;
+	}
+
+	pthread_cond_broadcast(&cache->wait);
+}
+
+
+/* Called with the cache mutex held */
+static void cache_put(struct block *entry)
+{
+	if(entry->length < 0 && entry->waiters == 0)
+		free(entry);
+}
+
+
+/*
+ * Copy bytes bytes starting at offset in the block at start into buffer,
+ * reading the block into the cache if it isn't there, or waiting for it if
+ * another thread is reading it.  Size is the block list entry of data blocks
+ * (and unused for metadata blocks).  The block's length and the start of the
+ * following block are returned in *length and *next.  Returns the number of
+ * bytes copied, which is only less than bytes if the end of the block is
+ * reached.
+ *
+ * The data is copied with the cache mutex held, because the block can be
+ * thrown out of the cache by another thread as soon as it is released
+ */
+static int cache_read(struct sqfs *fs, struct block_cache *cache,
+	long long start, unsigned int size, int offset, void *buffer,
+	int bytes, int *length, long long *next)
+{
+	struct block *entry;
+	int res;
+
+	pthread_mutex_lock(&cache->mutex);
+	entry = cache_lookup(cache, start);
+	if(entry == NULL) {
+		entry = cache_add(cache, start);
+		if(entry == NULL) {
+			pthread_mutex_unlock(&cache->mutex);
+			return -ENOMEM;
+		}
+
+		pthread_mutex_unlock(&cache->mutex);
+		res = fill_block(fs, cache, entry, size, NULL);
+		pthread_mutex_lock(&cache->mutex);
+		cache_ready(cache, entry, res);
+	} else {
+		entry->waiters ++;
+		while(entry->pending)
+			pthread_cond_wait(&cache->wait, &cache->mutex);
+		entry->waiters --;
+	}
+
+	res = entry->length;
+	if(res >= 0) {
+		if(offset > res)
+			offset = res;
+		if(bytes > res - offset)
+			bytes = res - offset;
+
+		memcpy(buffer, entry->data + offset, bytes);
+		*length = entry->length;
+		*next = entry->next;
+		res = bytes;
+	}
+
+	cache_put(entry);
+	pthread_mutex_unlock(&cache->mutex);
+
+	return res;
+}
+
+
+/*
+ * Read the block at start into the cache, unless it's there already, or
+ * another thread is reading it.  Used by the inflator threads for
+ * readahead
+ */
+static void cache_fill(struct sqfs *fs, struct block_cache *cache,
+	long long start, unsigned int size, void *strm)
+{
+	struct block *entry;
+	int res;
+
+	pthread_mutex_lock(&cache->mutex);
+	entry = cache_lookup(cache, start);
+	if(entry == NULL) {
+		entry = cache_add(cache, start);
+		if(entry) {
+			pthread_mutex_unlock(&cache->mutex);
+			res = fill_block(fs, cache, entry, size, strm);
+			pthread_mutex_lock(&cache->mutex);
+			cache_ready(cache, entry, res);
+			cache_put(entry);
+		}
+	}
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+
+/*
+ * Copy length bytes of metadata starting at offset bytes into the block
+ * at *block into buffer, moving on to the following blocks as necessary.
+ * *block and *offset are updated to point after the bytes copied.
+ * Returns 0, or -EIO if the end of the table is reached first
+ */
+static int read_metadata(struct sqfs *fs, struct block_cache *cache,
+	long long *block, int *offset, void *buffer, int length)
+{
+	int copied = 0;
+
+	while(copied < length) {
+		long long next;
+		int block_length, res;
+
+		if(*block >= cache->end)
+			return -EIO;
+
+		res = cache_read(fs, cache, *block, 0, *offset, buffer + copied,
+			length - copied, &block_length, &next);
+		if(res < 0)
+			return res;
+
+		copied += res;
+		*offset += res;
+
+		if(*offset >= block_length) {
+			*offset -= block_length;
+			*block = next;
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ * Read a table (the fragment or id table) in its entirety.  The table is
+ * made of bytes bytes of metadata blocks, whose locations are in the
+ * index at index_start
+ */
+static void *read_table(struct sqfs *fs, long long index_start, int bytes,
+	long long *first, int *error)
+{
+	int indexes = (bytes + SQUASHFS_METADATA_SIZE - 1) /
+		SQUASHFS_METADATA_SIZE;
+	long long index[indexes];
+	char *table;
+	int i, res;
+
+	res = read_fs_bytes(fs, index_start, indexes * sizeof(long long),
+		index);
+	if(res)
+		goto failed;
+	swap_long_longs(fs, index, indexes);
+
+	table = malloc(bytes);
+	if(table == NULL) {
+		res = -ENOMEM;
+		goto failed;
+	}
+
+	for(i = 0; i < indexes; i++) {
+		int expected = (i + 1) != indexes ? SQUASHFS_METADATA_SIZE :
+			bytes - i * SQUASHFS_METADATA_SIZE;
+		long long next;
+
+		res = read_metadata_block(fs, NULL, index[i], &next, expected,
+			table + i * SQUASHFS_METADATA_SIZE);
+		if(res != expected) {
+			free(table);
+			res = res < 0 ? res : -EIO;
+			goto failed;
+		}
+	}
+
+	if(first)
+		*first = index[0];
+	return table;
+
+failed:
+	*error = res;
+	return NULL;
+}
+
+
+static int check_compression(struct sqfs *fs)
+{
+	char buffer[SQUASHFS_METADATA_SIZE] __attribute__ ((aligned));
+	int res, bytes = 0;
+	long long next;
+
+	if(fs->comp == NULL || !fs->comp->supported)
+		return -EOPNOTSUPP;
+
+	/*
+	 * Read compression options from disk if present, and pass to
+	 * the compressor to ensure we know how to decompress a filesystem
+	 * compressed with these compression options.
+	 */
+	if(SQUASHFS_COMP_OPTS(fs->sBlk.flags)) {
+		bytes = read_metadata_block(fs, NULL, sizeof(fs->sBlk), &next,
+			SQUASHFS_METADATA_SIZE, buffer);
+		if(bytes < 0)
+			return bytes;
+	}
+
+	pthread_mutex_lock(&options_mutex);
+	res = compressor_check_options(fs->comp, fs->sBlk.block_size, buffer,
+		bytes);
+	pthread_mutex_unlock(&options_mutex);
+
+	return res == -1 ? -EOPNOTSUPP : 0;
+}
+
+
+/* The data cache shard holding the block at start */
+static struct block_cache *data_shard(struct sqfs *fs, long long start)
+{
+	unsigned long long hash = start * 0x9e3779b97f4a7c15ULL;
+
+	return fs->data_cache[(hash >> 32) & (fs->shards - 1)];
+}
+
+
+/*
+ * Queue the block at start for the inflator threads to read ahead.  This
+ * never waits, readahead is dropped if the queue is full.  Called with the
+ * request mutex held
+ */
+static void queue_readahead(struct sqfs *fs, long long start,
+	unsigned int size)
+{
+	if(fs->count < READAHEAD_QUEUE) {
+		struct request *request = &fs->request[(fs->readp + fs->count) %
+			READAHEAD_QUEUE];
+
+		request->start = start;
+		request->size = size;
+		fs->count ++;
+		pthread_cond_signal(&fs->request_wait);
+	}
+}
+
+
+static void *inflator(void *arg)
+{
+	struct sqfs *fs = arg;
+	void *strm;
+
+	/* without a context, each block is decompressed from scratch */
+	if(compressor_uncompress_init(fs->comp, &strm) == -1)
+		strm = NULL;
+
+	pthread_mutex_lock(&fs->request_mutex);
+	while(1) {
+		struct request request;
+
+		while(fs->count == 0 && !fs->exiting)
+			pthread_cond_wait(&fs->request_wait,
+				&fs->request_mutex);
+
+		if(fs->exiting)
+			break;
+
+		request = fs->request[fs->readp];
+		fs->readp = (fs->readp + 1) % READAHEAD_QUEUE;
+		fs->count --;
+		pthread_mutex_unlock(&fs->request_mutex);
+
+		cache_fill(fs, data_shard(fs, request.start), request.start,
+			request.size, strm);
+
+		pthread_mutex_lock(&fs->request_mutex);
+	}
+	pthread_mutex_unlock(&fs->request_mutex);
+
+	compressor_uncompress_free(fs->comp, strm);
+	return NULL;
+}
+
+
+/*
+ * Read a Squashfs 3.x superblock, and convert it to the 4.0 superblock
+ * the rest of the library uses.  3.x filesystems are always gzip
+ * compressed, and have no xattrs
+ */
+static int read_super_3(struct sqfs *fs, long long *uid_start)
+{
+	squashfs_super_block_3 sBlk_3;
+	int res;
+
+	res = read_fs_bytes(fs, SQUASHFS_START, sizeof(sBlk_3), &sBlk_3);
+	if(res)
+		return res;
+
+	if(sBlk_3.s_magic == SQUASHFS_MAGIC_SWAP) {
+		squashfs_super_block_3 sblk;
+
+		SQUASHFS_SWAP_SUPER_BLOCK_3(&sblk, &sBlk_3);
+		memcpy(&sBlk_3, &sblk, sizeof(squashfs_super_block_3));
+		fs->swap = TRUE;
+	} else if(sBlk_3.s_magic != SQUASHFS_MAGIC)
+		return -EINVAL;
+
+	/* 1.x and 2.x filesystems aren't supported */
+	if(sBlk_3.s_major != 3)
+		return -EOPNOTSUPP;
+
+	memset(&fs->sBlk, 0, sizeof(fs->sBlk));
+	fs->sBlk.s_magic = SQUASHFS_MAGIC;
+	fs->sBlk.inodes = sBlk_3.inodes;
+	fs->sBlk.mkfs_time = sBlk_3.mkfs_time;
+	fs->sBlk.block_size = sBlk_3.block_size;
+	fs->sBlk.fragments = sBlk_3.fragments;
+	fs->sBlk.compression = ZLIB_COMPRESSION;
+	fs->sBlk.block_log = sBlk_3.block_log;
+	fs->sBlk.flags = sBlk_3.flags & ~(1 << SQUASHFS_CHECK);
+	fs->sBlk.no_ids = sBlk_3.no_uids + sBlk_3.no_guids;
+	fs->sBlk.s_major = sBlk_3.s_major;
+	fs->sBlk.s_minor = sBlk_3.s_minor;
+	fs->sBlk.root_inode = sBlk_3.root_inode;
+	fs->sBlk.bytes_used = sBlk_3.bytes_used;
+	fs->sBlk.id_table_start = SQUASHFS_INVALID_BLK;
+	fs->sBlk.xattr_id_table_start = SQUASHFS_INVALID_BLK;
+	fs->sBlk.inode_table_start = sBlk_3.inode_table_start;
+	fs->sBlk.directory_table_start = sBlk_3.directory_table_start;
+	fs->sBlk.fragment_table_start = sBlk_3.fragment_table_start;
+	fs->sBlk.lookup_table_start = SQUASHFS_INVALID_BLK;
+
+	fs->major = 3;
+	fs->check = SQUASHFS_CHECK_DATA(sBlk_3.flags);
+	fs->no_uids = sBlk_3.no_uids;
+	*uid_start = sBlk_3.uid_start;
+	return 0;
+}
+
+
+/*
+ * Read the 3.x uid/gid and fragment tables, converting the fragment table
+ * to 4.0 fragment entries.  Unlike the fragment table, the uids and gids
+ * aren't stored in metadata blocks
+ */
+static int read_tables_3(struct sqfs *fs, long long uid_start,
+	long long *directory_table_end)
+{
+	squashfs_fragment_entry_3 *table;
+	int i, res;
+
+	if(fs->no_uids == 0)
+		return -EIO;
+
+	fs->id_table = malloc(fs->sBlk.no_ids * sizeof(unsigned int));
+	if(fs->id_table == NULL)
+		return -ENOMEM;
+
+	res = read_fs_bytes(fs, uid_start, fs->sBlk.no_ids *
+		sizeof(unsigned int), fs->id_table);
+	if(res)
+		return res;
+	swap_ints(fs, fs->id_table, fs->sBlk.no_ids);
+
+	if(fs->sBlk.fragments == 0) {
+		*directory_table_end = fs->sBlk.fragment_table_start;
+		return 0;
+	}
+
+	table = read_table(fs, fs->sBlk.fragment_table_start,
+		SQUASHFS_FRAGMENT_BYTES_3(fs->sBlk.fragments),
+		directory_table_end, &res);
+	if(table == NULL)
+		return res;
+
+	fs->fragment_table = malloc(fs->sBlk.fragments *
+		sizeof(struct squashfs_fragment_entry));
+	if(fs->fragment_table == NULL) {
+		free(table);
+		return -ENOMEM;
+	}
+
+	for(i = 0; i < fs->sBlk.fragments; i++) {
+		squashfs_fragment_entry_3 entry;
+
+		if(fs->swap)
+			SQUASHFS_SWAP_FRAGMENT_ENTRY_3(&entry, &table[i])
+		else
+			memcpy(&entry, &table[i], sizeof(entry));
+
+		fs->fragment_table[i].start_block = entry.start_block;
+		fs->fragment_table[i].size = entry.size;
+		fs->fragment_table[i].unused = 0;
+	}
+
+	free(table);
+	return 0;
+}
+
+
+/*
+ * Open the Squashfs 4.0 or 3.x filesystem in filename.  Older filesystems
+ * aren't supported, and return -EOPNOTSUPP, as do filesystems using a
+ * compressor this library hasn't been built with.
+ *
+ * Up to cache_size bytes of data and fragment blocks are cached (or
+ * DATA_CACHE_BLOCKS blocks if cache_size is 0).  If inflators isn't 0 that
+ * many inflator threads read ahead of sqfs_pread() by readahead blocks
+ */
+struct sqfs *sqfs_open_cache(char *filename, long long cache_size,
+	int inflators, int readahead, int *error)
+{
+	struct sqfs *fs = calloc(1, sizeof(struct sqfs));
+	long long directory_table_end, uid_start;
+	int i, res, cache_blocks;
+
+	if(fs == NULL) {
+		*error = -ENOMEM;
+		return NULL;
+	}
+
+	pthread_mutex_init(&fs->request_mutex, NULL);
+	pthread_cond_init(&fs->request_wait, NULL);
+
+	fs->fd = open(filename, O_RDONLY);
+	if(fs->fd == -1) {
+		res = -errno;
+		goto failed;
+	}
+
+	res = read_fs_bytes(fs, SQUASHFS_START, sizeof(fs->sBlk), &fs->sBlk);
+	if(res)
+		goto failed;
+	SQUASHFS_INSWAP_SUPER_BLOCK(&fs->sBlk);
+	fs->major = 4;
+
+	/*
+	 * The 3.x superblock is in the filesystem's byte order, and 4.0 is
+	 * little endian, so a 3.x superblock may be seen as swapped
+	 */
+	if(fs->sBlk.s_magic == SQUASHFS_MAGIC_SWAP ||
+			(fs->sBlk.s_magic == SQUASHFS_MAGIC &&
+			fs->sBlk.s_major < 4)) {
+		res = read_super_3(fs, &uid_start);
+		if(res)
+			goto failed;
+	} else {
+		res = -EINVAL;
+		if(fs->sBlk.s_magic != SQUASHFS_MAGIC)
+			goto failed;
+
+		res = -EOPNOTSUPP;
+		if(fs->sBlk.s_major != 4 || fs->sBlk.s_minor != 0)
+			goto failed;
+	}
+
+	res = -EIO;
+	if(fs->sBlk.block_size > SQUASHFS_FILE_MAX_SIZE ||
+			fs->sBlk.block_log > SQUASHFS_FILE_MAX_LOG ||
+			fs->sBlk.block_size != 1 << fs->sBlk.block_log)
+		goto failed;
+
+	fs->comp = lookup_compressor_id(fs->sBlk.compression);
+	res = check_compression(fs);
+	if(res)
+		goto failed;
+
+	if(fs->major == 3) {
+		res = read_tables_3(fs, uid_start, &directory_table_end);
+		if(res)
+			goto failed;
+	} else {
+		if(fs->sBlk.fragments) {
+			fs->fragment_table = read_table(fs,
+				fs->sBlk.fragment_table_start,
+				SQUASHFS_FRAGMENT_BYTES(fs->sBlk.fragments),
+				&directory_table_end, &res);
+			if(fs->fragment_table == NULL)
+				goto failed;
+		} else
+			directory_table_end = fs->sBlk.fragment_table_start;
+
+		fs->id_table = read_table(fs, fs->sBlk.id_table_start,
+			SQUASHFS_ID_BYTES(fs->sBlk.no_ids), NULL, &res);
+		if(fs->id_table == NULL)
+			goto failed;
+
+		SQUASHFS_INSWAP_INTS(fs->id_table, fs->sBlk.no_ids);
+		for(i = 0; i < fs->sBlk.fragments; i++)
+			SQUASHFS_INSWAP_FRAGMENT_ENTRY(&fs->fragment_table[i]);
+	}
+
+	res = -ENOMEM;
+	fs->inode_cache = cache_init(TRUE, SQUASHFS_METADATA_SIZE,
+		METADATA_CACHE_BLOCKS, fs->sBlk.inode_table_start,
+		fs->sBlk.directory_table_start);
+	fs->directory_cache = cache_init(TRUE, SQUASHFS_METADATA_SIZE,
+		METADATA_CACHE_BLOCKS, fs->sBlk.directory_table_start,
+		directory_table_end);
+	if(fs->inode_cache == NULL || fs->directory_cache == NULL)
+		goto failed;
+
+	if(cache_size == 0)
+		cache_blocks = DATA_CACHE_BLOCKS;
+	else if(cache_size >> fs->sBlk.block_log > INT_MAX)
+		cache_blocks = INT_MAX;
+	else
+		cache_blocks = cache_size >> fs->sBlk.block_log;
+	if(cache_blocks < 1)
+		cache_blocks = 1;
+	for(fs->shards = 1; fs->shards < DATA_CACHE_SHARDS &&
+		fs->shards * 2 * DATA_SHARD_BLOCKS <= cache_blocks;
+		fs->shards *= 2);
+
+	for(i = 0; i < fs->shards; i++) {
+		fs->data_cache[i] = cache_init(FALSE, fs->sBlk.block_size,
+			cache_blocks / fs->shards, 0, 0);
+		if(fs->data_cache[i] == NULL)
+			goto failed;
+	}
+
+	if(inflators) {
+		fs->thread = malloc(inflators * sizeof(pthread_t));
+		if(fs->thread == NULL)
+			goto failed;
+
+		for(i = 0; i < inflators; i++) {
+			if(pthread_create(&fs->thread[i], NULL, inflator, fs))
+				break;
+			fs->inflators ++;
+		}
+
+		if(fs->inflators == 0) {
+			res = -EAGAIN;
+			goto failed;
+		}
+
+		fs->readahead = readahead;
+	}
+
+	return fs;
+
+failed:
+	sqfs_close(fs);
+	*error = res;
+	return NULL;
+}
+
+
+struct sqfs *sqfs_open(char *filename, int *error)
+{
+	return sqfs_open_cache(filename, 0, 0, 0, error);
+}
+
+
+void sqfs_close(struct sqfs *fs)
+{
+	int i;
+
+	pthread_mutex_lock(&fs->request_mutex);
+	fs->exiting = TRUE;
+	pthread_cond_broadcast(&fs->request_wait);
+	pthread_mutex_unlock(&fs->request_mutex);
+
+	for(i = 0; i < fs->inflators; i++)
+		pthread_join(fs->thread[i], NULL);
+
+	free(fs->thread);
+	cache_free(fs->inode_cache);
+	cache_free(fs->directory_cache);
+	for(i = 0; i < fs->shards; i++)
+		cache_free(fs->data_cache[i]);
+	free(fs->fragment_table);
+	free(fs->id_table);
+	if(fs->fd != -1)
+		close(fs->fd);
+	pthread_cond_destroy(&fs->request_wait);
+	pthread_mutex_destroy(&fs->request_mutex);
+	free(fs);
+}
+
+
+unsigned int sqfs_block_size(struct sqfs *fs)
+{
+	return fs->sBlk.block_size;
+}
+
+
+void sqfs_statvfs(struct sqfs *fs, struct statvfs *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->f_bsize = st->f_frsize = fs->sBlk.block_size;
+	st->f_blocks = (fs->sBlk.bytes_used + fs->sBlk.block_size - 1) >>
+		fs->sBlk.block_log;
+	st->f_files = fs->sBlk.inodes;
+	st->f_namemax = SQUASHFS_NAME_LEN;
+	st->f_flag = ST_RDONLY;
+}
+
+
+void sqfs_get_info(struct sqfs *fs, struct sqfs_info *info)
+{
+	info->compression = fs->sBlk.compression;
+	info->block_size = fs->sBlk.block_size;
+	info->flags = fs->sBlk.flags;
+	info->inodes = fs->sBlk.inodes;
+	info->fragments = fs->sBlk.fragments;
+	info->bytes_used = fs->sBlk.bytes_used;
+	info->mkfs_time = fs->sBlk.mkfs_time;
+}
+
+
+int sqfs_fd(struct sqfs *fs)
+{
+	return fs->fd;
+}
+
+
+/*
+ * Copy the compression options stored in the filesystem into buffer,
+ * which must be 8192 bytes.  Returns the size of the options, 0 if the
+ * filesystem has none
+ */
+int sqfs_compression_options(struct sqfs *fs, void *buffer)
+{
+	long long next;
+
+	if(!SQUASHFS_COMP_OPTS(fs->sBlk.flags))
+		return 0;
+
+	return read_metadata_block(fs, NULL, sizeof(fs->sBlk), &next,
+		SQUASHFS_METADATA_SIZE, buffer);
+}
+
+
+/*
+ * Copy the first blocks entries of a file's block list, as stored in the
+ * filesystem (each the compressed size of a block, with
+ * SQUASHFS_COMPRESSED_BIT_BLOCK set if it's stored uncompressed, and 0 for
+ * a sparse block).  The blocks are stored one after another from i->start
+ */
+int sqfs_block_list(struct sqfs *fs, struct sqfs_inode *i,
+	unsigned int *list, int blocks)
+{
+	long long block = i->block_start;
+	int offset = i->block_offset, res;
+
+	if(!S_ISREG(i->mode))
+		return -EINVAL;
+
+	res = read_metadata(fs, fs->inode_cache, &block, &offset, list,
+		blocks * sizeof(unsigned int));
+	if(res)
+		return res;
+
+	swap_ints(fs, list, blocks);
+	return 0;
+}
+
+
+/*
+ * Return where fragment block index is in the filesystem, and its size
+ * as stored (with SQUASHFS_COMPRESSED_BIT_BLOCK set if uncompressed)
+ */
+int sqfs_fragment(struct sqfs *fs, unsigned int index, long long *start,
+	unsigned int *size)
+{
+	if(index >= fs->sBlk.fragments)
+		return -EINVAL;
+
+	*start = fs->fragment_table[index].start_block;
+	*size = fs->fragment_table[index].size;
+	return 0;
+}
+
+
+static int lookup_id(struct sqfs *fs, unsigned int index, unsigned int *id)
+{
+	if(index >= fs->sBlk.no_ids)
+		return -EIO;
+
+	*id = fs->id_table[index];
+	return 0;
+}
+
+
+/*
+ * Copy the 3.x inode (or directory) header at s into d, swapping it with
+ * the swap macro if the filesystem is of the other byte order
+ */
+#define COPY_3(fs, d, s, SWAP) \
+	do { \
+		if((fs)->swap) { \
+			__typeof__(*(d)) copy; \
+			memcpy(&copy, s, sizeof(copy)); \
+			SWAP(d, &copy); \
+		} else \
+			memcpy(d, s, sizeof(*(d))); \
+	} while(0)
+
+#define SWAP_BASE_INODE_HEADER_3(d, s) \
+	SQUASHFS_SWAP_BASE_INODE_HEADER_3(d, s, \
+		sizeof(struct squashfs_base_inode_header_3))
+
+
+/*
+ * Read a 3.x inode, following read_inode_3() in unsquash-3.c.  3.x has
+ * no extended inodes other than the large directory and file inodes,
+ * and the uid and gid are indexes into separate uid and gid tables
+ */
+static int read_inode_3(struct sqfs *fs, long long ref, struct sqfs_inode *i)
+{
+	union squashfs_inode_header_3 header;
+	char block_ptr[sizeof(header)] __attribute__((aligned));
+	long long start = fs->sBlk.inode_table_start + SQUASHFS_INODE_BLK(ref);
+	int offset = SQUASHFS_INODE_OFFSET(ref);
+	long long block = start;
+	int block_offset = offset, res;
+	unsigned int uid, gid;
+
+	res = read_metadata(fs, fs->inode_cache, &block, &block_offset,
+		block_ptr, sizeof(header.base));
+	if(res)
+		return res;
+
+	COPY_3(fs, &header.base, block_ptr, SWAP_BASE_INODE_HEADER_3);
+
+	if(header.base.inode_type < SQUASHFS_DIR_TYPE ||
+			header.base.inode_type > SQUASHFS_LREG_TYPE)
+		return -EIO;
+
+	/* reread the inode now its type, and so its size, is known */
+	block = start;
+	block_offset = offset;
+
+	switch(header.base.inode_type) {
+	case SQUASHFS_DIR_TYPE:
+		res = sizeof(header.dir);
+		break;
+	case SQUASHFS_LDIR_TYPE:
+		res = sizeof(header.ldir);
+		break;
+	case SQUASHFS_FILE_TYPE:
+		res = sizeof(header.reg);
+		break;
+	case SQUASHFS_LREG_TYPE:
+		res = sizeof(header.lreg);
+		break;
+	case SQUASHFS_SYMLINK_TYPE:
+		res = sizeof(header.symlink);
+		break;
+	case SQUASHFS_BLKDEV_TYPE:
+	case SQUASHFS_CHRDEV_TYPE:
+		res = sizeof(header.dev);
+		break;
+	default:
+		res = sizeof(header.ipc);
+	}
+
+	res = read_metadata(fs, fs->inode_cache, &block, &block_offset,
+		block_ptr, res);
+	if(res)
+		return res;
+
+	if(header.base.uid >= fs->no_uids)
+		return -EIO;
+	uid = fs->id_table[header.base.uid];
+
+	if(header.base.guid == SQUASHFS_GUIDS)
+		gid = uid;
+	else if(fs->no_uids + header.base.guid < fs->sBlk.no_ids)
+		gid = fs->id_table[fs->no_uids + header.base.guid];
+	else
+		return -EIO;
+
+	memset(i, 0, sizeof(*i));
+	i->ref = ref;
+	i->uid = uid;
+	i->gid = gid;
+	i->mode = lookup_type[header.base.inode_type] | header.base.mode;
+	i->mtime = header.base.mtime;
+	i->inode_number = header.base.inode_number;
+	i->nlink = 1;
+	i->xattr = SQUASHFS_INVALID_XATTR;
+	i->fragment = SQUASHFS_INVALID_FRAG;
+	i->block_start = block;
+	i->block_offset = block_offset;
+
+	switch(header.base.inode_type) {
+	case SQUASHFS_DIR_TYPE: {
+		struct squashfs_dir_inode_header_3 *inode = &header.dir;
+
+		COPY_3(fs, inode, block_ptr, SQUASHFS_SWAP_DIR_INODE_HEADER_3);
+
+		i->nlink = inode->nlink;
+		i->size = inode->file_size;
+		i->start = inode->start_block;
+		i->offset = inode->offset;
+		break;
+	}
+	case SQUASHFS_LDIR_TYPE: {
+		struct squashfs_ldir_inode_header_3 *inode = &header.ldir;
+
+		COPY_3(fs, inode, block_ptr, SQUASHFS_SWAP_LDIR_INODE_HEADER_3);
+
+		i->nlink = inode->nlink;
+		i->size = inode->file_size;
+		i->start = inode->start_block;
+		i->offset = inode->offset;
+		break;
+	}
+	case SQUASHFS_FILE_TYPE: {
+		struct squashfs_reg_inode_header_3 *inode = &header.reg;
+
+		COPY_3(fs, inode, block_ptr, SQUASHFS_SWAP_REG_INODE_HEADER_3);
+
+		i->size = inode->file_size;
+		i->start = inode->start_block;
+		i->fragment = inode->fragment;
+		i->frag_offset = inode->offset;
+		break;
+	}
+	case SQUASHFS_LREG_TYPE: {
+		struct squashfs_lreg_inode_header_3 *inode = &header.lreg;
+
+		COPY_3(fs, inode, block_ptr, SQUASHFS_SWAP_LREG_INODE_HEADER_3);
+
+		i->nlink = inode->nlink;
+		i->size = inode->file_size;
+		i->start = inode->start_block;
+		i->fragment = inode->fragment;
+		i->frag_offset = inode->offset;
+		break;
+	}
+	case SQUASHFS_SYMLINK_TYPE: {
+		struct squashfs_symlink_inode_header_3 *inode = &header.symlink;
+
+		COPY_3(fs, inode, block_ptr,
+			SQUASHFS_SWAP_SYMLINK_INODE_HEADER_3);
+
+		i->nlink = inode->nlink;
+		i->size = inode->symlink_size;
+		break;
+	}
+	case SQUASHFS_BLKDEV_TYPE:
+	case SQUASHFS_CHRDEV_TYPE: {
+		struct squashfs_dev_inode_header_3 *inode = &header.dev;
+
+		COPY_3(fs, inode, block_ptr, SQUASHFS_SWAP_DEV_INODE_HEADER_3);
+
+		i->nlink = inode->nlink;
+		i->rdev = inode->rdev;
+		break;
+	}
+	default: {
+		struct squashfs_ipc_inode_header_3 *inode = &header.ipc;
+
+		COPY_3(fs, inode, block_ptr, SQUASHFS_SWAP_IPC_INODE_HEADER_3);
+
+		i->nlink = inode->nlink;
+	}
+	}
+
+	if(i->fragment != SQUASHFS_INVALID_FRAG &&
+			(i->fragment >= fs->sBlk.fragments ||
+			i->frag_offset >= fs->sBlk.block_size))
+		return -EIO;
+
+	return 0;
+}
+
+
+/*
+ * Read the inode with reference ref (the inode table block relative to
+ * the start of the inode table, and offset in the block, as in
+ * directory entries and the superblock's root inode)
+ */
+int sqfs_read_inode(struct sqfs *fs, long long ref, struct sqfs_inode *i)
+{
+	union squashfs_inode_header header;
+	char block_ptr[sizeof(header)] __attribute__((aligned));
+	long long start = fs->sBlk.inode_table_start + SQUASHFS_INODE_BLK(ref);
+	int offset = SQUASHFS_INODE_OFFSET(ref);
+	long long block = start;
+	int block_offset = offset, res;
+	unsigned int uid, gid;
+
+	if(fs->major == 3)
+		return read_inode_3(fs, ref, i);
+
+	res = read_metadata(fs, fs->inode_cache, &block, &block_offset,
+		block_ptr, sizeof(header.base));
+	if(res)
+		return res;
+
+	SQUASHFS_SWAP_BASE_INODE_HEADER(block_ptr, &header.base);
+
+	if(header.base.inode_type < SQUASHFS_DIR_TYPE ||
+			header.base.inode_type > SQUASHFS_LSOCKET_TYPE)
+		return -EIO;
+
+	/* reread the inode now its type, and so its size, is known */
+	block = start;
+	block_offset = offset;
+
+	switch(header.base.inode_type) {
+	case SQUASHFS_DIR_TYPE:
+		res = sizeof(header.dir);
+		break;
+	case SQUASHFS_LDIR_TYPE:
+		res = sizeof(header.ldir);
+		break;
+	case SQUASHFS_FILE_TYPE:
+		res = sizeof(header.reg);
+		break;
+	case SQUASHFS_LREG_TYPE:
+		res = sizeof(header.lreg);
+		break;
+	case SQUASHFS_SYMLINK_TYPE:
+	case SQUASHFS_LSYMLINK_TYPE:
+		res = sizeof(header.symlink);
+		break;
+	case SQUASHFS_BLKDEV_TYPE:
+	case SQUASHFS_CHRDEV_TYPE:
+		res = sizeof(header.dev);
+		break;
+	case SQUASHFS_LBLKDEV_TYPE:
+	case SQUASHFS_LCHRDEV_TYPE:
+		res = sizeof(header.ldev);
+		break;
+	case SQUASHFS_FIFO_TYPE:
+	case SQUASHFS_SOCKET_TYPE:
+		res = sizeof(header.ipc);
+		break;
+	default:
+		res = sizeof(header.lipc);
+	}
+
+	res = read_metadata(fs, fs->inode_cache, &block, &block_offset,
+		block_ptr, res);
+	if(res)
+		return res;
+
+	res = lookup_id(fs, header.base.uid, &uid);
+	if(res == 0)
+		res = lookup_id(fs, header.base.guid, &gid);
+	if(res)
+		return res;
+
+	memset(i, 0, sizeof(*i));
+	i->ref = ref;
+	i->uid = uid;
+	i->gid = gid;
+	i->mode = lookup_type[header.base.inode_type] | header.base.mode;
+	i->mtime = header.base.mtime;
+	i->inode_number = header.base.inode_number;
+	i->nlink = 1;
+	i->xattr = SQUASHFS_INVALID_XATTR;
+	i->fragment = SQUASHFS_INVALID_FRAG;
+	i->block_start = block;
+	i->block_offset = block_offset;
+
+	switch(header.base.inode_type) {
+	case SQUASHFS_DIR_TYPE: {
+		struct squashfs_dir_inode_header *inode = &header.dir;
+
+		SQUASHFS_SWAP_DIR_INODE_HEADER(block_ptr, inode);
+
+		i->nlink = inode->nlink;
+		i->size = inode->file_size;
+		i->start = inode->start_block;
+		i->offset = inode->offset;
+		break;
+	}
+	case SQUASHFS_LDIR_TYPE: {
+		struct squashfs_ldir_inode_header *inode = &header.ldir;
+
+		SQUASHFS_SWAP_LDIR_INODE_HEADER(block_ptr, inode);
+
+		i->nlink = inode->nlink;
+		i->size = inode->file_size;
+		i->start = inode->start_block;
+		i->offset = inode->offset;
+		i->xattr = inode->xattr;
+		break;
+	}
+	case SQUASHFS_FILE_TYPE: {
+		struct squashfs_reg_inode_header *inode = &header.reg;
+
+		SQUASHFS_SWAP_REG_INODE_HEADER(block_ptr, inode);
+
+		i->size = inode->file_size;
+		i->start = inode->start_block;
+		i->fragment = inode->fragment;
+		i->frag_offset = inode->offset;
+		break;
+	}
+	case SQUASHFS_LREG_TYPE: {
+		struct squashfs_lreg_inode_header *inode = &header.lreg;
+
+		SQUASHFS_SWAP_LREG_INODE_HEADER(block_ptr, inode);
+
+		i->nlink = inode->nlink;
+		i->size = inode->file_size;
+		i->start = inode->start_block;
+		i->fragment = inode->fragment;
+		i->frag_offset = inode->offset;
+		i->xattr = inode->xattr;
+		break;
+	}
+	case SQUASHFS_SYMLINK_TYPE:
+	case SQUASHFS_LSYMLINK_TYPE: {
+		struct squashfs_symlink_inode_header *inode = &header.symlink;
+
+		SQUASHFS_SWAP_SYMLINK_INODE_HEADER(block_ptr, inode);
+
+		i->nlink = inode->nlink;
+		i->size = inode->symlink_size;
+
+		if(header.base.inode_type == SQUASHFS_LSYMLINK_TYPE) {
+			/* the xattr follows the symlink target */
+			block_offset += inode->symlink_size;
+			res = read_metadata(fs, fs->inode_cache, &block,
+				&block_offset, &i->xattr, sizeof(i->xattr));
+			if(res)
+				return res;
+			SQUASHFS_INSWAP_INTS(&i->xattr, 1);
+		}
+		break;
+	}
+	case SQUASHFS_BLKDEV_TYPE:
+	case SQUASHFS_CHRDEV_TYPE: {
+		struct squashfs_dev_inode_header *inode = &header.dev;
+
+		SQUASHFS_SWAP_DEV_INODE_HEADER(block_ptr, inode);
+
+		i->nlink = inode->nlink;
+		i->rdev = inode->rdev;
+		break;
+	}
+	case SQUASHFS_LBLKDEV_TYPE:
+	case SQUASHFS_LCHRDEV_TYPE: {
+		struct squashfs_ldev_inode_header *inode = &header.ldev;
+
+		SQUASHFS_SWAP_LDEV_INODE_HEADER(block_ptr, inode);
+
+		i->nlink = inode->nlink;
+		i->rdev = inode->rdev;
+		i->xattr = inode->xattr;
+		break;
+	}
+	case SQUASHFS_FIFO_TYPE:
+	case SQUASHFS_SOCKET_TYPE: {
+		struct squashfs_ipc_inode_header *inode = &header.ipc;
+
+		SQUASHFS_SWAP_IPC_INODE_HEADER(block_ptr, inode);
+
+		i->nlink = inode->nlink;
+		break;
+	}
+	default: {
+		struct squashfs_lipc_inode_header *inode = &header.lipc;
+
+		SQUASHFS_SWAP_LIPC_INODE_HEADER(block_ptr, inode);
+
+		i->nlink = inode->nlink;
+		i->xattr = inode->xattr;
+	}
+	}
+
+	if(i->fragment != SQUASHFS_INVALID_FRAG &&
+			(i->fragment >= fs->sBlk.fragments ||
+			i->frag_offset >= fs->sBlk.block_size))
+		return -EIO;
+
+	return 0;
+}
+
+
+int sqfs_root(struct sqfs *fs, struct sqfs_inode *i)
+{
+	return sqfs_read_inode(fs, fs->sBlk.root_inode, i);
+}
+
+
+/*
+ * Read a 3.x directory for sqfs_readdir().  The 3.x directory headers and
+ * entries are laid out differently, but are otherwise read the same way
+ */
+static int readdir_3(struct sqfs *fs, struct sqfs_inode *dir, sqfs_dir_fn fn,
+	void *arg)
+{
+	struct squashfs_dir_header_3 dirh;
+	struct squashfs_dir_entry_3 dire;
+	char buffer[sizeof(dire) + SQUASHFS_NAME_LEN + 1]
+		__attribute__((aligned));
+	long long start = fs->sBlk.directory_table_start + dir->start;
+	int offset = dir->offset, res;
+	long long bytes = 3;
+
+	while(bytes < dir->size) {
+		int dir_count;
+
+		res = read_metadata(fs, fs->directory_cache, &start, &offset,
+			buffer, sizeof(dirh));
+		if(res)
+			return res;
+		COPY_3(fs, &dirh, buffer, SQUASHFS_SWAP_DIR_HEADER_3);
+		bytes += sizeof(dirh);
+
+		/* dir_count should never be larger than 256 */
+		dir_count = dirh.count + 1;
+		if(dir_count > 256)
+			return -EIO;
+
+		while(dir_count--) {
+			res = read_metadata(fs, fs->directory_cache, &start,
+				&offset, buffer, sizeof(dire));
+			if(res)
+				return res;
+			COPY_3(fs, &dire, buffer, SQUASHFS_SWAP_DIR_ENTRY_3);
+
+			if(dire.type < SQUASHFS_DIR_TYPE)
+				return -EIO;
+
+			res = read_metadata(fs, fs->directory_cache, &start,
+				&offset, buffer, dire.size + 1);
+			if(res)
+				return res;
+			buffer[dire.size + 1] = '\0';
+			bytes += sizeof(dire) + dire.size + 1;
+
+			res = fn(arg, buffer, SQUASHFS_MKINODE(dirh.start_block,
+				dire.offset), lookup_type[dire.type]);
+			if(res)
+				return res;
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ * Call fn for each entry in the directory.  The directory is read
+ * entry by entry through the directory cache, so large directories
+ * aren't read into memory
+ */
+int sqfs_readdir(struct sqfs *fs, struct sqfs_inode *dir, sqfs_dir_fn fn,
+	void *arg)
+{
+	struct squashfs_dir_header dirh;
+	char buffer[sizeof(struct squashfs_dir_entry) + SQUASHFS_NAME_LEN + 1]
+		__attribute__((aligned));
+	struct squashfs_dir_entry *dire = (struct squashfs_dir_entry *) buffer;
+	long long start = fs->sBlk.directory_table_start + dir->start;
+	int offset = dir->offset, res;
+	long long bytes = 3;
+
+	if(!S_ISDIR(dir->mode))
+		return -ENOTDIR;
+
+	if(fs->major == 3)
+		return readdir_3(fs, dir, fn, arg);
+
+	/*
+	 * The directory size includes 3 bytes for the . and .. entries, which
+	 * aren't stored.  Empty directories may not have any directory table
+	 * at all, and so aren't read
+	 */
+	while(bytes < dir->size) {
+		int dir_count;
+
+		res = read_metadata(fs, fs->directory_cache, &start, &offset,
+			buffer, sizeof(dirh));
+		if(res)
+			return res;
+		SQUASHFS_SWAP_DIR_HEADER(buffer, &dirh);
+		bytes += sizeof(dirh);
+
+		/* dir_count should never be larger than 256 */
+		dir_count = dirh.count + 1;
+		if(dir_count > 256)
+			return -EIO;
+
+		while(dir_count--) {
+			res = read_metadata(fs, fs->directory_cache, &start,
+				&offset, buffer, sizeof(*dire));
+			if(res)
+				return res;
+			SQUASHFS_SWAP_DIR_ENTRY(buffer, dire);
+
+			/* size should never be larger than SQUASHFS_NAME_LEN */
+			if(dire->size > SQUASHFS_NAME_LEN ||
+					dire->type < SQUASHFS_DIR_TYPE ||
+					dire->type > SQUASHFS_LSOCKET_TYPE)
+				return -EIO;
+
+			res = read_metadata(fs, fs->directory_cache, &start,
+				&offset, dire->name, dire->size + 1);
+			if(res)
+				return res;
+			dire->name[dire->size + 1] = '\0';
+			bytes += sizeof(*dire) + dire->size + 1;
+
+			res = fn(arg, (char *) dire->name,
+				SQUASHFS_MKINODE(dirh.start_block, dire->offset),
+				lookup_type[dire->type]);
+			if(res)
+				return res;
+		}
+	}
+
+	return 0;
+}
+
+
+struct lookup {
+	char		*name;
+	long long	ref;
+};
+
+
+static int lookup_fn(void *arg, char *name, long long ref, mode_t type)
+{
+	struct lookup *lookup = arg;
+	int res = strcmp(name, lookup->name);
+
+	if(res == 0) {
+		lookup->ref = ref;
+		return 1;
+	}
+
+	/* directories are sorted, and so it isn't there */
+	return res > 0 ? -ENOENT : 0;
+}
+
+
+/*
+ * Look up name in the directory dir
+ */
+int sqfs_lookup_entry(struct sqfs *fs, struct sqfs_inode *dir, char *name,
+	struct sqfs_inode *i)
+{
+	struct lookup lookup = { name, 0 };
+	int res = sqfs_readdir(fs, dir, lookup_fn, &lookup);
+
+	if(res == 0)
+		return -ENOENT;
+	if(res < 0)
+		return res;
+
+	return sqfs_read_inode(fs, lookup.ref, i);
+}
+
+
+/*
+ * Look up path, relative to the root directory.  Empty and "."
+ * components are skipped, but ".." and symbolic links aren't followed
+ */
+int sqfs_lookup(struct sqfs *fs, char *path, struct sqfs_inode *i)
+{
+	char name[SQUASHFS_NAME_LEN + 1];
+	int res = sqfs_root(fs, i);
+
+	while(res == 0 && *path) {
+		char *end = strchrnul(path, '/');
+		int len = end - path;
+
+		if(len > SQUASHFS_NAME_LEN)
+			return -ENAMETOOLONG;
+
+		memcpy(name, path, len);
+		name[len] = '\0';
+		path = *end ? end + 1 : end;
+
+		if(len == 0 || strcmp(name, ".") == 0)
+			continue;
+
+		res = sqfs_lookup_entry(fs, i, name, i);
+	}
+
+	return res;
+}
+
+
+void sqfs_stat(struct sqfs *fs, struct sqfs_inode *i, struct stat *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_ino = i->inode_number;
+	st->st_mode = i->mode;
+	st->st_nlink = i->nlink;
+	st->st_uid = i->uid;
+	st->st_gid = i->gid;
+	st->st_rdev = makedev((i->rdev >> 8) & 0xfff,
+		(i->rdev & 0xff) | ((i->rdev >> 12) & 0xfff00));
+	st->st_size = i->size;
+	st->st_blksize = fs->sBlk.block_size;
+	st->st_blocks = (i->size + 511) >> 9;
+	st->st_atime = st->st_mtime = st->st_ctime = i->mtime;
+}
+
+
+/*
+ * Copy the symbolic link's target into buffer, which is always
+ * nul terminated, truncating it if it's longer than size - 1.  Returns the
+ * target's length
+ */
+int sqfs_readlink(struct sqfs *fs, struct sqfs_inode *i, char *buffer,
+	int size)
+{
+	long long block = i->block_start;
+	int offset = i->block_offset, res;
+	int bytes = i->size < size ? i->size : size - 1;
+
+	if(!S_ISLNK(i->mode) || size < 1)
+		return -EINVAL;
+
+	res = read_metadata(fs, fs->inode_cache, &block, &offset, buffer,
+		bytes);
+	if(res)
+		return res;
+
+	buffer[bytes] = '\0';
+	return i->size;
+}
+
+
+/*
+ * Open a regular file for sqfs_pread().  This reads the file's block list,
+ * so reads don't need to
+ */
+struct sqfs_file *sqfs_open_file(struct sqfs *fs, struct sqfs_inode *i,
+	int *error)
+{
+	struct sqfs_file *file;
+	long long block = i->block_start;
+	int offset = i->block_offset, n, res;
+
+	if(!S_ISREG(i->mode)) {
+		*error = S_ISDIR(i->mode) ? -EISDIR : -EINVAL;
+		return NULL;
+	}
+
+	file = calloc(1, sizeof(struct sqfs_file));
+	if(file == NULL) {
+		*error = -ENOMEM;
+		return NULL;
+	}
+
+	file->fs = fs;
+	file->inode = *i;
+	file->blocks = i->fragment == SQUASHFS_INVALID_FRAG ?
+		(i->size + fs->sBlk.block_size - 1) >> fs->sBlk.block_log :
+		i->size >> fs->sBlk.block_log;
+
+	file->block_list = malloc(file->blocks * sizeof(unsigned int));
+	file->block_start = malloc(file->blocks * sizeof(long long));
+	if(file->blocks && (file->block_list == NULL ||
+					file->block_start == NULL)) {
+		res = -ENOMEM;
+		goto failed;
+	}
+
+	res = read_metadata(fs, fs->inode_cache, &block, &offset,
+		file->block_list, file->blocks * sizeof(unsigned int));
+	if(res)
+		goto failed;
+	swap_ints(fs, file->block_list, file->blocks);
+
+	/* work out where each block is, so reads can go straight to it */
+	for(n = 0, block = i->start; n < file->blocks; n++) {
+		file->block_start[n] = block;
+		block += SQUASHFS_COMPRESSED_SIZE_BLOCK(file->block_list[n]);
+	}
+
+	return file;
+
+failed:
+	sqfs_close_file(file);
+	*error = res;
+	return NULL;
+}
+
+
+void sqfs_close_file(struct sqfs_file *file)
+{
+	free(file->block_list);
+	free(file->block_start);
+	free(file);
+}
+
+
+/*
+ * Queue the blocks after first up to last, and readahead blocks after last,
+ * for the inflator threads.  The first block is read by the calling thread
+ * straight away.  Blocks already queued for sequential reads aren't queued
+ * again
+ */
+static void read_ahead(struct sqfs_file *file, long long first,
+	long long last)
+{
+	struct sqfs *fs = file->fs;
+	long long n, end = last + 1 + fs->readahead;
+
+	if(end > file->blocks)
+		end = file->blocks;
+
+	pthread_mutex_lock(&fs->request_mutex);
+	n = file->ahead > first && file->ahead <= end ? file->ahead : first + 1;
+	file->ahead = end;
+
+	for(; n < end; n++)
+		if(file->block_list[n])
+			queue_readahead(fs, file->block_start[n],
+				file->block_list[n]);
+	pthread_mutex_unlock(&fs->request_mutex);
+}
+
+
+/*
+ * Read up to count bytes of the file at offset into buffer.  Returns the
+ * number of bytes read, which is only less than count at the end of the
+ * file
+ */
+long long sqfs_pread(struct sqfs_file *file, void *buffer, long long count,
+	long long offset)
+{
+	struct sqfs *fs = file->fs;
+	struct sqfs_inode *i = &file->inode;
+	long long copied = 0;
+
+	if(offset < 0)
+		return -EINVAL;
+
+	if(offset >= i->size)
+		return 0;
+
+	if(count > i->size - offset)
+		count = i->size - offset;
+
+	if(fs->inflators)
+		read_ahead(file, offset >> fs->sBlk.block_log,
+			(offset + count - 1) >> fs->sBlk.block_log);
+
+	while(copied < count) {
+		long long n = offset >> fs->sBlk.block_log, next;
+		int block_offset = offset & (fs->sBlk.block_size - 1);
+		int bytes = fs->sBlk.block_size - block_offset, length, res;
+		int expected = i->size - (n << fs->sBlk.block_log) <
+			fs->sBlk.block_size ? i->size - (n <<
+			fs->sBlk.block_log) : fs->sBlk.block_size;
+
+		if(bytes > count - copied)
+			bytes = count - copied;
+
+		if(n < file->blocks && file->block_list[n] == 0) {
+			/* sparse block */
+			memset(buffer + copied, 0, bytes);
+			res = bytes;
+		} else if(n < file->blocks) {
+			res = cache_read(fs, data_shard(fs,
+				file->block_start[n]), file->block_start[n],
+				file->block_list[n], block_offset,
+				buffer + copied, bytes, &length, &next);
+			if(res >= 0 && length != expected)
+				res = -EIO;
+		} else {
+			struct squashfs_fragment_entry *frag;
+
+			if(i->fragment == SQUASHFS_INVALID_FRAG)
+				return -EIO;
+
+			frag = &fs->fragment_table[i->fragment];
+			res = cache_read(fs, data_shard(fs, frag->start_block),
+				frag->start_block, frag->size, i->frag_offset +
+				block_offset, buffer + copied, bytes, &length,
+				&next);
+		}
+
+		if(res < 0)
+			return res;
+		if(res < bytes)
+			return -EIO;
+
+		copied += bytes;
+		offset += bytes;
+	}
+
+	return copied;
+}
@@ -0,0 +1,113 @@
+#ifndef LIBSQUASHFS_H
+#define LIBSQUASHFS_H
+/*
+ * Squashfs
+ *
+ * Copyright (c) 2014
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * libsquashfs.h
+ *
+ * A library to read files out of Squashfs 4.0 (and 3.x) filesystems
+ * in-process, without extracting or mounting them.  There's no global
+ * state, each open filesystem has its own caches, and any number of
+ * threads can use an open filesystem (and open file) at the same time.
+ * sqfs_open_cache() opens a filesystem with a larger data cache, and
+ * inflator threads decompressing blocks ahead of sqfs_pread()
+ *
+ * Functions returning int return 0 (or a byte count) on success, and a
+ * negated errno value on error, e.g. -ENOENT or -EIO if the filesystem
+ * is corrupted
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+struct sqfs;
+struct sqfs_file;
+
+struct sqfs_inode {
+	long long	ref;		/* inode table block << 16 | offset */
+	mode_t		mode;
+	uid_t		uid;
+	gid_t		gid;
+	time_t		mtime;
+	unsigned int	inode_number;
+	unsigned int	nlink;
+	long long	size;		/* file, symlink or directory size */
+	unsigned int	rdev;
+	unsigned int	xattr;
+
+	/* file data blocks, or the directory in the directory table */
+	long long	start;
+	int		offset;
+	unsigned int	fragment;
+	unsigned int	frag_offset;
+
+	/* the block list or symlink target following the inode */
+	long long	block_start;
+	int		block_offset;
+};
+
+/*
+ * The superblock details needed to copy compressed blocks between
+ * filesystems, see sqfs_block_list() and sqfs_fragment()
+ */
+struct sqfs_info {
+	int		compression;
+	unsigned int	block_size;
+	unsigned int	flags;
+	unsigned int	inodes;
+	unsigned int	fragments;
+	long long	bytes_used;
+	time_t		mkfs_time;
+};
+
+/*
+ * Called by sqfs_readdir() for each directory entry, with the entry's
+ * inode reference and file type (S_IFDIR etc.).  A non-zero return stops
+ * the directory read, and is returned by sqfs_readdir()
+ */
+typedef int (*sqfs_dir_fn)(void *, char *, long long, mode_t);
+
+extern struct sqfs *sqfs_open(char *, int *);
+extern struct sqfs *sqfs_open_cache(char *, long long, int, int, int *);
+extern void sqfs_close(struct sqfs *);
+extern unsigned int sqfs_block_size(struct sqfs *);
+extern void sqfs_statvfs(struct sqfs *, struct statvfs *);
+extern void sqfs_get_info(struct sqfs *, struct sqfs_info *);
+extern int sqfs_fd(struct sqfs *);
+extern int sqfs_compression_options(struct sqfs *, void *);
+extern int sqfs_read_inode(struct sqfs *, long long, struct sqfs_inode *);
+extern int sqfs_root(struct sqfs *, struct sqfs_inode *);
+extern int sqfs_lookup_entry(struct sqfs *, struct sqfs_inode *, char *,
+	struct sqfs_inode *);
+extern int sqfs_lookup(struct sqfs *, char *, struct sqfs_inode *);
+extern void sqfs_stat(struct sqfs *, struct sqfs_inode *, struct stat *);
+extern int sqfs_readdir(struct sqfs *, struct sqfs_inode *, sqfs_dir_fn,
+	void *);
+extern int sqfs_readlink(struct sqfs *, struct sqfs_inode *, char *, int);
+extern struct sqfs_file *sqfs_open_file(struct sqfs *, struct sqfs_inode *,
+	int *);
+extern void sqfs_close_file(struct sqfs_file *);
+extern long long sqfs_pread(struct sqfs_file *, void *, long long, long long);
+extern int sqfs_block_list(struct sqfs *, struct sqfs_inode *, unsigned int *,
+	int);
+extern int sqfs_fragment(struct sqfs *, unsigned int, long long *,
+	unsigned int *);
+#endif
@@ -33,6 +33,54 @@
 
 static int hc = 0;
 
+/* -Xcompression-level HC level, 0 if not given */
+static int hc_level = 0;
+
+/* -Xacceleration fast mode acceleration factor */
+static int acceleration = 1;
+
+/*
+ * dictionary used to compress and decompress every block, either read
+ * from the -Xdict file, or from the stored compression options
+ */
+static char dictionary[LZ4_MAX_DICTIONARY_SIZE];
+static int dictionary_size = 0;
+
+/*
+ * Read the dictionary file given to -Xdict.  The dictionary is stored
+ * in the filesystem, and so it must fit in the compression options
+ * metadata block
+ */
+static int read_dictionary(char *filename)
+{
+	FILE *file = fopen(filename, "r");
+	int res;
+
+	if(file == NULL) {
+		fprintf(stderr, "lz4: -Xdict failed to open %s\n", filename);
+		return -1;
+	}
+
+	res = fread(dictionary, 1, LZ4_MAX_DICTIONARY_SIZE, file);
+	if(ferror(file)) {
+		fprintf(stderr, "lz4: -Xdict failed to read %s\n", filename);
+		fclose(file);
+		return -1;
+	}
+
+	if(res == 0 || fgetc(file) != EOF) {
+		fprintf(stderr, "lz4: -Xdict dictionary should be 1 .. %d "
+			"bytes\n", (int) LZ4_MAX_DICTIONARY_SIZE);
+		fclose(file);
+		return -1;
+	}
+
+	fclose(file);
+	dictionary_size = res;
+	return 0;
+}
+
+
 /*
  * This function is called by the options parsing code in mksquashfs.c
  * to parse any -X compressor option.
@@ -53,9 +101,81 @@ static int lz4_options(char *argv[], int argc)
 	if(strcmp(argv[0], "-Xhc") == 0) {
 		hc = 1;
 		return 0;
+	} else if(strcmp(argv[0], "-Xcompression-level") == 0) {
+		if(argc < 2) {
+			fprintf(stderr, "lz4: -Xcompression-level missing "
+				"compression level\n");
+			fprintf(stderr, "lz4: -Xcompression-level it should "
+				"be 1 >= n <= %d\n", LZ4HC_CLEVEL_MAX);
+			goto failed;
+		}
+
+		hc_level = atoi(argv[1]);
+		if(hc_level < 1 || hc_level > LZ4HC_CLEVEL_MAX) {
+			fprintf(stderr, "lz4: -Xcompression-level invalid, it "
+				"should be 1 >= n <= %d\n", LZ4HC_CLEVEL_MAX);
+			goto failed;
+		}
+
+		hc = 1;
+		return 1;
+	} else if(strcmp(argv[0], "-Xacceleration") == 0) {
+		if(argc < 2) {
+			fprintf(stderr, "lz4: -Xacceleration missing "
+				"acceleration factor\n");
+			fprintf(stderr, "lz4: -Xacceleration it should be 1 >= "
+				"n <= %d\n", LZ4_MAX_ACCELERATION);
+			goto failed;
+		}
+
+		acceleration = atoi(argv[1]);
+		if(acceleration < 1 || acceleration > LZ4_MAX_ACCELERATION) {
+			fprintf(stderr, "lz4: -Xacceleration invalid, it "
+				"should be 1 >= n <= %d\n",
+				LZ4_MAX_ACCELERATION);
+			goto failed;
+		}
+
+		return 1;
+	} else if(strcmp(argv[0], "-Xdict") == 0) {
+		if(argc < 2) {
+			fprintf(stderr, "lz4: -Xdict missing dictionary "
+				"file\n");
+			fprintf(stderr, "lz4: -Xdict <dictionary-file>\n");
+			goto failed;
+		}
+
+		if(read_dictionary(argv[1]) == -1)
+			goto failed;
+
+		return 1;
 	}
 
 	return -1;
+
+failed:
+	return -2;
+}
+
+
+/*
+ * This function is called after all options have been parsed.
+ * It is used to do post-processing on the compressor options using
+ * values that were not expected to be known at option parse time.
+ *
+ * This function returns 0 on successful post processing, or
+ *			-1 on error
+ */
+static int lz4_options_post(int block_size)
+{
+	if(hc && acceleration != 1) {
+		fprintf(stderr, "lz4: -Xacceleration only applies to the fast "
+			"mode, it can't be used with -Xhc or "
+			"-Xcompression-level\n");
+		return -1;
+	}
+
+	return 0;
 }
 
 
@@ -72,42 +192,36 @@ static int lz4_options(char *argv[], int argc)
  * Currently LZ4 always returns a comp_opts structure, with
  * the version indicating LZ4_LEGACY stream fomat.  This is to
  * easily accomodate changes in the kernel code to different
- * stream formats 
+ * stream formats.  A dictionary makes the stream format LZ4_LEGACY_DICT,
+ * which the kernel and older versions of Unsquashfs will refuse, rather
+ * than misread
  */
 static void *lz4_dump_options(int block_size, int *size)
 {
-	static struct lz4_comp_opts comp_opts;
+	static char buffer[SQUASHFS_METADATA_SIZE] __attribute__ ((aligned));
+	struct lz4_comp_opts *comp_opts = (struct lz4_comp_opts *) buffer;
+
+	comp_opts->version = dictionary_size ? LZ4_LEGACY_DICT : LZ4_LEGACY;
+	comp_opts->flags = (hc ? LZ4_HC : 0) |
+		(unsigned) hc_level << LZ4_LEVEL_SHIFT |
+		(unsigned) (acceleration == 1 ? 0 : acceleration) <<
+		LZ4_ACCEL_SHIFT;
+	SQUASHFS_INSWAP_COMP_OPTS(comp_opts);
 
-	comp_opts.version = LZ4_LEGACY;
-	comp_opts.flags = hc ? LZ4_HC : 0;
-	SQUASHFS_INSWAP_COMP_OPTS(&comp_opts);
+	memcpy(buffer + sizeof(*comp_opts), dictionary, dictionary_size);
 
-	*size = sizeof(comp_opts);
-	return &comp_opts;
+	*size = sizeof(*comp_opts) + dictionary_size;
+	return comp_opts;
 }
 
 
 /*
- * This function is a helper specifically for the append mode of
- * mksquashfs.  Its purpose is to set the internal compressor state
- * to the stored compressor options in the passed compressor options
- * structure.
- *
- * In effect this function sets up the compressor options
- * to the same state they were when the filesystem was originally
- * generated, this is to ensure on appending, the compressor uses
- * the same compression options that were used to generate the
- * original filesystem.
- *
- * Note, even if there are no compressor options, this function is still
- * called with an empty compressor structure (size == 0), to explicitly
- * set the default options, this is to ensure any user supplied
- * -X options on the appending mksquashfs command line are over-ridden
- *
- * This function returns 0 on sucessful extraction of options, and
- *			-1 on error
+ * Check the stored compression options, and read the flags and
+ * dictionary from the options structure.  Used by extract_options,
+ * check_options and display_options, because the dictionary is needed to
+ * decompress
  */
-static int lz4_extract_options(int block_size, void *buffer, int size)
+static int read_options(void *buffer, int size, int *flags)
 {
 	struct lz4_comp_opts *comp_opts = buffer;
 
@@ -117,22 +231,34 @@ static int lz4_extract_options(int block_size, void *buffer, int size)
 
 	SQUASHFS_INSWAP_COMP_OPTS(comp_opts);
 
-	/* we expect the stream format to be LZ4_LEGACY */
-	if(comp_opts->version != LZ4_LEGACY) {
+	/* we expect the stream format to be LZ4_LEGACY or LZ4_LEGACY_DICT */
+	if(comp_opts->version != LZ4_LEGACY &&
+				comp_opts->version != LZ4_LEGACY_DICT) {
 		fprintf(stderr, "lz4: unknown LZ4 version\n");
 		goto failed;
 	}
 
 	/*
 	 * Check compression flags, currently only LZ4_HC ("high compression")
-	 * can be set.
+	 * can be set, with the HC level and the acceleration factor
 	 */
-	if(comp_opts->flags == LZ4_HC)
-		hc = 1;
-	else if(comp_opts->flags != 0) {
+	if(LZ4_UNKNOWN_FLAGS(comp_opts->flags) ||
+			LZ4_LEVEL(comp_opts->flags) > LZ4HC_CLEVEL_MAX) {
 		fprintf(stderr, "lz4: unknown LZ4 flags\n");
 		goto failed;
 	}
+	*flags = comp_opts->flags;
+
+	/* the dictionary is the rest of the structure */
+	if((comp_opts->version == LZ4_LEGACY_DICT) !=
+					(size > sizeof(*comp_opts))) {
+		fprintf(stderr, "lz4: bad dictionary in compression options "
+			"structure\n");
+		goto failed;
+	}
+
+	dictionary_size = size - sizeof(*comp_opts);
+	memcpy(dictionary, buffer + sizeof(*comp_opts), dictionary_size);
 
 	return 0;
 
@@ -144,10 +270,46 @@ failed:
 }
 
 
+/*
+ * This function is a helper specifically for the append mode of
+ * mksquashfs.  Its purpose is to set the internal compressor state
+ * to the stored compressor options in the passed compressor options
+ * structure.
+ *
+ * In effect this function sets up the compressor options
+ * to the same state they were when the filesystem was originally
+ * generated, this is to ensure on appending, the compressor uses
+ * the same compression options that were used to generate the
+ * original filesystem.
+ *
+ * Note, even if there are no compressor options, this function is still
+ * called with an empty compressor structure (size == 0), to explicitly
+ * set the default options, this is to ensure any user supplied
+ * -X options on the appending mksquashfs command line are over-ridden
+ *
+ * This function returns 0 on sucessful extraction of options, and
+ *			-1 on error
+ */
+static int lz4_extract_options(int block_size, void *buffer, int size)
+{
+	int flags;
+
+	if(read_options(buffer, size, &flags) == -1)
+		return -1;
+
+	hc = flags & LZ4_HC;
+	hc_level = LZ4_LEVEL(flags);
+	acceleration = LZ4_ACCEL(flags) ? LZ4_ACCEL(flags) : 1;
+
+	return 0;
+}
+
+
 /*
  * This function is a helper specifically for unsquashfs.
  * Its purpose is to check that the compression options are
- * understood by this version of LZ4.
+ * understood by this version of LZ4, and to read any dictionary
+ * needed to decompress the filesystem.
  *
  * This is important for LZ4 because the format understood by the
  * Linux kernel may change from the already obsolete legacy format
@@ -161,74 +323,89 @@ failed:
  */
 static int lz4_check_options(int block_size, void *buffer, int size)
 {
-	struct lz4_comp_opts *comp_opts = buffer;
+	int flags;
 
-	/* we expect a comp_opts structure to be present */
-	if(size < sizeof(*comp_opts))
-		goto failed;
+	return read_options(buffer, size, &flags);
+}
 
-	SQUASHFS_INSWAP_COMP_OPTS(comp_opts);
 
-	/* we expect the stream format to be LZ4_LEGACY */
-	if(comp_opts->version != LZ4_LEGACY) {
-		fprintf(stderr, "lz4: unknown LZ4 version\n");
-		goto failed;
-	}
+void lz4_display_options(void *buffer, int size)
+{
+	int flags;
 
-	return 0;
+	if(read_options(buffer, size, &flags) == -1)
+		return;
 
-failed:
-	fprintf(stderr, "lz4: error reading stored compressor options from "
-		"filesystem!\n");
-	return -1;
+	if(flags & LZ4_HC)
+		printf("\tHigh Compression option specified (-Xhc)\n");
+	if(LZ4_LEVEL(flags))
+		printf("\tcompression-level %d\n", LZ4_LEVEL(flags));
+	if(LZ4_ACCEL(flags))
+		printf("\tacceleration %d\n", LZ4_ACCEL(flags));
+	if(dictionary_size)
+		printf("\tdictionary-size %d\n", dictionary_size);
 }
 
 
-void lz4_display_options(void *buffer, int size)
+/*
+ * This function is called by mksquashfs to initialise the
+ * compressor, before compress() is called.
+ *
+ * Each compressing thread has its own compression state, or with a
+ * dictionary, its own stream which the dictionary is loaded into for
+ * every block, so the blocks remain independent of each other
+ *
+ * This function returns 0 on success, and
+ *			-1 on error
+ */
+static int lz4_init(void **strm, int block_size, int datablock)
 {
-	struct lz4_comp_opts *comp_opts = buffer;
+	struct lz4_stream *stream = malloc(sizeof(struct lz4_stream));
 
-	/* check passed comp opts struct is of the correct length */
-	if(size < sizeof(*comp_opts))
-		goto failed;
-
-	SQUASHFS_INSWAP_COMP_OPTS(comp_opts);
+	if(stream == NULL)
+		return -1;
 
-	/* we expect the stream format to be LZ4_LEGACY */
-	if(comp_opts->version != LZ4_LEGACY) {
-		fprintf(stderr, "lz4: unknown LZ4 version\n");
-		goto failed;
-	}
+	if(hc && dictionary_size)
+		stream->state = LZ4_createStreamHC();
+	else if(hc)
+		stream->state = malloc(LZ4_sizeofStateHC());
+	else if(dictionary_size)
+		stream->state = LZ4_createStream();
+	else
+		stream->state = malloc(LZ4_sizeofState());
 
-	/*
-	 * Check compression flags, currently only LZ4_HC ("high compression")
-	 * can be set.
-	 */
-	if(comp_opts->flags & ~LZ4_FLAGS_MASK) {
-		fprintf(stderr, "lz4: unknown LZ4 flags\n");
-		goto failed;
+	if(stream->state == NULL) {
+		free(stream);
+		return -1;
 	}
 
-	if(comp_opts->flags & LZ4_HC)
-		printf("\tHigh Compression option specified (-Xhc)\n");
-
-	return;
-
-failed:
-	fprintf(stderr, "lz4: error reading stored compressor options from "
-		"filesystem!\n");
-}	
+	stream->level = hc_level ? hc_level : LZ4HC_CLEVEL_DEFAULT;
+	*strm = stream;
+	return 0;
+}
 
 
 static int lz4_compress(void *strm, void *dest, void *src,  int size,
 	int block_size, int *error)
 {
+	struct lz4_stream *stream = strm;
 	int res;
 
-	if(hc)
-		res = LZ4_compressHC_limitedOutput(src, dest, size, block_size);
-	else
-		res = LZ4_compress_limitedOutput(src, dest, size, block_size);
+	if(hc && dictionary_size) {
+		LZ4_resetStreamHC_fast(stream->state, stream->level);
+		LZ4_loadDictHC(stream->state, dictionary, dictionary_size);
+		res = LZ4_compress_HC_continue(stream->state, src, dest, size,
+			block_size);
+	} else if(hc)
+		res = LZ4_compress_HC_extStateHC(stream->state, src, dest,
+			size, block_size, stream->level);
+	else if(dictionary_size) {
+		LZ4_loadDict(stream->state, dictionary, dictionary_size);
+		res = LZ4_compress_fast_continue(stream->state, src, dest,
+			size, block_size, acceleration);
+	} else
+		res = LZ4_compress_fast_extState(stream->state, src, dest,
+			size, block_size, acceleration);
 
 	if(res == 0) {
 		/*
@@ -248,10 +425,36 @@ static int lz4_compress(void *strm, void *dest, void *src,  int size,
 }
 
 
-static int lz4_uncompress(void *dest, void *src, int size, int outsize,
-	int *error)
+/*
+ * With -Xhc the efforts are HC levels 1 to the level given, which all
+ * decompress the same way.  The fast mode only has the one effort
+ */
+static int lz4_efforts()
+{
+	return hc ? (hc_level ? hc_level : LZ4HC_CLEVEL_DEFAULT) : 1;
+}
+
+
+static void lz4_effort(void *strm, int effort)
 {
-	int res = LZ4_decompress_safe(src, dest, size, outsize);
+	struct lz4_stream *stream = strm;
+
+	if(hc)
+		stream->level = effort + 1;
+}
+
+
+static int lz4_uncompress(void *strm, void *dest, void *src, int size,
+	int outsize, int *error)
+{
+	int res;
+
+	if(dictionary_size)
+		res = LZ4_decompress_safe_usingDict(src, dest, size, outsize,
+			dictionary, dictionary_size);
+	else
+		res = LZ4_decompress_safe(src, dest, size, outsize);
+
 	if(res < 0) {
 		*error = res;
 		return -1;
@@ -265,13 +468,30 @@ void lz4_usage()
 {
 	fprintf(stderr, "\t  -Xhc\n");
 	fprintf(stderr, "\t\tCompress using LZ4 High Compression\n");
+	fprintf(stderr, "\t  -Xcompression-level <compression-level>\n");
+	fprintf(stderr, "\t\tCompress using LZ4 High Compression at "
+		"<compression-level>,\n\t\twhich should be 1 .. %d (default "
+		"%d)\n", LZ4HC_CLEVEL_MAX, LZ4HC_CLEVEL_DEFAULT);
+	fprintf(stderr, "\t  -Xacceleration <acceleration>\n");
+	fprintf(stderr, "\t\tAcceleration factor of the fast mode, which "
+		"should be\n\t\t1 .. %d (default 1).  Higher is faster, and "
+		"compresses less\n", LZ4_MAX_ACCELERATION);
+	fprintf(stderr, "\t  -Xdict <dictionary-file>\n");
+	fprintf(stderr, "\t\tCompress using the dictionary in "
+		"<dictionary-file>, which is\n\t\tstored in the filesystem.  "
+		"It should be %d bytes or smaller\n",
+		(int) LZ4_MAX_DICTIONARY_SIZE);
 }
 
 
 struct compressor lz4_comp_ops = {
+	.init = lz4_init,
 	.compress = lz4_compress,
+	.efforts = lz4_efforts,
+	.effort = lz4_effort,
 	.uncompress = lz4_uncompress,
 	.options = lz4_options,
+	.options_post = lz4_options_post,
 	.dump_options = lz4_dump_options,
 	.extract_options = lz4_extract_options,
 	.check_options = lz4_check_options,
@@ -46,16 +46,46 @@ extern unsigned int inswap_le32(unsigned int);
 /*
  * Define the various stream formats recognised.
  * Currently omly legacy stream format is supported by the
- * kernel
+ * kernel.  LZ4_LEGACY_DICT is the legacy stream format with every
+ * block compressed using the dictionary which follows the compression
+ * options structure
  */
 #define LZ4_LEGACY	1
+#define LZ4_LEGACY_DICT	2
 #define LZ4_FLAGS_MASK	1
 
 /* Define the compression flags recognised. */
 #define LZ4_HC		1
 
+/*
+ * The -Xcompression-level HC level, and the -Xacceleration factor, are
+ * stored in the flags above the compression flags, 0 meaning the default
+ */
+#define LZ4_LEVEL_SHIFT		8
+#define LZ4_LEVEL_MASK		0xffU
+#define LZ4_ACCEL_SHIFT		16
+#define LZ4_ACCEL_MASK		0xffffU
+#define LZ4_LEVEL(flags)	(((flags) >> LZ4_LEVEL_SHIFT) & LZ4_LEVEL_MASK)
+#define LZ4_ACCEL(flags)	(((flags) >> LZ4_ACCEL_SHIFT) & LZ4_ACCEL_MASK)
+#define LZ4_UNKNOWN_FLAGS(flags) ((flags) & ~(LZ4_FLAGS_MASK | \
+	LZ4_LEVEL_MASK << LZ4_LEVEL_SHIFT | LZ4_ACCEL_MASK << LZ4_ACCEL_SHIFT))
+
+#define LZ4_MAX_ACCELERATION	65535
+
+/*
+ * The compression options, including any dictionary, are stored in one
+ * uncompressed metadata block after the superblock
+ */
+#define LZ4_MAX_DICTIONARY_SIZE (SQUASHFS_METADATA_SIZE - \
+	sizeof(struct lz4_comp_opts))
+
 struct lz4_comp_opts {
 	int version;
 	int flags;
 };
+
+struct lz4_stream {
+	void *state;
+	int level;
+};
 #endif
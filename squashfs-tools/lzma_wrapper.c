@@ -79,8 +79,8 @@ static int lzma_compress(void *strm, void *dest, void *src, int size, int block_
 }
 
 
-static int lzma_uncompress(void *dest, void *src, int size, int outsize,
-	int *error)
+static int lzma_uncompress(void *strm, void *dest, void *src, int size,
+	int outsize, int *error)
 {
 	unsigned char *s = src;
 	size_t outlen, inlen = size - LZMA_HEADER_SIZE;
@@ -96,8 +96,8 @@ failed:
 }
 
 
-static int lzma_uncompress(void *dest, void *src, int size, int outsize,
-	int *error)
+static int lzma_uncompress(void *ctx, void *dest, void *src, int size,
+	int outsize, int *error)
 {
 	lzma_stream strm = LZMA_STREAM_INIT;
 	int uncompressed_size = 0, res;
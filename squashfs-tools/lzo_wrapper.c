@@ -321,10 +321,16 @@ static int squashfs_lzo_init(void **strm, int block_size, int datablock)
 	if(stream == NULL)
 		goto failed;
 
-	stream->workspace = malloc(lzo[algorithm].size);
+	/* lzo1x_999 streams can drop to lzo1x_1 with -deadline */
+	stream->workspace = malloc(lzo[algorithm].size >
+		lzo[SQUASHFS_LZO1X_1].size ? lzo[algorithm].size :
+		lzo[SQUASHFS_LZO1X_1].size);
 	if(stream->workspace == NULL)
 		goto failed2;
 
+	stream->algorithm = algorithm;
+	stream->level = compression_level;
+
 	stream->buffer = malloc(LZO_MAX_EXPANSION(block_size));
 	if(stream->buffer != NULL)
 		return 0;
@@ -344,8 +350,13 @@ static int lzo_compress(void *strm, void *dest, void *src,  int size,
 	lzo_uint compsize, orig_size = size;
 	struct lzo_stream *stream = strm;
 
-	res = lzo[algorithm].compress(src, size, stream->buffer, &compsize,
-							stream->workspace);
+	if(stream->algorithm == SQUASHFS_LZO1X_999)
+		res = lzo1x_999_compress_level(src, size, stream->buffer,
+			&compsize, stream->workspace, NULL, 0, 0,
+			stream->level);
+	else
+		res = lzo[stream->algorithm].compress(src, size,
+			stream->buffer, &compsize, stream->workspace);
 	if(res != LZO_E_OK)
 		goto failed;	
 
@@ -375,8 +386,32 @@ failed:
 }
 
 
-static int lzo_uncompress(void *dest, void *src, int size, int outsize,
-	int *error)
+/*
+ * With lzo1x_999 the efforts are lzo1x_1, and then levels 1 to the level
+ * given.  All the lzo1x algorithms decompress with lzo1x_decompress, and
+ * so the blocks decompress the same way.  The other algorithms only have
+ * the one effort
+ */
+static int lzo_efforts()
+{
+	return algorithm == SQUASHFS_LZO1X_999 ? compression_level + 1 : 1;
+}
+
+
+static void lzo_effort(void *strm, int effort)
+{
+	struct lzo_stream *stream = strm;
+
+	if(algorithm != SQUASHFS_LZO1X_999)
+		return;
+
+	stream->algorithm = effort ? SQUASHFS_LZO1X_999 : SQUASHFS_LZO1X_1;
+	stream->level = effort ? effort : compression_level;
+}
+
+
+static int lzo_uncompress(void *strm, void *dest, void *src, int size,
+	int outsize, int *error)
 {
 	int res;
 	lzo_uint outlen = outsize;
@@ -426,6 +461,8 @@ int lzo1x_999_wrapper(const lzo_bytep src, lzo_uint src_len, lzo_bytep dst,
 struct compressor lzo_comp_ops = {
 	.init = squashfs_lzo_init,
 	.compress = lzo_compress,
+	.efforts = lzo_efforts,
+	.effort = lzo_effort,
 	.uncompress = lzo_uncompress,
 	.options = lzo_options,
 	.options_post = lzo_options_post,
@@ -68,6 +68,8 @@ struct lzo_algorithm {
 struct lzo_stream {
 	void *workspace;
 	void *buffer;
+	int algorithm;
+	int level;
 };
 
 #define LZO_MAX_EXPANSION(size)	(size + (size / 16) + 64 + 3)
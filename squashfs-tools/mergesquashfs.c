@@ -0,0 +1,1622 @@
+/*
+ * Merge squashfs filesystems into one, without recompressing their data.
+ *
+ * Copyright (c) 2014
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * mergesquashfs.c
+ *
+ * The filesystems are read with libsquashfs, and their directory trees
+ * merged in memory.  The compressed data and fragment blocks are copied
+ * to the new filesystem as they are, with copy_file_range() where the
+ * kernel can, and only the metadata (the inode, directory, fragment, id
+ * and export tables) is written afresh.  So all the filesystems must be
+ * compressed with the same compressor, block size and compression options.
+ *
+ * With -comp the filesystems are instead transcoded to another compressor
+ * (or other compression options).  Each block is decompressed and
+ * recompressed in memory by a pool of transcoder threads, and written
+ * where it would have been copied to, so only the block sizes and the
+ * table offsets change.
+ *
+ * Either way the blocks are written in the order they're in the
+ * filesystems, which keeps the layout Mksquashfs gave them (sort order,
+ * and fragment packing), and blocks shared by files stay shared.
+ *
+ * Libsquashfs reads 3.x filesystems too, whose data and fragment blocks
+ * are gzip blocks like 4.0's, so a 3.x filesystem is converted to 4.0 by
+ * copying its blocks and writing its metadata afresh (or transcoding it
+ * with -comp)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "squashfs_fs.h"
+#include "squashfs_swap.h"
+#include "compressor.h"
+#include "libsquashfs.h"
+
+#define TRUE 1
+#define FALSE 0
+
+/* entries added to a directory's entry array at a time */
+#define ENTRY_ALLOC 16
+
+/* the directory index (i_count) is 16 bits */
+#define I_COUNT_MAX 65535
+
+#define ID_HASH(id) (id & 0xff)
+
+/* blocks each transcoder thread has queued, so it never waits for work */
+#define TRANSCODE_AHEAD 2
+
+/* size of the buffer used to copy data if copy_file_range() can't */
+#define COPY_BUFFER (1024 * 1024)
+
+#define BAD_ERROR(s, args...) \
+	do { \
+		fprintf(stderr, "FATAL ERROR: " s, ##args); \
+		prep_exit(); \
+		exit(1); \
+	} while(0)
+
+#define MEM_ERROR() BAD_ERROR("Out of memory (%s)\n", __func__)
+
+struct merge_inode;
+
+struct merge_entry {
+	char			*name;
+	struct merge_inode	*inode;
+};
+
+/*
+ * struct describing an inode in the merged filesystem.  Hard links share
+ * the inode, which is written once, the first time it is reached
+ */
+struct merge_inode {
+	struct sqfs_inode	i;
+	int			image;
+	unsigned int		number;
+	unsigned int		nlink;
+	int			type;
+	long long		ref;
+
+	/* a regular file's block list, as stored in its filesystem */
+	unsigned int		*block_list;
+	int			blocks;
+
+	/* the entries of a directory, sorted by name once merged */
+	struct merge_entry	*entry;
+	int			count;
+	int			size;
+	int			dirs;
+};
+
+struct image {
+	char			*name;
+	struct sqfs		*fs;
+	struct sqfs_info	info;
+	int			fd;
+	struct compressor	*comp;
+
+	/*
+	 * The index in the merged fragment table of each fragment.  Set to 0
+	 * once the fragment block is in the block list, and to its index once
+	 * the blocks are written
+	 */
+	unsigned int		*fragment;
+
+	/* the merged inode of each inode with hard links */
+	struct merge_inode	**link;
+};
+
+/*
+ * A data or fragment block in one of the filesystems, and where it is
+ * written.  The sizes are as stored in block lists and the fragment
+ * table (with SQUASHFS_COMPRESSED_BIT_BLOCK set if uncompressed)
+ */
+struct block {
+	int			image;
+	long long		start;
+	unsigned int		size;
+	unsigned int		fragment;
+	long long		new_start;
+	unsigned int		new_size;
+};
+
+/* a block being transcoded, see transcoder() */
+struct job {
+	struct block		*block;
+	char			*data;
+	int			done;
+};
+
+struct id {
+	unsigned int		id;
+	int			index;
+	struct id		*next;
+};
+
+/* a metadata table built in memory, and written out once complete */
+struct metadata {
+	char			*table;
+	long long		bytes;
+	long long		size;
+	long long		total;
+	int			used;
+	char			block[SQUASHFS_METADATA_SIZE];
+};
+
+static struct image *image;
+static int images;
+static struct compressor *comp;
+static void *stream;
+static int transcode = FALSE;
+static int processors;
+static int noI = FALSE, no_exports = FALSE, no_xattrs = FALSE;
+static int xattrs_dropped = FALSE;
+
+static char *destination;
+static int fd = -1;
+static long long bytes;
+static int copy_range = TRUE;
+
+static unsigned int inode_count;
+static struct merge_inode **inode_lookup;
+static struct metadata inode_table, directory_table;
+
+static struct squashfs_fragment_entry *fragment_table;
+static unsigned int fragments;
+
+static struct id *id_hash[256];
+static unsigned int *id_table;
+static int ids;
+
+static struct block *block_list;
+static int blocks, blocks_size;
+
+/*
+ * The transcoder threads take the jobs in order, job taken being the next
+ * to take, and job queued the first not yet queued
+ */
+static struct job *job_list;
+static int job_ahead, job_taken, job_queued;
+static pthread_mutex_t job_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_wait = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t job_done = PTHREAD_COND_INITIALIZER;
+
+
+static void prep_exit()
+{
+	if(fd != -1) {
+		close(fd);
+		unlink(destination);
+	}
+}
+
+
+static void write_bytes(long long offset, long long count, void *buff)
+{
+	char *p = buff;
+
+	while(count) {
+		ssize_t res = pwrite(fd, p, count, offset);
+
+		if(res == -1) {
+			if(errno == EINTR)
+				continue;
+			BAD_ERROR("Failed to write to %s, because %s\n",
+				destination, strerror(errno));
+		}
+
+		p += res;
+		offset += res;
+		count -= res;
+	}
+}
+
+
+/*
+ * Compress a metadata block into d, returning the c_byte for its header
+ * (with SQUASHFS_COMPRESSED_BIT set if it's stored uncompressed)
+ */
+static unsigned short compress_block(void *d, void *s, int size)
+{
+	int error, c_byte = 0;
+
+	if(!noI) {
+		c_byte = compressor_compress(comp, stream, d, s, size, size,
+			&error);
+		if(c_byte == -1)
+			BAD_ERROR("Failed to compress metadata, "
+				"compressor_compress returned error %d\n",
+				error);
+	}
+
+	if(c_byte == 0) {
+		memcpy(d, s, size);
+		return size | SQUASHFS_COMPRESSED_BIT;
+	}
+
+	return c_byte;
+}
+
+
+static void flush_metadata(struct metadata *m)
+{
+	unsigned short c_byte;
+
+	if(m->bytes + SQUASHFS_METADATA_SIZE + 2 > m->size) {
+		m->size = (m->size + SQUASHFS_METADATA_SIZE + 2) * 2;
+		m->table = realloc(m->table, m->size);
+		if(m->table == NULL)
+			MEM_ERROR();
+	}
+
+	c_byte = compress_block(m->table + m->bytes + 2, m->block, m->used);
+	SQUASHFS_SWAP_SHORTS(&c_byte, m->table + m->bytes, 1);
+	m->bytes += SQUASHFS_COMPRESSED_SIZE(c_byte) + 2;
+	m->used = 0;
+}
+
+
+static void add_metadata(struct metadata *m, void *data, int size)
+{
+	char *p = data;
+
+	m->total += size;
+	while(size) {
+		int count = SQUASHFS_METADATA_SIZE - m->used;
+
+		if(count > size)
+			count = size;
+
+		memcpy(m->block + m->used, p, count);
+		m->used += count;
+		p += count;
+		size -= count;
+
+		if(m->used == SQUASHFS_METADATA_SIZE)
+			flush_metadata(m);
+	}
+}
+
+
+/* The reference (block << 16 | offset) of the next byte added to m */
+static long long metadata_ref(struct metadata *m)
+{
+	return SQUASHFS_MKINODE(m->bytes, m->used);
+}
+
+
+/*
+ * Write a table (the fragment, export and id tables) as metadata blocks,
+ * followed by the index of the blocks, returning where the index is
+ */
+static long long write_table(void *data, int length)
+{
+	int blocks = (length + SQUASHFS_METADATA_SIZE - 1) /
+		SQUASHFS_METADATA_SIZE, n;
+	long long *index = malloc(blocks * sizeof(long long)), start;
+	char buffer[SQUASHFS_METADATA_SIZE + 2];
+
+	if(blocks && index == NULL)
+		MEM_ERROR();
+
+	for(n = 0; n < blocks; n++) {
+		int size = length - n * SQUASHFS_METADATA_SIZE;
+		unsigned short c_byte;
+
+		if(size > SQUASHFS_METADATA_SIZE)
+			size = SQUASHFS_METADATA_SIZE;
+
+		c_byte = compress_block(buffer + 2, (char *) data + n *
+			SQUASHFS_METADATA_SIZE, size);
+		SQUASHFS_SWAP_SHORTS(&c_byte, buffer, 1);
+
+		index[n] = bytes;
+		write_bytes(bytes, SQUASHFS_COMPRESSED_SIZE(c_byte) + 2,
+			buffer);
+		bytes += SQUASHFS_COMPRESSED_SIZE(c_byte) + 2;
+	}
+
+	SQUASHFS_INSWAP_LONG_LONGS(index, blocks);
+	start = bytes;
+	write_bytes(bytes, blocks * sizeof(long long), index);
+	bytes += blocks * sizeof(long long);
+
+	free(index);
+	return start;
+}
+
+
+/*
+ * Copy length bytes at start in image to the end of the new filesystem.
+ * The kernel copies the bytes itself with copy_file_range() if it can
+ * (sharing the extents on filesystems with reflinks), otherwise they're
+ * read and written
+ */
+static void copy_data(struct image *img, long long start, long long length)
+{
+	static char *buffer = NULL;
+	loff_t in = start, out = bytes;
+
+	while(copy_range && length) {
+		ssize_t res = copy_file_range(img->fd, &in, fd, &out, length,
+			0);
+
+		if(res == -1 && errno == EINTR)
+			continue;
+
+		if(res == -1 && (errno == ENOSYS || errno == EXDEV ||
+				errno == EINVAL || errno == EOPNOTSUPP)) {
+			copy_range = FALSE;
+			break;
+		}
+
+		if(res == -1)
+			BAD_ERROR("Failed to copy data from %s, because %s\n",
+				img->name, strerror(errno));
+
+		if(res == 0)
+			BAD_ERROR("Unexpected end of file reading %s\n",
+				img->name);
+
+		length -= res;
+	}
+
+	if(length && buffer == NULL) {
+		buffer = malloc(COPY_BUFFER);
+		if(buffer == NULL)
+			MEM_ERROR();
+	}
+
+	while(length) {
+		ssize_t res = pread(img->fd, buffer, length > COPY_BUFFER ?
+			COPY_BUFFER : length, in);
+
+		if(res == -1 && errno == EINTR)
+			continue;
+
+		if(res == -1)
+			BAD_ERROR("Failed to read %s, because %s\n", img->name,
+				strerror(errno));
+
+		if(res == 0)
+			BAD_ERROR("Unexpected end of file reading %s\n",
+				img->name);
+
+		write_bytes(out, res, buffer);
+		in += res;
+		out += res;
+		length -= res;
+	}
+
+	bytes = out;
+}
+
+
+static void add_block(int img, long long start, unsigned int size,
+	unsigned int fragment)
+{
+	if(blocks == blocks_size) {
+		blocks_size = blocks_size ? blocks_size * 2 : 1024;
+		block_list = realloc(block_list, blocks_size *
+			sizeof(struct block));
+		if(block_list == NULL)
+			MEM_ERROR();
+	}
+
+	block_list[blocks].image = img;
+	block_list[blocks].start = start;
+	block_list[blocks].size = size;
+	block_list[blocks++].fragment = fragment;
+}
+
+
+static int compare_block(const void *a, const void *b)
+{
+	const struct block *block_a = a, *block_b = b;
+
+	if(block_a->image != block_b->image)
+		return block_a->image - block_b->image;
+
+	return block_a->start < block_b->start ? -1 :
+		block_a->start > block_b->start;
+}
+
+
+/* Sort the blocks into the order they're in the filesystems, once each */
+static void sort_blocks()
+{
+	int n, unique = 0;
+
+	/* the block list is NULL if there are no blocks */
+	if(blocks)
+		qsort(block_list, blocks, sizeof(struct block), compare_block);
+
+	for(n = 0; n < blocks; n++) {
+		if(unique && compare_block(&block_list[unique - 1],
+				&block_list[n]) == 0) {
+			if(block_list[n].fragment != SQUASHFS_INVALID_FRAG)
+				block_list[unique - 1].fragment =
+					block_list[n].fragment;
+			continue;
+		}
+
+		block_list[unique++] = block_list[n];
+	}
+
+	blocks = unique;
+}
+
+
+static struct block *lookup_block(int img, long long start)
+{
+	struct block key, *block;
+
+	key.image = img;
+	key.start = start;
+	block = bsearch(&key, block_list, blocks, sizeof(struct block),
+		compare_block);
+	if(block == NULL)
+		BAD_ERROR("Block at %lld in %s has gone missing\n", start,
+			image[img].name);
+
+	return block;
+}
+
+
+/*
+ * Read a file's block list, and add its blocks and fragment block to the
+ * blocks to be written
+ */
+static void add_file(struct merge_inode *inode)
+{
+	struct sqfs_inode *i = &inode->i;
+	struct image *im = &image[inode->image];
+	unsigned int block_size = im->info.block_size;
+	long long start = i->start;
+	int n, res;
+
+	inode->blocks = i->fragment == SQUASHFS_INVALID_FRAG ?
+		(i->size + block_size - 1) / block_size : i->size / block_size;
+
+	inode->block_list = malloc(inode->blocks * sizeof(unsigned int));
+	if(inode->blocks && inode->block_list == NULL)
+		MEM_ERROR();
+
+	res = sqfs_block_list(im->fs, i, inode->block_list, inode->blocks);
+	if(res)
+		BAD_ERROR("Failed to read block list in %s, because %s\n",
+			im->name, strerror(-res));
+
+	for(n = 0; n < inode->blocks; n++) {
+		unsigned int size = inode->block_list[n];
+
+		if(size) {
+			add_block(inode->image, start, size,
+				SQUASHFS_INVALID_FRAG);
+			start += SQUASHFS_COMPRESSED_SIZE_BLOCK(size);
+		}
+	}
+
+	if(i->fragment != SQUASHFS_INVALID_FRAG &&
+			im->fragment[i->fragment] == SQUASHFS_INVALID_FRAG) {
+		unsigned int size;
+
+		res = sqfs_fragment(im->fs, i->fragment, &start, &size);
+		if(res)
+			BAD_ERROR("Failed to read fragment %u in %s, because "
+				"%s\n", i->fragment, im->name, strerror(-res));
+
+		add_block(inode->image, start, size, i->fragment);
+		im->fragment[i->fragment] = 0;
+	}
+}
+
+
+/*
+ * Copy the blocks to the new filesystem as they are, runs of blocks
+ * next to each other with one copy_data()
+ */
+static void copy_blocks()
+{
+	int n, first;
+
+	for(first = 0; first < blocks; first = n) {
+		long long end = block_list[first].start;
+
+		for(n = first; n < blocks && block_list[n].image ==
+				block_list[first].image &&
+				block_list[n].start == end; n++) {
+			block_list[n].new_start = bytes + end -
+				block_list[first].start;
+			block_list[n].new_size = block_list[n].size;
+			end += SQUASHFS_COMPRESSED_SIZE_BLOCK(
+				block_list[n].size);
+		}
+
+		copy_data(&image[block_list[first].image],
+			block_list[first].start, end - block_list[first].start);
+	}
+}
+
+
+/*
+ * Transcoder thread.  Reads the block, decompresses it with its
+ * filesystem's compressor, and compresses it with the new one
+ */
+static void *transcoder(void *arg)
+{
+	int block_size = image[0].info.block_size, res, error, c_byte;
+	char *buffer = malloc(block_size), *data = malloc(block_size), *raw;
+	void *compress_stream, *uncompress_stream[images];
+
+	if(buffer == NULL || data == NULL)
+		MEM_ERROR();
+
+	res = compressor_init(comp, &compress_stream, block_size, 1);
+	if(res)
+		BAD_ERROR("compressor_init failed\n");
+
+	for(res = 0; res < images; res++)
+		if(compressor_uncompress_init(image[res].comp,
+				&uncompress_stream[res]) == -1)
+			MEM_ERROR();
+
+	while(1) {
+		struct job *job;
+		struct block *block;
+
+		pthread_mutex_lock(&job_mutex);
+		while(job_taken == job_queued)
+			pthread_cond_wait(&job_wait, &job_mutex);
+		job = &job_list[job_taken++ % job_ahead];
+		pthread_mutex_unlock(&job_mutex);
+
+		block = job->block;
+		struct image *im = &image[block->image];
+		int size = SQUASHFS_COMPRESSED_SIZE_BLOCK(block->size);
+
+		if(size > block_size || pread(im->fd, buffer, size,
+				block->start) != size)
+			BAD_ERROR("Failed to read block at %lld in %s\n",
+				block->start, im->name);
+
+		if(SQUASHFS_COMPRESSED_BLOCK(block->size)) {
+			size = compressor_uncompress(im->comp,
+				uncompress_stream[block->image], data, buffer,
+				size, block_size, &error);
+			if(size == -1)
+				BAD_ERROR("Failed to decompress block at %lld "
+					"in %s, error %d\n", block->start,
+					im->name, error);
+			raw = data;
+		} else
+			raw = buffer;
+
+		c_byte = compressor_compress(comp, compress_stream, job->data,
+			raw, size, block_size, &error);
+		if(c_byte == -1)
+			BAD_ERROR("Failed to compress block, "
+				"compressor_compress returned error %d\n",
+				error);
+
+		if(c_byte == 0 || c_byte >= size) {
+			memcpy(job->data, raw, size);
+			block->new_size = size | SQUASHFS_COMPRESSED_BIT_BLOCK;
+		} else
+			block->new_size = c_byte;
+
+		pthread_mutex_lock(&job_mutex);
+		job->done = TRUE;
+		pthread_cond_broadcast(&job_done);
+		pthread_mutex_unlock(&job_mutex);
+	}
+}
+
+
+/*
+ * Transcode the blocks, keeping TRANSCODE_AHEAD blocks queued for each
+ * transcoder thread, and write them in order as they complete
+ */
+static void transcode_blocks()
+{
+	int ahead = processors * TRANSCODE_AHEAD, n;
+	pthread_t thread;
+
+	job_list = malloc(ahead * sizeof(struct job));
+	if(job_list == NULL)
+		MEM_ERROR();
+
+	job_ahead = ahead;
+	for(n = 0; n < ahead; n++) {
+		job_list[n].data = malloc(image[0].info.block_size);
+		if(job_list[n].data == NULL)
+			MEM_ERROR();
+	}
+
+	for(n = 0; n < processors; n++)
+		if(pthread_create(&thread, NULL, transcoder, NULL))
+			BAD_ERROR("Failed to create transcoder thread\n");
+
+	for(n = 0; n < blocks; n++) {
+		struct job *slot = &job_list[n % ahead];
+
+		pthread_mutex_lock(&job_mutex);
+		for(; job_queued < blocks && job_queued < n + ahead;
+				job_queued++) {
+			struct job *next = &job_list[job_queued % ahead];
+
+			next->block = &block_list[job_queued];
+			next->done = FALSE;
+		}
+		pthread_cond_broadcast(&job_wait);
+
+		while(!slot->done)
+			pthread_cond_wait(&job_done, &job_mutex);
+		pthread_mutex_unlock(&job_mutex);
+
+		block_list[n].new_start = bytes;
+		write_bytes(bytes, SQUASHFS_COMPRESSED_SIZE_BLOCK(
+			block_list[n].new_size), slot->data);
+		bytes += SQUASHFS_COMPRESSED_SIZE_BLOCK(block_list[n].new_size);
+	}
+}
+
+
+/*
+ * Once the blocks are written, number the fragments in the order their
+ * blocks were written, and fill in the fragment table
+ */
+static void number_fragments()
+{
+	int n;
+
+	fragment_table = malloc(blocks *
+		sizeof(struct squashfs_fragment_entry));
+	if(blocks && fragment_table == NULL)
+		MEM_ERROR();
+
+	for(n = 0; n < blocks; n++) {
+		struct block *block = &block_list[n];
+
+		if(block->fragment == SQUASHFS_INVALID_FRAG)
+			continue;
+
+		fragment_table[fragments].start_block = block->new_start;
+		fragment_table[fragments].size = block->new_size;
+		fragment_table[fragments].unused = 0;
+		image[block->image].fragment[block->fragment] = fragments++;
+	}
+}
+
+
+static unsigned short get_id(unsigned int id)
+{
+	struct id *entry;
+
+	for(entry = id_hash[ID_HASH(id)]; entry; entry = entry->next)
+		if(entry->id == id)
+			return entry->index;
+
+	if(ids == SQUASHFS_IDS)
+		BAD_ERROR("Out of uids/gids, the merged filesystems have more "
+			"than %d\n", SQUASHFS_IDS);
+
+	entry = malloc(sizeof(struct id));
+	if(entry == NULL)
+		MEM_ERROR();
+
+	id_table = realloc(id_table, (ids + 1) * sizeof(unsigned int));
+	if(id_table == NULL)
+		MEM_ERROR();
+
+	id_table[ids] = id;
+	entry->id = id;
+	entry->index = ids++;
+	entry->next = id_hash[ID_HASH(id)];
+	id_hash[ID_HASH(id)] = entry;
+
+	return entry->index;
+}
+
+
+static struct merge_inode *new_inode(int img, struct sqfs_inode *i)
+{
+	struct merge_inode *inode = calloc(1, sizeof(struct merge_inode));
+
+	if(inode == NULL)
+		MEM_ERROR();
+
+	/* the root's parent is one more than the last inode number */
+	if(inode_count == UINT_MAX - 1)
+		BAD_ERROR("Too many inodes\n");
+
+	if(i->xattr != SQUASHFS_INVALID_XATTR) {
+		if(!no_xattrs)
+			BAD_ERROR("%s has extended attributes, which "
+				"Mergesquashfs can't copy.  Use -no-xattrs to "
+				"merge it without them\n", image[img].name);
+		xattrs_dropped = TRUE;
+	}
+
+	inode->i = *i;
+	inode->image = img;
+	inode->number = ++inode_count;
+	inode->ref = -1;
+	return inode;
+}
+
+
+/* The entries of a directory, collected by sqfs_readdir() */
+struct listing {
+	int			count;
+	int			size;
+	struct listing_entry {
+		char		*name;
+		long long	ref;
+	}			*entry;
+};
+
+
+static int listing_fn(void *arg, char *name, long long ref, mode_t type)
+{
+	struct listing *listing = arg;
+
+	if(listing->count == listing->size) {
+		listing->size += ENTRY_ALLOC;
+		listing->entry = realloc(listing->entry, listing->size *
+			sizeof(struct listing_entry));
+		if(listing->entry == NULL)
+			MEM_ERROR();
+	}
+
+	listing->entry[listing->count].name = strdup(name);
+	if(listing->entry[listing->count].name == NULL)
+		MEM_ERROR();
+	listing->entry[listing->count++].ref = ref;
+
+	return 0;
+}
+
+
+static int compare_entry(const void *a, const void *b)
+{
+	const struct merge_entry *entry_a = a, *entry_b = b;
+
+	return strcmp(entry_a->name, entry_b->name);
+}
+
+
+static void add_entry(struct merge_inode *dir, char *name,
+	struct merge_inode *inode)
+{
+	if(dir->count == dir->size) {
+		dir->size += ENTRY_ALLOC;
+		dir->entry = realloc(dir->entry, dir->size *
+			sizeof(struct merge_entry));
+		if(dir->entry == NULL)
+			MEM_ERROR();
+	}
+
+	dir->entry[dir->count].name = name;
+	dir->entry[dir->count++].inode = inode;
+	if(S_ISDIR(inode->i.mode))
+		dir->dirs ++;
+}
+
+
+/*
+ * Merge the directory i in image into dir.  Entries in both are merged if
+ * they're both directories (dir keeping its attributes), anything else
+ * in both is an error.  The entries of dir are sorted on entry, so the
+ * entries already there are found by binary search
+ */
+static void merge_dir(int img, struct merge_inode *dir, struct sqfs_inode *i,
+	char *pathname)
+{
+	struct image *im = &image[img];
+	struct listing listing = { 0, 0, NULL };
+	int n, res, merged = dir->count;
+
+	res = sqfs_readdir(im->fs, i, listing_fn, &listing);
+	if(res < 0)
+		BAD_ERROR("Failed to read directory %s in %s, because %s\n",
+			pathname, im->name, strerror(-res));
+
+	for(n = 0; n < listing.count; n++) {
+		struct merge_entry key = { listing.entry[n].name, NULL };
+		struct merge_entry *entry;
+		struct merge_inode *inode;
+		struct sqfs_inode child;
+		char *path;
+
+		res = sqfs_read_inode(im->fs, listing.entry[n].ref, &child);
+		if(res)
+			BAD_ERROR("Failed to read inode of %s/%s in %s, "
+				"because %s\n", pathname, key.name, im->name,
+				strerror(-res));
+
+		res = asprintf(&path, "%s/%s", pathname, key.name);
+		if(res == -1)
+			MEM_ERROR();
+
+		entry = merged ? bsearch(&key, dir->entry, merged,
+			sizeof(struct merge_entry), compare_entry) : NULL;
+		if(entry) {
+			if(!S_ISDIR(entry->inode->i.mode) ||
+					!S_ISDIR(child.mode))
+				BAD_ERROR("%s is in %s and %s, and isn't a "
+					"directory in both\n", path,
+					image[entry->inode->image].name,
+					im->name);
+
+			merge_dir(img, entry->inode, &child, path);
+			free(key.name);
+		} else if(S_ISDIR(child.mode)) {
+			inode = new_inode(img, &child);
+			merge_dir(img, inode, &child, path);
+			add_entry(dir, key.name, inode);
+		} else {
+			/* hard links within an image share the inode */
+			unsigned int number = child.inode_number;
+
+			if(child.nlink > 1 && number <= im->info.inodes &&
+					im->link[number])
+				inode = im->link[number];
+			else {
+				inode = new_inode(img, &child);
+				if(child.nlink > 1 && number <= im->info.inodes)
+					im->link[number] = inode;
+				if(S_ISREG(child.mode))
+					add_file(inode);
+			}
+
+			inode->nlink ++;
+			add_entry(dir, key.name, inode);
+		}
+
+		free(path);
+	}
+
+	if(dir->count)
+		qsort(dir->entry, dir->count, sizeof(struct merge_entry),
+			compare_entry);
+
+	free(listing.entry);
+}
+
+
+static void set_base(struct merge_inode *inode, int type,
+	struct squashfs_base_inode_header *base)
+{
+	inode->type = type;
+	base->inode_type = type;
+	base->mode = inode->i.mode & ~S_IFMT;
+	base->uid = get_id(inode->i.uid);
+	base->guid = get_id(inode->i.gid);
+	base->mtime = inode->i.mtime;
+	base->inode_number = inode->number;
+}
+
+
+static void write_file(struct merge_inode *inode)
+{
+	struct sqfs_inode *i = &inode->i;
+	struct image *im = &image[inode->image];
+	unsigned int block_size = im->info.block_size;
+	union squashfs_inode_header header;
+	long long start = i->start, new_start = -1, next = -1, sparse = 0;
+	unsigned int fragment = SQUASHFS_INVALID_FRAG;
+	int n, size;
+	char *buffer;
+
+	/*
+	 * The file's blocks were written in order, and so are still one
+	 * after another, unless the filesystem is corrupt
+	 */
+	for(n = 0; n < inode->blocks; n++) {
+		struct block *block;
+
+		if(inode->block_list[n] == 0) {
+			sparse += n == inode->blocks - 1 ? i->size -
+				(long long) n * block_size : block_size;
+			continue;
+		}
+
+		block = lookup_block(inode->image, start);
+		if(next != -1 && block->new_start != next)
+			BAD_ERROR("The blocks of a file in %s overlap other "
+				"blocks\n", im->name);
+		if(new_start == -1)
+			new_start = block->new_start;
+
+		start += SQUASHFS_COMPRESSED_SIZE_BLOCK(inode->block_list[n]);
+		next = block->new_start +
+			SQUASHFS_COMPRESSED_SIZE_BLOCK(block->new_size);
+		inode->block_list[n] = block->new_size;
+	}
+
+	if(new_start == -1)
+		new_start = 0;
+
+	if(i->fragment != SQUASHFS_INVALID_FRAG)
+		fragment = im->fragment[i->fragment];
+
+	size = sizeof(header.lreg) + inode->blocks * sizeof(unsigned int);
+	buffer = malloc(size);
+	if(buffer == NULL)
+		MEM_ERROR();
+
+	if(new_start >> 32 || i->size >> 32 || inode->nlink > 1 || sparse) {
+		struct squashfs_lreg_inode_header *reg = &header.lreg;
+
+		set_base(inode, SQUASHFS_LREG_TYPE, &header.base);
+		reg->start_block = new_start;
+		reg->file_size = i->size;
+		if(sparse && sparse >= i->size)
+			sparse = i->size - 1;
+		reg->sparse = sparse;
+		reg->nlink = inode->nlink;
+		reg->fragment = fragment;
+		reg->offset = i->frag_offset;
+		reg->xattr = SQUASHFS_INVALID_XATTR;
+
+		SQUASHFS_SWAP_LREG_INODE_HEADER(reg, buffer);
+		SQUASHFS_SWAP_INTS(inode->block_list, buffer + sizeof(*reg),
+			inode->blocks);
+		add_metadata(&inode_table, buffer, sizeof(*reg) +
+			inode->blocks * sizeof(unsigned int));
+	} else {
+		struct squashfs_reg_inode_header *reg = &header.reg;
+
+		set_base(inode, SQUASHFS_FILE_TYPE, &header.base);
+		reg->start_block = new_start;
+		reg->fragment = fragment;
+		reg->offset = i->frag_offset;
+		reg->file_size = i->size;
+
+		SQUASHFS_SWAP_REG_INODE_HEADER(reg, buffer);
+		SQUASHFS_SWAP_INTS(inode->block_list, buffer + sizeof(*reg),
+			inode->blocks);
+		add_metadata(&inode_table, buffer, sizeof(*reg) +
+			inode->blocks * sizeof(unsigned int));
+	}
+
+	free(buffer);
+	free(inode->block_list);
+}
+
+
+static void write_symlink(struct merge_inode *inode)
+{
+	struct squashfs_symlink_inode_header symlink;
+	struct image *im = &image[inode->image];
+	char buffer[sizeof(symlink)], *target = malloc(inode->i.size + 1);
+	int res;
+
+	if(target == NULL)
+		MEM_ERROR();
+
+	res = sqfs_readlink(im->fs, &inode->i, target, inode->i.size + 1);
+	if(res < 0)
+		BAD_ERROR("Failed to read symbolic link in %s, because %s\n",
+			im->name, strerror(-res));
+
+	set_base(inode, SQUASHFS_SYMLINK_TYPE,
+		(struct squashfs_base_inode_header *) &symlink);
+	symlink.nlink = inode->nlink;
+	symlink.symlink_size = inode->i.size;
+	SQUASHFS_SWAP_SYMLINK_INODE_HEADER(&symlink, buffer);
+	add_metadata(&inode_table, buffer, sizeof(symlink));
+	add_metadata(&inode_table, target, inode->i.size);
+
+	free(target);
+}
+
+
+static void write_inode(struct merge_inode *inode)
+{
+	mode_t mode = inode->i.mode & S_IFMT;
+
+	inode->ref = metadata_ref(&inode_table);
+	inode_lookup[inode->number - 1] = inode;
+
+	if(mode == S_IFREG)
+		write_file(inode);
+	else if(mode == S_IFLNK)
+		write_symlink(inode);
+	else if(mode == S_IFBLK || mode == S_IFCHR) {
+		struct squashfs_dev_inode_header dev;
+		char buffer[sizeof(dev)];
+
+		set_base(inode, mode == S_IFBLK ? SQUASHFS_BLKDEV_TYPE :
+			SQUASHFS_CHRDEV_TYPE,
+			(struct squashfs_base_inode_header *) &dev);
+		dev.nlink = inode->nlink;
+		dev.rdev = inode->i.rdev;
+		SQUASHFS_SWAP_DEV_INODE_HEADER(&dev, buffer);
+		add_metadata(&inode_table, buffer, sizeof(dev));
+	} else {
+		struct squashfs_ipc_inode_header ipc;
+		char buffer[sizeof(ipc)];
+
+		set_base(inode, mode == S_IFIFO ? SQUASHFS_FIFO_TYPE :
+			SQUASHFS_SOCKET_TYPE,
+			(struct squashfs_base_inode_header *) &ipc);
+		ipc.nlink = inode->nlink;
+		SQUASHFS_SWAP_IPC_INODE_HEADER(&ipc, buffer);
+		add_metadata(&inode_table, buffer, sizeof(ipc));
+	}
+}
+
+
+/* an entry in a large directory's index, see struct squashfs_dir_index */
+struct dir_index {
+	struct squashfs_dir_index	index;
+	char				*name;
+};
+
+
+/*
+ * Write the directory's entries, and then the directory's inode.  The
+ * entries under one header have their inodes in the same inode table
+ * block, and inode numbers within 16 bits of the header's.  Large
+ * directories are indexed about every metadata block, so lookups can
+ * skip to the block holding the name
+ */
+static void write_dir(struct merge_inode *dir, unsigned int parent)
+{
+	struct squashfs_dir_header dir_header;
+	struct squashfs_dir_entry dir_entry;
+	struct dir_index *index = NULL;
+	long long start, total, indexed;
+	unsigned int size;
+	int n, last, i_count = 0;
+	char buffer[sizeof(struct squashfs_ldir_inode_header)];
+
+	for(n = 0; n < dir->count; n++) {
+		struct merge_inode *inode = dir->entry[n].inode;
+
+		if(S_ISDIR(inode->i.mode))
+			write_dir(inode, dir->number);
+		else if(inode->ref == -1)
+			write_inode(inode);
+	}
+
+	start = metadata_ref(&directory_table);
+	total = indexed = directory_table.total;
+
+	for(n = 0; n < dir->count; n = last) {
+		struct merge_inode *first = dir->entry[n].inode;
+		unsigned int block = SQUASHFS_INODE_BLK(first->ref);
+
+		if(n && i_count < I_COUNT_MAX && directory_table.total -
+				indexed > SQUASHFS_METADATA_SIZE) {
+			index = realloc(index, (i_count + 1) *
+				sizeof(struct dir_index));
+			if(index == NULL)
+				MEM_ERROR();
+
+			index[i_count].index.index = directory_table.total -
+				total;
+			index[i_count].index.start_block =
+				directory_table.bytes;
+			index[i_count].index.size =
+				strlen(dir->entry[n].name) - 1;
+			index[i_count++].name = dir->entry[n].name;
+			indexed = directory_table.total;
+		}
+
+		for(last = n + 1; last < dir->count && last - n < 256;
+				last++) {
+			struct merge_inode *inode = dir->entry[last].inode;
+			long long delta = (long long) inode->number -
+				first->number;
+
+			if(SQUASHFS_INODE_BLK(inode->ref) != block ||
+					delta > 32767 || delta < -32768)
+				break;
+		}
+
+		dir_header.count = last - n - 1;
+		dir_header.start_block = block;
+		dir_header.inode_number = first->number;
+		SQUASHFS_SWAP_DIR_HEADER(&dir_header, buffer);
+		add_metadata(&directory_table, buffer, sizeof(dir_header));
+
+		for(; n < last; n++) {
+			struct merge_inode *inode = dir->entry[n].inode;
+			int length = strlen(dir->entry[n].name);
+
+			dir_entry.offset = SQUASHFS_INODE_OFFSET(inode->ref);
+			dir_entry.inode_number = (long long) inode->number -
+				first->number;
+			dir_entry.type = inode->type > SQUASHFS_SOCKET_TYPE ?
+				inode->type - 7 : inode->type;
+			dir_entry.size = length - 1;
+			SQUASHFS_SWAP_DIR_ENTRY(&dir_entry, buffer);
+			add_metadata(&directory_table, buffer,
+				sizeof(dir_entry));
+			add_metadata(&directory_table, dir->entry[n].name,
+				length);
+		}
+	}
+
+	size = directory_table.total - total + 3;
+	dir->ref = metadata_ref(&inode_table);
+	inode_lookup[dir->number - 1] = dir;
+
+	if(size >= 1 << 27)
+		BAD_ERROR("Directory greater than 2^27-1 bytes!\n");
+
+	if(i_count || size >= 1 << 16) {
+		struct squashfs_ldir_inode_header ldir;
+
+		set_base(dir, SQUASHFS_LDIR_TYPE,
+			(struct squashfs_base_inode_header *) &ldir);
+		ldir.nlink = dir->dirs + 2;
+		ldir.file_size = size;
+		ldir.start_block = SQUASHFS_INODE_BLK(start);
+		ldir.parent_inode = parent;
+		ldir.i_count = i_count;
+		ldir.offset = SQUASHFS_INODE_OFFSET(start);
+		ldir.xattr = SQUASHFS_INVALID_XATTR;
+		SQUASHFS_SWAP_LDIR_INODE_HEADER(&ldir, buffer);
+		add_metadata(&inode_table, buffer, sizeof(ldir));
+
+		for(n = 0; n < i_count; n++) {
+			SQUASHFS_SWAP_DIR_INDEX(&index[n].index, buffer);
+			add_metadata(&inode_table, buffer,
+				sizeof(struct squashfs_dir_index));
+			add_metadata(&inode_table, index[n].name,
+				index[n].index.size + 1);
+		}
+	} else {
+		struct squashfs_dir_inode_header inode;
+
+		set_base(dir, SQUASHFS_DIR_TYPE,
+			(struct squashfs_base_inode_header *) &inode);
+		inode.start_block = SQUASHFS_INODE_BLK(start);
+		inode.nlink = dir->dirs + 2;
+		inode.file_size = size;
+		inode.offset = SQUASHFS_INODE_OFFSET(start);
+		inode.parent_inode = parent;
+		SQUASHFS_SWAP_DIR_INODE_HEADER(&inode, buffer);
+		add_metadata(&inode_table, buffer, sizeof(inode));
+	}
+
+	free(index);
+}
+
+
+static void open_image(struct image *im, char *name)
+{
+	int res;
+
+	im->name = name;
+	im->fs = sqfs_open(name, &res);
+	if(im->fs == NULL)
+		BAD_ERROR("Failed to open %s, because %s\n", name,
+			strerror(-res));
+
+	sqfs_get_info(im->fs, &im->info);
+	im->fd = sqfs_fd(im->fs);
+	im->comp = lookup_compressor_id(im->info.compression);
+
+	im->fragment = malloc(im->info.fragments * sizeof(unsigned int));
+	im->link = calloc(im->info.inodes + 1, sizeof(struct merge_inode *));
+	if((im->info.fragments && im->fragment == NULL) || im->link == NULL)
+		MEM_ERROR();
+	if(im->info.fragments)
+		memset(im->fragment, 0xff, im->info.fragments *
+			sizeof(unsigned int));
+}
+
+
+/*
+ * All the filesystems must be compressed the same way, otherwise their
+ * blocks can't be copied into one filesystem.  Transcoded filesystems
+ * only need the same block size, block lists and fragment offsets depend
+ * on it
+ */
+static void check_images(void *options, int *options_size)
+{
+	char buffer[SQUASHFS_METADATA_SIZE];
+	int n, size;
+
+	*options_size = sqfs_compression_options(image[0].fs, options);
+	if(*options_size < 0)
+		BAD_ERROR("Failed to read compression options in %s, because "
+			"%s\n", image[0].name, strerror(-*options_size));
+
+	for(n = 1; n < images; n++) {
+		if(image[n].info.block_size != image[0].info.block_size)
+			BAD_ERROR("%s and %s have different block sizes\n",
+				image[0].name, image[n].name);
+
+		if(transcode)
+			continue;
+
+		if(image[n].info.compression != image[0].info.compression)
+			BAD_ERROR("%s and %s are compressed with different "
+				"compressors\n", image[0].name, image[n].name);
+
+		size = sqfs_compression_options(image[n].fs, buffer);
+		if(size < 0)
+			BAD_ERROR("Failed to read compression options in %s, "
+				"because %s\n", image[n].name, strerror(-size));
+
+		if(size != *options_size || memcmp(buffer, options, size))
+			BAD_ERROR("%s and %s are compressed with different "
+				"compression options\n", image[0].name,
+				image[n].name);
+	}
+}
+
+
+static void check_destination(char *name)
+{
+	struct stat dest, buf;
+	int n;
+
+	if(stat(name, &dest) == -1)
+		return;
+
+	for(n = 0; n < images; n++)
+		if(fstat(image[n].fd, &buf) == 0 && buf.st_dev ==
+				dest.st_dev && buf.st_ino == dest.st_ino)
+			BAD_ERROR("Destination %s is one of the filesystems "
+				"being merged\n", name);
+}
+
+
+#define VERSION() \
+	printf("mergesquashfs version 4.3 (2014/05/12)\n");\
+	printf("copyright (C) 2014 Phillip Lougher "\
+		"<phillip@squashfs.org.uk>\n\n");\
+    	printf("This program is free software; you can redistribute it and/or"\
+		"\n");\
+	printf("modify it under the terms of the GNU General Public License"\
+		"\n");\
+	printf("as published by the Free Software Foundation; either version "\
+		"2,\n");\
+	printf("or (at your option) any later version.\n\n");\
+	printf("This program is distributed in the hope that it will be "\
+		"useful,\n");\
+	printf("but WITHOUT ANY WARRANTY; without even the implied warranty of"\
+		"\n");\
+	printf("MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the"\
+		"\n");\
+	printf("GNU General Public License for more details.\n");
+int main(int argc, char *argv[])
+{
+	struct squashfs_super_block sBlk;
+	struct merge_inode *root;
+	struct sqfs_inode i;
+	char options[SQUASHFS_METADATA_SIZE];
+	void *comp_data;
+	long long *export_table = NULL;
+	int n, res, options_size, comp_opts, flags = ~0, mkfs_time = 0;
+
+	processors = sysconf(_SC_NPROCESSORS_ONLN);
+	if(processors < 1)
+		processors = 1;
+
+	for(n = 1; n < argc; n++) {
+		if(*argv[n] != '-')
+			break;
+		if(strcmp(argv[n], "-version") == 0 ||
+				strcmp(argv[n], "-v") == 0) {
+			VERSION();
+			exit(0);
+		} else if(strcmp(argv[n], "-comp") == 0) {
+			if(++n == argc) {
+				fprintf(stderr, "%s: -comp missing compression "
+					"type\n", argv[0]);
+				exit(1);
+			}
+			comp = lookup_compressor(argv[n]);
+			if(!comp->supported) {
+				fprintf(stderr, "%s: Compressor \"%s\" is not "
+					"supported!\n", argv[0], argv[n]);
+				fprintf(stderr, "%s: Compressors available:\n",
+					argv[0]);
+				display_compressors("", COMP_DEFAULT);
+				exit(1);
+			}
+			transcode = TRUE;
+		} else if(strncmp(argv[n], "-X", 2) == 0) {
+			int args;
+
+			if(comp == NULL) {
+				fprintf(stderr, "%s: compressor options must "
+					"follow -comp\n", argv[0]);
+				exit(1);
+			}
+
+			args = compressor_options(comp, argv + n, argc - n);
+			if(args < 0) {
+				if(args == -1) {
+					fprintf(stderr, "%s: Unrecognised "
+						"compressor option %s\n",
+						argv[0], argv[n]);
+					fprintf(stderr, "%s: selected "
+						"compressor \"%s\".  Options "
+						"supported: %s\n", argv[0],
+						comp->name, comp->usage ? "" :
+						"none");
+					if(comp->usage)
+						comp->usage();
+				}
+				exit(1);
+			}
+			n += args;
+		} else if(strcmp(argv[n], "-processors") == 0 ||
+				strcmp(argv[n], "-p") == 0) {
+			char *b;
+
+			if(++n == argc || (processors = strtol(argv[n], &b,
+					10), *b != '\0') || processors < 1) {
+				fprintf(stderr, "%s: -processors missing or "
+					"invalid processor number\n", argv[0]);
+				exit(1);
+			}
+		} else if(strcmp(argv[n], "-noI") == 0 ||
+				strcmp(argv[n], "-noInodeCompression") == 0)
+			noI = TRUE;
+		else if(strcmp(argv[n], "-no-exports") == 0)
+			no_exports = TRUE;
+		else if(strcmp(argv[n], "-no-xattrs") == 0)
+			no_xattrs = TRUE;
+		else
+			goto options;
+	}
+
+	if(n + 2 > argc)
+		goto options;
+
+	images = argc - n - 1;
+	destination = argv[argc - 1];
+	image = calloc(images, sizeof(struct image));
+	if(image == NULL)
+		MEM_ERROR();
+
+	for(images = 0; n < argc - 1; n++)
+		open_image(&image[images++], argv[n]);
+
+	check_images(options, &options_size);
+	check_destination(destination);
+
+	if(transcode) {
+		/*
+		 * The filesystems' options were given to their compressors by
+		 * sqfs_open(), and are replaced by the new options here, so
+		 * transcoding to the same compressor with other options only
+		 * works for compressors which decompress without their options
+		 * (not -Xdict)
+		 */
+		if(compressor_options_post(comp, image[0].info.block_size))
+			exit(1);
+
+		comp_data = compressor_dump_options(comp,
+			image[0].info.block_size, &options_size);
+		if(comp_data)
+			memcpy(options, comp_data, options_size);
+		else
+			options_size = 0;
+	} else {
+		comp = image[0].comp;
+		if(compressor_extract_options(comp, image[0].info.block_size,
+				options, options_size) == -1 ||
+				!comp->supported)
+			BAD_ERROR("Compressor \"%s\" is not supported\n",
+				comp->name);
+	}
+
+	res = compressor_init(comp, &stream, SQUASHFS_METADATA_SIZE, 0);
+	if(res)
+		BAD_ERROR("compressor_init failed\n");
+
+	/* the root directory, and its attributes, come from image one */
+	res = sqfs_root(image[0].fs, &i);
+	if(res)
+		BAD_ERROR("Failed to read root inode of %s, because %s\n",
+			image[0].name, strerror(-res));
+
+	root = new_inode(0, &i);
+	for(n = 0; n < images; n++) {
+		if(n) {
+			res = sqfs_root(image[n].fs, &i);
+			if(res)
+				BAD_ERROR("Failed to read root inode of %s, "
+					"because %s\n", image[n].name,
+					strerror(-res));
+		}
+
+		merge_dir(n, root, &i, "");
+
+		free(image[n].link);
+		flags &= image[n].info.flags;
+		if(image[n].info.mkfs_time > mkfs_time)
+			mkfs_time = image[n].info.mkfs_time;
+	}
+
+	inode_lookup = malloc(inode_count * sizeof(struct merge_inode *));
+	if(inode_lookup == NULL)
+		MEM_ERROR();
+
+	fd = open(destination, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR |
+		S_IWUSR | S_IRGRP | S_IROTH);
+	if(fd == -1) {
+		fprintf(stderr, "FATAL ERROR: Failed to create %s, because "
+			"%s\n", destination, strerror(errno));
+		exit(1);
+	}
+
+	/* store the compression options after the superblock, as Mksquashfs */
+	bytes = sizeof(sBlk);
+	comp_opts = options_size != 0;
+	if(comp_opts) {
+		unsigned short c_byte = options_size | SQUASHFS_COMPRESSED_BIT;
+
+		SQUASHFS_INSWAP_SHORTS(&c_byte, 1);
+		write_bytes(bytes, sizeof(c_byte), &c_byte);
+		write_bytes(bytes + sizeof(c_byte), options_size, options);
+		bytes += sizeof(c_byte) + options_size;
+	}
+
+	sort_blocks();
+	if(transcode)
+		transcode_blocks();
+	else
+		copy_blocks();
+	number_fragments();
+
+	write_dir(root, inode_count + 1);
+
+	if(inode_table.used)
+		flush_metadata(&inode_table);
+	if(directory_table.used)
+		flush_metadata(&directory_table);
+
+	sBlk.inode_table_start = bytes;
+	write_bytes(bytes, inode_table.bytes, inode_table.table);
+	bytes += inode_table.bytes;
+
+	sBlk.directory_table_start = bytes;
+	write_bytes(bytes, directory_table.bytes, directory_table.table);
+	bytes += directory_table.bytes;
+
+	for(n = 0; n < fragments; n++)
+		SQUASHFS_INSWAP_FRAGMENT_ENTRY(&fragment_table[n]);
+	sBlk.fragment_table_start = write_table(fragment_table, fragments *
+		sizeof(struct squashfs_fragment_entry));
+
+	if(!no_exports) {
+		export_table = malloc(inode_count * sizeof(long long));
+		if(export_table == NULL)
+			MEM_ERROR();
+
+		for(n = 0; n < inode_count; n++)
+			export_table[n] = inode_lookup[n]->ref;
+
+		SQUASHFS_INSWAP_LONG_LONGS(export_table, inode_count);
+		sBlk.lookup_table_start = write_table(export_table,
+			inode_count * sizeof(long long));
+	} else
+		sBlk.lookup_table_start = SQUASHFS_INVALID_BLK;
+
+	sBlk.no_ids = ids;
+	SQUASHFS_INSWAP_INTS(id_table, ids);
+	sBlk.id_table_start = write_table(id_table, ids *
+		sizeof(unsigned int));
+	sBlk.xattr_id_table_start = SQUASHFS_INVALID_BLK;
+
+	/* transcoded blocks are compressed, whatever they were before */
+	if(transcode)
+		flags &= ~(SQUASHFS_MKFLAGS(0, 1, 1, 0, 0, 0, 0, 0, 0, 0));
+
+	sBlk.s_magic = SQUASHFS_MAGIC;
+	sBlk.s_major = SQUASHFS_MAJOR;
+	sBlk.s_minor = SQUASHFS_MINOR;
+	sBlk.inodes = inode_count;
+	sBlk.mkfs_time = mkfs_time;
+	sBlk.block_size = image[0].info.block_size;
+	sBlk.block_log = ffs(sBlk.block_size) - 1;
+	sBlk.fragments = fragments;
+	sBlk.compression = comp->id;
+	sBlk.root_inode = root->ref;
+	sBlk.bytes_used = bytes;
+	sBlk.flags = SQUASHFS_MKFLAGS(noI, SQUASHFS_UNCOMPRESSED_DATA(flags),
+		SQUASHFS_UNCOMPRESSED_FRAGMENTS(flags),
+		SQUASHFS_UNCOMPRESSED_XATTRS(flags),
+		SQUASHFS_NO_FRAGMENTS(flags), SQUASHFS_ALWAYS_FRAGMENTS(flags),
+		SQUASHFS_DUPLICATES(flags), !no_exports, TRUE, comp_opts);
+
+	SQUASHFS_INSWAP_SUPER_BLOCK(&sBlk);
+	write_bytes(0, sizeof(sBlk), &sBlk);
+
+	/* pad to 4K, as Mksquashfs, so the filesystem can be loop mounted */
+	if(bytes & (4096 - 1)) {
+		char pad[4096];
+
+		memset(pad, 0, sizeof(pad));
+		write_bytes(bytes, 4096 - (bytes & (4096 - 1)), pad);
+	}
+
+	if(close(fd) == -1) {
+		fprintf(stderr, "FATAL ERROR: Failed to close %s, because "
+			"%s\n", destination, strerror(errno));
+		unlink(destination);
+		exit(1);
+	}
+	fd = -1;
+
+	if(xattrs_dropped)
+		fprintf(stderr, "Warning: extended attributes were not "
+			"merged (-no-xattrs)\n");
+
+	printf("%s %d filesystem%s into %s, %u inodes, %u fragments, "
+		"%lld bytes\n", transcode ? "Transcoded" : "Merged", images,
+		images == 1 ? "" : "s", destination, inode_count, fragments,
+		bytes);
+
+	for(n = 0; n < images; n++)
+		sqfs_close(image[n].fs);
+
+	return 0;
+
+options:
+	fprintf(stderr, "SYNTAX: %s [options] filesystem1 [filesystem2 ...] "
+		"dest\n", argv[0]);
+	fprintf(stderr, "\t-v[ersion]\t\tprint version, licence and "
+		"copyright information\n");
+	fprintf(stderr, "\t-comp <comp>\t\ttranscode the data to <comp> "
+		"compression, which\n\t\t\t\tcan be followed by its -X "
+		"options.  Compressors\n\t\t\t\tavailable:\n");
+	display_compressors("\t\t\t\t", "");
+	fprintf(stderr, "\t-p[rocessors] <number>\tuse <number> transcoder "
+		"threads.  By default as\n\t\t\t\tmany as there are "
+		"processors\n");
+	fprintf(stderr, "\t-noI\t\t\tdo not compress inode and directory "
+		"tables\n");
+	fprintf(stderr, "\t-no-exports\t\tdon't make the filesystem "
+		"exportable via NFS\n");
+	fprintf(stderr, "\t-no-xattrs\t\tmerge filesystems with extended "
+		"attributes,\n\t\t\t\tdropping the extended attributes\n");
+	fprintf(stderr, "\nUnless transcoded the filesystems must be "
+		"compressed with the same\ncompressor, block size and "
+		"compression options.  Directories in more\nthan one "
+		"filesystem are merged, the root directory and directories "
+		"keeping\nthe attributes of the first filesystem they're "
+		"in\n");
+	exit(1);
+}
@@ -44,12 +44,15 @@
 #include <setjmp.h>
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <pthread.h>
 #include <regex.h>
 #include <fnmatch.h>
 #include <sys/wait.h>
 #include <limits.h>
 #include <ctype.h>
+#include <ftw.h>
+#include <math.h>
 
 #ifndef linux
 #define __BYTE_ORDER BYTE_ORDER
@@ -76,6 +79,18 @@
 #include "read_fs.h"
 #include "restore.h"
 #include "process_fragments.h"
+#include "process_duplicates.h"
+#include "hash.h"
+#include "arena.h"
+#include "spill.h"
+#include "deadline.h"
+#include "probe.h"
+#include "dedup_index.h"
+#include "numa.h"
+#include "stats.h"
+#include "archive.h"
+#include "verity.h"
+#include "remote.h"
 
 /* ANDROID CHANGES START*/
 #ifdef ANDROID
@@ -99,6 +114,14 @@ int noF = FALSE;
 int no_fragments = FALSE;
 int always_use_fragments = FALSE;
 int noI = FALSE;
+
+/*
+ * -dir-index, the amount of directory data between directory index
+ * entries.  A denser index means lookups in large directories have fewer
+ * entries to scan, at the cost of a directory header and an index entry
+ * each time
+ */
+int dir_index_size = SQUASHFS_METADATA_SIZE;
 int noD = FALSE;
 int silent = TRUE;
 int exportable = TRUE;
@@ -107,6 +130,8 @@ int old_exclude = TRUE;
 int use_regex = FALSE;
 int nopad = FALSE;
 int exit_on_error = FALSE;
+int adaptive = FALSE;
+int pack_fragments = FALSE;
 
 long long global_uid = -1, global_gid = -1;
 
@@ -123,27 +148,91 @@ long long bytes = 0, total_bytes = 0;
 char *directory_table = NULL;
 unsigned int directory_bytes = 0, directory_size = 0, total_directory_bytes = 0;
 
-/* cached directory table */
+/*
+ * cached directory table, the uncompressed block currently being filled
+ * starts at directory_cache_start
+ */
 char *directory_data_cache = NULL;
 unsigned int directory_cache_bytes = 0, directory_cache_size = 0;
+unsigned int directory_cache_start = 0;
 
 /* in memory inode table - possibly compressed */
 char *inode_table = NULL;
 unsigned int inode_bytes = 0, inode_size = 0, total_inode_bytes = 0;
 
-/* cached inode table */
+/*
+ * cached inode table, the uncompressed block currently being filled starts
+ * at cache_start
+ */
 char *data_cache = NULL;
 unsigned int cache_bytes = 0, cache_size = 0, inode_count = 0;
+unsigned int cache_start = 0;
+
+/*
+ * Inode table blocks are compressed by the metadata threads as the inode
+ * cache fills, while the tree is still being written.  Where a block goes
+ * in the inode table isn't known until the blocks before it have been
+ * compressed, and so until then inodes are referred to by the number
+ * of their uncompressed block, marked INODE_PENDING.  resolve_inode()
+ * turns these into inode table references.  Directory headers are
+ * resolved when their directory block is compressed, which gives the
+ * inode blocks they refer to time to be compressed, see pending_resolve().
+ * squashfs_inode is signed, so the flags are tested on the unsigned value
+ */
+#define INODE_PENDING	(1ULL << 63)
+#define BLOCK_PENDING	(1ULL << 47)
+#define PENDING(A, FLAG) (((unsigned long long) (A)) & (FLAG))
+
+struct meta_block *inode_slot = NULL;
+int inode_ahead;
+
+/*
+ * inode blocks numbered so far, and written to the inode table, and the
+ * start in the inode table of each written block
+ */
+unsigned int inode_queued = 0, inode_written = 0;
+unsigned int *inode_block_start = NULL, inode_block_size = 0;
+
+/*
+ * A directory header whose start_block is pending.  offset is the header's
+ * offset in struct directory, and once it is in the directory cache, its
+ * offset in the uncompressed directory table of this run
+ */
+struct dir_pending {
+	long long		offset;
+	squashfs_inode		block;
+};
+
+struct dir_pending *pending_headers = NULL;
+unsigned int pending_count = 0, pending_size = 0;
+
+/* uncompressed directory bytes compressed from the directory cache */
+long long directory_cache_out = 0;
+
+/*
+ * the inode and directory caches are compacted rather than grown while
+ * they're smaller than this
+ */
+#define METADATA_CACHE_SIZE	(SQUASHFS_METADATA_SIZE << 3)
 
 /* inode lookup table */
 squashfs_inode *inode_lookup_table = NULL;
 
+/*
+ * inode references of the spilled inodes (-spill), indexed by inode number,
+ * which are added to the lookup table when it is written
+ */
+squashfs_inode *spill_lookup = NULL;
+int spill_lookup_count = 0;
+
 /* in memory directory data */
 #define I_COUNT_SIZE		128
+#define I_COUNT_MAX		65535
 #define DIR_ENTRIES		32
-#define INODE_HASH_SIZE		65536
-#define INODE_HASH_MASK		(INODE_HASH_SIZE - 1)
-#define INODE_HASH(dev, ino)	(ino & INODE_HASH_MASK)
+#define INODE_HASH_MIN		4096
+#define INODE_HASH(dev, ino)	((((unsigned long long) (ino) * \
+	0x9e3779b97f4a7c15ULL) ^ (unsigned long long) (dev)) * \
+	0x9e3779b97f4a7c15ULL)
 
 struct cached_dir_index {
 	struct squashfs_dir_index	index;
@@ -151,7 +240,7 @@ struct cached_dir_index {
 };
 
 struct directory {
-	unsigned int		start_block;
+	squashfs_inode		start_block;
 	unsigned int		size;
 	unsigned char		*buff;
 	unsigned char		*p;
@@ -162,14 +251,113 @@ struct directory {
 	struct cached_dir_index	*index;
 	unsigned char		*index_count_p;
 	unsigned int		inode_number;
+	struct dir_pending	*pending;
+	unsigned int		pending_count;
+};
+
+/*
+ * inode hash table used to detect hard-links, and to find every inode when
+ * writing the export table.  This is an open addressing (linear probing)
+ * table keyed on (dev, ino), which is grown by doubling to keep it at most
+ * three quarters full.  The inode number is kept in the slot so probing
+ * doesn't have to touch the inodes themselves
+ */
+struct inode_slot {
+	ino_t			ino;
+	struct inode_info	*inode;
+};
+
+struct inode_slot *inode_hash = NULL;
+unsigned int inode_hash_size = 0, inode_hash_count = 0;
+
+/*
+ * arena holding the in-core directory tree (inodes, directory entries
+ * and directories) built by the directory scan, freed in one go at the end
+ */
+struct arena *scan_arena;
+struct slab dir_ent_slab, dir_info_slab;
+
+/* directory read-ahead by the scanner threads, see scan_stat() */
+#define SCAN_AHEAD		1024
+#define SCAN_ENTRIES		64
+
+struct scan_ahead;
+
+/*
+ * struct describing one entry of a directory which has been read.
+ * Subdirectories remember their read-ahead, dir_info and exclude paths
+ * until they are scanned.  The xattrs read with the entry (xattrs is -1 if
+ * they weren't) are handed to its inode, see prefetch_xattrs()
+ */
+struct scan_entry {
+	char			*name;
+	char			*symlink;
+	struct scan_ahead	*ahead;
+	struct dir_info		*sub_dir;
+	struct pathnames	*paths;
+	struct xattr_list	*xattr_list;
+	int			xattrs;
+	int			error;
+	int			link_bytes;
+	struct stat		buf;
+};
+
+/* struct describing a directory read, or to be read, by scan_read() */
+struct scan_ahead {
+	char			*pathname;
+	struct scan_entry	*entry;
+	int			count;
+	int			error;
+	int			done;
+};
+
+struct queue *to_scan = NULL;
+pthread_t *scan_thread;
+pthread_mutex_t	scan_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t scan_done = PTHREAD_COND_INITIALIZER;
+pthread_cond_t scan_ready = PTHREAD_COND_INITIALIZER;
+int scan_ahead_count = 0;
+
+/*
+ * streaming, the reader thread starts reading files as soon as their
+ * directory has been scanned, see dir_scan()
+ */
+int streaming = FALSE;
+
+/*
+ * metadata tables written by generic_write_table() are compressed by the
+ * metadata threads, META_AHEAD blocks per thread are kept in flight
+ */
+#define META_AHEAD		2
+
+/* struct describing one metadata block being compressed */
+struct meta_block {
+	char			*data;
+	int			size;
+	int			uncompressed;
+	int			done;
+	unsigned short		c_byte;
+	char			cbuffer[(SQUASHFS_METADATA_SIZE << 2) + 2];
 };
 
-struct inode_info *inode_info[INODE_HASH_SIZE];
+struct queue *to_meta = NULL;
+pthread_t *meta_thread;
+pthread_mutex_t	meta_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t meta_done = PTHREAD_COND_INITIALIZER;
 
-/* hash tables used to do fast duplicate searches in duplicate check */
-struct file_info *dupl[65536];
+/*
+ * hash tables used to do fast duplicate searches in duplicate check,
+ * indexed by file size and by content hash.  Files from the filesystem
+ * being appended to have no content hash, and are only indexed by size
+ */
+struct file_info *dupl[65536], *dupl_hash[65536];
 int dup_files = 0;
 
+/* -block-duplicates */
+int block_duplicates = FALSE;
+int block_dup_files = 0;
+int unhashed_files = 0;
+
 /* exclude file handling */
 /* list of exclude dirs/files */
 struct exclude_info {
@@ -186,11 +374,22 @@ struct path_entry {
 	char *name;
 	regex_t *preg;
 	struct pathname *paths;
+	int next;
 };
 
+/*
+ * Once all the excludes have been added, compile_path() indexes the names
+ * at each level: names without wildcard characters go into a hash table
+ * (literal), and only the remaining names (glob) are matched by fnmatch
+ * or regexec
+ */
 struct pathname {
 	int names;
 	struct path_entry *name;
+	int *literal;
+	int literal_mask;
+	int *glob;
+	int globs;
 };
 
 struct pathnames {
@@ -208,6 +407,9 @@ int fragments = 0;
 
 #define FRAG_SIZE 32768
 
+/* maximum number of contiguous buffers the writer thread writes at once */
+#define WRITER_BATCH 64
+
 struct squashfs_fragment_entry *fragment_table = NULL;
 int fragments_outstanding = 0;
 
@@ -250,6 +452,12 @@ int block_device = FALSE;
 /* flag indicating whether files are sorted using sort list(s) */
 int sorted = FALSE;
 
+/* directory the filesystem was mounted on when the -sort-trace was taken */
+char *sort_trace_root = NULL;
+
+/* directory to hold the spill file, NULL if not spilling */
+char *spill_directory = NULL;
+
 /* save destination file name for deleting on error */
 char *destination_file = NULL;
 
@@ -257,26 +465,47 @@ char *destination_file = NULL;
 char *recovery_file = NULL;
 int recover = TRUE;
 
+/* duplicate index file, read when appending and written at the end */
+char *dedup_index = NULL;
+
 struct id *id_hash_table[ID_ENTRIES];
 struct id *id_table[SQUASHFS_IDS], *sid_table[SQUASHFS_IDS];
 unsigned int uid_count = 0, guid_count = 0;
 unsigned int sid_count = 0, suid_count = 0, sguid_count = 0;
 
 struct cache *reader_buffer, *fragment_buffer, *reserve_cache;
+struct cache_governor *mem_governor;
+struct buffer_pool *block_pool;
 struct cache *bwriter_buffer, *fwriter_buffer;
-struct queue *to_reader, *to_deflate, *to_writer, *from_writer,
-	*to_frag, *locked_fragment, *to_process_frag;
-struct seq_queue *to_main;
-pthread_t reader_thread, writer_thread, main_thread;
-pthread_t *deflator_thread, *frag_deflator_thread, *frag_thread;
+struct queue *to_reader, *to_writer, *from_writer, *to_frag,
+	*locked_fragment, *to_read, *to_dup;
+struct queue **to_deflate, **to_process_frag;
+
+/* the -worker addresses, and connections to them */
+char **remote_worker_list = NULL;
+int remote_workers = 0, remote_conns = 0;
+struct remote **remote_conn;
+pthread_t *remote_thread;
+struct seq_queue *to_main, *from_dup;
+pthread_t reader_thread, writer_thread, main_thread, dup_collect_thread;
+pthread_t *deflator_thread, *frag_deflator_thread, *frag_thread, *dup_thread;
+pthread_t *reader_pool_thread;
 pthread_t *restore_thread = NULL;
 pthread_mutex_t	fragment_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t	pos_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t	dup_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t	frag_lookup_mutex[FRAG_LOOKUP_LOCKS];
 
 /* user options that control parallelisation */
 int processors = -1;
+int readers = 1;
+int numa = FALSE;
+int scanners = -1;
+int mmap_input = FALSE;
+int reader_readahead;
 int bwriter_size;
+int dup_max_blocks;
+int dup_hold;
 
 /* compression operations */
 struct compressor *comp = NULL;
@@ -293,28 +522,46 @@ struct append_file **file_mapping;
 /* root of the in-core directory structure */
 struct dir_info *root_dir;
 
+/* -tar and -cpio, the archive the filesystem is built from */
+int archive_format = 0;
+struct archive *archive = NULL;
+struct queue *to_archive;
+struct archive_inode *archive_inodes = NULL;
+int archive_inode_count = 0;
+struct archive_inode *archive_defer = NULL;
+unsigned int archive_ino = 0;
+
 static char *read_from_disk(long long start, unsigned int avail_bytes);
 void add_old_root_entry(char *name, squashfs_inode inode, int inode_number,
 	int type);
 struct file_info *duplicate(long long file_size, long long bytes,
-	unsigned int **block_list, long long *start, struct fragment **fragment,
-	struct file_buffer *file_buffer, int blocks, unsigned short checksum,
-	int checksum_flag);
+	unsigned int *block_list, long long start,
+	struct file_buffer *file_buffer, int blocks, unsigned long long hash);
 struct dir_info *dir_scan1(char *, char *, struct pathnames *,
 	struct dir_ent *(_readdir)(struct dir_info *), int);
+void scan_threads_init();
+void scan_threads_fini();
 void dir_scan2(struct dir_info *dir, struct pseudo *pseudo);
+static unsigned int name_hash(char *name);
 void dir_scan3(struct dir_info *dir);
 void dir_scan4(struct dir_info *dir);
 void dir_scan5(struct dir_info *dir);
 void dir_scan6(struct dir_info *dir);
+void sort_directory(struct dir_info *dir);
 void dir_scan7(squashfs_inode *inode, struct dir_info *dir_info);
+static void spill_export(struct inode_info *inode);
+static void compress_meta_block(void *strm, struct meta_block *block);
+static void meta_threads_init();
 struct file_info *add_non_dup(long long file_size, long long bytes,
 	unsigned int *block_list, long long start, struct fragment *fragment,
 	unsigned short checksum, unsigned short fragment_checksum,
-	int checksum_flag, int checksum_frag_flag);
+	unsigned long long hash, int checksum_flag, int checksum_frag_flag,
+	int hash_flag);
 long long generic_write_table(int, void *, int, void *, int);
 void restorefs();
 struct dir_info *scan1_opendir(char *pathname, char *subpath, int depth);
+static struct dir_info *scan1_newdir(char *pathname, char *subpath, int depth);
+static void reader_archive(struct dir_info *root);
 void write_filesystem_tables(struct squashfs_super_block *sBlk, int nopad);
 unsigned short get_checksum_mem(char *buff, int bytes);
 void check_usable_phys_mem(int total_mem);
@@ -369,8 +616,9 @@ int multiply_overflowll(long long a, int multiplier)
 }
 
 
-#define MKINODE(A)	((squashfs_inode)(((squashfs_inode) inode_bytes << 16) \
-			+ (((char *)A) - data_cache)))
+#define MKINODE(A)	((squashfs_inode) (INODE_PENDING | \
+			((unsigned long long) inode_queued << 16) | \
+			(((char *)A) - (data_cache + cache_start))))
 
 
 void restorefs()
@@ -379,11 +627,16 @@ void restorefs()
 
 	bytes = sbytes;
 	memcpy(data_cache, sdata_cache, cache_bytes = scache_bytes);
+	cache_start = 0;
 	memcpy(directory_data_cache, sdirectory_data_cache,
 		sdirectory_cache_bytes);
 	directory_cache_bytes = sdirectory_cache_bytes;
+	directory_cache_start = 0;
 	inode_bytes = sinode_bytes;
 	directory_bytes = sdirectory_bytes;
+	/* inode blocks still being compressed belong to the abandoned run */
+	inode_queued = inode_written = 0;
+	pending_count = 0;
  	memcpy(directory_table + directory_bytes, sdirectory_compressed,
 		sdirectory_compressed_bytes);
  	directory_bytes += sdirectory_compressed_bytes;
@@ -412,19 +665,56 @@ void sighandler()
 }
 
 
-int mangle2(void *strm, char *d, char *s, int size,
-	int block_size, int uncompressed, int data_block)
+/*
+ * Estimate the order-0 entropy of a block, in 1/100ths of a bit per byte,
+ * from a sample of the block.  Blocks larger than the sample are sampled
+ * in chunks spread evenly across the block
+ */
+static int block_entropy(char *s, int size)
 {
-	int error, c_byte = 0;
+	unsigned int count[256];
+	int i, j, chunks, length, symbols = 0, n = 0;
+	double entropy = 0;
 
-	if(!uncompressed) {
-		c_byte = compressor_compress(comp, strm, d, s, size, block_size,
-			 &error);
-		if(c_byte == -1)
-			BAD_ERROR("mangle2:: %s compress failed with error "
-				"code %d\n", comp->name, error);
+	if(size <= ENTROPY_SAMPLE) {
+		chunks = 1;
+		length = size;
+	} else {
+		chunks = ENTROPY_SAMPLE / ENTROPY_CHUNK;
+		length = ENTROPY_CHUNK;
+	}
+
+	memset(count, 0, sizeof(count));
+	for(i = 0; i < chunks; i++) {
+		unsigned char *p = (unsigned char *) s +
+			(long long) i * size / chunks;
+
+		for(j = 0; j < length; j++)
+			count[p[j]] ++;
+		n += length;
 	}
 
+	for(i = 0; i < 256; i++)
+		if(count[i]) {
+			double p = (double) count[i] / n;
+
+			entropy -= p * log2(p);
+			symbols ++;
+		}
+
+	/* Miller-Madow correction for the underestimate of small samples */
+	entropy += (symbols - 1) / (2.0 * n * M_LN2);
+
+	return entropy * 100;
+}
+
+
+/*
+ * Store the block uncompressed if it didn't compress
+ */
+static int mangle_finish(char *d, char *s, int size, int c_byte,
+	int data_block)
+{
 	if(c_byte == 0 || c_byte >= size) {
 		memcpy(d, s, size);
 		return size | (data_block ? SQUASHFS_COMPRESSED_BIT_BLOCK :
@@ -435,57 +725,243 @@ int mangle2(void *strm, char *d, char *s, int size,
 }
 
 
+/*
+ * Effort is the -deadline effort data blocks are compressed at, or -1 to
+ * use the current effort
+ */
+int mangle2(void *strm, char *d, char *s, int size,
+	int block_size, int uncompressed, int data_block, int effort)
+{
+	int error, c_byte = 0;
+
+	if(!uncompressed) {
+		/*
+		 * With -adaptive, data and fragment blocks which look
+		 * incompressible are stored without trying to compress them,
+		 * and blocks which look poorly compressible are compressed
+		 * with the compressor's first choice of options only
+		 */
+		int entropy = adaptive && data_block ? block_entropy(s, size) :
+			0;
+
+		if(entropy >= ENTROPY_INCOMPRESSIBLE)
+			c_byte = 0;
+		else if(entropy >= ENTROPY_POOR)
+			c_byte = compressor_compress_fast(comp, strm, d, s,
+				size, block_size, &error);
+		else if(deadline_end && data_block)
+			c_byte = deadline_compress(strm, d, s, size,
+				block_size, effort, &error);
+		else
+			c_byte = compressor_compress(comp, strm, d, s, size,
+				block_size, &error);
+		if(c_byte == -1)
+			BAD_ERROR("mangle2:: %s compress failed with error "
+				"code %d\n", comp->name, error);
+	}
+
+	return mangle_finish(d, s, size, c_byte, data_block);
+}
+
+
 int mangle(char *d, char *s, int size, int block_size,
 	int uncompressed, int data_block)
 {
 	return mangle2(stream, d, s, size, block_size, uncompressed,
-		data_block);
+		data_block, -1);
 }
 
 
-void *get_inode(int req_size)
+/*
+ * Ensure there's room in the compressed inode or directory table for
+ * another metadata block after bytes.  The table is grown geometrically,
+ * so appending blocks costs amortised O(1)
+ */
+static char *table_space(char *table, unsigned int *size, unsigned int bytes)
 {
-	int data_space;
-	unsigned short c_byte;
+	unsigned int needed = bytes + (SQUASHFS_METADATA_SIZE << 1) + 2;
 
-	while(cache_bytes >= SQUASHFS_METADATA_SIZE) {
-		if((inode_size - inode_bytes) <
-				((SQUASHFS_METADATA_SIZE << 1)) + 2) {
-			void *it = realloc(inode_table, inode_size +
-				(SQUASHFS_METADATA_SIZE << 1) + 2);
-			if(it == NULL)
-				MEM_ERROR();
-			inode_table = it;
-			inode_size += (SQUASHFS_METADATA_SIZE << 1) + 2;
+	if(*size < needed) {
+		unsigned int new_size = *size < needed >> 1 || *size > UINT_MAX
+			>> 1 ? needed : *size << 1;
+
+		table = realloc(table, new_size);
+		if(table == NULL)
+			MEM_ERROR();
+		*size = new_size;
+	}
+
+	return table;
+}
+
+
+/*
+ * Ensure there's req_size bytes free at the end of the inode or directory
+ * cache.  Blocks are compressed from the front of the cache by advancing
+ * start, and the partial block left over is only moved back to the
+ * front when the end of the cache is reached, rather than after every
+ * block.  The cache is only grown if the partial block and req_size don't
+ * fit
+ */
+static char *cache_space(char *cache, unsigned int *size, unsigned int *start,
+	unsigned int *bytes, int req_size)
+{
+	if(*size - *bytes >= req_size)
+		return cache;
+
+	if(*start) {
+		memmove(cache, cache + *start, *bytes - *start);
+		*bytes -= *start;
+		*start = 0;
+		if(*size - *bytes >= req_size)
+			return cache;
+	}
+
+	if(*size < METADATA_CACHE_SIZE || *bytes + req_size > *size << 1) {
+		unsigned int new_size = (*bytes + req_size +
+			SQUASHFS_METADATA_SIZE) & ~(SQUASHFS_METADATA_SIZE - 1);
+
+		*size = new_size > METADATA_CACHE_SIZE ? new_size :
+			METADATA_CACHE_SIZE;
+	} else
+		*size <<= 1;
+
+	cache = realloc(cache, *size);
+	if(cache == NULL)
+		MEM_ERROR();
+
+	return cache;
+}
+
+
+static void inode_slots_init()
+{
+	int i;
+
+	inode_ahead = processors > 1 ? processors * META_AHEAD : 1;
+	inode_slot = malloc(inode_ahead * sizeof(struct meta_block));
+	if(inode_slot == NULL)
+		MEM_ERROR();
+
+	for(i = 0; i < inode_ahead; i++) {
+		inode_slot[i].data = malloc(SQUASHFS_METADATA_SIZE);
+		if(inode_slot[i].data == NULL)
+			MEM_ERROR();
+	}
+
+	if(inode_ahead > 1)
+		meta_threads_init();
+}
+
+
+/* the next inode block starts at inode_bytes */
+static void inode_block_started()
+{
+	if(inode_written == inode_block_size) {
+		inode_block_size = inode_block_size ? inode_block_size << 1 :
+			1024;
+		inode_block_start = realloc(inode_block_start,
+			inode_block_size * sizeof(unsigned int));
+		if(inode_block_start == NULL)
+			MEM_ERROR();
+	}
+
+	inode_block_start[inode_written ++] = inode_bytes;
+}
+
+
+/*
+ * Wait for the inode blocks numbered below block to be compressed, and
+ * add them to the inode table in order
+ */
+static void inode_blocks_wait(unsigned int block)
+{
+	while(inode_written < block) {
+		struct meta_block *slot = &inode_slot[inode_written %
+			inode_ahead];
+		int size;
+
+		if(inode_ahead > 1) {
+			pthread_cleanup_push((void *) pthread_mutex_unlock,
+				&meta_mutex);
+			pthread_mutex_lock(&meta_mutex);
+			while(!slot->done)
+				pthread_cond_wait(&meta_done, &meta_mutex);
+			pthread_cleanup_pop(1);
 		}
 
-		c_byte = mangle(inode_table + inode_bytes + BLOCK_OFFSET,
-			data_cache, SQUASHFS_METADATA_SIZE,
-			SQUASHFS_METADATA_SIZE, noI, 0);
-		TRACE("Inode block @ 0x%x, size %d\n", inode_bytes, c_byte);
-		SQUASHFS_SWAP_SHORTS(&c_byte, inode_table + inode_bytes, 1);
-		inode_bytes += SQUASHFS_COMPRESSED_SIZE(c_byte) + BLOCK_OFFSET;
+		size = SQUASHFS_COMPRESSED_SIZE(slot->c_byte) + BLOCK_OFFSET;
+		inode_table = table_space(inode_table, &inode_size,
+			inode_bytes);
+		memcpy(inode_table + inode_bytes, slot->cbuffer, size);
+		TRACE("Inode block @ 0x%x, size %d\n", inode_bytes,
+			slot->c_byte);
+		inode_block_started();
+		inode_bytes += size;
 		total_inode_bytes += SQUASHFS_METADATA_SIZE + BLOCK_OFFSET;
-		memmove(data_cache, data_cache + SQUASHFS_METADATA_SIZE,
-			cache_bytes - SQUASHFS_METADATA_SIZE);
-		cache_bytes -= SQUASHFS_METADATA_SIZE;
 	}
+}
 
-	data_space = (cache_size - cache_bytes);
-	if(data_space < req_size) {
-			int realloc_size = cache_size == 0 ?
-				((req_size + SQUASHFS_METADATA_SIZE) &
-				~(SQUASHFS_METADATA_SIZE - 1)) : req_size -
-				data_space;
 
-			void *dc = realloc(data_cache, cache_size +
-				realloc_size);
-			if(dc == NULL)
-				MEM_ERROR();
-			cache_size += realloc_size;
-			data_cache = dc;
+/* queue the full inode block at cache_start to be compressed */
+static void inode_block_queue()
+{
+	struct meta_block *block;
+
+	if(inode_slot == NULL)
+		inode_slots_init();
+
+	if(inode_queued - inode_written == inode_ahead)
+		inode_blocks_wait(inode_written + 1);
+
+	block = &inode_slot[inode_queued % inode_ahead];
+	memcpy(block->data, data_cache + cache_start, SQUASHFS_METADATA_SIZE);
+	block->size = SQUASHFS_METADATA_SIZE;
+	block->uncompressed = noI;
+	block->done = FALSE;
+	inode_queued ++;
+
+	if(inode_ahead > 1)
+		queue_put(to_meta, block);
+	else
+		compress_meta_block(stream, block);
+}
+
+
+/* return the inode table start of the (possibly pending) inode block */
+static unsigned int resolve_block(squashfs_inode block)
+{
+	unsigned int number = block;
+
+	if(!PENDING(block, BLOCK_PENDING))
+		return block;
+
+	inode_blocks_wait(number);
+
+	return number < inode_written ? inode_block_start[number] :
+		inode_bytes;
+}
+
+
+squashfs_inode resolve_inode(squashfs_inode inode)
+{
+	unsigned long long ref = inode;
+
+	return ((squashfs_inode) resolve_block(ref >> 16) << 16) |
+		(ref & 0xffff);
+}
+
+
+void *get_inode(int req_size)
+{
+	while(cache_bytes - cache_start >= SQUASHFS_METADATA_SIZE) {
+		inode_block_queue();
+		cache_start += SQUASHFS_METADATA_SIZE;
 	}
 
+	data_cache = cache_space(data_cache, &cache_size, &cache_start,
+		&cache_bytes, req_size);
+
 	cache_bytes += req_size;
 
 	return data_cache + cache_bytes - req_size;
@@ -578,6 +1054,9 @@ void write_destination(int fd, long long byte, int bytes, void *buff)
 		BAD_ERROR("Failed to write to output %s\n",
 			block_device ? "block device" : "filesystem");
 
+	if(verity)
+		verity_write(byte, buff, bytes);
+
 	pthread_cleanup_pop(1);
 }
 
@@ -586,25 +1065,25 @@ long long write_inodes()
 {
 	unsigned short c_byte;
 	int avail_bytes;
-	char *datap = data_cache;
+	char *datap = data_cache + cache_start;
 	long long start_bytes = bytes;
 
+	inode_blocks_wait(inode_queued);
+
+	cache_bytes -= cache_start;
+	cache_start = 0;
+
 	while(cache_bytes) {
-		if(inode_size - inode_bytes <
-				((SQUASHFS_METADATA_SIZE << 1) + 2)) {
-			void *it = realloc(inode_table, inode_size +
-				((SQUASHFS_METADATA_SIZE << 1) + 2));
-			if(it == NULL)
-				MEM_ERROR();
-			inode_size += (SQUASHFS_METADATA_SIZE << 1) + 2;
-			inode_table = it;
-		}
+		inode_table = table_space(inode_table, &inode_size,
+			inode_bytes);
 		avail_bytes = cache_bytes > SQUASHFS_METADATA_SIZE ?
 			SQUASHFS_METADATA_SIZE : cache_bytes;
 		c_byte = mangle(inode_table + inode_bytes + BLOCK_OFFSET, datap,
 			avail_bytes, SQUASHFS_METADATA_SIZE, noI, 0);
 		TRACE("Inode block @ 0x%x, size %d\n", inode_bytes, c_byte);
 		SQUASHFS_SWAP_SHORTS(&c_byte, inode_table + inode_bytes, 1); 
+		inode_block_started();
+		inode_queued = inode_written;
 		inode_bytes += SQUASHFS_COMPRESSED_SIZE(c_byte) + BLOCK_OFFSET;
 		total_inode_bytes += avail_bytes + BLOCK_OFFSET;
 		datap += avail_bytes;
@@ -618,24 +1097,48 @@ long long write_inodes()
 }
 
 
+/*
+ * Resolve the start_block of the pending directory headers in the
+ * directory cache below offset limit
+ */
+static void pending_resolve(long long limit)
+{
+	unsigned int i;
+
+	for(i = 0; i < pending_count && pending_headers[i].offset < limit;
+									i++) {
+		struct squashfs_dir_header dir_header;
+		char *header = directory_data_cache + directory_cache_start +
+			(pending_headers[i].offset - directory_cache_out);
+
+		SQUASHFS_SWAP_DIR_HEADER((struct squashfs_dir_header *) header,
+			&dir_header);
+		dir_header.start_block =
+			resolve_block(pending_headers[i].block);
+		SQUASHFS_SWAP_DIR_HEADER(&dir_header, header);
+	}
+
+	memmove(pending_headers, pending_headers + i, (pending_count - i) *
+		sizeof(struct dir_pending));
+	pending_count -= i;
+}
+
+
 long long write_directories()
 {
 	unsigned short c_byte;
 	int avail_bytes;
-	char *directoryp = directory_data_cache;
+	char *directoryp = directory_data_cache + directory_cache_start;
 	long long start_bytes = bytes;
 
+	pending_resolve(LLONG_MAX);
+
+	directory_cache_bytes -= directory_cache_start;
+	directory_cache_start = 0;
+
 	while(directory_cache_bytes) {
-		if(directory_size - directory_bytes <
-				((SQUASHFS_METADATA_SIZE << 1) + 2)) {
-			void *dt = realloc(directory_table,
-				directory_size + ((SQUASHFS_METADATA_SIZE << 1)
-				+ 2));
-			if(dt == NULL)
-				MEM_ERROR();
-			directory_size += (SQUASHFS_METADATA_SIZE << 1) + 2;
-			directory_table = dt;
-		}
+		directory_table = table_space(directory_table, &directory_size,
+			directory_bytes);
 		avail_bytes = directory_cache_bytes > SQUASHFS_METADATA_SIZE ?
 			SQUASHFS_METADATA_SIZE : directory_cache_bytes;
 		c_byte = mangle(directory_table + directory_bytes +
@@ -787,18 +1290,6 @@ char *pathname(struct dir_ent *dir_ent)
 }
 
 
-char *pathname_reader(struct dir_ent *dir_ent)
-{
-	static char *pathname = NULL;
-	static int size = ALLOC_SIZE;
-
-	if (dir_ent->nonstandard_pathname)
-		return dir_ent->nonstandard_pathname;
-
-	return pathname = _pathname(dir_ent, pathname, &size);
-}
-
-
 char *subpathname(struct dir_ent *dir_ent)
 {
 	static char *subpath = NULL;
@@ -854,13 +1345,42 @@ int create_inode(squashfs_inode *i_no, struct dir_info *dir_info,
 	long long start_block, unsigned int offset, unsigned int *block_list,
 	struct fragment *fragment, struct directory *dir_in, long long sparse)
 {
-	struct stat *buf = &dir_ent->inode->buf;
+	struct inode_stat *buf = &dir_ent->inode->buf;
 	union squashfs_inode_header inode_header;
 	struct squashfs_base_inode_header *base = &inode_header.base;
 	void *inode;
-	char *filename = pathname(dir_ent);
-	int nlink = dir_ent->inode->nlink;
-	int xattr = read_xattrs(dir_ent);
+	char *filename;
+	int nlink, xattr;
+
+	if(archive_defer && type == SQUASHFS_FILE_TYPE) {
+		/*
+		 * Writing a file read from an archive, remember the inode,
+		 * it is created by dir_scan7 once all the links to it are
+		 * known
+		 */
+		struct archive_inode *a = archive_defer;
+
+		a->file_size = byte_size;
+		a->start = start_block;
+		a->sparse = sparse;
+		a->blocks = offset;
+		a->block_list = NULL;
+		a->fragment = *fragment;
+		if(offset) {
+			a->block_list = malloc(offset * sizeof(unsigned int));
+			if(a->block_list == NULL)
+				MEM_ERROR();
+			memcpy(a->block_list, block_list, offset *
+				sizeof(unsigned int));
+		}
+
+		archive_defer = NULL;
+		return TRUE;
+	}
+
+	filename = pathname(dir_ent);
+	nlink = dir_ent->inode->nlink;
+	xattr = read_xattrs(dir_ent);
 
 	switch(type) {
 	case SQUASHFS_FILE_TYPE:
@@ -902,7 +1422,7 @@ int create_inode(squashfs_inode *i_no, struct dir_info *dir_info,
 	base->inode_type = type;
 	base->guid = get_guid((unsigned int) global_gid == -1 ?
 		buf->st_gid : global_gid);
-	base->mtime = buf->st_mtime;
+	base->mtime = buf->mtime;
 	base->inode_number = get_inode_no(dir_ent->inode);
 
 	if(type == SQUASHFS_FILE_TYPE) {
@@ -1108,10 +1628,11 @@ void add_dir(squashfs_inode inode, unsigned int inode_number, char *name,
 {
 	unsigned char *buff;
 	struct squashfs_dir_entry idir;
-	unsigned int start_block = inode >> 16;
+	squashfs_inode start_block = (unsigned long long) inode >> 16;
 	unsigned int offset = inode & 0xffff;
 	unsigned int size = strlen(name);
 	size_t name_off = offsetof(struct squashfs_dir_entry, name);
+	int index;
 
 	if(size > SQUASHFS_NAME_LEN) {
 		size = SQUASHFS_NAME_LEN;
@@ -1134,19 +1655,23 @@ void add_dir(squashfs_inode inode, unsigned int inode_number, char *name,
 		dir->buff = buff;
 	}
 
+	/*
+	 * The index (i_count) is 16 bits, once it is full the rest of the
+	 * directory isn't indexed, which lookups still find by scanning
+	 */
+	index = dir->i_count < I_COUNT_MAX && (dir->p +
+		sizeof(struct squashfs_dir_entry) + size - dir->index_count_p) >
+		dir_index_size;
+
 	if(dir->entry_count == 256 || start_block != dir->start_block ||
-			((dir->entry_count_p != NULL) &&
-			((dir->p + sizeof(struct squashfs_dir_entry) + size -
-			dir->index_count_p) > SQUASHFS_METADATA_SIZE)) ||
+			((dir->entry_count_p != NULL) && index) ||
 			((long long) inode_number - dir->inode_number) > 32767
 			|| ((long long) inode_number - dir->inode_number)
 			< -32768) {
 		if(dir->entry_count_p) {
 			struct squashfs_dir_header dir_header;
 
-			if((dir->p + sizeof(struct squashfs_dir_entry) + size -
-					dir->index_count_p) >
-					SQUASHFS_METADATA_SIZE) {
+			if(index) {
 				if(dir->i_count % I_COUNT_SIZE == 0) {
 					dir->index = realloc(dir->index,
 						(dir->i_count + I_COUNT_SIZE) *
@@ -1177,6 +1702,19 @@ void add_dir(squashfs_inode inode, unsigned int inode_number, char *name,
 		dir->entry_count = 0;
 		dir->inode_number = inode_number;
 		dir->p += sizeof(struct squashfs_dir_header);
+
+		if(PENDING(start_block, BLOCK_PENDING)) {
+			if(dir->pending_count % DIR_ENTRIES == 0) {
+				dir->pending = realloc(dir->pending,
+					(dir->pending_count + DIR_ENTRIES) *
+					sizeof(struct dir_pending));
+				if(dir->pending == NULL)
+					MEM_ERROR();
+			}
+			dir->pending[dir->pending_count].offset =
+				dir->entry_count_p - dir->buff;
+			dir->pending[dir->pending_count++].block = start_block;
+		}
 	}
 
 	idir.offset = offset;
@@ -1190,26 +1728,42 @@ void add_dir(squashfs_inode inode, unsigned int inode_number, char *name,
 }
 
 
+/*
+ * Add the pending headers of dir, which has just been copied to the end of
+ * the directory cache, to the pending headers of the directory cache
+ */
+static void add_pending(struct directory *dir)
+{
+	long long base = directory_cache_out + directory_cache_bytes -
+		directory_cache_start;
+	unsigned int i;
+
+	if(pending_count + dir->pending_count > pending_size) {
+		pending_size = (pending_count + dir->pending_count) << 1;
+		pending_headers = realloc(pending_headers, pending_size *
+			sizeof(struct dir_pending));
+		if(pending_headers == NULL)
+			MEM_ERROR();
+	}
+
+	for(i = 0; i < dir->pending_count; i++) {
+		pending_headers[pending_count].offset = base +
+			dir->pending[i].offset;
+		pending_headers[pending_count++].block = dir->pending[i].block;
+	}
+}
+
+
 void write_dir(squashfs_inode *inode, struct dir_info *dir_info,
 	struct directory *dir)
 {
 	unsigned int dir_size = dir->p - dir->buff;
-	int data_space = directory_cache_size - directory_cache_bytes;
 	unsigned int directory_block, directory_offset, i_count, index;
 	unsigned short c_byte;
 
-	if(data_space < dir_size) {
-		int realloc_size = directory_cache_size == 0 ?
-			((dir_size + SQUASHFS_METADATA_SIZE) &
-			~(SQUASHFS_METADATA_SIZE - 1)) : dir_size - data_space;
-
-		void *dc = realloc(directory_data_cache,
-			directory_cache_size + realloc_size);
-		if(dc == NULL)
-			MEM_ERROR();
-		directory_cache_size += realloc_size;
-		directory_data_cache = dc;
-	}
+	directory_data_cache = cache_space(directory_data_cache,
+		&directory_cache_size, &directory_cache_start,
+		&directory_cache_bytes, dir_size);
 
 	if(dir_size) {
 		struct squashfs_dir_header dir_header;
@@ -1220,8 +1774,9 @@ void write_dir(squashfs_inode *inode, struct dir_info *dir_info,
 		SQUASHFS_SWAP_DIR_HEADER(&dir_header, dir->entry_count_p);
 		memcpy(directory_data_cache + directory_cache_bytes, dir->buff,
 			dir_size);
+		add_pending(dir);
 	}
-	directory_offset = directory_cache_bytes;
+	directory_offset = directory_cache_bytes - directory_cache_start;
 	directory_block = directory_bytes;
 	directory_cache_bytes += dir_size;
 	i_count = 0;
@@ -1234,24 +1789,18 @@ void write_dir(squashfs_inode *inode, struct dir_info *dir_info,
 				directory_bytes;
 		index += SQUASHFS_METADATA_SIZE;
 
-		if(directory_cache_bytes < SQUASHFS_METADATA_SIZE)
+		if(directory_cache_bytes - directory_cache_start <
+				SQUASHFS_METADATA_SIZE)
 			break;
 
-		if((directory_size - directory_bytes) <
-					((SQUASHFS_METADATA_SIZE << 1) + 2)) {
-			void *dt = realloc(directory_table,
-				directory_size + (SQUASHFS_METADATA_SIZE << 1)
-				+ 2);
-			if(dt == NULL)
-				MEM_ERROR();
-			directory_size += SQUASHFS_METADATA_SIZE << 1;
-			directory_table = dt;
-		}
+		directory_table = table_space(directory_table, &directory_size,
+			directory_bytes);
 
+		pending_resolve(directory_cache_out + SQUASHFS_METADATA_SIZE);
 		c_byte = mangle(directory_table + directory_bytes +
-				BLOCK_OFFSET, directory_data_cache,
-				SQUASHFS_METADATA_SIZE, SQUASHFS_METADATA_SIZE,
-				noI, 0);
+				BLOCK_OFFSET, directory_data_cache +
+				directory_cache_start, SQUASHFS_METADATA_SIZE,
+				SQUASHFS_METADATA_SIZE, noI, 0);
 		TRACE("Directory block @ 0x%x, size %d\n", directory_bytes,
 			c_byte);
 		SQUASHFS_SWAP_SHORTS(&c_byte,
@@ -1259,10 +1808,8 @@ void write_dir(squashfs_inode *inode, struct dir_info *dir_info,
 		directory_bytes += SQUASHFS_COMPRESSED_SIZE(c_byte) +
 			BLOCK_OFFSET;
 		total_directory_bytes += SQUASHFS_METADATA_SIZE + BLOCK_OFFSET;
-		memmove(directory_data_cache, directory_data_cache +
-			SQUASHFS_METADATA_SIZE, directory_cache_bytes -
-			SQUASHFS_METADATA_SIZE);
-		directory_cache_bytes -= SQUASHFS_METADATA_SIZE;
+		directory_cache_start += SQUASHFS_METADATA_SIZE;
+		directory_cache_out += SQUASHFS_METADATA_SIZE;
 	}
 
 	create_inode(inode, dir_info, dir_info->dir_ent, SQUASHFS_DIR_TYPE,
@@ -1309,8 +1856,9 @@ static struct file_buffer *get_fragment(struct fragment *fragment)
 {
 	struct squashfs_fragment_entry *disk_fragment;
 	struct file_buffer *buffer, *compressed_buffer;
+	pthread_mutex_t *lookup_mutex;
 	long long start_block;
-	int res, size, index = fragment->index;
+	int res, size, c_byte, index = fragment->index;
 	char locked;
 
 	/*
@@ -1324,7 +1872,9 @@ static struct file_buffer *get_fragment(struct fragment *fragment)
 	 *	   same buffer.  This means a buffer needs to be "locked"
 	 *	   when it is being filled in, to prevent other threads from
 	 *	   using it when it is not ready.  This is because we now do
-	 *	   fragment duplicate checking in parallel.
+	 *	   fragment duplicate checking in parallel.  The lookup and
+	 *	   creation is serialised by the lookup mutex of the fragment,
+	 *	   so threads looking up different fragments don't contend.
 	 *	2. We have two caches which need to be checked for the
 	 *	   presence of fragment blocks: the normal fragment cache
 	 *	   and a "reserve" cache.  The reserve cache is used to
@@ -1335,13 +1885,15 @@ static struct file_buffer *get_fragment(struct fragment *fragment)
 	if(fragment->index == SQUASHFS_INVALID_FRAG)
 		return NULL;
 
-	pthread_cleanup_push((void *) pthread_mutex_unlock, &dup_mutex);
-	pthread_mutex_lock(&dup_mutex);
+	lookup_mutex = FRAG_LOOKUP_LOCK(index);
+
+	pthread_cleanup_push((void *) pthread_mutex_unlock, lookup_mutex);
+	pthread_mutex_lock(lookup_mutex);
 
 again:
 	buffer = cache_lookup_nowait(fragment_buffer, index, &locked);
 	if(buffer) {
-		pthread_mutex_unlock(&dup_mutex);
+		pthread_mutex_unlock(lookup_mutex);
 		if(locked)
 			/* got a buffer being filled in.  Wait for it */
 			cache_wait_unlock(buffer);
@@ -1351,7 +1903,7 @@ again:
 	/* not in fragment cache, is it in the reserve cache? */
 	buffer = cache_lookup_nowait(reserve_cache, index, &locked);
 	if(buffer) {
-		pthread_mutex_unlock(&dup_mutex);
+		pthread_mutex_unlock(lookup_mutex);
 		if(locked)
 			/* got a buffer being filled in.  Wait for it */
 			cache_wait_unlock(buffer);
@@ -1364,7 +1916,7 @@ again:
 		/*
 		 * no room, get it from the reserve cache, this is
 		 * dimensioned so it will always have space (no more than
-		 * processors + 1 can have an outstanding reserve buffer)
+		 * processors * 2 + 1 can have an outstanding reserve buffer)
 		 */
 		buffer = cache_get_nowait(reserve_cache, index);
 		if(!buffer) {
@@ -1374,18 +1926,19 @@ again:
 		}
 	}
 
-	pthread_mutex_unlock(&dup_mutex);
+	pthread_mutex_unlock(lookup_mutex);
 
 	compressed_buffer = cache_lookup(fwriter_buffer, index);
 
 	pthread_cleanup_push((void *) pthread_mutex_unlock, &fragment_mutex);
 	pthread_mutex_lock(&fragment_mutex);
 	disk_fragment = &fragment_table[index];
-	size = SQUASHFS_COMPRESSED_SIZE_BLOCK(disk_fragment->size);
+	c_byte = disk_fragment->size;
 	start_block = disk_fragment->start_block;
 	pthread_cleanup_pop(1);
 
-	if(SQUASHFS_COMPRESSED_BLOCK(disk_fragment->size)) {
+	size = SQUASHFS_COMPRESSED_SIZE_BLOCK(c_byte);
+	if(SQUASHFS_COMPRESSED_BLOCK(c_byte)) {
 		int error;
 		char *data;
 
@@ -1400,8 +1953,8 @@ again:
 			}
 		}
 
-		res = compressor_uncompress(comp, buffer->data, data, size,
-			block_size, &error);
+		res = compressor_uncompress(comp, NULL, buffer->data, data,
+			size, block_size, &error);
 		if(res == -1)
 			BAD_ERROR("%s uncompress failed with error code %d\n",
 				comp->name, error);
@@ -1501,8 +2054,8 @@ void unlock_fragments()
 		fragment_table[frg].start_block = bytes;
 		write_buffer->block = bytes;
 		bytes += size;
-		fragments_outstanding --;
 		queue_put(to_writer, write_buffer);
+		__atomic_sub_fetch(&fragments_outstanding, 1, __ATOMIC_RELEASE);
 		TRACE("fragment_locked writing fragment %d, compressed size %d"
 			"\n", frg, size);
 	}
@@ -1526,12 +2079,14 @@ void write_fragment(struct file_buffer *fragment)
 	if(fragment == NULL)
 		return;
 
-	pthread_cleanup_push((void *) pthread_mutex_unlock, &fragment_mutex);
-	pthread_mutex_lock(&fragment_mutex);
+	/*
+	 * Only the main thread reallocates the fragment table, and no other
+	 * thread touches this fragment's entry until it is queued, so
+	 * fragment_mutex isn't needed here
+	 */
 	fragment_table[fragment->block].unused = 0;
-	fragments_outstanding ++;
+	__atomic_add_fetch(&fragments_outstanding, 1, __ATOMIC_RELAXED);
 	queue_put(to_frag, fragment);
-	pthread_cleanup_pop(1);
 }
 
 
@@ -1539,22 +2094,31 @@ struct file_buffer *allocate_fragment()
 {
 	struct file_buffer *fragment = cache_get(fragment_buffer, fragments);
 
-	pthread_cleanup_push((void *) pthread_mutex_unlock, &fragment_mutex);
-	pthread_mutex_lock(&fragment_mutex);
-
+	/*
+	 * The fragment table grows FRAG_SIZE entries at a time, and the
+	 * fragment_mutex is only needed when it is reallocated (moved) under
+	 * the threads reading and updating it.  Fragments is only changed
+	 * by the main thread
+	 */
 	if(fragments % FRAG_SIZE == 0) {
-		void *ft = realloc(fragment_table, (fragments +
+		void *ft;
+
+		pthread_cleanup_push((void *) pthread_mutex_unlock,
+							&fragment_mutex);
+		pthread_mutex_lock(&fragment_mutex);
+
+		ft = realloc(fragment_table, (fragments +
 			FRAG_SIZE) * sizeof(struct squashfs_fragment_entry));
 		if(ft == NULL)
 			MEM_ERROR();
 		fragment_table = ft;
+
+		pthread_cleanup_pop(1);
 	}
 
 	fragment->size = 0;
 	fragment->block = fragments ++;
 
-	pthread_cleanup_pop(1);
-
 	return fragment;
 }
 
@@ -1569,6 +2133,155 @@ void free_fragment(struct fragment *fragment)
 }
 
 
+/*
+ * -pack-fragments bins, planned by plan_fragments().  Each bin reserves
+ * room for the members which haven't yet been written, and any room not
+ * reserved (left by members found to be duplicates) is used for tail ends
+ * which weren't planned.  Only a bounded number of bins can hold a
+ * fragment buffer at any one time, and once the oldest is closed to make
+ * room its remaining members are packed like unplanned tail ends
+ */
+static struct fragment_bin *fragment_bins = NULL;
+static int fragment_bin_count = 0;
+static int *open_bins = NULL;
+static int open_bin_count = 0, max_open_bins;
+
+
+static void close_bin(struct fragment_bin *bin)
+{
+	int i;
+
+	bin->closed = TRUE;
+	if(bin->buffer == NULL)
+		return;
+
+	write_fragment(bin->buffer);
+	bin->buffer = NULL;
+
+	for(i = 0; &fragment_bins[open_bins[i]] != bin; i++);
+	open_bin_count --;
+	memmove(open_bins + i, open_bins + i + 1, (open_bin_count - i) *
+		sizeof(int));
+}
+
+
+static void open_bin(struct fragment_bin *bin)
+{
+	if(open_bins == NULL) {
+		max_open_bins = fragment_buffer->max_buffers / 4;
+		if(max_open_bins == 0)
+			max_open_bins = 1;
+
+		open_bins = malloc(max_open_bins * sizeof(int));
+		if(open_bins == NULL)
+			MEM_ERROR();
+	}
+
+	if(open_bin_count == max_open_bins)
+		close_bin(&fragment_bins[open_bins[0]]);
+
+	bin->buffer = allocate_fragment();
+	open_bins[open_bin_count ++] = bin - fragment_bins;
+}
+
+
+static int tail_size(struct inode_info *inode)
+{
+	off_t file_size = inode->buf.st_size;
+
+	return file_size < block_size ? file_size : file_size &
+		(block_size - 1);
+}
+
+
+static struct fragment *add_to_bin(struct fragment_bin *bin,
+	struct file_buffer *file_buffer)
+{
+	struct fragment *ffrg = malloc(sizeof(struct fragment));
+
+	if(ffrg == NULL)
+		MEM_ERROR();
+
+	if(bin->buffer == NULL)
+		open_bin(bin);
+
+	ffrg->index = bin->buffer->block;
+	ffrg->offset = bin->buffer->size;
+	ffrg->size = file_buffer->size;
+	memcpy(bin->buffer->data + bin->buffer->size, file_buffer->data,
+		file_buffer->size);
+	bin->buffer->size += file_buffer->size;
+
+	return ffrg;
+}
+
+
+/*
+ * Release the inode's place in its planned bin, writing the bin if
+ * this was the last member
+ */
+static void release_fragment_bin(struct inode_info *inode)
+{
+	struct fragment_bin *bin;
+
+	if(inode->frag_bin < 0)
+		return;
+
+	bin = &fragment_bins[inode->frag_bin];
+	inode->frag_bin = FRAG_BIN_NONE;
+	bin->reserved -= tail_size(inode);
+
+	if(-- bin->members == 0)
+		close_bin(bin);
+}
+
+
+static struct fragment *pack_fragment(struct file_buffer *file_buffer,
+	struct inode_info *inode)
+{
+	struct fragment_bin *bin = &fragment_bins[inode->frag_bin];
+	struct fragment *ffrg = NULL;
+
+	/* the room reserved for this tail end is still free in the bin */
+	if(!bin->closed && file_buffer->size <= tail_size(inode))
+		ffrg = add_to_bin(bin, file_buffer);
+
+	release_fragment_bin(inode);
+
+	return ffrg;
+}
+
+
+/*
+ * Put an unplanned tail end into the open bin with the least unreserved
+ * room that it fits, if any
+ */
+static struct fragment *fill_fragment_bin(struct file_buffer *file_buffer)
+{
+	int i, room, best = -1, best_room = block_size + 1;
+
+	for(i = 0; i < open_bin_count; i++) {
+		struct fragment_bin *bin = &fragment_bins[open_bins[i]];
+
+		room = block_size - bin->buffer->size - bin->reserved;
+		if(room >= file_buffer->size && room < best_room) {
+			best = open_bins[i];
+			best_room = room;
+		}
+	}
+
+	return best == -1 ? NULL : add_to_bin(&fragment_bins[best],
+								file_buffer);
+}
+
+
+static void flush_fragment_bins()
+{
+	while(open_bin_count)
+		close_bin(&fragment_bins[open_bins[0]]);
+}
+
+
 struct fragment *get_and_fill_fragment(struct file_buffer *file_buffer,
 	struct dir_ent *dir_ent)
 {
@@ -1578,8 +2291,20 @@ struct fragment *get_and_fill_fragment(struct file_buffer *file_buffer,
 	if(file_buffer == NULL || file_buffer->size == 0)
 		return &empty_fragment;
 
+	if(dir_ent->inode->frag_bin >= 0) {
+		ffrg = pack_fragment(file_buffer, dir_ent->inode);
+		if(ffrg)
+			return ffrg;
+	}
+
 	fragment = eval_frag_actions(root_dir, dir_ent);
 
+	if(open_bin_count && fragment == get_frag_action(NULL)) {
+		ffrg = fill_fragment_bin(file_buffer);
+		if(ffrg)
+			return ffrg;
+	}
+
 	if((*fragment) && (*fragment)->size + file_buffer->size > block_size) {
 		write_fragment(*fragment);
 		*fragment = NULL;
@@ -1603,16 +2328,81 @@ struct fragment *get_and_fill_fragment(struct file_buffer *file_buffer,
 }
 
 
+static void compress_meta_block(void *strm, struct meta_block *block)
+{
+	block->c_byte = mangle2(strm, block->cbuffer + BLOCK_OFFSET,
+		block->data, block->size, SQUASHFS_METADATA_SIZE,
+		block->uncompressed, 0, -1);
+	SQUASHFS_SWAP_SHORTS(&block->c_byte, block->cbuffer, 1);
+}
+
+
+void *meta_thrd(void *arg)
+{
+	sigset_t sigmask, old_mask;
+	void *strm = NULL;
+	int res;
+
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask, SIGINT);
+	sigaddset(&sigmask, SIGTERM);
+	sigaddset(&sigmask, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &sigmask, &old_mask);
+
+	res = compressor_init(comp, &strm, SQUASHFS_METADATA_SIZE, 0);
+	if(res)
+		BAD_ERROR("meta_thrd:: compressor_init failed\n");
+
+	while(1) {
+		struct meta_block *block = queue_get(to_meta);
+
+		compress_meta_block(strm, block);
+
+		pthread_cleanup_push((void *) pthread_mutex_unlock,
+			&meta_mutex);
+		pthread_mutex_lock(&meta_mutex);
+		block->done = TRUE;
+		pthread_cond_broadcast(&meta_done);
+		pthread_cleanup_pop(1);
+	}
+}
+
+
+/*
+ * The metadata threads are only started the first time a table with more
+ * than one block is written, they then wait on the to_meta queue for
+ * the rest of the run
+ */
+static void meta_threads_init()
+{
+	int i;
+
+	if(to_meta)
+		return;
+
+	to_meta = queue_init(processors * META_AHEAD);
+	meta_thread = malloc(processors * sizeof(pthread_t));
+	if(meta_thread == NULL)
+		MEM_ERROR();
+
+	for(i = 0; i < processors; i++)
+		if(pthread_create(&meta_thread[i], NULL, meta_thrd, NULL) != 0)
+			BAD_ERROR("Failed to create thread\n");
+}
+
+
 long long generic_write_table(int length, void *buffer, int length2,
 	void *buffer2, int uncompressed)
 {
 	int meta_blocks = (length + SQUASHFS_METADATA_SIZE - 1) /
 		SQUASHFS_METADATA_SIZE;
 	long long *list, start_bytes;
-	int compressed_size, i, list_size = meta_blocks * sizeof(long long);
-	unsigned short c_byte;
-	char cbuffer[(SQUASHFS_METADATA_SIZE << 2) + 2];
-	
+	int compressed_size, i, queued, list_size = meta_blocks *
+		sizeof(long long);
+	int ahead = processors > 1 && meta_blocks > 1 ? processors *
+		META_AHEAD : 1;
+	struct meta_block *slot;
+
 #ifdef SQUASHFS_TRACE
 	long long obytes = bytes;
 	int olength = length;
@@ -1622,24 +2412,56 @@ long long generic_write_table(int length, void *buffer, int length2,
 	if(list == NULL)
 		MEM_ERROR();
 
-	for(i = 0; i < meta_blocks; i++) {
-		int avail_bytes = length > SQUASHFS_METADATA_SIZE ?
-			SQUASHFS_METADATA_SIZE : length;
-		c_byte = mangle(cbuffer + BLOCK_OFFSET, buffer + i *
-			SQUASHFS_METADATA_SIZE , avail_bytes,
-			SQUASHFS_METADATA_SIZE, uncompressed, 0);
-		SQUASHFS_SWAP_SHORTS(&c_byte, cbuffer, 1);
+	slot = malloc(ahead * sizeof(struct meta_block));
+	if(slot == NULL)
+		MEM_ERROR();
+
+	if(ahead > 1)
+		meta_threads_init();
+
+	/*
+	 * Keep up to ahead blocks queued to the metadata threads, and write
+	 * them out in order as they complete.  The slot of a block is reused
+	 * for the block ahead places after it once it has been written
+	 */
+	for(i = queued = 0; i < meta_blocks; i++) {
+		struct meta_block *block = &slot[i % ahead];
+
+		for(; queued < meta_blocks && queued < i + ahead; queued++) {
+			struct meta_block *next = &slot[queued % ahead];
+			int offset = queued * SQUASHFS_METADATA_SIZE;
+
+			next->data = buffer + offset;
+			next->size = length - offset > SQUASHFS_METADATA_SIZE ?
+				SQUASHFS_METADATA_SIZE : length - offset;
+			next->uncompressed = uncompressed;
+			next->done = FALSE;
+			if(ahead > 1)
+				queue_put(to_meta, next);
+		}
+
+		if(ahead > 1) {
+			pthread_cleanup_push((void *) pthread_mutex_unlock,
+				&meta_mutex);
+			pthread_mutex_lock(&meta_mutex);
+			while(!block->done)
+				pthread_cond_wait(&meta_done, &meta_mutex);
+			pthread_cleanup_pop(1);
+		} else
+			compress_meta_block(stream, block);
+
 		list[i] = bytes;
-		compressed_size = SQUASHFS_COMPRESSED_SIZE(c_byte) +
+		compressed_size = SQUASHFS_COMPRESSED_SIZE(block->c_byte) +
 			BLOCK_OFFSET;
 		TRACE("block %d @ 0x%llx, compressed size %d\n", i, bytes,
 			compressed_size);
-		write_destination(fd, bytes, compressed_size, cbuffer);
+		write_destination(fd, bytes, compressed_size, block->cbuffer);
 		bytes += compressed_size;
-		total_bytes += avail_bytes;
-		length -= avail_bytes;
+		total_bytes += block->size;
 	}
 
+	free(slot);
+
 	start_bytes = bytes;
 	if(length2) {
 		write_destination(fd, bytes, length2, buffer2);
@@ -1706,16 +2528,23 @@ char *read_from_disk2(long long start, unsigned int avail_bytes)
 
 
 /*
- * Compute 16 bit BSD checksum over the data
+ * Compute 16 bit BSD checksum over the data.
+ *
+ * Each byte is added after rotating the checksum so far, and as rotation
+ * doesn't distribute over addition (the carries differ) the bytes cannot be
+ * summed independently, with SIMD or otherwise.  The best that can be done
+ * is a branchless loop, which the compiler turns into a 16 bit rotate and
+ * add per byte.  Now duplicates are found by content hash, the checksum is
+ * only calculated when appending, to compare against files in the original
+ * filesystem.
  */
 unsigned short get_checksum(char *buff, int bytes, unsigned short chksum)
 {
 	unsigned char *b = (unsigned char *) buff;
 
-	while(bytes --) {
-		chksum = (chksum & 1) ? (chksum >> 1) | 0x8000 : chksum >> 1;
-		chksum += *b++;
-	}
+	while(bytes --)
+		chksum = (unsigned short) ((chksum >> 1) | (chksum << 15)) +
+			*b++;
 
 	return chksum;
 }
@@ -1809,7 +2638,7 @@ void add_file(long long start, long long file_size, long long file_bytes,
 	frg->size = bytes;
 
 	file = add_non_dup(file_size, file_bytes, block_list, start, frg, 0, 0,
-		FALSE, FALSE);
+		0, FALSE, FALSE, FALSE);
 
 	if(fragment == SQUASHFS_INVALID_FRAG)
 		return;
@@ -1839,7 +2668,8 @@ int pre_duplicate(long long file_size)
 struct file_info *add_non_dup(long long file_size, long long bytes,
 	unsigned int *block_list, long long start, struct fragment *fragment,
 	unsigned short checksum, unsigned short fragment_checksum,
-	int checksum_flag, int checksum_frag_flag)
+	unsigned long long hash, int checksum_flag, int checksum_frag_flag,
+	int hash_flag)
 {
 	struct file_info *dupl_ptr = malloc(sizeof(struct file_info));
 
@@ -1855,11 +2685,18 @@ struct file_info *add_non_dup(long long file_size, long long bytes,
 	dupl_ptr->fragment_checksum = fragment_checksum;
 	dupl_ptr->have_frag_checksum = checksum_frag_flag;
 	dupl_ptr->have_checksum = checksum_flag;
+	dupl_ptr->hash = hash;
+	dupl_ptr->have_hash = hash_flag;
 
 	pthread_cleanup_push((void *) pthread_mutex_unlock, &dup_mutex);
         pthread_mutex_lock(&dup_mutex);
 	dupl_ptr->next = dupl[DUP_HASH(file_size)];
 	dupl[DUP_HASH(file_size)] = dupl_ptr;
+	if(hash_flag) {
+		dupl_ptr->hash_next = dupl_hash[DUP_HASH(hash)];
+		dupl_hash[DUP_HASH(hash)] = dupl_ptr;
+	} else
+		unhashed_files ++;
 	dup_files ++;
 	pthread_cleanup_pop(1);
 
@@ -1873,31 +2710,34 @@ struct fragment *frag_duplicate(struct file_buffer *file_buffer, char *dont_put)
 	struct file_buffer *buffer;
 	struct file_info *dupl_start = file_buffer->dupl_start;
 	long long file_size = file_buffer->file_size;
-	unsigned short checksum = file_buffer->checksum;
+	unsigned long long hash = hash64_combine(0, file_buffer->hash);
 	int res;
 
 	if(file_buffer->duplicate) {
 		TRACE("Found duplicate file, fragment %d, size %d, offset %d, "
-			"checksum 0x%x\n", dupl_start->fragment->index,
-			file_size, dupl_start->fragment->offset, checksum);
+			"hash 0x%llx\n", dupl_start->fragment->index,
+			file_size, dupl_start->fragment->offset, hash);
 		*dont_put = TRUE;
 		return dupl_start->fragment;
 	} else {
 		*dont_put = FALSE;
-		dupl_ptr = dupl[DUP_HASH(file_size)];
+		dupl_ptr = dupl_hash[DUP_HASH(hash)];
 	}
 
-	for(; dupl_ptr && dupl_ptr != dupl_start; dupl_ptr = dupl_ptr->next) {
-		if(file_size == dupl_ptr->file_size && file_size ==
-				dupl_ptr->fragment->size) {
-			if(get_fragment_checksum(dupl_ptr) == checksum) {
-				buffer = get_fragment(dupl_ptr->fragment);
-				res = memcmp(file_buffer->data, buffer->data +
-					dupl_ptr->fragment->offset, file_size);
-				cache_block_put(buffer);
-				if(res == 0)
-					break;
-			}
+	/*
+	 * The process fragment threads have already checked the files
+	 * from dupl_start onwards, only check the files added since
+	 */
+	for(; dupl_ptr && dupl_ptr != dupl_start;
+					dupl_ptr = dupl_ptr->hash_next) {
+		if(hash == dupl_ptr->hash && file_size == dupl_ptr->file_size &&
+				file_size == dupl_ptr->fragment->size) {
+			buffer = get_fragment(dupl_ptr->fragment);
+			res = memcmp(file_buffer->data, buffer->data +
+				dupl_ptr->fragment->offset, file_size);
+			cache_block_put(buffer);
+			if(res == 0)
+				break;
 		}
 	}
 
@@ -1905,36 +2745,143 @@ struct fragment *frag_duplicate(struct file_buffer *file_buffer, char *dont_put)
 		return NULL;
 
 	TRACE("Found duplicate file, fragment %d, size %d, offset %d, "
-		"checksum 0x%x\n", dupl_ptr->fragment->index, file_size,
-		dupl_ptr->fragment->offset, checksum);
+		"hash 0x%llx\n", dupl_ptr->fragment->index, file_size,
+		dupl_ptr->fragment->offset, hash);
 
 	return dupl_ptr->fragment;
 }
 
 
+/*
+ * Compare the data blocks of the file just written at target_start against
+ * those at dup_start.  Returns TRUE if they are the same
+ */
+static int data_match(long long target_start, long long dup_start,
+	unsigned int *block_list, int blocks)
+{
+	int block, res;
+
+	for(block = 0; block < blocks; block ++) {
+		int size = SQUASHFS_COMPRESSED_SIZE_BLOCK(block_list[block]);
+		struct file_buffer *target_buffer = NULL;
+		struct file_buffer *dup_buffer = NULL;
+		char *target_data, *dup_data;
+
+		if(size == 0)
+			continue;
+		target_buffer = cache_lookup(bwriter_buffer, target_start);
+		if(target_buffer)
+			target_data = target_buffer->data;
+		else {
+			target_data = read_from_disk(target_start, size);
+			if(target_data == NULL) {
+				ERROR("Failed to read data from output "
+					"filesystem\n");
+				BAD_ERROR("Output filesystem corrupted?\n");
+			}
+		}
+
+		dup_buffer = cache_lookup(bwriter_buffer, dup_start);
+		if(dup_buffer)
+			dup_data = dup_buffer->data;
+		else {
+			dup_data = read_from_disk2(dup_start, size);
+			if(dup_data == NULL) {
+				ERROR("Failed to read data from output "
+					"filesystem\n");
+				BAD_ERROR("Output filesystem corrupted?\n");
+			}
+		}
+
+		res = memcmp(target_data, dup_data, size);
+		cache_block_put(target_buffer);
+		cache_block_put(dup_buffer);
+		if(res != 0)
+			return FALSE;
+		target_start += size;
+		dup_start += size;
+	}
+
+	return TRUE;
+}
+
+
+/*
+ * Compare the data blocks and fragment of the file just written against
+ * the possible duplicate dupl_ptr.  Returns TRUE if they are the same
+ */
+static int duplicate_match(struct file_info *dupl_ptr, unsigned int *block_list,
+	long long start, struct file_buffer *file_buffer, int blocks)
+{
+	int frag_bytes = file_buffer ? file_buffer->size : 0;
+	struct file_buffer *frag_buffer;
+	int res;
+
+	if(!data_match(start, dupl_ptr->start, block_list, blocks))
+		return FALSE;
+
+	if(frag_bytes == 0)
+		return TRUE;
+
+	frag_buffer = get_fragment(dupl_ptr->fragment);
+	res = memcmp(file_buffer->data, frag_buffer->data +
+		dupl_ptr->fragment->offset, frag_bytes);
+	cache_block_put(frag_buffer);
+
+	return res == 0;
+}
+
+
+/*
+ * Look for a duplicate of the file just written, returning it or NULL.
+ * The caller adds the file to the duplicate table if there isn't one,
+ * once its fragment is known, because the duplicate threads may be
+ * looking at the table at the same time
+ */
 struct file_info *duplicate(long long file_size, long long bytes,
-	unsigned int **block_list, long long *start, struct fragment **fragment,
-	struct file_buffer *file_buffer, int blocks, unsigned short checksum,
-	int checksum_flag)
+	unsigned int *block_list, long long start,
+	struct file_buffer *file_buffer, int blocks, unsigned long long hash)
 {
-	struct file_info *dupl_ptr = dupl[DUP_HASH(file_size)];
+	struct file_info *dupl_ptr;
 	int frag_bytes = file_buffer ? file_buffer->size : 0;
 	unsigned short fragment_checksum = file_buffer ?
 		file_buffer->checksum : 0;
+	unsigned short checksum = 0;
+	int checksum_flag = FALSE;
 
-	for(; dupl_ptr; dupl_ptr = dupl_ptr->next)
-		if(file_size == dupl_ptr->file_size && bytes == dupl_ptr->bytes
-				 && frag_bytes == dupl_ptr->fragment->size) {
-			long long target_start, dup_start = dupl_ptr->start;
-			int block;
+	/*
+	 * Only files with the same content hash can be duplicates, these
+	 * are compared in full to rule out hash collisions.  This means the
+	 * output filesystem is only re-read to check likely duplicates
+	 */
+	for(dupl_ptr = dupl_hash[DUP_HASH(hash)]; dupl_ptr;
+					dupl_ptr = dupl_ptr->hash_next)
+		if(hash == dupl_ptr->hash && file_size == dupl_ptr->file_size
+				&& bytes == dupl_ptr->bytes && frag_bytes ==
+				dupl_ptr->fragment->size && memcmp(block_list,
+				dupl_ptr->block_list, blocks *
+				sizeof(unsigned int)) == 0 &&
+				duplicate_match(dupl_ptr, block_list, start,
+				file_buffer, blocks))
+			goto found;
 
-			if(memcmp(*block_list, dupl_ptr->block_list, blocks *
+	/*
+	 * Files from the filesystem being appended to don't have a content
+	 * hash, and so fall back to checking all files of the same size,
+	 * using checksums to eliminate most of them
+	 */
+	for(dupl_ptr = unhashed_files ? dupl[DUP_HASH(file_size)] : NULL;
+				dupl_ptr; dupl_ptr = dupl_ptr->next)
+		if(!dupl_ptr->have_hash && file_size == dupl_ptr->file_size &&
+				bytes == dupl_ptr->bytes && frag_bytes ==
+				dupl_ptr->fragment->size) {
+			if(memcmp(block_list, dupl_ptr->block_list, blocks *
 					sizeof(unsigned int)) != 0)
 				continue;
 
 			if(checksum_flag == FALSE) {
-				checksum = get_checksum_disk(*start, bytes,
-					*block_list);
+				checksum = get_checksum_disk(start, bytes,
+					block_list);
 				checksum_flag = TRUE;
 			}
 
@@ -1950,147 +2897,366 @@ struct file_info *duplicate(long long file_size, long long bytes,
 					get_fragment_checksum(dupl_ptr))
 				continue;
 
-			target_start = *start;
-			for(block = 0; block < blocks; block ++) {
-				int size = SQUASHFS_COMPRESSED_SIZE_BLOCK
-					((*block_list)[block]);
-				struct file_buffer *target_buffer = NULL;
-				struct file_buffer *dup_buffer = NULL;
-				char *target_data, *dup_data;
-				int res;
-
-				if(size == 0)
-					continue;
-				target_buffer = cache_lookup(bwriter_buffer,
-					target_start);
-				if(target_buffer)
-					target_data = target_buffer->data;
-				else {
-					target_data =
-						read_from_disk(target_start,
-						size);
-					if(target_data == NULL) {
-						ERROR("Failed to read data from"
-							" output filesystem\n");
-						BAD_ERROR("Output filesystem"
-							" corrupted?\n");
-					}
-				}
-
-				dup_buffer = cache_lookup(bwriter_buffer,
-					dup_start);
-				if(dup_buffer)
-					dup_data = dup_buffer->data;
-				else {
-					dup_data = read_from_disk2(dup_start,
-						size);
-					if(dup_data == NULL) {
-						ERROR("Failed to read data from"
-							" output filesystem\n");
-						BAD_ERROR("Output filesystem"
-							" corrupted?\n");
-					}
-				}
-
-				res = memcmp(target_data, dup_data, size);
-				cache_block_put(target_buffer);
-				cache_block_put(dup_buffer);
-				if(res != 0)
-					break;
-				target_start += size;
-				dup_start += size;
-			}
-			if(block == blocks) {
-				struct file_buffer *frag_buffer =
-					get_fragment(dupl_ptr->fragment);
-
-				if(frag_bytes == 0 ||
-						memcmp(file_buffer->data,
-						frag_buffer->data +
-						dupl_ptr->fragment->offset,
-						frag_bytes) == 0) {
-					TRACE("Found duplicate file, start "
-						"0x%llx, size %lld, checksum "
-						"0x%x, fragment %d, size %d, "
-						"offset %d, checksum 0x%x\n",
-						dupl_ptr->start,
-						dupl_ptr->bytes,
-						dupl_ptr->checksum,
-						dupl_ptr->fragment->index,
-						frag_bytes,
-						dupl_ptr->fragment->offset,
-						fragment_checksum);
-					*block_list = dupl_ptr->block_list;
-					*start = dupl_ptr->start;
-					*fragment = dupl_ptr->fragment;
-					cache_block_put(frag_buffer);
-					return 0;
-				}
-				cache_block_put(frag_buffer);
-			}
+			if(duplicate_match(dupl_ptr, block_list, start,
+					file_buffer, blocks))
+				goto found;
 		}
 
+	return NULL;
 
-	return add_non_dup(file_size, bytes, *block_list, *start, *fragment,
-		checksum, fragment_checksum, checksum_flag, TRUE);
+found:
+	TRACE("Found duplicate file, start 0x%llx, size %lld, hash 0x%llx, "
+		"fragment %d, size %d, offset %d, checksum 0x%x\n",
+		dupl_ptr->start, dupl_ptr->bytes, dupl_ptr->hash,
+		dupl_ptr->fragment->index, frag_bytes,
+		dupl_ptr->fragment->offset, fragment_checksum);
+	return dupl_ptr;
 }
 
 
-inline int is_fragment(struct inode_info *inode)
+/*
+ * -block-duplicates index of the data blocks written, by content hash.
+ * Squashfs addresses a file's blocks from its start block, and so blocks
+ * can only be shared as a run: a file whose blocks are all the same (and
+ * in the same order) as a run of blocks already written, possibly spanning
+ * more than one file, can point at the run rather than storing them again
+ */
+static struct block_entry *block_table[65536];
+
+
+static void add_blocks(long long start, unsigned int *block_list,
+	unsigned long long *hashes, int blocks)
 {
-	off_t file_size = inode->buf.st_size;
+	int block;
 
-	/*
-	 * If this block is to be compressed differently to the
-	 * fragment compression then it cannot be a fragment
-	 */
-	if(inode->noF != noF)
-		return FALSE;
+	for(block = 0; block < blocks; block ++) {
+		int size = SQUASHFS_COMPRESSED_SIZE_BLOCK(block_list[block]);
+		struct block_entry *entry;
 
-	return !inode->no_fragments && file_size && (file_size < block_size ||
-		(inode->always_use_fragments && file_size & (block_size - 1)));
+		if(size == 0)
+			continue;
+
+		entry = malloc(sizeof(struct block_entry));
+		if(entry == NULL)
+			MEM_ERROR();
+
+		entry->hash = hashes[block];
+		entry->start = start;
+		entry->c_byte = block_list[block];
+		entry->next = block_table[DUP_HASH(hashes[block])];
+		block_table[DUP_HASH(hashes[block])] = entry;
+		start += size;
+	}
 }
 
 
-void put_file_buffer(struct file_buffer *file_buffer)
+static int block_at(unsigned long long hash, unsigned int c_byte,
+	long long start)
 {
-	/*
-	 * Decide where to send the file buffer:
-	 * - compressible non-fragment blocks go to the deflate threads,
-	 * - fragments go to the process fragment threads,
-	 * - all others go directly to the main thread
-	 */
-	if(file_buffer->error) {
-		file_buffer->fragment = 0;
-		seq_queue_put(to_main, file_buffer);
-	} else if (file_buffer->file_size == 0)
-		seq_queue_put(to_main, file_buffer);
- 	else if(file_buffer->fragment)
-		queue_put(to_process_frag, file_buffer);
-	else
-		queue_put(to_deflate, file_buffer);
+	struct block_entry *entry;
+
+	for(entry = block_table[DUP_HASH(hash)]; entry; entry = entry->next)
+		if(entry->start == start && entry->hash == hash &&
+							entry->c_byte == c_byte)
+			return TRUE;
+
+	return FALSE;
 }
 
 
-static int seq = 0;
-void reader_read_process(struct dir_ent *dir_ent)
+/*
+ * Look for a run of blocks already written which is the same as the
+ * blocks of the file just written at start, returning its start or -1
+ */
+static long long block_duplicate(long long start, unsigned int *block_list,
+	unsigned long long *hashes, int blocks)
 {
-	long long bytes = 0;
-	struct inode_info *inode = dir_ent->inode;
-	struct file_buffer *prev_buffer = NULL, *file_buffer;
-	int status, byte, res, child;
-	int file = pseudo_exec_file(get_pseudo_file(inode->pseudo_id), &child);
+	struct block_entry *entry;
+	int first, block;
 
-	if(!file) {
-		file_buffer = cache_get_nohash(reader_buffer);
-		file_buffer->sequence = seq ++;
-		goto read_err;
+	for(first = 0; first < blocks && SQUASHFS_COMPRESSED_SIZE_BLOCK
+					(block_list[first]) == 0; first ++);
+	if(first == blocks)
+		return -1;
+
+	for(entry = block_table[DUP_HASH(hashes[first])]; entry;
+						entry = entry->next) {
+		long long run = entry->start;
+
+		if(entry->hash != hashes[first] ||
+					entry->c_byte != block_list[first])
+			continue;
+
+		for(block = first; block < blocks; block ++) {
+			int size = SQUASHFS_COMPRESSED_SIZE_BLOCK
+							(block_list[block]);
+
+			if(size == 0)
+				continue;
+			if(!block_at(hashes[block], block_list[block], run))
+				break;
+			run += size;
+		}
+
+		if(block == blocks && data_match(start, entry->start,
+							block_list, blocks)) {
+			TRACE("Found duplicate blocks, start 0x%llx, run "
+				"0x%llx\n", start, entry->start);
+			block_dup_files ++;
+			return entry->start;
+		}
 	}
 
-	while(1) {
-		file_buffer = cache_get_nohash(reader_buffer);
+	return -1;
+}
+
+
+/*
+ * Remove the blocks of the file just written at start from the output
+ * filesystem, the file pointing at an earlier copy of them instead
+ */
+static void truncate_output(long long start)
+{
+	int res;
+
+	bytes = start;
+	if(block_device)
+		return;
+
+	queue_put(to_writer, NULL);
+	if(queue_get(from_writer) != 0)
+		EXIT_MKSQUASHFS();
+	res = ftruncate(fd, bytes);
+	if(res != 0)
+		BAD_ERROR("Failed to truncate dest file because %s\n",
+			strerror(errno));
+}
+
+
+inline int is_fragment(struct inode_info *inode)
+{
+	off_t file_size = inode->buf.st_size;
+
+	/*
+	 * If this block is to be compressed differently to the
+	 * fragment compression then it cannot be a fragment
+	 */
+	if(inode->noF != noF)
+		return FALSE;
+
+	return !inode->no_fragments && file_size && (file_size < block_size ||
+		(inode->always_use_fragments && file_size & (block_size - 1)));
+}
+
+
+void put_file_buffer(struct file_buffer *file_buffer)
+{
+	/*
+	 * Decide where to send the file buffer:
+	 * - compressible non-fragment blocks go to the deflate threads,
+	 * - fragments go to the process fragment threads,
+	 * - all others go directly to the main thread
+	 */
+	if(file_buffer->error) {
+		file_buffer->fragment = 0;
+		seq_queue_put(to_main, file_buffer);
+	} else if (file_buffer->file_size == 0)
+		seq_queue_put(to_main, file_buffer);
+ 	else if(file_buffer->fragment) {
+		STATS_BLOCK(file_buffer->size, file_buffer->size);
+		queue_put(to_process_frag[numa_this_node()], file_buffer);
+	} else {
+		STATS_BLOCK(file_buffer->size, file_buffer->size);
+		queue_put(to_deflate[numa_this_node()], file_buffer);
+	}
+}
+
+
+/*
+ * Reader thread pool.
+ *
+ * The reader thread walks the directory tree (or the sort priority list)
+ * as before, but rather than reading the files itself it hands each file to
+ * the pool of reader threads in the order it would have read them, each
+ * file being given a ticket number.  The reader threads read files in
+ * parallel, but only the thread whose ticket matches next_ticket (the head)
+ * may pass buffers on to the rest of the pipeline.  Any other reader reads
+ * ahead into a small pending list, and waits its turn once this list is
+ * full.  Sequence numbers are allocated at the time buffers are passed on,
+ * and so the output is identical to a single reader.
+ *
+ * With one reader the reader thread reads the files itself.
+ */
+struct reader {
+	int ticket;
+	int head;
+	int pending_count;
+	struct file_buffer **pending;
+	char *pathname;
+	int size;
+};
+
+struct read_job {
+	struct dir_ent *dir_ent;
+	int ticket;
+	int process;
+};
+
+static int seq = 0;
+static int next_ticket = 0;
+static int tickets = 0;
+static pthread_mutex_t reader_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reader_turn = PTHREAD_COND_INITIALIZER;
+
+
+/* Called with the reader mutex held */
+static void reader_wait_head(struct reader *reader)
+{
+	while(reader->ticket != next_ticket)
+		pthread_cond_wait(&reader_turn, &reader_mutex);
+
+	reader->head = TRUE;
+}
+
+
+static void reader_become_head(struct reader *reader)
+{
+	int i;
+
+	pthread_cleanup_push((void *) pthread_mutex_unlock, &reader_mutex);
+	pthread_mutex_lock(&reader_mutex);
+	reader_wait_head(reader);
+	pthread_cleanup_pop(1);
+
+	for(i = 0; i < reader->pending_count; i++) {
+		reader->pending[i]->sequence = seq ++;
+		put_file_buffer(reader->pending[i]);
+	}
+
+	reader->pending_count = 0;
+}
+
+
+static struct file_buffer *reader_get_buffer(struct reader *reader)
+{
+	/*
+	 * A reader which isn't the head must not hold more than reader_readahead
+	 * buffers, otherwise the head may be unable to get a buffer from
+	 * the reader cache, and deadlock
+	 */
+	struct file_buffer *file_buffer;
+
+	if(!reader->head && reader->pending_count + 1 > reader_readahead)
+		reader_become_head(reader);
+
+	file_buffer = cache_get_nohash(reader_buffer);
+	file_buffer->hole = FALSE;
+	return file_buffer;
+}
+
+
+static struct file_buffer *reader_get_view(struct reader *reader,
+	struct file_map *map, long long offset)
+{
+	struct file_buffer *file_buffer;
+
+	if(!reader->head && reader->pending_count + 1 > reader_readahead)
+		reader_become_head(reader);
+
+	file_buffer = cache_get_view(reader_buffer, map, offset);
+	file_buffer->hole = FALSE;
+	return file_buffer;
+}
+
+
+static void reader_put_buffer(struct reader *reader,
+	struct file_buffer *file_buffer)
+{
+	if(!reader->head) {
+		int turn;
+
+		pthread_cleanup_push((void *) pthread_mutex_unlock,
+			&reader_mutex);
+		pthread_mutex_lock(&reader_mutex);
+		turn = reader->ticket == next_ticket;
+		pthread_cleanup_pop(1);
+
+		if(turn)
+			reader_become_head(reader);
+	}
+
+	if(reader->head) {
 		file_buffer->sequence = seq ++;
+		put_file_buffer(file_buffer);
+	} else
+		reader->pending[reader->pending_count ++] = file_buffer;
+}
+
+
+static void reader_done(struct reader *reader)
+{
+	if(!reader->head)
+		reader_become_head(reader);
+
+	pthread_cleanup_push((void *) pthread_mutex_unlock, &reader_mutex);
+	pthread_mutex_lock(&reader_mutex);
+	next_ticket ++;
+	reader->head = FALSE;
+	pthread_cond_broadcast(&reader_turn);
+	pthread_cleanup_pop(1);
+}
+
+
+/*
+ * With -adaptive, check the first block of each file, and if it looks
+ * incompressible, store the following blocks of the file uncompressed
+ * without checking them.  In case the file changes content part way
+ * through, the decision is rechecked every ADAPTIVE_RECHECK blocks.
+ * Blocks going into fragments are compressed with the fragment
+ */
+static void adaptive_block(struct inode_info *inode,
+	struct file_buffer *file_buffer, long long block)
+{
+	if(!adaptive || inode->noD || file_buffer->fragment ||
+			file_buffer->hole || file_buffer->size == 0)
+		return;
+
+	if(block % ADAPTIVE_RECHECK == 0)
+		inode->incompressible = block_entropy(file_buffer->data,
+			file_buffer->size) >= ENTROPY_INCOMPRESSIBLE;
+
+	file_buffer->noD = inode->incompressible;
+}
+
+
+static char *reader_pathname(struct reader *reader, struct dir_ent *dir_ent)
+{
+	if(dir_ent->nonstandard_pathname)
+		return dir_ent->nonstandard_pathname;
+
+	return reader->pathname = _pathname(dir_ent, reader->pathname,
+		&reader->size);
+}
+
+
+void reader_read_process(struct reader *reader, struct dir_ent *dir_ent)
+{
+	long long bytes = 0;
+	struct inode_info *inode = dir_ent->inode;
+	struct file_buffer *prev_buffer = NULL, *file_buffer;
+	int status, byte, res, child, block = 0;
+	int file = pseudo_exec_file(get_pseudo_file(inode->pseudo_id), &child);
+
+	inode->effort = deadline_effort();
+	if(!file) {
+		file_buffer = reader_get_buffer(reader);
+		goto read_err;
+	}
+
+	while(1) {
+		file_buffer = reader_get_buffer(reader);
 		file_buffer->noD = inode->noD;
+		file_buffer->effort = inode->effort;
 
 		byte = read_bytes(file, file_buffer->data, block_size);
 		if(byte == -1)
@@ -2114,8 +3280,10 @@ void reader_read_process(struct dir_ent *dir_ent)
 		 */ 
 		progress_bar_size(1);
 
-		if(prev_buffer)
-			put_file_buffer(prev_buffer);
+		if(prev_buffer) {
+			adaptive_block(inode, prev_buffer, block ++);
+			reader_put_buffer(reader, prev_buffer);
+		}
 		prev_buffer = file_buffer;
 	}
 
@@ -2133,13 +3301,12 @@ void reader_read_process(struct dir_ent *dir_ent)
 
 	if(prev_buffer == NULL)
 		prev_buffer = file_buffer;
-	else {
+	else
 		cache_block_put(file_buffer);
-		seq --;
-	}
 	prev_buffer->file_size = bytes;
 	prev_buffer->fragment = is_fragment(inode);
-	put_file_buffer(prev_buffer);
+	adaptive_block(inode, prev_buffer, block);
+	reader_put_buffer(reader, prev_buffer);
 
 	return;
 
@@ -2148,626 +3315,1008 @@ read_err2:
 read_err:
 	if(prev_buffer) {
 		cache_block_put(file_buffer);
-		seq --;
 		file_buffer = prev_buffer;
 	}
 	file_buffer->error = TRUE;
-	put_file_buffer(file_buffer);
+	reader_put_buffer(reader, file_buffer);
 }
 
 
-void reader_read_file(struct dir_ent *dir_ent)
+/*
+ * Read the data of a file from the archive (-tar and -cpio).  The file is
+ * queued to the main thread first, which writes it as the data arrives
+ */
+static void reader_read_archive(struct reader *reader, struct dir_ent *dir_ent)
 {
-	struct stat *buf = &dir_ent->inode->buf, buf2;
-	struct file_buffer *file_buffer;
-	int blocks, file, res;
-	long long bytes, read_size;
 	struct inode_info *inode = dir_ent->inode;
-
-	if(inode->read)
-		return;
+	long long size = inode->buf.st_size, bytes = 0;
+	int blocks = (size + block_size - 1) >> block_log;
+	struct file_buffer *file_buffer;
 
 	inode->read = TRUE;
-again:
-	bytes = 0;
-	read_size = buf->st_size;
-	blocks = (read_size + block_size - 1) >> block_log;
-
-	file = open(pathname_reader(dir_ent), O_RDONLY);
-	if(file == -1) {
-		file_buffer = cache_get_nohash(reader_buffer);
-		file_buffer->sequence = seq ++;
-		goto read_err2;
-	}
+	inode->effort = deadline_effort();
+	reader->ticket = tickets ++;
+	queue_put(to_archive, dir_ent);
 
 	do {
-		file_buffer = cache_get_nohash(reader_buffer);
-		file_buffer->file_size = read_size;
-		file_buffer->sequence = seq ++;
+		int expected = size - bytes > block_size ? block_size :
+			size - bytes;
+
+		file_buffer = reader_get_buffer(reader);
+		file_buffer->file_size = size;
 		file_buffer->noD = inode->noD;
+		file_buffer->effort = inode->effort;
 		file_buffer->error = FALSE;
 
-		/*
-		 * Always try to read block_size bytes from the file rather
-		 * than expected bytes (which will be less than the block_size
-		 * at the file tail) to check that the file hasn't grown
-		 * since being stated.  If it is longer (or shorter) than
-		 * expected, then restat, and try again.  Note the special
-		 * case where the file is an exact multiple of the block_size
-		 * is dealt with later.
-		 */
-		file_buffer->size = read_bytes(file, file_buffer->data,
-			block_size);
-		if(file_buffer->size == -1)
-			goto read_err;
+		file_buffer->size = archive_read(archive, file_buffer->data,
+			expected);
+		if(file_buffer->size != expected)
+			BAD_ERROR("Unexpected end of archive \"%s\" reading "
+				"%s\n", archive->filename, archive->name);
 
 		bytes += file_buffer->size;
 
-		if(blocks > 1) {
-			/* non-tail block should be exactly block_size */
-			if(file_buffer->size < block_size)
-				goto restat;
-
+		if(-- blocks > 0) {
 			file_buffer->fragment = FALSE;
-			put_file_buffer(file_buffer);
+			adaptive_block(inode, file_buffer,
+				(bytes >> block_log) - 1);
+			reader_put_buffer(reader, file_buffer);
 		}
-	} while(-- blocks > 0);
-
-	/* Overall size including tail should match */
-	if(read_size != bytes)
-		goto restat;
-
-	if(read_size && read_size % block_size == 0) {
-		/*
-		 * Special case where we've not tried to read past the end of
-		 * the file.  We expect to get EOF, i.e. the file isn't larger
-		 * than we expect.
-		 */
-		char buffer;
-		int res;
+	} while(blocks > 0);
 
-		res = read_bytes(file, &buffer, 1);
-		if(res == -1)
-			goto read_err;
+	file_buffer->fragment = is_fragment(inode);
+	adaptive_block(inode, file_buffer, (bytes - 1) >> block_log);
+	reader_put_buffer(reader, file_buffer);
 
-		if(res != 0)
-			goto restat;
-	}
+	reader_done(reader);
+}
 
-	file_buffer->fragment = is_fragment(inode);
-	put_file_buffer(file_buffer);
 
-	close(file);
+/*
+ * Holes in sparse files are found with SEEK_DATA/SEEK_HOLE, so blocks lying
+ * entirely within a hole don't need to be read and checked for zeros.  The
+ * current data extent is cached in struct holes, and a new one is only
+ * looked up once the reader has moved past it.  This moves the file
+ * position, and so holes->moved is set to tell the reader to seek back
+ */
+struct holes {
+	long long	data;
+	long long	hole;
+	int		moved;
+};
 
-	return;
 
-restat:
-	res = fstat(file, &buf2);
-	if(res == -1) {
-		ERROR("Cannot stat dir/file %s because %s\n",
-			pathname_reader(dir_ent), strerror(errno));
-		goto read_err;
-	}
+static void holes_init(struct holes *holes, long long size, long long blocks)
+{
+	/*
+	 * Only look for holes if the file has less blocks allocated than its
+	 * size, and is large enough that a block could be a hole
+	 */
+	if(sparse_files && size > block_size && (blocks << 9) < size)
+		holes->data = holes->hole = 0;
+	else
+		holes->data = holes->hole = -1;
 
-	if(read_size != buf2.st_size) {
-		close(file);
-		memcpy(buf, &buf2, sizeof(struct stat));
-		file_buffer->error = 2;
-		put_file_buffer(file_buffer);
-		goto again;
-	}
-read_err:
-	close(file);
-read_err2:
-	file_buffer->error = TRUE;
-	put_file_buffer(file_buffer);
+	holes->moved = FALSE;
 }
 
 
-void reader_scan(struct dir_info *dir) {
-	struct dir_ent *dir_ent = dir->list;
+static int block_is_hole(struct holes *holes, int file, long long offset)
+{
+#ifdef SEEK_DATA
+	if(holes->hole == -1)
+		return FALSE;
 
-	for(; dir_ent; dir_ent = dir_ent->next) {
-		struct stat *buf = &dir_ent->inode->buf;
-		if(dir_ent->inode->root_entry)
-			continue;
+	if(offset >= holes->hole) {
+		holes->moved = TRUE;
+		holes->data = lseek(file, offset, SEEK_DATA);
+		if(holes->data == -1) {
+			if(errno != ENXIO) {
+				/* not supported, treat the rest as data */
+				holes->data = holes->hole = -1;
+				return FALSE;
+			}
 
-		if(IS_PSEUDO_PROCESS(dir_ent->inode)) {
-			reader_read_process(dir_ent);
-			continue;
+			/* nothing but a hole to the end of the file */
+			holes->data = holes->hole = LLONG_MAX;
+		} else {
+			holes->hole = lseek(file, holes->data, SEEK_HOLE);
+			if(holes->hole == -1)
+				holes->hole = LLONG_MAX;
 		}
+	}
 
-		switch(buf->st_mode & S_IFMT) {
-			case S_IFREG:
-				reader_read_file(dir_ent);
-				break;
-			case S_IFDIR:
-				reader_scan(dir_ent->dir);
-				break;
-		}
-	}
+	return offset + block_size <= holes->data;
+#else
+	return FALSE;
+#endif
 }
 
 
-void *reader(void *arg)
+/*
+ * Read file by mapping it, and passing views of the mapping through to
+ * the deflate/fragment/main threads rather than copying the data into the
+ * reader buffers.  Returns FALSE if the file cannot be mapped, or if its size
+ * no longer matches the stat, in which case it should be read normally,
+ * TRUE if it has been read, and 2 if it changed size while being read and
+ * should be re-read.
+ *
+ * If the file is truncated while it is mapped, the SIGBUS handler replaces
+ * the missing pages with zeros.  A truncation seen before the file's last
+ * block is queued is re-read like any other change, but one after can only
+ * be warned about when the mapping is removed
+ */
+static int reader_read_mapped(struct reader *reader, struct dir_ent *dir_ent,
+	int file, long long read_size)
 {
-	if(!sorted)
-		reader_scan(queue_get(to_reader));
-	else {
-		int i;
-		struct priority_entry *entry;
+	struct inode_stat *buf = &dir_ent->inode->buf;
+	struct stat buf2;
+	struct inode_info *inode = dir_ent->inode;
+	struct file_buffer *file_buffer = NULL;
+	struct file_map *map;
+	struct holes holes;
+	long long offset;
 
-		queue_get(to_reader);
-		for(i = 65535; i >= 0; i--)
-			for(entry = priority_list[i]; entry;
-							entry = entry->next)
-				reader_read_file(entry->dir);
+	if(fstat(file, &buf2) == -1 || buf2.st_size != read_size)
+		return FALSE;
+
+	map = map_file(file, read_size, reader_pathname(reader, dir_ent));
+	if(map == NULL)
+		return FALSE;
+
+	holes_init(&holes, buf2.st_size, buf2.st_blocks);
+
+	for(offset = 0; offset < read_size; offset += block_size) {
+		file_buffer = reader_get_view(reader, map, offset);
+		file_buffer->file_size = read_size;
+		file_buffer->noD = inode->noD;
+		file_buffer->effort = inode->effort;
+		file_buffer->error = FALSE;
+		file_buffer->size = read_size - offset < block_size ?
+			read_size - offset : block_size;
+
+		if(offset + block_size < read_size) {
+			file_buffer->hole = block_is_hole(&holes, file, offset);
+			file_buffer->fragment = FALSE;
+			adaptive_block(inode, file_buffer, offset >> block_log);
+			reader_put_buffer(reader, file_buffer);
+		}
 	}
 
-	pthread_exit(NULL);
+	/*
+	 * check the file hasn't changed size while it was being read, or
+	 * been truncated and grown again, leaving zero-filled pages
+	 */
+	if(fstat(file, &buf2) == -1) {
+		ERROR("Cannot stat dir/file %s because %s\n",
+			reader_pathname(reader, dir_ent), strerror(errno));
+		unmap_file(map);
+		file_buffer->error = TRUE;
+		reader_put_buffer(reader, file_buffer);
+		return TRUE;
+	}
+
+	if(buf2.st_size != read_size || map_truncated(map)) {
+		discard_map(map);
+		unmap_file(map);
+		copy_inode_stat(buf, &buf2);
+		file_buffer->error = 2;
+		reader_put_buffer(reader, file_buffer);
+		return 2;
+	}
+
+	unmap_file(map);
+
+	file_buffer->fragment = is_fragment(inode);
+	adaptive_block(inode, file_buffer, (read_size - 1) >> block_log);
+	reader_put_buffer(reader, file_buffer);
+
+	return TRUE;
 }
 
 
-void *writer(void *arg)
+void reader_read_file(struct reader *reader, struct dir_ent *dir_ent)
 {
-	while(1) {
-		struct file_buffer *file_buffer = queue_get(to_writer);
-		off_t off;
+	struct inode_stat *buf = &dir_ent->inode->buf;
+	struct stat buf2;
+	struct file_buffer *file_buffer;
+	int blocks, file, res;
+	long long bytes, read_size;
+	struct inode_info *inode = dir_ent->inode;
+	struct holes holes;
 
-		if(file_buffer == NULL) {
-			queue_put(from_writer, NULL);
+again:
+	bytes = 0;
+	read_size = buf->st_size;
+	inode->effort = deadline_effort();
+	blocks = (read_size + block_size - 1) >> block_log;
+
+	file = open(reader_pathname(reader, dir_ent), O_RDONLY);
+	if(file == -1) {
+		file_buffer = reader_get_buffer(reader);
+		goto read_err2;
+	}
+
+	if(mmap_input && blocks > 1) {
+		res = reader_read_mapped(reader, dir_ent, file, read_size);
+		if(res) {
+			close(file);
+			if(res == 2)
+				goto again;
+			return;
+		}
+	}
+
+	holes_init(&holes, buf->st_size, buf->st_blocks);
+
+	do {
+		file_buffer = reader_get_buffer(reader);
+		file_buffer->file_size = read_size;
+		file_buffer->noD = inode->noD;
+		file_buffer->effort = inode->effort;
+		file_buffer->error = FALSE;
+
+		if(blocks > 1 && block_is_hole(&holes, file, bytes)) {
+			/*
+			 * Block lies entirely within a hole, it is known to
+			 * be zero without reading it
+			 */
+			file_buffer->hole = TRUE;
+			file_buffer->size = block_size;
+			file_buffer->fragment = FALSE;
+			bytes += block_size;
+			reader_put_buffer(reader, file_buffer);
 			continue;
 		}
 
-		off = file_buffer->block;
+		if(holes.moved) {
+			if(lseek(file, bytes, SEEK_SET) == -1)
+				goto read_err;
+			holes.moved = FALSE;
+		}
+
+		/*
+		 * Always try to read block_size bytes from the file rather
+		 * than expected bytes (which will be less than the block_size
+		 * at the file tail) to check that the file hasn't grown
+		 * since being stated.  If it is longer (or shorter) than
+		 * expected, then restat, and try again.  Note the special
+		 * case where the file is an exact multiple of the block_size
+		 * is dealt with later.
+		 */
+		file_buffer->size = read_bytes(file, file_buffer->data,
+			block_size);
+		if(file_buffer->size == -1)
+			goto read_err;
+
+		bytes += file_buffer->size;
 
-		pthread_cleanup_push((void *) pthread_mutex_unlock, &pos_mutex);
-		pthread_mutex_lock(&pos_mutex);
+		if(blocks > 1) {
+			/* non-tail block should be exactly block_size */
+			if(file_buffer->size < block_size)
+				goto restat;
 
-		if(lseek(fd, off, SEEK_SET) == -1) {
-			ERROR("writer: Lseek on destination failed because "
-				"%s, offset=0x%llx\n", strerror(errno), off);
-			BAD_ERROR("Probably out of space on output "
-				"%s\n", block_device ? "block device" :
-				"filesystem");
+			file_buffer->fragment = FALSE;
+			adaptive_block(inode, file_buffer,
+				(bytes >> block_log) - 1);
+			reader_put_buffer(reader, file_buffer);
 		}
+	} while(-- blocks > 0);
 
-		if(write_bytes(fd, file_buffer->data,
-				file_buffer->size) == -1)
-			BAD_ERROR("Failed to write to output %s\n",
-				block_device ? "block device" : "filesystem");
+	/* Overall size including tail should match */
+	if(read_size != bytes)
+		goto restat;
 
-		pthread_cleanup_pop(1);
+	if(read_size && read_size % block_size == 0) {
+		/*
+		 * Special case where we've not tried to read past the end of
+		 * the file.  We expect to get EOF, i.e. the file isn't larger
+		 * than we expect.
+		 */
+		char buffer;
+		int res;
 
-		cache_block_put(file_buffer);
+		res = read_bytes(file, &buffer, 1);
+		if(res == -1)
+			goto read_err;
+
+		if(res != 0)
+			goto restat;
 	}
-}
 
+	file_buffer->fragment = is_fragment(inode);
+	adaptive_block(inode, file_buffer, (bytes - 1) >> block_log);
+	reader_put_buffer(reader, file_buffer);
 
-int all_zero(struct file_buffer *file_buffer)
-{
-	int i;
-	long entries = file_buffer->size / sizeof(long);
-	long *p = (long *) file_buffer->data;
+	close(file);
 
-	for(i = 0; i < entries && p[i] == 0; i++);
+	return;
 
-	if(i == entries) {
-		for(i = file_buffer->size & ~(sizeof(long) - 1);
-			i < file_buffer->size && file_buffer->data[i] == 0;
-			i++);
+restat:
+	res = fstat(file, &buf2);
+	if(res == -1) {
+		ERROR("Cannot stat dir/file %s because %s\n",
+			reader_pathname(reader, dir_ent), strerror(errno));
+		goto read_err;
+	}
 
-		return i == file_buffer->size;
+	if(read_size != buf2.st_size) {
+		close(file);
+		copy_inode_stat(buf, &buf2);
+		file_buffer->error = 2;
+		reader_put_buffer(reader, file_buffer);
+		goto again;
 	}
+read_err:
+	close(file);
+read_err2:
+	file_buffer->error = TRUE;
+	reader_put_buffer(reader, file_buffer);
+}
 
-	return 0;
+
+static void reader_init(struct reader *reader)
+{
+	reader->ticket = -1;
+	reader->head = FALSE;
+	reader->pending_count = 0;
+	reader->pathname = NULL;
+	reader->size = ALLOC_SIZE;
+	reader->pending = NULL;
+
+	if(reader_readahead) {
+		reader->pending = malloc(reader_readahead *
+			sizeof(struct file_buffer *));
+		if(reader->pending == NULL)
+			MEM_ERROR();
+	}
 }
 
 
-void *deflator(void *arg)
+static void reader_read(struct reader *reader, struct read_job *job)
 {
-	struct file_buffer *write_buffer = cache_get_nohash(bwriter_buffer);
-	void *stream = NULL;
-	int res;
+	reader->ticket = job->ticket;
 
-	res = compressor_init(comp, &stream, block_size, 1);
-	if(res)
-		BAD_ERROR("deflator:: compressor_init failed\n");
+	if(job->process)
+		reader_read_process(reader, job->dir_ent);
+	else
+		reader_read_file(reader, job->dir_ent);
 
-	while(1) {
-		struct file_buffer *file_buffer = queue_get(to_deflate);
+	reader_done(reader);
 
-		if(sparse_files && all_zero(file_buffer)) { 
-			file_buffer->c_byte = 0;
-			seq_queue_put(to_main, file_buffer);
-		} else {
-			write_buffer->c_byte = mangle2(stream,
-				write_buffer->data, file_buffer->data,
-				file_buffer->size, block_size,
-				file_buffer->noD, 1);
-			write_buffer->sequence = file_buffer->sequence;
-			write_buffer->file_size = file_buffer->file_size;
-			write_buffer->block = file_buffer->block;
-			write_buffer->size = SQUASHFS_COMPRESSED_SIZE_BLOCK
-				(write_buffer->c_byte);
-			write_buffer->fragment = FALSE;
-			write_buffer->error = FALSE;
-			cache_block_put(file_buffer);
-			seq_queue_put(to_main, write_buffer);
-			write_buffer = cache_get_nohash(bwriter_buffer);
-		}
-	}
+	/* the job held a reference to its (loaded) spilled directory */
+	if(SPILL_LOADED(job->dir_ent->our_dir))
+		spill_put(job->dir_ent->our_dir);
 }
 
 
-void *frag_deflator(void *arg)
+void *reader_pool(void *arg)
 {
-	void *stream = NULL;
-	int res;
-
-	res = compressor_init(comp, &stream, block_size, 1);
-	if(res)
-		BAD_ERROR("frag_deflator:: compressor_init failed\n");
+	struct reader reader;
 
-	pthread_cleanup_push((void *) pthread_mutex_unlock, &fragment_mutex);
+	stats_thread(STATS_READER);
+	reader_init(&reader);
 
 	while(1) {
-		int c_byte, compressed_size;
-		struct file_buffer *file_buffer = queue_get(to_frag);
-		struct file_buffer *write_buffer =
-			cache_get(fwriter_buffer, file_buffer->block);
+		struct read_job *job = queue_get(to_read);
 
-		c_byte = mangle2(stream, write_buffer->data, file_buffer->data,
-			file_buffer->size, block_size, noF, 1);
-		compressed_size = SQUASHFS_COMPRESSED_SIZE_BLOCK(c_byte);
-		write_buffer->size = compressed_size;
-		pthread_mutex_lock(&fragment_mutex);
-		if(fragments_locked == FALSE) {
-			fragment_table[file_buffer->block].size = c_byte;
-			fragment_table[file_buffer->block].start_block = bytes;
-			write_buffer->block = bytes;
-			bytes += compressed_size;
-			fragments_outstanding --;
-			queue_put(to_writer, write_buffer);
-			pthread_mutex_unlock(&fragment_mutex);
-			TRACE("Writing fragment %lld, uncompressed size %d, "
-				"compressed size %d\n", file_buffer->block,
-				file_buffer->size, compressed_size);
-		} else {
-				add_pending_fragment(write_buffer, c_byte,
-					file_buffer->block);
-				pthread_mutex_unlock(&fragment_mutex);
-		}
-		cache_block_put(file_buffer);
+		reader_read(&reader, job);
+		free(job);
 	}
-
-	pthread_cleanup_pop(0);
 }
 
 
-struct file_buffer *get_file_buffer()
+static void reader_dispatch(struct dir_ent *dir_ent, int process)
 {
-	struct file_buffer *file_buffer = seq_queue_get(to_main);
+	static struct reader reader;
+	static int initialised = FALSE;
+	struct inode_info *inode = dir_ent->inode;
 
-	return file_buffer;
-}
+	/* hard linked files are only read once */
+	if(inode->read)
+		return;
 
+	inode->read = TRUE;
 
-void write_file_empty(squashfs_inode *inode, struct dir_ent *dir_ent,
-	struct file_buffer *file_buffer, int *duplicate_file)
-{
-	file_count ++;
-	*duplicate_file = FALSE;
-	cache_block_put(file_buffer);
-	create_inode(inode, NULL, dir_ent, SQUASHFS_FILE_TYPE, 0, 0, 0,
-		 NULL, &empty_fragment, NULL, 0);
-}
+	if(SPILL_LOADED(dir_ent->our_dir))
+		spill_get(dir_ent->our_dir);
 
+	if(readers == 1) {
+		struct read_job job = { dir_ent, tickets ++, process };
 
-void write_file_frag(squashfs_inode *inode, struct dir_ent *dir_ent,
-	struct file_buffer *file_buffer, int *duplicate_file)
-{
-	int size = file_buffer->file_size;
-	struct fragment *fragment;
-	unsigned short checksum = file_buffer->checksum;
-	char dont_put;
+		if(!initialised) {
+			reader_init(&reader);
+			initialised = TRUE;
+		}
 
-	fragment = frag_duplicate(file_buffer, &dont_put);
-	*duplicate_file = !fragment;
-	if(!fragment) {
-		fragment = get_and_fill_fragment(file_buffer, dir_ent);
-		if(duplicate_checking)
-			add_non_dup(size, 0, NULL, 0, fragment, 0, checksum,
-				TRUE, TRUE);
+		reader_read(&reader, &job);
+	} else {
+		struct read_job *job = malloc(sizeof(struct read_job));
+		if(job == NULL)
+			MEM_ERROR();
+
+		job->dir_ent = dir_ent;
+		job->ticket = tickets ++;
+		job->process = process;
+		queue_put(to_read, job);
 	}
+}
 
-	if(dont_put)
-		free(file_buffer);
-	else
-		cache_block_put(file_buffer);
 
-	total_bytes += size;
-	file_count ++;
+/*
+ * Start the commands for the dynamic pseudo files following dir_ent in its
+ * directory, so that up to processors of them run concurrently while the
+ * earlier files are read.  *ahead is the next entry to consider, and is
+ * advanced past the entries examined, started counts the commands started
+ * but not yet read
+ */
+static void reader_start_ahead(struct dir_ent *dir_ent,
+	struct dir_ent **ahead, int *started)
+{
+	struct dir_ent *entry;
 
-	inc_progress_bar();
+	if(get_pseudo_file(dir_ent->inode->pseudo_id)->fd != -1)
+		(*started) --;
 
-	create_inode(inode, NULL, dir_ent, SQUASHFS_FILE_TYPE, size, 0,
-			0, NULL, fragment, NULL, 0);
+	for(entry = *ahead; entry && *started < processors;
+						entry = entry->next) {
+		struct inode_info *inode = entry->inode;
 
-	if(!duplicate_checking)
-		free_fragment(fragment);
+		if(entry == dir_ent || inode->root_entry || inode->read ||
+						!IS_PSEUDO_PROCESS(inode))
+			continue;
+
+		if(pseudo_start_file(get_pseudo_file(inode->pseudo_id)))
+			(*started) ++;
+	}
+
+	*ahead = entry;
 }
 
 
-int write_file_process(squashfs_inode *inode, struct dir_ent *dir_ent,
-	struct file_buffer *read_buffer, int *duplicate_file)
-{
-	long long read_size, file_bytes, start;
-	struct fragment *fragment;
-	unsigned int *block_list = NULL;
-	int block = 0, status;
-	long long sparse = 0;
-	struct file_buffer *fragment_buffer = NULL;
+void reader_scan(struct dir_info *dir) {
+	struct dir_ent *dir_ent, *ahead;
+	int started = 0;
 
-	*duplicate_file = FALSE;
+	if(SPILLED(dir)) {
+		struct dir_info *loaded = spill_load(dir);
 
-	lock_fragments();
+		reader_scan(loaded);
+		spill_put(loaded);
+		return;
+	}
 
-	file_bytes = 0;
-	start = bytes;
-	while (1) {
-		read_size = read_buffer->file_size;
-		if(read_buffer->fragment)
-			fragment_buffer = read_buffer;
-		else {
-			block_list = realloc(block_list, (block + 1) *
-				sizeof(unsigned int));
-			if(block_list == NULL)
-				MEM_ERROR();
-			block_list[block ++] = read_buffer->c_byte;
-			if(read_buffer->c_byte) {
-				read_buffer->block = bytes;
-				bytes += read_buffer->size;
-				cache_hash(read_buffer, read_buffer->block);
-				file_bytes += read_buffer->size;
-				queue_put(to_writer, read_buffer);
-			} else {
-				sparse += read_buffer->size;
-				cache_block_put(read_buffer);
-			}
-		}
-		inc_progress_bar();
+	if(streaming) {
+		/* wait for the directory to be scanned */
+		pthread_cleanup_push((void *) pthread_mutex_unlock,
+			&scan_mutex);
+		pthread_mutex_lock(&scan_mutex);
+		while(!dir->ready)
+			pthread_cond_wait(&scan_ready, &scan_mutex);
+		pthread_cleanup_pop(1);
+	}
 
-		if(read_size != -1)
-			break;
+	ahead = dir->list;
+	for(dir_ent = dir->list; dir_ent; dir_ent = dir_ent->next) {
+		struct inode_stat *buf = &dir_ent->inode->buf;
+		if(dir_ent->inode->root_entry)
+			continue;
 
-		read_buffer = get_file_buffer();
-		if(read_buffer->error)
-			goto read_err;
+		if(IS_PSEUDO_PROCESS(dir_ent->inode)) {
+			reader_start_ahead(dir_ent, &ahead, &started);
+			reader_dispatch(dir_ent, TRUE);
+			continue;
+		}
+
+		switch(buf->st_mode & S_IFMT) {
+			case S_IFREG:
+				reader_dispatch(dir_ent, FALSE);
+				break;
+			case S_IFDIR:
+				reader_scan(dir_ent->dir);
+				break;
+		}
 	}
+}
 
-	unlock_fragments();
-	fragment = get_and_fill_fragment(fragment_buffer, dir_ent);
 
-	if(duplicate_checking)
-		add_non_dup(read_size, file_bytes, block_list, start, fragment,
-			0, fragment_buffer ? fragment_buffer->checksum : 0,
-			FALSE, TRUE);
-	cache_block_put(fragment_buffer);
-	file_count ++;
-	total_bytes += read_size;
+void *reader(void *arg)
+{
+	stats_thread(STATS_READER);
 
-	create_inode(inode, NULL, dir_ent, SQUASHFS_FILE_TYPE, read_size, start,
-		 block, block_list, fragment, NULL, sparse);
+	if(archive_format)
+		reader_archive(queue_get(to_reader));
+	else if(!sorted) {
+		struct dir_info *root = queue_get(to_reader);
 
-	if(duplicate_checking == FALSE) {
-		free(block_list);
-		free_fragment(fragment);
+		/* root is NULL if the source couldn't be scanned */
+		if(root)
+			reader_scan(root);
+	} else {
+		int i;
+		struct priority_entry *entry;
+
+		queue_get(to_reader);
+		for(i = 0; i < trace_count; i++)
+			for(entry = trace_list[i]; entry;
+							entry = entry->next)
+				reader_dispatch(entry->dir, FALSE);
+		for(i = 65535; i >= 0; i--)
+			for(entry = priority_list[i]; entry;
+							entry = entry->next)
+				reader_dispatch(entry->dir, FALSE);
 	}
 
-	return 0;
+	pthread_exit(NULL);
+}
 
-read_err:
-	dec_progress_bar(block);
-	status = read_buffer->error;
-	bytes = start;
-	if(!block_device) {
-		int res;
 
-		queue_put(to_writer, NULL);
-		if(queue_get(from_writer) != 0)
-			EXIT_MKSQUASHFS();
-		res = ftruncate(fd, bytes);
-		if(res != 0)
-			BAD_ERROR("Failed to truncate dest file because %s\n",
-				strerror(errno));
+/*
+ * Write the buffers described by iov to the output at off.  pwritev()
+ * doesn't use (or move) the file position, and so unlike
+ * write_destination() this doesn't need the pos_mutex
+ */
+static int write_vector(int fd, struct iovec *iov, int count, off_t off)
+{
+	while(count) {
+		ssize_t res = pwritev(fd, iov, count, off);
+
+		if(res == -1) {
+			if(errno == EINTR)
+				continue;
+			ERROR("Write failed because %s\n", strerror(errno));
+			return -1;
+		}
+
+		off += res;
+
+		/* step over the buffers written, and any partially written */
+		for(; count && res >= iov->iov_len; iov ++, count --)
+			res -= iov->iov_len;
+
+		if(count) {
+			iov->iov_base += res;
+			iov->iov_len -= res;
+		}
 	}
-	unlock_fragments();
-	free(block_list);
-	cache_block_put(read_buffer);
-	return status;
+
+	return 0;
 }
 
 
-int write_file_blocks_dup(squashfs_inode *inode, struct dir_ent *dir_ent,
-	struct file_buffer *read_buffer, int *duplicate_file)
+void *writer(void *arg)
 {
-	int block, thresh;
-	long long read_size = read_buffer->file_size;
-	long long file_bytes, dup_start, start;
-	struct fragment *fragment;
-	struct file_info *dupl_ptr;
-	int blocks = (read_size + block_size - 1) >> block_log;
-	unsigned int *block_list, *block_listp;
-	struct file_buffer **buffer_list;
-	int status;
-	long long sparse = 0;
-	struct file_buffer *fragment_buffer = NULL;
-
-	block_list = malloc(blocks * sizeof(unsigned int));
-	if(block_list == NULL)
-		MEM_ERROR();
-	block_listp = block_list;
+	struct file_buffer *buffer[WRITER_BATCH], *next = NULL;
+	struct iovec iov[WRITER_BATCH];
+	int have_next = FALSE;
 
-	buffer_list = malloc(blocks * sizeof(struct file_buffer *));
-	if(buffer_list == NULL)
-		MEM_ERROR();
+	stats_thread(STATS_WRITER);
 
-	lock_fragments();
+	while(1) {
+		struct file_buffer *file_buffer = have_next ? next :
+			queue_get(to_writer);
+		long long end;
+		int i, count;
 
-	file_bytes = 0;
-	start = dup_start = bytes;
-	thresh = blocks > bwriter_size ? blocks - bwriter_size : 0;
+		/*
+		 * next may be the NULL end marker, which must not be
+		 * mistaken for there being no buffer
+		 */
+		have_next = FALSE;
 
-	for(block = 0; block < blocks;) {
-		if(read_buffer->fragment) {
-			block_list[block] = 0;
-			buffer_list[block] = NULL;
-			fragment_buffer = read_buffer;
-			blocks = read_size >> block_log;
-		} else {
-			block_list[block] = read_buffer->c_byte;
+		if(file_buffer == NULL) {
+			queue_put(from_writer, NULL);
+			continue;
+		}
 
-			if(read_buffer->c_byte) {
-				read_buffer->block = bytes;
-				bytes += read_buffer->size;
-				file_bytes += read_buffer->size;
-				cache_hash(read_buffer, read_buffer->block);
-				if(block < thresh) {
-					buffer_list[block] = NULL;
-					queue_put(to_writer, read_buffer);
-				} else
-					buffer_list[block] = read_buffer;
-			} else {
-				buffer_list[block] = NULL;
-				sparse += read_buffer->size;
-				cache_block_put(read_buffer);
+		/*
+		 * Merge any buffers already queued which are contiguous on
+		 * disk with this one, and write them with one system call.
+		 * This is the only thread taking buffers off to_writer, so
+		 * if it isn't empty queue_get() won't block
+		 */
+		buffer[0] = file_buffer;
+		end = file_buffer->block + file_buffer->size;
+		for(count = 1; count < WRITER_BATCH &&
+						!queue_empty(to_writer); count ++) {
+			next = queue_get(to_writer);
+			if(next == NULL || next->block != end) {
+				have_next = TRUE;
+				break;
 			}
+			buffer[count] = next;
+			end += next->size;
 		}
-		inc_progress_bar();
 
-		if(++block < blocks) {
-			read_buffer = get_file_buffer();
-			if(read_buffer->error)
-				goto read_err;
+		for(i = 0; i < count; i++) {
+			iov[i].iov_base = buffer[i]->data;
+			iov[i].iov_len = buffer[i]->size;
 		}
-	}
 
-	dupl_ptr = duplicate(read_size, file_bytes, &block_listp, &dup_start,
-		&fragment, fragment_buffer, blocks, 0, FALSE);
-
-	if(dupl_ptr) {
-		*duplicate_file = FALSE;
-		for(block = thresh; block < blocks; block ++)
-			if(buffer_list[block])
-				queue_put(to_writer, buffer_list[block]);
-		fragment = get_and_fill_fragment(fragment_buffer, dir_ent);
-		dupl_ptr->fragment = fragment;
-	} else {
-		*duplicate_file = TRUE;
-		for(block = thresh; block < blocks; block ++)
-			cache_block_put(buffer_list[block]);
-		bytes = start;
-		if(thresh && !block_device) {
-			int res;
+		if(write_vector(fd, iov, count, file_buffer->block) == -1)
+			BAD_ERROR("Failed to write to output %s\n",
+				block_device ? "block device" : "filesystem");
 
-			queue_put(to_writer, NULL);
-			if(queue_get(from_writer) != 0)
-				EXIT_MKSQUASHFS();
-			res = ftruncate(fd, bytes);
-			if(res != 0)
-				BAD_ERROR("Failed to truncate dest file because"
-					"  %s\n", strerror(errno));
+		for(i = 0; i < count; i++) {
+			/* write_vector() may have moved the iov buffers */
+			if(verity)
+				verity_write(buffer[i]->block,
+					buffer[i]->data, buffer[i]->size);
+			STATS_BLOCK(buffer[i]->size, buffer[i]->size);
+			cache_block_put(buffer[i]);
 		}
 	}
+}
 
-	unlock_fragments();
-	cache_block_put(fragment_buffer);
-	free(buffer_list);
-	file_count ++;
-	total_bytes += read_size;
-
-	/*
-	 * sparse count is needed to ensure squashfs correctly reports a
- 	 * a smaller block count on stat calls to sparse files.  This is
- 	 * to ensure intelligent applications like cp correctly handle the
- 	 * file as a sparse file.  If the file in the original filesystem isn't
- 	 * stored as a sparse file then still store it sparsely in squashfs, but
- 	 * report it as non-sparse on stat calls to preserve semantics
- 	 */
-	if(sparse && (dir_ent->inode->buf.st_blocks << 9) >= read_size)
-		sparse = 0;
 
-	create_inode(inode, NULL, dir_ent, SQUASHFS_FILE_TYPE, read_size,
-		dup_start, blocks, block_listp, fragment, NULL, sparse);
+#define ZERO_GROUP 16
 
-	if(*duplicate_file == TRUE)
-		free(block_list);
+int all_zero(struct file_buffer *file_buffer)
+{
+	int i, j;
+	long entries = file_buffer->size / sizeof(long);
+	long *p = (long *) file_buffer->data;
 
-	return 0;
+	/*
+	 * OR together groups of longs rather than testing them one by one,
+	 * this has no branches in the inner loop and so can be vectorised
+	 * by the compiler.  Blocks with data almost always fail in the
+	 * first group
+	 */
+	for(i = 0; i + ZERO_GROUP <= entries; i += ZERO_GROUP) {
+		long bits = 0;
 
-read_err:
-	dec_progress_bar(block);
-	status = read_buffer->error;
-	bytes = start;
-	if(thresh && !block_device) {
-		int res;
+		for(j = 0; j < ZERO_GROUP; j++)
+			bits |= p[i + j];
 
-		queue_put(to_writer, NULL);
-		if(queue_get(from_writer) != 0)
-			EXIT_MKSQUASHFS();
-		res = ftruncate(fd, bytes);
-		if(res != 0)
-			BAD_ERROR("Failed to truncate dest file because %s\n",
-				strerror(errno));
+		if(bits)
+			return 0;
 	}
-	unlock_fragments();
-	for(blocks = thresh; blocks < block; blocks ++)
-		cache_block_put(buffer_list[blocks]);
-	free(buffer_list);
-	free(block_list);
-	cache_block_put(read_buffer);
-	return status;
-}
 
+	for(; i < entries && p[i] == 0; i++);
 
-int write_file_blocks(squashfs_inode *inode, struct dir_ent *dir_ent,
-	struct file_buffer *read_buffer, int *dup)
-{
-	long long read_size = read_buffer->file_size;
-	long long file_bytes, start;
-	struct fragment *fragment;
-	unsigned int *block_list;
-	int block, status;
-	int blocks = (read_size + block_size - 1) >> block_log;
-	long long sparse = 0;
-	struct file_buffer *fragment_buffer = NULL;
+	if(i == entries) {
+		for(i = file_buffer->size & ~(sizeof(long) - 1);
+			i < file_buffer->size && file_buffer->data[i] == 0;
+			i++);
 
-	if(pre_duplicate(read_size))
-		return write_file_blocks_dup(inode, dir_ent, read_buffer, dup);
+		return i == file_buffer->size;
+	}
 
-	*dup = FALSE;
+	return 0;
+}
 
-	block_list = malloc(blocks * sizeof(unsigned int));
-	if(block_list == NULL)
+
+/*
+ * Pass the block compressed from file_buffer into write_buffer to the
+ * main thread
+ */
+static void deflator_put(struct file_buffer *file_buffer,
+	struct file_buffer *write_buffer, int c_byte)
+{
+	write_buffer->c_byte = c_byte;
+	write_buffer->sequence = file_buffer->sequence;
+	write_buffer->file_size = file_buffer->file_size;
+	write_buffer->block = file_buffer->block;
+	write_buffer->size = SQUASHFS_COMPRESSED_SIZE_BLOCK(c_byte);
+	write_buffer->fragment = FALSE;
+	write_buffer->error = FALSE;
+	if(duplicate_checking)
+		write_buffer->hash = hash64(write_buffer->data,
+			write_buffer->size, 0);
+	STATS_BLOCK(file_buffer->size, write_buffer->size);
+	cache_block_put(file_buffer);
+	seq_queue_put(to_main, write_buffer);
+}
+
+
+/* a block in flight on a compressor with a queue depth */
+struct deflate_job {
+	struct file_buffer *file_buffer;
+	struct file_buffer *write_buffer;
+};
+
+
+/*
+ * Deflator for compressors which can have several blocks in flight at
+ * once.  Each time around the deflator takes a batch of blocks, as many
+ * as it has idle jobs and buffers to compress them into, submits them,
+ * and then collects the blocks which have finished.  Blocks finish in any
+ * order, which the sequenced to_main queue puts right.
+ *
+ * The deflator only waits for blocks, or for a buffer to compress them
+ * into, when it has no blocks in flight, and only waits for a block to
+ * finish when it couldn't take any more.  Otherwise it could wait on the
+ * writer for a buffer, while the writer waits on a block the deflator holds
+ */
+static void async_deflator(struct compressor *comp, void *stream,
+	struct queue *queue, int depth)
+{
+	struct deflate_job *job = malloc(depth * sizeof(struct deflate_job));
+	struct deflate_job **idle = malloc(depth * sizeof(struct deflate_job *));
+	struct file_buffer **batch = malloc(depth * sizeof(struct file_buffer *));
+	struct file_buffer **spare = malloc(depth * sizeof(struct file_buffer *));
+	int i, idle_jobs = depth, spares = 0;
+
+	if(job == NULL || idle == NULL || batch == NULL || spare == NULL)
 		MEM_ERROR();
 
+	for(i = 0; i < depth; i++)
+		idle[i] = &job[i];
+
+	while(1) {
+		int blocks, wait, in_flight = idle_jobs < depth;
+
+		while(spares < idle_jobs) {
+			struct file_buffer *write_buffer = in_flight || spares ?
+				cache_get_nohash_nowait(bwriter_buffer) :
+				cache_get_nohash(bwriter_buffer);
+
+			if(write_buffer == NULL)
+				break;
+			spare[spares ++] = write_buffer;
+		}
+
+		blocks = queue_get_batch(queue, (void **) batch, spares,
+			!in_flight);
+
+		for(i = 0; i < blocks; i++) {
+			struct file_buffer *file_buffer = batch[i];
+			int error;
+
+			if(sparse_files && (file_buffer->hole ||
+						all_zero(file_buffer))) {
+				STATS_BLOCK(file_buffer->size, 0);
+				file_buffer->c_byte = 0;
+				seq_queue_put(to_main, file_buffer);
+			} else if(file_buffer->noD || (adaptive &&
+					block_entropy(file_buffer->data,
+					file_buffer->size) >=
+					ENTROPY_INCOMPRESSIBLE)) {
+				struct file_buffer *write_buffer =
+					spare[-- spares];
+
+				deflator_put(file_buffer, write_buffer,
+					mangle2(stream, write_buffer->data,
+					file_buffer->data, file_buffer->size,
+					block_size, TRUE, 1, -1));
+			} else {
+				struct deflate_job *next = idle[-- idle_jobs];
+
+				next->file_buffer = file_buffer;
+				next->write_buffer = spare[-- spares];
+				if(compressor_submit(comp, stream,
+						next->write_buffer->data,
+						file_buffer->data,
+						file_buffer->size, block_size,
+						next, &error) == -1)
+					BAD_ERROR("deflator:: %s compress "
+						"failed with error code %d\n",
+						comp->name, error);
+			}
+		}
+
+		for(wait = blocks == 0; idle_jobs < depth; wait = FALSE) {
+			struct deflate_job *done;
+			int error, c_byte = compressor_collect(comp, stream,
+				(void **) &done, wait, &error);
+
+			if(c_byte == COMPRESSOR_PENDING)
+				break;
+			if(c_byte == -1)
+				BAD_ERROR("deflator:: %s compress failed with "
+					"error code %d\n", comp->name, error);
+
+			deflator_put(done->file_buffer, done->write_buffer,
+				mangle_finish(done->write_buffer->data,
+				done->file_buffer->data,
+				done->file_buffer->size, c_byte, 1));
+			idle[idle_jobs ++] = done;
+		}
+	}
+}
+
+
+void *deflator(void *arg)
+{
+	struct file_buffer *write_buffer;
+	void *stream = NULL;
+	int res, depth;
+
+	stats_thread(STATS_DEFLATOR);
+
+	res = compressor_init(comp, &stream, block_size, 1);
+	if(res)
+		BAD_ERROR("deflator:: compressor_init failed\n");
+
+	struct queue *queue = to_deflate[numa_this_node()];
+
+	depth = compressor_queue_depth(comp, stream);
+	if(depth)
+		async_deflator(comp, stream, queue, depth);
+
+	write_buffer = cache_get_nohash(bwriter_buffer);
+
+	while(1) {
+		struct file_buffer *file_buffer = queue_get(queue);
+
+		if(sparse_files && (file_buffer->hole ||
+						all_zero(file_buffer))) {
+			STATS_BLOCK(file_buffer->size, 0);
+			file_buffer->c_byte = 0;
+			seq_queue_put(to_main, file_buffer);
+		} else {
+			deflator_put(file_buffer, write_buffer, mangle2(stream,
+				write_buffer->data, file_buffer->data,
+				file_buffer->size, block_size,
+				file_buffer->noD, 1, file_buffer->effort));
+			write_buffer = cache_get_nohash(bwriter_buffer);
+		}
+	}
+}
+
+
+/*
+ * Deflator sending the blocks to a worker (-worker) to be compressed.
+ * The connections are shared out between the NUMA node queues
+ */
+static void *remote_deflator(void *arg)
+{
+	long i = (long) arg;
+
+	stats_thread(STATS_DEFLATOR);
+
+	async_deflator(&remote_compressor, remote_conn[i],
+		to_deflate[i % numa_nodes], REMOTE_DEPTH);
+	return NULL;
+}
+
+
+void *frag_deflator(void *arg)
+{
+	void *stream = NULL;
+	int res;
+
+	stats_thread(STATS_FRAG_DEFLATOR);
+
+	res = compressor_init(comp, &stream, block_size, 1);
+	if(res)
+		BAD_ERROR("frag_deflator:: compressor_init failed\n");
+
+	pthread_cleanup_push((void *) pthread_mutex_unlock, &fragment_mutex);
+
+	while(1) {
+		int c_byte, compressed_size;
+		struct file_buffer *file_buffer = queue_get(to_frag);
+		struct file_buffer *write_buffer =
+			cache_get(fwriter_buffer, file_buffer->block);
+
+		c_byte = mangle2(stream, write_buffer->data, file_buffer->data,
+			file_buffer->size, block_size, noF, 1, -1);
+		compressed_size = SQUASHFS_COMPRESSED_SIZE_BLOCK(c_byte);
+		write_buffer->size = compressed_size;
+		STATS_BLOCK(file_buffer->size, compressed_size);
+		pthread_mutex_lock(&fragment_mutex);
+		if(fragments_locked == FALSE) {
+			/*
+			 * Only reserve the space on disk with the mutex held.
+			 * The writer writes each buffer at its own offset, so
+			 * queueing it can be done after dropping the mutex,
+			 * but it must be queued before it stops being
+			 * outstanding
+			 */
+			fragment_table[file_buffer->block].size = c_byte;
+			fragment_table[file_buffer->block].start_block = bytes;
+			write_buffer->block = bytes;
+			bytes += compressed_size;
+			pthread_mutex_unlock(&fragment_mutex);
+			queue_put(to_writer, write_buffer);
+			__atomic_sub_fetch(&fragments_outstanding, 1,
+				__ATOMIC_RELEASE);
+			TRACE("Writing fragment %lld, uncompressed size %d, "
+				"compressed size %d\n", file_buffer->block,
+				file_buffer->size, compressed_size);
+		} else {
+				add_pending_fragment(write_buffer, c_byte,
+					file_buffer->block);
+				pthread_mutex_unlock(&fragment_mutex);
+		}
+		cache_block_put(file_buffer);
+	}
+
+	pthread_cleanup_pop(0);
+}
+
+
+struct file_buffer *get_file_buffer()
+{
+	struct file_buffer *file_buffer = seq_queue_get(from_dup ? from_dup :
+		to_main);
+
+	return file_buffer;
+}
+
+
+void write_file_empty(squashfs_inode *inode, struct dir_ent *dir_ent,
+	struct file_buffer *file_buffer, int *duplicate_file)
+{
+	file_count ++;
+	*duplicate_file = FALSE;
+	cache_block_put(file_buffer);
+	create_inode(inode, NULL, dir_ent, SQUASHFS_FILE_TYPE, 0, 0, 0,
+		 NULL, &empty_fragment, NULL, 0);
+}
+
+
+void write_file_frag(squashfs_inode *inode, struct dir_ent *dir_ent,
+	struct file_buffer *file_buffer, int *duplicate_file)
+{
+	int size = file_buffer->file_size;
+	struct fragment *fragment;
+	unsigned short checksum = file_buffer->checksum;
+	char dont_put;
+
+	fragment = frag_duplicate(file_buffer, &dont_put);
+	*duplicate_file = !fragment;
+	if(!fragment) {
+		fragment = get_and_fill_fragment(file_buffer, dir_ent);
+		if(duplicate_checking)
+			add_non_dup(size, 0, NULL, 0, fragment, 0, checksum,
+				hash64_combine(0, file_buffer->hash), TRUE,
+				unhashed_files != 0, TRUE);
+	}
+
+	if(dont_put)
+		free(file_buffer);
+	else
+		cache_block_put(file_buffer);
+
+	total_bytes += size;
+	file_count ++;
+
+	inc_progress_bar();
+
+	create_inode(inode, NULL, dir_ent, SQUASHFS_FILE_TYPE, size, 0,
+			0, NULL, fragment, NULL, 0);
+
+	if(!duplicate_checking)
+		free_fragment(fragment);
+}
+
+
+int write_file_process(squashfs_inode *inode, struct dir_ent *dir_ent,
+	struct file_buffer *read_buffer, int *duplicate_file)
+{
+	long long read_size, file_bytes, start;
+	struct fragment *fragment;
+	unsigned int *block_list = NULL;
+	int block = 0, status;
+	long long sparse = 0;
+	struct file_buffer *fragment_buffer = NULL;
+	unsigned long long hash = 0;
+
+	*duplicate_file = FALSE;
+
 	lock_fragments();
 
 	file_bytes = 0;
 	start = bytes;
-	for(block = 0; block < blocks;) {
-		if(read_buffer->fragment) {
-			block_list[block] = 0;
+	while (1) {
+		read_size = read_buffer->file_size;
+		if(read_buffer->fragment)
 			fragment_buffer = read_buffer;
-			blocks = read_size >> block_log;
-		} else {
-			block_list[block] = read_buffer->c_byte;
+		else {
+			block_list = realloc(block_list, (block + 1) *
+				sizeof(unsigned int));
+			if(block_list == NULL)
+				MEM_ERROR();
+			block_list[block ++] = read_buffer->c_byte;
 			if(read_buffer->c_byte) {
 				read_buffer->block = bytes;
 				bytes += read_buffer->size;
 				cache_hash(read_buffer, read_buffer->block);
 				file_bytes += read_buffer->size;
+				hash = hash64_combine(hash, read_buffer->hash);
 				queue_put(to_writer, read_buffer);
 			} else {
 				sparse += read_buffer->size;
@@ -2776,37 +4325,30 @@ int write_file_blocks(squashfs_inode *inode, struct dir_ent *dir_ent,
 		}
 		inc_progress_bar();
 
-		if(++block < blocks) {
-			read_buffer = get_file_buffer();
-			if(read_buffer->error)
-				goto read_err;
-		}
+		if(read_size != -1)
+			break;
+
+		read_buffer = get_file_buffer();
+		if(read_buffer->error)
+			goto read_err;
 	}
 
 	unlock_fragments();
 	fragment = get_and_fill_fragment(fragment_buffer, dir_ent);
 
+	if(fragment_buffer)
+		hash = hash64_combine(hash, fragment_buffer->hash);
+
 	if(duplicate_checking)
 		add_non_dup(read_size, file_bytes, block_list, start, fragment,
 			0, fragment_buffer ? fragment_buffer->checksum : 0,
-			FALSE, TRUE);
+			hash, FALSE, unhashed_files != 0, TRUE);
 	cache_block_put(fragment_buffer);
 	file_count ++;
 	total_bytes += read_size;
 
-	/*
-	 * sparse count is needed to ensure squashfs correctly reports a
- 	 * a smaller block count on stat calls to sparse files.  This is
- 	 * to ensure intelligent applications like cp correctly handle the
- 	 * file as a sparse file.  If the file in the original filesystem isn't
- 	 * stored as a sparse file then still store it sparsely in squashfs, but
- 	 * report it as non-sparse on stat calls to preserve semantics
- 	 */
-	if(sparse && (dir_ent->inode->buf.st_blocks << 9) >= read_size)
-		sparse = 0;
-
 	create_inode(inode, NULL, dir_ent, SQUASHFS_FILE_TYPE, read_size, start,
-		 blocks, block_list, fragment, NULL, sparse);
+		 block, block_list, fragment, NULL, sparse);
 
 	if(duplicate_checking == FALSE) {
 		free(block_list);
@@ -2837,551 +4379,2165 @@ read_err:
 }
 
 
-void write_file(squashfs_inode *inode, struct dir_ent *dir, int *dup)
+int write_file_blocks_dup(squashfs_inode *inode, struct dir_ent *dir_ent,
+	struct file_buffer *read_buffer, int *duplicate_file)
 {
+	int block, thresh;
+	long long read_size = read_buffer->file_size;
+	long long file_bytes, dup_start, start;
+	struct fragment *fragment;
+	struct file_info *dupl_ptr;
+	int blocks = (read_size + block_size - 1) >> block_log;
+	unsigned int *block_list, *block_listp;
+	struct file_buffer **buffer_list;
 	int status;
-	struct file_buffer *read_buffer;
+	long long sparse = 0;
+	struct file_buffer *fragment_buffer = NULL;
+	unsigned long long hash = 0, *hashes = NULL;
 
-again:
-	read_buffer = get_file_buffer();
+	block_list = malloc(blocks * sizeof(unsigned int));
+	if(block_list == NULL)
+		MEM_ERROR();
+	block_listp = block_list;
+
+	if(block_duplicates) {
+		hashes = malloc(blocks * sizeof(unsigned long long));
+		if(hashes == NULL)
+			MEM_ERROR();
+	}
+
+	buffer_list = malloc(blocks * sizeof(struct file_buffer *));
+	if(buffer_list == NULL)
+		MEM_ERROR();
+
+	lock_fragments();
+
+	file_bytes = 0;
+	start = dup_start = bytes;
+	thresh = blocks > dup_hold ? blocks - dup_hold : 0;
+
+	for(block = 0; block < blocks;) {
+		if(read_buffer->fragment) {
+			block_list[block] = 0;
+			buffer_list[block] = NULL;
+			fragment_buffer = read_buffer;
+			blocks = read_size >> block_log;
+		} else {
+			block_list[block] = read_buffer->c_byte;
+
+			if(read_buffer->c_byte) {
+				read_buffer->block = bytes;
+				bytes += read_buffer->size;
+				file_bytes += read_buffer->size;
+				hash = hash64_combine(hash, read_buffer->hash);
+				if(hashes)
+					hashes[block] = read_buffer->hash;
+				cache_hash(read_buffer, read_buffer->block);
+				if(block < thresh) {
+					buffer_list[block] = NULL;
+					queue_put(to_writer, read_buffer);
+				} else
+					buffer_list[block] = read_buffer;
+			} else {
+				buffer_list[block] = NULL;
+				sparse += read_buffer->size;
+				cache_block_put(read_buffer);
+			}
+		}
+		inc_progress_bar();
+
+		if(++block < blocks) {
+			read_buffer = get_file_buffer();
+			if(read_buffer->error)
+				goto read_err;
+		}
+	}
+
+	if(fragment_buffer)
+		hash = hash64_combine(hash, fragment_buffer->hash);
+
+	dupl_ptr = duplicate(read_size, file_bytes, block_list, start,
+		fragment_buffer, blocks, hash);
+
+	if(dupl_ptr == NULL && hashes) {
+		dup_start = block_duplicate(start, block_list, hashes, blocks);
+
+		if(dup_start == -1) {
+			dup_start = start;
+			add_blocks(start, block_list, hashes, blocks);
+		} else {
+			/* the held back blocks needn't be written */
+			for(block = thresh; block < blocks; block ++) {
+				cache_block_put(buffer_list[block]);
+				buffer_list[block] = NULL;
+			}
+			if(thresh)
+				truncate_output(start);
+			else
+				bytes = start;
+		}
+	}
+
+	if(dupl_ptr == NULL) {
+		*duplicate_file = FALSE;
+		for(block = thresh; block < blocks; block ++)
+			if(buffer_list[block])
+				queue_put(to_writer, buffer_list[block]);
+		fragment = get_and_fill_fragment(fragment_buffer, dir_ent);
+		add_non_dup(read_size, file_bytes, block_list, dup_start, fragment,
+			0, fragment_buffer ? fragment_buffer->checksum : 0,
+			hash, FALSE, unhashed_files != 0, TRUE);
+	} else {
+		*duplicate_file = TRUE;
+		block_listp = dupl_ptr->block_list;
+		dup_start = dupl_ptr->start;
+		fragment = dupl_ptr->fragment;
+		for(block = thresh; block < blocks; block ++)
+			cache_block_put(buffer_list[block]);
+		bytes = start;
+		if(thresh && !block_device) {
+			int res;
+
+			queue_put(to_writer, NULL);
+			if(queue_get(from_writer) != 0)
+				EXIT_MKSQUASHFS();
+			res = ftruncate(fd, bytes);
+			if(res != 0)
+				BAD_ERROR("Failed to truncate dest file because"
+					"  %s\n", strerror(errno));
+		}
+	}
+
+	unlock_fragments();
+	cache_block_put(fragment_buffer);
+	free(buffer_list);
+	free(hashes);
+	file_count ++;
+	total_bytes += read_size;
+
+	/*
+	 * sparse count is needed to ensure squashfs correctly reports a
+ 	 * a smaller block count on stat calls to sparse files.  This is
+ 	 * to ensure intelligent applications like cp correctly handle the
+ 	 * file as a sparse file.  If the file in the original filesystem isn't
+ 	 * stored as a sparse file then still store it sparsely in squashfs, but
+ 	 * report it as non-sparse on stat calls to preserve semantics
+ 	 */
+	if(sparse && (dir_ent->inode->buf.st_blocks << 9) >= read_size)
+		sparse = 0;
+
+	create_inode(inode, NULL, dir_ent, SQUASHFS_FILE_TYPE, read_size,
+		dup_start, blocks, block_listp, fragment, NULL, sparse);
+
+	if(*duplicate_file == TRUE)
+		free(block_list);
+
+	return 0;
+
+read_err:
+	dec_progress_bar(block);
 	status = read_buffer->error;
+	bytes = start;
+	if(thresh && !block_device) {
+		int res;
 
-	if(status)
-		cache_block_put(read_buffer);
-	else if(read_buffer->file_size == -1)
-		status = write_file_process(inode, dir, read_buffer, dup);
-	else if(read_buffer->file_size == 0)
-		write_file_empty(inode, dir, read_buffer, dup);
-	else if(read_buffer->fragment && read_buffer->c_byte)
-		write_file_frag(inode, dir, read_buffer, dup);
-	else
-		status = write_file_blocks(inode, dir, read_buffer, dup);
+		queue_put(to_writer, NULL);
+		if(queue_get(from_writer) != 0)
+			EXIT_MKSQUASHFS();
+		res = ftruncate(fd, bytes);
+		if(res != 0)
+			BAD_ERROR("Failed to truncate dest file because %s\n",
+				strerror(errno));
+	}
+	unlock_fragments();
+	for(blocks = thresh; blocks < block; blocks ++)
+		cache_block_put(buffer_list[blocks]);
+	free(buffer_list);
+	free(block_list);
+	free(hashes);
+	cache_block_put(read_buffer);
+	return status;
+}
 
-	if(status == 2) {
-		ERROR("File %s changed size while reading filesystem, "
-			"attempting to re-read\n", pathname(dir));
-		goto again;
-	} else if(status == 1) {
-		ERROR_START("Failed to read file %s", pathname(dir));
-		ERROR_EXIT(", creating empty file\n");
-		write_file_empty(inode, dir, NULL, dup);
+
+int write_file_blocks(squashfs_inode *inode, struct dir_ent *dir_ent,
+	struct file_buffer *read_buffer, int *dup)
+{
+	long long read_size = read_buffer->file_size;
+	long long file_bytes, start;
+	struct fragment *fragment;
+	unsigned int *block_list;
+	int block, status;
+	int blocks = (read_size + block_size - 1) >> block_log;
+	long long sparse = 0;
+	struct file_buffer *fragment_buffer = NULL;
+	unsigned long long hash = 0, *hashes = NULL;
+
+	*dup = FALSE;
+
+	block_list = malloc(blocks * sizeof(unsigned int));
+	if(block_list == NULL)
+		MEM_ERROR();
+
+	if(block_duplicates && duplicate_checking) {
+		hashes = malloc(blocks * sizeof(unsigned long long));
+		if(hashes == NULL)
+			MEM_ERROR();
+	}
+
+	lock_fragments();
+
+	file_bytes = 0;
+	start = bytes;
+	for(block = 0; block < blocks;) {
+		if(read_buffer->fragment) {
+			block_list[block] = 0;
+			fragment_buffer = read_buffer;
+			blocks = read_size >> block_log;
+		} else {
+			block_list[block] = read_buffer->c_byte;
+			if(read_buffer->c_byte) {
+				read_buffer->block = bytes;
+				bytes += read_buffer->size;
+				cache_hash(read_buffer, read_buffer->block);
+				file_bytes += read_buffer->size;
+				hash = hash64_combine(hash, read_buffer->hash);
+				if(hashes)
+					hashes[block] = read_buffer->hash;
+				queue_put(to_writer, read_buffer);
+			} else {
+				sparse += read_buffer->size;
+				cache_block_put(read_buffer);
+			}
+		}
+		inc_progress_bar();
+
+		if(++block < blocks) {
+			read_buffer = get_file_buffer();
+			if(read_buffer->error)
+				goto read_err;
+		}
+	}
+
+	if(hashes) {
+		long long run = block_duplicate(start, block_list, hashes,
+			blocks);
+
+		if(run == -1)
+			add_blocks(start, block_list, hashes, blocks);
+		else {
+			truncate_output(start);
+			start = run;
+		}
+		free(hashes);
+	}
+
+	unlock_fragments();
+	fragment = get_and_fill_fragment(fragment_buffer, dir_ent);
+
+	if(fragment_buffer)
+		hash = hash64_combine(hash, fragment_buffer->hash);
+
+	if(duplicate_checking)
+		add_non_dup(read_size, file_bytes, block_list, start, fragment,
+			0, fragment_buffer ? fragment_buffer->checksum : 0,
+			hash, FALSE, unhashed_files != 0, TRUE);
+	cache_block_put(fragment_buffer);
+	file_count ++;
+	total_bytes += read_size;
+
+	/*
+	 * sparse count is needed to ensure squashfs correctly reports a
+ 	 * a smaller block count on stat calls to sparse files.  This is
+ 	 * to ensure intelligent applications like cp correctly handle the
+ 	 * file as a sparse file.  If the file in the original filesystem isn't
+ 	 * stored as a sparse file then still store it sparsely in squashfs, but
+ 	 * report it as non-sparse on stat calls to preserve semantics
+ 	 */
+	if(sparse && (dir_ent->inode->buf.st_blocks << 9) >= read_size)
+		sparse = 0;
+
+	create_inode(inode, NULL, dir_ent, SQUASHFS_FILE_TYPE, read_size, start,
+		 blocks, block_list, fragment, NULL, sparse);
+
+	if(duplicate_checking == FALSE) {
+		free(block_list);
+		free_fragment(fragment);
+	}
+
+	return 0;
+
+read_err:
+	dec_progress_bar(block);
+	status = read_buffer->error;
+	free(hashes);
+	bytes = start;
+	if(!block_device) {
+		int res;
+
+		queue_put(to_writer, NULL);
+		if(queue_get(from_writer) != 0)
+			EXIT_MKSQUASHFS();
+		res = ftruncate(fd, bytes);
+		if(res != 0)
+			BAD_ERROR("Failed to truncate dest file because %s\n",
+				strerror(errno));
+	}
+	unlock_fragments();
+	free(block_list);
+	cache_block_put(read_buffer);
+	return status;
+}
+
+
+/*
+ * Write a file the duplicate threads have found to be a duplicate of
+ * file_dupl.  None of the file's blocks need to be written
+ */
+void write_file_dup(squashfs_inode *inode, struct dir_ent *dir_ent,
+	struct file_buffer *read_buffer, int *dup)
+{
+	struct file_info *dupl_ptr = read_buffer->file_dupl;
+	long long read_size = read_buffer->file_size;
+	int block, blocks = (read_size + block_size - 1) >> block_log;
+	long long sparse = 0;
+
+	for(block = 0; block < blocks;) {
+		if(read_buffer->fragment)
+			blocks = read_size >> block_log;
+		else if(read_buffer->c_byte == 0)
+			sparse += read_buffer->size;
+		cache_block_put(read_buffer);
+		inc_progress_bar();
+
+		if(++block < blocks)
+			read_buffer = get_file_buffer();
+	}
+
+	TRACE("Found duplicate file, start 0x%llx, size %lld, hash 0x%llx\n",
+		dupl_ptr->start, dupl_ptr->bytes, dupl_ptr->hash);
+
+	*dup = TRUE;
+	file_count ++;
+	total_bytes += read_size;
+
+	if(sparse && (dir_ent->inode->buf.st_blocks << 9) >= read_size)
+		sparse = 0;
+
+	create_inode(inode, NULL, dir_ent, SQUASHFS_FILE_TYPE, read_size,
+		dupl_ptr->start, blocks, dupl_ptr->block_list,
+		dupl_ptr->fragment, NULL, sparse);
+}
+
+
+/*
+ * Write a file which has been through the duplicate threads.  They have
+ * checked it against the duplicate table as it was when they looked, and
+ * so only the files added to the table since then need to be checked
+ */
+int write_file_checked(squashfs_inode *inode, struct dir_ent *dir_ent,
+	struct file_buffer *read_buffer, int *dup)
+{
+	long long read_size = read_buffer->file_size;
+
+	if(read_buffer->file_dup) {
+		write_file_dup(inode, dir_ent, read_buffer, dup);
+		return 0;
+	}
+
+	if((unhashed_files && pre_duplicate(read_size)) ||
+			dupl_hash[DUP_HASH(read_buffer->file_hash)] !=
+			read_buffer->file_dupl)
+		return write_file_blocks_dup(inode, dir_ent, read_buffer, dup);
+
+	return write_file_blocks(inode, dir_ent, read_buffer, dup);
+}
+
+
+void write_file(squashfs_inode *inode, struct dir_ent *dir, int *dup)
+{
+	int status;
+	struct file_buffer *read_buffer;
+
+again:
+	read_buffer = get_file_buffer();
+	status = read_buffer->error;
+
+	if(status)
+		cache_block_put(read_buffer);
+	else if(read_buffer->file_size == -1)
+		status = write_file_process(inode, dir, read_buffer, dup);
+	else if(read_buffer->file_size == 0)
+		write_file_empty(inode, dir, read_buffer, dup);
+	else if(read_buffer->fragment && read_buffer->c_byte)
+		write_file_frag(inode, dir, read_buffer, dup);
+	else if(from_dup && read_buffer->checked)
+		status = write_file_checked(inode, dir, read_buffer, dup);
+	else if(pre_duplicate(read_buffer->file_size))
+		status = write_file_blocks_dup(inode, dir, read_buffer, dup);
+	else
+		status = write_file_blocks(inode, dir, read_buffer, dup);
+
+	if(status == 2) {
+		ERROR("File %s changed size while reading filesystem, "
+			"attempting to re-read\n", pathname(dir));
+		goto again;
+	} else if(status == 1) {
+		ERROR_START("Failed to read file %s", pathname(dir));
+		ERROR_EXIT(", creating empty file\n");
+		write_file_empty(inode, dir, NULL, dup);
+	}
+
+	/* duplicate and empty files don't take their planned place */
+	release_fragment_bin(dir->inode);
+}
+
+
+#define BUFF_SIZE 512
+char *name;
+char *basename_r();
+
+char *getbase(char *pathname)
+{
+	static char *b_buffer = NULL;
+	static int b_size = BUFF_SIZE;
+	char *result;
+
+	if(b_buffer == NULL) {
+		b_buffer = malloc(b_size);
+		if(b_buffer == NULL)
+			MEM_ERROR();
+	}
+
+	while(1) {
+		if(*pathname != '/') {
+			result = getcwd(b_buffer, b_size);
+			if(result == NULL && errno != ERANGE)
+				BAD_ERROR("Getcwd failed in getbase\n");
+
+			/* enough room for pathname + "/" + '\0' terminator? */
+			if(result && strlen(pathname) + 2 <=
+						b_size - strlen(b_buffer)) {
+				strcat(strcat(b_buffer, "/"), pathname);
+				break;
+			}
+		} else if(strlen(pathname) < b_size) {
+			strcpy(b_buffer, pathname);
+			break;
+		}
+
+		/* Buffer not large enough, realloc and try again */
+		b_buffer = realloc(b_buffer, b_size += BUFF_SIZE);
+		if(b_buffer == NULL)
+			MEM_ERROR();
+	}
+
+	name = b_buffer;
+	if(((result = basename_r()) == NULL) || (strcmp(result, "..") == 0))
+		return NULL;
+	else
+		return result;
+}
+
+
+char *basename_r()
+{
+	char *s;
+	char *p;
+	int n = 1;
+
+	for(;;) {
+		s = name;
+		if(*name == '\0')
+			return NULL;
+		if(*name != '/') {
+			while(*name != '\0' && *name != '/') name++;
+			n = name - s;
+		}
+		while(*name == '/') name++;
+		if(strncmp(s, ".", n) == 0)
+			continue;
+		if((*name == '\0') || (strncmp(s, "..", n) == 0) ||
+				((p = basename_r()) == NULL)) {
+			s[n] = '\0';
+			return s;
+		}
+		if(strcmp(p, "..") == 0)
+			continue;
+		return p;
+	}
+}
+
+
+void copy_inode_stat(struct inode_stat *ibuf, struct stat *buf)
+{
+	ibuf->st_dev = buf->st_dev;
+	ibuf->st_ino = buf->st_ino;
+	ibuf->st_size = buf->st_size;
+	ibuf->st_blocks = buf->st_blocks;
+	ibuf->st_rdev = buf->st_rdev;
+	ibuf->st_nlink = buf->st_nlink;
+	ibuf->mtime = buf->st_mtime;
+	ibuf->st_mode = buf->st_mode;
+	ibuf->st_uid = buf->st_uid;
+	ibuf->st_gid = buf->st_gid;
+}
+
+
+/*
+ * A hard-link must also agree on the attributes which are stored.  If the
+ * attributes of the existing inode have been altered (for instance by the
+ * Android fs_config), or the file changed between the two stats, it is
+ * stored as a separate inode
+ */
+static int same_inode(struct inode_info *inode, struct stat *buf)
+{
+	struct inode_stat *ibuf = &inode->buf;
+
+	return ibuf->st_dev == buf->st_dev && ibuf->st_mode == buf->st_mode &&
+		ibuf->st_uid == buf->st_uid && ibuf->st_gid == buf->st_gid &&
+		ibuf->st_size == buf->st_size && ibuf->st_rdev == buf->st_rdev &&
+		ibuf->st_nlink == buf->st_nlink && ibuf->mtime == buf->st_mtime;
+}
+
+
+static void insert_inode_slot(struct inode_slot *table, unsigned int size,
+	struct inode_info *inode)
+{
+	unsigned int mask = size - 1;
+	unsigned int slot = INODE_HASH(inode->buf.st_dev, inode->buf.st_ino) &
+		mask;
+
+	while(table[slot].inode)
+		slot = (slot + 1) & mask;
+
+	table[slot].ino = inode->buf.st_ino;
+	table[slot].inode = inode;
+}
+
+
+static void grow_inode_hash()
+{
+	unsigned int i, size = inode_hash_size ? inode_hash_size << 1 :
+		INODE_HASH_MIN;
+	struct inode_slot *table = calloc(size, sizeof(struct inode_slot));
+
+	if(table == NULL)
+		MEM_ERROR();
+
+	for(i = 0; i < inode_hash_size; i++)
+		if(inode_hash[i].inode)
+			insert_inode_slot(table, size, inode_hash[i].inode);
+
+	free(inode_hash);
+	inode_hash = table;
+	inode_hash_size = size;
+}
+
+
+struct inode_info *lookup_inode3(struct stat *buf, int pseudo, int id,
+	char *symlink, int bytes)
+{
+	struct inode_info *inode;
+
+	/*
+	 * Look-up inode in hash table, if it already exists we have a
+	 * hard-link, so increment the nlink count and return it.
+	 * Don't do the look-up for directories because we don't hard-link
+	 * directories, or for pseudo files, which are never hard-linked
+	 * and whose inode numbers aren't from a real filesystem
+	 */
+	if ((buf->st_mode & S_IFMT) != S_IFDIR && !pseudo &&
+			inode_hash_count) {
+		unsigned int mask = inode_hash_size - 1;
+		unsigned int slot = INODE_HASH(buf->st_dev, buf->st_ino) & mask;
+
+		for(; inode_hash[slot].inode; slot = (slot + 1) & mask) {
+			inode = inode_hash[slot].inode;
+
+			if(inode_hash[slot].ino == buf->st_ino &&
+						same_inode(inode, buf)) {
+				inode->nlink ++;
+				return inode;
+			}
+		}
+	}
+
+	/*
+	 * With -spill inodes which can't be hard linked are spilled with
+	 * their directory, and are allocated separately so they can be freed
+	 */
+	if(spill_fd != -1 && !SPILL_KEEP(buf)) {
+		inode = malloc(sizeof(struct inode_info) + bytes);
+		if(inode == NULL)
+			MEM_ERROR();
+	} else
+		inode = arena_alloc(scan_arena, sizeof(struct inode_info) +
+			bytes);
+
+	if(bytes)
+		memcpy(&inode->symlink, symlink, bytes);
+	copy_inode_stat(&inode->buf, buf);
+	inode->read = FALSE;
+	inode->root_entry = FALSE;
+	inode->pseudo_file = pseudo;
+	inode->pseudo_id = id;
+	inode->inode = SQUASHFS_INVALID_BLK;
+	inode->nlink = 1;
+	inode->inode_number = 0;
+	inode->xattr_list = NULL;
+	inode->xattrs = -1;
+
+	/*
+	 * Copy filesystem wide defaults into inode, these filesystem
+	 * wide defaults may be altered on an individual inode basis by
+	 * user specified actions
+	 *
+	*/
+	inode->no_fragments = no_fragments;
+	inode->always_use_fragments = always_use_fragments;
+	inode->noD = noD;
+	inode->noF = noF;
+	inode->incompressible = FALSE;
+	inode->frag_bin = FRAG_BIN_NONE;
+
+	if(spill_fd != -1 && !SPILL_KEEP(buf))
+		return inode;
+
+	if((inode_hash_count + 1) * 4 > inode_hash_size * 3)
+		grow_inode_hash();
+	insert_inode_slot(inode_hash, inode_hash_size, inode);
+	inode_hash_count ++;
+
+	return inode;
+}
+
+
+struct inode_info *lookup_inode2(struct stat *buf, int pseudo, int id)
+{
+	return lookup_inode3(buf, pseudo, id, NULL, 0);
+}
+
+
+inline struct inode_info *lookup_inode(struct stat *buf)
+{
+	return lookup_inode2(buf, 0, 0);
+}
+
+
+inline void alloc_inode_no(struct inode_info *inode, unsigned int use_this)
+{
+	if (inode->inode_number == 0) {
+		inode->inode_number = use_this ? : inode_no ++;
+		/* -tar and -cpio files are counted as they're read */
+		if((inode->buf.st_mode & S_IFMT) == S_IFREG &&
+						!IS_PSEUDO_ARCHIVE(inode))
+			progress_bar_size((inode->buf.st_size + block_size - 1)
+								 >> block_log);
+	}
+}
+
+
+inline struct dir_ent *create_dir_entry(char *name, char *source_name,
+	char *nonstandard_pathname, struct dir_info *dir)
+{
+	struct dir_ent *dir_ent = slab_alloc(&dir_ent_slab);
+
+	dir_ent->name = name;
+	dir_ent->source_name = source_name;
+	dir_ent->nonstandard_pathname = nonstandard_pathname;
+	dir_ent->our_dir = dir;
+	dir_ent->inode = NULL;
+	dir_ent->next = NULL;
+
+	return dir_ent;
+}
+
+
+/* ANDROID CHANGES START*/
+#ifdef ANDROID
+/* fs_config works on a struct stat, pass it the inode attributes it sets */
+static void android_inode_config(const char *path, struct inode_stat *ibuf)
+{
+	struct stat buf;
+
+	buf.st_mode = ibuf->st_mode;
+	buf.st_uid = ibuf->st_uid;
+	buf.st_gid = ibuf->st_gid;
+
+	android_fs_config(path, &buf);
+
+	ibuf->st_mode = buf.st_mode;
+	ibuf->st_uid = buf.st_uid;
+	ibuf->st_gid = buf.st_gid;
+}
+#endif
+/* ANDROID CHANGES END */
+
+
+inline void add_dir_entry(struct dir_ent *dir_ent, struct dir_info *sub_dir,
+	struct inode_info *inode_info)
+{
+	struct dir_info *dir = dir_ent->our_dir;
+
+	if(sub_dir)
+		sub_dir->dir_ent = dir_ent;
+
+/* ANDROID CHANGES START*/
+#ifdef ANDROID
+	if (android_config) {
+		if (mount_point)
+			android_inode_config(mounted_path(mount_point,
+				subpathname(dir_ent)), &inode_info->buf);
+		else
+			android_inode_config(pathname(dir_ent), &inode_info->buf);
+	}
+#endif
+/* ANDROID CHANGES END */
+
+	dir_ent->inode = inode_info;
+	dir_ent->dir = sub_dir;
+
+	dir_ent->next = dir->list;
+	dir->list = dir_ent;
+	dir->count++;
+}
+
+/* ANDROID CHANGES START*/
+#ifdef ANDROID
+/* Weird linker bug that complains those inline functions are undefined. */
+extern inline void add_dir_entry(struct dir_ent *dir_ent, struct dir_info *sub_dir,
+	struct inode_info *inode_info);
+extern inline void add_dir_entry2(char *name, char *source_name,
+	char *nonstandard_pathname, struct dir_info *sub_dir,
+	struct inode_info *inode_info, struct dir_info *dir);
+#endif
+/* ANDROID CHANGES END */
+
+inline void add_dir_entry2(char *name, char *source_name,
+	char *nonstandard_pathname, struct dir_info *sub_dir,
+	struct inode_info *inode_info, struct dir_info *dir)
+{
+	struct dir_ent *dir_ent = create_dir_entry(name, source_name,
+		nonstandard_pathname, dir);
+
+
+	add_dir_entry(dir_ent, sub_dir, inode_info);
+}
+
+
+inline void free_dir_entry(struct dir_ent *dir_ent)
+{
+	if(dir_ent->name)
+		free(dir_ent->name);
+
+	if(dir_ent->source_name)
+		free(dir_ent->source_name);
+
+	if(dir_ent->nonstandard_pathname)
+		free(dir_ent->nonstandard_pathname);
+
+	/* if this entry has been associated with an inode, then we need
+	 * to update the inode nlink count.  Orphaned inodes are harmless, and
+	 * is easier to leave them than go to the bother of deleting them */
+	if(dir_ent->inode && !dir_ent->inode->root_entry)
+		dir_ent->inode->nlink --;
+
+	slab_free(&dir_ent_slab, dir_ent);
+}
+
+
+inline void add_excluded(struct dir_info *dir)
+{
+	dir->excluded ++;
+}
+
+
+/*
+ * -pack-fragments planning.  The tail ends which will go into the default
+ * fragment blocks are ordered so that similar tails (same sort priority,
+ * same file extension, same directory) are adjacent, and are then packed
+ * into bins in that order.  When the next tail doesn't fit, the bin is
+ * topped up with the tails among the next PACK_LOOKAHEAD which do fit,
+ * which fills the bins without mixing dissimilar tails, as packing by
+ * size does
+ */
+static struct pack_entry *pack_list = NULL;
+static int pack_count = 0, pack_size = 0;
+
+
+static void add_pack_entry(struct dir_ent *dir_ent, int priority)
+{
+	struct inode_info *inode = dir_ent->inode;
+	struct pack_entry *entry;
+	char *extension;
+
+	if(!S_ISREG(inode->buf.st_mode) || inode->frag_bin != FRAG_BIN_NONE ||
+			inode->inode != SQUASHFS_INVALID_BLK ||
+			IS_PSEUDO_PROCESS(inode) || !is_fragment(inode) ||
+			eval_frag_actions(root_dir, dir_ent) !=
+			get_frag_action(NULL))
+		return;
+
+	if(pack_count == pack_size) {
+		pack_size += 1024;
+		pack_list = realloc(pack_list, pack_size *
+			sizeof(struct pack_entry));
+		if(pack_list == NULL)
+			MEM_ERROR();
+	}
+
+	extension = strrchr(dir_ent->name, '.');
+
+	entry = &pack_list[pack_count];
+	entry->inode = inode;
+	entry->extension = extension ? extension + 1 : "";
+	entry->subpath = dir_ent->our_dir->subpath;
+	entry->priority = priority;
+	entry->size = tail_size(inode);
+	entry->order = pack_count ++;
+
+	inode->frag_bin = FRAG_BIN_PLANNED;
+}
+
+
+static void add_pack_dir(struct dir_info *dir)
+{
+	struct dir_ent *dir_ent;
+
+	for(dir_ent = dir->list; dir_ent; dir_ent = dir_ent->next)
+		if(S_ISDIR(dir_ent->inode->buf.st_mode)) {
+			if(dir_ent->dir)
+				add_pack_dir(dir_ent->dir);
+		} else
+			add_pack_entry(dir_ent, -1);
+}
+
+
+static int compare_similar(const void *a, const void *b)
+{
+	const struct pack_entry *entry_a = a, *entry_b = b;
+	int res;
+
+	if(entry_a->priority != entry_b->priority)
+		return entry_b->priority - entry_a->priority;
+
+	/* traced files stay in access order, so co-accessed tails share bins */
+	if(entry_a->priority == PACK_TRACE)
+		return entry_a->order - entry_b->order;
+
+	res = strcmp(entry_a->extension, entry_b->extension);
+	if(res)
+		return res;
+
+	res = strcmp(entry_a->subpath, entry_b->subpath);
+	if(res)
+		return res;
+
+	return entry_a->order - entry_b->order;
+}
+
+
+static int new_fragment_bin()
+{
+	struct fragment_bin *bin;
+
+	if(fragment_bin_count % FRAG_SIZE == 0) {
+		fragment_bins = realloc(fragment_bins, (fragment_bin_count +
+			FRAG_SIZE) * sizeof(struct fragment_bin));
+		if(fragment_bins == NULL)
+			MEM_ERROR();
+	}
+
+	bin = &fragment_bins[fragment_bin_count];
+	bin->buffer = NULL;
+	bin->reserved = 0;
+	bin->members = 0;
+	bin->closed = FALSE;
+
+	return fragment_bin_count ++;
+}
+
+
+static void add_to_plan(int bin, struct pack_entry *entry)
+{
+	fragment_bins[bin].reserved += entry->size;
+	fragment_bins[bin].members ++;
+	entry->inode->frag_bin = bin;
+}
+
+
+void plan_fragments(struct dir_info *root)
+{
+	int i, j, bin = -1, priority = 0;
+
+	/*
+	 * Sorted files are written first, in priority order, and so they
+	 * are collected first
+	 */
+	if(sorted) {
+		struct priority_entry *entry;
+
+		for(i = 0; i < trace_count; i++)
+			for(entry = trace_list[i]; entry; entry = entry->next)
+				add_pack_entry(entry->dir, PACK_TRACE);
+		for(i = 65535; i >= 0; i--)
+			for(entry = priority_list[i]; entry; entry =
+								entry->next)
+				add_pack_entry(entry->dir, i);
+	}
+
+	add_pack_dir(root);
+
+	qsort(pack_list, pack_count, sizeof(struct pack_entry),
+		compare_similar);
+
+	for(i = 0; i < pack_count; i++) {
+		if(pack_list[i].inode->frag_bin >= 0)
+			continue;
+
+		/* sort priorities don't share bins */
+		if(bin != -1 && pack_list[i].priority != priority)
+			bin = -1;
+
+		if(bin != -1 && fragment_bins[bin].reserved +
+					pack_list[i].size > block_size) {
+			for(j = i + 1; j < pack_count && j <= i +
+					PACK_LOOKAHEAD && pack_list[j].priority
+					== priority; j++)
+				if(pack_list[j].inode->frag_bin < 0 &&
+						fragment_bins[bin].reserved +
+						pack_list[j].size <= block_size)
+					add_to_plan(bin, &pack_list[j]);
+			bin = -1;
+		}
+
+		if(bin == -1) {
+			bin = new_fragment_bin();
+			priority = pack_list[i].priority;
+		}
+
+		add_to_plan(bin, &pack_list[i]);
+	}
+
+	TRACE("plan_fragments: %d tail ends planned into %d bins\n",
+		pack_count, fragment_bin_count);
+
+	free(pack_list);
+	pack_list = NULL;
+	pack_count = pack_size = 0;
+}
+
+
+void dir_scan(squashfs_inode *inode, char *pathname,
+	struct dir_ent *(_readdir)(struct dir_info *), int progress)
+{
+	struct stat buf;
+	struct dir_ent *dir_ent;
+
+	/*
+	 * If nothing after the directory scan alters the directories, or the
+	 * order files are read in, stream, and let the reader thread start
+	 * on each directory as soon as it has been scanned (and sorted).
+	 * Otherwise the reader thread is only given the root directory once
+	 * the directory tree is complete
+	 */
+	streaming = !sorted && !actions() && !move_actions() && !prune_actions()
+		&& !empty_actions() && !get_pseudo() && !pack_fragments &&
+		spill_fd == -1;
+	
+	scan_threads_init();
+	root_dir = dir_scan1(pathname, "", paths, _readdir, 1);
+	scan_threads_fini();
+	if(root_dir == NULL) {
+		queue_put(to_reader, NULL);
+		return;
+	}
+
+	/* Create root directory dir_ent and associated inode, and connect
+	 * it to the root directory dir_info structure */
+	dir_ent = create_dir_entry("", NULL, pathname,
+						scan1_opendir("", "", 0));
+
+	if(pathname[0] == '\0') {
+		/*
+ 		 * dummy top level directory, if multiple sources specified on
+		 * command line
+		 */
+		memset(&buf, 0, sizeof(buf));
+		buf.st_mode = S_IRWXU | S_IRWXG | S_IRWXO | S_IFDIR;
+		buf.st_uid = getuid();
+		buf.st_gid = getgid();
+		buf.st_mtime = time(NULL);
+		buf.st_dev = 0;
+		buf.st_ino = 0;
+		dir_ent->inode = lookup_inode2(&buf, PSEUDO_FILE_OTHER, 0);
+	} else {
+		if(lstat(pathname, &buf) == -1)
+			/* source directory has disappeared? */
+			BAD_ERROR("Cannot stat source directory %s because %s\n",
+				pathname, strerror(errno));
+/* ANDROID CHANGES START*/
+#ifdef ANDROID
+		if (android_config)
+			if (mount_point)
+				android_fs_config(mount_point, &buf);
+			else
+				android_fs_config(pathname, &buf);
+#endif
+/* ANDROID CHANGES END */
+		dir_ent->inode = lookup_inode(&buf);
+	}
+
+	dir_ent->dir = root_dir;
+	root_dir->dir_ent = dir_ent;
+
+	/*
+	 * Process most actions and any pseudo files
+	 */
+	if(actions() || get_pseudo())
+		dir_scan2(root_dir, get_pseudo());
+
+	/*
+	 * Process move actions
+	 */
+	if(move_actions()) {
+		dir_scan3(root_dir);
+		do_move_actions();
+	}
+
+	/*
+	 * Process prune actions
+	 */
+	if(prune_actions())
+		dir_scan4(root_dir);
+
+	/*
+	 * Process empty actions
+	 */
+	if(empty_actions())
+		dir_scan5(root_dir);
+
+ 	/*
+	 * Sort directories and compute the inode numbers
+	 */
+	dir_scan6(root_dir);
+
+	alloc_inode_no(dir_ent->inode, root_inode_number);
+
+	/*
+	 * Spilled inodes aren't in the inode hash, and so their export
+	 * table entries are kept as they're written, see spill_export()
+	 */
+	if(spill_fd != -1 && exportable) {
+		spill_lookup = calloc(inode_no - 1, sizeof(squashfs_inode));
+		if(spill_lookup == NULL)
+			MEM_ERROR();
+		spill_lookup_count = inode_no - 1;
+	}
+
+	eval_actions(root_dir, dir_ent);
+
+	if(sorted)
+		generate_file_priorities(root_dir, 0,
+			&root_dir->dir_ent->inode->buf);
+
+	if(pack_fragments)
+		plan_fragments(root_dir);
+
+	if(appending) {
+		sigset_t sigmask;
+
+		restore_thread = init_restore_thread();
+		sigemptyset(&sigmask);
+		sigaddset(&sigmask, SIGINT);
+		sigaddset(&sigmask, SIGTERM);
+		sigaddset(&sigmask, SIGUSR1);
+		if(pthread_sigmask(SIG_BLOCK, &sigmask, NULL) == -1)
+			BAD_ERROR("Failed to set signal mask\n");
+		write_destination(fd, SQUASHFS_START, 4, "\0\0\0\0");
+	}
+
+	if(!streaming)
+		queue_put(to_reader, root_dir);
+
+	set_progressbar_state(progress);
+
+	if(sorted)
+		sort_files_and_write(root_dir);
+
+	dir_scan7(inode, root_dir);
+	dir_ent->inode->inode = *inode;
+	dir_ent->inode->type = SQUASHFS_DIR_TYPE;
+	if(spill_fd != -1)
+		spill_export(dir_ent->inode);
+}
+
+
+/*
+ * -tar and -cpio routines...
+ * The reader thread reads the archive in one pass, building the directory
+ * tree as it goes and reading the data of each file when it is reached.
+ * Each file is passed to the main thread before its data is read, and the
+ * main thread writes the files in archive order.  The inodes of the files
+ * are created afterwards by dir_scan7 (see struct archive_inode)
+ */
+#define ARCHIVE_HASH_MIN 1024
+#define ARCHIVE_LINK_HASH 1024
+#define ARCHIVE_QUEUE_SIZE 1024
+
+/* pathname to directory entry lookup, for parents and tar hard links */
+struct archive_path {
+	char			*path;
+	struct dir_ent		*dir_ent;
+	struct archive_path	*next;
+};
+
+/* cpio hard links, which are identified by their dev and ino */
+struct archive_link {
+	unsigned long long	dev;
+	unsigned long long	ino;
+	struct dir_ent		*dir_ent;
+	int			queued;
+	struct archive_link	*next;
+};
+
+static struct archive_path **archive_paths = NULL;
+static unsigned int archive_paths_size = 0, archive_paths_count = 0;
+static struct archive_link *archive_links[ARCHIVE_LINK_HASH];
+
+
+static struct dir_ent *archive_lookup(char *path)
+{
+	struct archive_path *entry;
+
+	if(archive_paths_count == 0)
+		return NULL;
+
+	for(entry = archive_paths[name_hash(path) & (archive_paths_size - 1)];
+				entry; entry = entry->next)
+		if(strcmp(entry->path, path) == 0)
+			return entry->dir_ent;
+
+	return NULL;
+}
+
+
+static void archive_add_path(char *path, struct dir_ent *dir_ent)
+{
+	struct archive_path *entry = malloc(sizeof(struct archive_path));
+	unsigned int h;
+
+	if(entry == NULL)
+		MEM_ERROR();
+
+	if(archive_paths_count >= archive_paths_size) {
+		unsigned int i, size = archive_paths_size ?
+			archive_paths_size << 1 : ARCHIVE_HASH_MIN;
+		struct archive_path **table = calloc(size,
+			sizeof(struct archive_path *));
+
+		if(table == NULL)
+			MEM_ERROR();
+
+		for(i = 0; i < archive_paths_size; i++)
+			while(archive_paths[i]) {
+				struct archive_path *next =
+					archive_paths[i]->next;
+
+				h = name_hash(archive_paths[i]->path) &
+					(size - 1);
+				archive_paths[i]->next = table[h];
+				table[h] = archive_paths[i];
+				archive_paths[i] = next;
+			}
+
+		free(archive_paths);
+		archive_paths = table;
+		archive_paths_size = size;
+	}
+
+	entry->path = strdup(path);
+	if(entry->path == NULL)
+		MEM_ERROR();
+	entry->dir_ent = dir_ent;
+
+	h = name_hash(path) & (archive_paths_size - 1);
+	entry->next = archive_paths[h];
+	archive_paths[h] = entry;
+	archive_paths_count ++;
+}
+
+
+static void archive_free_paths()
+{
+	unsigned int i;
+
+	for(i = 0; i < archive_paths_size; i++)
+		while(archive_paths[i]) {
+			struct archive_path *next = archive_paths[i]->next;
+
+			free(archive_paths[i]->path);
+			free(archive_paths[i]);
+			archive_paths[i] = next;
+		}
+
+	free(archive_paths);
+	archive_paths = NULL;
+	archive_paths_size = archive_paths_count = 0;
+}
+
+
+static struct archive_link *archive_link(struct archive_entry *entry,
+	struct dir_ent *dir_ent)
+{
+	unsigned int h = (entry->ino ^ entry->dev) & (ARCHIVE_LINK_HASH - 1);
+	struct archive_link *link;
+
+	for(link = archive_links[h]; link; link = link->next)
+		if(link->dev == entry->dev && link->ino == entry->ino)
+			return link;
+
+	if(dir_ent == NULL)
+		return NULL;
+
+	link = malloc(sizeof(struct archive_link));
+	if(link == NULL)
+		MEM_ERROR();
+
+	link->dev = entry->dev;
+	link->ino = entry->ino;
+	link->dir_ent = dir_ent;
+	link->queued = FALSE;
+	link->next = archive_links[h];
+	archive_links[h] = link;
+
+	return link;
+}
+
+
+static void archive_set_xattrs(struct inode_info *inode,
+	struct archive_entry *entry)
+{
+	if(inode->xattrs != -1)
+		free_prefetched_xattrs(inode->xattrs, inode->xattr_list);
+
+	inode->xattrs = -1;
+	inode->xattr_list = NULL;
+
+	/* with -no-xattrs the archive doesn't keep them */
+	if(entry->xattrs) {
+		inode->xattrs = entry->xattrs;
+		inode->xattr_list = entry->xattr_list;
+	}
+}
+
+
+/* Add path to dir, with a new inode for buf, or the existing inode */
+static struct dir_ent *archive_add_entry(struct dir_info *dir, char *path,
+	struct stat *buf, char *link, struct inode_info *inode)
+{
+	char *name = strrchr(path, '/');
+	struct dir_info *sub_dir = NULL;
+	struct dir_ent *dir_ent;
+
+	name = strdup(name ? name + 1 : path);
+	if(name == NULL)
+		MEM_ERROR();
+
+	if(inode)
+		inode->nlink ++;
+	else {
+		buf->st_dev = 0;
+		buf->st_ino = ++ archive_ino;
+		if(link)
+			inode = lookup_inode3(buf, PSEUDO_FILE_ARCHIVE, 0, link,
+				strlen(link) + 1);
+		else
+			inode = lookup_inode2(buf, PSEUDO_FILE_ARCHIVE, 0);
+	}
+
+	if(S_ISDIR(inode->buf.st_mode)) {
+		sub_dir = scan1_newdir(path, path, dir->depth + 1);
+		dir->directory_count ++;
 	}
+
+	dir_ent = create_dir_entry(name, NULL, NULL, dir);
+	add_dir_entry(dir_ent, sub_dir, inode);
+	archive_add_path(path, dir_ent);
+
+	return dir_ent;
 }
 
 
-#define BUFF_SIZE 512
-char *name;
-char *basename_r();
+/*
+ * Return the directory path is in.  Archives don't have to contain the
+ * parent directories of their entries, and so missing parents are created
+ * (with the mtime of the entry).  Returns NULL if a parent isn't a directory
+ */
+static struct dir_info *archive_parent(char *path, long long mtime)
+{
+	char *slash = strrchr(path, '/'), *parent;
+	struct dir_ent *dir_ent;
+	struct dir_info *dir;
+	struct stat buf;
 
-char *getbase(char *pathname)
+	if(slash == NULL)
+		return root_dir;
+
+	parent = strndup(path, slash - path);
+	if(parent == NULL)
+		MEM_ERROR();
+
+	dir_ent = archive_lookup(parent);
+	if(dir_ent)
+		dir = dir_ent->dir;
+	else {
+		dir = archive_parent(parent, mtime);
+		if(dir) {
+			memset(&buf, 0, sizeof(buf));
+			buf.st_mode = S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH |
+				S_IXOTH | S_IFDIR;
+			buf.st_mtime = mtime;
+			dir = archive_add_entry(dir, parent, &buf, NULL,
+				NULL)->dir;
+		}
+	}
+
+	free(parent);
+	return dir;
+}
+
+
+void reader_archive(struct dir_info *root)
 {
-	static char *b_buffer = NULL;
-	static int b_size = BUFF_SIZE;
-	char *result;
+	struct archive_entry entry;
+	struct reader reader;
+	struct dir_ent *dir_ent;
+	struct dir_info *dir;
+	struct stat buf;
+	int i;
 
-	if(b_buffer == NULL) {
-		b_buffer = malloc(b_size);
-		if(b_buffer == NULL)
-			MEM_ERROR();
+	reader_init(&reader);
+
+	while(archive_next(archive, &entry)) {
+		struct inode_info *inode = NULL;
+		struct archive_link *link = NULL;
+
+		if(entry.name[0] == '\0' || (dir_ent =
+					archive_lookup(entry.name))) {
+			/*
+			 * A directory may be given more than once, or after
+			 * it was created as a parent, the last attributes are
+			 * used
+			 */
+			inode = entry.name[0] == '\0' ? root->dir_ent->inode :
+				dir_ent->inode;
+
+			if(S_ISDIR(entry.mode) && S_ISDIR(inode->buf.st_mode)) {
+				inode->buf.st_mode = entry.mode;
+				inode->buf.st_uid = entry.uid;
+				inode->buf.st_gid = entry.gid;
+				inode->buf.mtime = entry.mtime;
+				archive_set_xattrs(inode, &entry);
+			} else {
+				ERROR("Skipping \"%s\" in archive \"%s\", it is"
+					" already in the archive\n", entry.name,
+					archive->filename);
+				free_prefetched_xattrs(entry.xattrs,
+					entry.xattr_list);
+			}
+			continue;
+		}
+
+		dir = archive_parent(entry.name, entry.mtime);
+		if(dir == NULL) {
+			ERROR("Skipping \"%s\" in archive \"%s\", its parent is"
+				" not a directory\n", entry.name,
+				archive->filename);
+			free_prefetched_xattrs(entry.xattrs, entry.xattr_list);
+			continue;
+		}
+
+		if(entry.hardlink) {
+			dir_ent = archive_lookup(entry.link);
+			if(dir_ent == NULL || dir_ent->dir) {
+				ERROR("Skipping hard link \"%s\" in archive "
+					"\"%s\", its target \"%s\" isn't an "
+					"earlier file\n", entry.name,
+					archive->filename, entry.link);
+				free_prefetched_xattrs(entry.xattrs,
+					entry.xattr_list);
+				continue;
+			}
+
+			archive_add_entry(dir, entry.name, NULL, NULL,
+				dir_ent->inode);
+			free_prefetched_xattrs(entry.xattrs, entry.xattr_list);
+			continue;
+		}
+
+		if(S_ISREG(entry.mode) && entry.nlink > 1) {
+			link = archive_link(&entry, NULL);
+			if(link) {
+				inode = link->dir_ent->inode;
+				free_prefetched_xattrs(entry.xattrs,
+					entry.xattr_list);
+			}
+		}
+
+		memset(&buf, 0, sizeof(buf));
+		buf.st_mode = entry.mode;
+		buf.st_uid = entry.uid;
+		buf.st_gid = entry.gid;
+		buf.st_mtime = entry.mtime;
+		buf.st_size = entry.size;
+		buf.st_nlink = 1;
+		if(S_ISCHR(entry.mode) || S_ISBLK(entry.mode))
+			buf.st_rdev = makedev(entry.major, entry.minor);
+
+		dir_ent = archive_add_entry(dir, entry.name, &buf,
+			S_ISLNK(entry.mode) ? entry.link : NULL, inode);
+
+		if(inode == NULL)
+			archive_set_xattrs(dir_ent->inode, &entry);
+
+		if(!S_ISREG(entry.mode))
+			continue;
+
+		if(entry.nlink > 1) {
+			/*
+			 * Cpio stores the data of a hard linked file with one
+			 * of its links (usually the last), the others are
+			 * empty
+			 */
+			if(link == NULL)
+				link = archive_link(&entry, dir_ent);
+
+			if(entry.size == 0 || link->queued)
+				continue;
+
+			link->queued = TRUE;
+			link->dir_ent->inode->buf.st_size = entry.size;
+		}
+
+		reader_read_archive(&reader, dir_ent);
 	}
 
-	while(1) {
-		if(*pathname != '/') {
-			result = getcwd(b_buffer, b_size);
-			if(result == NULL && errno != ERANGE)
-				BAD_ERROR("Getcwd failed in getbase\n");
+	/* hard linked files whose data was never found are empty */
+	for(i = 0; i < ARCHIVE_LINK_HASH; i++)
+		while(archive_links[i]) {
+			struct archive_link *next = archive_links[i]->next;
 
-			/* enough room for pathname + "/" + '\0' terminator? */
-			if(result && strlen(pathname) + 2 <=
-						b_size - strlen(b_buffer)) {
-				strcat(strcat(b_buffer, "/"), pathname);
-				break;
+			if(!archive_links[i]->queued) {
+				archive_links[i]->dir_ent->inode->buf.st_size =
+					0;
+				reader_read_archive(&reader,
+					archive_links[i]->dir_ent);
 			}
-		} else if(strlen(pathname) < b_size) {
-			strcpy(b_buffer, pathname);
-			break;
+
+			free(archive_links[i]);
+			archive_links[i] = next;
 		}
 
-		/* Buffer not large enough, realloc and try again */
-		b_buffer = realloc(b_buffer, b_size += BUFF_SIZE);
-		if(b_buffer == NULL)
-			MEM_ERROR();
+	archive_free_paths();
+	queue_put(to_archive, NULL);
+}
+
+
+/* Create the inode of a file written by archive_scan */
+static void archive_file_inode(squashfs_inode *inode, struct dir_ent *dir_ent,
+	int *duplicate_file)
+{
+	struct archive_inode *a = &archive_inodes[dir_ent->inode->pseudo_id];
+
+	create_inode(inode, NULL, dir_ent, SQUASHFS_FILE_TYPE, a->file_size,
+		a->start, a->blocks, a->block_list, &a->fragment, NULL,
+		a->sparse);
+	free(a->block_list);
+	*duplicate_file = a->duplicate;
+}
+
+
+/*
+ * Create the filesystem from the archive.  This is called instead of
+ * dir_scan, and writes the files as the reader thread reads them
+ */
+void archive_scan(squashfs_inode *inode, int progress)
+{
+	struct dir_ent *dir_ent, *file;
+	struct stat buf;
+
+	root_dir = scan1_newdir("", "", 1);
+	dir_ent = create_dir_entry("", NULL, "", scan1_opendir("", "", 0));
+
+	memset(&buf, 0, sizeof(buf));
+	buf.st_mode = S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH | S_IFDIR;
+	buf.st_uid = getuid();
+	buf.st_gid = getgid();
+	buf.st_mtime = time(NULL);
+	dir_ent->inode = lookup_inode2(&buf, PSEUDO_FILE_ARCHIVE, 0);
+	dir_ent->dir = root_dir;
+	root_dir->dir_ent = dir_ent;
+
+	to_archive = queue_init(ARCHIVE_QUEUE_SIZE);
+	set_progressbar_state(progress);
+	queue_put(to_reader, root_dir);
+
+	while((file = queue_get(to_archive)) != NULL) {
+		struct archive_inode *a;
+
+		if(archive_inode_count % ARCHIVE_QUEUE_SIZE == 0) {
+			archive_inodes = realloc(archive_inodes,
+				(archive_inode_count + ARCHIVE_QUEUE_SIZE) *
+				sizeof(struct archive_inode));
+			if(archive_inodes == NULL)
+				MEM_ERROR();
+		}
+
+		a = &archive_inodes[archive_inode_count];
+		file->inode->pseudo_id = archive_inode_count ++;
+		progress_bar_size((file->inode->buf.st_size + block_size - 1)
+			>> block_log);
+
+		archive_defer = a;
+		write_file(inode, file, &a->duplicate);
 	}
 
-	name = b_buffer;
-	if(((result = basename_r()) == NULL) || (strcmp(result, "..") == 0))
-		return NULL;
-	else
-		return result;
+	dir_scan6(root_dir);
+	alloc_inode_no(dir_ent->inode, root_inode_number);
+	dir_scan7(inode, root_dir);
+	dir_ent->inode->inode = *inode;
+	dir_ent->inode->type = SQUASHFS_DIR_TYPE;
 }
 
 
-char *basename_r()
+/*
+ * dir_scan1 routines...
+ * These scan the source directories into memory for processing.
+ * Exclude actions are processed here (in contrast to the other actions)
+ * because they affect what is scanned.
+ */
+static struct dir_info *scan1_newdir(char *pathname, char *subpath, int depth)
 {
-	char *s;
-	char *p;
-	int n = 1;
+	struct dir_info *dir = slab_alloc(&dir_info_slab);
 
-	for(;;) {
-		s = name;
-		if(*name == '\0')
+	dir->pathname = strdup(pathname);
+	dir->subpath = strdup(subpath);
+	dir->count = 0;
+	dir->directory_count = 0;
+	dir->dir_is_ldir = TRUE;
+	dir->list = NULL;
+	dir->depth = depth;
+	dir->excluded = 0;
+	dir->ready = FALSE;
+	dir->linuxdir = NULL;
+	dir->spill = -1;
+	dir->refs = 0;
+
+	return dir;
+}
+
+
+struct dir_info *scan1_opendir(char *pathname, char *subpath, int depth)
+{
+	DIR *linuxdir = NULL;
+	struct dir_info *dir;
+
+	if(pathname[0] != '\0') {
+		linuxdir = opendir(pathname);
+		if(linuxdir == NULL)
 			return NULL;
-		if(*name != '/') {
-			while(*name != '\0' && *name != '/') name++;
-			n = name - s;
+	}
+
+	dir = scan1_newdir(pathname, subpath, depth);
+	dir->linuxdir = linuxdir;
+
+	return dir;
+}
+
+
+struct dir_ent *scan1_encomp_readdir(struct dir_info *dir)
+{
+	static int index = 0;
+
+	if(dir->count < old_root_entries) {
+		int i;
+
+		for(i = 0; i < old_root_entries; i++) {
+			if(old_root_entry[i].inode.type == SQUASHFS_DIR_TYPE)
+				dir->directory_count ++;
+			add_dir_entry2(old_root_entry[i].name, NULL, NULL, NULL,
+				&old_root_entry[i].inode, dir);
 		}
-		while(*name == '/') name++;
-		if(strncmp(s, ".", n) == 0)
+	}
+
+	while(index < source) {
+		char *basename = NULL;
+		char *dir_name = getbase(source_path[index]);
+		int pass = 1, res;
+
+		if(dir_name == NULL) {
+			ERROR_START("Bad source directory %s",
+				source_path[index]);
+			ERROR_EXIT(" - skipping ...\n");
+			index ++;
 			continue;
-		if((*name == '\0') || (strncmp(s, "..", n) == 0) ||
-				((p = basename_r()) == NULL)) {
-			s[n] = '\0';
-			return s;
 		}
-		if(strcmp(p, "..") == 0)
-			continue;
-		return p;
+		dir_name = strdup(dir_name);
+		for(;;) {
+			struct dir_ent *dir_ent = dir->list;
+
+			for(; dir_ent && strcmp(dir_ent->name, dir_name) != 0;
+				dir_ent = dir_ent->next);
+			if(dir_ent == NULL)
+				break;
+			ERROR("Source directory entry %s already used! - trying"
+				" ", dir_name);
+			if(pass == 1)
+				basename = dir_name;
+			else
+				free(dir_name);
+			res = asprintf(&dir_name, "%s_%d", basename, pass++);
+			if(res == -1)
+				BAD_ERROR("asprintf failed in "
+					"scan1_encomp_readdir\n");
+			ERROR("%s\n", dir_name);
+		}
+		return create_dir_entry(dir_name, basename,
+			strdup(source_path[index ++]), dir);
 	}
+	return NULL;
 }
 
 
-struct inode_info *lookup_inode3(struct stat *buf, int pseudo, int id,
-	char *symlink, int bytes)
+struct dir_ent *scan1_single_readdir(struct dir_info *dir)
 {
-	int ino_hash = INODE_HASH(buf->st_dev, buf->st_ino);
-	struct inode_info *inode;
+	struct dirent *d_name;
+	int i;
 
-	/*
-	 * Look-up inode in hash table, if it already exists we have a
-	 * hard-link, so increment the nlink count and return it.
-	 * Don't do the look-up for directories because we don't hard-link
-	 * directories.
-	 */
-	if ((buf->st_mode & S_IFMT) != S_IFDIR) {
-		for(inode = inode_info[ino_hash]; inode; inode = inode->next) {
-			if(memcmp(buf, &inode->buf, sizeof(struct stat)) == 0) {
-				inode->nlink ++;
-				return inode;
-			}
+	if(dir->count < old_root_entries) {
+		for(i = 0; i < old_root_entries; i++) {
+			if(old_root_entry[i].inode.type == SQUASHFS_DIR_TYPE)
+				dir->directory_count ++;
+			add_dir_entry2(old_root_entry[i].name, NULL, NULL, NULL,
+				&old_root_entry[i].inode, dir);
+		}
+	}
+
+	if((d_name = readdir(dir->linuxdir)) != NULL) {
+		char *basename = NULL;
+		char *dir_name = strdup(d_name->d_name);
+		int pass = 1, res;
+
+		for(;;) {
+			struct dir_ent *dir_ent = dir->list;
+
+			for(; dir_ent && strcmp(dir_ent->name, dir_name) != 0;
+				dir_ent = dir_ent->next);
+			if(dir_ent == NULL)
+				break;
+			ERROR("Source directory entry %s already used! - trying"
+				" ", dir_name);
+			if (pass == 1)
+				basename = dir_name;
+			else
+				free(dir_name);
+			res = asprintf(&dir_name, "%s_%d", d_name->d_name, pass++);
+			if(res == -1)
+				BAD_ERROR("asprintf failed in "
+					"scan1_single_readdir\n");
+			ERROR("%s\n", dir_name);
 		}
+		return create_dir_entry(dir_name, basename, NULL, dir);
 	}
 
-	inode = malloc(sizeof(struct inode_info) + bytes);
-	if(inode == NULL)
-		MEM_ERROR();
-
-	if(bytes)
-		memcpy(&inode->symlink, symlink, bytes);
-	memcpy(&inode->buf, buf, sizeof(struct stat));
-	inode->read = FALSE;
-	inode->root_entry = FALSE;
-	inode->pseudo_file = pseudo;
-	inode->pseudo_id = id;
-	inode->inode = SQUASHFS_INVALID_BLK;
-	inode->nlink = 1;
-	inode->inode_number = 0;
+	return NULL;
+}
 
-	/*
-	 * Copy filesystem wide defaults into inode, these filesystem
-	 * wide defaults may be altered on an individual inode basis by
-	 * user specified actions
-	 *
-	*/
-	inode->no_fragments = no_fragments;
-	inode->always_use_fragments = always_use_fragments;
-	inode->noD = noD;
-	inode->noF = noF;
 
-	inode->next = inode_info[ino_hash];
-	inode_info[ino_hash] = inode;
+struct dir_ent *scan1_readdir(struct dir_info *dir)
+{
+	struct dirent *d_name = readdir(dir->linuxdir);
 
-	return inode;
+	return d_name ?
+		create_dir_entry(strdup(d_name->d_name), NULL, NULL, dir) :
+		NULL;
 }
 
 
-struct inode_info *lookup_inode2(struct stat *buf, int pseudo, int id)
+void scan1_freedir(struct dir_info *dir)
 {
-	return lookup_inode3(buf, pseudo, id, NULL, 0);
+	if(dir->pathname[0] != '\0')
+		closedir(dir->linuxdir);
 }
 
 
-inline struct inode_info *lookup_inode(struct stat *buf)
+/*
+ * Directory read-ahead.  Reading the directories and stat'ing their
+ * entries is done by the scanner threads, which read the subdirectories
+ * of a directory concurrently while the main thread builds the in-core
+ * directory tree in the usual order.  Everything which affects the tree
+ * (excluding, hard-link detection, error reporting) is still done by the
+ * main thread, in the same order as a serial scan, and so the result is
+ * identical.
+ *
+ * Subdirectories are read ahead when their parent is processed, unless
+ * they're excluded (by -e or -ef, exclude actions are not evaluated ahead),
+ * and no more than SCAN_AHEAD directories are read ahead at any one time.
+ * A directory which isn't read ahead is read by the main thread when it is
+ * reached
+ */
+static void scan_stat(char *filename, struct scan_entry *entry, char *buff)
 {
-	return lookup_inode2(buf, 0, 0);
-}
+	entry->symlink = NULL;
+	entry->ahead = NULL;
+	entry->xattrs = -1;
 
+	if(lstat(filename, &entry->buf) == -1) {
+		entry->error = errno;
+		return;
+	}
 
-inline void alloc_inode_no(struct inode_info *inode, unsigned int use_this)
-{
-	if (inode->inode_number == 0) {
-		inode->inode_number = use_this ? : inode_no ++;
-		if((inode->buf.st_mode & S_IFMT) == S_IFREG)
-			progress_bar_size((inode->buf.st_size + block_size - 1)
-								 >> block_log);
+	entry->error = 0;
+	entry->xattrs = prefetch_xattrs(filename, &entry->xattr_list);
+
+	if((entry->buf.st_mode & S_IFMT) == S_IFLNK) {
+		entry->link_bytes = readlink(filename, buff, 65536);
+		if(entry->link_bytes != -1 && entry->link_bytes < 65536) {
+			/* readlink doesn't 0 terminate the returned path */
+			buff[entry->link_bytes] = '\0';
+			entry->symlink = buff;
+		}
 	}
 }
 
 
-inline struct dir_ent *create_dir_entry(char *name, char *source_name,
-	char *nonstandard_pathname, struct dir_info *dir)
+static struct scan_ahead *scan_ahead_init(char *pathname)
 {
-	struct dir_ent *dir_ent = malloc(sizeof(struct dir_ent));
-	if(dir_ent == NULL)
+	struct scan_ahead *ahead = malloc(sizeof(struct scan_ahead));
+
+	if(ahead == NULL)
 		MEM_ERROR();
 
-	dir_ent->name = name;
-	dir_ent->source_name = source_name;
-	dir_ent->nonstandard_pathname = nonstandard_pathname;
-	dir_ent->our_dir = dir;
-	dir_ent->inode = NULL;
-	dir_ent->next = NULL;
+	ahead->pathname = pathname;
+	ahead->entry = NULL;
+	ahead->count = 0;
+	ahead->error = 0;
+	ahead->done = FALSE;
 
-	return dir_ent;
+	return ahead;
 }
 
 
-inline void add_dir_entry(struct dir_ent *dir_ent, struct dir_info *sub_dir,
-	struct inode_info *inode_info)
+static void scan_read(struct scan_ahead *ahead)
 {
-	struct dir_info *dir = dir_ent->our_dir;
+	DIR *linuxdir = opendir(ahead->pathname);
+	struct dirent *d_name;
+	char *buff, *filename;
+	int size = 0;
 
-	if(sub_dir)
-		sub_dir->dir_ent = dir_ent;
+	if(linuxdir == NULL) {
+		ahead->error = errno;
+		return;
+	}
 
-/* ANDROID CHANGES START*/
-#ifdef ANDROID
-	if (android_config) {
-		if (mount_point) {
-			char *mounted_path;
-			alloc_mounted_path(mount_point, subpathname(dir_ent), &mounted_path);
-			android_fs_config(mounted_path, &inode_info->buf);
-			free(mounted_path);
-		} else {
-			android_fs_config(pathname(dir_ent), &inode_info->buf);
+	buff = malloc(65536);
+	if(buff == NULL)
+		MEM_ERROR();
+
+	while((d_name = readdir(linuxdir)) != NULL) {
+		struct scan_entry *entry;
+
+		if(strcmp(d_name->d_name, ".") == 0 ||
+					strcmp(d_name->d_name, "..") == 0)
+			continue;
+
+		if(ahead->count == size) {
+			size = size ? size << 1 : SCAN_ENTRIES;
+			ahead->entry = realloc(ahead->entry, size *
+				sizeof(struct scan_entry));
+			if(ahead->entry == NULL)
+				MEM_ERROR();
 		}
-	}
-#endif
-/* ANDROID CHANGES END */
 
-	dir_ent->inode = inode_info;
-	dir_ent->dir = sub_dir;
+		entry = &ahead->entry[ahead->count ++];
+		entry->name = strdup(d_name->d_name);
+		if(entry->name == NULL)
+			MEM_ERROR();
 
-	dir_ent->next = dir->list;
-	dir->list = dir_ent;
-	dir->count++;
+		if(asprintf(&filename, "%s/%s", ahead->pathname,
+							entry->name) == -1)
+			BAD_ERROR("asprintf failed in scan_read\n");
+
+		scan_stat(filename, entry, buff);
+		if(entry->symlink) {
+			entry->symlink = strdup(buff);
+			if(entry->symlink == NULL)
+				MEM_ERROR();
+		}
+
+		free(filename);
+	}
+
+	closedir(linuxdir);
+	free(buff);
 }
 
-/* ANDROID CHANGES START*/
-#ifdef ANDROID
-/* Weird linker bug that complains those inline functions are undefined. */
-extern inline void add_dir_entry(struct dir_ent *dir_ent, struct dir_info *sub_dir,
-	struct inode_info *inode_info);
-extern inline void add_dir_entry2(char *name, char *source_name,
-	char *nonstandard_pathname, struct dir_info *sub_dir,
-	struct inode_info *inode_info, struct dir_info *dir);
-#endif
-/* ANDROID CHANGES END */
 
-inline void add_dir_entry2(char *name, char *source_name,
-	char *nonstandard_pathname, struct dir_info *sub_dir,
-	struct inode_info *inode_info, struct dir_info *dir)
+void *scan_thrd(void *arg)
 {
-	struct dir_ent *dir_ent = create_dir_entry(name, source_name,
-		nonstandard_pathname, dir);
+	sigset_t sigmask, old_mask;
 
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask, SIGINT);
+	sigaddset(&sigmask, SIGTERM);
+	sigaddset(&sigmask, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &sigmask, &old_mask);
 
-	add_dir_entry(dir_ent, sub_dir, inode_info);
-}
+	while(1) {
+		struct scan_ahead *ahead = queue_get(to_scan);
 
+		if(ahead == NULL)
+			return NULL;
 
-inline void free_dir_entry(struct dir_ent *dir_ent)
-{
-	if(dir_ent->name)
-		free(dir_ent->name);
+		scan_read(ahead);
 
-	if(dir_ent->source_name)
-		free(dir_ent->source_name);
+		pthread_cleanup_push((void *) pthread_mutex_unlock,
+			&scan_mutex);
+		pthread_mutex_lock(&scan_mutex);
+		ahead->done = TRUE;
+		pthread_cond_broadcast(&scan_done);
+		pthread_cleanup_pop(1);
+	}
+}
 
-	if(dir_ent->nonstandard_pathname)
-		free(dir_ent->nonstandard_pathname);
 
-	/* if this entry has been associated with an inode, then we need
-	 * to update the inode nlink count.  Orphaned inodes are harmless, and
-	 * is easier to leave them than go to the bother of deleting them */
-	if(dir_ent->inode && !dir_ent->inode->root_entry)
-		dir_ent->inode->nlink --;
+static void scan_wait(struct scan_ahead *ahead)
+{
+	pthread_cleanup_push((void *) pthread_mutex_unlock, &scan_mutex);
+	pthread_mutex_lock(&scan_mutex);
+	while(!ahead->done)
+		pthread_cond_wait(&scan_done, &scan_mutex);
+	pthread_cleanup_pop(1);
 
-	free(dir_ent);
+	scan_ahead_count --;
 }
 
 
-inline void add_excluded(struct dir_info *dir)
+static void scan_free(struct scan_ahead *ahead)
 {
-	dir->excluded ++;
+	free(ahead->pathname);
+	free(ahead->entry);
+	free(ahead);
 }
 
 
-void dir_scan(squashfs_inode *inode, char *pathname,
-	struct dir_ent *(_readdir)(struct dir_info *), int progress)
+/*
+ * Throw away a directory which was read ahead, but which turned out not
+ * to be wanted (it was excluded by an exclude action)
+ */
+static void scan_discard(struct scan_ahead *ahead)
 {
-	struct stat buf;
-	struct dir_ent *dir_ent;
-	
-	root_dir = dir_scan1(pathname, "", paths, _readdir, 1);
-	if(root_dir == NULL)
-		return;
+	int i;
 
-	/* Create root directory dir_ent and associated inode, and connect
-	 * it to the root directory dir_info structure */
-	dir_ent = create_dir_entry("", NULL, pathname,
-						scan1_opendir("", "", 0));
+	scan_wait(ahead);
 
-	if(pathname[0] == '\0') {
-		/*
- 		 * dummy top level directory, if multiple sources specified on
-		 * command line
-		 */
-		memset(&buf, 0, sizeof(buf));
-		buf.st_mode = S_IRWXU | S_IRWXG | S_IRWXO | S_IFDIR;
-		buf.st_uid = getuid();
-		buf.st_gid = getgid();
-		buf.st_mtime = time(NULL);
-		buf.st_dev = 0;
-		buf.st_ino = 0;
-		dir_ent->inode = lookup_inode2(&buf, PSEUDO_FILE_OTHER, 0);
-	} else {
-		if(lstat(pathname, &buf) == -1)
-			/* source directory has disappeared? */
-			BAD_ERROR("Cannot stat source directory %s because %s\n",
-				pathname, strerror(errno));
-/* ANDROID CHANGES START*/
-#ifdef ANDROID
-		if (android_config)
-			if (mount_point)
-				android_fs_config(mount_point, &buf);
-			else
-				android_fs_config(pathname, &buf);
-#endif
-/* ANDROID CHANGES END */
-		dir_ent->inode = lookup_inode(&buf);
+	for(i = 0; i < ahead->count; i++) {
+		free(ahead->entry[i].name);
+		free_prefetched_xattrs(ahead->entry[i].xattrs,
+			ahead->entry[i].xattr_list);
+		free(ahead->entry[i].symlink);
 	}
 
-	dir_ent->dir = root_dir;
-	root_dir->dir_ent = dir_ent;
+	scan_free(ahead);
+}
 
-	/*
-	 * Process most actions and any pseudo files
-	 */
-	if(actions() || get_pseudo())
-		dir_scan2(root_dir, get_pseudo());
 
-	/*
-	 * Process move actions
-	 */
-	if(move_actions()) {
-		dir_scan3(root_dir);
-		do_move_actions();
+/*
+ * Queue the subdirectories of a directory which has been read to be read
+ * ahead by the scanner threads
+ */
+static void scan_queue(struct scan_ahead *ahead, struct pathnames *paths)
+{
+	int i;
+
+	for(i = 0; i < ahead->count && scan_ahead_count < SCAN_AHEAD; i++) {
+		struct scan_entry *entry = &ahead->entry[i];
+		struct pathnames *new = NULL;
+		char *pathname;
+
+		if(entry->error || (entry->buf.st_mode & S_IFMT) != S_IFDIR)
+			continue;
+
+		if(old_exclude ? old_excluded(NULL, &entry->buf) :
+					excluded(entry->name, paths, &new))
+			continue;
+		free(new);
+
+		if(asprintf(&pathname, "%s/%s", ahead->pathname,
+							entry->name) == -1)
+			BAD_ERROR("asprintf failed in scan_queue\n");
+
+		entry->ahead = scan_ahead_init(pathname);
+		scan_ahead_count ++;
+		queue_put(to_scan, entry->ahead);
 	}
+}
 
-	/*
-	 * Process prune actions
-	 */
-	if(prune_actions())
-		dir_scan4(root_dir);
 
-	/*
-	 * Process empty actions
-	 */
-	if(empty_actions())
-		dir_scan5(root_dir);
+void scan_threads_init()
+{
+	int i;
 
- 	/*
-	 * Sort directories and compute the inode numbers
-	 */
-	dir_scan6(root_dir);
+	if(scanners == -1)
+		scanners = processors;
 
-	alloc_inode_no(dir_ent->inode, root_inode_number);
+	if(scanners == 1)
+		return;
 
-	eval_actions(root_dir, dir_ent);
+	if(multiply_overflow(scanners, sizeof(pthread_t)))
+		BAD_ERROR("Scanners too large\n");
 
-	if(sorted)
-		generate_file_priorities(root_dir, 0,
-			&root_dir->dir_ent->inode->buf);
+	scan_thread = malloc(scanners * sizeof(pthread_t));
+	if(scan_thread == NULL)
+		MEM_ERROR();
 
-	if(appending) {
-		sigset_t sigmask;
+	to_scan = queue_init(SCAN_AHEAD + scanners);
 
-		restore_thread = init_restore_thread();
-		sigemptyset(&sigmask);
-		sigaddset(&sigmask, SIGINT);
-		sigaddset(&sigmask, SIGTERM);
-		sigaddset(&sigmask, SIGUSR1);
-		if(pthread_sigmask(SIG_BLOCK, &sigmask, NULL) == -1)
-			BAD_ERROR("Failed to set signal mask\n");
-		write_destination(fd, SQUASHFS_START, 4, "\0\0\0\0");
-	}
+	for(i = 0; i < scanners; i++)
+		if(pthread_create(&scan_thread[i], NULL, scan_thrd, NULL) != 0)
+			BAD_ERROR("Failed to create thread\n");
+}
+
+
+void scan_threads_fini()
+{
+	int i;
 
-	queue_put(to_reader, root_dir);
+	if(to_scan == NULL)
+		return;
 
-	set_progressbar_state(progress);
+	for(i = 0; i < scanners; i++)
+		queue_put(to_scan, NULL);
 
-	if(sorted)
-		sort_files_and_write(root_dir);
+	for(i = 0; i < scanners; i++)
+		pthread_join(scan_thread[i], NULL);
 
-	dir_scan7(inode, root_dir);
-	dir_ent->inode->inode = *inode;
-	dir_ent->inode->type = SQUASHFS_DIR_TYPE;
+	free(scan_thread);
+	queue_free(to_scan);
+	to_scan = NULL;
 }
 
 
 /*
- * dir_scan1 routines...
- * These scan the source directories into memory for processing.
- * Exclude actions are processed here (in contrast to the other actions)
- * because they affect what is scanned.
+ * Give the xattrs read with an entry to its inode, unless the inode already
+ * has them (it is a hard link)
  */
-struct dir_info *scan1_opendir(char *pathname, char *subpath, int depth)
+static void scan1_xattrs(struct scan_entry *entry, struct inode_info *inode)
 {
-	struct dir_info *dir;
+	if(inode->nlink == 1 && inode->xattrs == -1) {
+		inode->xattr_list = entry->xattr_list;
+		inode->xattrs = entry->xattrs;
+	} else
+		free_prefetched_xattrs(entry->xattrs, entry->xattr_list);
 
-	dir = malloc(sizeof(struct dir_info));
-	if(dir == NULL)
-		MEM_ERROR();
+	entry->xattrs = -1;
+}
 
-	if(pathname[0] != '\0') {
-		dir->linuxdir = opendir(pathname);
-		if(dir->linuxdir == NULL) {
-			free(dir);
-			return NULL;
-		}
-	}
 
-	dir->pathname = strdup(pathname);
-	dir->subpath = strdup(subpath);
-	dir->count = 0;
-	dir->directory_count = 0;
-	dir->dir_is_ldir = TRUE;
-	dir->list = NULL;
-	dir->depth = depth;
-	dir->excluded = 0;
+/*
+ * Add one entry to the directory being scanned.  The entry has been
+ * stat'ed, by scan_stat().  A subdirectory is read (or its read-ahead
+ * waited for) to check it can be opened, but the subdirectories are only
+ * scanned once the directory is complete, by scan1_subdirs()
+ */
+static void scan1_add(struct dir_info *dir, struct dir_ent *dir_ent,
+	struct scan_entry *entry, struct pathnames *paths, int depth)
+{
+	struct scan_ahead *ahead;
+	struct dir_info *sub_dir;
+	struct stat *buf = &entry->buf;
+	struct pathnames *new = NULL;
+	char *filename = pathname(dir_ent);
+	char *subpath = NULL;
+	char *dir_name = dir_ent->name;
 
-	return dir;
-}
+	entry->sub_dir = NULL;
 
+	if(strcmp(dir_name, ".") == 0 || strcmp(dir_name, "..") == 0) {
+		free_dir_entry(dir_ent);
+		return;
+	}
 
-struct dir_ent *scan1_encomp_readdir(struct dir_info *dir)
-{
-	static int index = 0;
+	if(entry->error) {
+		ERROR_START("Cannot stat dir/file %s because %s",
+			filename, strerror(entry->error));
+		ERROR_EXIT(", ignoring\n");
+		free_dir_entry(dir_ent);
+		return;
+	}
 
-	if(dir->count < old_root_entries) {
-		int i;
+	if((buf->st_mode & S_IFMT) != S_IFREG &&
+				(buf->st_mode & S_IFMT) != S_IFDIR &&
+				(buf->st_mode & S_IFMT) != S_IFLNK &&
+				(buf->st_mode & S_IFMT) != S_IFCHR &&
+				(buf->st_mode & S_IFMT) != S_IFBLK &&
+				(buf->st_mode & S_IFMT) != S_IFIFO &&
+				(buf->st_mode & S_IFMT) != S_IFSOCK) {
+		ERROR_START("File %s has unrecognised filetype %d",
+			filename, buf->st_mode & S_IFMT);
+		ERROR_EXIT(", ignoring\n");
+		free_dir_entry(dir_ent);
+		return;
+	}
 
-		for(i = 0; i < old_root_entries; i++) {
-			if(old_root_entry[i].inode.type == SQUASHFS_DIR_TYPE)
-				dir->directory_count ++;
-			add_dir_entry2(old_root_entry[i].name, NULL, NULL, NULL,
-				&old_root_entry[i].inode, dir);
+	if((old_exclude && old_excluded(filename, buf)) ||
+		(!old_exclude && excluded(dir_name, paths, &new))) {
+		add_excluded(dir);
+		free_dir_entry(dir_ent);
+		return;
+	}
+
+	if(exclude_actions()) {
+		subpath = subpathname(dir_ent);
+		
+		if(eval_exclude_actions(dir_name, filename, subpath,
+						buf, depth, dir_ent)) {
+			add_excluded(dir);
+			free_dir_entry(dir_ent);
+			free(new);
+			return;
 		}
 	}
 
-	while(index < source) {
-		char *basename = NULL;
-		char *dir_name = getbase(source_path[index]);
-		int pass = 1, res;
+	switch(buf->st_mode & S_IFMT) {
+	case S_IFDIR:
+		if(subpath == NULL)
+			subpath = subpathname(dir_ent);
 
-		if(dir_name == NULL) {
-			ERROR_START("Bad source directory %s",
-				source_path[index]);
-			ERROR_EXIT(" - skipping ...\n");
-			index ++;
-			continue;
+		ahead = entry->ahead;
+		if(ahead)
+			scan_wait(ahead);
+		else {
+			ahead = scan_ahead_init(strdup(filename));
+			scan_read(ahead);
 		}
-		dir_name = strdup(dir_name);
-		for(;;) {
-			struct dir_ent *dir_ent = dir->list;
 
-			for(; dir_ent && strcmp(dir_ent->name, dir_name) != 0;
-				dir_ent = dir_ent->next);
-			if(dir_ent == NULL)
-				break;
-			ERROR("Source directory entry %s already used! - trying"
-				" ", dir_name);
-			if(pass == 1)
-				basename = dir_name;
-			else
-				free(dir_name);
-			res = asprintf(&dir_name, "%s_%d", basename, pass++);
-			if(res == -1)
-				BAD_ERROR("asprintf failed in "
-					"scan1_encomp_readdir\n");
-			ERROR("%s\n", dir_name);
+		if(ahead->error) {
+			ERROR_START("Could not open %s", filename);
+			ERROR_EXIT(", skipping...\n");
+			scan_free(ahead);
+			entry->ahead = NULL;
+			free_dir_entry(dir_ent);
+			break;
 		}
-		return create_dir_entry(dir_name, basename,
-			strdup(source_path[index ++]), dir);
-	}
-	return NULL;
-}
 
+		if(to_scan)
+			scan_queue(ahead, new);
 
-struct dir_ent *scan1_single_readdir(struct dir_info *dir)
-{
-	struct dirent *d_name;
-	int i;
+		sub_dir = scan1_newdir(filename, subpath, depth + 1);
+		dir->directory_count ++;
+		add_dir_entry(dir_ent, sub_dir, lookup_inode(buf));
+		scan1_xattrs(entry, dir_ent->inode);
 
-	if(dir->count < old_root_entries) {
-		for(i = 0; i < old_root_entries; i++) {
-			if(old_root_entry[i].inode.type == SQUASHFS_DIR_TYPE)
-				dir->directory_count ++;
-			add_dir_entry2(old_root_entry[i].name, NULL, NULL, NULL,
-				&old_root_entry[i].inode, dir);
+		entry->ahead = ahead;
+		entry->sub_dir = sub_dir;
+		entry->paths = new;
+		return;
+	case S_IFLNK:
+		if(entry->link_bytes == -1) {
+			ERROR_START("Failed to read symlink %s", filename);
+			ERROR_EXIT(", ignoring\n");
+			free_dir_entry(dir_ent);
+		} else if(entry->link_bytes == 65536) {
+			ERROR_START("Symlink %s is greater than 65536 bytes!",
+				filename);
+			ERROR_EXIT(", ignoring\n");
+			free_dir_entry(dir_ent);
+		} else {
+			add_dir_entry(dir_ent, NULL, lookup_inode3(buf, 0, 0,
+				entry->symlink, entry->link_bytes + 1));
+			scan1_xattrs(entry, dir_ent->inode);
 		}
+		break;
+	default:
+		add_dir_entry(dir_ent, NULL, lookup_inode(buf));
+		scan1_xattrs(entry, dir_ent->inode);
 	}
 
-	if((d_name = readdir(dir->linuxdir)) != NULL) {
-		char *basename = NULL;
-		char *dir_name = strdup(d_name->d_name);
-		int pass = 1, res;
+	free(new);
+}
 
-		for(;;) {
-			struct dir_ent *dir_ent = dir->list;
 
-			for(; dir_ent && strcmp(dir_ent->name, dir_name) != 0;
-				dir_ent = dir_ent->next);
-			if(dir_ent == NULL)
-				break;
-			ERROR("Source directory entry %s already used! - trying"
-				" ", dir_name);
-			if (pass == 1)
-				basename = dir_name;
-			else
-				free(dir_name);
-			res = asprintf(&dir_name, "%s_%d", d_name->d_name, pass++);
-			if(res == -1)
-				BAD_ERROR("asprintf failed in "
-					"scan1_single_readdir\n");
-			ERROR("%s\n", dir_name);
-		}
-		return create_dir_entry(dir_name, basename, NULL, dir);
-	}
+/*
+ * The directory is complete, when streaming sort it and hand it over to
+ * the reader thread, see dir_scan().  With -spill it is sorted here too,
+ * because it is spilled once its subdirectories have been scanned
+ */
+static void scan1_done(struct dir_info *dir)
+{
+	if(!streaming && spill_fd == -1)
+		return;
 
-	return NULL;
+	sort_directory(dir);
+
+	if(!streaming)
+		return;
+
+	pthread_cleanup_push((void *) pthread_mutex_unlock, &scan_mutex);
+	pthread_mutex_lock(&scan_mutex);
+	dir->ready = TRUE;
+	pthread_cond_broadcast(&scan_ready);
+	pthread_cleanup_pop(1);
+
+	if(dir->depth == 1)
+		queue_put(to_reader, dir);
 }
 
 
-struct dir_ent *scan1_readdir(struct dir_info *dir)
+static void dir_scan1_list(struct dir_info *, struct scan_ahead *,
+	struct pathnames *);
+
+static void scan1_subdirs(struct scan_entry *entry, int count)
 {
-	struct dirent *d_name = readdir(dir->linuxdir);
+	int i;
 
-	return d_name ?
-		create_dir_entry(strdup(d_name->d_name), NULL, NULL, dir) :
-		NULL;
+	for(i = 0; i < count; i++)
+		if(entry[i].sub_dir) {
+			dir_scan1_list(entry[i].sub_dir, entry[i].ahead,
+				entry[i].paths);
+			free(entry[i].paths);
+		}
 }
 
 
-void scan1_freedir(struct dir_info *dir)
+/*
+ * Scan a directory using the list of entries read by scan_read()
+ */
+static void dir_scan1_list(struct dir_info *dir, struct scan_ahead *ahead,
+	struct pathnames *paths)
 {
-	if(dir->pathname[0] != '\0')
-		closedir(dir->linuxdir);
+	int i;
+
+	for(i = 0; i < ahead->count; i++) {
+		struct scan_entry *entry = &ahead->entry[i];
+
+		scan1_add(dir, create_dir_entry(entry->name, NULL, NULL, dir),
+			entry, paths, dir->depth);
+		free_prefetched_xattrs(entry->xattrs, entry->xattr_list);
+		if(entry->ahead && entry->sub_dir == NULL)
+			scan_discard(entry->ahead);
+		free(entry->symlink);
+	}
+
+	scan1_done(dir);
+	scan1_subdirs(ahead->entry, ahead->count);
+	scan_free(ahead);
+
+	/* the root directory is always kept in memory */
+	if(spill_fd != -1 && dir->depth > 1)
+		spill_dir(dir);
 }
 
 
@@ -3389,112 +6545,63 @@ struct dir_info *dir_scan1(char *filename, char *subpath,
 	struct pathnames *paths,
 	struct dir_ent *(_readdir)(struct dir_info *), int depth)
 {
-	struct dir_info *dir = scan1_opendir(filename, subpath, depth);
+	struct dir_info *dir;
 	struct dir_ent *dir_ent;
+	struct scan_entry *entry = NULL;
+	int count = 0, size = 0;
+	static char buff[65536]; /* overflow safe */
+
+	if(_readdir == scan1_readdir) {
+		struct scan_ahead *ahead = scan_ahead_init(strdup(filename));
+
+		scan_read(ahead);
+		if(ahead->error) {
+			ERROR_START("Could not open %s", filename);
+			ERROR_EXIT(", skipping...\n");
+			scan_free(ahead);
+			return NULL;
+		}
+
+		if(to_scan)
+			scan_queue(ahead, paths);
 
+		dir = scan1_newdir(filename, subpath, depth);
+		dir_scan1_list(dir, ahead, paths);
+
+		return dir;
+	}
+
+	dir = scan1_opendir(filename, subpath, depth);
 	if(dir == NULL) {
 		ERROR_START("Could not open %s", filename);
 		ERROR_EXIT(", skipping...\n");
 		return NULL;
 	}
 
+	/*
+	 * The root directory entries are stat'ed and added here, one by one,
+	 * because the readdir functions check the names already added
+	 */
 	while((dir_ent = _readdir(dir))) {
-		struct dir_info *sub_dir;
-		struct stat buf;
-		struct pathnames *new = NULL;
-		char *filename = pathname(dir_ent);
-		char *subpath = NULL;
-		char *dir_name = dir_ent->name;
-
-		if(strcmp(dir_name, ".") == 0 || strcmp(dir_name, "..") == 0) {
-			free_dir_entry(dir_ent);
-			continue;
-		}
-
-		if(lstat(filename, &buf) == -1) {
-			ERROR_START("Cannot stat dir/file %s because %s",
-				filename, strerror(errno));
-			ERROR_EXIT(", ignoring\n");
-			free_dir_entry(dir_ent);
-			continue;
-		}
-
-		if((buf.st_mode & S_IFMT) != S_IFREG &&
-					(buf.st_mode & S_IFMT) != S_IFDIR &&
-					(buf.st_mode & S_IFMT) != S_IFLNK &&
-					(buf.st_mode & S_IFMT) != S_IFCHR &&
-					(buf.st_mode & S_IFMT) != S_IFBLK &&
-					(buf.st_mode & S_IFMT) != S_IFIFO &&
-					(buf.st_mode & S_IFMT) != S_IFSOCK) {
-			ERROR_START("File %s has unrecognised filetype %d",
-				filename, buf.st_mode & S_IFMT);
-			ERROR_EXIT(", ignoring\n");
-			free_dir_entry(dir_ent);
-			continue;
-		}
-
-		if((old_exclude && old_excluded(filename, &buf)) ||
-			(!old_exclude && excluded(dir_name, paths, &new))) {
-			add_excluded(dir);
-			free_dir_entry(dir_ent);
-			continue;
-		}
-
-		if(exclude_actions()) {
-			subpath = subpathname(dir_ent);
-			
-			if(eval_exclude_actions(dir_name, filename, subpath,
-							&buf, depth, dir_ent)) {
-				add_excluded(dir);
-				free_dir_entry(dir_ent);
-				continue;
-			}
-		}
-
-		switch(buf.st_mode & S_IFMT) {
-		case S_IFDIR:
-			if(subpath == NULL)
-				subpath = subpathname(dir_ent);
-
-			sub_dir = dir_scan1(filename, subpath, new,
-					scan1_readdir, depth + 1);
-			if(sub_dir) {
-				dir->directory_count ++;
-				add_dir_entry(dir_ent, sub_dir,
-							lookup_inode(&buf));
-			} else
-				free_dir_entry(dir_ent);
-			break;
-		case S_IFLNK: {
-			int byte;
-			static char buff[65536]; /* overflow safe */
-
-			byte = readlink(filename, buff, 65536);
-			if(byte == -1) {
-				ERROR_START("Failed to read symlink %s",
-								filename);
-				ERROR_EXIT(", ignoring\n");
-			} else if(byte == 65536) {
-				ERROR_START("Symlink %s is greater than 65536 "
-							"bytes!", filename);
-				ERROR_EXIT(", ignoring\n");
-			} else {
-				/* readlink doesn't 0 terminate the returned
-				 * path */
-				buff[byte] = '\0';
-				add_dir_entry(dir_ent, NULL, lookup_inode3(&buf,
-							 0, 0, buff, byte + 1));
-			}
-			break;
-		}
-		default:
-			add_dir_entry(dir_ent, NULL, lookup_inode(&buf));
+		if(count == size) {
+			size = size ? size << 1 : SCAN_ENTRIES;
+			entry = realloc(entry, size * sizeof(struct scan_entry));
+			if(entry == NULL)
+				MEM_ERROR();
 		}
 
-		free(new);
+		scan_stat(pathname(dir_ent), &entry[count], buff);
+		scan1_add(dir, dir_ent, &entry[count], paths, depth);
+		free_prefetched_xattrs(entry[count].xattrs,
+			entry[count].xattr_list);
+		if(entry[count].sub_dir)
+			count ++;
 	}
 
 	scan1_freedir(dir);
+	scan1_done(dir);
+	scan1_subdirs(entry, count);
+	free(entry);
 
 	return dir;
 }
@@ -3517,11 +6624,68 @@ struct dir_ent *scan2_readdir(struct dir_info *dir, struct dir_ent *dir_ent)
 }
 
 
-struct dir_ent *scan2_lookup(struct dir_info *dir, char *name)
+/*
+ * Pseudo names are unique within their pseudo directory, and so a pseudo
+ * file can only clash with an entry read from the source directory, not
+ * with the pseudo files added before it.  The lookup is restricted to the
+ * source entries, and if there are more than SCAN2_HASH_MIN of them
+ * they're hashed, so that adding many pseudo files to a large directory
+ * doesn't search the directory for each one
+ */
+#define SCAN2_HASH_MIN 16
+
+struct scan2_names {
+	struct dir_ent	*list;
+	struct dir_ent	**hash;
+	unsigned int	mask;
+};
+
+
+static void scan2_names_init(struct scan2_names *names, struct dir_info *dir,
+	struct pseudo *pseudo)
+{
+	struct dir_ent *dir_ent;
+	unsigned int size = SCAN2_HASH_MIN * 4;
+
+	names->list = dir->list;
+	names->hash = NULL;
+
+	if(pseudo == NULL || pseudo->names < 2 || dir->count <= SCAN2_HASH_MIN)
+		return;
+
+	while(size < dir->count * 2)
+		size <<= 1;
+
+	names->hash = calloc(size, sizeof(struct dir_ent *));
+	if(names->hash == NULL)
+		MEM_ERROR();
+
+	names->mask = size - 1;
+	for(dir_ent = dir->list; dir_ent; dir_ent = dir_ent->next) {
+		unsigned int h = name_hash(dir_ent->name) & names->mask;
+
+		while(names->hash[h])
+			h = (h + 1) & names->mask;
+		names->hash[h] = dir_ent;
+	}
+}
+
+
+static struct dir_ent *scan2_lookup(struct scan2_names *names, char *name)
 {
-	struct dir_ent *dir_ent = dir->list;
+	struct dir_ent *dir_ent;
+
+	if(names->hash) {
+		unsigned int h = name_hash(name) & names->mask;
+
+		for(; (dir_ent = names->hash[h]); h = (h + 1) & names->mask)
+			if(strcmp(dir_ent->name, name) == 0)
+				return dir_ent;
+
+		return NULL;
+	}
 
-	for(; dir_ent && strcmp(dir_ent->name, name) != 0;
+	for(dir_ent = names->list; dir_ent && strcmp(dir_ent->name, name) != 0;
 					dir_ent = dir_ent->next);
 
 	return dir_ent;
@@ -3532,12 +6696,13 @@ void dir_scan2(struct dir_info *dir, struct pseudo *pseudo)
 {
 	struct dir_ent *dir_ent = NULL;
 	struct pseudo_entry *pseudo_ent;
+	struct scan2_names names;
 	struct stat buf;
 	static int pseudo_ino = 1;
 	
 	while((dir_ent = scan2_readdir(dir, dir_ent)) != NULL) {
 		struct inode_info *inode_info = dir_ent->inode;
-		struct stat *buf = &inode_info->buf;
+		struct inode_stat *buf = &inode_info->buf;
 		char *name = dir_ent->name;
 
 		eval_actions(root_dir, dir_ent);
@@ -3546,10 +6711,12 @@ void dir_scan2(struct dir_info *dir, struct pseudo *pseudo)
 			dir_scan2(dir_ent->dir, pseudo_subdir(name, pseudo));
 	}
 
+	scan2_names_init(&names, dir, pseudo);
+
 	while((pseudo_ent = pseudo_readdir(pseudo)) != NULL) {
-		dir_ent = scan2_lookup(dir, pseudo_ent->name);
+		dir_ent = scan2_lookup(&names, pseudo_ent->name);
 		if(pseudo_ent->dev->type == 'm') {
-			struct stat *buf;
+			struct inode_stat *buf;
 			if(dir_ent == NULL) {
 				ERROR_START("Pseudo modify file \"%s\" does "
 					"not exist in source filesystem.",
@@ -3630,6 +6797,8 @@ void dir_scan2(struct dir_info *dir, struct pseudo *pseudo)
 				lookup_inode2(&buf, PSEUDO_FILE_OTHER, 0), dir);
 		}
 	}
+
+	free(names.hash);
 }
 
 
@@ -3675,7 +6844,7 @@ void free_dir(struct dir_info *dir)
 
 	free(dir->pathname);
 	free(dir->subpath);
-	free(dir);
+	slab_free(&dir_info_slab, dir);
 }
 	
 
@@ -3752,7 +6921,7 @@ void dir_scan5(struct dir_info *dir)
 				 */
 				free(dir_ent->dir->pathname);
 				free(dir_ent->dir->subpath);
-				free(dir_ent->dir);
+				slab_free(&dir_info_slab, dir_ent->dir);
 
 				/* remove dir_ent from list */
 				dir_ent = dir_ent->next;
@@ -3877,7 +7046,12 @@ void dir_scan6(struct dir_info *dir)
 	struct dir_ent *dir_ent;
 	unsigned int byte_count = 0;
 
-	sort_directory(dir);
+	/*
+	 * when streaming, or with -spill, the directory was sorted when it
+	 * was scanned
+	 */
+	if(!streaming && spill_fd == -1)
+		sort_directory(dir);
 
 	for(dir_ent = dir->list; dir_ent; dir_ent = dir_ent->next) {
 		byte_count += strlen(dir_ent->name) +
@@ -3888,7 +7062,9 @@ void dir_scan6(struct dir_info *dir)
 
 		alloc_inode_no(dir_ent->inode, 0);
 
-		if((dir_ent->inode->buf.st_mode & S_IFMT) == S_IFDIR)
+		/* spilled directories were numbered when they were spilled */
+		if((dir_ent->inode->buf.st_mode & S_IFMT) == S_IFDIR &&
+						!SPILLED(dir_ent->dir))
 			dir_scan6(dir_ent->dir);
 	}
 
@@ -3913,6 +7089,8 @@ void scan7_init_dir(struct directory *dir)
 	dir->entry_count_p = NULL;
 	dir->index = NULL;
 	dir->i_count = dir->i_size = 0;
+	dir->pending = NULL;
+	dir->pending_count = 0;
 }
 
 
@@ -3936,6 +7114,7 @@ void scan7_freedir(struct directory *dir)
 {
 	if(dir->index)
 		free(dir->index);
+	free(dir->pending);
 	free(dir->buff);
 }
 
@@ -3946,11 +7125,19 @@ void dir_scan7(squashfs_inode *inode, struct dir_info *dir_info)
 	int duplicate_file;
 	struct directory dir;
 	struct dir_ent *dir_ent = NULL;
+
+	if(SPILLED(dir_info)) {
+		struct dir_info *loaded = spill_load(dir_info);
+
+		dir_scan7(inode, loaded);
+		spill_put(loaded);
+		return;
+	}
 	
 	scan7_init_dir(&dir);
 	
 	while((dir_ent = scan7_readdir(&dir, dir_info, dir_ent)) != NULL) {
-		struct stat *buf = &dir_ent->inode->buf;
+		struct inode_stat *buf = &dir_ent->inode->buf;
 
 		update_info(dir_ent);
 
@@ -3958,8 +7145,13 @@ void dir_scan7(squashfs_inode *inode, struct dir_info *dir_info)
 			switch(buf->st_mode & S_IFMT) {
 				case S_IFREG:
 					squashfs_type = SQUASHFS_FILE_TYPE;
-					write_file(inode, dir_ent,
-						&duplicate_file);
+					if(IS_PSEUDO_ARCHIVE(dir_ent->inode))
+						archive_file_inode(inode,
+							dir_ent,
+							&duplicate_file);
+					else
+						write_file(inode, dir_ent,
+							&duplicate_file);
 					INFO("file %s, uncompressed size %lld "
 						"bytes %s\n",
 						subpathname(dir_ent),
@@ -3979,7 +7171,8 @@ void dir_scan7(squashfs_inode *inode, struct dir_info *dir_info)
 						squashfs_type, 0, 0, 0, NULL,
 						NULL, NULL, 0);
 					INFO("symbolic link %s inode 0x%llx\n",
-						subpathname(dir_ent), *inode);
+						subpathname(dir_ent),
+						resolve_inode(*inode));
 					sym_count ++;
 					break;
 
@@ -3990,7 +7183,7 @@ void dir_scan7(squashfs_inode *inode, struct dir_info *dir_info)
 						NULL, NULL, 0);
 					INFO("character device %s inode 0x%llx"
 						"\n", subpathname(dir_ent),
-						*inode);
+						resolve_inode(*inode));
 					dev_count ++;
 					break;
 
@@ -4000,7 +7193,8 @@ void dir_scan7(squashfs_inode *inode, struct dir_info *dir_info)
 						squashfs_type, 0, 0, 0, NULL,
 						NULL, NULL, 0);
 					INFO("block device %s inode 0x%llx\n",
-						subpathname(dir_ent), *inode);
+						subpathname(dir_ent),
+						resolve_inode(*inode));
 					dev_count ++;
 					break;
 
@@ -4010,7 +7204,8 @@ void dir_scan7(squashfs_inode *inode, struct dir_info *dir_info)
 						squashfs_type, 0, 0, 0, NULL,
 						NULL, NULL, 0);
 					INFO("fifo %s inode 0x%llx\n",
-						subpathname(dir_ent), *inode);
+						subpathname(dir_ent),
+						resolve_inode(*inode));
 					fifo_count ++;
 					break;
 
@@ -4021,7 +7216,8 @@ void dir_scan7(squashfs_inode *inode, struct dir_info *dir_info)
 						NULL, NULL, 0);
 					INFO("unix domain socket %s inode "
 						"0x%llx\n",
-						subpathname(dir_ent), *inode);
+						subpathname(dir_ent),
+						resolve_inode(*inode));
 					sock_count ++;
 					break;
 
@@ -4033,6 +7229,8 @@ void dir_scan7(squashfs_inode *inode, struct dir_info *dir_info)
 			}
 			dir_ent->inode->inode = *inode;
 			dir_ent->inode->type = squashfs_type;
+			if(spill_fd != -1)
+				spill_export(dir_ent->inode);
 		 } else {
 			*inode = dir_ent->inode->inode;
 			squashfs_type = dir_ent->inode->type;
@@ -4049,26 +7247,28 @@ void dir_scan7(squashfs_inode *inode, struct dir_info *dir_info)
 				case SQUASHFS_SYMLINK_TYPE:
 					INFO("symbolic link %s inode 0x%llx "
 						"LINK\n", subpathname(dir_ent),
-						 *inode);
+						 resolve_inode(*inode));
 					break;
 				case SQUASHFS_CHRDEV_TYPE:
 					INFO("character device %s inode 0x%llx "
 						"LINK\n", subpathname(dir_ent),
-						*inode);
+						resolve_inode(*inode));
 					break;
 				case SQUASHFS_BLKDEV_TYPE:
 					INFO("block device %s inode 0x%llx "
 						"LINK\n", subpathname(dir_ent),
-						*inode);
+						resolve_inode(*inode));
 					break;
 				case SQUASHFS_FIFO_TYPE:
 					INFO("fifo %s inode 0x%llx LINK\n",
-						subpathname(dir_ent), *inode);
+						subpathname(dir_ent),
+						resolve_inode(*inode));
 					break;
 				case SQUASHFS_SOCKET_TYPE:
 					INFO("unix domain socket %s inode "
 						"0x%llx LINK\n",
-						subpathname(dir_ent), *inode);
+						subpathname(dir_ent),
+						resolve_inode(*inode));
 					break;
 			}
 		}
@@ -4079,7 +7279,7 @@ void dir_scan7(squashfs_inode *inode, struct dir_info *dir_info)
 
 	write_dir(inode, dir_info, &dir);
 	INFO("directory %s inode 0x%llx\n", subpathname(dir_info->dir_ent),
-		*inode);
+		resolve_inode(*inode));
 
 	scan7_freedir(&dir);
 }
@@ -4171,6 +7371,83 @@ void add_old_root_entry(char *name, squashfs_inode inode, int inode_number,
 }
 
 
+/*
+ * Samples read by train_dictionary(), stored back to back in sample_data
+ */
+static char *sample_data;
+static size_t *sample_sizes;
+static int sample_count, sample_limit;
+static size_t sample_bytes;
+
+static int add_sample(const char *path, const struct stat *buf, int type,
+	struct FTW *ftwbuf)
+{
+	int fd, bytes;
+
+	/* only files which will end up in fragments are sampled */
+	if(type != FTW_F || !S_ISREG(buf->st_mode) || buf->st_size == 0 ||
+			buf->st_size >= block_size)
+		return 0;
+
+	if(sample_bytes + buf->st_size > sample_limit)
+		/* stop once the sample space is (nearly) full */
+		return sample_limit - sample_bytes < SQUASHFS_METADATA_SIZE;
+
+	fd = open(path, O_RDONLY);
+	if(fd == -1)
+		return 0;
+
+	bytes = read_bytes(fd, sample_data + sample_bytes, buf->st_size);
+	close(fd);
+	if(bytes < 1)
+		return 0;
+
+	if((sample_count & 1023) == 0) {
+		sample_sizes = realloc(sample_sizes, (sample_count + 1024) *
+			sizeof(size_t));
+		if(sample_sizes == NULL)
+			MEM_ERROR();
+	}
+
+	sample_sizes[sample_count ++] = bytes;
+	sample_bytes += bytes;
+
+	return 0;
+}
+
+
+/*
+ * Read a sample of the small files in the sources, and use it to train a
+ * compressor dictionary (i.e. zstd -Xdict-train).  This has to be done
+ * before the compressor is initialised by any thread.  Failure to train
+ * isn't fatal, the filesystem is then created without a dictionary
+ */
+void train_dictionary(int source, char *source_path[])
+{
+	int i;
+
+	sample_limit = compressor_sample_size(comp);
+	if(sample_limit == 0)
+		return;
+
+	sample_data = malloc(sample_limit);
+	if(sample_data == NULL)
+		MEM_ERROR();
+
+	for(i = 0; i < source; i++)
+		if(nftw(source_path[i], add_sample, 64, FTW_PHYS) != 0)
+			break;
+
+	if(sample_count == 0 || compressor_train(comp, sample_data,
+			sample_sizes, sample_count) == -1)
+		ERROR("Failed to train compressor dictionary from %d sample "
+			"files, not using a dictionary\n", sample_count);
+
+	free(sample_data);
+	free(sample_sizes);
+}
+
+
 void initialise_threads(int readq, int fragq, int bwriteq, int fwriteq,
 	int freelst, char *destination_file)
 {
@@ -4180,6 +7457,7 @@ void initialise_threads(int readq, int fragq, int bwriteq, int fwriteq,
 	int reader_size;
 	int fragment_size;
 	int fwriter_size;
+	int lend;
 	/*
 	 * bwriter_size is global because it is needed in
 	 * write_file_blocks_dup()
@@ -4216,6 +7494,21 @@ void initialise_threads(int readq, int fragq, int bwriteq, int fwriteq,
 	bwriter_size = bwriteq << (20 - block_log);
 	fwriter_size = fwriteq << (20 - block_log);
 
+	/*
+	 * Rather than statically dividing the memory between the caches,
+	 * each cache is guaranteed half its queue size, and the other
+	 * halves are pooled in the memory governor, to be lent to
+	 * whichever caches are busy.  The cache sizes below are the
+	 * guaranteed sizes, and the queues holding blocks from the caches
+	 * are sized for the most a cache can hold
+	 */
+	lend = reader_size / 2 + fragment_size / 2 + bwriter_size / 2 +
+		fwriter_size / 2;
+	reader_size -= reader_size / 2;
+	fragment_size -= fragment_size / 2;
+	bwriter_size -= bwriter_size / 2;
+	fwriter_size -= fwriter_size / 2;
+
 	/*
 	 * setup signal handlers for the main thread, these cleanup
 	 * deleting the destination file, if appending the
@@ -4272,50 +7565,183 @@ void initialise_threads(int readq, int fragq, int bwriteq, int fwriteq,
 #endif
 	}
 
-	if(multiply_overflow(processors, 3) ||
-			multiply_overflow(processors * 3, sizeof(pthread_t)))
+	if(multiply_overflow(processors, 4) ||
+			multiply_overflow(processors * 4, sizeof(pthread_t)))
 		BAD_ERROR("Processors too large\n");
 
-	deflator_thread = malloc(processors * 3 * sizeof(pthread_t));
+	/*
+	 * With -numa the deflator, fragment deflator, fragment and reader
+	 * threads are divided between the nodes, and each node has its own
+	 * reader to deflator and fragment thread queues.  Buffers are
+	 * therefore read, processed and freed on one node.  Each node
+	 * needs its own readers
+	 */
+	if(numa && numa_init(processors) > 1 && readers < numa_nodes)
+		readers = numa_nodes;
+
+	deflator_thread = malloc(processors * 4 * sizeof(pthread_t));
 	if(deflator_thread == NULL)
 		MEM_ERROR();
 
 	frag_deflator_thread = &deflator_thread[processors];
 	frag_thread = &frag_deflator_thread[processors];
+	dup_thread = &frag_thread[processors];
+
+	if(multiply_overflow(readers, sizeof(pthread_t)))
+		BAD_ERROR("Readers too large\n");
+
+	reader_pool_thread = malloc(readers * sizeof(pthread_t));
+	if(reader_pool_thread == NULL)
+		MEM_ERROR();
+
+	/*
+	 * Readers other than the head may read ahead, but between them
+	 * they must leave at least half the reader cache for the head
+	 */
+	reader_readahead = readers > 1 ? reader_size / 2 / (readers - 1) : 0;
+
+	/*
+	 * The duplicate collector and threads hold up to 2 * processors + 1
+	 * files, which between them mustn't use more than half the block
+	 * writer (or reader) cache.  Files larger than this are duplicate
+	 * checked by the main thread, which must leave room for them
+	 */
+	dup_max_blocks = (reader_size < bwriter_size ? reader_size :
+		bwriter_size) / (4 * processors + 2);
+	if(!duplicate_checking)
+		dup_max_blocks = 0;
+	dup_hold = bwriter_size - (2 * processors + 1) * dup_max_blocks;
 
 	to_reader = queue_init(1);
-	to_deflate = queue_init(reader_size);
-	to_process_frag = queue_init(reader_size);
-	to_writer = queue_init(bwriter_size + fwriter_size);
+	to_read = queue_init(readers);
+	to_deflate = malloc(numa_nodes * sizeof(struct queue *));
+	to_process_frag = malloc(numa_nodes * sizeof(struct queue *));
+	if(to_deflate == NULL || to_process_frag == NULL)
+		MEM_ERROR();
+	for(i = 0; i < numa_nodes; i++) {
+		to_deflate[i] = queue_init(reader_size + lend);
+		to_process_frag[i] = queue_init(reader_size + lend);
+		stats_queue("to_deflate", numa_nodes > 1 ? i : -1,
+			to_deflate[i]);
+		stats_queue("to_process_frag", numa_nodes > 1 ? i : -1,
+			to_process_frag[i]);
+	}
+	to_writer = queue_init(bwriter_size + fwriter_size + lend);
 	from_writer = queue_init(1);
-	to_frag = queue_init(fragment_size);
-	locked_fragment = queue_init(fragment_size);
+	to_frag = queue_init(fragment_size + lend);
+	locked_fragment = queue_init(fragment_size + fwriter_size + lend);
 	to_main = seq_queue_init();
+	if(dup_max_blocks) {
+		to_dup = queue_init(processors);
+		from_dup = seq_queue_init();
+	}
+	stats_queue("to_read", -1, to_read);
+	stats_queue("to_frag", -1, to_frag);
+	stats_queue("to_writer", -1, to_writer);
+	stats_seq_queue("to_main", to_main);
+	if(dup_max_blocks) {
+		stats_queue("to_dup", -1, to_dup);
+		stats_seq_queue("from_dup", from_dup);
+	}
+	for(i = 0; i < FRAG_LOOKUP_LOCKS; i++)
+		pthread_mutex_init(&frag_lookup_mutex[i], NULL);
+
 	reader_buffer = cache_init(block_size, reader_size, 0, 0);
 	bwriter_buffer = cache_init(block_size, bwriter_size, 1, freelst);
 	fwriter_buffer = cache_init(block_size, fwriter_size, 1, freelst);
 	fragment_buffer = cache_init(block_size, fragment_size, 1, 0);
-	reserve_cache = cache_init(block_size, processors + 1, 1, 0);
+	reserve_cache = cache_init(block_size, processors * 2 + 1, 1, 0);
+	mem_governor = governor_init(lend);
+	cache_govern(reader_buffer, mem_governor);
+	cache_govern(bwriter_buffer, mem_governor);
+	cache_govern(fwriter_buffer, mem_governor);
+	cache_govern(fragment_buffer, mem_governor);
+
+	/*
+	 * All the blocks come from one pool, which has room for every
+	 * block the caches and the governor can hold at once.  If the pool
+	 * can't be mapped the blocks are allocated with malloc
+	 */
+	block_pool = pool_init(FILE_BUFFER_DATA + block_size, reader_size +
+		bwriter_size + fwriter_size + fragment_size + processors * 2 +
+		1 + lend);
+	cache_pool(reader_buffer, block_pool);
+	cache_pool(bwriter_buffer, block_pool);
+	cache_pool(fwriter_buffer, block_pool);
+	cache_pool(fragment_buffer, block_pool);
+	cache_pool(reserve_cache, block_pool);
 	pthread_create(&reader_thread, NULL, reader, NULL);
 	pthread_create(&writer_thread, NULL, writer, NULL);
+	for(i = 0; readers > 1 && i < readers; i++)
+		if(numa_thread_create(&reader_pool_thread[i], i, readers,
+				reader_pool, NULL) != 0)
+			BAD_ERROR("Failed to create thread\n");
 	init_progress_bar();
 	init_info();
+	if(deadline_end)
+		deadline_init(processors);
 
 	for(i = 0; i < processors; i++) {
-		if(pthread_create(&deflator_thread[i], NULL, deflator, NULL))
+		if(numa_thread_create(&deflator_thread[i], i, processors,
+				deflator, NULL) != 0)
 			BAD_ERROR("Failed to create thread\n");
-		if(pthread_create(&frag_deflator_thread[i], NULL, frag_deflator,
-				NULL) != 0)
+		if(numa_thread_create(&frag_deflator_thread[i], i, processors,
+				frag_deflator, NULL) != 0)
 			BAD_ERROR("Failed to create thread\n");
-		if(pthread_create(&frag_thread[i], NULL, frag_thrd,
-				(void *) destination_file) != 0)
+		if(numa_thread_create(&frag_thread[i], i, processors,
+				frag_thrd, (void *) destination_file) != 0)
 			BAD_ERROR("Failed to create thread\n");
+		if(dup_max_blocks && pthread_create(&dup_thread[i], NULL,
+				dup_thrd, (void *) destination_file) != 0)
+			BAD_ERROR("Failed to create thread\n");
+	}
+
+	if(dup_max_blocks && pthread_create(&dup_collect_thread, NULL,
+			dup_collect_thrd, NULL) != 0)
+		BAD_ERROR("Failed to create thread\n");
+
+	/*
+	 * Each worker asks for a connection per processor, which all get
+	 * a remote deflator thread as well as the local deflators
+	 */
+	for(i = 0; i < remote_workers; i++) {
+		struct remote *remote = remote_connect(remote_worker_list[i],
+			comp, block_size);
+		int j;
+
+		remote_conn = realloc(remote_conn, (remote_conns +
+			remote->processors) * sizeof(struct remote *));
+		if(remote_conn == NULL)
+			MEM_ERROR();
+
+		remote_conn[remote_conns ++] = remote;
+		for(j = 1; j < remote->processors; j++)
+			remote_conn[remote_conns ++] = remote_connect(
+				remote_worker_list[i], comp, block_size);
+	}
+
+	if(remote_conns) {
+		remote_thread = malloc(remote_conns * sizeof(pthread_t));
+		if(remote_thread == NULL)
+			MEM_ERROR();
 	}
 
+	for(i = 0; i < remote_conns; i++)
+		if(pthread_create(&remote_thread[i], NULL, remote_deflator,
+				(void *) (long) i) != 0)
+			BAD_ERROR("Failed to create thread\n");
+
 	main_thread = pthread_self();
 
 	printf("Parallel mksquashfs: Using %d processor%s\n", processors,
 			processors == 1 ? "" : "s");
+	if(readers > 1)
+		printf("Parallel mksquashfs: Using %d reader threads\n",
+			readers);
+	if(remote_conns)
+		printf("Parallel mksquashfs: Using %d connection%s to %d "
+			"worker%s\n", remote_conns, remote_conns == 1 ? "" : "s",
+			remote_workers, remote_workers == 1 ? "" : "s");
 
 	/* Restore the signal mask for the main thread */
 	if(pthread_sigmask(SIG_SETMASK, &old_mask, NULL) == -1)
@@ -4323,9 +7749,17 @@ void initialise_threads(int readq, int fragq, int bwriteq, int fwriteq,
 }
 
 
+static void spill_export(struct inode_info *inode)
+{
+	if(spill_lookup)
+		spill_lookup[get_inode_no(inode) - 1] = inode->inode;
+}
+
+
 long long write_inode_lookup_table()
 {
 	int i, inode_number, lookup_bytes = SQUASHFS_LOOKUP_BYTES(inode_count);
+	squashfs_inode ref;
 	void *it;
 
 	if(inode_count == sinode_count)
@@ -4336,27 +7770,34 @@ long long write_inode_lookup_table()
 		MEM_ERROR();
 	inode_lookup_table = it;
 
-	for(i = 0; i < INODE_HASH_SIZE; i ++) {
-		struct inode_info *inode;
+	for(i = 0; i < inode_hash_size; i ++) {
+		struct inode_info *inode = inode_hash[i].inode;
 
-		for(inode = inode_info[i]; inode; inode = inode->next) {
+		if(inode == NULL)
+			continue;
 
-			inode_number = get_inode_no(inode);
+		inode_number = get_inode_no(inode);
 
-			/* The empty action will produce orphaned inode
-			 * entries in the inode_info[] table.  These
-			 * entries because they are orphaned will not be
-			 * allocated an inode number in dir_scan5(), so
-			 * skip any entries with the default dummy inode
-			 * number of 0 */
-			if(inode_number == 0)
-				continue;
+		/* The empty action will produce orphaned inode
+		 * entries in the inode table.  These entries
+		 * because they are orphaned will not be
+		 * allocated an inode number in dir_scan5(), so
+		 * skip any entries with the default dummy inode
+		 * number of 0 */
+		if(inode_number == 0)
+			continue;
 
-			SQUASHFS_SWAP_LONG_LONGS(&inode->inode,
-				&inode_lookup_table[inode_number - 1], 1);
+		ref = resolve_inode(inode->inode);
+		SQUASHFS_SWAP_LONG_LONGS(&ref,
+			&inode_lookup_table[inode_number - 1], 1);
+	}
 
+	for(i = 0; i < spill_lookup_count && i < inode_count; i++)
+		if(spill_lookup[i]) {
+			ref = resolve_inode(spill_lookup[i]);
+			SQUASHFS_SWAP_LONG_LONGS(&ref, &inode_lookup_table[i],
+				1);
 		}
-	}
 
 skip_inode_hash_table:
 	return generic_write_table(lookup_bytes, inode_lookup_table, 0, NULL,
@@ -4398,6 +7839,9 @@ void free_path(struct pathname *paths)
 		}
 	}
 
+	free(paths->literal);
+	free(paths->glob);
+	free(paths->name);
 	free(paths);
 }
 
@@ -4416,6 +7860,8 @@ struct pathname *add_path(struct pathname *paths, char *target, char *alltarget)
 
 		paths->names = 0;
 		paths->name = NULL;
+		paths->literal = NULL;
+		paths->glob = NULL;
 	}
 
 	for(i = 0; i < paths->names; i++)
@@ -4529,6 +7975,65 @@ void display_path2(struct pathname *paths, char *string)
 }
 
 
+static unsigned int name_hash(char *name)
+{
+	unsigned int hash = 2166136261U;
+
+	while(*name)
+		hash = (hash ^ (unsigned char) *name++) * 16777619U;
+
+	return hash;
+}
+
+
+static int literal_name(char *name)
+{
+	return !use_regex && strpbrk(name, "*?[\\(") == NULL;
+}
+
+
+/*
+ * Index the names at each level of an exclude tree, see struct pathname
+ */
+void compile_path(struct pathname *paths)
+{
+	int i, size = 1, literals = 0;
+
+	if(paths == NULL)
+		return;
+
+	for(i = 0; i < paths->names; i++)
+		literals += literal_name(paths->name[i].name);
+
+	while(size < literals * 2)
+		size <<= 1;
+
+	paths->literal = malloc(size * sizeof(int));
+	paths->glob = malloc((paths->names - literals + 1) * sizeof(int));
+	if(paths->literal == NULL || paths->glob == NULL)
+		MEM_ERROR();
+
+	paths->literal_mask = size - 1;
+	paths->globs = 0;
+	for(i = 0; i < size; i++)
+		paths->literal[i] = -1;
+
+	for(i = 0; i < paths->names; i++) {
+		struct path_entry *entry = &paths->name[i];
+
+		if(literal_name(entry->name)) {
+			int hash = name_hash(entry->name) & paths->literal_mask;
+
+			entry->next = paths->literal[hash];
+			paths->literal[hash] = i;
+		} else
+			paths->glob[paths->globs ++] = i;
+
+		compile_path(entry->paths);
+	}
+}
+
+
 struct pathnames *add_subdir(struct pathnames *paths, struct pathname *path)
 {
 	int count = paths == NULL ? 0 : paths->count;
@@ -4546,28 +8051,42 @@ struct pathnames *add_subdir(struct pathnames *paths, struct pathname *path)
 }
 
 
+static int excluded_entry(struct path_entry *entry, struct pathnames **new)
+{
+	if(entry->paths == NULL || new == NULL)
+		/* match on a leaf component, any subdirectories
+		 * in the filesystem should be excluded */
+		return TRUE;
+
+	/* match on a non-leaf component, add any subdirectories to the
+	 * new set of subdirectories to scan for this name */
+	*new = add_subdir(*new, entry->paths);
+	return FALSE;
+}
+
+
 int excluded_match(char *name, struct pathname *path, struct pathnames **new)
 {
-	int i;
+	int i, n;
+
+	/* at most one literal name can match, look it up in the hash table */
+	for(i = path->literal[name_hash(name) & path->literal_mask]; i != -1;
+						i = path->name[i].next)
+		if(strcmp(path->name[i].name, name) == 0) {
+			if(excluded_entry(&path->name[i], new))
+				return TRUE;
+			break;
+		}
 
-	for(i = 0; i < path->names; i++) {
+	for(n = 0; n < path->globs; n++) {
+		struct path_entry *entry = &path->name[path->glob[n]];
 		int match = use_regex ?
-			regexec(path->name[i].preg, name, (size_t) 0,
-					NULL, 0) == 0 :
-			fnmatch(path->name[i].name, name,
+			regexec(entry->preg, name, (size_t) 0, NULL, 0) == 0 :
+			fnmatch(entry->name, name,
 				FNM_PATHNAME|FNM_PERIOD|FNM_EXTMATCH) == 0;
 
-		if(match) {
-			 if(path->name[i].paths == NULL || new == NULL)
-				/* match on a leaf component, any subdirectories
-			 	* in the filesystem should be excluded */
-				return TRUE;
-			else
-				/* match on a non-leaf component, add any
-				 * subdirectories to the new set of
-				 * subdirectories to scan for this name */
-				*new = add_subdir(*new, path->name[i].paths);
-		}
+		if(match && excluded_entry(entry, new))
+			return TRUE;
 	}
 
 	return FALSE;
@@ -4833,6 +8352,10 @@ void write_filesystem_tables(struct squashfs_super_block *sBlk, int nopad)
 		write_destination(fd, bytes, 4096 - i, temp);
 	}
 
+	if(verity)
+		verity_finish(fd, (bytes + VERITY_BLOCK_SIZE - 1) &
+			~(VERITY_BLOCK_SIZE - 1));
+
 	close(fd);
 
 	if(recovery_file)
@@ -4851,6 +8374,8 @@ void write_filesystem_tables(struct squashfs_super_block *sBlk, int nopad)
 		"compressed");
 	printf("\tduplicates are %sremoved\n", duplicate_checking ? "" :
 		"not ");
+	if(deadline_end)
+		deadline_report();
 	printf("Filesystem size %.2f Kbytes (%.2f Mbytes)\n", bytes / 1024.0,
 		bytes / (1024.0 * 1024.0));
 	printf("\t%.2f%% of uncompressed filesystem size (%.2f Kbytes)\n",
@@ -4877,6 +8402,9 @@ void write_filesystem_tables(struct squashfs_super_block *sBlk, int nopad)
 			dup_files);
 	else
 		printf("No duplicate files removed\n");
+	if(duplicate_checking && block_duplicates)
+		printf("Number of files sharing duplicate blocks %d\n",
+			block_dup_files);
 	printf("Number of inodes %d\n", inode_count);
 	printf("Number of files %d\n", file_count);
 	if(!no_fragments)
@@ -5165,6 +8693,7 @@ int main(int argc, char *argv[])
 	int total_mem = get_default_phys_mem();
 	int progress = TRUE;
 	int force_progress = FALSE;
+	int probe = FALSE;
 	struct file_buffer **fragment = NULL;
 
 	if(argc > 1 && strcmp(argv[1], "-version") == 0) {
@@ -5172,10 +8701,30 @@ int main(int argc, char *argv[])
 		exit(0);
 	}
 
+	if(argc > 1 && strcmp(argv[1], "-worker-listen") == 0) {
+		int worker_processors = sysconf(_SC_NPROCESSORS_ONLN);
+
+		if(argc != 3 && (argc != 5 || strcmp(argv[3], "-processors") ||
+				!parse_num(argv[4], &worker_processors) ||
+				worker_processors < 1)) {
+			ERROR("SYNTAX: %s -worker-listen [<address>:]<port> "
+				"[-processors <number>]\n", argv[0]);
+			exit(1);
+		}
+
+		remote_worker(argv[2], worker_processors);
+	}
+
 	block_log = slog(block_size);
 	calculate_queue_sizes(total_mem, &readq, &fragq, &bwriteq, &fwriteq);
 
-        for(i = 1; i < argc && argv[i][0] != '-'; i++);
+	scan_arena = arena_init();
+	slab_init(&dir_ent_slab, scan_arena, sizeof(struct dir_ent));
+	slab_init(&dir_info_slab, scan_arena, sizeof(struct dir_info));
+
+	/* a source of "-" is stdin, with -tar and -cpio */
+        for(i = 1; i < argc && (argv[i][0] != '-' || argv[i][1] == '\0');
+									i++);
 	if(i < 3)
 		goto printOptions;
 	source_path = argv + 1;
@@ -5325,6 +8874,11 @@ int main(int argc, char *argv[])
 			if(strcmp(argv[i] + 2, "help") == 0)
 				goto print_compressor_options;
 
+			if(strcmp(argv[i] + 2, "bench") == 0) {
+				probe = TRUE;
+				continue;
+			}
+
 			args = compressor_options(comp, argv + i, argc - i);
 			if(args < 0) {
 				if(args == -1) {
@@ -5371,7 +8925,31 @@ print_compressor_options:
 			read_recovery_data(argv[i], argv[source + 1]);
 		} else if(strcmp(argv[i], "-no-recovery") == 0)
 			recover = FALSE;
-		else if(strcmp(argv[i], "-wildcards") == 0) {
+		else if(strcmp(argv[i], "-dedup-index") == 0) {
+			if(++i == argc) {
+				ERROR("%s: -dedup-index missing filename\n",
+					argv[0]);
+				exit(1);
+			}
+			dedup_index = argv[i];
+		} else if(strcmp(argv[i], "-stats") == 0) {
+			if(++i == argc) {
+				ERROR("%s: -stats missing filename\n",
+					argv[0]);
+				exit(1);
+			}
+			stats_file = argv[i];
+		} else if(strcmp(argv[i], "-deadline") == 0) {
+			int seconds;
+
+			if((++i == argc) || !parse_num(argv[i], &seconds) ||
+					seconds < 1) {
+				ERROR("%s: -deadline missing or invalid "
+					"number of seconds\n", argv[0]);
+				exit(1);
+			}
+			deadline_end = stats_time() + seconds * 1000000000LL;
+		} else if(strcmp(argv[i], "-wildcards") == 0) {
 			old_exclude = FALSE;
 			use_regex = FALSE;
 		} else if(strcmp(argv[i], "-regex") == 0) {
@@ -5396,7 +8974,44 @@ print_compressor_options:
 					argv[0]);
 				exit(1);
 			}
-		} else if(strcmp(argv[i], "-read-queue") == 0) {
+		} else if(strcmp(argv[i], "-readers") == 0) {
+			if((++i == argc) || !parse_num(argv[i], &readers)) {
+				ERROR("%s: -readers missing or invalid "
+					"reader number\n", argv[0]);
+				exit(1);
+			}
+			if(readers < 1) {
+				ERROR("%s: -readers should be 1 or larger\n",
+					argv[0]);
+				exit(1);
+			}
+		} else if(strcmp(argv[i], "-scanners") == 0) {
+			if((++i == argc) || !parse_num(argv[i], &scanners)) {
+				ERROR("%s: -scanners missing or invalid "
+					"scanner number\n", argv[0]);
+				exit(1);
+			}
+			if(scanners < 1) {
+				ERROR("%s: -scanners should be 1 or larger\n",
+					argv[0]);
+				exit(1);
+			}
+		} else if(strcmp(argv[i], "-worker") == 0) {
+			if(++i == argc) {
+				ERROR("%s: -worker missing worker address\n",
+					argv[0]);
+				exit(1);
+			}
+			remote_worker_list = realloc(remote_worker_list,
+				(remote_workers + 1) * sizeof(char *));
+			if(remote_worker_list == NULL)
+				MEM_ERROR();
+			remote_worker_list[remote_workers ++] = argv[i];
+		} else if(strcmp(argv[i], "-mmap") == 0)
+			mmap_input = TRUE;
+		else if(strcmp(argv[i], "-numa") == 0)
+			numa = TRUE;
+		else if(strcmp(argv[i], "-read-queue") == 0) {
 			if((++i == argc) || !parse_num(argv[i], &readq)) {
 				ERROR("%s: -read-queue missing or invalid "
 					"queue size\n", argv[0]);
@@ -5474,6 +9089,19 @@ print_compressor_options:
 					argv[0]);
 				exit(1);
 			}
+		} else if(strcmp(argv[i], "-dir-index") == 0) {
+			if((++i == argc) || !parse_number(argv[i],
+						&dir_index_size, 1)) {
+				ERROR("%s: -dir-index missing or invalid size\n",
+					argv[0]);
+				exit(1);
+			}
+			if(dir_index_size < 256 || dir_index_size >
+						SQUASHFS_METADATA_SIZE) {
+				ERROR("%s: -dir-index should be between 256 "
+					"bytes and 8 Kbytes\n", argv[0]);
+				exit(1);
+			}
 		} else if(strcmp(argv[i], "-ef") == 0) {
 			if(++i == argc) {
 				ERROR("%s: -ef missing filename\n", argv[0]);
@@ -5482,9 +9110,27 @@ print_compressor_options:
 		} else if(strcmp(argv[i], "-no-duplicates") == 0)
 			duplicate_checking = FALSE;
 
+		else if(strcmp(argv[i], "-block-duplicates") == 0)
+			block_duplicates = TRUE;
+
 		else if(strcmp(argv[i], "-no-fragments") == 0)
 			no_fragments = TRUE;
 
+		else if(strcmp(argv[i], "-adaptive") == 0)
+			adaptive = TRUE;
+
+		else if(strcmp(argv[i], "-pack-fragments") == 0)
+			pack_fragments = TRUE;
+
+		else if(strcmp(argv[i], "-spill") == 0) {
+			if(++i == argc) {
+				ERROR("%s: -spill missing directory\n",
+					argv[0]);
+				exit(1);
+			}
+			spill_directory = argv[i];
+		}
+
 		 else if(strcmp(argv[i], "-always-use-fragments") == 0)
 			always_use_fragments = TRUE;
 
@@ -5493,6 +9139,19 @@ print_compressor_options:
 				ERROR("%s: -sort missing filename\n", argv[0]);
 				exit(1);
 			}
+		} else if(strcmp(argv[i], "-sort-trace") == 0) {
+			if(++i == argc) {
+				ERROR("%s: -sort-trace missing filename\n",
+					argv[0]);
+				exit(1);
+			}
+		} else if(strcmp(argv[i], "-sort-trace-root") == 0) {
+			if(++i == argc) {
+				ERROR("%s: -sort-trace-root missing directory\n",
+					argv[0]);
+				exit(1);
+			}
+			sort_trace_root = argv[i];
 		} else if(strcmp(argv[i], "-all-root") == 0 ||
 				strcmp(argv[i], "-root-owned") == 0)
 			global_uid = global_gid = 0;
@@ -5580,6 +9239,31 @@ print_compressor_options:
 		else if(strcmp(argv[i], "-nopad") == 0)
 			nopad = TRUE;
 
+		else if(strcmp(argv[i], "-verity") == 0) {
+			if(++i == argc) {
+				ERROR("%s: -verity missing filename\n",
+					argv[0]);
+				exit(1);
+			}
+			verity_file = argv[i];
+			verity = TRUE;
+		} else if(strcmp(argv[i], "-verity-append") == 0)
+			verity = verity_append = TRUE;
+
+		else if(strcmp(argv[i], "-verity-salt") == 0) {
+			if(++i == argc) {
+				ERROR("%s: -verity-salt missing salt\n",
+					argv[0]);
+				exit(1);
+			}
+			if(!verity_set_salt(argv[i])) {
+				ERROR("%s: -verity-salt should be a hex string "
+					"of up to %d bytes, or -\n", argv[0],
+					VERITY_SALT_MAX);
+				exit(1);
+			}
+		}
+
 		else if(strcmp(argv[i], "-info") == 0)
 			silent = FALSE;
 
@@ -5591,6 +9275,12 @@ print_compressor_options:
 
 		else if(strcmp(argv[i], "-keep-as-directory") == 0)
 			keep_as_directory = TRUE;
+
+		else if(strcmp(argv[i], "-tar") == 0)
+			archive_format = ARCHIVE_TAR;
+
+		else if(strcmp(argv[i], "-cpio") == 0)
+			archive_format = ARCHIVE_CPIO;
 /* ANDROID CHANGES START*/
 #ifdef ANDROID
 		else if(strcmp(argv[i], "-android-fs-config") == 0)
@@ -5632,6 +9322,10 @@ printOptions:
 			ERROR("\t\t\tOptionally a suffix of K or M can be"
 				" given to specify\n\t\t\tKbytes or Mbytes"
 				" respectively\n");
+			ERROR("-dir-index <size>\tindex directories every "
+				"<size> bytes, rather than\n\t\t\tevery 8 "
+				"Kbytes, for faster lookups in large\n\t\t\t"
+				"directories.  256 bytes to 8 Kbytes\n");
 			ERROR("-no-exports\t\tdon't make the filesystem "
 				"exportable via NFS\n");
 			ERROR("-no-sparse\t\tdon't detect sparse files\n");
@@ -5652,20 +9346,52 @@ printOptions:
 			ERROR("-noX\t\t\tdo not compress extended "
 				"attributes\n");
 			ERROR("-no-fragments\t\tdo not use fragments\n");
+			ERROR("-adaptive\t\tdon't compress blocks which look "
+				"incompressible, and only\n\t\t\ttry the "
+				"compressor's first choice of options on\n"
+				"\t\t\tblocks which look poorly "
+				"compressible\n");
+			ERROR("-deadline <seconds>\tlower and raise the "
+				"compression level as needed\n\t\t\tto "
+				"finish compressing the data within "
+				"<seconds>\n");
 			ERROR("-always-use-fragments\tuse fragment blocks for "
 				"files larger than block size\n");
+			ERROR("-pack-fragments\t\tgroup similar tail ends "
+				"together, and bin-pack them\n\t\t\tinto "
+				"fewer fragment blocks\n");
+			ERROR("-spill <dir>\t\tspill scanned directories to a "
+				"temporary file in\n\t\t\t<dir>, to bound "
+				"the memory used by large\n\t\t\t"
+				"source trees\n");
 			ERROR("-no-duplicates\t\tdo not perform duplicate "
 				"checking\n");
+			ERROR("-block-duplicates\talso find files whose data "
+				"blocks duplicate a run\n\t\t\tof blocks "
+				"already written\n");
 			ERROR("-all-root\t\tmake all files owned by root\n");
 			ERROR("-force-uid uid\t\tset all file uids to uid\n");
 			ERROR("-force-gid gid\t\tset all file gids to gid\n");
 			ERROR("-nopad\t\t\tdo not pad filesystem to a multiple "
 				"of 4K\n");
+			ERROR("-verity <file>\t\twrite a dm-verity hash tree "
+				"of the filesystem to\n\t\t\t<file>, computed "
+				"as it is written\n");
+			ERROR("-verity-append\t\twrite the dm-verity hash tree "
+				"after the filesystem\n");
+			ERROR("-verity-salt <salt>\thex salt of the hash tree, "
+				"default none\n");
 			ERROR("-keep-as-directory\tif one source directory is "
 				"specified, create a root\n");
 			ERROR("\t\t\tdirectory containing that directory, "
 				"rather than the\n");
 			ERROR("\t\t\tcontents of the directory\n");
+			ERROR("-tar\t\t\tthe source is a tar archive (or - to "
+				"read one from\n\t\t\tstdin), rather than "
+				"directories/files\n");
+			ERROR("-cpio\t\t\tthe source is a cpio archive (or - to "
+				"read one from\n\t\t\tstdin), rather than "
+				"directories/files\n");
 /* ANDROID CHANGES START*/
 #ifdef ANDROID
 			ERROR("-android-fs-config\tuse android fs config "
@@ -5685,6 +9411,13 @@ printOptions:
 			ERROR("\t\t\tfile or dir with priority per line.  "
 				"Priority -32768 to\n");
 			ERROR("\t\t\t32767, default priority 0\n");
+			ERROR("-sort-trace <file>\twrite the files in the "
+				"access trace <file> (list of\n\t\t\tfiles or "
+				"android_fs ftrace) first, in the order\n\t\t\t"
+				"they were first accessed\n");
+			ERROR("-sort-trace-root <dir>\tdirectory the "
+				"filesystem was mounted on when\n\t\t\tthe "
+				"trace was taken, default /\n");
 			ERROR("-ef <exclude_file>\tlist of exclude dirs/files."
 				"  One per line\n");
 			ERROR("-wildcards\t\tAllow extended shell wildcards "
@@ -5711,6 +9444,13 @@ printOptions:
 				"using recovery file <name>\n");
 			ERROR("-no-recovery\t\tdon't generate a recovery "
 				"file\n");
+			ERROR("-dedup-index <file>\tread the duplicate index "
+				"of the filesystem being\n\t\t\tappended to "
+				"from <file>, and write the index of\n\t\t\t"
+				"the new filesystem to <file>\n");
+			ERROR("-stats <file>\t\twrite pipeline statistics "
+				"to <file> as JSON,\n\t\t\tor to stdout if "
+				"<file> is -\n");
 			ERROR("-info\t\t\tprint files written to filesystem\n");
 			ERROR("-no-progress\t\tdon't display the progress "
 				"bar\n");
@@ -5719,6 +9459,22 @@ printOptions:
 			ERROR("-processors <number>\tUse <number> processors."
 				"  By default will use number of\n");
 			ERROR("\t\t\tprocessors available\n");
+			ERROR("-readers <number>\tUse <number> threads to read "
+				"files.  Default 1\n");
+			ERROR("-scanners <number>\tUse <number> threads to scan "
+				"the source directories.\n\t\t\tBy default will "
+				"use the number of processors\n");
+			ERROR("-worker <host>[:<port>]\tcompress data blocks "
+				"on the mksquashfs -worker-listen\n\t\t\tworker "
+				"at <host> too.  Can be given more than\n\t\t\t"
+				"once.  The default port is %s\n", REMOTE_PORT);
+			ERROR("-mmap\t\t\tmap files larger than the block size "
+				"rather than\n\t\t\treading them.  Data lost "
+				"by a late truncation\n\t\t\tis stored as "
+				"zeros, with a warning\n");
+			ERROR("-numa\t\t\tdivide the processing threads "
+				"between the NUMA nodes,\n\t\t\tkeeping "
+				"buffers on the node they were read on\n");
 			ERROR("-mem <size>\t\tUse <size> physical memory.  "
 				"Currently set to %dM\n", total_mem);
 			ERROR("\t\t\tOptionally a suffix of K, M or G can be"
@@ -5737,6 +9493,11 @@ printOptions:
 				"-noX\n");
 			ERROR("\n-Xhelp\t\t\tprint compressor options for"
 				" selected compressor\n");
+			ERROR("-Xbench\t\t\tcompress a sample of the sources "
+				"with every\n\t\t\tcompressor and a range of "
+				"their options, and\n\t\t\tprint the compressed "
+				"size and speeds.  The\n\t\t\tdestination isn't "
+				"written\n");
 			ERROR("\nCompressors available and compressor specific "
 				"options:\n");
 			display_compressor_usage(COMP_DEFAULT);
@@ -5744,6 +9505,9 @@ printOptions:
 		}
 	}
 
+	if(probe)
+		probe_compressors(source_path, source, block_size, processors);
+
 	/*
 	 * Some compressors may need the options to be checked for validity
 	 * once all the options have been processed
@@ -5759,6 +9523,19 @@ printOptions:
 	 */
 	if(!silent)
 		progress = force_progress;
+
+	if(verity && nopad) {
+		ERROR("%s: -verity and -verity-append need the filesystem "
+			"padded to 4K, and so can't be used with -nopad\n",
+			argv[0]);
+		exit(1);
+	}
+
+	if(verity_file && verity_append) {
+		ERROR("%s: -verity and -verity-append can't both be used\n",
+			argv[0]);
+		exit(1);
+	}
 		
 #ifdef SQUASHFS_TRACE
 	/*
@@ -5769,7 +9546,13 @@ printOptions:
 	progress = FALSE;
 #endif
 
-	for(i = 0; i < source; i++)
+	if(archive_format && source != 1) {
+		ERROR("%s: -tar and -cpio take one source, the archive, or - "
+			"to read it from stdin\n", argv[0]);
+		exit(1);
+	}
+
+	for(i = 0; i < source && !archive_format; i++)
 		if(lstat(source_path[i], &source_buf) == -1) {
 			fprintf(stderr, "Cannot stat source directory \"%s\" "
 				"because %s\n", source_path[i],
@@ -5832,6 +9615,11 @@ printOptions:
 			break;
 		else if(strcmp(argv[i], "-root-becomes") == 0 ||
 				strcmp(argv[i], "-sort") == 0 ||
+				strcmp(argv[i], "-sort-trace") == 0 ||
+				strcmp(argv[i], "-sort-trace-root") == 0 ||
+				strcmp(argv[i], "-spill") == 0 ||
+				strcmp(argv[i], "-verity") == 0 ||
+				strcmp(argv[i], "-verity-salt") == 0 ||
 				strcmp(argv[i], "-pf") == 0 ||
 				strcmp(argv[i], "-af") == 0 ||
 				strcmp(argv[i], "-vaf") == 0 ||
@@ -5858,9 +9646,27 @@ printOptions:
 			if(res == FALSE)
 				BAD_ERROR("Failed to read sort file\n");
 			sorted ++;
+		} else if(strcmp(argv[i], "-sort-trace") == 0) {
+			char *root = sort_trace_root;
+
+/* ANDROID CHANGES START*/
+#ifdef ANDROID
+			/* traces are taken with the filesystem mounted */
+			if(root == NULL)
+				root = mount_point;
+#endif
+/* ANDROID CHANGES END */
+			if(read_trace_file(argv[++i], root, source,
+						source_path) == FALSE)
+				BAD_ERROR("Failed to read trace file\n");
+			sorted ++;
 		} else if(strcmp(argv[i], "-e") == 0)
 			break;
 		else if(strcmp(argv[i], "-root-becomes") == 0 ||
+				strcmp(argv[i], "-sort-trace-root") == 0 ||
+				strcmp(argv[i], "-spill") == 0 ||
+				strcmp(argv[i], "-verity") == 0 ||
+				strcmp(argv[i], "-verity-salt") == 0 ||
 				strcmp(argv[i], "-ef") == 0 ||
 				strcmp(argv[i], "-pf") == 0 ||
 				strcmp(argv[i], "-af") == 0 ||
@@ -5868,6 +9674,52 @@ printOptions:
 				strcmp(argv[i], "-comp") == 0)
 			i++;
 
+	if(archive_format) {
+		/*
+		 * The archive is read in one pass, as the filesystem is
+		 * written, and so nothing which needs the whole directory
+		 * tree before the files are written can be used
+		 */
+		if(!delete)
+			BAD_ERROR("-tar and -cpio can't append, use "
+				"-noappend\n");
+		if(sorted || pack_fragments || actions() || move_actions() ||
+				prune_actions() || empty_actions() ||
+				get_pseudo() || path || stickypath || exclude ||
+				keep_as_directory || root_name)
+			BAD_ERROR("-tar and -cpio can't be used with -sort, "
+				"-sort-trace, -pack-fragments, actions, pseudo "
+				"files, excludes, -keep-as-directory or "
+				"-root-becomes\n");
+/* ANDROID CHANGES START*/
+#ifdef ANDROID
+		if(android_config)
+			BAD_ERROR("-tar and -cpio can't be used with "
+				"-android-fs-config\n");
+#endif
+/* ANDROID CHANGES END */
+
+		archive = archive_open(source_path[0], archive_format);
+		if(archive == NULL)
+			EXIT_MKSQUASHFS();
+	}
+
+	if(spill_directory) {
+		/*
+		 * Spilled directories are only loaded again, one at a time,
+		 * when they're read and written, and so nothing which needs
+		 * the whole directory tree can be used
+		 */
+		if(archive_format || sorted || pack_fragments || actions() ||
+				move_actions() || prune_actions() ||
+				empty_actions() || get_pseudo())
+			BAD_ERROR("-spill can't be used with -tar, -cpio, "
+				"-sort, -sort-trace, -pack-fragments, actions "
+				"or pseudo files\n");
+
+		spill_init(spill_directory);
+	}
+
 	if(!delete) {
 	        comp = read_super(fd, &sBlk, argv[source + 1]);
 	        if(comp == NULL) {
@@ -5891,8 +9743,13 @@ printOptions:
 		comp_opts = SQUASHFS_COMP_OPTS(sBlk.flags);
 	}
 
+	if(delete && !archive_format)
+		train_dictionary(source, source_path);
+
+	stats_init();
 	initialise_threads(readq, fragq, bwriteq, fwriteq, delete,
 		destination_file);
+	stats_thread(STATS_MAIN);
 
 	res = compressor_init(comp, &stream, SQUASHFS_METADATA_SIZE, 0);
 	if(res)
@@ -5969,6 +9826,9 @@ printOptions:
 		printf("\nIf appending is not wanted, please re-run with "
 			"-noappend specified!\n\n");
 
+		if(dedup_index)
+			read_dedup_index(dedup_index, &sBlk);
+
 		compressed_data = (inode_dir_offset + inode_dir_file_size) &
 			~(SQUASHFS_METADATA_SIZE - 1);
 		uncompressed_data = (inode_dir_offset + inode_dir_file_size) &
@@ -6055,13 +9915,18 @@ printOptions:
 			fifo_count + sock_count;
 	}
 
+	compile_path(path);
+	compile_path(stickypath);
+
 	if(path)
 		paths = add_subdir(paths, path);
 
 	dump_actions(); 
 	dump_pseudos();
 
-	if(delete && !keep_as_directory && source == 1 &&
+	if(archive_format)
+		archive_scan(&inode, progress);
+	else if(delete && !keep_as_directory && source == 1 &&
 			S_ISDIR(source_buf.st_mode))
 		dir_scan(&inode, source_path[0], scan1_readdir, progress);
 	else if(!keep_as_directory && source == 1 &&
@@ -6069,7 +9934,7 @@ printOptions:
 		dir_scan(&inode, source_path[0], scan1_single_readdir, progress);
 	else
 		dir_scan(&inode, "", scan1_encomp_readdir, progress);
-	sBlk.root_inode = inode;
+	sBlk.root_inode = resolve_inode(inode);
 	sBlk.inodes = inode_count;
 	sBlk.s_magic = SQUASHFS_MAGIC;
 	sBlk.s_major = SQUASHFS_MAJOR;
@@ -6083,17 +9948,12 @@ printOptions:
 
 	disable_info();
 
+	flush_fragment_bins();
 	while((fragment = get_frag_action(fragment)))
 		write_fragment(*fragment);
 	unlock_fragments();
-	pthread_cleanup_push((void *) pthread_mutex_unlock, &fragment_mutex);
-	pthread_mutex_lock(&fragment_mutex);
-	while(fragments_outstanding) {
-		pthread_mutex_unlock(&fragment_mutex);
+	while(__atomic_load_n(&fragments_outstanding, __ATOMIC_ACQUIRE))
 		sched_yield();
-		pthread_mutex_lock(&fragment_mutex);
-	}
-	pthread_cleanup_pop(1);
 
 	queue_put(to_writer, NULL);
 	if(queue_get(from_writer) != 0)
@@ -6102,5 +9962,18 @@ printOptions:
 	set_progressbar_state(FALSE);
 	write_filesystem_tables(&sBlk, nopad);
 
+	if(dedup_index)
+		write_dedup_index(dedup_index, &sBlk);
+
+	write_stats();
+
+	/*
+	 * The reader thread may still be walking the last (file-less)
+	 * directories, wait for it before freeing the directory tree
+	 */
+	pthread_join(reader_thread, NULL);
+	arena_free(scan_arena);
+	free(inode_hash);
+
 	return 0;
 }
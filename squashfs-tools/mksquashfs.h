@@ -33,9 +33,12 @@ struct dir_info {
 	int			depth;
 	unsigned int		excluded;
 	char			dir_is_ldir;
+	char			ready;
 	struct dir_ent		*dir_ent;
 	struct dir_ent		*list;
 	DIR			*linuxdir;
+	long long		spill;
+	int			refs;
 };
 
 struct dir_ent {
@@ -48,9 +51,27 @@ struct dir_ent {
 	struct dir_ent		*next;
 };
 
+/*
+ * The attributes of an inode kept for the filesystem, a subset of
+ * struct stat.  The st_ names are kept so the attributes read the same
+ * as stat(2) attributes, except for mtime, which cannot be called st_mtime
+ * because libc defines st_mtime as a macro
+ */
+struct inode_stat {
+	dev_t			st_dev;
+	ino_t			st_ino;
+	off_t			st_size;
+	blkcnt_t		st_blocks;
+	dev_t			st_rdev;
+	nlink_t			st_nlink;
+	time_t			mtime;
+	mode_t			st_mode;
+	uid_t			st_uid;
+	gid_t			st_gid;
+};
+
 struct inode_info {
-	struct stat		buf;
-	struct inode_info	*next;
+	struct inode_stat	buf;
 	squashfs_inode		inode;
 	unsigned int		inode_number;
 	unsigned int		nlink;
@@ -63,6 +84,11 @@ struct inode_info {
 	char			always_use_fragments;
 	char			noD;
 	char			noF;
+	char			incompressible;
+	char			effort;
+	int			frag_bin;
+	struct xattr_list	*xattr_list;
+	int			xattrs;
 	char			symlink[0];
 };
 
@@ -73,11 +99,14 @@ struct file_info {
 	long long		start;
 	unsigned int		*block_list;
 	struct file_info	*next;
+	struct file_info	*hash_next;
 	struct fragment		*fragment;
+	unsigned long long	hash;
 	unsigned short		checksum;
 	unsigned short		fragment_checksum;
 	char			have_frag_checksum;
 	char			have_checksum;
+	char			have_hash;
 };
 
 /* fragment block data structures */
@@ -87,6 +116,59 @@ struct fragment {
 	int			size;
 };
 
+/*
+ * -tar and -cpio file inode.  Files are written in archive order, before
+ * the directory tree is complete, and so their inodes are created later
+ * by dir_scan7 from what write_file() would have created them with
+ */
+struct archive_inode {
+	long long		file_size;
+	long long		start;
+	long long		sparse;
+	unsigned int		blocks;
+	unsigned int		*block_list;
+	struct fragment		fragment;
+	int			duplicate;
+};
+
+/* -block-duplicates index of the data blocks written */
+struct block_entry {
+	unsigned long long	hash;
+	long long		start;
+	unsigned int		c_byte;
+	struct block_entry	*next;
+};
+
+/*
+ * -pack-fragments data structures.  Before any file is written the tail
+ * ends are planned into bins, and a bin becomes a fragment block when its
+ * first member is written
+ */
+struct pack_entry {
+	struct inode_info	*inode;
+	char			*extension;
+	char			*subpath;
+	int			priority;
+	int			size;
+	int			order;
+};
+
+struct fragment_bin {
+	struct file_buffer	*buffer;
+	int			reserved;
+	int			members;
+	char			closed;
+};
+
+#define FRAG_BIN_NONE -1
+#define FRAG_BIN_PLANNED -2
+
+/* -pack-fragments priority of the files in a -sort-trace, above any -sort */
+#define PACK_TRACE 65536
+
+/* how far ahead a bin looks for tail ends to top it up */
+#define PACK_LOOKAHEAD 16
+
 /* in memory uid tables */
 #define ID_ENTRIES 256
 #define ID_HASH(id) (id & (ID_ENTRIES - 1))
@@ -108,10 +190,12 @@ struct append_file {
 
 #define PSEUDO_FILE_OTHER	1
 #define PSEUDO_FILE_PROCESS	2
+#define PSEUDO_FILE_ARCHIVE	4
 
 #define IS_PSEUDO(a)		((a)->pseudo_file)
 #define IS_PSEUDO_PROCESS(a)	((a)->pseudo_file & PSEUDO_FILE_PROCESS)
 #define IS_PSEUDO_OTHER(a)	((a)->pseudo_file & PSEUDO_FILE_OTHER)
+#define IS_PSEUDO_ARCHIVE(a)	((a)->pseudo_file & PSEUDO_FILE_ARCHIVE)
 
 /*
  * Amount of physical memory to use by default, and the default queue
@@ -132,17 +216,45 @@ struct append_file {
  * compressed size */
 #define BLOCK_OFFSET 2
 
+/*
+ * -adaptive compressibility estimate.  Up to ENTROPY_SAMPLE bytes of a
+ * block are sampled, in chunks of ENTROPY_CHUNK bytes.  The thresholds
+ * are in 1/100ths of a bit per byte
+ */
+#define ENTROPY_SAMPLE 16384
+#define ENTROPY_CHUNK 256
+#define ENTROPY_INCOMPRESSIBLE 795
+#define ENTROPY_POOR 700
+
+/*
+ * How often (in blocks) -adaptive rechecks a file found to be
+ * incompressible
+ */
+#define ADAPTIVE_RECHECK 4
+
 extern struct cache *reader_buffer, *fragment_buffer, *reserve_cache;
+extern struct cache_governor *mem_governor;
 struct cache *bwriter_buffer, *fwriter_buffer;
-extern struct queue *to_reader, *to_deflate, *to_writer, *from_writer,
-	*to_frag, *locked_fragment, *to_process_frag;
+extern struct queue *to_reader, *to_writer, *from_writer, *to_frag,
+	*locked_fragment, *to_read, *to_dup;
+extern struct queue **to_deflate, **to_process_frag;
 extern struct append_file **file_mapping;
-extern struct seq_queue *to_main;
+extern struct seq_queue *to_main, *from_dup;
 extern pthread_mutex_t fragment_mutex, dup_mutex;
+
+/*
+ * Looking up (and if necessary reading) a fragment block is serialised
+ * per fragment by one of a set of striped mutexes
+ */
+#define FRAG_LOOKUP_LOCKS 64
+#define FRAG_LOOKUP_LOCK(index) \
+	(&frag_lookup_mutex[(index) & (FRAG_LOOKUP_LOCKS - 1)])
+extern pthread_mutex_t frag_lookup_mutex[FRAG_LOOKUP_LOCKS];
 extern struct squashfs_fragment_entry *fragment_table;
 extern struct compressor *comp;
 extern int block_size;
-extern struct file_info *dupl[];
+extern struct file_info *dupl[], *dupl_hash[];
+extern int unhashed_files;
 extern int read_fs_bytes(int, long long, int, void *);
 extern void add_file(long long, long long, long long, unsigned int *, int,
 	unsigned int, int, int);
@@ -151,4 +263,5 @@ extern unsigned int get_uid(unsigned int);
 extern unsigned int get_guid(unsigned int);
 extern int read_bytes(int, void *, int);
 extern unsigned short get_checksum_mem(char *, int);
+extern void copy_inode_stat(struct inode_stat *, struct stat *);
 #endif
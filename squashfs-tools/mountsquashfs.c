@@ -0,0 +1,319 @@
+/*
+ * Mount a squashfs filesystem with FUSE, without kernel Squashfs support
+ * or mount privileges.
+ *
+ * Copyright (c) 2014
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * mountsquashfs.c
+ *
+ * The filesystem is read with libsquashfs, so FUSE's threads read it in
+ * parallel, with a pool of inflator threads decompressing the blocks of
+ * large reads, and reading ahead of sequential reads
+ */
+
+#define FUSE_USE_VERSION 31
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <fuse3/fuse.h>
+
+#include "libsquashfs.h"
+
+/* default size of the data cache in Mbytes */
+#define CACHE_DEFAULT 256
+
+/* default blocks read ahead of sequential reads */
+#define READAHEAD_DEFAULT 8
+
+/* the filesystem never changes, so the kernel can cache it indefinitely */
+#define TIMEOUT 86400.0
+
+static struct sqfs *fs;
+
+
+static int squashfs_getattr(const char *path, struct stat *st,
+	struct fuse_file_info *fi)
+{
+	struct sqfs_inode i;
+	int res = sqfs_lookup(fs, (char *) path, &i);
+
+	if(res)
+		return res;
+
+	sqfs_stat(fs, &i, st);
+	return 0;
+}
+
+
+static int squashfs_readlink(const char *path, char *buffer, size_t size)
+{
+	struct sqfs_inode i;
+	int res = sqfs_lookup(fs, (char *) path, &i);
+
+	if(res)
+		return res;
+
+	res = sqfs_readlink(fs, &i, buffer, size > INT_MAX ? INT_MAX : size);
+	return res < 0 ? res : 0;
+}
+
+
+static int squashfs_open(const char *path, struct fuse_file_info *fi)
+{
+	struct sqfs_inode i;
+	struct sqfs_file *file;
+	int res;
+
+	if((fi->flags & O_ACCMODE) != O_RDONLY)
+		return -EROFS;
+
+	res = sqfs_lookup(fs, (char *) path, &i);
+	if(res)
+		return res;
+
+	file = sqfs_open_file(fs, &i, &res);
+	if(file == NULL)
+		return res;
+
+	fi->fh = (uintptr_t) file;
+	fi->keep_cache = 1;
+	return 0;
+}
+
+
+static int squashfs_read(const char *path, char *buffer, size_t size,
+	off_t offset, struct fuse_file_info *fi)
+{
+	struct sqfs_file *file = (struct sqfs_file *) (uintptr_t) fi->fh;
+
+	return sqfs_pread(file, buffer, size, offset);
+}
+
+
+static int squashfs_release(const char *path, struct fuse_file_info *fi)
+{
+	sqfs_close_file((struct sqfs_file *) (uintptr_t) fi->fh);
+	return 0;
+}
+
+
+static int squashfs_statfs(const char *path, struct statvfs *st)
+{
+	sqfs_statvfs(fs, st);
+	return 0;
+}
+
+
+struct fill {
+	void		*buffer;
+	fuse_fill_dir_t	filler;
+};
+
+
+static int fill_fn(void *arg, char *name, long long ref, mode_t type)
+{
+	struct fill *fill = arg;
+	struct stat st;
+
+	memset(&st, 0, sizeof(st));
+	st.st_mode = type;
+
+	/* a full buffer stops the directory read */
+	return fill->filler(fill->buffer, name, &st, 0, 0) ? 1 : 0;
+}
+
+
+static int squashfs_readdir(const char *path, void *buffer,
+	fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi,
+	enum fuse_readdir_flags flags)
+{
+	struct fill fill = { buffer, filler };
+	struct sqfs_inode i;
+	int res = sqfs_lookup(fs, (char *) path, &i);
+
+	if(res)
+		return res;
+
+	if(!S_ISDIR(i.mode))
+		return -ENOTDIR;
+
+	filler(buffer, ".", NULL, 0, 0);
+	filler(buffer, "..", NULL, 0, 0);
+
+	res = sqfs_readdir(fs, &i, fill_fn, &fill);
+	return res < 0 ? res : 0;
+}
+
+
+static void *squashfs_init(struct fuse_conn_info *conn,
+	struct fuse_config *cfg)
+{
+	cfg->use_ino = 1;
+	cfg->kernel_cache = 1;
+	cfg->entry_timeout = TIMEOUT;
+	cfg->attr_timeout = TIMEOUT;
+	cfg->negative_timeout = TIMEOUT;
+
+	return NULL;
+}
+
+
+static struct fuse_operations squashfs_ops = {
+	.init = squashfs_init,
+	.getattr = squashfs_getattr,
+	.readlink = squashfs_readlink,
+	.open = squashfs_open,
+	.read = squashfs_read,
+	.release = squashfs_release,
+	.statfs = squashfs_statfs,
+	.readdir = squashfs_readdir,
+};
+
+
+static int parse_number(char *arg, int *res)
+{
+	char *b;
+	long number = strtol(arg, &b, 10);
+
+	/* check for trailing junk after number */
+	if(*b != '\0')
+		return 0;
+
+	/* reject negative numbers, or numbers which overflow signed int */
+	if(number < 0 || number > INT_MAX)
+		return 0;
+
+	*res = number;
+	return 1;
+}
+
+
+#define VERSION() \
+	printf("mountsquashfs version 4.3 (2014/05/12)\n");\
+	printf("copyright (C) 2014 Phillip Lougher "\
+		"<phillip@squashfs.org.uk>\n\n");\
+    	printf("This program is free software; you can redistribute it and/or"\
+		"\n");\
+	printf("modify it under the terms of the GNU General Public License"\
+		"\n");\
+	printf("as published by the Free Software Foundation; either version "\
+		"2,\n");\
+	printf("or (at your option) any later version.\n\n");\
+	printf("This program is distributed in the hope that it will be "\
+		"useful,\n");\
+	printf("but WITHOUT ANY WARRANTY; without even the implied warranty of"\
+		"\n");\
+	printf("MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the"\
+		"\n");\
+	printf("GNU General Public License for more details.\n");
+int main(int argc, char *argv[])
+{
+	int processors = sysconf(_SC_NPROCESSORS_ONLN);
+	int readahead = READAHEAD_DEFAULT, cache_size = CACHE_DEFAULT;
+	int i, res, fuse_argc = 0;
+	char **fuse_argv;
+
+	for(i = 1; i < argc; i++) {
+		if(*argv[i] != '-')
+			break;
+		if(strcmp(argv[i], "-version") == 0 ||
+				strcmp(argv[i], "-v") == 0) {
+			VERSION();
+			exit(0);
+		} else if(strcmp(argv[i], "-processors") == 0 ||
+				strcmp(argv[i], "-p") == 0) {
+			if((++i == argc) || !parse_number(argv[i],
+					&processors)) {
+				fprintf(stderr, "%s: -processors missing or "
+					"invalid processor number\n", argv[0]);
+				exit(1);
+			}
+		} else if(strcmp(argv[i], "-readahead") == 0 ||
+				strcmp(argv[i], "-ra") == 0) {
+			if((++i == argc) || !parse_number(argv[i],
+					&readahead)) {
+				fprintf(stderr, "%s: -readahead missing or "
+					"invalid readahead size\n", argv[0]);
+				exit(1);
+			}
+		} else if(strcmp(argv[i], "-cache-size") == 0 ||
+				strcmp(argv[i], "-cs") == 0) {
+			if((++i == argc) || !parse_number(argv[i],
+					&cache_size) || cache_size < 1) {
+				fprintf(stderr, "%s: -cache-size missing or "
+					"invalid cache size\n", argv[0]);
+				exit(1);
+			}
+		} else
+			goto options;
+	}
+
+	if(i + 2 > argc)
+		goto options;
+
+	fs = sqfs_open_cache(argv[i], (long long) cache_size << 20, processors,
+		readahead, &res);
+	if(fs == NULL) {
+		fprintf(stderr, "%s: failed to open %s, because %s\n", argv[0],
+			argv[i], strerror(-res));
+		exit(1);
+	}
+
+	/* FUSE gets the mount point, and any FUSE options following it */
+	fuse_argv = malloc((argc - i + 3) * sizeof(char *));
+	if(fuse_argv == NULL) {
+		fprintf(stderr, "%s: out of memory\n", argv[0]);
+		exit(1);
+	}
+
+	fuse_argv[fuse_argc++] = argv[0];
+	fuse_argv[fuse_argc++] = "-oro,default_permissions";
+	for(i++; i < argc; i++)
+		fuse_argv[fuse_argc++] = argv[i];
+	fuse_argv[fuse_argc] = NULL;
+
+	res = fuse_main(fuse_argc, fuse_argv, &squashfs_ops, NULL);
+
+	free(fuse_argv);
+	sqfs_close(fs);
+	return res;
+
+options:
+	fprintf(stderr, "SYNTAX: %s [options] filesystem mountpoint "
+		"[FUSE options]\n", argv[0]);
+	fprintf(stderr, "\t-v[ersion]\t\tprint version, licence and "
+		"copyright information\n");
+	fprintf(stderr, "\t-p[rocessors] <number>\tuse <number> inflator "
+		"threads.  By default\n\t\t\t\tas many as there are "
+		"processors\n");
+	fprintf(stderr, "\t-ra, -readahead <blocks>\tread ahead <blocks> "
+		"blocks of sequential\n\t\t\t\treads.  Default %d blocks\n",
+		READAHEAD_DEFAULT);
+	fprintf(stderr, "\t-cs, -cache-size <size>\tcache <size> Mbytes of "
+		"data and fragment\n\t\t\t\tblocks.  Default %d Mbytes\n",
+		CACHE_DEFAULT);
+	fprintf(stderr, "\nFUSE options (e.g. -f, -o allow_other) follow the "
+		"mountpoint\n");
+	exit(1);
+}
@@ -0,0 +1,212 @@
+/*
+ * Create a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2014
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * numa.c
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "numa.h"
+#include "error.h"
+
+#define FALSE 0
+#define TRUE 1
+
+int numa_nodes = 1;
+
+static cpu_set_t node_cpus[NUMA_MAX_NODES];
+static unsigned char cpu_node[CPU_SETSIZE];
+static pthread_attr_t node_attr;
+static __thread int this_node = -1;
+
+struct numa_thread {
+	int	node;
+	void	*(*start)(void *);
+	void	*arg;
+};
+
+
+static int read_list(char *filename, cpu_set_t *set)
+{
+	/*
+	 * Read a sysfs list file, such as "0-3,8-11", into set.  Returns
+	 * FALSE if the file can't be read or parsed
+	 */
+	char buffer[4096], *ptr = buffer;
+	FILE *file = fopen(filename, "r");
+	int res;
+
+	if(file == NULL)
+		return FALSE;
+
+	res = fgets(buffer, sizeof(buffer), file) != NULL;
+	fclose(file);
+	if(res == FALSE)
+		return FALSE;
+
+	CPU_ZERO(set);
+
+	while(*ptr != '\0' && *ptr != '\n') {
+		char *end;
+		long first = strtol(ptr, &end, 10), last = first;
+
+		if(end == ptr || first < 0)
+			return FALSE;
+
+		if(*end == '-') {
+			ptr = end + 1;
+			last = strtol(ptr, &end, 10);
+			if(end == ptr || last < first)
+				return FALSE;
+		}
+
+		for(; first <= last && first < CPU_SETSIZE; first++)
+			CPU_SET(first, set);
+
+		ptr = end;
+		if(*ptr == ',')
+			ptr ++;
+	}
+
+	return TRUE;
+}
+
+
+int numa_init(int max_nodes)
+{
+	/*
+	 * Find the nodes with CPUs, up to max_nodes of them.  The CPUs of
+	 * any other nodes are treated as belonging to the first node.
+	 * Returns the number of nodes, which is 1 if the topology can't be
+	 * read
+	 */
+	char filename[64];
+	cpu_set_t online;
+	int node, found = 0;
+
+	if(max_nodes > NUMA_MAX_NODES)
+		max_nodes = NUMA_MAX_NODES;
+
+	if(read_list(NUMA_SYSFS "/online", &online) == FALSE) {
+		ERROR("-numa: cannot read the NUMA topology from %s, "
+			"ignoring\n", NUMA_SYSFS);
+		return numa_nodes;
+	}
+
+	for(node = 0; node < CPU_SETSIZE && found < max_nodes; node++) {
+		cpu_set_t *cpus = &node_cpus[found];
+		int cpu;
+
+		if(!CPU_ISSET(node, &online))
+			continue;
+
+		sprintf(filename, NUMA_SYSFS "/node%d/cpulist", node);
+		if(read_list(filename, cpus) == FALSE || CPU_COUNT(cpus) == 0)
+			continue;
+
+		for(cpu = 0; cpu < CPU_SETSIZE; cpu++)
+			if(CPU_ISSET(cpu, cpus))
+				cpu_node[cpu] = found;
+
+		found ++;
+	}
+
+	if(found > 1) {
+		numa_nodes = found;
+		pthread_attr_init(&node_attr);
+	}
+
+	return numa_nodes;
+}
+
+
+static void *numa_start(void *arg)
+{
+	struct numa_thread *numa_thread = arg;
+	void *(*start)(void *) = numa_thread->start;
+
+	this_node = numa_thread->node;
+	arg = numa_thread->arg;
+	free(numa_thread);
+
+	return start(arg);
+}
+
+
+int numa_thread_create(pthread_t *thread, int number, int threads,
+	void *(*start)(void *), void *arg)
+{
+	/*
+	 * Create thread number number out of threads, bound to its node.
+	 * Consecutive threads are bound to the same node, dividing the
+	 * threads between the nodes.  Returns as pthread_create()
+	 */
+	struct numa_thread *numa_thread;
+	int res;
+
+	if(numa_nodes == 1)
+		return pthread_create(thread, NULL, start, arg);
+
+	numa_thread = malloc(sizeof(struct numa_thread));
+	if(numa_thread == NULL)
+		MEM_ERROR();
+
+	numa_thread->node = (long long) number * numa_nodes / threads;
+	numa_thread->start = start;
+	numa_thread->arg = arg;
+
+	res = pthread_attr_setaffinity_np(&node_attr, sizeof(cpu_set_t),
+		&node_cpus[numa_thread->node]);
+	if(res)
+		BAD_ERROR("-numa: failed to set thread affinity because %s\n",
+			strerror(res));
+
+	res = pthread_create(thread, &node_attr, numa_start, numa_thread);
+	if(res)
+		free(numa_thread);
+
+	return res;
+}
+
+
+int numa_this_node()
+{
+	/*
+	 * Return the node of the calling thread.  Bound threads know their
+	 * node, other threads look up the node they happen to be running on
+	 * the first time they ask
+	 */
+	if(numa_nodes == 1)
+		return 0;
+
+	if(this_node == -1) {
+		int cpu = sched_getcpu();
+
+		this_node = cpu >= 0 && cpu < CPU_SETSIZE ? cpu_node[cpu] : 0;
+	}
+
+	return this_node;
+}
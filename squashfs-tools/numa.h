@@ -0,0 +1,39 @@
+#ifndef NUMA_H
+#define NUMA_H
+/*
+ * Create a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2014
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * numa.h
+ */
+
+/*
+ * -numa support.  The NUMA topology is read from sysfs, and so libnuma
+ * isn't needed.  Only nodes with CPUs are counted, and at most
+ * NUMA_MAX_NODES of them are used
+ */
+#define NUMA_SYSFS "/sys/devices/system/node"
+#define NUMA_MAX_NODES 16
+
+extern int numa_nodes;
+extern int numa_init(int);
+extern int numa_thread_create(pthread_t *, int, int, void *(*)(void *), void *);
+extern int numa_this_node();
+#endif
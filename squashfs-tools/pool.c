@@ -0,0 +1,195 @@
+/*
+ * Create a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2014
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * pool.c
+ *
+ * Pools of the block sized buffers passed between the reader, deflator
+ * (or inflator) and writer threads.  Allocating these one by one with
+ * malloc puts every block in its own mapping, each of which is page
+ * faulted in and covered by its own TLB entries, and unmapped again when
+ * freed.  A pool carves the buffers out of one huge page backed region,
+ * and reuses them without going back to the kernel.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "pool.h"
+
+#define FALSE 0
+#define TRUE 1
+
+static void *map_region(size_t length, int *huge)
+{
+	char *region, *aligned;
+
+#ifdef MAP_HUGETLB
+	/*
+	 * Use explicitly reserved huge pages if there are enough of them,
+	 * they can't be swapped or split.  The mapping fails if there aren't
+	 */
+	region = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE |
+		MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if(region != MAP_FAILED) {
+		*huge = TRUE;
+		return region;
+	}
+#endif
+
+	/*
+	 * Otherwise ask for transparent huge pages, which need the region to
+	 * be huge page aligned.  Map an extra huge page, and trim the mapping
+	 * either side of the aligned region
+	 */
+	region = mmap(NULL, length + POOL_HUGE_PAGE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(region == MAP_FAILED)
+		return NULL;
+
+	aligned = (char *) (((uintptr_t) region + POOL_HUGE_PAGE - 1) &
+		~((uintptr_t) POOL_HUGE_PAGE - 1));
+	if(aligned != region)
+		munmap(region, aligned - region);
+	munmap(aligned + length, region + POOL_HUGE_PAGE - aligned);
+
+#ifdef MADV_HUGEPAGE
+	madvise(aligned, length, MADV_HUGEPAGE);
+#endif
+
+	*huge = FALSE;
+	return aligned;
+}
+
+
+/*
+ * Create a pool of buffers of size bytes.  Returns NULL if the region
+ * can't be mapped, in which case the caller allocates its buffers
+ * with pool_alloc(NULL, size)
+ */
+struct buffer_pool *pool_init(size_t size, unsigned int buffers)
+{
+	struct buffer_pool *pool;
+
+	if(buffers == 0)
+		return NULL;
+
+	pool = malloc(sizeof(struct buffer_pool));
+	if(pool == NULL)
+		return NULL;
+
+	pool->size = POOL_ROUND(size);
+	pool->buffers = buffers;
+	pool->length = (pool->size * buffers + POOL_HUGE_PAGE - 1) &
+		~((size_t) POOL_HUGE_PAGE - 1);
+	pool->head = 0;
+	pool->carved = 0;
+
+	pool->next = calloc(buffers, sizeof(unsigned int));
+	if(pool->next == NULL) {
+		free(pool);
+		return NULL;
+	}
+
+	pool->region = map_region(pool->length, &pool->huge);
+	if(pool->region == NULL) {
+		free(pool->next);
+		free(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+
+/*
+ * Allocate a buffer of size bytes, aligned to POOL_ALIGN.  It comes from
+ * the pool if it's no bigger than the buffers in the pool, and the pool
+ * isn't exhausted, otherwise from the heap.  Returns NULL if out of memory
+ */
+void *pool_alloc(struct buffer_pool *pool, size_t size)
+{
+	unsigned long long head, new;
+	unsigned int buffer;
+	void *ptr;
+
+	if(pool == NULL || size > pool->size)
+		goto heap;
+
+	head = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+	while((buffer = head & 0xffffffff)) {
+		new = ((head >> 32) + 1) << 32 |
+			__atomic_load_n(&pool->next[buffer - 1],
+				__ATOMIC_RELAXED);
+		if(__atomic_compare_exchange_n(&pool->head, &head, new, TRUE,
+				__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+			return pool->region + (size_t) (buffer - 1) *
+				pool->size;
+	}
+
+	/* the stack is empty, hand out a buffer not used before */
+	if(__atomic_load_n(&pool->carved, __ATOMIC_RELAXED) < pool->buffers) {
+		buffer = __atomic_fetch_add(&pool->carved, 1,
+			__ATOMIC_RELAXED);
+		if(buffer < pool->buffers)
+			return pool->region + (size_t) buffer * pool->size;
+	}
+
+heap:
+	if(posix_memalign(&ptr, POOL_ALIGN, size ? size : 1))
+		return NULL;
+
+	return ptr;
+}
+
+
+void pool_free(struct buffer_pool *pool, void *ptr)
+{
+	unsigned long long head;
+	unsigned int buffer;
+
+	if(pool == NULL || (char *) ptr < pool->region ||
+			(char *) ptr >= pool->region + pool->length) {
+		free(ptr);
+		return;
+	}
+
+	buffer = ((char *) ptr - pool->region) / pool->size + 1;
+
+	head = __atomic_load_n(&pool->head, __ATOMIC_RELAXED);
+	do {
+		__atomic_store_n(&pool->next[buffer - 1], head & 0xffffffff,
+			__ATOMIC_RELAXED);
+	} while(!__atomic_compare_exchange_n(&pool->head, &head,
+			(head & ~0xffffffffULL) | buffer, TRUE,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+
+void pool_destroy(struct buffer_pool *pool)
+{
+	if(pool == NULL)
+		return;
+
+	munmap(pool->region, pool->length);
+	free(pool->next);
+	free(pool);
+}
@@ -0,0 +1,65 @@
+#ifndef POOL_H
+#define POOL_H
+/*
+ * Create a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2014
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * pool.h
+ */
+
+#include <stddef.h>
+
+#include "queue.h"
+
+/* buffers are aligned to a cache line, which is enough for SIMD loads */
+#define POOL_ALIGN QUEUE_CACHE_LINE
+#define POOL_ROUND(n) (((n) + POOL_ALIGN - 1) & ~((size_t) POOL_ALIGN - 1))
+
+#define POOL_HUGE_PAGE (2 * 1024 * 1024)
+
+/*
+ * struct describing a pool of same sized buffers, carved from one
+ * region of memory backed by huge pages.  The free buffers are a lock-free
+ * stack, head holding the number of the top buffer plus one in its low
+ * 32 bits, and a count of the pops in its high 32 bits (which stops a
+ * pop succeeding if the stack has changed underneath it).  Buffers are
+ * handed out from the unused part of the region (carved) once the stack
+ * is empty, so the region is only touched as it is used
+ */
+struct buffer_pool {
+	char			*region;
+	size_t			length;
+	size_t			size;
+	unsigned int		buffers;
+	unsigned int		*next;
+	int			huge;
+	char			pad1[QUEUE_CACHE_LINE];
+	unsigned long long	head;
+	char			pad2[QUEUE_CACHE_LINE];
+	unsigned int		carved;
+	char			pad3[QUEUE_CACHE_LINE];
+};
+
+
+extern struct buffer_pool *pool_init(size_t, unsigned int);
+extern void *pool_alloc(struct buffer_pool *, size_t);
+extern void pool_free(struct buffer_pool *, void *);
+extern void pool_destroy(struct buffer_pool *);
+#endif
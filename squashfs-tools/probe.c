@@ -0,0 +1,471 @@
+/*
+ * Create a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2014
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * probe.c
+ *
+ * Compressor probe (-Xbench).  The source files are scanned, and every
+ * n'th block is read, n chosen to give PROBE_SAMPLE bytes.  The tails of
+ * files are packed into fragment blocks as mksquashfs would, and those
+ * are sampled in the same way, so the sample has the mix of blocks and
+ * fragments the filesystem would have.  Then, for each compressor built
+ * in and each set of options in the grid below, a child process parses the
+ * options (the compressor options are static in the wrappers, and this
+ * gives each set of options a fresh start), and compresses and
+ * decompresses the sample with a thread per processor.  Nothing is
+ * written to the destination
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "squashfs_fs.h"
+#include "mksquashfs.h"
+#include "caches-queues-lists.h"
+#include "compressor.h"
+#include "stats.h"
+#include "probe.h"
+#include "error.h"
+
+#define FALSE 0
+#define TRUE 1
+
+/* the maximum number of arguments in a grid entry */
+#define PROBE_ARGS 8
+
+/*
+ * The options tried for each compressor.  "" is the compressor's
+ * defaults
+ */
+static struct probe_grid {
+	char	*name;
+	char	*options;
+} grid[] = {
+	{ "gzip", "-Xcompression-level 1" },
+	{ "gzip", "-Xcompression-level 6" },
+	{ "gzip", "" },
+	{ "gzip", "-Xstrategy default,filtered,huffman_only,"
+		"run_length_encoded,fixed" },
+	{ "lzma", "" },
+	{ "lzo", "-Xalgorithm lzo1x_1" },
+	{ "lzo", "-Xalgorithm lzo1x_1_15" },
+	{ "lzo", "-Xcompression-level 1" },
+	{ "lzo", "" },
+	{ "lzo", "-Xcompression-level 9" },
+	{ "lz4", "-Xacceleration 8" },
+	{ "lz4", "" },
+	{ "lz4", "-Xhc -Xcompression-level 4" },
+	{ "lz4", "-Xhc" },
+	{ "xz", "-Xdict-size 25%" },
+	{ "xz", "" },
+	{ "xz", "-Xbcj x86" },
+	{ "xz", "-Xbcj x86,arm,armthumb,powerpc,sparc,ia64" },
+	{ "zstd", "-Xcompression-level 1" },
+	{ "zstd", "-Xcompression-level 3" },
+	{ "zstd", "-Xcompression-level 9" },
+	{ "zstd", "" },
+	{ "zstd", "-Xcompression-level 19" },
+	{ "zstd", "-Xcompression-level 22" },
+	{ NULL, NULL }
+};
+
+struct probe_file {
+	char	*pathname;
+	off_t	size;
+};
+
+struct probe_job {
+	struct compressor	*comp;
+	int			next;
+	int			decompress;
+	int			failed;
+};
+
+static struct probe_file *file_list;
+static int files;
+static long long full_blocks, tail_bytes;
+
+static struct probe_block *block_list;
+static int blocks;
+static long long sample_bytes;
+
+/* whether the next block is sampled, see probe_step() */
+static long long step_total, step_sample, step_acc, steps;
+
+/* the fragment block being filled, and whether it is sampled */
+static int frag_block, frag_fill;
+
+static int probe_block_size, threads;
+
+extern struct compressor *compressor[];
+
+
+static int probe_file(const char *path, const struct stat *buf, int type,
+	struct FTW *ftwbuf)
+{
+	if(type != FTW_F || !S_ISREG(buf->st_mode) || buf->st_size == 0)
+		return 0;
+
+	if((files & 1023) == 0) {
+		file_list = realloc(file_list, (files + 1024) *
+			sizeof(struct probe_file));
+		if(file_list == NULL)
+			MEM_ERROR();
+	}
+
+	file_list[files].pathname = strdup(path);
+	if(file_list[files].pathname == NULL)
+		MEM_ERROR();
+	file_list[files ++].size = buf->st_size;
+
+	full_blocks += buf->st_size / probe_block_size;
+	tail_bytes += buf->st_size % probe_block_size;
+
+	return 0;
+}
+
+
+/*
+ * Blocks and fragment blocks are numbered (in the order mksquashfs would
+ * write them), and step_sample of the step_total are chosen, evenly spaced
+ */
+static int probe_step()
+{
+	steps ++;
+	step_acc += step_sample;
+	if(step_acc < step_total)
+		return FALSE;
+
+	step_acc -= step_total;
+	return TRUE;
+}
+
+
+static struct probe_block *probe_add()
+{
+	struct probe_block *block;
+
+	if((blocks & 255) == 0) {
+		block_list = realloc(block_list, (blocks + 256) *
+			sizeof(struct probe_block));
+		if(block_list == NULL)
+			MEM_ERROR();
+	}
+
+	block = &block_list[blocks ++];
+	block->data = malloc(probe_block_size);
+	block->cdata = malloc(probe_block_size);
+	if(block->data == NULL || block->cdata == NULL)
+		MEM_ERROR();
+	block->size = block->c_byte = 0;
+
+	return block;
+}
+
+
+static int probe_read(int fd, char *buffer, int size, off_t off)
+{
+	if(lseek(fd, off, SEEK_SET) == -1)
+		return -1;
+
+	return read_bytes(fd, buffer, size);
+}
+
+
+static void probe_sample_file(struct probe_file *file)
+{
+	long long n, full = file->size / probe_block_size;
+	int tail = file->size % probe_block_size, fd = -1, bytes;
+
+	for(n = 0; n < full; n++) {
+		struct probe_block *block;
+
+		if(!probe_step())
+			continue;
+
+		if(fd == -1 && (fd = open(file->pathname, O_RDONLY)) == -1)
+			goto failed;
+
+		block = probe_add();
+		bytes = probe_read(fd, block->data, probe_block_size, n *
+			probe_block_size);
+		if(bytes < 1)
+			goto failed;
+
+		block->size = bytes;
+		sample_bytes += bytes;
+	}
+
+	if(tail == 0)
+		goto done;
+
+	if(frag_fill + tail > probe_block_size || frag_fill == 0) {
+		frag_block = probe_step() ? -1 : -2;
+		frag_fill = 0;
+	}
+	frag_fill += tail;
+
+	if(frag_block == -2)
+		goto done;
+
+	if(fd == -1 && (fd = open(file->pathname, O_RDONLY)) == -1)
+		goto failed;
+
+	if(frag_block == -1) {
+		probe_add();
+		frag_block = blocks - 1;
+	}
+
+	bytes = probe_read(fd, block_list[frag_block].data +
+		block_list[frag_block].size, tail, full * probe_block_size);
+	if(bytes < 1)
+		goto failed;
+
+	block_list[frag_block].size += bytes;
+	sample_bytes += bytes;
+	goto done;
+
+failed:
+	ERROR("-Xbench: failed to read %s, not sampling it\n",
+		file->pathname);
+	if(blocks && block_list[blocks - 1].size == 0) {
+		blocks --;
+		free(block_list[blocks].data);
+		free(block_list[blocks].cdata);
+		if(frag_block == blocks)
+			frag_block = -2;
+	}
+
+done:
+	if(fd != -1)
+		close(fd);
+}
+
+
+static void *probe_thrd(void *arg)
+{
+	struct probe_job *job = arg;
+	struct compressor *comp = job->comp;
+	char *buffer = NULL;
+	void *strm;
+	int res, error;
+
+	if(job->decompress) {
+		buffer = malloc(probe_block_size);
+		if(buffer == NULL)
+			MEM_ERROR();
+		res = compressor_uncompress_init(comp, &strm);
+	} else
+		res = compressor_init(comp, &strm, probe_block_size, 1);
+	if(res)
+		BAD_ERROR("-Xbench: %s compressor_init failed\n", comp->name);
+
+	while(1) {
+		int i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+		struct probe_block *block;
+
+		if(i >= blocks)
+			break;
+
+		block = &block_list[i];
+
+		if(job->decompress == FALSE) {
+			res = compressor_compress(comp, strm, block->cdata,
+				block->data, block->size, probe_block_size,
+				&error);
+			if(res == -1)
+				job->failed = TRUE;
+			else
+				block->c_byte = res;
+		} else if(block->c_byte) {
+			/* blocks which didn't compress are stored as is */
+			res = compressor_uncompress(comp, strm, buffer,
+				block->cdata, block->c_byte, probe_block_size,
+				&error);
+			if(res != block->size || memcmp(buffer, block->data,
+					res) != 0)
+				job->failed = TRUE;
+		}
+	}
+
+	if(job->decompress)
+		compressor_uncompress_free(comp, strm);
+	free(buffer);
+	return NULL;
+}
+
+
+/*
+ * Compress (or decompress) the sample using threads threads, returning
+ * the elapsed time in nanoseconds, or -1 on failure
+ */
+static long long probe_threads(struct compressor *comp, int decompress)
+{
+	struct probe_job job = { comp, 0, decompress, FALSE };
+	pthread_t thread[threads];
+	long long start = stats_time();
+	int i;
+
+	for(i = 0; i < threads; i++)
+		if(pthread_create(&thread[i], NULL, probe_thrd, &job) != 0)
+			BAD_ERROR("Failed to create thread\n");
+
+	for(i = 0; i < threads; i++)
+		pthread_join(thread[i], NULL);
+
+	return job.failed ? -1 : stats_time() - start;
+}
+
+
+static double probe_rate(long long ns)
+{
+	return ns ? sample_bytes / (ns / 1000000000.0) / (1024 * 1024) : 0;
+}
+
+
+/*
+ * Run in a child process.  Set up the compressor with options, and
+ * print the results for the sample
+ */
+static void probe_run(struct compressor *comp, char *options)
+{
+	char *argv[PROBE_ARGS], *copy = strdup(options), *arg;
+	long long comp_ns, decomp_ns, bytes = 0;
+	int argc = 0, i, res;
+
+	if(copy == NULL)
+		MEM_ERROR();
+
+	for(arg = strtok(copy, " "); arg && argc < PROBE_ARGS;
+						arg = strtok(NULL, " "))
+		argv[argc ++] = arg;
+
+	for(i = 0; i < argc; i++) {
+		res = compressor_options(comp, argv + i, argc - i);
+		if(res < 0)
+			exit(1);
+		i += res;
+	}
+
+	if(compressor_options_post(comp, probe_block_size))
+		exit(1);
+
+	comp_ns = probe_threads(comp, FALSE);
+	if(comp_ns == -1) {
+		ERROR("-Xbench: %s %s failed to compress the sample\n",
+			comp->name, options);
+		exit(1);
+	}
+
+	for(i = 0; i < blocks; i++)
+		bytes += block_list[i].c_byte ? block_list[i].c_byte :
+			block_list[i].size;
+
+	decomp_ns = probe_threads(comp, TRUE);
+	if(decomp_ns == -1) {
+		ERROR("-Xbench: %s %s failed to decompress the sample\n",
+			comp->name, options);
+		exit(1);
+	}
+
+	printf("%-6s %6.2f%% %9.2f %9.2f  %s\n", comp->name, bytes *
+		100.0 / sample_bytes, probe_rate(comp_ns),
+		probe_rate(decomp_ns), options[0] ? options : "(defaults)");
+	exit(0);
+}
+
+
+/*
+ * Sample the source files, and print how each compressor and set of
+ * options does on the sample.  This doesn't return
+ */
+void probe_compressors(char **source_path, int source, int block_size,
+	int processors)
+{
+	int i, j, status;
+
+	probe_block_size = block_size;
+	threads = processors == -1 ? sysconf(_SC_NPROCESSORS_ONLN) :
+		processors;
+	if(threads < 1)
+		threads = 1;
+
+	for(i = 0; i < source; i++)
+		if(nftw(source_path[i], probe_file, 64, FTW_PHYS) != 0)
+			BAD_ERROR("-Xbench: failed to scan %s\n",
+				source_path[i]);
+
+	step_total = full_blocks + (tail_bytes + block_size - 1) / block_size;
+	step_sample = PROBE_SAMPLE / block_size;
+	if(step_sample > step_total)
+		step_sample = step_total;
+	step_acc = step_total / 2;
+
+	for(i = 0; i < files; i++)
+		probe_sample_file(&file_list[i]);
+
+	if(blocks == 0)
+		BAD_ERROR("-Xbench: no data to sample in the sources\n");
+
+	printf("Sampled %d of %lld blocks (%.2f Mbytes) from %d files, using "
+		"%d thread%s\n\n", blocks, steps, sample_bytes /
+		(1024.0 * 1024), files, threads, threads == 1 ? "" : "s");
+	printf("%-6s %7s %9s %9s  %s\n", "comp", "size", "comp MB/s",
+		"dec MB/s", "options");
+	fflush(stdout);
+
+	for(i = 0; compressor[i]->id; i++) {
+		if(!compressor[i]->supported)
+			continue;
+
+		for(j = 0; grid[j].name; j++) {
+			pid_t pid;
+
+			if(strcmp(grid[j].name, compressor[i]->name))
+				continue;
+
+			pid = fork();
+			if(pid == -1)
+				BAD_ERROR("-Xbench: fork failed, because %s\n",
+					strerror(errno));
+			if(pid == 0)
+				probe_run(compressor[i], grid[j].options);
+
+			while(waitpid(pid, &status, 0) == -1)
+				if(errno != EINTR)
+					BAD_ERROR("-Xbench: waitpid failed, "
+						"because %s\n", strerror(errno));
+		}
+	}
+
+	printf("\nsize is the sample's compressed size, as a percentage of "
+		"its uncompressed size\n");
+	exit(0);
+}
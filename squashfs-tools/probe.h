@@ -0,0 +1,42 @@
+#ifndef PROBE_H
+#define PROBE_H
+/*
+ * Create a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2014
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * probe.h
+ */
+
+/*
+ * Compressor probe (-Xbench).  Up to PROBE_SAMPLE bytes of blocks,
+ * spread evenly over the source files, are compressed and decompressed by
+ * every compressor built in, with each of the options in its grid
+ */
+#define PROBE_SAMPLE (64 * 1024 * 1024)
+
+struct probe_block {
+	char	*data;
+	char	*cdata;
+	int	size;
+	int	c_byte;
+};
+
+extern void probe_compressors(char **, int, int, int);
+#endif
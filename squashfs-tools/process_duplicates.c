@@ -0,0 +1,324 @@
+/*
+ * Create a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2014
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * process_duplicates.c
+ *
+ * Parallel duplicate checking of files with data blocks.
+ *
+ * The collector thread takes the buffers destined for the main thread off
+ * the to_main queue in sequence order, and gathers together all the buffers
+ * of each file which has data blocks (up to dup_max_blocks).  These files
+ * are passed to the duplicate threads, which check them against the files
+ * already in the duplicate table, before passing the buffers on to the main
+ * thread (via the from_dup queue) with the first buffer marked as checked.
+ * Everything else (fragment only files, dynamic pseudo files, files too
+ * large to hold, and errors) is passed straight on.
+ *
+ * In the same way as fragment duplicate checking, the main thread only
+ * needs to check the files it has added to the table since the buffer
+ * was checked (i.e. those in front of file_dupl).
+ */
+
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "caches-queues-lists.h"
+#include "squashfs_fs.h"
+#include "mksquashfs.h"
+#include "error.h"
+#include "process_fragments.h"
+#include "process_duplicates.h"
+#include "hash.h"
+#include "compressor.h"
+#include "stats.h"
+
+#define FALSE 0
+#define TRUE 1
+
+/* struct describing the buffers of one file being duplicate checked */
+struct dup_file {
+	int			count;
+	struct file_buffer	*buffer[0];
+};
+
+extern struct queue *to_dup;
+extern struct seq_queue *from_dup;
+extern int block_log;
+extern int dup_max_blocks;
+
+
+static void pass_buffer(struct file_buffer *file_buffer)
+{
+	file_buffer->checked = FALSE;
+	seq_queue_put(from_dup, file_buffer);
+}
+
+
+void *dup_collect_thrd(void *arg)
+{
+	stats_thread(STATS_DUPLICATE);
+
+	while(1) {
+		struct file_buffer *file_buffer = seq_queue_get(to_main);
+		long long file_size = file_buffer->file_size;
+		struct dup_file *file;
+		int i, blocks;
+
+		if(file_size == -1) {
+			/*
+			 * Dynamic pseudo file, the size isn't known until the
+			 * last buffer, pass the buffers straight on
+			 */
+			while(!file_buffer->error &&
+					file_buffer->file_size == -1) {
+				pass_buffer(file_buffer);
+				file_buffer = seq_queue_get(to_main);
+			}
+			pass_buffer(file_buffer);
+			continue;
+		}
+
+		blocks = (file_size + block_size - 1) >> block_log;
+
+		if(file_buffer->error || file_size == 0 ||
+				(file_buffer->fragment && file_buffer->c_byte)) {
+			/* errors, empty and fragment only files */
+			pass_buffer(file_buffer);
+			continue;
+		}
+
+		if(blocks > dup_max_blocks) {
+			/*
+			 * Too large to hold, let the main thread duplicate
+			 * check it, stopping if an error is hit
+			 */
+			for(i = 0; ; ) {
+				int error = file_buffer->error;
+
+				pass_buffer(file_buffer);
+				if(error || ++i == blocks)
+					break;
+				file_buffer = seq_queue_get(to_main);
+			}
+			continue;
+		}
+
+		file = malloc(sizeof(struct dup_file) +
+			blocks * sizeof(struct file_buffer *));
+		if(file == NULL)
+			MEM_ERROR();
+
+		for(i = 0; i < blocks; i++) {
+			if(i)
+				file_buffer = seq_queue_get(to_main);
+			file->buffer[i] = file_buffer;
+			if(file_buffer->error)
+				break;
+		}
+
+		if(i < blocks) {
+			/* hit an error, the main thread will deal with it */
+			for(blocks = 0; blocks <= i; blocks++)
+				pass_buffer(file->buffer[blocks]);
+			free(file);
+			continue;
+		}
+
+		file->count = blocks;
+		queue_put(to_dup, file);
+	}
+}
+
+
+/*
+ * Compare the file's data blocks against those of the possible duplicate
+ * dupl_ptr.  Returns TRUE if they are the same
+ */
+static int blocks_match(struct dup_file *file, int blocks,
+	struct file_info *dupl_ptr, char *data_buffer, int fd)
+{
+	long long dup_start = dupl_ptr->start;
+	int block;
+
+	for(block = 0; block < blocks; block++) {
+		struct file_buffer *buffer = file->buffer[block];
+		struct file_buffer *dup_buffer;
+		char *dup_data;
+		int res;
+
+		if(buffer->c_byte == 0)
+			continue;
+
+		dup_buffer = cache_lookup(bwriter_buffer, dup_start);
+		if(dup_buffer)
+			dup_data = dup_buffer->data;
+		else {
+			res = read_fs_bytes(fd, dup_start, buffer->size,
+				data_buffer);
+			if(res == 0) {
+				ERROR("Failed to read data from output "
+					"filesystem\n");
+				BAD_ERROR("Output filesystem corrupted?\n");
+			}
+			dup_data = data_buffer;
+		}
+
+		res = memcmp(buffer->data, dup_data, buffer->size);
+		cache_block_put(dup_buffer);
+		if(res)
+			return FALSE;
+
+		dup_start += buffer->size;
+	}
+
+	return TRUE;
+}
+
+
+static int frag_matches(struct file_buffer *fragment,
+	struct file_info *dupl_ptr, char *data_buffer, int fd, void *strm)
+{
+	struct file_buffer *buffer;
+	int res;
+
+	if(fragment == NULL)
+		return TRUE;
+
+	buffer = read_fragment(dupl_ptr->fragment, data_buffer, fd, strm);
+	res = memcmp(fragment->data, buffer->data +
+		dupl_ptr->fragment->offset, fragment->size);
+	cache_block_put(buffer);
+
+	return res == 0;
+}
+
+
+static void check_file(struct dup_file *file, unsigned int *block_list,
+	char *data_buffer, int fd, void *strm)
+{
+	struct file_buffer *first = file->buffer[0], *fragment = NULL;
+	long long file_size = first->file_size, bytes = 0;
+	unsigned long long hash = 0;
+	struct file_info *dupl_ptr;
+	int i, blocks = file->count, frag_bytes;
+
+	/*
+	 * Build the block list and content hash in the same way as the
+	 * main thread will
+	 */
+	for(i = 0; i < file->count; i++) {
+		struct file_buffer *buffer = file->buffer[i];
+
+		if(buffer->fragment) {
+			fragment = buffer;
+			blocks = file_size >> block_log;
+			break;
+		}
+
+		block_list[i] = buffer->c_byte;
+		if(buffer->c_byte) {
+			bytes += buffer->size;
+			hash = hash64_combine(hash, buffer->hash);
+		}
+	}
+
+	if(fragment)
+		hash = hash64_combine(hash, fragment->hash);
+	frag_bytes = fragment ? fragment->size : 0;
+
+	pthread_cleanup_push((void *) pthread_mutex_unlock, &dup_mutex);
+	pthread_mutex_lock(&dup_mutex);
+	dupl_ptr = dupl_hash[DUP_HASH(hash)];
+	pthread_cleanup_pop(1);
+
+	first->checked = TRUE;
+	first->file_hash = hash;
+	first->file_dupl = dupl_ptr;
+	first->file_dup = FALSE;
+
+	for(; dupl_ptr; dupl_ptr = dupl_ptr->hash_next)
+		if(hash == dupl_ptr->hash && file_size == dupl_ptr->file_size
+				&& bytes == dupl_ptr->bytes && frag_bytes ==
+				dupl_ptr->fragment->size && memcmp(block_list,
+				dupl_ptr->block_list, blocks *
+				sizeof(unsigned int)) == 0 &&
+				blocks_match(file, blocks, dupl_ptr,
+				data_buffer, fd) && frag_matches(fragment,
+				dupl_ptr, data_buffer, fd, strm)) {
+			first->file_dupl = dupl_ptr;
+			first->file_dup = TRUE;
+			break;
+		}
+
+	for(i = 1; i < file->count; i++)
+		file->buffer[i]->checked = FALSE;
+}
+
+
+void *dup_thrd(void *destination_file)
+{
+	sigset_t sigmask, old_mask;
+	unsigned int *block_list;
+	char *data_buffer;
+	void *strm;
+	int i, fd;
+
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask, SIGINT);
+	sigaddset(&sigmask, SIGTERM);
+	sigaddset(&sigmask, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &sigmask, &old_mask);
+
+	stats_thread(STATS_DUPLICATE);
+
+	fd = open(destination_file, O_RDONLY);
+	if(fd == -1)
+		BAD_ERROR("dup_thrd: can't open destination for reading\n");
+
+	data_buffer = malloc(SQUASHFS_FILE_MAX_SIZE);
+	if(data_buffer == NULL)
+		MEM_ERROR();
+
+	block_list = malloc(dup_max_blocks * sizeof(unsigned int));
+	if(block_list == NULL)
+		MEM_ERROR();
+
+	if(compressor_uncompress_init(comp, &strm) == -1)
+		BAD_ERROR("dup_thrd: failed to initialise %s decompressor\n",
+			comp->name);
+
+	while(1) {
+		struct dup_file *file = queue_get(to_dup);
+
+		check_file(file, block_list, data_buffer, fd, strm);
+
+		for(i = 0; i < file->count; i++)
+			seq_queue_put(from_dup, file->buffer[i]);
+		free(file);
+	}
+}
@@ -46,34 +46,30 @@
 #include "info.h"
 #include "compressor.h"
 #include "process_fragments.h"
+#include "hash.h"
+#include "numa.h"
+#include "stats.h"
 
 #define FALSE 0
 #define TRUE 1
 
-extern struct queue *to_process_frag;
+extern struct queue **to_process_frag;
 extern struct seq_queue *to_main;
 extern int sparse_files;
+extern int duplicate_checking;
+extern int all_zero(struct file_buffer *);
 
 /*
- * Compute 16 bit BSD checksum over the data, and check for sparseness
+ * Compute 16 bit BSD checksum over the data, and check for sparseness.
+ * The checksum is only needed to compare against fragments in the
+ * filesystem being appended to, which have no content hash
  */
 static int checksum_sparse(struct file_buffer *file_buffer)
 {
-	unsigned char *b = (unsigned char *) file_buffer->data;
-	unsigned short chksum = 0;
-	int bytes = file_buffer->size, sparse = TRUE, value;
-
-	while(bytes --) {
-		chksum = (chksum & 1) ? (chksum >> 1) | 0x8000 : chksum >> 1;
-		value = *b++;
-		if(value) {
-			sparse = FALSE;
-			chksum += value;
-		}
-	}
+	file_buffer->checksum = unhashed_files ?
+		get_checksum_mem(file_buffer->data, file_buffer->size) : 0;
 
-	file_buffer->checksum = chksum;
-	return sparse;
+	return all_zero(file_buffer);
 }
 
 
@@ -97,13 +93,14 @@ static int read_filesystem(int fd, long long byte, int bytes, void *buff)
 }
 
 
-static struct file_buffer *get_fragment(struct fragment *fragment,
-	char *data_buffer, int fd)
+struct file_buffer *read_fragment(struct fragment *fragment,
+	char *data_buffer, int fd, void *strm)
 {
 	struct squashfs_fragment_entry *disk_fragment;
 	struct file_buffer *buffer, *compressed_buffer;
+	pthread_mutex_t *lookup_mutex = FRAG_LOOKUP_LOCK(fragment->index);
 	long long start_block;
-	int res, size, index = fragment->index;
+	int res, size, c_byte, index = fragment->index;
 	char locked;
 
 	/*
@@ -117,20 +114,22 @@ static struct file_buffer *get_fragment(struct fragment *fragment,
 	 *	   same buffer.  This means a buffer needs to be "locked"
 	 *	   when it is being filled in, to prevent other threads from
 	 *	   using it when it is not ready.  This is because we now do
-	 *	   fragment duplicate checking in parallel.
+	 *	   fragment duplicate checking in parallel.  The lookup and
+	 *	   creation is serialised by the lookup mutex of the fragment,
+	 *	   so threads looking up different fragments don't contend.
 	 *	2. We have two caches which need to be checked for the
 	 *	   presence of fragment blocks: the normal fragment cache
 	 *	   and a "reserve" cache.  The reserve cache is used to
 	 *	   prevent an unnecessary pipeline stall when the fragment cache
 	 *	   is full of fragments waiting to be compressed.
 	 */
-	pthread_cleanup_push((void *) pthread_mutex_unlock, &dup_mutex);
-	pthread_mutex_lock(&dup_mutex);
+	pthread_cleanup_push((void *) pthread_mutex_unlock, lookup_mutex);
+	pthread_mutex_lock(lookup_mutex);
 
 again:
 	buffer = cache_lookup_nowait(fragment_buffer, index, &locked);
 	if(buffer) {
-		pthread_mutex_unlock(&dup_mutex);
+		pthread_mutex_unlock(lookup_mutex);
 		if(locked)
 			/* got a buffer being filled in.  Wait for it */
 			cache_wait_unlock(buffer);
@@ -140,7 +139,7 @@ again:
 	/* not in fragment cache, is it in the reserve cache? */
 	buffer = cache_lookup_nowait(reserve_cache, index, &locked);
 	if(buffer) {
-		pthread_mutex_unlock(&dup_mutex);
+		pthread_mutex_unlock(lookup_mutex);
 		if(locked)
 			/* got a buffer being filled in.  Wait for it */
 			cache_wait_unlock(buffer);
@@ -153,7 +152,7 @@ again:
 		/*
 		 * no room, get it from the reserve cache, this is
 		 * dimensioned so it will always have space (no more than
-		 * processors + 1 can have an outstanding reserve buffer)
+		 * processors * 2 + 1 can have an outstanding reserve buffer)
 		 */
 		buffer = cache_get_nowait(reserve_cache, index);
 		if(!buffer) {
@@ -163,18 +162,19 @@ again:
 		}
 	}
 
-	pthread_mutex_unlock(&dup_mutex);
+	pthread_mutex_unlock(lookup_mutex);
 
 	compressed_buffer = cache_lookup(fwriter_buffer, index);
 
 	pthread_cleanup_push((void *) pthread_mutex_unlock, &fragment_mutex);
 	pthread_mutex_lock(&fragment_mutex);
 	disk_fragment = &fragment_table[index];
-	size = SQUASHFS_COMPRESSED_SIZE_BLOCK(disk_fragment->size);
+	c_byte = disk_fragment->size;
 	start_block = disk_fragment->start_block;
 	pthread_cleanup_pop(1);
 
-	if(SQUASHFS_COMPRESSED_BLOCK(disk_fragment->size)) {
+	size = SQUASHFS_COMPRESSED_SIZE_BLOCK(c_byte);
+	if(SQUASHFS_COMPRESSED_BLOCK(c_byte)) {
 		int error;
 		char *data;
 
@@ -190,8 +190,8 @@ again:
 			data = data_buffer;
 		}
 
-		res = compressor_uncompress(comp, buffer->data, data, size,
-			block_size, &error);
+		res = compressor_uncompress(comp, strm, buffer->data, data,
+			size, block_size, &error);
 		if(res == -1)
 			BAD_ERROR("%s uncompress failed with error code %d\n",
 				comp->name, error);
@@ -217,13 +217,13 @@ finished:
 
 
 struct file_buffer *get_fragment_cksum(struct file_info *file,
-	char *data_buffer, int fd, unsigned short *checksum)
+	char *data_buffer, int fd, void *strm, unsigned short *checksum)
 {
 	struct file_buffer *frag_buffer;
 	struct append_file *append;
 	int index = file->fragment->index;
 
-	frag_buffer = get_fragment(file->fragment, data_buffer, fd);
+	frag_buffer = read_fragment(file->fragment, data_buffer, fd, strm);
 
 	pthread_cleanup_push((void *) pthread_mutex_unlock, &dup_mutex);
 
@@ -248,10 +248,40 @@ struct file_buffer *get_fragment_cksum(struct file_info *file,
 }
 
 
+/*
+ * Compare the fragment against the possible duplicate dupl_ptr, whose
+ * fragment block is buffer.  If they match, replace the fragment by a
+ * (dataless) copy marked as a duplicate of dupl_ptr and return TRUE
+ */
+static int frag_match(struct file_buffer **file_buffer,
+	struct file_info *dupl_ptr, struct file_buffer *buffer)
+{
+	struct file_buffer *dup;
+	int res = memcmp((*file_buffer)->data, buffer->data +
+		dupl_ptr->fragment->offset, (*file_buffer)->file_size);
+
+	cache_block_put(buffer);
+	if(res)
+		return FALSE;
+
+	dup = malloc(sizeof(*dup));
+	if(dup == NULL)
+		MEM_ERROR();
+	memcpy(dup, *file_buffer, sizeof(*dup));
+	cache_block_put(*file_buffer);
+	dup->dupl_start = dupl_ptr;
+	dup->duplicate = TRUE;
+	*file_buffer = dup;
+	return TRUE;
+}
+
+
 void *frag_thrd(void *destination_file)
 {
 	sigset_t sigmask, old_mask;
 	char *data_buffer;
+	void *strm;
+	struct queue *queue;
 	int fd;
 
 	sigemptyset(&sigmask);
@@ -268,17 +298,26 @@ void *frag_thrd(void *destination_file)
 	if(data_buffer == NULL)
 		MEM_ERROR();
 
+	if(compressor_uncompress_init(comp, &strm) == -1)
+		BAD_ERROR("frag_thrd: failed to initialise %s decompressor\n",
+			comp->name);
+
+	stats_thread(STATS_FRAGMENT);
+	queue = to_process_frag[numa_this_node()];
+
 	pthread_cleanup_push((void *) pthread_mutex_unlock, &dup_mutex);
 
 	while(1) {
-		struct file_buffer *file_buffer = queue_get(to_process_frag);
+		struct file_buffer *file_buffer = queue_get(queue);
 		struct file_buffer *buffer;
 		int sparse = checksum_sparse(file_buffer);
 		struct file_info *dupl_ptr;
 		long long file_size;
+		unsigned long long hash;
 		unsigned short checksum;
 		char flag;
-		int res;
+
+		STATS_BLOCK(file_buffer->size, file_buffer->size);
 
 		if(sparse_files && sparse) {
 			file_buffer->c_byte = 0;
@@ -286,6 +325,10 @@ void *frag_thrd(void *destination_file)
 		} else
 			file_buffer->c_byte = file_buffer->size;
 
+		if(duplicate_checking)
+			file_buffer->hash = hash64(file_buffer->data,
+				file_buffer->size, 0);
+
 		/*
 		 * Specutively pull into the fragment cache any fragment blocks
 		 * which contain fragments which *this* fragment may be
@@ -307,16 +350,46 @@ void *frag_thrd(void *destination_file)
 		}
 
 		file_size = file_buffer->file_size;
+		hash = hash64_combine(0, file_buffer->hash);
 
 		pthread_mutex_lock(&dup_mutex);
-		dupl_ptr = dupl[DUP_HASH(file_size)];
+		dupl_ptr = dupl_hash[DUP_HASH(hash)];
 		pthread_mutex_unlock(&dup_mutex);
 
 		file_buffer->dupl_start = dupl_ptr;
 		file_buffer->duplicate = FALSE;
 
-		for(; dupl_ptr; dupl_ptr = dupl_ptr->next) {
-			if(file_size != dupl_ptr->file_size ||
+		/*
+		 * Only fragments with the same content hash can be
+		 * duplicates, these are compared in full to rule out
+		 * hash collisions
+		 */
+		for(; dupl_ptr; dupl_ptr = dupl_ptr->hash_next) {
+			if(hash != dupl_ptr->hash ||
+					file_size != dupl_ptr->file_size ||
+					file_size != dupl_ptr->fragment->size)
+				continue;
+
+			buffer = read_fragment(dupl_ptr->fragment,
+				data_buffer, fd, strm);
+			if(frag_match(&file_buffer, dupl_ptr, buffer))
+				break;
+		}
+
+		if(file_buffer->duplicate || !unhashed_files) {
+			seq_queue_put(to_main, file_buffer);
+			continue;
+		}
+
+		/*
+		 * Fragments from the filesystem being appended to don't have
+		 * a content hash, and so fall back to checking all fragments
+		 * of the same size, using checksums to eliminate most of them
+		 */
+		for(dupl_ptr = dupl[DUP_HASH(file_size)]; dupl_ptr;
+						dupl_ptr = dupl_ptr->next) {
+			if(dupl_ptr->have_hash ||
+					file_size != dupl_ptr->file_size ||
 					file_size != dupl_ptr->fragment->size)
 				continue;
 
@@ -336,31 +409,19 @@ void *frag_thrd(void *destination_file)
 			 */
 			if(!flag) {
 				buffer = get_fragment_cksum(dupl_ptr,
-					data_buffer, fd, &checksum);
+					data_buffer, fd, strm, &checksum);
 				if(checksum != file_buffer->checksum) {
 					cache_block_put(buffer);
 					continue;
 				}
 			} else if(checksum == file_buffer->checksum)
-				buffer = get_fragment(dupl_ptr->fragment,
-					data_buffer, fd);
+				buffer = read_fragment(dupl_ptr->fragment,
+					data_buffer, fd, strm);
 			else
 				continue;
 
-			res = memcmp(file_buffer->data, buffer->data +
-				dupl_ptr->fragment->offset, file_size);
-			cache_block_put(buffer);
-			if(res == 0) {
-				struct file_buffer *dup = malloc(sizeof(*dup));
-				if(dup == NULL)
-					MEM_ERROR();
-				memcpy(dup, file_buffer, sizeof(*dup));
-				cache_block_put(file_buffer);
-				dup->dupl_start = dupl_ptr;
-				dup->duplicate = TRUE;
-				file_buffer = dup;
+			if(frag_match(&file_buffer, dupl_ptr, buffer))
 				break;
-			}
 		}
 
 		seq_queue_put(to_main, file_buffer);
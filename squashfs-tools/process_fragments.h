@@ -27,4 +27,6 @@
 #define DUP_HASH(a) (a & 0xffff)
 
 extern void *frag_thrd(void *);
+extern struct file_buffer *read_fragment(struct fragment *, char *, int,
+	void *);
 #endif
@@ -33,14 +33,28 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <ctype.h>
+#include <spawn.h>
 
 #include "pseudo.h"
 #include "error.h"
 #include "progressbar.h"
+#include "hash.h"
 
 #define TRUE 1
 #define FALSE 0
 
+/*
+ * Pseudo directories with more than PSEUDO_HASH_MIN names are hashed, so
+ * that building a directory from millions of definitions isn't quadratic
+ */
+#define PSEUDO_HASH_MIN 16
+
+/*
+ * Pipe size requested for dynamic file commands, so that commands started
+ * ahead of the reader can run further before they block
+ */
+#define PSEUDO_PIPE_SIZE (1024 * 1024)
+
 extern int read_file(char *filename, char *type, int (parse_line)(char *));
 
 struct pseudo_dev **pseudo_file = NULL;
@@ -67,6 +81,75 @@ static char *get_component(char *target, char **targname)
 }
 
 
+static unsigned int pseudo_hash(char *name)
+{
+	return hash64(name, strlen(name), 0);
+}
+
+
+static void pseudo_hash_insert(struct pseudo *pseudo, int i)
+{
+	int mask = pseudo->hash_size - 1;
+	int h = pseudo_hash(pseudo->name[i].name) & mask;
+
+	while(pseudo->hash[h])
+		h = (h + 1) & mask;
+
+	pseudo->hash[h] = i + 1;
+}
+
+
+static void pseudo_hash_add(struct pseudo *pseudo, int i)
+{
+	if(pseudo->names < PSEUDO_HASH_MIN)
+		return;
+
+	if(pseudo->names * 2 > pseudo->hash_size) {
+		int j;
+
+		free(pseudo->hash);
+		pseudo->hash_size = pseudo->hash_size ? pseudo->hash_size * 2 :
+			PSEUDO_HASH_MIN * 4;
+		pseudo->hash = calloc(pseudo->hash_size, sizeof(int));
+		if(pseudo->hash == NULL)
+			MEM_ERROR();
+
+		for(j = 0; j < pseudo->names; j++)
+			pseudo_hash_insert(pseudo, j);
+	} else
+		pseudo_hash_insert(pseudo, i);
+}
+
+
+/*
+ * Return the index of name in pseudo directory pseudo, or -1 if it
+ * doesn't exist
+ */
+static int pseudo_lookup(struct pseudo *pseudo, char *name)
+{
+	int i;
+
+	if(pseudo->hash) {
+		int mask = pseudo->hash_size - 1;
+		int h = pseudo_hash(name) & mask;
+
+		for(; pseudo->hash[h]; h = (h + 1) & mask) {
+			i = pseudo->hash[h] - 1;
+			if(strcmp(pseudo->name[i].name, name) == 0)
+				return i;
+		}
+
+		return -1;
+	}
+
+	for(i = 0; i < pseudo->names; i++)
+		if(strcmp(pseudo->name[i].name, name) == 0)
+			return i;
+
+	return -1;
+}
+
+
 /*
  * Add pseudo device target to the set of pseudo devices.  Pseudo_dev
  * describes the pseudo device attributes.
@@ -86,21 +169,26 @@ struct pseudo *add_pseudo(struct pseudo *pseudo, struct pseudo_dev *pseudo_dev,
 
 		pseudo->names = 0;
 		pseudo->count = 0;
+		pseudo->size = 0;
+		pseudo->hash_size = 0;
+		pseudo->hash = NULL;
 		pseudo->name = NULL;
 	}
 
-	for(i = 0; i < pseudo->names; i++)
-		if(strcmp(pseudo->name[i].name, targname) == 0)
-			break;
+	i = pseudo_lookup(pseudo, targname);
 
-	if(i == pseudo->names) {
+	if(i == -1) {
 		/* allocate new name entry */
-		pseudo->names ++;
-		pseudo->name = realloc(pseudo->name, (i + 1) *
-			sizeof(struct pseudo_entry));
-		if(pseudo->name == NULL)
-			MEM_ERROR();
+		i = pseudo->names ++;
+		if(i == pseudo->size) {
+			pseudo->size = pseudo->size ? pseudo->size * 2 : 1;
+			pseudo->name = realloc(pseudo->name, pseudo->size *
+				sizeof(struct pseudo_entry));
+			if(pseudo->name == NULL)
+				MEM_ERROR();
+		}
 		pseudo->name[i].name = targname;
+		pseudo_hash_add(pseudo, i);
 
 		if(target[0] == '\0') {
 			/* at leaf pathname component */
@@ -191,11 +279,9 @@ struct pseudo *pseudo_subdir(char *filename, struct pseudo *pseudo)
 	if(pseudo == NULL)
 		return NULL;
 
-	for(i = 0; i < pseudo->names; i++)
-		if(strcmp(filename, pseudo->name[i].name) == 0)
-			return pseudo->name[i].pseudo;
+	i = pseudo_lookup(pseudo, filename);
 
-	return NULL;
+	return i == -1 ? NULL : pseudo->name[i].pseudo;
 }
 
 
@@ -215,40 +301,92 @@ struct pseudo_entry *pseudo_readdir(struct pseudo *pseudo)
 }
 
 
-int pseudo_exec_file(struct pseudo_dev *dev, int *child)
+/*
+ * Start the command for dynamic pseudo file dev, returning the read end of a
+ * pipe connected to its standard output, or 0 on failure.
+ *
+ * The command is started with posix_spawn() rather than fork(), because
+ * mksquashfs can be very large by the time the files are read, and
+ * duplicating its address space for every dynamic file is expensive.  The
+ * pipe is close-on-exec, so commands started concurrently by other reader
+ * threads don't inherit (and hold open) each other's pipes
+ */
+static int spawn_file(struct pseudo_dev *dev, int *child, int report)
 {
 	int res, pipefd[2];
+	pid_t pid;
+	posix_spawn_file_actions_t actions;
+	char *argv[] = { "sh", "-c", dev->command, NULL };
 
-	res = pipe(pipefd);
+	res = pipe2(pipefd, O_CLOEXEC);
 	if(res == -1) {
-		ERROR("Executing dynamic pseudo file, pipe failed\n");
+		if(report)
+			ERROR("Executing dynamic pseudo file, pipe failed\n");
 		return 0;
 	}
 
-	*child = fork();
-	if(*child == -1) {
-		ERROR("Executing dynamic pseudo file, fork failed\n");
-		goto failed;
+#ifdef F_SETPIPE_SZ
+	/* failure just means the default pipe size is used */
+	fcntl(pipefd[0], F_SETPIPE_SZ, PSEUDO_PIPE_SIZE);
+#endif
+
+	res = posix_spawn_file_actions_init(&actions);
+	if(res == 0) {
+		res = posix_spawn_file_actions_adddup2(&actions, pipefd[1],
+			STDOUT_FILENO);
+		if(res == 0)
+			res = posix_spawn(&pid, "/bin/sh", &actions, NULL, argv,
+				environ);
+		posix_spawn_file_actions_destroy(&actions);
 	}
 
-	if(*child == 0) {
-		close(pipefd[0]);
-		close(STDOUT_FILENO);
-		res = dup(pipefd[1]);
-		if(res == -1)
-			exit(EXIT_FAILURE);
+	close(pipefd[1]);
 
-		execl("/bin/sh", "sh", "-c", dev->command, (char *) NULL);
-		exit(EXIT_FAILURE);
+	if(res != 0) {
+		if(report)
+			ERROR("Executing dynamic pseudo file, spawn failed "
+				"because %s\n", strerror(res));
+		close(pipefd[0]);
+		return 0;
 	}
 
-	close(pipefd[1]);
+	*child = pid;
 	return pipefd[0];
+}
 
-failed:
-	close(pipefd[0]);
-	close(pipefd[1]);
-	return 0;
+
+/*
+ * Start the command for dynamic pseudo file dev ahead of it being read, so
+ * that it runs concurrently with the files before it.  Returns TRUE if it
+ * was started.  Failure is silent, the command is started again when it
+ * is read, and any error is reported then
+ */
+int pseudo_start_file(struct pseudo_dev *dev)
+{
+	if(dev->fd != -1)
+		return FALSE;
+
+	dev->fd = spawn_file(dev, &dev->child, FALSE);
+	if(dev->fd == 0) {
+		dev->fd = -1;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+
+int pseudo_exec_file(struct pseudo_dev *dev, int *child)
+{
+	int file = dev->fd;
+
+	if(file == -1)
+		return spawn_file(dev, child, TRUE);
+
+	/* already started by pseudo_start_file() */
+	*child = dev->child;
+	dev->fd = -1;
+	return file;
 }
 
 
@@ -280,6 +418,13 @@ int read_pseudo_def(char *def)
 	char *orig_def = def;
 	long long uid, gid;
 	struct pseudo_dev *dev;
+	/*
+	 * Definitions generated from a manifest usually use the same user
+	 * and group names throughout, so remember the last name looked up
+	 * rather than getting the password and group databases each time
+	 */
+	static char user[100] = "", group[100] = "";
+	static long long user_uid, group_gid;
 
 	/*
 	 * Scan for filename, don't use sscanf() and "%s" because
@@ -404,14 +549,17 @@ int read_pseudo_def(char *def)
 			ERROR("Uid %s out of range\n", suid);
 			goto error;
 		}
-	} else {
+	} else if(strcmp(suid, user) == 0)
+		uid = user_uid;
+	else {
 		struct passwd *pwuid = getpwnam(suid);
 		if(pwuid)
-			uid = pwuid->pw_uid;
+			uid = user_uid = pwuid->pw_uid;
 		else {
 			ERROR("Uid %s invalid uid or unknown user\n", suid);
 			goto error;
 		}
+		strcpy(user, suid);
 	}
 		
 	gid = strtoll(sgid, &ptr, 10);
@@ -420,14 +568,17 @@ int read_pseudo_def(char *def)
 			ERROR("Gid %s out of range\n", sgid);
 			goto error;
 		}
-	} else {
+	} else if(strcmp(sgid, group) == 0)
+		gid = group_gid;
+	else {
 		struct group *grgid = getgrnam(sgid);
 		if(grgid)
-			gid = grgid->gr_gid;
+			gid = group_gid = grgid->gr_gid;
 		else {
 			ERROR("Gid %s invalid uid or unknown user\n", sgid);
 			goto error;
 		}
+		strcpy(group, sgid);
 	}
 
 	switch(type) {
@@ -455,6 +606,8 @@ int read_pseudo_def(char *def)
 	dev->gid = gid;
 	dev->major = major;
 	dev->minor = minor;
+	dev->fd = -1;
+	dev->child = 0;
 	if(type == 'f') {
 		dev->command = strdup(def);
 		add_pseudo_file(dev);
@@ -32,6 +32,8 @@ struct pseudo_dev {
 	unsigned int	minor;
 	int		pseudo_id;
 	char		*command;
+	int		fd;
+	int		child;
 };
 
 struct pseudo_entry {
@@ -44,6 +46,9 @@ struct pseudo_entry {
 struct pseudo {
 	int			names;
 	int			count;
+	int			size;
+	int			hash_size;
+	int			*hash;
 	struct pseudo_entry	*name;
 };
 
@@ -53,6 +58,7 @@ extern struct pseudo *pseudo_subdir(char *, struct pseudo *);
 extern struct pseudo_entry *pseudo_readdir(struct pseudo *);
 extern struct pseudo_dev *get_pseudo_file(int);
 extern int pseudo_exec_file(struct pseudo_dev *, int *);
+extern int pseudo_start_file(struct pseudo_dev *);
 extern struct pseudo *get_pseudo();
 extern void dump_pseudos();
 #endif
@@ -0,0 +1,375 @@
+/*
+ * Create a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2013, 2014
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * queue.c
+ *
+ * Bounded multi-producer multi-consumer queues, shared by mksquashfs and
+ * unsquashfs.
+ *
+ * Each slot has a sequence number, which tells a producer the slot is
+ * free (sequence == writep), and a consumer the slot is full (sequence ==
+ * readp + 1).  Producers and consumers claim slots by atomically
+ * incrementing writep and readp respectively, and so in the common case
+ * neither takes a lock.  A slot which has been claimed but not yet
+ * filled in (or freed) is briefly waited for, so the queue is only seen
+ * as empty when writep == readp, and as full when writep == readp + size.
+ * Only if the queue is full (or empty) does a thread take the queue mutex
+ * and wait on the full (or empty) condition.
+ * Waiting threads are counted, and a thread which adds (or removes) an
+ * entry only takes the mutex to wake a waiting thread if there is one.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "error.h"
+#include "queue.h"
+
+extern int add_overflow(int, int);
+extern int multiply_overflow(int, int);
+
+#define TRUE 1
+#define FALSE 0
+
+__thread long long *queue_get_wait = NULL, *queue_put_wait = NULL;
+
+
+static long long queue_time()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+struct queue *queue_init(int size)
+{
+	struct queue *queue = malloc(sizeof(struct queue));
+	int i;
+
+	if(queue == NULL)
+		MEM_ERROR();
+
+	/* a queue needs at least one slot */
+	if(size < 1)
+		size = 1;
+
+	/*
+	 * Allocate one more slot than the size of the queue.  With only one
+	 * slot a full slot (sequence == pos + 1) can't be told apart from
+	 * a slot free for the next position (sequence == pos + slots)
+	 */
+	if(add_overflow(size, 1) || multiply_overflow(size + 1,
+						sizeof(struct queue_slot)))
+		BAD_ERROR("Size too large in queue_init\n");
+
+	queue->slot = malloc(sizeof(struct queue_slot) * (size + 1));
+	if(queue->slot == NULL)
+		MEM_ERROR();
+
+	for(i = 0; i < size + 1; i++)
+		queue->slot[i].sequence = i;
+
+	queue->size = size;
+	queue->slots = size + 1;
+	queue->readp = queue->writep = 0;
+	queue->get_waiting = queue->put_waiting = 0;
+	queue->depth = NULL;
+	pthread_mutex_init(&queue->mutex, NULL);
+	pthread_cond_init(&queue->empty, NULL);
+	pthread_cond_init(&queue->full, NULL);
+
+	return queue;
+}
+
+
+void queue_free(struct queue *queue)
+{
+	pthread_mutex_destroy(&queue->mutex);
+	pthread_cond_destroy(&queue->empty);
+	pthread_cond_destroy(&queue->full);
+	free(queue->slot);
+	free(queue->depth);
+	free(queue);
+}
+
+
+static int queue_try_put(struct queue *queue, void *data)
+{
+	long long pos = __atomic_load_n(&queue->writep, __ATOMIC_RELAXED);
+
+	while(1) {
+		struct queue_slot *slot = &queue->slot[pos % queue->slots];
+		long long diff = __atomic_load_n(&slot->sequence,
+			__ATOMIC_ACQUIRE) - pos;
+
+		if(diff == 0) {
+			/* the spare slot is free, but the queue is full */
+			if(pos - __atomic_load_n(&queue->readp,
+					__ATOMIC_ACQUIRE) >= queue->size)
+				return FALSE;
+
+			if(__atomic_compare_exchange_n(&queue->writep, &pos,
+					pos + 1, TRUE, __ATOMIC_RELAXED,
+					__ATOMIC_RELAXED)) {
+				slot->data = data;
+				__atomic_store_n(&slot->sequence, pos + 1,
+					__ATOMIC_RELEASE);
+				return TRUE;
+			}
+		} else if(diff < 0) {
+			/*
+			 * Either the queue is full, or a consumer has claimed
+			 * this slot and not yet freed it.  In the second case
+			 * wait for it, a producer must never see the queue as
+			 * full if it isn't, otherwise it could go to sleep
+			 * with nothing left to wake it
+			 */
+			if(pos - __atomic_load_n(&queue->readp,
+					__ATOMIC_ACQUIRE) >= queue->size)
+				return FALSE;
+			sched_yield();
+		} else
+			pos = __atomic_load_n(&queue->writep, __ATOMIC_RELAXED);
+	}
+}
+
+
+static int queue_try_get(struct queue *queue, void **data)
+{
+	long long pos = __atomic_load_n(&queue->readp, __ATOMIC_RELAXED);
+
+	while(1) {
+		struct queue_slot *slot = &queue->slot[pos % queue->slots];
+		long long diff = __atomic_load_n(&slot->sequence,
+			__ATOMIC_ACQUIRE) - (pos + 1);
+
+		if(diff == 0) {
+			if(__atomic_compare_exchange_n(&queue->readp, &pos,
+					pos + 1, TRUE, __ATOMIC_RELAXED,
+					__ATOMIC_RELAXED)) {
+				*data = slot->data;
+				__atomic_store_n(&slot->sequence, pos +
+					queue->slots, __ATOMIC_RELEASE);
+				return TRUE;
+			}
+		} else if(diff < 0) {
+			/*
+			 * Either the queue is empty, or a producer has claimed
+			 * this slot and not yet filled it in.  As above, in
+			 * the second case wait for it
+			 */
+			if(__atomic_load_n(&queue->writep, __ATOMIC_ACQUIRE)
+					== pos)
+				return FALSE;
+			sched_yield();
+		} else
+			pos = __atomic_load_n(&queue->readp, __ATOMIC_RELAXED);
+	}
+}
+
+
+/*
+ * Wake a thread waiting on cond, if there is one.  The fence orders the
+ * preceding slot update before the read of the waiting count, and
+ * pairs with the fence in queue_wait()
+ */
+static void queue_wake(struct queue *queue, int *waiting, pthread_cond_t *cond)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if(__atomic_load_n(waiting, __ATOMIC_RELAXED) == 0)
+		return;
+
+	pthread_cleanup_push((void *) pthread_mutex_unlock, &queue->mutex);
+	pthread_mutex_lock(&queue->mutex);
+	pthread_cond_signal(cond);
+	pthread_cleanup_pop(1);
+}
+
+
+static void queue_wait_put_cleanup(void *arg)
+{
+	struct queue *queue = arg;
+
+	__atomic_sub_fetch(&queue->put_waiting, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&queue->mutex);
+}
+
+
+static void queue_wait_get_cleanup(void *arg)
+{
+	struct queue *queue = arg;
+
+	__atomic_sub_fetch(&queue->get_waiting, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&queue->mutex);
+}
+
+
+void queue_put(struct queue *queue, void *data)
+{
+	if(queue_try_put(queue, data) == FALSE) {
+		long long start = queue_put_wait ? queue_time() : 0;
+
+		pthread_mutex_lock(&queue->mutex);
+		__atomic_add_fetch(&queue->put_waiting, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+		pthread_cleanup_push(queue_wait_put_cleanup, queue);
+		while(queue_try_put(queue, data) == FALSE)
+			pthread_cond_wait(&queue->full, &queue->mutex);
+		pthread_cleanup_pop(1);
+
+		if(queue_put_wait)
+			__atomic_add_fetch(queue_put_wait, queue_time() - start,
+				__ATOMIC_RELAXED);
+	}
+
+	if(queue->depth) {
+		long long depth = __atomic_load_n(&queue->writep,
+			__ATOMIC_RELAXED) - __atomic_load_n(&queue->readp,
+			__ATOMIC_RELAXED);
+
+		__atomic_add_fetch(&queue->depth[QUEUE_DEPTH_BUCKET(depth)], 1,
+			__ATOMIC_RELAXED);
+	}
+
+	queue_wake(queue, &queue->get_waiting, &queue->empty);
+}
+
+
+void *queue_get(struct queue *queue)
+{
+	void *data;
+
+	if(queue_try_get(queue, &data) == FALSE) {
+		long long start = queue_get_wait ? queue_time() : 0;
+
+		pthread_mutex_lock(&queue->mutex);
+		__atomic_add_fetch(&queue->get_waiting, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+		pthread_cleanup_push(queue_wait_get_cleanup, queue);
+		while(queue_try_get(queue, &data) == FALSE)
+			pthread_cond_wait(&queue->empty, &queue->mutex);
+		pthread_cleanup_pop(1);
+
+		if(queue_get_wait)
+			__atomic_add_fetch(queue_get_wait, queue_time() - start,
+				__ATOMIC_RELAXED);
+	}
+
+	queue_wake(queue, &queue->put_waiting, &queue->full);
+
+	return data;
+}
+
+
+/*
+ * As queue_get(), but if the queue is empty return NULL rather than
+ * waiting
+ */
+void *queue_get_nowait(struct queue *queue)
+{
+	void *data;
+
+	if(queue_try_get(queue, &data) == FALSE)
+		return NULL;
+
+	queue_wake(queue, &queue->put_waiting, &queue->full);
+
+	return data;
+}
+
+
+/*
+ * Get up to n entries from the queue into data, and return how many there
+ * were.  If wait is set the first entry is waited for, otherwise only the
+ * entries already queued are taken.  Only for queues which never hold NULL
+ */
+int queue_get_batch(struct queue *queue, void **data, int n, int wait)
+{
+	int i = 0;
+
+	if(wait && n)
+		data[i++] = queue_get(queue);
+
+	for(; i < n; i++) {
+		data[i] = queue_get_nowait(queue);
+		if(data[i] == NULL)
+			break;
+	}
+
+	return i;
+}
+
+
+/*
+ * Note, as with the previous mutex based implementation, the result is
+ * inherently racy with respect to concurrent queue_put() and queue_get()
+ * calls
+ */
+int queue_empty(struct queue *queue)
+{
+	long long pos = __atomic_load_n(&queue->readp, __ATOMIC_ACQUIRE);
+
+	return __atomic_load_n(&queue->slot[pos % queue->slots].sequence,
+		__ATOMIC_ACQUIRE) != pos + 1;
+}
+
+
+/*
+ * Discard the contents of the queue.  Only called once the threads using
+ * the queue have been cancelled
+ */
+void queue_flush(struct queue *queue)
+{
+	void *data;
+
+	while(queue_try_get(queue, &data))
+		;
+}
+
+
+/*
+ * Keep a histogram of the depth of the queue, sampled each time an entry
+ * is added.  Called before the queue is used
+ */
+void queue_count_depth(struct queue *queue)
+{
+	queue->depth = calloc(QUEUE_DEPTH_BUCKETS, sizeof(long long));
+	if(queue->depth == NULL)
+		MEM_ERROR();
+}
+
+
+void dump_queue(struct queue *queue)
+{
+	long long size = __atomic_load_n(&queue->writep, __ATOMIC_ACQUIRE) -
+		__atomic_load_n(&queue->readp, __ATOMIC_ACQUIRE);
+
+	printf("\tMax size %d, size %lld%s\n", queue->size, size,
+		size == 0 ? " (EMPTY)" : size == queue->size ? " (FULL)" : "");
+}
@@ -0,0 +1,91 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+/*
+ * Create a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2013, 2014
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * queue.h
+ */
+
+#include <pthread.h>
+
+#define QUEUE_CACHE_LINE 64
+
+/*
+ * Queue depth histograms have QUEUE_DEPTH_BUCKETS buckets, bucket b
+ * counting depths from 2^(b - 1) to 2^b - 1, and the last bucket
+ * counting all larger depths
+ */
+#define QUEUE_DEPTH_BUCKETS 16
+#define QUEUE_DEPTH_BUCKET(n) ((n) <= 0 ? 0 : \
+	64 - __builtin_clzll(n) < QUEUE_DEPTH_BUCKETS - 1 ? \
+	64 - __builtin_clzll(n) : QUEUE_DEPTH_BUCKETS - 1)
+
+/* struct describing a slot in a queue */
+struct queue_slot {
+	long long		sequence;
+	void			*data;
+};
+
+
+/*
+ * struct describing queues used to pass data between threads.  These are
+ * used by both mksquashfs and unsquashfs.
+ *
+ * readp and writep are only ever incremented, and are kept on separate
+ * cache lines so producers and consumers don't contend with each other.
+ * The mutex and condition variables are only used by threads which
+ * have to wait because the queue is empty or full
+ */
+struct queue {
+	int			size;
+	int			slots;
+	struct queue_slot	*slot;
+	long long		*depth;
+	char			pad1[QUEUE_CACHE_LINE];
+	long long		readp;
+	char			pad2[QUEUE_CACHE_LINE];
+	long long		writep;
+	char			pad3[QUEUE_CACHE_LINE];
+	int			get_waiting;
+	int			put_waiting;
+	pthread_mutex_t		mutex;
+	pthread_cond_t		empty;
+	pthread_cond_t		full;
+};
+
+
+extern struct queue *queue_init(int);
+extern void queue_free(struct queue *);
+extern void queue_put(struct queue *, void *);
+extern void *queue_get(struct queue *);
+extern void *queue_get_nowait(struct queue *);
+extern int queue_get_batch(struct queue *, void **, int, int);
+extern int queue_empty(struct queue *);
+extern void queue_flush(struct queue *);
+extern void dump_queue(struct queue *);
+extern void queue_count_depth(struct queue *);
+
+/*
+ * If set, the time in nanoseconds the calling thread spends waiting in
+ * queue_get() and queue_put() is added to these
+ */
+extern __thread long long *queue_get_wait, *queue_put_wait;
+#endif
@@ -34,6 +34,8 @@
 #include <sys/mman.h>
 #include <limits.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
 
 #ifndef linux
 #define __BYTE_ORDER BYTE_ORDER
@@ -52,6 +54,8 @@
 #include "error.h"
 #include "mksquashfs.h"
 
+extern int processors;
+
 int read_block(int fd, long long start, long long *next, int expected,
 								void *block)
 {
@@ -84,7 +88,7 @@ int read_block(int fd, long long start, long long *next, int expected,
 		if(res == 0)
 			return 0;
 
-		res = compressor_uncompress(comp, block, buffer, c_byte,
+		res = compressor_uncompress(comp, NULL, block, buffer, c_byte,
 			outlen, &error);
 		if(res == -1) {
 			ERROR("%s uncompress failed with error code %d\n",
@@ -111,6 +115,274 @@ int read_block(int fd, long long start, long long *next, int expected,
 		return res;
 }
 
+/*
+ * The tables of an existing filesystem are read with one read_fs_bytes()
+ * per table, and their metadata blocks decompressed in parallel by
+ * processors threads
+ */
+struct read_meta {
+	unsigned char	*src;
+	long long	start;
+	int		c_byte;
+	int		compressed;
+	int		expected;
+	int		length;
+};
+
+struct read_meta_list {
+	struct read_meta	*block;
+	unsigned char		*table;
+	int			count;
+	int			next;
+};
+
+
+/*
+ * Read the compressed bytes from start to end of an existing table
+ */
+static unsigned char *read_meta_bytes(int fd, long long start, long long end)
+{
+	unsigned char *buffer;
+
+	if(end <= start || end - start > INT_MAX)
+		return NULL;
+
+	buffer = malloc(end - start);
+	if(buffer == NULL)
+		MEM_ERROR();
+
+	if(read_fs_bytes(fd, start, end - start, buffer) == 0) {
+		free(buffer);
+		return NULL;
+	}
+
+	return buffer;
+}
+
+
+/*
+ * Fill in the metadata block at block->start, from the compressed bytes
+ * read from start to end (to buffer).  Returns FALSE if the block isn't
+ * wholly within them
+ */
+static int read_meta_header(struct read_meta *block, unsigned char *buffer,
+	long long start, long long end)
+{
+	unsigned short c_byte;
+
+	if(block->start < start || block->start + 2 > end)
+		return FALSE;
+
+	memcpy(&c_byte, buffer + (block->start - start), 2);
+	SQUASHFS_INSWAP_SHORTS(&c_byte, 1);
+	block->compressed = SQUASHFS_COMPRESSED(c_byte);
+	block->c_byte = SQUASHFS_COMPRESSED_SIZE(c_byte);
+	block->src = buffer + (block->start - start) + 2;
+
+	return block->start + 2 + block->c_byte <= end;
+}
+
+
+/*
+ * Decompress one block into table, as read_block() does
+ */
+static void read_meta_block(void *strm, struct read_meta *block,
+	unsigned char *dest)
+{
+	int outlen = block->expected ? block->expected : SQUASHFS_METADATA_SIZE;
+	int res, error;
+
+	block->length = 0;
+
+	if(block->c_byte > outlen)
+		return;
+
+	if(block->compressed) {
+		res = compressor_uncompress(comp, strm, dest, block->src,
+			block->c_byte, outlen, &error);
+		if(res == -1) {
+			ERROR("%s uncompress failed with error code %d\n",
+				comp->name, error);
+			return;
+		}
+	} else {
+		memcpy(dest, block->src, block->c_byte);
+		res = block->c_byte;
+	}
+
+	if(block->expected == 0 || block->expected == res)
+		block->length = res;
+}
+
+
+static void read_meta_blocks(void *strm, struct read_meta_list *list)
+{
+	while(1) {
+		int i = __atomic_fetch_add(&list->next, 1, __ATOMIC_RELAXED);
+
+		if(i >= list->count)
+			break;
+
+		read_meta_block(strm, &list->block[i], list->table +
+			(long long) i * SQUASHFS_METADATA_SIZE);
+	}
+}
+
+
+static void *read_meta_thrd(void *arg)
+{
+	sigset_t sigmask;
+	void *strm;
+
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask, SIGINT);
+	sigaddset(&sigmask, SIGTERM);
+	sigaddset(&sigmask, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &sigmask, NULL);
+
+	if(compressor_uncompress_init(comp, &strm))
+		BAD_ERROR("read_meta_thrd: compressor_uncompress_init "
+			"failed\n");
+
+	read_meta_blocks(strm, arg);
+
+	compressor_uncompress_free(comp, strm);
+	return NULL;
+}
+
+
+/*
+ * Decompress the count blocks, block i into table at i *
+ * SQUASHFS_METADATA_SIZE.  The calling thread decompresses blocks too, and
+ * up to processors - 1 threads are started to help it.  Returns the
+ * number of the first block which failed, or -1 if all are good
+ */
+static int read_meta_table(struct read_meta *block, int count,
+	unsigned char *table)
+{
+	struct read_meta_list list = { block, table, count, 0 };
+	int threads = (processors < count ? processors : count) - 1;
+	pthread_t thread[threads > 0 ? threads : 1];
+	void *strm;
+	int i, started;
+
+	for(started = 0; started < threads; started++)
+		if(pthread_create(&thread[started], NULL, read_meta_thrd,
+				&list) != 0)
+			break;
+
+	if(compressor_uncompress_init(comp, &strm))
+		BAD_ERROR("read_meta_table: compressor_uncompress_init "
+			"failed\n");
+
+	read_meta_blocks(strm, &list);
+	compressor_uncompress_free(comp, strm);
+
+	for(i = 0; i < started; i++)
+		pthread_join(thread[i], NULL);
+
+	for(i = 0; i < count; i++)
+		if(block[i].length == 0)
+			return i;
+
+	return -1;
+}
+
+
+/*
+ * Read the metadata blocks of an inode table or directory, which are stored
+ * one after another from start.  The blocks from start to end are found by
+ * walking their headers, stopping after max blocks.  *blocks is
+ * the list of blocks found, and the caller frees it and *buffer
+ */
+static int read_meta_chain(int fd, long long start, long long end, int max,
+	unsigned char **buffer, struct read_meta **blocks)
+{
+	struct read_meta *block = NULL;
+	long long next = start;
+	int count = 0;
+
+	*buffer = read_meta_bytes(fd, start, end);
+	if(*buffer == NULL)
+		return -1;
+
+	while(next < end && count < max) {
+		if(count % 64 == 0) {
+			block = realloc(block, (count + 64) *
+				sizeof(struct read_meta));
+			if(block == NULL)
+				MEM_ERROR();
+		}
+
+		block[count].start = next;
+		block[count].expected = SQUASHFS_METADATA_SIZE;
+		if(read_meta_header(&block[count], *buffer, start, end) ==
+				FALSE) {
+			free(block);
+			free(*buffer);
+			return -1;
+		}
+
+		next += 2 + block[count ++].c_byte;
+	}
+
+	*blocks = block;
+	return count;
+}
+
+
+/*
+ * Read one of the id, fragment, or inode lookup tables, which are stored
+ * as metadata blocks at the locations in index, followed by the index.
+ * Bytes is the uncompressed size of the table
+ */
+static int read_index_table(int fd, char *name, long long *index,
+	int indexes, int bytes, long long table_start, void *table)
+{
+	struct read_meta block[indexes];
+	unsigned char *buffer;
+	long long start = table_start;
+	int i, res;
+
+	memset(block, 0, sizeof(block));
+	for(i = 0; i < indexes; i++)
+		if(index[i] < start)
+			start = index[i];
+
+	buffer = read_meta_bytes(fd, start, table_start);
+	if(buffer == NULL) {
+		ERROR("Failed to read %s table\n", name);
+		ERROR("Filesystem corrupted?\n");
+		return FALSE;
+	}
+
+	for(i = 0; i < indexes; i++) {
+		block[i].start = index[i];
+		block[i].expected = (i + 1) != indexes ?
+			SQUASHFS_METADATA_SIZE :
+			bytes & (SQUASHFS_METADATA_SIZE - 1);
+		if(read_meta_header(&block[i], buffer, start, table_start) ==
+				FALSE)
+			break;
+	}
+
+	res = i == indexes ? read_meta_table(block, indexes, table) : i;
+	free(buffer);
+
+	for(i = 0; i < indexes; i++)
+		TRACE("Read %s table block %d, from 0x%llx, length %d\n",
+			name, i, index[i], block[i].length);
+
+	if(res != -1) {
+		ERROR("Failed to read %s table block %d, from 0x%llx, "
+			"length %d\n", name, res, index[res], block[res].length);
+		ERROR("Filesystem corrupted?\n");
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 
 #define NO_BYTES(SIZE) \
 	(bytes - (cur_ptr - *inode_table) < (SIZE))
@@ -126,43 +398,46 @@ int scan_inode_table(int fd, long long start, long long end,
 	int *dev_count, int *dir_count, int *fifo_count, int *sock_count,
 	unsigned int *id_table)
 {
-	unsigned char *cur_ptr;
-	int byte, files = 0;
-	unsigned int directory_start_block, bytes = 0, size = 0;
+	unsigned char *cur_ptr, *buffer;
+	struct read_meta *block;
+	int files = 0, count, res, i;
+	unsigned int directory_start_block, bytes = 0;
 	struct squashfs_base_inode_header base;
 
 	TRACE("scan_inode_table: start 0x%llx, end 0x%llx, root_inode_start "
 		"0x%llx\n", start, end, root_inode_start);
 
 	*root_inode_block = UINT_MAX;
-	while(start < end) {
-		if(start == root_inode_start) {
+	count = read_meta_chain(fd, start, end, INT_MAX, &buffer, &block);
+	if(count == -1)
+		goto corrupted;
+
+	/*
+	 * If this is not the last metadata block in the inode table
+	 * then it should be SQUASHFS_METADATA_SIZE in size, the last block
+	 * can be any size
+	 */
+	block[count - 1].expected = 0;
+	for(i = 0; i < count; i++) {
+		TRACE("scan_inode_table: reading block 0x%llx\n",
+			block[i].start);
+		if(block[i].start == root_inode_start) {
 			TRACE("scan_inode_table: read compressed block 0x%llx "
-				"containing root inode\n", start);
-			*root_inode_block = bytes;
+				"containing root inode\n", block[i].start);
+			*root_inode_block = i * SQUASHFS_METADATA_SIZE;
 		}
-		if(size - bytes < SQUASHFS_METADATA_SIZE) {
-			*inode_table = realloc(*inode_table, size
-				+= SQUASHFS_METADATA_SIZE);
-			if(*inode_table == NULL)
-				MEM_ERROR();
-		}
-		TRACE("scan_inode_table: reading block 0x%llx\n", start);
-		byte = read_block(fd, start, &start, 0, *inode_table + bytes);
-		if(byte == 0)
-			goto corrupted;
+	}
 
-		bytes += byte;
+	*inode_table = malloc(count * SQUASHFS_METADATA_SIZE);
+	if(*inode_table == NULL)
+		MEM_ERROR();
 
-		/* If this is not the last metadata block in the inode table
-		 * then it should be SQUASHFS_METADATA_SIZE in size.
-		 * Note, we can't use expected in read_block() above for this
-		 * because we don't know if this is the last block until
-		 * after reading.
-		 */
-		if(start != end && byte != SQUASHFS_METADATA_SIZE)
-			goto corrupted;
-	}
+	res = read_meta_table(block, count, *inode_table);
+	bytes = (count - 1) * SQUASHFS_METADATA_SIZE + block[count - 1].length;
+	free(block);
+	free(buffer);
+	if(res != -1)
+		goto corrupted;
 
 	/*
 	 * We expect to have found the metadata block containing the
@@ -630,33 +905,55 @@ unsigned char *squashfs_readdir(int fd, int root_entries,
 	char buffer[sizeof(struct squashfs_dir_entry) + SQUASHFS_NAME_LEN + 1]
 		__attribute__ ((aligned));
 	struct squashfs_dir_entry *dire = (struct squashfs_dir_entry *) buffer;
-	unsigned char *directory_table = NULL;
-	int byte, bytes = 0, dir_count;
+	unsigned char *directory_table = NULL, *compressed;
+	struct read_meta *block = NULL;
+	int bytes = 0, dir_count, count, blocks, res = 0;
 	long long start = sBlk->directory_table_start + directory_start_block,
-		last_start_block = start; 
+		last_start_block = start, end;
 
+	/*
+	 * The directory is in the blocks metadata blocks from start, which
+	 * can't extend beyond start + blocks compressed blocks, or the end
+	 * of the filesystem
+	 */
 	size += offset;
-	directory_table = malloc((size + SQUASHFS_METADATA_SIZE * 2 - 1) &
-		~(SQUASHFS_METADATA_SIZE - 1));
-	if(directory_table == NULL)
-		MEM_ERROR();
+	blocks = (size + SQUASHFS_METADATA_SIZE - 1) / SQUASHFS_METADATA_SIZE;
+	end = start + (long long) blocks * (SQUASHFS_METADATA_SIZE + 2);
+	if(end > sBlk->bytes_used)
+		end = sBlk->bytes_used;
+
+	count = read_meta_chain(fd, start, end, blocks, &compressed, &block);
+	if(count == blocks) {
+		/*
+		 * All but the last block should be SQUASHFS_METADATA_SIZE,
+		 * and the last as well if the directory fills it
+		 */
+		if(size != blocks * SQUASHFS_METADATA_SIZE)
+			block[count - 1].expected = 0;
 
-	while(bytes < size) {
-		int expected = (size - bytes) >= SQUASHFS_METADATA_SIZE ?
-			SQUASHFS_METADATA_SIZE : 0;
+		directory_table = malloc(blocks * SQUASHFS_METADATA_SIZE);
+		if(directory_table == NULL)
+			MEM_ERROR();
 
-		TRACE("squashfs_readdir: reading block 0x%llx, bytes read so "
-			"far %d\n", start, bytes);
+		TRACE("squashfs_readdir: reading %d blocks from 0x%llx\n",
+			blocks, start);
 
-		last_start_block = start;
-		byte = read_block(fd, start, &start, expected, directory_table + bytes);
-		if(byte == 0) {
-			ERROR("Failed to read directory\n");
-			ERROR("Filesystem corrupted?\n");
-			free(directory_table);
-			return NULL;
-		}
-		bytes += byte;
+		res = read_meta_table(block, count, directory_table);
+		bytes = (count - 1) * SQUASHFS_METADATA_SIZE +
+			block[count - 1].length;
+		last_start_block = block[count - 1].start;
+	}
+
+	if(count != -1) {
+		free(block);
+		free(compressed);
+	}
+
+	if(count != blocks || res != -1 || bytes < size) {
+		ERROR("Failed to read directory\n");
+		ERROR("Filesystem corrupted?\n");
+		free(directory_table);
+		return NULL;
 	}
 
 	if(!root_entries)
@@ -719,21 +1016,10 @@ unsigned int *read_id_table(int fd, struct squashfs_super_block *sBlk)
 
 	SQUASHFS_INSWAP_ID_BLOCKS(index, indexes);
 
-	for(i = 0; i < indexes; i++) {
-		int expected = (i + 1) != indexes ? SQUASHFS_METADATA_SIZE :
-					bytes & (SQUASHFS_METADATA_SIZE - 1);
-		int length = read_block(fd, index[i], NULL, expected,
-			((unsigned char *) id_table) +
-			(i * SQUASHFS_METADATA_SIZE));
-		TRACE("Read id table block %d, from 0x%llx, length %d\n", i,
-			index[i], length);
-		if(length == 0) {
-			ERROR("Failed to read id table block %d, from 0x%llx, "
-				"length %d\n", i, index[i], length);
-			ERROR("Filesystem corrupted?\n");
-			free(id_table);
-			return NULL;
-		}
+	if(read_index_table(fd, "id", index, indexes, bytes,
+			sBlk->id_table_start, id_table) == FALSE) {
+		free(id_table);
+		return NULL;
 	}
 
 	SQUASHFS_INSWAP_INTS(id_table, sBlk->no_ids);
@@ -778,22 +1064,11 @@ int read_fragment_table(int fd, struct squashfs_super_block *sBlk,
 
 	SQUASHFS_INSWAP_FRAGMENT_INDEXES(fragment_table_index, indexes);
 
-	for(i = 0; i < indexes; i++) {
-		int expected = (i + 1) != indexes ? SQUASHFS_METADATA_SIZE :
-					bytes & (SQUASHFS_METADATA_SIZE - 1);
-		int length = read_block(fd, fragment_table_index[i], NULL,
-			expected, ((unsigned char *) *fragment_table) +
-			(i * SQUASHFS_METADATA_SIZE));
-		TRACE("Read fragment table block %d, from 0x%llx, length %d\n",
-			i, fragment_table_index[i], length);
-		if(length == 0) {
-			ERROR("Failed to read fragment table block %d, from "
-				"0x%llx, length %d\n", i,
-				fragment_table_index[i], length);
-			ERROR("Filesystem corrupted?\n");
-			free(*fragment_table);
-			return 0;
-		}
+	if(read_index_table(fd, "fragment", fragment_table_index, indexes,
+			bytes, sBlk->fragment_table_start, *fragment_table) ==
+			FALSE) {
+		free(*fragment_table);
+		return 0;
 	}
 
 	for(i = 0; i < sBlk->fragments; i++)
@@ -809,7 +1084,7 @@ int read_inode_lookup_table(int fd, struct squashfs_super_block *sBlk,
 	int lookup_bytes = SQUASHFS_LOOKUP_BYTES(sBlk->inodes);
 	int indexes = SQUASHFS_LOOKUP_BLOCKS(sBlk->inodes);
 	long long index[indexes];
-	int res, i;
+	int res;
 
 	if(sBlk->lookup_table_start == SQUASHFS_INVALID_BLK)
 		return 1;
@@ -829,22 +1104,11 @@ int read_inode_lookup_table(int fd, struct squashfs_super_block *sBlk,
 
 	SQUASHFS_INSWAP_LONG_LONGS(index, indexes);
 
-	for(i = 0; i <  indexes; i++) {
-		int expected = (i + 1) != indexes ? SQUASHFS_METADATA_SIZE :
-				lookup_bytes & (SQUASHFS_METADATA_SIZE - 1);
-		int length = read_block(fd, index[i], NULL, expected,
-			((unsigned char *) *inode_lookup_table) +
-			(i * SQUASHFS_METADATA_SIZE));
-		TRACE("Read inode lookup table block %d, from 0x%llx, length "
-			"%d\n", i, index[i], length);
-		if(length == 0) {
-			ERROR("Failed to read inode lookup table block %d, "
-				"from 0x%llx, length %d\n", i, index[i],
-				length);
-			ERROR("Filesystem corrupted?\n");
-			free(*inode_lookup_table);
-			return 0;
-		}
+	if(read_index_table(fd, "inode lookup", index, indexes, lookup_bytes,
+			sBlk->lookup_table_start, *inode_lookup_table) ==
+			FALSE) {
+		free(*inode_lookup_table);
+		return 0;
 	}
 
 	SQUASHFS_INSWAP_LONG_LONGS(*inode_lookup_table, sBlk->inodes);
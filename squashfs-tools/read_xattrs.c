@@ -56,6 +56,7 @@ static struct hash_entry {
 } *hash_table[65536];
 
 static struct squashfs_xattr_id *xattr_ids;
+static unsigned int xattr_id_count;
 static void *xattrs = NULL;
 static long long xattr_table_start;
 
@@ -175,6 +176,7 @@ int read_xattrs_from_disk(int fd, struct squashfs_super_block *sBlk)
 	 * blocks
 	 */
 	ids = id_table.xattr_ids;
+	xattr_id_count = ids;
 	xattr_table_start = id_table.xattr_table_start;
 	index_bytes = SQUASHFS_XATTR_BLOCK_BYTES(ids);
 	indexes = SQUASHFS_XATTR_BLOCKS(ids);
@@ -316,12 +318,26 @@ struct xattr_list *get_xattr(int i, unsigned int *count, int ignore)
 	void *xptr;
 	int j = 0, res = 1;
 
+	int block;
+
 	TRACE("get_xattr\n");
 
+	if(i < 0 || i >= xattr_id_count) {
+		ERROR("get_xattr: xattr id %d out of range\n", i);
+		*count = 0;
+		return NULL;
+	}
+
 	*count = xattr_ids[i].count;
 	start = SQUASHFS_XATTR_BLK(xattr_ids[i].xattr) + xattr_table_start;
 	offset = SQUASHFS_XATTR_OFFSET(xattr_ids[i].xattr);
-	xptr = xattrs + get_xattr_block(start) + offset;
+	block = get_xattr_block(start);
+	if(block == -1) {
+		ERROR("get_xattr: xattr block %lld not found\n", start);
+		*count = 0;
+		return NULL;
+	}
+	xptr = xattrs + block + offset;
 
 	TRACE("get_xattr: xattr_id %d, count %d, start %lld, offset %d\n", i,
 			*count, start, offset);
@@ -364,7 +380,14 @@ struct xattr_list *get_xattr(int i, unsigned int *count, int ignore)
 			xptr += sizeof(xattr);	
 			start = SQUASHFS_XATTR_BLK(xattr) + xattr_table_start;
 			offset = SQUASHFS_XATTR_OFFSET(xattr);
-			ool_xptr = xattrs + get_xattr_block(start) + offset;
+			block = get_xattr_block(start);
+			if(block == -1) {
+				ERROR("get_xattr: xattr block %lld not "
+					"found\n", start);
+				free(xattr_list[j].full_name);
+				goto failed;
+			}
+			ool_xptr = xattrs + block + offset;
 			SQUASHFS_SWAP_XATTR_VAL(ool_xptr, &val);
 			xattr_list[j].value = ool_xptr + sizeof(val);
 		} else {
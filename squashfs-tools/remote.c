@@ -0,0 +1,478 @@
+/*
+ * Create a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2014
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * remote.c
+ *
+ * Compression of data blocks by worker machines.  Mksquashfs scans the
+ * sources, reads the files, does the duplicate and fragment processing,
+ * and lays out and writes the filesystem as usual, but as well as its own
+ * deflator threads it has a remote deflator thread for each connection to
+ * a worker (mksquashfs -worker-listen), which sends the blocks it takes
+ * off the deflator queue to the worker and gets them back compressed.
+ *
+ * A connection looks to the deflator like a compressor which can have
+ * several blocks in flight at once (see compressor_queue_depth()).  The
+ * worker forks a process for each connection, which compresses the
+ * blocks one by one with the compressor and options of the filesystem
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "squashfs_fs.h"
+#include "mksquashfs.h"
+#include "compressor.h"
+#include "queue.h"
+#include "remote.h"
+#include "error.h"
+
+#define FALSE 0
+#define TRUE 1
+
+static int send_bytes(int fd, void *buff, int bytes, int more)
+{
+	int res, count, flags = MSG_NOSIGNAL;
+
+#ifdef MSG_MORE
+	if(more)
+		flags |= MSG_MORE;
+#endif
+
+	for(count = 0; count < bytes; count += res) {
+		res = send(fd, buff + count, bytes - count, flags);
+		if(res == -1) {
+			if(errno != EINTR)
+				return -1;
+			res = 0;
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ * Split an address of the form host:port, [host]:port (for IPv6) or
+ * host.  If there's no host, and passive is set, the address is a port
+ * alone
+ */
+static void parse_address(char *address, char **host, char **port,
+	int passive)
+{
+	char *colon;
+
+	*host = strdup(address);
+	if(*host == NULL)
+		MEM_ERROR();
+
+	if(**host == '[') {
+		char *end = strchr(*host, ']');
+
+		if(end == NULL)
+			BAD_ERROR("Unterminated IPv6 address in %s\n", address);
+		*end = '\0';
+		memmove(*host, *host + 1, strlen(*host + 1) + 1);
+		colon = end[1] == ':' ? end + 1 : NULL;
+	} else {
+		colon = strrchr(*host, ':');
+		if(colon && strchr(*host, ':') != colon)
+			/* an IPv6 address without a port */
+			colon = NULL;
+	}
+
+	if(colon) {
+		*colon = '\0';
+		*port = colon + 1;
+	} else if(passive && strspn(*host, "0123456789") == strlen(*host)) {
+		*port = *host;
+		*host = NULL;
+	} else
+		*port = REMOTE_PORT;
+}
+
+
+struct remote *remote_connect(char *address, struct compressor *comp,
+	int block_size)
+{
+	struct addrinfo hints, *info, *ai;
+	struct remote_hello hello;
+	struct remote *remote;
+	char *host, *port;
+	void *options;
+	int fd = -1, res, size = 0, one = 1;
+
+	parse_address(address, &host, &port, FALSE);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	res = getaddrinfo(host, port, &hints, &info);
+	if(res)
+		BAD_ERROR("Failed to look up worker %s, because %s\n", address,
+			gai_strerror(res));
+
+	for(ai = info; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if(fd == -1)
+			continue;
+		if(connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(info);
+	if(fd == -1)
+		BAD_ERROR("Failed to connect to worker %s, because %s\n",
+			address, strerror(errno));
+
+	/* the block size headers are small, and must go out at once */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	options = compressor_dump_options(comp, block_size, &size);
+
+	hello.magic = htonl(REMOTE_MAGIC);
+	hello.version = htonl(REMOTE_VERSION);
+	hello.compression = htonl(comp->id);
+	hello.block_size = htonl(block_size);
+	hello.options = htonl(size);
+	hello.processors = 0;
+
+	if(send_bytes(fd, &hello, sizeof(hello), size) == -1 ||
+			(size && send_bytes(fd, options, size, FALSE) == -1))
+		BAD_ERROR("Failed to write to worker %s, because %s\n",
+			address, strerror(errno));
+
+	if(read_bytes(fd, &hello, sizeof(hello)) < (int) sizeof(hello) ||
+			ntohl(hello.magic) != REMOTE_MAGIC)
+		BAD_ERROR("Worker %s failed to answer\n", address);
+
+	if(ntohl(hello.version) != REMOTE_VERSION)
+		BAD_ERROR("Worker %s is a different version of mksquashfs\n",
+			address);
+
+	if(hello.processors == 0)
+		BAD_ERROR("Worker %s can't compress with %s and these "
+			"options\n", address, comp->name);
+
+	remote = malloc(sizeof(struct remote));
+	if(remote == NULL)
+		MEM_ERROR();
+
+	remote->fd = fd;
+	remote->processors = ntohl(hello.processors);
+	remote->first = remote->in_flight = 0;
+
+	free(host);
+	return remote;
+}
+
+
+static int remote_queue_depth(void *strm)
+{
+	return REMOTE_DEPTH;
+}
+
+
+static int remote_submit(void *strm, void *dest, void *src, int size,
+	int block_size, void *tag, int *error)
+{
+	struct remote *remote = strm;
+	struct remote_job *job = &remote->job[(remote->first +
+		remote->in_flight) % REMOTE_DEPTH];
+	unsigned int header = htonl(size);
+
+	if(send_bytes(remote->fd, &header, sizeof(header), TRUE) == -1 ||
+			send_bytes(remote->fd, src, size, FALSE) == -1) {
+		ERROR("Lost connection to worker, because %s\n",
+			strerror(errno));
+		*error = errno;
+		return -1;
+	}
+
+	job->dest = dest;
+	job->size = size;
+	job->tag = tag;
+	remote->in_flight ++;
+
+	return 0;
+}
+
+
+static int remote_collect(void *strm, void **tag, int wait, int *error)
+{
+	struct remote *remote = strm;
+	struct remote_job *job = &remote->job[remote->first];
+	struct remote_reply reply;
+	struct pollfd pfd = { .fd = remote->fd, .events = POLLIN };
+	int c_byte;
+
+	if(!wait && poll(&pfd, 1, 0) == 0)
+		return COMPRESSOR_PENDING;
+
+	if(read_bytes(remote->fd, &reply, sizeof(reply)) < (int) sizeof(reply))
+		goto failed;
+
+	c_byte = ntohl(reply.c_byte);
+	if(c_byte == -1) {
+		*error = ntohl(reply.error);
+		return -1;
+	}
+
+	if(c_byte < 0 || c_byte > job->size || (c_byte &&
+			read_bytes(remote->fd, job->dest, c_byte) < c_byte))
+		goto failed;
+
+	remote->first = (remote->first + 1) % REMOTE_DEPTH;
+	remote->in_flight --;
+	*tag = job->tag;
+	return c_byte;
+
+failed:
+	ERROR("Lost connection to worker\n");
+	*error = EIO;
+	return -1;
+}
+
+
+struct compressor remote_compressor = {
+	.name = "remote",
+	.supported = 1,
+	.queue_depth = remote_queue_depth,
+	.submit = remote_submit,
+	.collect = remote_collect,
+};
+
+
+/* a block read by the worker, waiting to be compressed */
+struct remote_block {
+	int			size;
+	char			data[0];
+};
+
+struct worker {
+	int			fd;
+	int			block_size;
+	struct queue		*queue;
+};
+
+
+/*
+ * Read the blocks off the connection as they arrive, so the sender never
+ * waits on the worker while the worker waits to send a block back
+ */
+static void *worker_reader(void *arg)
+{
+	struct worker *worker = arg;
+
+	while(1) {
+		struct remote_block *block;
+		unsigned int size;
+
+		if(read_bytes(worker->fd, &size, sizeof(size)) <
+							(int) sizeof(size))
+			break;
+
+		size = ntohl(size);
+		if(size > worker->block_size)
+			break;
+
+		block = malloc(sizeof(struct remote_block) + size);
+		if(block == NULL)
+			break;
+
+		block->size = size;
+		if(read_bytes(worker->fd, block->data, size) < (int) size) {
+			free(block);
+			break;
+		}
+
+		queue_put(worker->queue, block);
+	}
+
+	queue_put(worker->queue, NULL);
+	return NULL;
+}
+
+
+static void worker_serve(int fd, int processors)
+{
+	struct remote_hello hello;
+	struct compressor *comp;
+	struct remote_block *block;
+	struct worker worker;
+	pthread_t thread;
+	void *options = NULL, *stream = NULL, *dest;
+	int size, res = 0, one = 1;
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	if(read_bytes(fd, &hello, sizeof(hello)) < (int) sizeof(hello) ||
+			ntohl(hello.magic) != REMOTE_MAGIC)
+		return;
+
+	worker.fd = fd;
+	worker.block_size = ntohl(hello.block_size);
+	size = ntohl(hello.options);
+	comp = lookup_compressor_id(ntohl(hello.compression));
+
+	if(ntohl(hello.version) != REMOTE_VERSION ||
+			worker.block_size < 4096 ||
+			worker.block_size > SQUASHFS_FILE_MAX_SIZE ||
+			size < 0 || size > SQUASHFS_METADATA_SIZE ||
+			!comp->supported)
+		res = -1;
+
+	if(res == 0 && size) {
+		options = malloc(size);
+		if(options == NULL || read_bytes(fd, options, size) < size)
+			return;
+	}
+
+	/*
+	 * Each connection has its own process, so the compressor options
+	 * (which the compressors keep in globals) are this connection's
+	 */
+	if(res == 0)
+		res = compressor_extract_options(comp, worker.block_size,
+			options, size);
+	if(res == 0)
+		res = compressor_init(comp, &stream, worker.block_size, 1);
+
+	hello.magic = htonl(REMOTE_MAGIC);
+	hello.version = htonl(REMOTE_VERSION);
+	hello.processors = res ? 0 : htonl(processors);
+	if(send_bytes(fd, &hello, sizeof(hello), FALSE) == -1 || res)
+		return;
+
+	dest = malloc(worker.block_size);
+	worker.queue = queue_init(REMOTE_DEPTH + 1);
+	if(dest == NULL || pthread_create(&thread, NULL, worker_reader,
+			&worker) != 0)
+		return;
+
+	while((block = queue_get(worker.queue))) {
+		struct remote_reply reply;
+		int error = 0, c_byte = compressor_compress(comp, stream, dest,
+			block->data, block->size, worker.block_size, &error);
+
+		/* send blocks which didn't compress as 0, they're stored */
+		if(c_byte >= block->size)
+			c_byte = 0;
+
+		reply.c_byte = htonl(c_byte);
+		reply.error = htonl(error);
+		free(block);
+
+		if(send_bytes(fd, &reply, sizeof(reply), c_byte > 0) == -1 ||
+				(c_byte > 0 && send_bytes(fd, dest, c_byte,
+				FALSE) == -1))
+			break;
+	}
+}
+
+
+/*
+ * Run as a worker (mksquashfs -worker-listen), listening on address for
+ * connections from mksquashfs.  Processors is the number of connections
+ * it asks each mksquashfs to make.  Never returns
+ */
+void remote_worker(char *address, int processors)
+{
+	struct addrinfo hints, *info, *ai;
+	char *host, *port;
+	int fd = -1, res, one = 1;
+
+	parse_address(address, &host, &port, TRUE);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	res = getaddrinfo(host, port, &hints, &info);
+	if(res)
+		BAD_ERROR("Failed to look up %s, because %s\n", address,
+			gai_strerror(res));
+
+	for(ai = info; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if(fd == -1)
+			continue;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if(bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+				listen(fd, 64) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(info);
+	if(fd == -1)
+		BAD_ERROR("Failed to listen on %s, because %s\n", address,
+			strerror(errno));
+
+	/* the connection processes are never waited for */
+	signal(SIGCHLD, SIG_IGN);
+
+	printf("Mksquashfs worker: listening on %s, asking for %d "
+		"connection%s\n", address, processors, processors == 1 ? "" :
+		"s");
+	fflush(stdout);
+
+	while(1) {
+		int conn = accept(fd, NULL, NULL);
+
+		if(conn == -1) {
+			if(errno != EINTR && errno != ECONNABORTED)
+				BAD_ERROR("Failed to accept connection, "
+					"because %s\n", strerror(errno));
+			continue;
+		}
+
+		res = fork();
+		if(res == 0) {
+			close(fd);
+			worker_serve(conn, processors);
+			_exit(0);
+		}
+
+		if(res == -1)
+			ERROR("Failed to fork for connection, because %s\n",
+				strerror(errno));
+		close(conn);
+	}
+}
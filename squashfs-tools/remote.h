@@ -0,0 +1,80 @@
+#ifndef REMOTE_H
+#define REMOTE_H
+/*
+ * Create a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2014
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * remote.h
+ */
+
+#define REMOTE_PORT "7345"
+#define REMOTE_MAGIC 0x57525153	/* "SQRW" */
+#define REMOTE_VERSION 1
+
+/*
+ * Blocks in flight on each connection.  Enough to keep the worker busy
+ * while the compressed blocks come back, and the next blocks go out
+ */
+#define REMOTE_DEPTH 4
+
+/*
+ * The connection handshake, followed by the compression options, and
+ * answered by the worker with a remote_hello with its processors.  All
+ * fields are big endian
+ */
+struct remote_hello {
+	unsigned int		magic;
+	unsigned int		version;
+	unsigned int		compression;
+	unsigned int		block_size;
+	unsigned int		options;
+	unsigned int		processors;
+};
+
+/*
+ * Each block is sent as its size followed by the data.  The reply is the
+ * compressed size (0 if the block didn't compress) and error (as
+ * returned by compressor_compress()) followed by the compressed data.
+ * Blocks are compressed, and answered, in the order they're sent
+ */
+struct remote_reply {
+	int			c_byte;
+	int			error;
+};
+
+struct remote_job {
+	void			*dest;
+	int			size;
+	void			*tag;
+};
+
+/* struct describing a connection from mksquashfs to a worker */
+struct remote {
+	int			fd;
+	int			processors;
+	int			first;
+	int			in_flight;
+	struct remote_job	job[REMOTE_DEPTH];
+};
+
+extern struct compressor remote_compressor;
+extern struct remote *remote_connect(char *, struct compressor *, int);
+extern void remote_worker(char *, int);
+#endif
@@ -42,16 +42,19 @@
 #include "error.h"
 #include "progressbar.h"
 #include "info.h"
+#include "numa.h"
 
 #define FALSE 0
 #define TRUE 1
 
-extern pthread_t reader_thread, writer_thread, main_thread;
+extern pthread_t reader_thread, writer_thread, main_thread, dup_collect_thread;
 extern pthread_t *deflator_thread, *frag_deflator_thread, *frag_thread;
-extern struct queue *to_deflate, *to_writer, *to_frag, *to_process_frag;
-extern struct seq_queue *to_main;
+extern pthread_t *reader_pool_thread, *dup_thread;
+extern struct queue **to_deflate, *to_writer, *to_frag, **to_process_frag;
+extern struct queue *to_dup;
+extern struct seq_queue *to_main, *from_dup;
 extern void restorefs();
-extern int processors;
+extern int processors, readers, dup_max_blocks;
 
 static int interrupted = 0;
 static pthread_t restore_thread;
@@ -86,11 +89,18 @@ void *restore_thrd(void *arg)
 		pthread_cancel(reader_thread);
 		pthread_join(reader_thread, NULL);
 
+		/* and the reader pool thread(s) if any */
+		for(i = 0; readers > 1 && i < readers; i++)
+			pthread_cancel(reader_pool_thread[i]);
+		for(i = 0; readers > 1 && i < readers; i++)
+			pthread_join(reader_pool_thread[i], NULL);
+
 		/*
 		 * then flush the reader to deflator thread(s) output queue.
 		 * The deflator thread(s) will idle
 		 */
-		queue_flush(to_deflate);
+		for(i = 0; i < numa_nodes; i++)
+			queue_flush(to_deflate[i]);
 
 		/* now kill the deflator thread(s) */
 		for(i = 0; i < processors; i++)
@@ -102,7 +112,8 @@ void *restore_thrd(void *arg)
 		 * then flush the reader to process fragment thread(s) output
 		 * queue.  The process fragment thread(s) will idle
 		 */
-		queue_flush(to_process_frag);
+		for(i = 0; i < numa_nodes; i++)
+			queue_flush(to_process_frag[i]);
 
 		/* now kill the process fragment thread(s) */
 		for(i = 0; i < processors; i++)
@@ -112,10 +123,35 @@ void *restore_thrd(void *arg)
 
 		/*
 		 * then flush the reader/deflator/process fragment to main
-		 * thread output queue.  The main thread will idle
+		 * thread output queue.  The main thread (or the duplicate
+		 * collector thread if any) will idle
 		 */
 		seq_queue_flush(to_main);
 
+		if(dup_max_blocks) {
+			/* now kill the duplicate collector thread */
+			pthread_cancel(dup_collect_thread);
+			pthread_join(dup_collect_thread, NULL);
+
+			/*
+			 * then flush the collector to duplicate thread(s)
+			 * queue.  The duplicate thread(s) will idle
+			 */
+			queue_flush(to_dup);
+
+			/* now kill the duplicate thread(s) */
+			for(i = 0; i < processors; i++)
+				pthread_cancel(dup_thread[i]);
+			for(i = 0; i < processors; i++)
+				pthread_join(dup_thread[i], NULL);
+
+			/*
+			 * then flush the duplicate thread(s) to main thread
+			 * queue.  The main thread will idle
+			 */
+			seq_queue_flush(from_dup);
+		}
+
 		/* now kill the main thread */
 		pthread_cancel(main_thread);
 		pthread_join(main_thread, NULL);
@@ -50,6 +50,7 @@ struct sort_info {
 	dev_t			st_dev;
 	ino_t			st_ino;
 	int			priority;
+	int			order;
 	struct sort_info	*next;
 };
 
@@ -57,6 +58,13 @@ struct sort_info *sort_info_list[65536];
 
 struct priority_entry *priority_list[65536];
 
+/*
+ * Files in a -sort-trace access trace, indexed by the order they were first
+ * accessed.  These are written before all the other files
+ */
+struct priority_entry **trace_list = NULL;
+int trace_count = 0;
+
 extern int silent;
 extern void write_file(squashfs_inode *inode, struct dir_ent *dir_ent,
 	int *c_size);
@@ -78,13 +86,28 @@ void add_priority_list(struct dir_ent *dir, int priority)
 }
 
 
-int get_priority(char *filename, struct stat *buf, int priority)
+void add_trace_list(struct dir_ent *dir, int order)
+{
+	struct priority_entry *new_priority_entry;
+
+	new_priority_entry = malloc(sizeof(struct priority_entry));
+	if(new_priority_entry == NULL)
+		MEM_ERROR();
+
+	new_priority_entry->dir = dir;
+	new_priority_entry->next = trace_list[order];
+	trace_list[order] = new_priority_entry;
+}
+
+
+int get_priority(char *filename, struct inode_stat *buf, int priority)
 {
 	int hash = buf->st_ino & 0xffff;
 	struct sort_info *s;
 
 	for(s = sort_info_list[hash]; s; s = s->next)
-		if((s->st_dev == buf->st_dev) && (s->st_ino == buf->st_ino)) {
+		if(s->order == -1 && (s->st_dev == buf->st_dev) &&
+					(s->st_ino == buf->st_ino)) {
 			TRACE("returning priority %d (%s)\n", s->priority,
 				filename);
 			return s->priority;
@@ -94,14 +117,29 @@ int get_priority(char *filename, struct stat *buf, int priority)
 }
 
 
-#define ADD_ENTRY(buf, priority) {\
+int get_trace_order(dev_t st_dev, ino_t st_ino)
+{
+	int hash = st_ino & 0xffff;
+	struct sort_info *s;
+
+	for(s = sort_info_list[hash]; s; s = s->next)
+		if(s->order != -1 && (s->st_dev == st_dev) &&
+					(s->st_ino == st_ino))
+			return s->order;
+
+	return -1;
+}
+
+
+#define ADD_ENTRY(buf, sort_priority, sort_order) {\
 	int hash = buf.st_ino & 0xffff;\
 	struct sort_info *s;\
 	if((s = malloc(sizeof(struct sort_info))) == NULL) \
 		MEM_ERROR(); \
 	s->st_dev = buf.st_dev;\
 	s->st_ino = buf.st_ino;\
-	s->priority = priority;\
+	s->priority = sort_priority;\
+	s->order = sort_order;\
 	s->next = sort_info_list[hash];\
 	sort_info_list[hash] = s;\
 	}
@@ -123,7 +161,7 @@ re_read:
 		TRACE("adding filename %s, priority %d, st_dev %d, st_ino "
 			"%lld\n", path, priority, (int) buf.st_dev,
 			(long long) buf.st_ino);
-		ADD_ENTRY(buf, priority);
+		ADD_ENTRY(buf, priority, -1);
 		return TRUE;
 	}
 
@@ -139,7 +177,7 @@ re_read:
 				goto error;
 			continue;
 		}
-		ADD_ENTRY(buf, priority);
+		ADD_ENTRY(buf, priority, -1);
 		n ++;
 	}
 
@@ -188,23 +226,30 @@ error:
 
 
 void generate_file_priorities(struct dir_info *dir, int priority,
-	struct stat *buf)
+	struct inode_stat *buf)
 {
 	struct dir_ent *dir_ent = dir->list;
 
 	priority = get_priority(dir->pathname, buf, priority);
 
 	for(; dir_ent; dir_ent = dir_ent->next) {
-		struct stat *buf = &dir_ent->inode->buf;
+		struct inode_stat *buf = &dir_ent->inode->buf;
 		if(dir_ent->inode->root_entry)
 			continue;
 
 		switch(buf->st_mode & S_IFMT) {
-			case S_IFREG:
-				add_priority_list(dir_ent,
-					get_priority(pathname(dir_ent), buf,
-					priority));
+			case S_IFREG: {
+				int order = get_trace_order(buf->st_dev,
+					buf->st_ino);
+
+				if(order != -1)
+					add_trace_list(dir_ent, order);
+				else
+					add_priority_list(dir_ent,
+						get_priority(pathname(dir_ent),
+						buf, priority));
 				break;
+			}
 			case S_IFDIR:
 				generate_file_priorities(dir_ent->dir,
 					priority, buf);
@@ -335,29 +380,219 @@ failed:
 }
 
 
+/*
+ * Get the pathname of the file accessed from a line of an access trace.
+ * This is either an ftrace line from the android_fs tracepoints
+ * ("... entry_name <path>, offset ..."), or a line holding just the
+ * pathname, as written by tools which map block traces or open calls back
+ * to files.  Returns NULL for lines with no pathname
+ */
+char *trace_pathname(char *line)
+{
+	char *name = strstr(line, "entry_name ");
+	int len;
+
+	if(name) {
+		name += 11;
+		len = strcspn(name, ",");
+	} else {
+		/* Skip any leading whitespace */
+		while(isspace(*line))
+			line ++;
+
+		/* if comment line, skip */
+		if(*line == '#')
+			return NULL;
+
+		name = line;
+		len = strlen(name);
+	}
+
+	/* Remove any trailing whitespace */
+	while(len && isspace(name[len - 1]))
+		len --;
+
+	if(len == 0)
+		return NULL;
+
+	name[len] = '\0';
+	return name;
+}
+
+
+/*
+ * Strip root, the directory the filesystem is mounted on when the trace
+ * was taken, from an absolute trace pathname.  Returns NULL if the file
+ * isn't within the filesystem.  Relative trace pathnames are taken to be
+ * relative to the root of the filesystem already
+ */
+char *trace_strip_root(char *name, char *root)
+{
+	int len;
+
+	if(*name != '/')
+		return name;
+
+	while(*name == '/')
+		name ++;
+
+	if(root == NULL)
+		return name;
+
+	while(*root == '/')
+		root ++;
+
+	len = strlen(root);
+	while(len && root[len - 1] == '/')
+		len --;
+
+	if(len == 0)
+		return name;
+
+	if(strncmp(name, root, len) != 0 || (name[len] != '/' &&
+						name[len] != '\0'))
+		return NULL;
+
+	for(name += len; *name == '/'; name ++);
+
+	return name;
+}
+
+
+int read_trace_file(char *filename, char *root, int source,
+	char *source_path[])
+{
+	FILE *fd;
+	char line_buffer[MAX_LINE + 1]; /* overflow safe */
+	char *name;
+	int i, n, entries = 0, old_count = trace_count;
+	struct stat buf, found;
+
+	if((fd = fopen(filename, "r")) == NULL) {
+		ERROR("Failed to open trace file \"%s\" because %s\n",
+			filename, strerror(errno));
+		return FALSE;
+	}
+
+	while(fgets(line_buffer, MAX_LINE + 1, fd) != NULL) {
+		int len = strlen(line_buffer);
+
+		if(len == MAX_LINE && line_buffer[len - 1] != '\n') {
+			/* line too large */
+			ERROR("Line too long when reading "
+				"trace file \"%s\", larger than %d "
+				"bytes\n", filename, MAX_LINE);
+			goto failed;
+		}
+
+		name = trace_pathname(line_buffer);
+		if(name == NULL)
+			continue;
+
+		entries ++;
+
+		/*
+		 * Traces include files on other filesystems, and files which
+		 * aren't in the source directories, these are ignored
+		 */
+		name = trace_strip_root(name, root);
+		if(name == NULL || *name == '\0')
+			continue;
+
+		for(i = 0, n = 0; i < source; i++) {
+			char *path;
+			int res = asprintf(&path, "%s/%s", source_path[i],
+				name);
+			if(res == -1)
+				BAD_ERROR("asprintf failed in "
+					"read_trace_file\n");
+			res = lstat(path, &buf);
+			free(path);
+			if(res == 0 && S_ISREG(buf.st_mode)) {
+				found = buf;
+				n ++;
+			}
+		}
+
+		/*
+		 * Only the first access to a file orders it, later
+		 * accesses (and ambiguous entries) are ignored
+		 */
+		if(n != 1 || get_trace_order(found.st_dev, found.st_ino) != -1)
+			continue;
+
+		TRACE("read_trace_file: file %s, order %d\n", name,
+			trace_count);
+		ADD_ENTRY(found, 0, trace_count);
+		trace_count ++;
+	}
+
+	if(ferror(fd)) {
+		ERROR("Reading trace file \"%s\" failed because %s\n",
+			filename, strerror(errno));
+		goto failed;
+	}
+
+	fclose(fd);
+
+	if(trace_count == old_count) {
+		ERROR("WARNING: none of the %d files in trace file \"%s\" were "
+			"found in the source directories\n", entries,
+			filename);
+		if(root == NULL)
+			ERROR("Use -sort-trace-root to give the directory the "
+				"filesystem was mounted on\n");
+	}
+
+	trace_list = realloc(trace_list, trace_count *
+		sizeof(struct priority_entry *));
+	if(trace_list == NULL && trace_count)
+		MEM_ERROR();
+	memset(trace_list + old_count, 0, (trace_count - old_count) *
+		sizeof(struct priority_entry *));
+
+	return TRUE;
+
+failed:
+	fclose(fd);
+	return FALSE;
+}
+
+
+void write_sorted_file(struct dir_ent *dir_ent)
+{
+	squashfs_inode inode;
+	int duplicate_file;
+
+	if(dir_ent->inode->inode == SQUASHFS_INVALID_BLK) {
+		write_file(&inode, dir_ent, &duplicate_file);
+		INFO("file %s, uncompressed size %lld bytes %s\n",
+			pathname(dir_ent),
+			(long long) dir_ent->inode->buf.st_size,
+			duplicate_file ? "DUPLICATE" : "");
+		dir_ent->inode->inode = inode;
+		dir_ent->inode->type = SQUASHFS_FILE_TYPE;
+	} else
+		INFO("file %s, uncompressed size %lld bytes LINK\n",
+			pathname(dir_ent),
+			(long long) dir_ent->inode->buf.st_size);
+}
+
+
 void sort_files_and_write(struct dir_info *dir)
 {
 	int i;
 	struct priority_entry *entry;
-	squashfs_inode inode;
-	int duplicate_file;
+
+	for(i = 0; i < trace_count; i++)
+		for(entry = trace_list[i]; entry; entry = entry->next) {
+			TRACE("trace %d: %s\n", i, pathname(entry->dir));
+			write_sorted_file(entry->dir);
+		}
 
 	for(i = 65535; i >= 0; i--)
 		for(entry = priority_list[i]; entry; entry = entry->next) {
 			TRACE("%d: %s\n", i - 32768, pathname(entry->dir));
-			if(entry->dir->inode->inode == SQUASHFS_INVALID_BLK) {
-				write_file(&inode, entry->dir, &duplicate_file);
-				INFO("file %s, uncompressed size %lld bytes %s"
-					"\n", pathname(entry->dir),
-					(long long)
-					entry->dir->inode->buf.st_size,
-					duplicate_file ? "DUPLICATE" : "");
-				entry->dir->inode->inode = inode;
-				entry->dir->inode->type = SQUASHFS_FILE_TYPE;
-			} else
-				INFO("file %s, uncompressed size %lld bytes "
-					"LINK\n", pathname(entry->dir),
-					(long long)
-					entry->dir->inode->buf.st_size);
+			write_sorted_file(entry->dir);
 		}
 }
@@ -0,0 +1,355 @@
+/*
+ * Create a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2014
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * spill.c
+ *
+ * Bounded memory directory scanning (-spill).  Once a directory and all
+ * its subdirectories have been scanned, its entries are written to a
+ * spill file and freed, leaving only a stub dir_info.  The reader thread
+ * and dir_scan7 load each directory back from the spill file when they
+ * reach it, and free it once done, so only the directories on the path
+ * being worked on are in memory, rather than the whole tree.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <dirent.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "squashfs_fs.h"
+#include "mksquashfs.h"
+#include "arena.h"
+#include "xattr.h"
+#include "spill.h"
+#include "error.h"
+
+#define FALSE 0
+#define TRUE 1
+
+int spill_fd = -1;
+
+/* bytes written to the spill file */
+static long long spill_bytes = 0;
+
+/* the record being built by spill_dir() */
+static char *spill_buffer = NULL;
+static size_t spill_buffer_size = 0;
+
+extern struct slab dir_ent_slab, dir_info_slab;
+extern void dir_scan6(struct dir_info *);
+
+
+void spill_init(char *directory)
+{
+	char *filename;
+
+	if(asprintf(&filename, "%s/mksquashfs-spill-XXXXXX", directory) == -1)
+		MEM_ERROR();
+
+	spill_fd = mkstemp(filename);
+	if(spill_fd == -1)
+		BAD_ERROR("Failed to create spill file in %s, because %s\n",
+			directory, strerror(errno));
+
+	/* the spill file is only needed while Mksquashfs runs */
+	unlink(filename);
+	free(filename);
+}
+
+
+static void spill_write(char *buffer, size_t size, long long off)
+{
+	while(size) {
+		ssize_t res = pwrite(spill_fd, buffer, size, off);
+
+		if(res == -1 && errno == EINTR)
+			continue;
+		if(res == -1)
+			BAD_ERROR("Failed to write to spill file, because %s\n",
+				strerror(errno));
+
+		buffer += res;
+		size -= res;
+		off += res;
+	}
+}
+
+
+static void spill_read(void *buffer, size_t size, long long off)
+{
+	char *buf = buffer;
+
+	while(size) {
+		ssize_t res = pread(spill_fd, buf, size, off);
+
+		if(res == -1 && errno == EINTR)
+			continue;
+		if(res == -1)
+			BAD_ERROR("Failed to read spill file, because %s\n",
+				strerror(errno));
+		if(res == 0)
+			BAD_ERROR("Unexpected end of spill file\n");
+
+		buf += res;
+		size -= res;
+		off += res;
+	}
+}
+
+
+/*
+ * Append size bytes to the record at *used, padding the record to 8 bytes
+ * if pad is set.  If data is NULL the space is only reserved
+ */
+static void spill_add(size_t *used, void *data, size_t size, int pad)
+{
+	size_t bytes = pad ? SPILL_ALIGN(*used + size) - *used : size;
+
+	if(*used + bytes > spill_buffer_size) {
+		size_t new_size = spill_buffer_size ? spill_buffer_size : 8192;
+
+		while(*used + bytes > new_size)
+			new_size <<= 1;
+
+		spill_buffer = realloc(spill_buffer, new_size);
+		if(spill_buffer == NULL)
+			MEM_ERROR();
+		spill_buffer_size = new_size;
+	}
+
+	if(data)
+		memcpy(spill_buffer + *used, data, size);
+	if(bytes > size)
+		memset(spill_buffer + *used + size, 0, bytes - size);
+
+	*used += bytes;
+}
+
+
+static unsigned int spill_string(char *string)
+{
+	return string ? strlen(string) + 1 : 0;
+}
+
+
+/*
+ * Write the scanned directory dir to the spill file, and free its entries.
+ * Its subdirectories have already been spilled, it is left as a stub
+ * which records where it is in the spill file.  The spilled entries
+ * are numbered first, as dir_scan6() would have done
+ */
+void spill_dir(struct dir_info *dir)
+{
+	struct spill_dir header;
+	struct dir_ent *dir_ent, *next;
+	size_t used = 0;
+
+	dir_scan6(dir);
+
+	memset(&header, 0, sizeof(header));
+	header.count = dir->count;
+	header.directory_count = dir->directory_count;
+	header.depth = dir->depth;
+	header.dir_is_ldir = dir->dir_is_ldir;
+	header.pathname = spill_string(dir->pathname);
+	header.subpath = spill_string(dir->subpath);
+
+	spill_add(&used, NULL, sizeof(header), TRUE);
+	spill_add(&used, dir->pathname, header.pathname, FALSE);
+	spill_add(&used, dir->subpath, header.subpath, TRUE);
+
+	for(dir_ent = dir->list; dir_ent; dir_ent = next) {
+		struct inode_info *inode = dir_ent->inode;
+		struct spill_entry entry;
+		size_t start = used;
+
+		next = dir_ent->next;
+
+		memset(&entry, 0, sizeof(entry));
+		entry.inode = SPILL_KEEP(&inode->buf) ? inode : NULL;
+		entry.dir = -1;
+		entry.name = spill_string(dir_ent->name);
+		entry.source_name = spill_string(dir_ent->source_name);
+		entry.nonstandard_pathname =
+			spill_string(dir_ent->nonstandard_pathname);
+
+		if(S_ISLNK(inode->buf.st_mode))
+			entry.symlink = strlen(inode->symlink) + 1;
+
+		if(S_ISDIR(inode->buf.st_mode)) {
+			entry.dir = dir_ent->dir->spill;
+			entry.directory_count = dir_ent->dir->directory_count;
+			slab_free(&dir_info_slab, dir_ent->dir);
+			header.subdirs ++;
+		}
+
+		spill_add(&used, NULL, sizeof(entry), TRUE);
+
+		if(entry.inode == NULL) {
+			/*
+			 * xattrs read by the scan are read again (from the
+			 * pathname) when the inode is written
+			 */
+			if(inode->xattrs != -1)
+				free_prefetched_xattrs(inode->xattrs,
+					inode->xattr_list);
+			inode->xattrs = -1;
+			inode->xattr_list = NULL;
+
+			spill_add(&used, inode, sizeof(struct inode_info) +
+				entry.symlink, TRUE);
+			free(inode);
+		}
+
+		spill_add(&used, dir_ent->name, entry.name, FALSE);
+		spill_add(&used, dir_ent->source_name, entry.source_name,
+			FALSE);
+		spill_add(&used, dir_ent->nonstandard_pathname,
+			entry.nonstandard_pathname, TRUE);
+
+		entry.size = used - start;
+		memcpy(spill_buffer + start, &entry, sizeof(entry));
+		header.entries ++;
+
+		free(dir_ent->name);
+		free(dir_ent->source_name);
+		free(dir_ent->nonstandard_pathname);
+		slab_free(&dir_ent_slab, dir_ent);
+	}
+
+	header.size = used;
+	memcpy(spill_buffer, &header, sizeof(header));
+	spill_write(spill_buffer, used, spill_bytes);
+
+	free(dir->pathname);
+	free(dir->subpath);
+	dir->pathname = dir->subpath = NULL;
+	dir->list = NULL;
+	dir->spill = spill_bytes;
+	spill_bytes += used;
+}
+
+
+/*
+ * Load a copy of the spilled directory stub from the spill file.  The
+ * dir_info, its entries, the stubs of its subdirectories and the spilled
+ * record are a single allocation, freed by the last spill_put().  This
+ * only uses pread() and malloc(), and can be called by any thread
+ */
+struct dir_info *spill_load(struct dir_info *stub)
+{
+	struct spill_dir header;
+	struct dir_info *dir, *sub_dir;
+	struct dir_ent *dir_ent, **prev;
+	char *data, *p;
+	size_t bytes;
+	unsigned int i;
+
+	spill_read(&header, sizeof(header), stub->spill);
+
+	bytes = SPILL_ALIGN(sizeof(struct dir_info) + header.entries *
+		sizeof(struct dir_ent) + header.subdirs *
+		sizeof(struct dir_info));
+	dir = malloc(bytes + header.size);
+	if(dir == NULL)
+		MEM_ERROR();
+
+	data = (char *) dir + bytes;
+	spill_read(data, header.size, stub->spill);
+
+	p = data + SPILL_ALIGN(sizeof(header));
+	dir->pathname = p;
+	dir->subpath = p + header.pathname;
+	p = data + SPILL_ALIGN(SPILL_ALIGN(sizeof(header)) + header.pathname +
+		header.subpath);
+
+	dir->count = header.count;
+	dir->directory_count = header.directory_count;
+	dir->depth = header.depth;
+	dir->excluded = 0;
+	dir->dir_is_ldir = header.dir_is_ldir;
+	dir->ready = TRUE;
+	dir->dir_ent = stub->dir_ent;
+	dir->linuxdir = NULL;
+	dir->spill = -1;
+	dir->refs = 1;
+
+	dir_ent = (struct dir_ent *) (dir + 1);
+	sub_dir = (struct dir_info *) (dir_ent + header.entries);
+	prev = &dir->list;
+
+	for(i = 0; i < header.entries; i++, dir_ent++) {
+		struct spill_entry *entry = (struct spill_entry *) p;
+		char *q = p + sizeof(struct spill_entry);
+
+		if(entry->inode)
+			dir_ent->inode = entry->inode;
+		else {
+			dir_ent->inode = (struct inode_info *) q;
+			q += SPILL_ALIGN(sizeof(struct inode_info) +
+				entry->symlink);
+		}
+
+		dir_ent->name = entry->name ? q : NULL;
+		q += entry->name;
+		dir_ent->source_name = entry->source_name ? q : NULL;
+		q += entry->source_name;
+		dir_ent->nonstandard_pathname = entry->nonstandard_pathname ?
+			q : NULL;
+
+		dir_ent->our_dir = dir;
+		dir_ent->dir = NULL;
+
+		if(entry->dir != -1) {
+			memset(sub_dir, 0, sizeof(struct dir_info));
+			sub_dir->directory_count = entry->directory_count;
+			sub_dir->ready = TRUE;
+			sub_dir->dir_ent = dir_ent;
+			sub_dir->spill = entry->dir;
+			dir_ent->dir = sub_dir ++;
+		}
+
+		*prev = dir_ent;
+		prev = &dir_ent->next;
+		p += entry->size;
+	}
+
+	*prev = NULL;
+
+	return dir;
+}
+
+
+void spill_get(struct dir_info *dir)
+{
+	__atomic_add_fetch(&dir->refs, 1, __ATOMIC_RELAXED);
+}
+
+
+void spill_put(struct dir_info *dir)
+{
+	if(__atomic_sub_fetch(&dir->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		free(dir);
+}
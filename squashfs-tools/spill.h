@@ -0,0 +1,83 @@
+#ifndef SPILL_H
+#define SPILL_H
+
+/*
+ * Squashfs
+ *
+ * Copyright (c) 2014
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * spill.h
+ */
+
+/*
+ * Inodes which may be hard linked from elsewhere in the tree can't be
+ * spilled, they stay in memory (and in the inode hash) and the spilled
+ * entries refer to them by address
+ */
+#define SPILL_KEEP(buf) (((buf)->st_mode & S_IFMT) != S_IFDIR && \
+	(buf)->st_nlink > 1)
+
+/* a directory whose contents have been written to the spill file */
+#define SPILLED(dir) ((dir)->spill != -1)
+
+/* a copy of a spilled directory loaded by spill_load() */
+#define SPILL_LOADED(dir) ((dir)->refs != 0)
+
+#define SPILL_ALIGN(size) (((size) + 7) & ~((size_t) 7))
+
+/*
+ * A spilled directory record is a struct spill_dir, followed by the
+ * directory's pathname and subpath, followed by a struct spill_entry
+ * for each directory entry.  Everything is 8 byte aligned
+ */
+struct spill_dir {
+	unsigned int		size;
+	unsigned int		count;
+	unsigned int		directory_count;
+	unsigned int		entries;
+	unsigned int		subdirs;
+	unsigned int		pathname;
+	unsigned int		subpath;
+	int			depth;
+	char			dir_is_ldir;
+};
+
+/*
+ * Followed by the inode if it isn't kept in memory (a struct inode_info
+ * and the symlink), and then the name, source_name and nonstandard_pathname
+ * strings.  The string lengths include the terminating 0, with 0 for a
+ * NULL string
+ */
+struct spill_entry {
+	struct inode_info	*inode;
+	long long		dir;
+	unsigned int		size;
+	unsigned int		directory_count;
+	unsigned int		symlink;
+	unsigned int		name;
+	unsigned int		source_name;
+	unsigned int		nonstandard_pathname;
+};
+
+extern int spill_fd;
+extern void spill_init(char *);
+extern void spill_dir(struct dir_info *);
+extern struct dir_info *spill_load(struct dir_info *);
+extern void spill_get(struct dir_info *);
+extern void spill_put(struct dir_info *);
+#endif
@@ -29,15 +29,97 @@
 
 #if __BYTE_ORDER == __BIG_ENDIAN
 #include <stddef.h>
-extern void swap_le16(void *, void *);
-extern void swap_le32(void *, void *);
-extern void swap_le64(void *, void *);
+#include <string.h>
+
+/*
+ * The single values are swapped inline, as the structure macros below swap
+ * each field in turn.  Compilers turn the byte reversal builtins into one
+ * instruction, or a byte-reversed load or store (lwbrx and stwbrx on
+ * PowerPC), and the memcpy()s into plain, possibly unaligned, loads and
+ * stores
+ */
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 8))
+static inline unsigned short inswap_le16(unsigned short num)
+{
+	return __builtin_bswap16(num);
+}
+
+
+static inline unsigned int inswap_le32(unsigned int num)
+{
+	return __builtin_bswap32(num);
+}
+
+
+static inline long long inswap_le64(long long num)
+{
+	return __builtin_bswap64(num);
+}
+#else
+static inline unsigned short inswap_le16(unsigned short num)
+{
+	return (num >> 8) |
+		((num & 0xff) << 8);
+}
+
+
+static inline unsigned int inswap_le32(unsigned int num)
+{
+	return (num >> 24) |
+		((num & 0xff0000) >> 8) |
+		((num & 0xff00) << 8) |
+		((num & 0xff) << 24);
+}
+
+
+static inline long long inswap_le64(long long n)
+{
+	unsigned long long num = n;
+
+	return (num >> 56) |
+		((num & 0xff000000000000LL) >> 40) |
+		((num & 0xff0000000000LL) >> 24) |
+		((num & 0xff00000000LL) >> 8) |
+		((num & 0xff000000) << 8) |
+		((num & 0xff0000) << 24) |
+		((num & 0xff00) << 40) |
+		((num & 0xff) << 56);
+}
+#endif
+
+
+static inline void swap_le16(void *src, void *dest)
+{
+	unsigned short num;
+
+	memcpy(&num, src, sizeof(num));
+	num = inswap_le16(num);
+	memcpy(dest, &num, sizeof(num));
+}
+
+
+static inline void swap_le32(void *src, void *dest)
+{
+	unsigned int num;
+
+	memcpy(&num, src, sizeof(num));
+	num = inswap_le32(num);
+	memcpy(dest, &num, sizeof(num));
+}
+
+
+static inline void swap_le64(void *src, void *dest)
+{
+	long long num;
+
+	memcpy(&num, src, sizeof(num));
+	num = inswap_le64(num);
+	memcpy(dest, &num, sizeof(num));
+}
+
 extern void swap_le16_num(void *, void *, int);
 extern void swap_le32_num(void *, void *, int);
 extern void swap_le64_num(void *, void *, int);
-extern unsigned short inswap_le16(unsigned short);
-extern unsigned int inswap_le32(unsigned int);
-extern long long inswap_le64(long long);
 extern void inswap_le16_num(unsigned short *, int);
 extern void inswap_le32_num(unsigned int *, int);
 extern void inswap_le64_num(long long *, int);
@@ -0,0 +1,266 @@
+/*
+ * Create a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2014
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * stats.c
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "caches-queues-lists.h"
+#include "stats.h"
+#include "error.h"
+
+#define FALSE 0
+#define TRUE 1
+
+#define STATS_QUEUES 64
+
+char *stats_file = NULL;
+__thread struct thread_stats *thread_stats = NULL;
+
+static struct thread_stats *thread_list = NULL, **thread_tail = &thread_list;
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static long long start_time;
+
+static struct stats_queue {
+	char			*name;
+	int			node;
+	struct queue		*queue;
+	struct seq_queue	*seq_queue;
+} queues[STATS_QUEUES];
+static int queue_count = 0;
+
+static char *stage_name[STATS_STAGES] = {
+	"reader", "deflator", "fragment", "frag_deflator", "duplicate",
+	"main", "writer"
+};
+
+
+long long stats_time()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+void stats_init()
+{
+	start_time = stats_time();
+}
+
+
+void stats_thread(int stage)
+{
+	/*
+	 * Start counting for the calling thread, which belongs to stage.
+	 * Called at the start of the thread
+	 */
+	struct thread_stats *stats;
+
+	if(stats_file == NULL)
+		return;
+
+	stats = calloc(1, sizeof(struct thread_stats));
+	if(stats == NULL)
+		MEM_ERROR();
+
+	stats->stage = stage;
+	stats->start = stats_time();
+
+	pthread_cleanup_push((void *) pthread_mutex_unlock, &stats_mutex);
+	pthread_mutex_lock(&stats_mutex);
+	*thread_tail = stats;
+	thread_tail = &stats->next;
+	pthread_cleanup_pop(1);
+
+	thread_stats = stats;
+	queue_get_wait = &stats->get_wait;
+	queue_put_wait = &stats->put_wait;
+}
+
+
+static struct stats_queue *add_queue(char *name, int node)
+{
+	if(queue_count == STATS_QUEUES)
+		BAD_ERROR("Too many queues in stats_queue\n");
+
+	queues[queue_count].name = name;
+	queues[queue_count].node = node;
+	queues[queue_count].queue = NULL;
+	queues[queue_count].seq_queue = NULL;
+
+	return &queues[queue_count ++];
+}
+
+
+void stats_queue(char *name, int node, struct queue *queue)
+{
+	/*
+	 * Count the depth of queue, which is reported as name.  Node is
+	 * the queue's NUMA node, or -1 if it isn't per node.  Called before
+	 * the queue is used
+	 */
+	if(stats_file == NULL)
+		return;
+
+	queue_count_depth(queue);
+	add_queue(name, node)->queue = queue;
+}
+
+
+void stats_seq_queue(char *name, struct seq_queue *queue)
+{
+	if(stats_file == NULL)
+		return;
+
+	seq_queue_count_depth(queue);
+	add_queue(name, -1)->seq_queue = queue;
+}
+
+
+static double seconds(long long nanoseconds)
+{
+	return nanoseconds / 1000000000.0;
+}
+
+
+static void write_stage(FILE *file, int stage, long long now)
+{
+	struct thread_stats *stats;
+	long long busy = 0, get_wait = 0, put_wait = 0, cache_wait = 0;
+	long long blocks = 0, bytes_in = 0, bytes_out = 0;
+	int threads = 0;
+
+	fprintf(file, "\t\t\"%s\": {\n\t\t\t\"thread_busy\": [",
+		stage_name[stage]);
+
+	/*
+	 * A thread is busy unless waiting in a queue or cache.  The other
+	 * threads are still running, and so the counts are only a snapshot
+	 */
+	for(stats = thread_list; stats; stats = stats->next) {
+		long long waiting, lifetime;
+
+		if(stats->stage != stage)
+			continue;
+
+		waiting = __atomic_load_n(&stats->get_wait, __ATOMIC_RELAXED) +
+			__atomic_load_n(&stats->put_wait, __ATOMIC_RELAXED) +
+			__atomic_load_n(&stats->cache_wait, __ATOMIC_RELAXED);
+		lifetime = now - stats->start;
+
+		fprintf(file, "%s%.6f", threads ? ", " : "",
+			seconds(lifetime > waiting ? lifetime - waiting : 0));
+
+		busy += lifetime > waiting ? lifetime - waiting : 0;
+		get_wait += __atomic_load_n(&stats->get_wait, __ATOMIC_RELAXED);
+		put_wait += __atomic_load_n(&stats->put_wait, __ATOMIC_RELAXED);
+		cache_wait += __atomic_load_n(&stats->cache_wait,
+			__ATOMIC_RELAXED);
+		blocks += __atomic_load_n(&stats->blocks, __ATOMIC_RELAXED);
+		bytes_in += __atomic_load_n(&stats->bytes_in, __ATOMIC_RELAXED);
+		bytes_out += __atomic_load_n(&stats->bytes_out,
+			__ATOMIC_RELAXED);
+		threads ++;
+	}
+
+	fprintf(file, "],\n\t\t\t\"threads\": %d,\n", threads);
+	fprintf(file, "\t\t\t\"busy\": %.6f,\n", seconds(busy));
+	fprintf(file, "\t\t\t\"get_wait\": %.6f,\n", seconds(get_wait));
+	fprintf(file, "\t\t\t\"put_wait\": %.6f,\n", seconds(put_wait));
+	fprintf(file, "\t\t\t\"cache_wait\": %.6f,\n", seconds(cache_wait));
+	fprintf(file, "\t\t\t\"blocks\": %lld,\n", blocks);
+	fprintf(file, "\t\t\t\"bytes_in\": %lld,\n", bytes_in);
+	fprintf(file, "\t\t\t\"bytes_out\": %lld\n", bytes_out);
+	fprintf(file, "\t\t}%s\n", stage + 1 < STATS_STAGES ? "," : "");
+}
+
+
+static void write_queue(FILE *file, struct stats_queue *entry, int last)
+{
+	long long *depth = entry->queue ? entry->queue->depth :
+		entry->seq_queue->depth;
+	int i;
+
+	fprintf(file, "\t\t{\n\t\t\t\"name\": \"%s\",\n", entry->name);
+	if(entry->node != -1)
+		fprintf(file, "\t\t\t\"node\": %d,\n", entry->node);
+	if(entry->queue)
+		fprintf(file, "\t\t\t\"size\": %d,\n", entry->queue->size);
+	fprintf(file, "\t\t\t\"depth\": [");
+	for(i = 0; i < QUEUE_DEPTH_BUCKETS; i++)
+		fprintf(file, "%s%lld", i ? ", " : "",
+			__atomic_load_n(&depth[i], __ATOMIC_RELAXED));
+	fprintf(file, "]\n\t\t}%s\n", last ? "" : ",");
+}
+
+
+void write_stats()
+{
+	/*
+	 * Write the statistics as a JSON object.  The depth histograms have
+	 * QUEUE_DEPTH_BUCKETS buckets, bucket b counting depths of 2^(b - 1)
+	 * to 2^b - 1 (see queue.h)
+	 */
+	long long now = stats_time();
+	FILE *file;
+	int i;
+
+	if(stats_file == NULL)
+		return;
+
+	if(strcmp(stats_file, "-") == 0)
+		file = stdout;
+	else {
+		file = fopen(stats_file, "w");
+		if(file == NULL) {
+			ERROR("Failed to open stats file %s because %s\n",
+				stats_file, strerror(errno));
+			return;
+		}
+	}
+
+	pthread_cleanup_push((void *) pthread_mutex_unlock, &stats_mutex);
+	pthread_mutex_lock(&stats_mutex);
+
+	fprintf(file, "{\n\t\"elapsed\": %.6f,\n", seconds(now - start_time));
+	fprintf(file, "\t\"stages\": {\n");
+	for(i = 0; i < STATS_STAGES; i++)
+		write_stage(file, i, now);
+	fprintf(file, "\t},\n\t\"queues\": [\n");
+	for(i = 0; i < queue_count; i++)
+		write_queue(file, &queues[i], i + 1 == queue_count);
+	fprintf(file, "\t]\n}\n");
+
+	pthread_cleanup_pop(1);
+
+	if(file != stdout && fclose(file) == EOF)
+		ERROR("Failed to write stats file %s because %s\n", stats_file,
+			strerror(errno));
+}
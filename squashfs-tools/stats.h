@@ -0,0 +1,76 @@
+#ifndef STATS_H
+#define STATS_H
+/*
+ * Create a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2014
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * stats.h
+ */
+
+/*
+ * Pipeline statistics (-stats).  Each thread counts the blocks and bytes
+ * it processes, and the time it spends waiting in the queues and caches,
+ * and at the end of the run the totals for each pipeline stage, and the
+ * queue depth histograms, are written out as JSON
+ */
+enum {
+	STATS_READER,
+	STATS_DEFLATOR,
+	STATS_FRAGMENT,
+	STATS_FRAG_DEFLATOR,
+	STATS_DUPLICATE,
+	STATS_MAIN,
+	STATS_WRITER,
+	STATS_STAGES
+};
+
+struct thread_stats {
+	int			stage;
+	long long		start;
+	long long		get_wait;
+	long long		put_wait;
+	long long		cache_wait;
+	long long		blocks;
+	long long		bytes_in;
+	long long		bytes_out;
+	struct thread_stats	*next;
+};
+
+extern __thread struct thread_stats *thread_stats;
+
+/* Count a block processed by the calling thread, if it is being counted */
+#define STATS_BLOCK(in, out) do { \
+	if(thread_stats) { \
+		__atomic_add_fetch(&thread_stats->blocks, 1, __ATOMIC_RELAXED); \
+		__atomic_add_fetch(&thread_stats->bytes_in, in, \
+			__ATOMIC_RELAXED); \
+		__atomic_add_fetch(&thread_stats->bytes_out, out, \
+			__ATOMIC_RELAXED); \
+	} \
+} while(0)
+
+extern char *stats_file;
+extern long long stats_time();
+extern void stats_init();
+extern void stats_thread(int);
+extern void stats_queue(char *, int, struct queue *);
+extern void stats_seq_queue(char *, struct seq_queue *);
+extern void write_stats();
+#endif
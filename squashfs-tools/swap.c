@@ -28,86 +28,30 @@
 #endif
 
 #if __BYTE_ORDER == __BIG_ENDIAN
-void swap_le16(void *src, void *dest)
-{
-	unsigned char *s = src;
-	unsigned char *d = dest;
+#include "squashfs_swap.h"
 
-	d[0] = s[1];
-	d[1] = s[0];
-}
-
-
-void swap_le32(void *src, void *dest)
-{
-	unsigned char *s = src;
-	unsigned char *d = dest;
-
-	d[0] = s[3];
-	d[1] = s[2];
-	d[2] = s[1];
-	d[3] = s[0];
-}
-
-
-void swap_le64(void *src, void *dest)
-{
-	unsigned char *s = src;
-	unsigned char *d = dest;
-
-	d[0] = s[7];
-	d[1] = s[6];
-	d[2] = s[5];
-	d[3] = s[4];
-	d[4] = s[3];
-	d[5] = s[2];
-	d[6] = s[1];
-	d[7] = s[0];
-}
-
-
-unsigned short inswap_le16(unsigned short num)
-{
-	return (num >> 8) |
-		((num & 0xff) << 8);
-}
-
-
-unsigned int inswap_le32(unsigned int num)
-{
-	return (num >> 24) |
-		((num & 0xff0000) >> 8) |
-		((num & 0xff00) << 8) |
-		((num & 0xff) << 24);
-}
-
-
-long long inswap_le64(long long n)
-{
-	unsigned long long num = n;
-
-	return (num >> 56) |
-		((num & 0xff000000000000LL) >> 40) |
-		((num & 0xff0000000000LL) >> 24) |
-		((num & 0xff00000000LL) >> 8) |
-		((num & 0xff000000) << 8) |
-		((num & 0xff0000) << 24) |
-		((num & 0xff00) << 40) |
-		((num & 0xff) << 56);
-}
-
-
-#define SWAP_LE_NUM(BITS) \
+/*
+ * Swap arrays (block lists, and the fragment, id, lookup and xattr id
+ * tables) a whole element at a time.  When both arrays are aligned, which
+ * they are other than in metadata, this is a simple loop over the
+ * elements, which compilers can vectorise
+ */
+#define SWAP_LE_NUM(BITS, TYPE) \
 void swap_le##BITS##_num(void *s, void *d, int n) \
 {\
 	int i;\
-	for(i = 0; i < n; i++, s += BITS / 8, d += BITS / 8)\
-		swap_le##BITS(s, d);\
+	if((((unsigned long) s | (unsigned long) d) & (BITS / 8 - 1)) == 0) {\
+		TYPE *src = s, *dest = d;\
+		for(i = 0; i < n; i++)\
+			dest[i] = inswap_le##BITS(src[i]);\
+	} else\
+		for(i = 0; i < n; i++, s += BITS / 8, d += BITS / 8)\
+			swap_le##BITS(s, d);\
 }
 
-SWAP_LE_NUM(16)
-SWAP_LE_NUM(32)
-SWAP_LE_NUM(64)
+SWAP_LE_NUM(16, unsigned short)
+SWAP_LE_NUM(32, unsigned int)
+SWAP_LE_NUM(64, long long)
 
 #define INSWAP_LE_NUM(BITS, TYPE) \
 void inswap_le##BITS##_num(TYPE *s, int n) \
@@ -25,20 +25,23 @@
 #include "unsquashfs.h"
 #include "squashfs_compat.h"
 
-void read_block_list_1(unsigned int *block_list, char *block_ptr, int blocks)
+void read_block_list_1(unsigned int *block_list, long long start, int offset,
+	int blocks)
 {
 	unsigned short block_size;
 	int i;
 
 	TRACE("read_block_list: blocks %d\n", blocks);
 
-	for(i = 0; i < blocks; i++, block_ptr += 2) {
+	for(i = 0; i < blocks; i++) {
+		if(read_metadata(inode_cache, &start, &offset, &block_size,
+				sizeof(unsigned short)) != sizeof(unsigned short))
+			EXIT_UNSQUASH("read_block_list: failed to read block "
+				"list\n");
 		if(swap) {
-			unsigned short sblock_size;
-			memcpy(&sblock_size, block_ptr, sizeof(unsigned short));
+			unsigned short sblock_size = block_size;
 			SQUASHFS_SWAP_SHORTS_3((&block_size), &sblock_size, 1);
-		} else
-			memcpy(&block_size, block_ptr, sizeof(unsigned short));
+		}
 		block_list[i] = SQUASHFS_COMPRESSED_SIZE(block_size) |
 			(SQUASHFS_COMPRESSED(block_size) ? 0 :
 			SQUASHFS_COMPRESSED_BIT_BLOCK);
@@ -58,13 +61,13 @@ struct inode *read_inode_1(unsigned int start_block, unsigned int offset)
 {
 	static union squashfs_inode_header_1 header;
 	long long start = sBlk.s.inode_table_start + start_block;
-	int bytes = lookup_entry(inode_table_hash, start);
-	char *block_ptr = inode_table + bytes + offset;
+	char block_ptr[sizeof(header)] __attribute__((aligned));
 	static struct inode i;
 
 	TRACE("read_inode: reading inode [%d:%d]\n", start_block,  offset);
 
-	if(bytes == -1)
+	if(read_inode_data(block_ptr, start, offset, sizeof(block_ptr)) <
+			sizeof(header.base))
 		EXIT_UNSQUASH("read_inode: inode table block %lld not found\n",
 			 start); 
 
@@ -142,7 +145,8 @@ struct inode *read_inode_1(unsigned int start_block, unsigned int offset)
 			i.blocks = (i.data + sBlk.s.block_size - 1) >>
 				sBlk.s.block_log;
 			i.start = inode->start_block;
-			i.block_ptr = block_ptr + sizeof(*inode);
+			i.block_start = start;
+			i.block_offset = offset + sizeof(*inode);
 			i.fragment = 0;
 			i.frag_bytes = 0;
 			i.offset = 0;
@@ -165,9 +169,11 @@ struct inode *read_inode_1(unsigned int start_block, unsigned int offset)
 			if(i.symlink == NULL)
 				EXIT_UNSQUASH("read_inode: failed to malloc "
 					"symlink data\n");
-			strncpy(i.symlink, block_ptr +
-				sizeof(squashfs_symlink_inode_header_1),
-				inodep->symlink_size);
+			if(read_inode_data(i.symlink, start, offset +
+					sizeof(*inodep), inodep->symlink_size) !=
+					inodep->symlink_size)
+				EXIT_UNSQUASH("read_inode: failed to read "
+					"symlink data\n");
 			i.symlink[inodep->symlink_size] = '\0';
 			i.data = inodep->symlink_size;
 			break;
@@ -209,7 +215,8 @@ struct dir *squashfs_opendir_1(unsigned int block_start, unsigned int offset,
 		__attribute__((aligned));
 	squashfs_dir_entry_2 *dire = (squashfs_dir_entry_2 *) buffer;
 	long long start;
-	int bytes;
+	int bytes = 0, dir_offset;
+	char *directory_data;
 	int dir_count, size;
 	struct dir_ent *new_dir;
 	struct dir *dir;
@@ -235,28 +242,37 @@ struct dir *squashfs_opendir_1(unsigned int block_start, unsigned int offset,
 	if ((*i)->data == 0)
 		/*
 		 * if the directory is empty, skip the unnecessary
-		 * lookup_entry, this fixes the corner case with
-		 * completely empty filesystems where lookup_entry correctly
-		 * returning -1 is incorrectly treated as an error
+		 * directory table read, this fixes the corner case with
+		 * completely empty filesystems where the directory table
+		 * is empty and a read would incorrectly be treated as an error
 		 */
 		return dir;
 		
+	/*
+	 * read the directory in one go, rather than entry by entry.  The
+	 * buffer is over-allocated by the size of the largest directory
+	 * header and entry, so a corrupted directory can't cause a read past
+	 * the end of the buffer
+	 */
 	start = sBlk.s.directory_table_start + (*i)->start;
-	bytes = lookup_entry(directory_table_hash, start);
-	if(bytes == -1)
-		EXIT_UNSQUASH("squashfs_opendir: directory block %d not "
-			"found!\n", block_start);
+	dir_offset = (*i)->offset;
+	size = (*i)->data;
+
+	directory_data = calloc(1, size + sizeof(dirh) + sizeof(buffer));
+	if(directory_data == NULL)
+		EXIT_UNSQUASH("squashfs_opendir: malloc failed!\n");
 
-	bytes += (*i)->offset;
-	size = (*i)->data + bytes;
+	if(read_metadata(directory_cache, &start, &dir_offset, directory_data,
+			size) != size)
+		goto corrupted;
 
 	while(bytes < size) {			
 		if(swap) {
 			squashfs_dir_header_2 sdirh;
-			memcpy(&sdirh, directory_table + bytes, sizeof(sdirh));
+			memcpy(&sdirh, directory_data + bytes, sizeof(sdirh));
 			SQUASHFS_SWAP_DIR_HEADER_2(&dirh, &sdirh);
 		} else
-			memcpy(&dirh, directory_table + bytes, sizeof(dirh));
+			memcpy(&dirh, directory_data + bytes, sizeof(dirh));
 	
 		dir_count = dirh.count + 1;
 		TRACE("squashfs_opendir: Read directory header @ byte position "
@@ -270,11 +286,11 @@ struct dir *squashfs_opendir_1(unsigned int block_start, unsigned int offset,
 		while(dir_count--) {
 			if(swap) {
 				squashfs_dir_entry_2 sdire;
-				memcpy(&sdire, directory_table + bytes,
+				memcpy(&sdire, directory_data + bytes,
 					sizeof(sdire));
 				SQUASHFS_SWAP_DIR_ENTRY_2(dire, &sdire);
 			} else
-				memcpy(dire, directory_table + bytes,
+				memcpy(dire, directory_data + bytes,
 					sizeof(*dire));
 			bytes += sizeof(*dire);
 
@@ -282,7 +298,7 @@ struct dir *squashfs_opendir_1(unsigned int block_start, unsigned int offset,
 			if(dire->size > SQUASHFS_NAME_LEN)
 				goto corrupted;
 
-			memcpy(dire->name, directory_table + bytes,
+			memcpy(dire->name, directory_data + bytes,
 				dire->size + 1);
 			dire->name[dire->size + 1] = '\0';
 			TRACE("squashfs_opendir: directory entry %s, inode "
@@ -306,9 +322,11 @@ struct dir *squashfs_opendir_1(unsigned int block_start, unsigned int offset,
 		}
 	}
 
+	free(directory_data);
 	return dir;
 
 corrupted:
+	free(directory_data);
 	free(dir->dirs);
 	free(dir);
 	return NULL;
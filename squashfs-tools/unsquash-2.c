@@ -27,16 +27,20 @@
 
 static squashfs_fragment_entry_2 *fragment_table;
 
-void read_block_list_2(unsigned int *block_list, char *block_ptr, int blocks)
+void read_block_list_2(unsigned int *block_list, long long start, int offset,
+	int blocks)
 {
 	TRACE("read_block_list: blocks %d\n", blocks);
 
+	if(read_inode_data(block_list, start, offset, blocks *
+			sizeof(unsigned int)) != blocks * sizeof(unsigned int))
+		EXIT_UNSQUASH("read_block_list: failed to read block list\n");
+
 	if(swap) {
 		unsigned int sblock_list[blocks];
-		memcpy(sblock_list, block_ptr, blocks * sizeof(unsigned int));
+		memcpy(sblock_list, block_list, blocks * sizeof(unsigned int));
 		SQUASHFS_SWAP_INTS_3(block_list, sblock_list, blocks);
-	} else
-		memcpy(block_list, block_ptr, blocks * sizeof(unsigned int));
+	}
 }
 
 
@@ -56,11 +60,6 @@ int read_fragment_table_2(long long *directory_table_end)
 		return TRUE;
 	}
 
-	fragment_table = malloc(bytes);
-	if(fragment_table == NULL)
-		EXIT_UNSQUASH("read_fragment_table: failed to allocate "
-			"fragment table\n");
-
 	if(swap) {
 		 unsigned int sfragment_table_index[indexes];
 
@@ -85,6 +84,20 @@ int read_fragment_table_2(long long *directory_table_end)
 		}
 	}
 
+	/*
+	 * Listing never reads file data, and only needs the location of the
+	 * first fragment table block, which ends the directory table
+	 */
+	if(lsonly) {
+		*directory_table_end = fragment_table_index[0];
+		return TRUE;
+	}
+
+	fragment_table = malloc(bytes);
+	if(fragment_table == NULL)
+		EXIT_UNSQUASH("read_fragment_table: failed to allocate "
+			"fragment table\n");
+
 	for(i = 0; i < indexes; i++) {
 		int expected = (i + 1) != indexes ? SQUASHFS_METADATA_SIZE :
 					bytes & (SQUASHFS_METADATA_SIZE - 1);
@@ -129,13 +142,13 @@ struct inode *read_inode_2(unsigned int start_block, unsigned int offset)
 {
 	static union squashfs_inode_header_2 header;
 	long long start = sBlk.s.inode_table_start + start_block;
-	int bytes = lookup_entry(inode_table_hash, start);
-	char *block_ptr = inode_table + bytes + offset;
+	char block_ptr[sizeof(header)] __attribute__((aligned));
 	static struct inode i;
 
 	TRACE("read_inode: reading inode [%d:%d]\n", start_block,  offset);
 
-	if(bytes == -1)
+	if(read_inode_data(block_ptr, start, offset, sizeof(block_ptr)) <
+			sizeof(header.base))
 		EXIT_UNSQUASH("read_inode: inode table block %lld not found\n",
 			start); 
 
@@ -216,7 +229,8 @@ struct inode *read_inode_2(unsigned int start_block, unsigned int offset)
 				sBlk.s.block_log;
 			i.start = inode->start_block;
 			i.sparse = 0;
-			i.block_ptr = block_ptr + sizeof(*inode);
+			i.block_start = start;
+			i.block_offset = offset + sizeof(*inode);
 			break;
 		}	
 		case SQUASHFS_SYMLINK_TYPE: {
@@ -235,9 +249,11 @@ struct inode *read_inode_2(unsigned int start_block, unsigned int offset)
 			if(i.symlink == NULL)
 				EXIT_UNSQUASH("read_inode: failed to malloc "
 					"symlink data\n");
-			strncpy(i.symlink, block_ptr +
-				sizeof(squashfs_symlink_inode_header_2),
-				inodep->symlink_size);
+			if(read_inode_data(i.symlink, start, offset +
+					sizeof(*inodep), inodep->symlink_size) !=
+					inodep->symlink_size)
+				EXIT_UNSQUASH("read_inode: failed to read "
+					"symlink data\n");
 			i.symlink[inodep->symlink_size] = '\0';
 			i.data = inodep->symlink_size;
 			break;
@@ -43,11 +43,6 @@ int read_fragment_table_3(long long *directory_table_end)
 		return TRUE;
 	}
 
-	fragment_table = malloc(bytes);
-	if(fragment_table == NULL)
-		EXIT_UNSQUASH("read_fragment_table: failed to allocate "
-			"fragment table\n");
-
 	if(swap) {
 		long long sfragment_table_index[indexes];
 
@@ -72,6 +67,20 @@ int read_fragment_table_3(long long *directory_table_end)
 		}
 	}
 
+	/*
+	 * Listing never reads file data, and only needs the location of the
+	 * first fragment table block, which ends the directory table
+	 */
+	if(lsonly) {
+		*directory_table_end = fragment_table_index[0];
+		return TRUE;
+	}
+
+	fragment_table = malloc(bytes);
+	if(fragment_table == NULL)
+		EXIT_UNSQUASH("read_fragment_table: failed to allocate "
+			"fragment table\n");
+
 	for(i = 0; i < indexes; i++) {
 		int expected = (i + 1) != indexes ? SQUASHFS_METADATA_SIZE :
 					bytes & (SQUASHFS_METADATA_SIZE - 1);
@@ -116,13 +125,13 @@ struct inode *read_inode_3(unsigned int start_block, unsigned int offset)
 {
 	static union squashfs_inode_header_3 header;
 	long long start = sBlk.s.inode_table_start + start_block;
-	int bytes = lookup_entry(inode_table_hash, start);
-	char *block_ptr = inode_table + bytes + offset;
+	char block_ptr[sizeof(header)] __attribute__((aligned));
 	static struct inode i;
 
 	TRACE("read_inode: reading inode [%d:%d]\n", start_block,  offset);
 
-	if(bytes == -1)
+	if(read_inode_data(block_ptr, start, offset, sizeof(block_ptr)) <
+			sizeof(header.base))
 		EXIT_UNSQUASH("read_inode: inode table block %lld not found\n",
 			start); 
 
@@ -200,7 +209,8 @@ struct inode *read_inode_3(unsigned int start_block, unsigned int offset)
 				i.data >> sBlk.s.block_log;
 			i.start = inode->start_block;
 			i.sparse = 1;
-			i.block_ptr = block_ptr + sizeof(*inode);
+			i.block_start = start;
+			i.block_offset = offset + sizeof(*inode);
 			break;
 		}	
 		case SQUASHFS_LREG_TYPE: {
@@ -225,7 +235,8 @@ struct inode *read_inode_3(unsigned int start_block, unsigned int offset)
 				inode->file_size >> sBlk.s.block_log;
 			i.start = inode->start_block;
 			i.sparse = 1;
-			i.block_ptr = block_ptr + sizeof(*inode);
+			i.block_start = start;
+			i.block_offset = offset + sizeof(*inode);
 			break;
 		}	
 		case SQUASHFS_SYMLINK_TYPE: {
@@ -244,9 +255,11 @@ struct inode *read_inode_3(unsigned int start_block, unsigned int offset)
 			if(i.symlink == NULL)
 				EXIT_UNSQUASH("read_inode: failed to malloc "
 					"symlink data\n");
-			strncpy(i.symlink, block_ptr +
-				sizeof(squashfs_symlink_inode_header_3),
-				inodep->symlink_size);
+			if(read_inode_data(i.symlink, start, offset +
+					sizeof(*inodep), inodep->symlink_size) !=
+					inodep->symlink_size)
+				EXIT_UNSQUASH("read_inode: failed to read "
+					"symlink data\n");
 			i.symlink[inodep->symlink_size] = '\0';
 			i.data = inodep->symlink_size;
 			break;
@@ -286,7 +299,8 @@ struct dir *squashfs_opendir_3(unsigned int block_start, unsigned int offset,
 		__attribute__((aligned));
 	squashfs_dir_entry_3 *dire = (squashfs_dir_entry_3 *) buffer;
 	long long start;
-	int bytes;
+	int bytes = 0, dir_offset;
+	char *directory_data;
 	int dir_count, size;
 	struct dir_ent *new_dir;
 	struct dir *dir;
@@ -312,29 +326,37 @@ struct dir *squashfs_opendir_3(unsigned int block_start, unsigned int offset,
 	if ((*i)->data == 3)
 		/*
 		 * if the directory is empty, skip the unnecessary
-		 * lookup_entry, this fixes the corner case with
-		 * completely empty filesystems where lookup_entry correctly
-		 * returning -1 is incorrectly treated as an error
+		 * directory table read, this fixes the corner case with
+		 * completely empty filesystems where the directory table
+		 * is empty and a read would incorrectly be treated as an error
 		 */
 		return dir;
 
+	/*
+	 * read the directory in one go, rather than entry by entry.  The
+	 * buffer is over-allocated by the size of the largest directory
+	 * header and entry, so a corrupted directory can't cause a read past
+	 * the end of the buffer
+	 */
 	start = sBlk.s.directory_table_start + (*i)->start;
-	bytes = lookup_entry(directory_table_hash, start);
+	dir_offset = (*i)->offset;
+	size = (*i)->data - 3;
 
-	if(bytes == -1)
-		EXIT_UNSQUASH("squashfs_opendir: directory block %d not "
-			"found!\n", block_start);
+	directory_data = calloc(1, size + sizeof(dirh) + sizeof(buffer));
+	if(directory_data == NULL)
+		EXIT_UNSQUASH("squashfs_opendir: malloc failed!\n");
 
-	bytes += (*i)->offset;
-	size = (*i)->data + bytes - 3;
+	if(read_metadata(directory_cache, &start, &dir_offset, directory_data,
+			size) != size)
+		goto corrupted;
 
 	while(bytes < size) {			
 		if(swap) {
 			squashfs_dir_header_3 sdirh;
-			memcpy(&sdirh, directory_table + bytes, sizeof(sdirh));
+			memcpy(&sdirh, directory_data + bytes, sizeof(sdirh));
 			SQUASHFS_SWAP_DIR_HEADER_3(&dirh, &sdirh);
 		} else
-			memcpy(&dirh, directory_table + bytes, sizeof(dirh));
+			memcpy(&dirh, directory_data + bytes, sizeof(dirh));
 	
 		dir_count = dirh.count + 1;
 		TRACE("squashfs_opendir: Read directory header @ byte position "
@@ -348,11 +370,11 @@ struct dir *squashfs_opendir_3(unsigned int block_start, unsigned int offset,
 		while(dir_count--) {
 			if(swap) {
 				squashfs_dir_entry_3 sdire;
-				memcpy(&sdire, directory_table + bytes,
+				memcpy(&sdire, directory_data + bytes,
 					sizeof(sdire));
 				SQUASHFS_SWAP_DIR_ENTRY_3(dire, &sdire);
 			} else
-				memcpy(dire, directory_table + bytes,
+				memcpy(dire, directory_data + bytes,
 					sizeof(*dire));
 			bytes += sizeof(*dire);
 
@@ -360,7 +382,7 @@ struct dir *squashfs_opendir_3(unsigned int block_start, unsigned int offset,
 			if(dire->size > SQUASHFS_NAME_LEN)
 				goto corrupted;
 
-			memcpy(dire->name, directory_table + bytes,
+			memcpy(dire->name, directory_data + bytes,
 				dire->size + 1);
 			dire->name[dire->size + 1] = '\0';
 			TRACE("squashfs_opendir: directory entry %s, inode "
@@ -384,9 +406,11 @@ struct dir *squashfs_opendir_3(unsigned int block_start, unsigned int offset,
 		}
 	}
 
+	free(directory_data);
 	return dir;
 
 corrupted:
+	free(directory_data);
 	free(dir->dirs);
 	free(dir);
 	return NULL;
@@ -44,11 +44,6 @@ int read_fragment_table_4(long long *directory_table_end)
 		return TRUE;
 	}
 
-	fragment_table = malloc(bytes);
-	if(fragment_table == NULL)
-		EXIT_UNSQUASH("read_fragment_table: failed to allocate "
-			"fragment table\n");
-
 	res = read_fs_bytes(fd, sBlk.s.fragment_table_start,
 		SQUASHFS_FRAGMENT_INDEX_BYTES(sBlk.s.fragments),
 		fragment_table_index);
@@ -59,6 +54,20 @@ int read_fragment_table_4(long long *directory_table_end)
 	}
 	SQUASHFS_INSWAP_FRAGMENT_INDEXES(fragment_table_index, indexes);
 
+	/*
+	 * Listing never reads file data, and only needs the location of the
+	 * first fragment table block, which ends the directory table
+	 */
+	if(lsonly) {
+		*directory_table_end = fragment_table_index[0];
+		return TRUE;
+	}
+
+	fragment_table = malloc(bytes);
+	if(fragment_table == NULL)
+		EXIT_UNSQUASH("read_fragment_table: failed to allocate "
+			"fragment table\n");
+
 	for(i = 0; i < indexes; i++) {
 		int expected = (i + 1) != indexes ? SQUASHFS_METADATA_SIZE :
 					bytes & (SQUASHFS_METADATA_SIZE - 1);
@@ -98,13 +107,13 @@ struct inode *read_inode_4(unsigned int start_block, unsigned int offset)
 {
 	static union squashfs_inode_header header;
 	long long start = sBlk.s.inode_table_start + start_block;
-	int bytes = lookup_entry(inode_table_hash, start);
-	char *block_ptr = inode_table + bytes + offset;
+	char block_ptr[sizeof(header)] __attribute__((aligned));
 	static struct inode i;
 
 	TRACE("read_inode: reading inode [%d:%d]\n", start_block,  offset);
 
-	if(bytes == -1)
+	if(read_inode_data(block_ptr, start, offset, sizeof(block_ptr)) <
+			sizeof(header.base))
 		EXIT_UNSQUASH("read_inode: inode table block %lld not found\n",
 			start); 		
 
@@ -156,7 +165,8 @@ struct inode *read_inode_4(unsigned int start_block, unsigned int offset)
 				i.data >> sBlk.s.block_log;
 			i.start = inode->start_block;
 			i.sparse = 0;
-			i.block_ptr = block_ptr + sizeof(*inode);
+			i.block_start = start;
+			i.block_offset = offset + sizeof(*inode);
 			i.xattr = SQUASHFS_INVALID_XATTR;
 			break;
 		}	
@@ -176,7 +186,8 @@ struct inode *read_inode_4(unsigned int start_block, unsigned int offset)
 				inode->file_size >> sBlk.s.block_log;
 			i.start = inode->start_block;
 			i.sparse = inode->sparse != 0;
-			i.block_ptr = block_ptr + sizeof(*inode);
+			i.block_start = start;
+			i.block_offset = offset + sizeof(*inode);
 			i.xattr = inode->xattr;
 			break;
 		}	
@@ -190,17 +201,22 @@ struct inode *read_inode_4(unsigned int start_block, unsigned int offset)
 			if(i.symlink == NULL)
 				EXIT_UNSQUASH("read_inode: failed to malloc "
 					"symlink data\n");
-			strncpy(i.symlink, block_ptr +
-				sizeof(struct squashfs_symlink_inode_header),
-				inode->symlink_size);
+			if(read_inode_data(i.symlink, start, offset +
+					sizeof(*inode), inode->symlink_size) !=
+					inode->symlink_size)
+				EXIT_UNSQUASH("read_inode: failed to read "
+					"symlink data\n");
 			i.symlink[inode->symlink_size] = '\0';
 			i.data = inode->symlink_size;
 
-			if(header.base.inode_type == SQUASHFS_LSYMLINK_TYPE)
-				SQUASHFS_SWAP_INTS(block_ptr +
-					sizeof(struct squashfs_symlink_inode_header) +
-					inode->symlink_size, &i.xattr, 1);
-			else
+			if(header.base.inode_type == SQUASHFS_LSYMLINK_TYPE) {
+				if(read_inode_data(&i.xattr, start, offset +
+						sizeof(*inode) + inode->symlink_size,
+						sizeof(i.xattr)) != sizeof(i.xattr))
+					EXIT_UNSQUASH("read_inode: failed to "
+						"read symlink xattr\n");
+				SQUASHFS_INSWAP_INTS(&i.xattr, 1);
+			} else
 				i.xattr = SQUASHFS_INVALID_XATTR;
 			break;
 		}
@@ -255,7 +271,8 @@ struct dir *squashfs_opendir_4(unsigned int block_start, unsigned int offset,
 		__attribute__((aligned));
 	struct squashfs_dir_entry *dire = (struct squashfs_dir_entry *) buffer;
 	long long start;
-	int bytes;
+	int bytes = 0, dir_offset;
+	char *directory_data;
 	int dir_count, size;
 	struct dir_ent *new_dir;
 	struct dir *dir;
@@ -281,24 +298,32 @@ struct dir *squashfs_opendir_4(unsigned int block_start, unsigned int offset,
 	if ((*i)->data == 3)
 		/*
 		 * if the directory is empty, skip the unnecessary
-		 * lookup_entry, this fixes the corner case with
-		 * completely empty filesystems where lookup_entry correctly
-		 * returning -1 is incorrectly treated as an error
+		 * directory table read, this fixes the corner case with
+		 * completely empty filesystems where the directory table
+		 * is empty and a read would incorrectly be treated as an error
 		 */
 		return dir;
 
+	/*
+	 * read the directory in one go, rather than entry by entry.  The
+	 * buffer is over-allocated by the size of the largest directory
+	 * header and entry, so a corrupted directory can't cause a read past
+	 * the end of the buffer
+	 */
 	start = sBlk.s.directory_table_start + (*i)->start;
-	bytes = lookup_entry(directory_table_hash, start);
+	dir_offset = (*i)->offset;
+	size = (*i)->data - 3;
 
-	if(bytes == -1)
-		EXIT_UNSQUASH("squashfs_opendir: directory block %d not "
-			"found!\n", block_start);
+	directory_data = calloc(1, size + sizeof(dirh) + sizeof(buffer));
+	if(directory_data == NULL)
+		EXIT_UNSQUASH("squashfs_opendir: malloc failed!\n");
 
-	bytes += (*i)->offset;
-	size = (*i)->data + bytes - 3;
+	if(read_metadata(directory_cache, &start, &dir_offset, directory_data,
+			size) != size)
+		goto corrupted;
 
 	while(bytes < size) {			
-		SQUASHFS_SWAP_DIR_HEADER(directory_table + bytes, &dirh);
+		SQUASHFS_SWAP_DIR_HEADER(directory_data + bytes, &dirh);
 	
 		dir_count = dirh.count + 1;
 		TRACE("squashfs_opendir: Read directory header @ byte position "
@@ -310,7 +335,7 @@ struct dir *squashfs_opendir_4(unsigned int block_start, unsigned int offset,
 			goto corrupted;
 
 		while(dir_count--) {
-			SQUASHFS_SWAP_DIR_ENTRY(directory_table + bytes, dire);
+			SQUASHFS_SWAP_DIR_ENTRY(directory_data + bytes, dire);
 
 			bytes += sizeof(*dire);
 
@@ -318,7 +343,7 @@ struct dir *squashfs_opendir_4(unsigned int block_start, unsigned int offset,
 			if(dire->size > SQUASHFS_NAME_LEN)
 				goto corrupted;
 
-			memcpy(dire->name, directory_table + bytes,
+			memcpy(dire->name, directory_data + bytes,
 				dire->size + 1);
 			dire->name[dire->size + 1] = '\0';
 			TRACE("squashfs_opendir: directory entry %s, inode "
@@ -342,9 +367,11 @@ struct dir *squashfs_opendir_4(unsigned int block_start, unsigned int offset,
 		}
 	}
 
+	free(directory_data);
 	return dir;
 
 corrupted:
+	free(directory_data);
 	free(dir->dirs);
 	free(dir);
 	return NULL;
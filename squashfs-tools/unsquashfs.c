@@ -39,12 +39,20 @@
 #include <ctype.h>
 
 struct cache *fragment_cache, *data_cache;
-struct queue *to_reader, *to_inflate, *to_writer, *from_writer;
-pthread_t *thread, *inflator_thread;
+struct queue *to_reader, *to_inflate, *to_writer;
+pthread_t *thread, *inflator_thread, *reader_thread;
+pthread_t *writer_thread;
 pthread_mutex_t	fragment_mutex;
 
 /* user options that control parallelisation */
 int processors = -1;
+int readers = 1;
+int writers = 1;
+
+/* write file data in the order it is on disk, rather than directory order */
+int disk_order = FALSE;
+struct disk_order_file *disk_order_list = NULL;
+int disk_order_files = 0, disk_order_size = 0;
 
 struct super_block sBlk;
 squashfs_operations s_ops;
@@ -52,8 +60,7 @@ struct compressor *comp;
 
 int bytes = 0, swap, file_count = 0, dir_count = 0, sym_count = 0,
 	dev_count = 0, fifo_count = 0;
-char *inode_table = NULL, *directory_table = NULL;
-struct hash_table_entry *inode_table_hash[65536], *directory_table_hash[65536];
+struct metadata_cache *inode_cache, *directory_cache;
 int fd;
 unsigned int *uid_table, *guid_table;
 unsigned int cached_frag = SQUASHFS_INVALID_FRAG;
@@ -71,7 +78,7 @@ int rotate = 0;
 pthread_mutex_t	screen_mutex;
 int progress = TRUE, progress_enabled = FALSE;
 unsigned int total_blocks = 0, total_files = 0, total_inodes = 0;
-unsigned int cur_blocks = 0;
+int cur_blocks = 0;
 int inode_number = 1;
 int no_xattrs = XATTR_DEF;
 int user_xattrs = FALSE;
@@ -166,79 +173,6 @@ int multiply_overflow(int a, int multiplier)
 }
 
 
-struct queue *queue_init(int size)
-{
-	struct queue *queue = malloc(sizeof(struct queue));
-
-	if(queue == NULL)
-		EXIT_UNSQUASH("Out of memory in queue_init\n");
-
-	if(add_overflow(size, 1) ||
-				multiply_overflow(size + 1, sizeof(void *)))
-		EXIT_UNSQUASH("Size too large in queue_init\n");
-
-	queue->data = malloc(sizeof(void *) * (size + 1));
-	if(queue->data == NULL)
-		EXIT_UNSQUASH("Out of memory in queue_init\n");
-
-	queue->size = size + 1;
-	queue->readp = queue->writep = 0;
-	pthread_mutex_init(&queue->mutex, NULL);
-	pthread_cond_init(&queue->empty, NULL);
-	pthread_cond_init(&queue->full, NULL);
-
-	return queue;
-}
-
-
-void queue_put(struct queue *queue, void *data)
-{
-	int nextp;
-
-	pthread_mutex_lock(&queue->mutex);
-
-	while((nextp = (queue->writep + 1) % queue->size) == queue->readp)
-		pthread_cond_wait(&queue->full, &queue->mutex);
-
-	queue->data[queue->writep] = data;
-	queue->writep = nextp;
-	pthread_cond_signal(&queue->empty);
-	pthread_mutex_unlock(&queue->mutex);
-}
-
-
-void *queue_get(struct queue *queue)
-{
-	void *data;
-	pthread_mutex_lock(&queue->mutex);
-
-	while(queue->readp == queue->writep)
-		pthread_cond_wait(&queue->empty, &queue->mutex);
-
-	data = queue->data[queue->readp];
-	queue->readp = (queue->readp + 1) % queue->size;
-	pthread_cond_signal(&queue->full);
-	pthread_mutex_unlock(&queue->mutex);
-
-	return data;
-}
-
-
-void dump_queue(struct queue *queue)
-{
-	pthread_mutex_lock(&queue->mutex);
-
-	printf("Max size %d, size %d%s\n", queue->size - 1,  
-		queue->readp <= queue->writep ? queue->writep - queue->readp :
-			queue->size - queue->readp + queue->writep,
-		queue->readp == queue->writep ? " (EMPTY)" :
-			((queue->writep + 1) % queue->size) == queue->readp ?
-			" (FULL)" : "");
-
-	pthread_mutex_unlock(&queue->mutex);
-}
-
-
 /* Called with the cache mutex held */
 void insert_hash_table(struct cache *cache, struct cache_entry *entry)
 {
@@ -316,6 +250,9 @@ struct cache *cache_init(int buffer_size, int max_buffers)
 	cache->used = 0;
 	cache->free_list = NULL;
 	memset(cache->hash_table, 0, sizeof(struct cache_entry *) * 65536);
+
+	/* the block buffers are carved from a pool, or malloced if it fails */
+	cache->pool = pool_init(buffer_size, max_buffers);
 	cache->wait_free = FALSE;
 	cache->wait_pending = FALSE;
 	pthread_mutex_init(&cache->mutex, NULL);
@@ -365,7 +302,8 @@ struct cache_entry *cache_get(struct cache *cache, long long block, int size)
 			entry = malloc(sizeof(struct cache_entry));
 			if(entry == NULL)
 				EXIT_UNSQUASH("Out of memory in cache_get\n");
-			entry->data = malloc(cache->buffer_size);
+			entry->data = pool_alloc(cache->pool,
+				cache->buffer_size);
 			if(entry->data == NULL)
 				EXIT_UNSQUASH("Out of memory in cache_get\n");
 			entry->cache = cache;
@@ -511,48 +449,69 @@ char *modestr(char *str, int mode)
 }
 
 
+struct id_name *user_names[ID_NAME_HASH_SIZE];
+struct id_name *group_names[ID_NAME_HASH_SIZE];
+
+char *lookup_id_name(struct id_name **table, unsigned int id, int user)
+{
+	int hash = ID_NAME_HASH(id);
+	struct id_name *entry;
+	char dummy[12]; /* overflow safe */
+	char *name;
+
+	for(entry = table[hash]; entry; entry = entry->next)
+		if(entry->id == id)
+			return entry->name;
+
+	if(user) {
+		struct passwd *pw = getpwuid(id);
+		name = pw ? pw->pw_name : NULL;
+	} else {
+		struct group *gr = getgrgid(id);
+		name = gr ? gr->gr_name : NULL;
+	}
+
+	if(name == NULL) {
+		int res = snprintf(dummy, 12, "%d", id);
+		if(res < 0)
+			EXIT_UNSQUASH("snprintf failed in print_filename()\n");
+		else if(res >= 12)
+			/* unsigned int shouldn't ever need more than 11 bytes
+			 * (including terminating '\0') to print in base 10 */
+			name = "*";
+		else
+			name = dummy;
+	}
+
+	entry = malloc(sizeof(struct id_name));
+	if(entry == NULL)
+		EXIT_UNSQUASH("Out of memory in lookup_id_name\n");
+	entry->name = strdup(name);
+	if(entry->name == NULL)
+		EXIT_UNSQUASH("Out of memory in lookup_id_name\n");
+	entry->id = id;
+	entry->next = table[hash];
+	table[hash] = entry;
+
+	return entry->name;
+}
+
+
 #define TOTALCHARS  25
 int print_filename(char *pathname, struct inode *inode)
 {
-	char str[11], dummy[12], dummy2[12]; /* overflow safe */
+	char str[11];
 	char *userstr, *groupstr;
 	int padchars;
-	struct passwd *user;
-	struct group *group;
-	struct tm *t;
+	struct tm t;
 
 	if(short_ls) {
 		printf("%s\n", pathname);
 		return 1;
 	}
 
-	user = getpwuid(inode->uid);
-	if(user == NULL) {
-		int res = snprintf(dummy, 12, "%d", inode->uid);
-		if(res < 0)
-			EXIT_UNSQUASH("snprintf failed in print_filename()\n");
-		else if(res >= 12)
-			/* unsigned int shouldn't ever need more than 11 bytes
-			 * (including terminating '\0') to print in base 10 */
-			userstr = "*";
-		else
-			userstr = dummy;
-	} else
-		userstr = user->pw_name;
-		 
-	group = getgrgid(inode->gid);
-	if(group == NULL) {
-		int res = snprintf(dummy2, 12, "%d", inode->gid);
-		if(res < 0)
-			EXIT_UNSQUASH("snprintf failed in print_filename()\n");
-		else if(res >= 12)
-			/* unsigned int shouldn't ever need more than 11 bytes
-			 * (including terminating '\0') to print in base 10 */
-			groupstr = "*";
-		else
-			groupstr = dummy2;
-	} else
-		groupstr = group->gr_name;
+	userstr = lookup_id_name(user_names, inode->uid, TRUE);
+	groupstr = lookup_id_name(group_names, inode->gid, FALSE);
 
 	printf("%s %s/%s ", modestr(str, inode->mode), userstr, groupstr);
 
@@ -579,10 +538,11 @@ int print_filename(char *pathname, struct inode *inode)
 			break;
 	}
 
-	t = localtime(&inode->time);
+	/* localtime_r() doesn't re-read the timezone for every file listed */
+	localtime_r(&inode->time, &t);
 
-	printf("%d-%02d-%02d %02d:%02d %s", t->tm_year + 1900, t->tm_mon + 1,
-		t->tm_mday, t->tm_hour, t->tm_min, pathname);
+	printf("%d-%02d-%02d %02d:%02d %s", t.tm_year + 1900, t.tm_mon + 1,
+		t.tm_mday, t.tm_hour, t.tm_min, pathname);
 	if((inode->mode & S_IFMT) == S_IFLNK)
 		printf(" -> %s", inode->symlink);
 	printf("\n");
@@ -591,38 +551,10 @@ int print_filename(char *pathname, struct inode *inode)
 }
 	
 
-void add_entry(struct hash_table_entry *hash_table[], long long start,
-	int bytes)
-{
-	int hash = CALCULATE_HASH(start);
-	struct hash_table_entry *hash_table_entry;
-
-	hash_table_entry = malloc(sizeof(struct hash_table_entry));
-	if(hash_table_entry == NULL)
-		EXIT_UNSQUASH("Out of memory in add_entry\n");
-
-	hash_table_entry->start = start;
-	hash_table_entry->bytes = bytes;
-	hash_table_entry->next = hash_table[hash];
-	hash_table[hash] = hash_table_entry;
-}
-
-
-int lookup_entry(struct hash_table_entry *hash_table[], long long start)
-{
-	int hash = CALCULATE_HASH(start);
-	struct hash_table_entry *hash_table_entry;
-
-	for(hash_table_entry = hash_table[hash]; hash_table_entry;
-				hash_table_entry = hash_table_entry->next)
-
-		if(hash_table_entry->start == start)
-			return hash_table_entry->bytes;
-
-	return -1;
-}
-
-
+/*
+ * Read using pread() rather than lseek() and read(), so this can be called
+ * by more than one reader thread at the same time
+ */
 int read_fs_bytes(int fd, long long byte, int bytes, void *buff)
 {
 	off_t off = byte;
@@ -631,13 +563,8 @@ int read_fs_bytes(int fd, long long byte, int bytes, void *buff)
 	TRACE("read_bytes: reading from position 0x%llx, bytes %d\n", byte,
 		bytes);
 
-	if(lseek(fd, off, SEEK_SET) == -1) {
-		ERROR("Lseek failed because %s\n", strerror(errno));
-		return FALSE;
-	}
-
 	for(count = 0; count < bytes; count += res) {
-		res = read(fd, buff + count, bytes - count);
+		res = pread(fd, buff + count, bytes - count, off + count);
 		if(res < 1) {
 			if(res == 0) {
 				ERROR("Read on filesystem failed because "
@@ -697,7 +624,7 @@ int read_block(int fd, long long start, long long *next, int expected,
 		if(res == FALSE)
 			goto failed;
 
-		res = compressor_uncompress(comp, block, buffer, c_byte,
+		res = compressor_uncompress(comp, NULL, block, buffer, c_byte,
 			outlen, &error);
 
 		if(res == -1) {
@@ -743,7 +670,7 @@ int read_data_block(long long start, unsigned int size, char *block)
 		if(read_fs_bytes(fd, start, c_byte, data) == FALSE)
 			goto failed;
 
-		res = compressor_uncompress(comp, block, data, c_byte,
+		res = compressor_uncompress(comp, NULL, block, data, c_byte,
 			block_size, &error);
 
 		if(res == -1) {
@@ -767,52 +694,183 @@ failed:
 }
 
 
-int read_inode_table(long long start, long long end)
+/*
+ * The inode and directory tables are not read into memory in their
+ * entirety, instead metadata blocks are read and decompressed on demand,
+ * and kept in an LRU cache of METADATA_CACHE_BLOCKS blocks.  This means
+ * only the metadata blocks actually used are decompressed (e.g. when
+ * listing or extracting a subdirectory), and memory use is bounded
+ * irrespective of the size of the filesystem
+ */
+struct metadata_cache *metadata_cache_init(long long start, long long end,
+	int max_entries)
 {
-	int size = 0, bytes = 0, res;
+	struct metadata_cache *cache = malloc(sizeof(struct metadata_cache));
 
-	TRACE("read_inode_table: start %lld, end %lld\n", start, end);
+	if(cache == NULL)
+		EXIT_UNSQUASH("Out of memory in metadata_cache_init\n");
 
-	while(start < end) {
-		if(size - bytes < SQUASHFS_METADATA_SIZE) {
-			inode_table = realloc(inode_table, size +=
-				SQUASHFS_METADATA_SIZE);
-			if(inode_table == NULL) {
-				ERROR("Out of memory in read_inode_table");
-				goto failed;
-			}
-		}
+	cache->start = start;
+	cache->end = end;
+	cache->max_entries = max_entries;
+	cache->count = 0;
+	cache->lru = NULL;
+	memset(cache->hash_table, 0, sizeof(cache->hash_table));
+	pthread_mutex_init(&cache->mutex, NULL);
 
-		add_entry(inode_table_hash, start, bytes);
+	return cache;
+}
 
-		res = read_block(fd, start, &start, 0, inode_table + bytes);
-		if(res == 0) {
-			ERROR("read_inode_table: failed to read block\n");
-			goto failed;
+
+static void metadata_lru_remove(struct metadata_cache *cache,
+	struct metadata_entry *entry)
+{
+	if(entry->lru_next == entry)
+		cache->lru = NULL;
+	else {
+		entry->lru_prev->lru_next = entry->lru_next;
+		entry->lru_next->lru_prev = entry->lru_prev;
+		if(cache->lru == entry)
+			cache->lru = entry->lru_next;
+	}
+}
+
+
+static void metadata_lru_insert(struct metadata_cache *cache,
+	struct metadata_entry *entry)
+{
+	/* the head of the lru list is the most recently used block */
+	if(cache->lru) {
+		entry->lru_next = cache->lru;
+		entry->lru_prev = cache->lru->lru_prev;
+		cache->lru->lru_prev->lru_next = entry;
+		cache->lru->lru_prev = entry;
+	} else
+		entry->lru_next = entry->lru_prev = entry;
+
+	cache->lru = entry;
+}
+
+
+static void metadata_hash_remove(struct metadata_cache *cache,
+	struct metadata_entry *entry)
+{
+	struct metadata_entry **ptr =
+		&cache->hash_table[CALCULATE_HASH(entry->start)];
+
+	while(*ptr != entry)
+		ptr = &(*ptr)->hash_next;
+
+	*ptr = entry->hash_next;
+}
+
+
+/*
+ * Get the metadata block at start, reading and decompressing it if it
+ * is not in the cache.  Called with the cache mutex held
+ */
+static struct metadata_entry *metadata_get(struct metadata_cache *cache,
+	long long start)
+{
+	int hash = CALCULATE_HASH(start);
+	struct metadata_entry *entry;
+
+	for(entry = cache->hash_table[hash]; entry; entry = entry->hash_next)
+		if(entry->start == start)
+			break;
+
+	if(entry) {
+		metadata_lru_remove(cache, entry);
+		metadata_lru_insert(cache, entry);
+		return entry;
+	}
+
+	if(start < cache->start || start >= cache->end)
+		EXIT_UNSQUASH("read_metadata: metadata block @0x%llx is "
+			"outside of the table\n", start);
+
+	if(cache->count < cache->max_entries) {
+		entry = malloc(sizeof(struct metadata_entry));
+		if(entry == NULL)
+			EXIT_UNSQUASH("Out of memory in read_metadata\n");
+		cache->count ++;
+	} else {
+		/* reuse the least recently used block */
+		entry = cache->lru->lru_prev;
+		metadata_lru_remove(cache, entry);
+		metadata_hash_remove(cache, entry);
+	}
+
+	entry->start = start;
+	entry->length = read_block(fd, start, &entry->next, 0, entry->data);
+	if(entry->length == 0)
+		EXIT_UNSQUASH("read_metadata: failed to read block @0x%llx\n",
+			start);
+
+	/*
+	 * If this is not the last metadata block in the table then it
+	 * should be SQUASHFS_METADATA_SIZE in size.
+	 */
+	if(entry->next != cache->end &&
+			entry->length != SQUASHFS_METADATA_SIZE)
+		EXIT_UNSQUASH("read_metadata: metadata block should be %d "
+			"bytes in length, it is %d bytes\n",
+			SQUASHFS_METADATA_SIZE, entry->length);
+
+	entry->hash_next = cache->hash_table[hash];
+	cache->hash_table[hash] = entry;
+	metadata_lru_insert(cache, entry);
+
+	return entry;
+}
+
+
+/*
+ * Copy length bytes of metadata starting at offset bytes into the block
+ * at *block into buffer, moving on to the following blocks as necessary.
+ * *block and *offset are updated to point after the bytes copied.
+ * Returns the number of bytes copied, which is only less than length if
+ * the end of the table is reached
+ */
+int read_metadata(struct metadata_cache *cache, long long *block,
+	int *offset, void *buffer, int length)
+{
+	int copied = 0;
+
+	pthread_mutex_lock(&cache->mutex);
+
+	while(copied < length && *block < cache->end) {
+		struct metadata_entry *entry = metadata_get(cache, *block);
+		int bytes = entry->length - *offset;
+
+		if(bytes > 0) {
+			if(bytes > length - copied)
+				bytes = length - copied;
+
+			memcpy(buffer + copied, entry->data + *offset, bytes);
+			copied += bytes;
+			*offset += bytes;
 		}
-		bytes += res;
 
-		/*
-		 * If this is not the last metadata block in the inode table
-		 * then it should be SQUASHFS_METADATA_SIZE in size.
-		 * Note, we can't use expected in read_block() above for this
-		 * because we don't know if this is the last block until
-		 * after reading.
-		 */
-		if(start != end && res != SQUASHFS_METADATA_SIZE) {
-			ERROR("read_inode_table: metadata block should be %d "
-				"bytes in length, it is %d bytes\n",
-				SQUASHFS_METADATA_SIZE, res);
-			
-			goto failed;
+		if(*offset >= entry->length) {
+			*offset -= entry->length;
+			*block = entry->next;
 		}
 	}
 
-	return TRUE;
+	pthread_mutex_unlock(&cache->mutex);
 
-failed:
-	free(inode_table);
-	return FALSE;
+	return copied;
+}
+
+
+/*
+ * Copy length bytes of the inode table starting at offset bytes
+ * into the block at start (on disk).  Returns the number of bytes copied
+ */
+int read_inode_data(void *buffer, long long start, int offset, int length)
+{
+	return read_metadata(inode_cache, &start, &offset, buffer, length);
 }
 
 
@@ -869,48 +927,108 @@ int write_bytes(int fd, char *buff, int bytes)
 }
 
 
-int lseek_broken = FALSE;
+/*
+ * Write bytes at off in the output file.  The writer threads write at
+ * explicit offsets, and so holes are simply skipped over
+ */
+int write_bytes_at(int fd, char *buff, int bytes, long long off)
+{
+	int res, count;
+
+	for(count = 0; count < bytes; count += res) {
+		res = pwrite(fd, buff + count, bytes - count, off + count);
+		if(res == -1) {
+			if(errno != EINTR) {
+				ERROR("Write on output file failed because "
+					"%s\n", strerror(errno));
+				return -1;
+			}
+			res = 0;
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ * Uncompressed data blocks are copied from the filesystem to the output
+ * files with copy_file_range() rather than being read into the data cache
+ * and written, until the kernel can't do it (the filesystem and output
+ * are on different filesystems, or the filesystem is a block device)
+ */
+int copy_range = TRUE;
 char *zero_data = NULL;
 
-int write_block(int file_fd, char *buffer, int size, long long hole, int sparse)
+int copy_block(int file_fd, long long start, int size, long long off)
 {
-	off_t off = hole;
+	loff_t in = start, out = off;
 
-	if(hole) {
-		if(sparse && lseek_broken == FALSE) {
-			 int error = lseek(file_fd, off, SEEK_CUR);
-			 if(error == -1)
-				/* failed to seek beyond end of file */
-				lseek_broken = TRUE;
-		}
+	while(copy_range && size) {
+		ssize_t res = copy_file_range(fd, &in, file_fd, &out, size, 0);
+
+		if(res == -1 && errno == EINTR)
+			continue;
 
-		if((sparse == FALSE || lseek_broken) && zero_data == NULL) {
-			if((zero_data = malloc(block_size)) == NULL)
-				EXIT_UNSQUASH("write_block: failed to alloc "
-					"zero data block\n");
-			memset(zero_data, 0, block_size);
+		if(res == -1 && (errno == ENOSYS || errno == EXDEV ||
+				errno == EINVAL || errno == EOPNOTSUPP)) {
+			copy_range = FALSE;
+			break;
 		}
 
-		if(sparse == FALSE || lseek_broken) {
-			int blocks = (hole + block_size -1) / block_size;
-			int avail_bytes, i;
-			for(i = 0; i < blocks; i++, hole -= avail_bytes) {
-				avail_bytes = hole > block_size ? block_size :
-					hole;
-				if(write_bytes(file_fd, zero_data, avail_bytes)
-						== -1)
-					goto failure;
-			}
+		if(res == -1) {
+			ERROR("Copy to output file failed because %s\n",
+				strerror(errno));
+			return FALSE;
 		}
+
+		if(res == 0)
+			/* EOF, which read_fs_bytes() below reports */
+			break;
+
+		size -= res;
 	}
 
-	if(write_bytes(file_fd, buffer, size) == -1)
-		goto failure;
+	if(size) {
+		char buffer[size];
+
+		if(read_fs_bytes(fd, in, size, buffer) == FALSE ||
+				write_bytes_at(file_fd, buffer, size, out) == -1)
+			return FALSE;
+	}
 
 	return TRUE;
+}
 
-failure:
-	return FALSE;
+
+/*
+ * Write block at off in the output file.  Holes are left unwritten in
+ * sparse files (which have already been extended to their full size), and
+ * are written as zeros otherwise
+ */
+int write_block(int file_fd, struct file_entry *block, long long off,
+	int sparse)
+{
+	int size;
+
+	if(block->buffer)
+		return write_bytes_at(file_fd, block->buffer->data +
+			block->offset, block->size, off) != -1;
+
+	if(block->start != -1)
+		return copy_block(file_fd, block->start, block->size, off);
+
+	for(size = block->size; sparse == FALSE && size; ) {
+		int bytes = size > block_size ? block_size : size;
+
+		if(write_bytes_at(file_fd, zero_data, bytes, off) == -1)
+			return FALSE;
+
+		size -= bytes;
+		off += bytes;
+	}
+
+	return TRUE;
 }
 
 
@@ -954,7 +1072,20 @@ void close_wake(int fd)
 }
 
 
-void queue_file(char *pathname, int file_fd, struct inode *inode)
+pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * With more than one writer thread, directory attributes can't be set by
+ * the writer threads, because the files within the directory may still be
+ * being written by another writer thread.  Instead the directories are
+ * kept on this list, in the order they were finished by the scan
+ * threads (i.e. subdirectories before their parents), and their attributes
+ * are set once all the writer threads have finished
+ */
+struct squashfs_file *dir_attr_list = NULL, **dir_attr_tail = &dir_attr_list;
+
+struct squashfs_file *queue_file(char *pathname, int file_fd,
+	struct inode *inode)
 {
 	struct squashfs_file *file = malloc(sizeof(struct squashfs_file));
 	if(file == NULL)
@@ -970,7 +1101,27 @@ void queue_file(char *pathname, int file_fd, struct inode *inode)
 	file->blocks = inode->blocks + (inode->frag_bytes > 0);
 	file->sparse = inode->sparse;
 	file->xattr = inode->xattr;
+	file->link = NULL;
+	file->rdev = 0;
+	file->queue = queue_init(file->blocks);
+	file->users = 2;
 	queue_put(to_writer, file);
+
+	return file;
+}
+
+
+/*
+ * The writer thread can take the file's last block off its queue while
+ * queue_put() is still returning, and so the file and its queue are freed
+ * by whichever of the writer thread and write_file() finishes with them last
+ */
+void release_file(struct squashfs_file *file)
+{
+	if(__atomic_sub_fetch(&file->users, 1, __ATOMIC_ACQ_REL) == 0) {
+		queue_free(file->queue);
+		free(file);
+	}
 }
 
 
@@ -987,57 +1138,88 @@ void queue_dir(char *pathname, struct dir *dir)
 	file->time = dir->mtime;
 	file->pathname = strdup(pathname);
 	file->xattr = dir->xattr;
-	queue_put(to_writer, file);
+	file->queue = NULL;
+	file->next = NULL;
+
+	pthread_mutex_lock(&queue_mutex);
+	if(writers > 1 || disk_order) {
+		*dir_attr_tail = file;
+		dir_attr_tail = &file->next;
+	} else
+		queue_put(to_writer, file);
+	pthread_mutex_unlock(&queue_mutex);
 }
 
 
-int write_file(struct inode *inode, char *pathname)
+/*
+ * set the attributes of the directories deferred by queue_dir(), called
+ * once all the writer threads have finished
+ */
+void set_dir_attributes()
+{
+	while(dir_attr_list) {
+		struct squashfs_file *file = dir_attr_list;
+
+		set_attributes(file->pathname, file->mode, file->uid,
+			file->gid, file->time, file->xattr, TRUE);
+		dir_attr_list = file->next;
+		free(file->pathname);
+		free(file);
+	}
+}
+
+
+void queue_file_data(struct inode *inode, char *pathname, int file_fd)
 {
-	unsigned int file_fd, i;
+	unsigned int i;
 	unsigned int *block_list;
+	struct squashfs_file *file;
 	int file_end = inode->data / block_size;
 	long long start = inode->start;
 
-	TRACE("write_file: regular file, blocks %d\n", inode->blocks);
-
-	file_fd = open_wait(pathname, O_CREAT | O_WRONLY |
-		(force ? O_TRUNC : 0), (mode_t) inode->mode & 0777);
-	if(file_fd == -1) {
-		ERROR("write_file: failed to create file %s, because %s\n",
-			pathname, strerror(errno));
-		return FALSE;
-	}
-
 	block_list = malloc(inode->blocks * sizeof(unsigned int));
 	if(block_list == NULL)
-		EXIT_UNSQUASH("write_file: unable to malloc block list\n");
+		EXIT_UNSQUASH("queue_file_data: unable to malloc block list\n");
 
-	s_ops.read_block_list(block_list, inode->block_ptr, inode->blocks);
+	s_ops.read_block_list(block_list, inode->block_start,
+		inode->block_offset, inode->blocks);
 
 	/*
-	 * the writer thread is queued a squashfs_file structure describing the
- 	 * file.  If the file has one or more blocks or a fragment they are
- 	 * queued separately (references to blocks in the cache).
+	 * the writer threads are queued a squashfs_file structure describing
+ 	 * the file.  If the file has one or more blocks or a fragment they are
+ 	 * queued separately on the file's own queue (references to blocks in
+	 * the cache), so each writer thread can take a whole file.  The
+	 * blocks must still be obtained from the cache in the same order the
+	 * files are queued, otherwise cache entries could be held by files
+	 * no writer thread has taken yet, and so the queueing is not
+	 * interleaved with that of files queued by other scan threads
  	 */
-	queue_file(pathname, file_fd, inode);
+	pthread_mutex_lock(&queue_mutex);
+	file = queue_file(pathname, file_fd, inode);
 
 	for(i = 0; i < inode->blocks; i++) {
 		int c_byte = SQUASHFS_COMPRESSED_SIZE_BLOCK(block_list[i]);
 		struct file_entry *block = malloc(sizeof(struct file_entry));
 
 		if(block == NULL)
-			EXIT_UNSQUASH("write_file: unable to malloc file\n");
+			EXIT_UNSQUASH("queue_file_data: unable to malloc file\n");
 		block->offset = 0;
 		block->size = i == file_end ? inode->data & (block_size - 1) :
 			block_size;
+		block->start = -1;
 		if(block_list[i] == 0) /* sparse block */
 			block->buffer = NULL;
-		else {
+		else if(copy_range && tar_fd == -1 &&
+				!SQUASHFS_COMPRESSED_BLOCK(block_list[i]) &&
+				c_byte == block->size) {
+			/* copied directly by the writer thread */
+			block->buffer = NULL;
+			block->start = start;
+		} else
 			block->buffer = cache_get(data_cache, start,
 				block_list[i]);
-			start += c_byte;
-		}
-		queue_put(to_writer, block);
+		start += c_byte;
+		queue_put(file->queue, block);
 	}
 
 	if(inode->frag_bytes) {
@@ -1046,29 +1228,191 @@ int write_file(struct inode *inode, char *pathname)
 		struct file_entry *block = malloc(sizeof(struct file_entry));
 
 		if(block == NULL)
-			EXIT_UNSQUASH("write_file: unable to malloc file\n");
+			EXIT_UNSQUASH("queue_file_data: unable to malloc file\n");
 		s_ops.read_fragment(inode->fragment, &start, &size);
 		block->buffer = cache_get(fragment_cache, start, size);
+		block->start = -1;
 		block->offset = inode->offset;
 		block->size = inode->frag_bytes;
-		queue_put(to_writer, block);
+		queue_put(file->queue, block);
 	}
 
+	release_file(file);
+	pthread_mutex_unlock(&queue_mutex);
 	free(block_list);
+}
+
+
+/*
+ * With -disk-order the files are created as they are scanned (so hard links
+ * to them can be made), but their data is queued once the scan has finished,
+ * sorted by where it is on disk.  Files with a tail end are located by their
+ * fragment block, and so all the files sharing a fragment block are queued
+ * together and the fragment block is read and decompressed only once (it
+ * stays in the fragment cache while they are queued).  Within a fragment
+ * block, and for files without a tail end, files are sorted by their first
+ * data block, and so the data blocks are read sequentially too
+ */
+void add_disk_order(struct inode *inode, char *pathname)
+{
+	struct disk_order_file *file;
+	long long location = 0;
+	int size;
+
+	pthread_mutex_lock(&queue_mutex);
+	if(inode->frag_bytes)
+		s_ops.read_fragment(inode->fragment, &location, &size);
+	else if(inode->blocks)
+		location = inode->start;
+
+	if(disk_order_files == disk_order_size) {
+		disk_order_size = disk_order_size ? disk_order_size * 2 : 1024;
+		disk_order_list = realloc(disk_order_list, disk_order_size *
+			sizeof(struct disk_order_file));
+		if(disk_order_list == NULL)
+			EXIT_UNSQUASH("Out of memory in add_disk_order\n");
+	}
+
+	file = &disk_order_list[disk_order_files];
+	file->location = location;
+	file->start = inode->blocks ? inode->start : -1;
+	file->order = disk_order_files ++;
+	file->pathname = strdup(pathname);
+	file->inode = *inode;
+	pthread_mutex_unlock(&queue_mutex);
+}
+
+
+int compare_disk_order(const void *a, const void *b)
+{
+	const struct disk_order_file *file_a = a, *file_b = b;
+
+	if(file_a->location != file_b->location)
+		return file_a->location < file_b->location ? -1 : 1;
+
+	if(file_a->start != file_b->start)
+		return file_a->start < file_b->start ? -1 : 1;
+
+	return file_a->order - file_b->order;
+}
+
+
+void write_disk_order()
+{
+	int i;
+
+	qsort(disk_order_list, disk_order_files, sizeof(struct disk_order_file),
+		compare_disk_order);
+
+	for(i = 0; i < disk_order_files; i++) {
+		struct disk_order_file *file = &disk_order_list[i];
+		int file_fd = open_wait(file->pathname, O_WRONLY, 0);
+
+		if(file_fd == -1)
+			ERROR("write_file: failed to open file %s, because "
+				"%s\n", file->pathname, strerror(errno));
+		else
+			queue_file_data(&file->inode, file->pathname, file_fd);
+		free(file->pathname);
+	}
+
+	free(disk_order_list);
+}
+
+
+int write_file(struct inode *inode, char *pathname)
+{
+	int file_fd, mode = inode->mode & 0777;
+
+	TRACE("write_file: regular file, blocks %d\n", inode->blocks);
+
+	/*
+	 * With -disk-order the file is opened again to write its data, and
+	 * so it must be writable.  The writer thread sets the mode
+	 */
+	if(disk_order)
+		mode |= S_IWUSR;
+
+	file_fd = open_wait(pathname, O_CREAT | O_WRONLY |
+		(force ? O_TRUNC : 0), (mode_t) mode);
+	if(file_fd == -1) {
+		ERROR("write_file: failed to create file %s, because %s\n",
+			pathname, strerror(errno));
+		return FALSE;
+	}
+
+	if(disk_order) {
+		close_wake(file_fd);
+		add_disk_order(inode, pathname);
+	} else
+		queue_file_data(inode, pathname, file_fd);
+
 	return TRUE;
 }
 
 
+/*
+ * Directories are scanned in parallel, and so more than one scan thread
+ * can find the same hard linked inode at once.  The first thread claims
+ * it and creates it, the others wait until creation is finished and then
+ * link to it
+ */
+#define INODE_CREATING ((char *) -1)
+
+pthread_mutex_t inode_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t inode_created = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t count_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+char *claim_inode(struct inode *i)
+{
+	char *name;
+
+	pthread_mutex_lock(&inode_mutex);
+	while((name = created_inode[i->inode_number - 1]) == INODE_CREATING)
+		pthread_cond_wait(&inode_created, &inode_mutex);
+	if(name == NULL)
+		created_inode[i->inode_number - 1] = INODE_CREATING;
+	pthread_mutex_unlock(&inode_mutex);
+
+	return name;
+}
+
+
+void set_created(struct inode *i, char *name)
+{
+	pthread_mutex_lock(&inode_mutex);
+	created_inode[i->inode_number - 1] = name;
+	pthread_cond_broadcast(&inode_created);
+	pthread_mutex_unlock(&inode_mutex);
+}
+
+
+void inc_count(int *count)
+{
+	pthread_mutex_lock(&count_mutex);
+	(*count) ++;
+	pthread_mutex_unlock(&count_mutex);
+}
+
+
 int create_inode(char *pathname, struct inode *i)
 {
+	char *link_name;
+
 	TRACE("create_inode: pathname %s\n", pathname);
 
-	if(created_inode[i->inode_number - 1]) {
+	link_name = claim_inode(i);
+	if(tar_fd != -1)
+		return tar_inode(pathname, i, link_name);
+	else if(verify)
+		return verify_inode(pathname, i, link_name);
+
+	if(link_name) {
 		TRACE("create_inode: hard link\n");
 		if(force)
 			unlink(pathname);
 
-		if(link(created_inode[i->inode_number - 1], pathname) == -1) {
+		if(link(link_name, pathname) == -1) {
 			ERROR("create_inode: failed to create hardlink, "
 				"because %s\n", strerror(errno));
 			return FALSE;
@@ -1084,7 +1428,7 @@ int create_inode(char *pathname, struct inode *i)
 				"blocks %d\n", i->data, i->blocks);
 
 			if(write_file(i, pathname))
-				file_count ++;
+				inc_count(&file_count);
 			break;
 		case SQUASHFS_SYMLINK_TYPE:
 		case SQUASHFS_LSYMLINK_TYPE:
@@ -1111,7 +1455,7 @@ int create_inode(char *pathname, struct inode *i)
 						strerror(errno));
 			}
 
-			sym_count ++;
+			inc_count(&sym_count);
 			break;
  		case SQUASHFS_BLKDEV_TYPE:
 	 	case SQUASHFS_CHRDEV_TYPE:
@@ -1135,7 +1479,7 @@ int create_inode(char *pathname, struct inode *i)
 				}
 				set_attributes(pathname, i->mode, i->uid,
 					i->gid, i->time, i->xattr, TRUE);
-				dev_count ++;
+				inc_count(&dev_count);
 			} else
 				ERROR("create_inode: could not create %s "
 					"device %s, because you're not "
@@ -1158,7 +1502,7 @@ int create_inode(char *pathname, struct inode *i)
 			}
 			set_attributes(pathname, i->mode, i->uid, i->gid,
 				i->time, i->xattr, TRUE);
-			fifo_count ++;
+			inc_count(&fifo_count);
 			break;
 		case SQUASHFS_SOCKET_TYPE:
 		case SQUASHFS_LSOCKET_TYPE:
@@ -1168,65 +1512,16 @@ int create_inode(char *pathname, struct inode *i)
 		default:
 			ERROR("Unknown inode type %d in create_inode_table!\n",
 				i->type);
+			set_created(i, NULL);
 			return FALSE;
 	}
 
-	created_inode[i->inode_number - 1] = strdup(pathname);
+	set_created(i, strdup(pathname));
 
 	return TRUE;
 }
 
 
-int read_directory_table(long long start, long long end)
-{
-	int bytes = 0, size = 0, res;
-
-	TRACE("read_directory_table: start %lld, end %lld\n", start, end);
-
-	while(start < end) {
-		if(size - bytes < SQUASHFS_METADATA_SIZE) {
-			directory_table = realloc(directory_table, size +=
-				SQUASHFS_METADATA_SIZE);
-			if(directory_table == NULL) {
-				ERROR("Out of memory in "
-						"read_directory_table\n");
-				goto failed;
-			}
-		}
-
-		add_entry(directory_table_hash, start, bytes);
-
-		res = read_block(fd, start, &start, 0, directory_table + bytes);
-		if(res == 0) {
-			ERROR("read_directory_table: failed to read block\n");
-			goto failed;
-		}
-
-		bytes += res;
-
-		/*
-		 * If this is not the last metadata block in the directory table
-		 * then it should be SQUASHFS_METADATA_SIZE in size.
-		 * Note, we can't use expected in read_block() above for this
-		 * because we don't know if this is the last block until
-		 * after reading.
-		 */
-		if(start != end && res != SQUASHFS_METADATA_SIZE) {
-			ERROR("read_directory_table: metadata block "
-				"should be %d bytes in length, it is %d "
-				"bytes\n", SQUASHFS_METADATA_SIZE, res);
-			goto failed;
-		}
-	}
-
-	return TRUE;
-
-failed:
-	free(directory_table);
-	return FALSE;
-}
-
-
 int squashfs_readdir(struct dir *dir, char **name, unsigned int *start_block,
 unsigned int *offset, unsigned int *type)
 {
@@ -1284,6 +1579,9 @@ void free_path(struct pathname *paths)
 		}
 	}
 
+	free(paths->literal);
+	free(paths->glob);
+	free(paths->name);
 	free(paths);
 }
 
@@ -1304,6 +1602,8 @@ struct pathname *add_path(struct pathname *paths, char *target, char *alltarget)
 
 		paths->names = 0;
 		paths->name = NULL;
+		paths->literal = NULL;
+		paths->glob = NULL;
 	}
 
 	for(i = 0; i < paths->names; i++)
@@ -1370,13 +1670,72 @@ struct pathname *add_path(struct pathname *paths, char *target, char *alltarget)
 			free_path(paths->name[i].paths);
 			paths->name[i].paths = NULL;
 		} else
-			/*
-			 * recurse adding child components
-			 */
-			add_path(paths->name[i].paths, target, alltarget);
-	}
+			/*
+			 * recurse adding child components
+			 */
+			add_path(paths->name[i].paths, target, alltarget);
+	}
+
+	return paths;
+}
+
+
+static unsigned int name_hash(char *name)
+{
+	unsigned int hash = 2166136261U;
+
+	while(*name)
+		hash = (hash ^ (unsigned char) *name++) * 16777619U;
+
+	return hash;
+}
+
+
+static int literal_name(char *name)
+{
+	return !use_regex && strpbrk(name, "*?[\\(") == NULL;
+}
+
+
+/*
+ * Index the names at each level of an extract tree, see struct pathname
+ */
+void compile_path(struct pathname *paths)
+{
+	int i, size = 1, literals = 0;
+
+	if(paths == NULL)
+		return;
+
+	for(i = 0; i < paths->names; i++)
+		literals += literal_name(paths->name[i].name);
+
+	while(size < literals * 2)
+		size <<= 1;
+
+	paths->literal = malloc(size * sizeof(int));
+	paths->glob = malloc((paths->names - literals + 1) * sizeof(int));
+	if(paths->literal == NULL || paths->glob == NULL)
+		EXIT_UNSQUASH("Out of memory in compile_path\n");
+
+	paths->literal_mask = size - 1;
+	paths->globs = 0;
+	for(i = 0; i < size; i++)
+		paths->literal[i] = -1;
+
+	for(i = 0; i < paths->names; i++) {
+		struct path_entry *entry = &paths->name[i];
+
+		if(literal_name(entry->name)) {
+			int hash = name_hash(entry->name) & paths->literal_mask;
+
+			entry->next = paths->literal[hash];
+			paths->literal[hash] = i;
+		} else
+			paths->glob[paths->globs ++] = i;
 
-	return paths;
+		compile_path(entry->paths);
+	}
 }
 
 
@@ -1411,58 +1770,70 @@ void free_subdir(struct pathnames *paths)
 }
 
 
+/*
+ * Handle a name matching entry.  Return TRUE if it is a leaf component,
+ * otherwise add its subdirectories to the new search set, which is only
+ * allocated once a non-leaf match is found
+ */
+static int match_entry(struct path_entry *entry, struct pathnames **new)
+{
+	if(entry->paths == NULL)
+		return TRUE;
+
+	if(*new == NULL)
+		*new = init_subdir();
+	*new = add_subdir(*new, entry->paths);
+	return FALSE;
+}
+
+
 int matches(struct pathnames *paths, char *name, struct pathnames **new)
 {
 	int i, n;
 
-	if(paths == NULL) {
-		*new = NULL;
-		return TRUE;
-	}
+	*new = NULL;
 
-	*new = init_subdir();
+	if(paths == NULL)
+		return TRUE;
 
 	for(n = 0; n < paths->count; n++) {
 		struct pathname *path = paths->path[n];
-		for(i = 0; i < path->names; i++) {
+
+		/*
+		 * at most one literal name can match, look it up in the hash
+		 * table
+		 */
+		for(i = path->literal[name_hash(name) & path->literal_mask];
+					i != -1; i = path->name[i].next)
+			if(strcmp(path->name[i].name, name) == 0) {
+				if(match_entry(&path->name[i], new))
+					goto empty_set;
+				break;
+			}
+
+		for(i = 0; i < path->globs; i++) {
+			struct path_entry *entry = &path->name[path->glob[i]];
 			int match = use_regex ?
-				regexec(path->name[i].preg, name, (size_t) 0,
-				NULL, 0) == 0 : fnmatch(path->name[i].name,
+				regexec(entry->preg, name, (size_t) 0,
+				NULL, 0) == 0 : fnmatch(entry->name,
 				name, FNM_PATHNAME|FNM_PERIOD|FNM_EXTMATCH) ==
 				0;
-			if(match && path->name[i].paths == NULL)
+			if(match && match_entry(entry, new))
 				/*
 				 * match on a leaf component, any subdirectories
 				 * will implicitly match, therefore return an
 				 * empty new search set
 				 */
 				goto empty_set;
-
-			if(match)
-				/*
-				 * match on a non-leaf component, add any
-				 * subdirectories to the new set of
-				 * subdirectories to scan for this name
-				 */
-				*new = add_subdir(*new, path->name[i].paths);
 		}
 	}
 
-	if((*new)->count == 0) {
-		/*
-		 * no matching names found, delete empty search set, and return
-		 * FALSE
-		 */
-		free_subdir(*new);
-		*new = NULL;
-		return FALSE;
-	}
-
 	/*
-	 * one or more matches with sub-directories found (no leaf matches),
-	 * return new search set and return TRUE
+	 * Either no matching names were found (new search set is NULL),
+	 * return FALSE, or one or more matches with sub-directories were found
+	 * (no leaf matches), return new search set and return TRUE
 	 */
-	return TRUE;
+	return *new != NULL;
 
 empty_set:
 	/*
@@ -1526,25 +1897,131 @@ void pre_scan(char *parent_name, unsigned int start_block, unsigned int offset,
 }
 
 
-void dir_scan(char *parent_name, unsigned int start_block, unsigned int offset,
-	struct pathnames *paths)
+/*
+ * Directories are scanned by scan threads, with each directory a separate
+ * piece of work taken from a shared stack.  Subdirectories found while
+ * scanning are pushed onto the stack for any free scan thread to pick up,
+ * and so many directories' files can be created and queued to the writer
+ * thread at once.
+ *
+ * A directory's attributes must be set after all its contents have been
+ * written, so it is only queued to the writer once it and all of its
+ * subdirectories have been finished.  pending counts these.
+ *
+ * With one scan thread (or when listing), subdirectories are scanned
+ * immediately, which gives the same order as a simple recursive scan
+ */
+struct scan_dir {
+	char			*pathname;
+	unsigned int		start_block;
+	unsigned int		offset;
+	struct pathnames	*paths;
+	struct dir		*dir;
+	struct scan_dir		*parent;
+	struct scan_dir		*next;
+	int			pending;
+};
+
+pthread_mutex_t scan_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t scan_wait = PTHREAD_COND_INITIALIZER;
+pthread_cond_t scan_done = PTHREAD_COND_INITIALIZER;
+struct scan_dir *scan_stack = NULL;
+int scan_threads, scan_finished;
+
+
+struct scan_dir *new_scan_dir(char *pathname, unsigned int start_block,
+	unsigned int offset, struct pathnames *paths, struct scan_dir *parent)
 {
-	unsigned int type;
-	char *name;
+	struct scan_dir *scan = malloc(sizeof(struct scan_dir));
+	if(scan == NULL)
+		EXIT_UNSQUASH("new_scan_dir: unable to malloc\n");
+
+	scan->pathname = pathname;
+	scan->start_block = start_block;
+	scan->offset = offset;
+	scan->paths = paths;
+	scan->dir = NULL;
+	scan->parent = parent;
+	scan->pending = 1;
+
+	if(parent) {
+		pthread_mutex_lock(&scan_mutex);
+		parent->pending ++;
+		pthread_mutex_unlock(&scan_mutex);
+	}
+
+	return scan;
+}
+
+
+/*
+ * Called when a directory, or one of its subdirectories, has been finished.
+ * If that was the last thing outstanding, queue the directory to the writer
+ * thread, and pass the completion up to its parent
+ */
+void finish_scan_dir(struct scan_dir *scan)
+{
+	while(scan) {
+		struct scan_dir *parent = scan->parent;
+		int pending;
+
+		pthread_mutex_lock(&scan_mutex);
+		pending = -- scan->pending;
+		pthread_mutex_unlock(&scan_mutex);
+
+		if(pending)
+			break;
+
+		if(scan->dir) {
+			/* with -tar the directory was written before its contents */
+			if(!lsonly && tar_fd == -1 && !verify)
+				queue_dir(scan->pathname, scan->dir);
+			squashfs_closedir(scan->dir);
+			inc_count(&dir_count);
+		}
+
+		if(parent == NULL) {
+			pthread_mutex_lock(&scan_mutex);
+			scan_finished = TRUE;
+			pthread_cond_signal(&scan_done);
+			pthread_mutex_unlock(&scan_mutex);
+		} else
+			free(scan->pathname);
+
+		free_subdir(scan->paths);
+		free(scan);
+		scan = parent;
+	}
+}
+
+
+void dir_scan(struct scan_dir *scan)
+{
+	unsigned int type, start_block, offset;
+	char *name, *parent_name = scan->pathname;
 	struct pathnames *new;
-	struct inode *i;
-	struct dir *dir = s_ops.squashfs_opendir(start_block, offset, &i);
+	struct inode *i, inode;
+	struct dir *dir;
+
+	pthread_mutex_lock(&inode_mutex);
+	dir = s_ops.squashfs_opendir(scan->start_block, scan->offset, &i);
+	if(dir && (lsonly || info))
+		print_filename(parent_name, i);
+	pthread_mutex_unlock(&inode_mutex);
 
 	if(dir == NULL) {
 		ERROR("dir_scan: failed to read directory %s, skipping\n",
 			parent_name);
-		return;
+		if(verify)
+			inc_count(&verify_errors);
+		goto finished;
 	}
 
-	if(lsonly || info)
-		print_filename(parent_name, i);
-
-	if(!lsonly) {
+	if(tar_fd != -1)
+		tar_dir(parent_name, dir);
+	else if(verify)
+		verify_dir(parent_name, dir);
+	else if(!lsonly) {
 		/*
 		 * Make directory with default User rwx permissions rather than
 		 * the permissions from the filesystem, as these may not have
@@ -1562,7 +2039,7 @@ void dir_scan(char *parent_name, unsigned int start_block, unsigned int offset,
 					"because %s\n", parent_name,
 					strerror(errno));
 				squashfs_closedir(dir);
-				return;
+				goto finished;
 			} 
 
 			/*
@@ -1585,7 +2062,7 @@ void dir_scan(char *parent_name, unsigned int start_block, unsigned int offset,
 			name, start_block, offset, type);
 
 
-		if(!matches(paths, name, &new))
+		if(!matches(scan->paths, name, &new))
 			continue;
 
 		res = asprintf(&pathname, "%s/%s", parent_name, name);
@@ -1593,33 +2070,99 @@ void dir_scan(char *parent_name, unsigned int start_block, unsigned int offset,
 			EXIT_UNSQUASH("asprintf failed in dir_scan\n");
 
 		if(type == SQUASHFS_DIR_TYPE) {
-			dir_scan(pathname, start_block, offset, new);
-			free(pathname);
+			struct scan_dir *sub = new_scan_dir(pathname,
+				start_block, offset, new, scan);
+
+			if(scan_threads == 1)
+				dir_scan(sub);
+			else {
+				pthread_mutex_lock(&scan_mutex);
+				sub->next = scan_stack;
+				scan_stack = sub;
+				pthread_cond_signal(&scan_wait);
+				pthread_mutex_unlock(&scan_mutex);
+			}
+			continue;
 		} else if(new == NULL) {
-			update_info(pathname);
-
-			i = s_ops.read_inode(start_block, offset);
-
+			/*
+			 * read_inode() returns a static inode, take a copy
+			 * for use outside the inode_mutex
+			 */
+			pthread_mutex_lock(&inode_mutex);
+			inode = *s_ops.read_inode(start_block, offset);
 			if(lsonly || info)
-				print_filename(pathname, i);
+				print_filename(pathname, &inode);
+			pthread_mutex_unlock(&inode_mutex);
 
 			if(!lsonly)
-				create_inode(pathname, i);
+				create_inode(pathname, &inode);
 
-			if(i->type == SQUASHFS_SYMLINK_TYPE ||
-					i->type == SQUASHFS_LSYMLINK_TYPE)
-				free(i->symlink);
+			if(inode.type == SQUASHFS_SYMLINK_TYPE ||
+					inode.type == SQUASHFS_LSYMLINK_TYPE)
+				free(inode.symlink);
+
+			update_info(pathname);
 		} else
 			free(pathname);
 
 		free_subdir(new);
 	}
 
-	if(!lsonly)
-		queue_dir(parent_name, dir);
+	scan->dir = dir;
 
-	squashfs_closedir(dir);
-	dir_count ++;
+finished:
+	finish_scan_dir(scan);
+}
+
+
+void *scan_thread(void *arg)
+{
+	while(1) {
+		struct scan_dir *scan;
+
+		pthread_mutex_lock(&scan_mutex);
+		while(scan_stack == NULL)
+			pthread_cond_wait(&scan_wait, &scan_mutex);
+		scan = scan_stack;
+		scan_stack = scan->next;
+		pthread_mutex_unlock(&scan_mutex);
+
+		dir_scan(scan);
+	}
+}
+
+
+void scan_filesystem(char *dest, struct pathnames *paths)
+{
+	struct scan_dir *root = new_scan_dir(dest,
+		SQUASHFS_INODE_BLK(sBlk.s.root_inode),
+		SQUASHFS_INODE_OFFSET(sBlk.s.root_inode), paths, NULL);
+	pthread_t *scanner;
+	int i;
+
+	/* listing must be printed in order, as must the tar archive */
+	scan_threads = lsonly || info || tar_fd != -1 ? 1 : processors;
+
+	if(scan_threads == 1) {
+		dir_scan(root);
+		return;
+	}
+
+	scanner = malloc(scan_threads * sizeof(pthread_t));
+	if(scanner == NULL)
+		EXIT_UNSQUASH("Out of memory allocating scan threads\n");
+
+	for(i = 0; i < scan_threads; i++)
+		if(pthread_create(&scanner[i], NULL, scan_thread, NULL) != 0)
+			EXIT_UNSQUASH("Failed to create thread\n");
+
+	pthread_mutex_lock(&scan_mutex);
+	root->next = scan_stack;
+	scan_stack = root;
+	pthread_cond_signal(&scan_wait);
+	while(!scan_finished)
+		pthread_cond_wait(&scan_done, &scan_mutex);
+	pthread_mutex_unlock(&scan_mutex);
 }
 
 
@@ -1959,8 +2502,10 @@ struct pathname *process_extract_files(struct pathname *path, char *filename)
 		
 
 /*
- * reader thread.  This thread processes read requests queued by the
- * cache_get() routine.
+ * reader thread(s).  These process read requests queued by the
+ * cache_get() routine.  With more than one reader thread, up to readers
+ * block reads are in flight at once, which helps hide the latency of
+ * slow storage
  */
 void *reader(void *arg)
 {
@@ -1970,6 +2515,8 @@ void *reader(void *arg)
 			SQUASHFS_COMPRESSED_SIZE_BLOCK(entry->size),
 			entry->data);
 
+		entry->length = SQUASHFS_COMPRESSED_SIZE_BLOCK(entry->size);
+
 		if(res && SQUASHFS_COMPRESSED_BLOCK(entry->size))
 			/*
 			 * queue successfully read block to the inflate
@@ -1989,8 +2536,10 @@ void *reader(void *arg)
 
 
 /*
- * writer thread.  This processes file write requests queued by the
- * write_file() routine.
+ * writer thread(s).  These process file write requests queued by the
+ * write_file() routine.  Each writer thread takes a whole file off the
+ * to_writer queue, and then takes the file's blocks off the file's own
+ * queue, which allows more than one file to be written at once
  */
 void *writer(void *arg)
 {
@@ -1998,13 +2547,21 @@ void *writer(void *arg)
 
 	while(1) {
 		struct squashfs_file *file = queue_get(to_writer);
-		int file_fd;
-		long long hole = 0;
+		int file_fd, sparse;
+		long long off = 0;
 		int failed = FALSE;
-		int error;
 
 		if(file == NULL) {
-			queue_put(from_writer, NULL);
+			/*
+			 * end of the files, each writer thread is queued one
+			 * NULL, and so must stop after seeing it
+			 */
+			return NULL;
+		} else if(tar_fd != -1) {
+			tar_write_file(file);
+			continue;
+		} else if(verify) {
+			verify_write_file(file);
 			continue;
 		} else if(file->fd == -1) {
 			/* write attributes for directory file->pathname */
@@ -2019,73 +2576,48 @@ void *writer(void *arg)
 
 		file_fd = file->fd;
 
-		for(i = 0; i < file->blocks; i++, cur_blocks ++) {
-			struct file_entry *block = queue_get(to_writer);
-
-			if(block->buffer == 0) { /* sparse file */
-				hole += block->size;
-				free(block);
-				continue;
-			}
-
-			cache_block_wait(block->buffer);
+		/*
+		 * A sparse file is extended to its full size with a single
+		 * ftruncate() first, and then only its data blocks are
+		 * written.  If that fails its holes are written as zeros
+		 */
+		sparse = file->sparse && ftruncate(file_fd, file->file_size)
+			!= -1;
 
-			if(block->buffer->error)
-				failed = TRUE;
+		for(i = 0; i < file->blocks; i++, inc_count(&cur_blocks)) {
+			struct file_entry *block = queue_get(file->queue);
 
-			if(failed)
-				continue;
+			if(block->buffer) {
+				cache_block_wait(block->buffer);
 
-			error = write_block(file_fd, block->buffer->data +
-				block->offset, block->size, hole, file->sparse);
+				if(block->buffer->error)
+					failed = TRUE;
+			}
 
-			if(error == FALSE) {
+			if(failed == FALSE && write_block(file_fd, block, off,
+					sparse) == FALSE) {
 				ERROR("writer: failed to write data block %d\n",
 					i);
 				failed = TRUE;
 			}
 
-			hole = 0;
-			cache_block_put(block->buffer);
+			off += block->size;
+			if(block->buffer)
+				cache_block_put(block->buffer);
 			free(block);
 		}
 
-		if(hole && failed == FALSE) {
-			/*
-			 * corner case for hole extending to end of file
-			 */
-			if(file->sparse == FALSE ||
-					lseek(file_fd, hole, SEEK_CUR) == -1) {
-				/*
-				 * for files which we don't want to write
-				 * sparsely, or for broken lseeks which cannot
-				 * seek beyond end of file, write_block will do
-				 * the right thing
-				 */
-				hole --;
-				if(write_block(file_fd, "\0", 1, hole,
-						file->sparse) == FALSE) {
-					ERROR("writer: failed to write sparse "
-						"data block\n");
-					failed = TRUE;
-				}
-			} else if(ftruncate(file_fd, file->file_size) == -1) {
-				ERROR("writer: failed to write sparse data "
-					"block\n");
-				failed = TRUE;
-			}
-		}
-
 		close_wake(file_fd);
 		if(failed == FALSE)
 			set_attributes(file->pathname, file->mode, file->uid,
-				file->gid, file->time, file->xattr, force);
+				file->gid, file->time, file->xattr, force ||
+				(disk_order && !(file->mode & S_IWUSR)));
 		else {
 			ERROR("Failed to write %s, skipping\n", file->pathname);
 			unlink(file->pathname);
 		}
 		free(file->pathname);
-		free(file);
+		release_file(file);
 
 	}
 }
@@ -2097,12 +2629,17 @@ void *writer(void *arg)
 void *inflator(void *arg)
 {
 	char tmp[block_size];
+	void *strm;
+
+	if(compressor_uncompress_init(comp, &strm) == -1)
+		EXIT_UNSQUASH("inflator: failed to initialise %s "
+			"decompressor\n", comp->name);
 
 	while(1) {
 		struct cache_entry *entry = queue_get(to_inflate);
 		int error, res;
 
-		res = compressor_uncompress(comp, tmp, entry->data,
+		res = compressor_uncompress(comp, strm, tmp, entry->data,
 			SQUASHFS_COMPRESSED_SIZE_BLOCK(entry->size), block_size,
 			&error);
 
@@ -2112,6 +2649,8 @@ void *inflator(void *arg)
 		else
 			memcpy(entry->data, tmp, res);
 
+		entry->length = res;
+
 		/*
 		 * block has been either successfully decompressed, or an error
  		 * occurred, clear pending flag, set error appropriately and
@@ -2164,6 +2703,32 @@ void *progress_thread(void *arg)
 }
 
 
+void count_processors()
+{
+	if(processors == -1) {
+#ifndef linux
+		int mib[2];
+		size_t len = sizeof(processors);
+
+		mib[0] = CTL_HW;
+#ifdef HW_AVAILCPU
+		mib[1] = HW_AVAILCPU;
+#else
+		mib[1] = HW_NCPU;
+#endif
+
+		if(sysctl(mib, 2, &processors, &len, NULL, 0) == -1) {
+			ERROR("Failed to get number of available processors.  "
+				"Defaulting to 1\n");
+			processors = 1;
+		}
+#else
+		processors = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	}
+}
+
+
 void initialise_threads(int fragment_buffer_size, int data_buffer_size)
 {
 	struct rlimit rlim;
@@ -2189,36 +2754,22 @@ void initialise_threads(int fragment_buffer_size, int data_buffer_size)
 		EXIT_UNSQUASH("Failed to set signal mask in initialise_threads"
 			"\n");
 
-	if(processors == -1) {
-#ifndef linux
-		int mib[2];
-		size_t len = sizeof(processors);
-
-		mib[0] = CTL_HW;
-#ifdef HW_AVAILCPU
-		mib[1] = HW_AVAILCPU;
-#else
-		mib[1] = HW_NCPU;
-#endif
-
-		if(sysctl(mib, 2, &processors, &len, NULL, 0) == -1) {
-			ERROR("Failed to get number of available processors.  "
-				"Defaulting to 1\n");
-			processors = 1;
-		}
-#else
-		processors = sysconf(_SC_NPROCESSORS_ONLN);
-#endif
-	}
+	count_processors();
 
-	if(add_overflow(processors, 3) ||
-			multiply_overflow(processors + 3, sizeof(pthread_t)))
+	if(add_overflow(processors, readers) ||
+			add_overflow(processors + readers, writers) ||
+			add_overflow(processors + readers + writers, 1) ||
+			multiply_overflow(processors + readers + writers + 1,
+			sizeof(pthread_t)))
 		EXIT_UNSQUASH("Processors too large\n");
 
-	thread = malloc((3 + processors) * sizeof(pthread_t));
+	thread = malloc((1 + readers + writers + processors) *
+		sizeof(pthread_t));
 	if(thread == NULL)
 		EXIT_UNSQUASH("Out of memory allocating thread descriptors\n");
 	inflator_thread = &thread[3];
+	reader_thread = &inflator_thread[processors];
+	writer_thread = &reader_thread[readers - 1];
 
 	/*
 	 * dimensioning the to_reader and to_inflate queues.  The size of
@@ -2315,10 +2866,12 @@ void initialise_threads(int fragment_buffer_size, int data_buffer_size)
 		to_writer = queue_init(all_buffers_size * 2);
 	}
 
-	from_writer = queue_init(1);
-
 	fragment_cache = cache_init(block_size, fragment_buffer_size);
 	data_cache = cache_init(block_size, data_buffer_size);
+
+	zero_data = calloc(block_size, 1);
+	if(zero_data == NULL)
+		EXIT_UNSQUASH("Out of memory in initialise_threads\n");
 	pthread_create(&thread[0], NULL, reader, NULL);
 	pthread_create(&thread[1], NULL, writer, NULL);
 	pthread_create(&thread[2], NULL, progress_thread, NULL);
@@ -2331,6 +2884,18 @@ void initialise_threads(int fragment_buffer_size, int data_buffer_size)
 			EXIT_UNSQUASH("Failed to create thread\n");
 	}
 
+	/* thread[0] is the first reader thread, create any others */
+	for(i = 0; i < readers - 1; i++) {
+		if(pthread_create(&reader_thread[i], NULL, reader, NULL) != 0)
+			EXIT_UNSQUASH("Failed to create thread\n");
+	}
+
+	/* thread[1] is the first writer thread, create any others */
+	for(i = 0; i < writers - 1; i++) {
+		if(pthread_create(&writer_thread[i], NULL, writer, NULL) != 0)
+			EXIT_UNSQUASH("Failed to create thread\n");
+	}
+
 	printf("Parallel unsquashfs: Using %d processor%s\n", processors,
 			processors == 1 ? "" : "s");
 
@@ -2340,6 +2905,25 @@ void initialise_threads(int fragment_buffer_size, int data_buffer_size)
 }
 
 
+void initialise_list()
+{
+	/*
+	 * Listing reads the inode and directory tables directly, and never
+	 * reads file data, so no reader, inflator or writer threads, nor
+	 * data and fragment caches are needed.  The listing is written
+	 * through one large stdout buffer rather than a write per line
+	 */
+	count_processors();
+	tzset();
+
+	if(setvbuf(stdout, NULL, _IOFBF, LIST_BUFFER_SIZE) != 0)
+		ERROR("Failed to set the stdout buffer size\n");
+
+	printf("Parallel unsquashfs: Using %d processor%s\n", processors,
+			processors == 1 ? "" : "s");
+}
+
+
 void enable_progress_bar()
 {
 	pthread_mutex_lock(&screen_mutex);
@@ -2496,7 +3080,7 @@ int parse_number(char *arg, int *res)
 	printf("GNU General Public License for more details.\n");
 int main(int argc, char *argv[])
 {
-	char *dest = "squashfs-root";
+	char *dest = "squashfs-root", *tar_file = NULL;
 	int i, stat_sys = FALSE, version = FALSE;
 	int n;
 	struct pathnames *paths = NULL;
@@ -2558,7 +3142,43 @@ int main(int argc, char *argv[])
 					argv[0]);
 				exit(1);
 			}
-		} else if(strcmp(argv[i], "-data-queue") == 0 ||
+		} else if(strcmp(argv[i], "-readers") == 0) {
+			if((++i == argc) ||
+					!parse_number(argv[i], &readers)) {
+				ERROR("%s: -readers missing or invalid "
+					"reader number\n", argv[0]);
+				exit(1);
+			}
+			if(readers < 1) {
+				ERROR("%s: -readers should be 1 or larger\n",
+					argv[0]);
+				exit(1);
+			}
+		} else if(strcmp(argv[i], "-writers") == 0) {
+			if((++i == argc) ||
+					!parse_number(argv[i], &writers)) {
+				ERROR("%s: -writers missing or invalid "
+					"writer number\n", argv[0]);
+				exit(1);
+			}
+			if(writers < 1) {
+				ERROR("%s: -writers should be 1 or larger\n",
+					argv[0]);
+				exit(1);
+			}
+		} else if(strcmp(argv[i], "-disk-order") == 0)
+			disk_order = TRUE;
+		else if(strcmp(argv[i], "-verify") == 0)
+			verify = TRUE;
+		else if(strcmp(argv[i], "-tar") == 0) {
+			if(++i == argc) {
+				fprintf(stderr, "%s: -tar missing filename\n",
+					argv[0]);
+				exit(1);
+			}
+			tar_file = argv[i];
+		}
+		else if(strcmp(argv[i], "-data-queue") == 0 ||
 					 strcmp(argv[i], "-da") == 0) {
 			if((++i == argc) ||
 					!parse_number(argv[i],
@@ -2618,6 +3238,24 @@ int main(int argc, char *argv[])
 	if(lsonly || info)
 		progress = FALSE;
 
+	if(tar_file && (lsonly || disk_order)) {
+		ERROR("%s: -tar can't be used with -ls, -lls or -disk-order\n",
+			argv[0]);
+		exit(1);
+	}
+
+	if(verify && (tar_file || lsonly || disk_order)) {
+		ERROR("%s: -verify can't be used with -tar, -ls, -lls or "
+			"-disk-order\n", argv[0]);
+		exit(1);
+	}
+
+#ifdef XATTR_SUPPORT
+	/* -verify reads all the metadata, xattrs included */
+	if(verify)
+		no_xattrs = FALSE;
+#endif
+
 #ifdef SQUASHFS_TRACE
 	/*
 	 * Disable progress bar if full debug tracing is enabled.
@@ -2648,6 +3286,21 @@ options:
 			ERROR("\t-p[rocessors] <number>\tuse <number> "
 				"processors.  By default will use\n");
 			ERROR("\t\t\t\tnumber of processors available\n");
+			ERROR("\t-readers <number>\tuse <number> reader threads, "
+				"keeping up to\n\t\t\t\t<number> block reads in "
+				"flight.  Default 1\n");
+			ERROR("\t-writers <number>\tuse <number> writer threads, "
+				"writing up to\n\t\t\t\t<number> files at "
+				"once.  Default 1\n");
+			ERROR("\t-disk-order\t\twrite files in the order "
+				"their data is on disk,\n\t\t\t\trather than "
+				"directory order\n");
+			ERROR("\t-tar <file>\t\twrite a tar archive to <file> "
+				"(or - for stdout)\n\t\t\t\trather than "
+				"creating the files\n");
+			ERROR("\t-verify\t\t\tcheck the filesystem, reading "
+				"and decompressing\n\t\t\t\tevery block once, "
+				"rather than creating the\n\t\t\t\tfiles\n");
 			ERROR("\t-i[nfo]\t\t\tprint files as they are "
 				"unsquashed\n");
 			ERROR("\t-li[nfo]\t\tprint files as they are "
@@ -2720,6 +3373,20 @@ options:
 		EXIT_UNSQUASH("Block size and block_log do not match."
 			"  File system is corrupt.\n");
 
+	if(tar_file) {
+		/*
+		 * The archive is written by one writer thread, in the order
+		 * the filesystem is scanned, with names relative to "."
+		 */
+		tar_open(tar_file);
+		writers = 1;
+		dest = ".";
+	}
+
+	/* nothing is created, so name the files relative to "." */
+	if(verify)
+		dest = ".";
+
 	/*
 	 * convert from queue size in Mbytes to queue size in
 	 * blocks.
@@ -2737,7 +3404,10 @@ options:
 	else
 		data_buffer_size <<= 20 - block_log;
 
-	initialise_threads(fragment_buffer_size, data_buffer_size);
+	if(lsonly)
+		initialise_list();
+	else
+		initialise_threads(fragment_buffer_size, data_buffer_size);
 
 	fragment_data = malloc(block_size);
 	if(fragment_data == NULL)
@@ -2763,13 +3433,10 @@ options:
 	if(s_ops.read_fragment_table(&directory_table_end) == FALSE)
 		EXIT_UNSQUASH("failed to read fragment table\n");
 
-	if(read_inode_table(sBlk.s.inode_table_start,
-				sBlk.s.directory_table_start) == FALSE)
-		EXIT_UNSQUASH("failed to read inode table\n");
-
-	if(read_directory_table(sBlk.s.directory_table_start,
-				directory_table_end) == FALSE)
-		EXIT_UNSQUASH("failed to read directory table\n");
+	inode_cache = metadata_cache_init(sBlk.s.inode_table_start,
+		sBlk.s.directory_table_start, METADATA_CACHE_BLOCKS);
+	directory_cache = metadata_cache_init(sBlk.s.directory_table_start,
+		directory_table_end, METADATA_CACHE_BLOCKS);
 
 	if(no_xattrs)
 		sBlk.s.xattr_id_table_start = SQUASHFS_INVALID_BLK;
@@ -2777,7 +3444,11 @@ options:
 	if(read_xattrs_from_disk(fd, &sBlk.s) == 0)
 		EXIT_UNSQUASH("failed to read the xattr table\n");
 
+	if(verify)
+		verify_init();
+
 	if(path) {
+		compile_path(path);
 		paths = init_subdir();
 		paths = add_subdir(paths, path);
 	}
@@ -2793,14 +3464,31 @@ options:
 
 	enable_progress_bar();
 
-	dir_scan(dest, SQUASHFS_INODE_BLK(sBlk.s.root_inode),
-		SQUASHFS_INODE_OFFSET(sBlk.s.root_inode), paths);
+	scan_filesystem(dest, paths);
+
+	if(disk_order)
+		write_disk_order();
+
+	if(verify && path == NULL)
+		verify_fragments();
 
-	queue_put(to_writer, NULL);
-	queue_get(from_writer);
+	if(!lsonly) {
+		for(i = 0; i < writers; i++)
+			queue_put(to_writer, NULL);
+		pthread_join(thread[1], NULL);
+		for(i = 0; i < writers - 1; i++)
+			pthread_join(writer_thread[i], NULL);
+	}
+	set_dir_attributes();
+
+	if(tar_fd != -1)
+		tar_close();
 
 	disable_progress_bar();
 
+	if(verify)
+		return verify_finish();
+
 	if(!lsonly) {
 		printf("\n");
 		printf("created %d files\n", file_count);
@@ -57,6 +57,8 @@
 
 #include "squashfs_fs.h"
 #include "error.h"
+#include "queue.h"
+#include "pool.h"
 
 #define CALCULATE_HASH(start)	(start & 0xffff)
 
@@ -72,15 +74,10 @@ struct super_block {
 	long long		guid_start;
 };
 
-struct hash_table_entry {
-	long long	start;
-	int		bytes;
-	struct hash_table_entry *next;
-};
-
 struct inode {
 	int blocks;
-	char *block_ptr;
+	long long block_start;
+	int block_offset;
 	long long data;
 	int fragment;
 	int frag_bytes;
@@ -103,8 +100,8 @@ typedef struct squashfs_operations {
 	void (*read_fragment)(unsigned int fragment, long long *start_block,
 		int *size);
 	int (*read_fragment_table)(long long *);
-	void (*read_block_list)(unsigned int *block_list, char *block_ptr,
-		int blocks);
+	void (*read_block_list)(unsigned int *block_list, long long start,
+		int offset, int blocks);
 	struct inode *(*read_inode)(unsigned int start_block,
 		unsigned int offset);
 	int (*read_uids_guids)();
@@ -130,6 +127,7 @@ struct cache {
 	pthread_mutex_t	mutex;
 	pthread_cond_t wait_for_free;
 	pthread_cond_t wait_for_pending;
+	struct buffer_pool *pool;
 	struct cache_entry *free_list;
 	struct cache_entry *hash_table[65536];
 };
@@ -142,6 +140,7 @@ struct cache_entry {
 	int	used;
 	int error;
 	int	pending;
+	int	length;
 	struct cache_entry *hash_next;
 	struct cache_entry *hash_prev;
 	struct cache_entry *free_next;
@@ -149,17 +148,39 @@ struct cache_entry {
 	char *data;
 };
 
-/* struct describing queues used to pass data between threads */
-struct queue {
-	int	size;
-	int	readp;
-	int	writep;
+/*
+ * struct describing a cached metadata (inode or directory table) block.
+ * start is the location of the block on disk, and next is the location
+ * of the following block
+ */
+struct metadata_entry {
+	long long start;
+	long long next;
+	int	length;
+	struct metadata_entry *hash_next;
+	struct metadata_entry *lru_next;
+	struct metadata_entry *lru_prev;
+	char data[SQUASHFS_METADATA_SIZE];
+};
+
+/*
+ * LRU cache of the metadata blocks of the inode or directory table, which
+ * lies between start and end on disk
+ */
+struct metadata_cache {
+	long long start;
+	long long end;
+	int	max_entries;
+	int	count;
 	pthread_mutex_t	mutex;
-	pthread_cond_t empty;
-	pthread_cond_t full;
-	void **data;
+	struct metadata_entry *lru;
+	struct metadata_entry *hash_table[65536];
 };
 
+
+/* number of metadata blocks cached for each of the inode and directory tables */
+#define METADATA_CACHE_BLOCKS 2048
+
 /* default size of fragment buffer in Mbytes */
 #define FRAGMENT_BUFFER_DEFAULT 256
 /* default size of data buffer in Mbytes */
@@ -185,10 +206,16 @@ struct dir {
 	struct dir_ent	*dirs;
 };
 
+/*
+ * A block queued to the writer.  Buffer is NULL for a hole, or for an
+ * uncompressed block the writer copies straight from the filesystem at
+ * start (-1 for a hole)
+ */
 struct file_entry {
 	int offset;
 	int size;
 	struct cache_entry *buffer;
+	long long start;
 };
 
 
@@ -203,17 +230,80 @@ struct squashfs_file {
 	char *pathname;
 	char sparse;
 	unsigned int xattr;
+	char *link;
+	unsigned int rdev;
+	struct queue *queue;
+	struct squashfs_file *next;
+	int users;
+};
+
+/*
+ * struct describing a regular file whose data is written later, in the
+ * order of its location on disk.  location is the fragment block of files
+ * with a tail end, otherwise start, the first data block
+ */
+struct disk_order_file {
+	long long location;
+	long long start;
+	int order;
+	char *pathname;
+	struct inode inode;
 };
 
+/*
+ * -verify table of the data and fragment blocks read, hashed on their
+ * location.  size is how much of the block the files referring to it use,
+ * length how much it decompressed to (-1 if it couldn't be read)
+ */
+#define VERIFY_HASH_SIZE 65536
+#define VERIFY_HASH(start) ((start) & (VERIFY_HASH_SIZE - 1))
+
+struct verify_block {
+	long long start;
+	int c_byte;
+	int size;
+	int length;
+	char fragment;
+	char *pathname;
+	struct verify_block *next;
+};
+
+/*
+ * -lls user and group names, looked up once per id rather than once per
+ * listed file
+ */
+#define ID_NAME_HASH_SIZE 256
+#define ID_NAME_HASH(id) ((id) & (ID_NAME_HASH_SIZE - 1))
+
+struct id_name {
+	unsigned int id;
+	char *name;
+	struct id_name *next;
+};
+
+/* size of the stdout buffer a listing is written through */
+#define LIST_BUFFER_SIZE (1024 * 1024)
+
 struct path_entry {
 	char *name;
 	regex_t *preg;
 	struct pathname *paths;
+	int next;
 };
 
+/*
+ * Once all the extract files have been added, compile_path() indexes the
+ * names at each level: names without wildcard characters go into a hash
+ * table (literal), and only the remaining names (glob) are matched by
+ * fnmatch or regexec
+ */
 struct pathname {
 	int names;
 	struct path_entry *name;
+	int *literal;
+	int literal_mask;
+	int *glob;
+	int globs;
 };
 
 struct pathnames {
@@ -226,12 +316,11 @@ struct pathnames {
 extern struct super_block sBlk;
 extern squashfs_operations s_ops;
 extern int swap;
-extern char *inode_table, *directory_table;
-extern struct hash_table_entry *inode_table_hash[65536],
-	*directory_table_hash[65536];
+extern struct metadata_cache *inode_cache, *directory_cache;
 extern unsigned int *uid_table, *guid_table;
 extern pthread_mutex_t screen_mutex;
 extern int progress_enabled;
+extern int lsonly;
 extern int inode_number;
 extern int lookup_type[];
 extern int fd;
@@ -239,16 +328,27 @@ extern struct queue *to_reader, *to_inflate, *to_writer;
 extern struct cache *fragment_cache, *data_cache;
 
 /* unsquashfs.c */
-extern int lookup_entry(struct hash_table_entry **, long long);
+extern int read_metadata(struct metadata_cache *, long long *, int *, void *,
+	int);
+extern int read_inode_data(void *, long long, int, int);
 extern int read_fs_bytes(int fd, long long, int, void *);
 extern int read_block(int, long long, long long *, int, void *);
+extern int write_bytes(int, char *, int);
+extern struct squashfs_file *queue_file(char *, int, struct inode *);
+extern void queue_file_data(struct inode *, char *, int);
+extern void release_file(struct squashfs_file *);
+extern void set_created(struct inode *, char *);
+extern void inc_count(int *);
+extern struct cache_entry *cache_get(struct cache *, long long, int);
+extern void cache_block_wait(struct cache_entry *);
+extern void cache_block_put(struct cache_entry *);
+extern int file_count, sym_count, dev_count, fifo_count;
 extern void enable_progress_bar();
 extern void disable_progress_bar();
-extern void dump_queue(struct queue *);
 extern void dump_cache(struct cache *);
 
 /* unsquash-1.c */
-extern void read_block_list_1(unsigned int *, char *, int);
+extern void read_block_list_1(unsigned int *, long long, int, int);
 extern int read_fragment_table_1(long long *);
 extern struct inode *read_inode_1(unsigned int, unsigned int);
 extern struct dir *squashfs_opendir_1(unsigned int, unsigned int,
@@ -256,7 +356,7 @@ extern struct dir *squashfs_opendir_1(unsigned int, unsigned int,
 extern int read_uids_guids_1();
 
 /* unsquash-2.c */
-extern void read_block_list_2(unsigned int *, char *, int);
+extern void read_block_list_2(unsigned int *, long long, int, int);
 extern int read_fragment_table_2(long long *);
 extern void read_fragment_2(unsigned int, long long *, int *);
 extern struct inode *read_inode_2(unsigned int, unsigned int);
@@ -275,4 +375,21 @@ extern struct inode *read_inode_4(unsigned int, unsigned int);
 extern struct dir *squashfs_opendir_4(unsigned int, unsigned int,
 	struct inode **);
 extern int read_uids_guids_4();
+
+/* unsquashfs_tar.c */
+extern int tar_fd;
+extern void tar_open(char *);
+extern void tar_close();
+extern void tar_write_file(struct squashfs_file *);
+extern void tar_dir(char *, struct dir *);
+extern int tar_inode(char *, struct inode *, char *);
+
+/* unsquashfs_verify.c */
+extern int verify, verify_errors;
+extern void verify_init();
+extern void verify_dir(char *, struct dir *);
+extern int verify_inode(char *, struct inode *, char *);
+extern void verify_fragments();
+extern void verify_write_file(struct squashfs_file *);
+extern int verify_finish();
 #endif
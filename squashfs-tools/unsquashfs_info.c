@@ -43,25 +43,34 @@
 
 static int silent = 0;
 char *pathname = NULL;
+pthread_mutex_t info_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 pthread_t info_thread;
 
 
 void disable_info()
 {
+	pthread_mutex_lock(&info_mutex);
 	if(pathname)
 		free(pathname);
 
 	pathname = NULL;
+	pthread_mutex_unlock(&info_mutex);
 }
 
 
+/*
+ * Called by the scan thread(s) and so protected by info_mutex.  Name is
+ * freed when the next one replaces it
+ */
 void update_info(char *name)
 {
+	pthread_mutex_lock(&info_mutex);
 	if(pathname)
 		free(pathname);
 
 	pathname = name;
+	pthread_mutex_unlock(&info_mutex);
 }
 
 
@@ -127,8 +136,10 @@ void *info_thrd(void *arg)
 		}
 
 		if(sig == SIGQUIT && !waiting) {
+			pthread_mutex_lock(&info_mutex);
 			if(pathname)
 				INFO("%s\n", pathname);
+			pthread_mutex_unlock(&info_mutex);
 
 			/* set one second interval period, if ^\ received
 			   within then, dump queue and cache status */
@@ -0,0 +1,468 @@
+/*
+ * Unsquash a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2014
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * unsquashfs_tar.c
+ *
+ * -tar writes the filesystem as a pax (POSIX.1-2001) tar archive rather than
+ * creating the files.  The archive entries are queued to the writer thread in
+ * the order the filesystem is scanned, the regular files with their data
+ * blocks as normal, and the writer thread writes each entry's header followed
+ * by its data straight from the cache.  Names and link targets too long for
+ * the ustar header, large sizes, uids and gids, and xattrs are stored in a
+ * pax extended header before the entry
+ */
+
+#include "unsquashfs.h"
+#include "xattr.h"
+
+#define TAR_BLOCK_SIZE	512
+#define TAR_PAX_NAME	"././@PaxHeader"
+
+/* the largest values which fit the ustar octal fields */
+#define TAR_SIZE_MAX	077777777777LL
+#define TAR_ID_MAX	07777777
+
+extern int block_size;
+extern int user_xattrs;
+extern int cur_blocks;
+extern pthread_mutex_t queue_mutex;
+
+struct tar_header {
+	char	name[100];
+	char	mode[8];
+	char	uid[8];
+	char	gid[8];
+	char	size[12];
+	char	mtime[12];
+	char	checksum[8];
+	char	type;
+	char	link[100];
+	char	magic[6];
+	char	version[2];
+	char	uname[32];
+	char	gname[32];
+	char	major[8];
+	char	minor[8];
+	char	prefix[155];
+	char	padding[12];
+};
+
+/* pax extended header records being built for the next entry */
+struct tar_pax {
+	char	*data;
+	int	size;
+	int	used;
+};
+
+int tar_fd = -1;
+static char *zero_block;
+
+
+/*
+ * Open the archive.  When writing to stdout, stdout is moved to stderr, so
+ * the progress bar and any other output doesn't corrupt the archive
+ */
+void tar_open(char *filename)
+{
+	if(strcmp(filename, "-") == 0) {
+		tar_fd = dup(STDOUT_FILENO);
+		if(tar_fd == -1 || dup2(STDERR_FILENO, STDOUT_FILENO) == -1)
+			EXIT_UNSQUASH("tar_open: failed to redirect stdout, "
+				"because %s\n", strerror(errno));
+	} else {
+		tar_fd = open(filename, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+		if(tar_fd == -1)
+			EXIT_UNSQUASH("tar_open: failed to create %s, because "
+				"%s\n", filename, strerror(errno));
+	}
+
+	zero_block = calloc(1, block_size);
+	if(zero_block == NULL)
+		EXIT_UNSQUASH("tar_open: out of memory\n");
+}
+
+
+static void tar_write(void *buffer, long long bytes)
+{
+	if(write_bytes(tar_fd, buffer, bytes) == -1)
+		EXIT_UNSQUASH("Failed to write tar archive\n");
+}
+
+
+static void tar_pad(long long bytes)
+{
+	int padding = (TAR_BLOCK_SIZE - (bytes % TAR_BLOCK_SIZE)) %
+		TAR_BLOCK_SIZE;
+
+	if(padding)
+		tar_write(zero_block, padding);
+}
+
+
+/* write the two zero blocks which end the archive, and close it */
+void tar_close()
+{
+	int i;
+
+	for(i = 0; i < 2; i++)
+		tar_write(zero_block, TAR_BLOCK_SIZE);
+
+	if(close(tar_fd) == -1)
+		EXIT_UNSQUASH("Failed to write tar archive, because %s\n",
+			strerror(errno));
+}
+
+
+static void pax_add(struct tar_pax *pax, char *key, void *value, int vsize)
+{
+	/* a record is "<length> <key>=<value>\n", length including itself */
+	int bytes = strlen(key) + vsize + 3, digits, len, n;
+
+	/* find the number of digits which, added to bytes, has that many */
+	for(digits = 1; ; digits ++) {
+		for(n = 1, len = bytes + digits; len >= 10; len /= 10)
+			n ++;
+		if(n == digits)
+			break;
+	}
+	len = bytes + digits;
+
+	if(pax->used + len + 1 > pax->size) {
+		pax->size = (pax->used + len + 1) * 2;
+		pax->data = realloc(pax->data, pax->size);
+		if(pax->data == NULL)
+			EXIT_UNSQUASH("pax_add: out of memory\n");
+	}
+
+	pax->used += sprintf(pax->data + pax->used, "%d %s=", len, key);
+	memcpy(pax->data + pax->used, value, vsize);
+	pax->used += vsize;
+	pax->data[pax->used ++] = '\n';
+}
+
+
+static void pax_number(struct tar_pax *pax, char *key, long long value)
+{
+	char buffer[24];
+
+	pax_add(pax, key, buffer, sprintf(buffer, "%lld", value));
+}
+
+
+static void pax_xattrs(struct tar_pax *pax, unsigned int xattr)
+{
+	unsigned int count;
+	struct xattr_list *xattr_list;
+	int i;
+
+	if(xattr == SQUASHFS_INVALID_XATTR ||
+			sBlk.s.xattr_id_table_start == SQUASHFS_INVALID_BLK)
+		return;
+
+	xattr_list = get_xattr(xattr, &count, 1);
+	if(xattr_list == NULL) {
+		ERROR("Failed to read xattrs\n");
+		return;
+	}
+
+	for(i = 0; i < count; i++) {
+		int prefix = xattr_list[i].type & SQUASHFS_XATTR_PREFIX_MASK;
+		char *key;
+
+		if(user_xattrs && prefix != SQUASHFS_XATTR_USER)
+			continue;
+
+		if(asprintf(&key, "SCHILY.xattr.%s", xattr_list[i].full_name)
+								== -1)
+			EXIT_UNSQUASH("pax_xattrs: asprintf failed\n");
+		pax_add(pax, key, xattr_list[i].value, xattr_list[i].vsize);
+		free(key);
+	}
+
+	free_xattr(xattr_list, count);
+}
+
+
+static void tar_octal(char *field, int size, long long value)
+{
+	snprintf(field, size, "%0*llo", size - 1, value);
+}
+
+
+static void tar_checksum(struct tar_header *header)
+{
+	unsigned char *p = (unsigned char *) header;
+	unsigned int sum = 0;
+	int i;
+
+	memset(header->checksum, ' ', sizeof(header->checksum));
+	for(i = 0; i < sizeof(*header); i++)
+		sum += p[i];
+
+	snprintf(header->checksum, sizeof(header->checksum), "%06o", sum);
+}
+
+
+/*
+ * Copy string into the zeroed header field of size bytes.  The field isn't
+ * NUL terminated if the string fills it, and longer strings are truncated
+ * (their full value is in the pax extended header)
+ */
+static void tar_string(char *field, size_t size, char *string)
+{
+	size_t len = strlen(string);
+
+	if(len > size)
+		len = size;
+
+	memcpy(field, string, len);
+}
+
+
+static void tar_header(struct tar_header *header, char *name, int mode,
+	long long size, long long mtime, int type)
+{
+	memset(header, 0, sizeof(*header));
+	tar_string(header->name, sizeof(header->name), name);
+	tar_octal(header->mode, sizeof(header->mode), mode & 07777);
+	tar_octal(header->size, sizeof(header->size), size);
+	tar_octal(header->mtime, sizeof(header->mtime), mtime);
+	header->type = type;
+	memcpy(header->magic, "ustar", 6);
+	memcpy(header->version, "00", 2);
+}
+
+
+/* write the header (and any pax extended header) of file */
+static void tar_write_header(struct squashfs_file *file)
+{
+	struct tar_header header;
+	struct tar_pax pax = { NULL, 0, 0 };
+	char *name = file->pathname;
+	long long size = 0;
+	int type, major = 0, minor = 0;
+
+	switch(file->mode & S_IFMT) {
+	case S_IFREG:
+		if(file->link)
+			type = '1';
+		else {
+			type = '0';
+			size = file->file_size;
+		}
+		break;
+	case S_IFDIR:
+		type = '5';
+		if(asprintf(&name, "%s/", file->pathname) == -1)
+			EXIT_UNSQUASH("tar_write_header: asprintf failed\n");
+		break;
+	case S_IFLNK:
+		type = '2';
+		break;
+	case S_IFCHR:
+	case S_IFBLK:
+		type = S_ISCHR(file->mode) ? '3' : '4';
+		major = (file->rdev >> 8) & 0xfff;
+		minor = (file->rdev & 0xff) | ((file->rdev >> 12) & 0xfff00);
+		break;
+	default:
+		type = '6';
+		break;
+	}
+
+	if(strlen(name) > sizeof(header.name))
+		pax_add(&pax, "path", name, strlen(name));
+	if(file->link && strlen(file->link) > sizeof(header.link))
+		pax_add(&pax, "linkpath", file->link, strlen(file->link));
+	if(size > TAR_SIZE_MAX)
+		pax_number(&pax, "size", size);
+	if(file->uid > TAR_ID_MAX)
+		pax_number(&pax, "uid", file->uid);
+	if(file->gid > TAR_ID_MAX)
+		pax_number(&pax, "gid", file->gid);
+	if(file->time < 0 || file->time > TAR_SIZE_MAX)
+		pax_number(&pax, "mtime", file->time);
+	if(!file->link || type != '1')
+		pax_xattrs(&pax, file->xattr);
+
+	if(pax.used) {
+		tar_header(&header, TAR_PAX_NAME, 0644, pax.used, 0, 'x');
+		tar_checksum(&header);
+		tar_write(&header, sizeof(header));
+		tar_write(pax.data, pax.used);
+		tar_pad(pax.used);
+		free(pax.data);
+	}
+
+	tar_header(&header, name, file->mode, size > TAR_SIZE_MAX ? 0 : size,
+		file->time < 0 || file->time > TAR_SIZE_MAX ? 0 : file->time,
+		type);
+	tar_octal(header.uid, sizeof(header.uid), file->uid > TAR_ID_MAX ? 0 :
+		file->uid);
+	tar_octal(header.gid, sizeof(header.gid), file->gid > TAR_ID_MAX ? 0 :
+		file->gid);
+	tar_octal(header.major, sizeof(header.major), major);
+	tar_octal(header.minor, sizeof(header.minor), minor);
+	if(file->link)
+		tar_string(header.link, sizeof(header.link), file->link);
+	tar_checksum(&header);
+	tar_write(&header, sizeof(header));
+
+	if(name != file->pathname)
+		free(name);
+}
+
+
+/*
+ * Called by the writer thread to write one entry to the archive.  Sparse
+ * blocks are written as zeros, as are blocks which couldn't be read, so
+ * the archive stays consistent
+ */
+void tar_write_file(struct squashfs_file *file)
+{
+	int i;
+	long long bytes = 0;
+
+	tar_write_header(file);
+
+	for(i = 0; file->queue && i < file->blocks; i++,
+						inc_count(&cur_blocks)) {
+		struct file_entry *block = queue_get(file->queue);
+
+		if(block->buffer) {
+			cache_block_wait(block->buffer);
+
+			if(block->buffer->error) {
+				ERROR("Failed to read data block %d of %s, "
+					"writing zeros\n", i, file->pathname);
+				tar_write(zero_block, block->size);
+			} else
+				tar_write(block->buffer->data + block->offset,
+					block->size);
+
+			cache_block_put(block->buffer);
+		} else
+			tar_write(zero_block, block->size);
+
+		bytes += block->size;
+		free(block);
+	}
+
+	tar_pad(bytes);
+
+	free(file->pathname);
+	free(file->link);
+	if(file->queue)
+		release_file(file);
+	else
+		free(file);
+}
+
+
+/* queue an entry without data */
+static void tar_queue(char *pathname, int mode, uid_t uid, gid_t gid,
+	time_t time, unsigned int xattr, char *link, unsigned int rdev)
+{
+	struct squashfs_file *file = malloc(sizeof(struct squashfs_file));
+	if(file == NULL)
+		EXIT_UNSQUASH("tar_queue: unable to malloc file\n");
+
+	file->fd = tar_fd;
+	file->blocks = 0;
+	file->file_size = 0;
+	file->mode = mode;
+	file->uid = uid;
+	file->gid = gid;
+	file->time = time;
+	file->pathname = strdup(pathname);
+	file->sparse = FALSE;
+	file->xattr = xattr;
+	file->link = link ? strdup(link) : NULL;
+	file->rdev = rdev;
+	file->queue = NULL;
+
+	pthread_mutex_lock(&queue_mutex);
+	queue_put(to_writer, file);
+	pthread_mutex_unlock(&queue_mutex);
+}
+
+
+/* queue a directory, which is written before its contents */
+void tar_dir(char *pathname, struct dir *dir)
+{
+	tar_queue(pathname, dir->mode, dir->uid, dir->guid, dir->mtime,
+		dir->xattr, NULL, 0);
+}
+
+
+/*
+ * create_inode() with -tar.  Link_name is the name the inode was first
+ * written as, if it is a hard link
+ */
+int tar_inode(char *pathname, struct inode *i, char *link_name)
+{
+	if(link_name) {
+		TRACE("tar_inode: hard link\n");
+		tar_queue(pathname, S_IFREG | (i->mode & 07777), i->uid,
+			i->gid, i->time, i->xattr, link_name, 0);
+		return TRUE;
+	}
+
+	switch(i->type) {
+		case SQUASHFS_FILE_TYPE:
+		case SQUASHFS_LREG_TYPE:
+			queue_file_data(i, pathname, tar_fd);
+			inc_count(&file_count);
+			break;
+		case SQUASHFS_SYMLINK_TYPE:
+		case SQUASHFS_LSYMLINK_TYPE:
+			tar_queue(pathname, i->mode, i->uid, i->gid, i->time,
+				i->xattr, i->symlink, 0);
+			inc_count(&sym_count);
+			break;
+ 		case SQUASHFS_BLKDEV_TYPE:
+	 	case SQUASHFS_CHRDEV_TYPE:
+ 		case SQUASHFS_LBLKDEV_TYPE:
+	 	case SQUASHFS_LCHRDEV_TYPE:
+			tar_queue(pathname, i->mode, i->uid, i->gid, i->time,
+				i->xattr, NULL, i->data);
+			inc_count(&dev_count);
+			break;
+		case SQUASHFS_FIFO_TYPE:
+		case SQUASHFS_LFIFO_TYPE:
+			tar_queue(pathname, i->mode, i->uid, i->gid, i->time,
+				i->xattr, NULL, 0);
+			inc_count(&fifo_count);
+			break;
+		case SQUASHFS_SOCKET_TYPE:
+		case SQUASHFS_LSOCKET_TYPE:
+			ERROR("tar_inode: socket %s ignored\n", pathname);
+			break;
+		default:
+			ERROR("Unknown inode type %d in tar_inode!\n", i->type);
+			set_created(i, NULL);
+			return FALSE;
+	}
+
+	set_created(i, strdup(pathname));
+
+	return TRUE;
+}
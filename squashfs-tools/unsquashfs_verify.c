@@ -0,0 +1,491 @@
+/*
+ * Unsquash a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2014
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * unsquashfs_verify.c
+ *
+ * -verify checks the filesystem rather than creating the files.  The
+ * directories, inodes and xattrs are read by the scan threads as normal, and
+ * the data blocks and fragment blocks are read and decompressed by the
+ * reader and inflator threads, but each block is only queued for the first
+ * file which refers to it, and so each is decompressed once however many
+ * files share it.  The writer thread(s) record the decompressed length of
+ * each block, and once everything has been read the blocks are checked
+ * against the sizes the files expect, and for overlaps
+ */
+
+#include "unsquashfs.h"
+#include "xattr.h"
+
+#define VERIFY_ERROR(s, args...) \
+		do {\
+			ERROR(s, ## args); \
+			inc_count(&verify_errors); \
+		} while(0)
+
+extern int block_size;
+extern int cur_blocks, dir_count;
+extern pthread_mutex_t queue_mutex;
+
+int verify = FALSE;
+int verify_errors = 0;
+
+static struct verify_block *verify_table[VERIFY_HASH_SIZE];
+static pthread_mutex_t verify_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int verified_blocks = 0, verified_fragments = 0, shared_blocks = 0;
+static char *fragment_seen;
+
+
+static struct verify_block *lookup_block(long long start, int fragment)
+{
+	struct verify_block *block = verify_table[VERIFY_HASH(start)];
+
+	for(; block; block = block->next)
+		if(block->start == start && block->fragment == fragment)
+			break;
+
+	return block;
+}
+
+
+/*
+ * Add the block at start to the table of blocks read, returning FALSE if it
+ * was already there, in which case whoever first referred to it has queued
+ * it.  Name is the file referring to it, pathname a copy of it kept by the
+ * table (made on first use).  Called with the verify_mutex held
+ */
+static int add_block(long long start, int c_byte, int size, int fragment,
+	char *pathname, char **name)
+{
+	struct verify_block *block = lookup_block(start, fragment);
+
+	if(block) {
+		if(block->c_byte != c_byte)
+			VERIFY_ERROR("%s block at %lld is %d bytes in %s, "
+				"but %d bytes in %s\n", fragment ?
+				"Fragment" : "Data", start, c_byte, pathname,
+				block->c_byte, block->pathname);
+		else if(!fragment && block->size != size)
+			VERIFY_ERROR("Data block at %lld is %d bytes "
+				"uncompressed in %s, but %d bytes in %s\n",
+				start, size, pathname, block->size,
+				block->pathname);
+		else if(size > block->size)
+			/* the furthest tail end in the fragment block */
+			block->size = size;
+
+		if(!fragment)
+			shared_blocks ++;
+		return FALSE;
+	}
+
+	block = malloc(sizeof(struct verify_block));
+	if(block == NULL)
+		EXIT_UNSQUASH("add_block: unable to malloc block\n");
+
+	if(*name == NULL) {
+		*name = strdup(pathname);
+		if(*name == NULL)
+			EXIT_UNSQUASH("add_block: unable to malloc name\n");
+	}
+
+	block->start = start;
+	block->c_byte = c_byte;
+	block->size = size;
+	block->length = -1;
+	block->fragment = fragment;
+	block->pathname = *name;
+	block->next = verify_table[VERIFY_HASH(start)];
+	verify_table[VERIFY_HASH(start)] = block;
+
+	if(fragment)
+		verified_fragments ++;
+	else
+		verified_blocks ++;
+
+	return TRUE;
+}
+
+
+static int check_block(char *pathname, char *type, long long start,
+	int c_byte)
+{
+	if(c_byte > block_size) {
+		VERIFY_ERROR("%s block at %lld in %s is %d bytes, larger than "
+			"the block size\n", type, start, pathname, c_byte);
+		return FALSE;
+	}
+
+	if(start < 0 || start + c_byte > sBlk.s.inode_table_start) {
+		VERIFY_ERROR("%s block at %lld in %s is outside the data "
+			"area\n", type, start, pathname);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+
+/*
+ * queue_file_data() for -verify.  The file is queued to the writer
+ * thread(s) with its blocks as normal, except that blocks already queued
+ * for another file are queued without a cache entry, like sparse blocks
+ */
+static void verify_file_data(struct inode *inode, char *pathname)
+{
+	unsigned int i;
+	unsigned int *block_list;
+	struct squashfs_file *file;
+	int file_end = inode->data / block_size;
+	long long start = inode->start;
+	char *name = NULL;
+	int bad = FALSE;
+
+	block_list = malloc(inode->blocks * sizeof(unsigned int));
+	if(block_list == NULL)
+		EXIT_UNSQUASH("verify_file_data: unable to malloc block "
+			"list\n");
+
+	s_ops.read_block_list(block_list, inode->block_start,
+		inode->block_offset, inode->blocks);
+
+	pthread_mutex_lock(&queue_mutex);
+	file = queue_file(pathname, -1, inode);
+
+	for(i = 0; i < inode->blocks; i++) {
+		int c_byte = SQUASHFS_COMPRESSED_SIZE_BLOCK(block_list[i]);
+		struct file_entry *block = malloc(sizeof(struct file_entry));
+
+		if(block == NULL)
+			EXIT_UNSQUASH("verify_file_data: unable to malloc "
+				"file\n");
+		block->offset = 0;
+		block->size = i == file_end ? inode->data & (block_size - 1) :
+			block_size;
+		block->buffer = NULL;
+
+		if(block_list[i] && !bad) {
+			/*
+			 * once a block is bad, the location of the rest of
+			 * the file's blocks can't be trusted
+			 */
+			bad = !check_block(pathname, "Data", start, c_byte);
+
+			if(!bad) {
+				int new;
+
+				pthread_mutex_lock(&verify_mutex);
+				new = add_block(start, c_byte, block->size,
+					FALSE, pathname, &name);
+				pthread_mutex_unlock(&verify_mutex);
+				if(new)
+					block->buffer = cache_get(data_cache,
+						start, block_list[i]);
+			}
+			start += c_byte;
+		}
+		queue_put(file->queue, block);
+	}
+
+	if(inode->frag_bytes) {
+		int size, c_byte;
+		long long start;
+		struct file_entry *block = malloc(sizeof(struct file_entry));
+
+		if(block == NULL)
+			EXIT_UNSQUASH("verify_file_data: unable to malloc "
+				"file\n");
+		block->offset = inode->offset;
+		block->size = inode->frag_bytes;
+		block->buffer = NULL;
+
+		if(inode->fragment >= sBlk.s.fragments)
+			VERIFY_ERROR("Fragment %u of %s is not in the fragment "
+				"table\n", inode->fragment, pathname);
+		else {
+			s_ops.read_fragment(inode->fragment, &start, &size);
+			c_byte = SQUASHFS_COMPRESSED_SIZE_BLOCK(size);
+			fragment_seen[inode->fragment] = TRUE;
+
+			if(check_block(pathname, "Fragment", start, c_byte)) {
+				int new;
+
+				pthread_mutex_lock(&verify_mutex);
+				new = add_block(start, c_byte, inode->offset +
+					inode->frag_bytes, TRUE, pathname,
+					&name);
+				pthread_mutex_unlock(&verify_mutex);
+				if(new)
+					block->buffer = cache_get(
+						fragment_cache, start, size);
+			}
+		}
+		queue_put(file->queue, block);
+	}
+
+	release_file(file);
+	pthread_mutex_unlock(&queue_mutex);
+	free(block_list);
+}
+
+
+void verify_init()
+{
+	fragment_seen = calloc(sBlk.s.fragments, 1);
+	if(fragment_seen == NULL && sBlk.s.fragments)
+		EXIT_UNSQUASH("verify_init: unable to malloc fragment table\n");
+}
+
+
+/* the directory's attributes are checked, its contents by dir_scan() */
+void verify_dir(char *pathname, struct dir *dir)
+{
+	if(!verify_xattr(pathname, dir->xattr))
+		inc_count(&verify_errors);
+}
+
+
+/*
+ * create_inode() with -verify.  Link_name is the name the inode was first
+ * verified as, if it is a hard link, in which case there is nothing more to
+ * check
+ */
+int verify_inode(char *pathname, struct inode *i, char *link_name)
+{
+	if(link_name)
+		return TRUE;
+
+	if(!verify_xattr(pathname, i->xattr))
+		inc_count(&verify_errors);
+
+	switch(i->type) {
+		case SQUASHFS_FILE_TYPE:
+		case SQUASHFS_LREG_TYPE:
+			verify_file_data(i, pathname);
+			inc_count(&file_count);
+			break;
+		case SQUASHFS_SYMLINK_TYPE:
+		case SQUASHFS_LSYMLINK_TYPE:
+			inc_count(&sym_count);
+			break;
+ 		case SQUASHFS_BLKDEV_TYPE:
+	 	case SQUASHFS_CHRDEV_TYPE:
+ 		case SQUASHFS_LBLKDEV_TYPE:
+	 	case SQUASHFS_LCHRDEV_TYPE:
+			inc_count(&dev_count);
+			break;
+		case SQUASHFS_FIFO_TYPE:
+		case SQUASHFS_LFIFO_TYPE:
+			inc_count(&fifo_count);
+			break;
+		case SQUASHFS_SOCKET_TYPE:
+		case SQUASHFS_LSOCKET_TYPE:
+			break;
+		default:
+			VERIFY_ERROR("Unknown inode type %d for %s\n", i->type,
+				pathname);
+			set_created(i, NULL);
+			return FALSE;
+	}
+
+	set_created(i, strdup(pathname));
+
+	return TRUE;
+}
+
+
+/*
+ * Queue the fragment blocks no file refers to, so every block in the
+ * filesystem is read.  Only done when verifying the whole filesystem
+ */
+void verify_fragments()
+{
+	struct squashfs_file *file;
+	struct inode inode;
+	char *name = "fragment table";
+	unsigned int i;
+	int count = 0;
+
+	for(i = 0; i < sBlk.s.fragments; i++)
+		count += !fragment_seen[i];
+
+	if(count == 0)
+		return;
+
+	memset(&inode, 0, sizeof(inode));
+	inode.blocks = count;
+
+	pthread_mutex_lock(&queue_mutex);
+	file = queue_file(name, -1, &inode);
+
+	for(i = 0; i < sBlk.s.fragments; i++) {
+		struct file_entry *block;
+		long long start;
+		int size, c_byte, new;
+
+		if(fragment_seen[i])
+			continue;
+
+		block = malloc(sizeof(struct file_entry));
+		if(block == NULL)
+			EXIT_UNSQUASH("verify_fragments: unable to malloc "
+				"file\n");
+		block->offset = 0;
+		block->size = 0;
+		block->buffer = NULL;
+
+		s_ops.read_fragment(i, &start, &size);
+		c_byte = SQUASHFS_COMPRESSED_SIZE_BLOCK(size);
+
+		if(check_block(name, "Fragment", start, c_byte)) {
+			pthread_mutex_lock(&verify_mutex);
+			new = add_block(start, c_byte, 0, TRUE, name, &name);
+			pthread_mutex_unlock(&verify_mutex);
+			if(new)
+				block->buffer = cache_get(fragment_cache,
+					start, size);
+		}
+		queue_put(file->queue, block);
+	}
+
+	release_file(file);
+	pthread_mutex_unlock(&queue_mutex);
+}
+
+
+/*
+ * the writer thread with -verify.  The file's blocks are waited for, and
+ * their decompressed length recorded for verify_finish()
+ */
+void verify_write_file(struct squashfs_file *file)
+{
+	int i;
+
+	for(i = 0; i < file->blocks; i++, inc_count(&cur_blocks)) {
+		struct file_entry *block = queue_get(file->queue);
+		struct cache_entry *buffer = block->buffer;
+
+		if(buffer) {
+			int fragment = buffer->cache == fragment_cache;
+			struct verify_block *verify_block;
+
+			cache_block_wait(buffer);
+
+			if(buffer->error)
+				VERIFY_ERROR("Failed to read %s block at %lld "
+					"of %s\n", fragment ? "fragment" :
+					"data", buffer->block, file->pathname);
+
+			pthread_mutex_lock(&verify_mutex);
+			verify_block = lookup_block(buffer->block, fragment);
+			verify_block->length = buffer->error ? -1 :
+				buffer->length;
+			pthread_mutex_unlock(&verify_mutex);
+
+			cache_block_put(buffer);
+		}
+		free(block);
+	}
+
+	free(file->pathname);
+	release_file(file);
+}
+
+
+static int compare_blocks(const void *a, const void *b)
+{
+	const struct verify_block *block_a = *(struct verify_block **) a;
+	const struct verify_block *block_b = *(struct verify_block **) b;
+
+	if(block_a->start != block_b->start)
+		return block_a->start < block_b->start ? -1 : 1;
+
+	return 0;
+}
+
+
+/*
+ * Once the writer thread(s) have finished, check every block decompressed to
+ * the size the files referring to it expect, and that no two blocks overlap.
+ * Returns the exit status
+ */
+int verify_finish()
+{
+	struct verify_block **blocks;
+	int i, count = 0;
+
+	blocks = malloc((verified_blocks + verified_fragments) *
+		sizeof(struct verify_block *));
+	if(blocks == NULL && verified_blocks + verified_fragments)
+		EXIT_UNSQUASH("verify_finish: unable to malloc blocks\n");
+
+	for(i = 0; i < VERIFY_HASH_SIZE; i++) {
+		struct verify_block *block = verify_table[i];
+
+		for(; block; block = block->next) {
+			blocks[count ++] = block;
+
+			/* read failures were reported by the writer thread */
+			if(block->length == -1)
+				continue;
+
+			if(block->fragment ? block->length < block->size :
+					block->length != block->size)
+				VERIFY_ERROR("%s block at %lld in %s "
+					"decompressed to %d bytes, expected "
+					"%s%d bytes\n", block->fragment ?
+					"Fragment" : "Data", block->start,
+					block->pathname,
+					block->length, block->fragment ?
+					"at least " : "", block->size);
+		}
+	}
+
+	qsort(blocks, count, sizeof(struct verify_block *), compare_blocks);
+
+	for(i = 1; i < count; i++)
+		if(blocks[i - 1]->start + blocks[i - 1]->c_byte >
+				blocks[i]->start)
+			VERIFY_ERROR("Block at %lld in %s overlaps block at "
+				"%lld in %s\n", blocks[i - 1]->start,
+				blocks[i - 1]->pathname, blocks[i]->start,
+				blocks[i]->pathname);
+
+	free(blocks);
+
+	printf("\n");
+	printf("verified %d files\n", file_count);
+	printf("verified %d directories\n", dir_count);
+	printf("verified %d symlinks\n", sym_count);
+	printf("verified %d devices\n", dev_count);
+	printf("verified %d fifos\n", fifo_count);
+	printf("verified %d data blocks and %d fragment blocks\n",
+		verified_blocks, verified_fragments);
+	printf("found %d duplicate references to data blocks\n",
+		shared_blocks);
+
+	if(verify_errors) {
+		printf("%d errors found\n", verify_errors);
+		return 1;
+	}
+
+	printf("No errors found\n");
+	return 0;
+}
@@ -137,3 +137,27 @@ void write_xattr(char *pathname, unsigned int xattr)
 
 	free_xattr(xattr_list, count);
 }
+
+
+/*
+ * -verify: read the xattrs of pathname, returning FALSE if they're
+ * missing or corrupt
+ */
+int verify_xattr(char *pathname, unsigned int xattr)
+{
+	unsigned int count;
+	struct xattr_list *xattr_list;
+
+	if(xattr == SQUASHFS_INVALID_XATTR ||
+			sBlk.s.xattr_id_table_start == SQUASHFS_INVALID_BLK)
+		return TRUE;
+
+	xattr_list = get_xattr(xattr, &count, 0);
+	if(xattr_list == NULL) {
+		ERROR("Failed to read xattrs for file %s\n", pathname);
+		return FALSE;
+	}
+
+	free_xattr(xattr_list, count);
+	return TRUE;
+}
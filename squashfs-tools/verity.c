@@ -0,0 +1,391 @@
+/*
+ * Create a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2014
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * verity.c
+ *
+ * -verity builds a dm-verity hash tree of the filesystem as it is written,
+ * rather than in a separate pass over the finished image.  Every write to the
+ * output passes through verity_write(), which hashes the 4K blocks of the
+ * image it covers.  Most of the image is written in order, a write carrying
+ * on from where the last one stopped, and so a block split between writes is
+ * kept until it is complete.  Blocks only partly written (the superblock,
+ * blocks rewritten after a duplicate file has been thrown away, and, when
+ * appending, the existing filesystem) are read back from the output once it
+ * has been written.
+ *
+ * The tree is in the veritysetup format: a superblock, followed by the levels
+ * of the tree top down, each hash being sha256(salt + block).  Without a salt
+ * the tree is also the fs-verity Merkle tree of the image, and so its
+ * fs-verity digest is printed too
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "squashfs_fs.h"
+#include "sha256.h"
+#include "verity.h"
+#include "error.h"
+
+#define FALSE 0
+#define TRUE 1
+
+extern int read_fs_bytes(int, long long, int, void *);
+extern int write_bytes(int, void *, int);
+
+int verity = FALSE, verity_append = FALSE;
+char *verity_file = NULL;
+
+static unsigned char salt[VERITY_SALT_MAX];
+static int salt_size = 0;
+
+/* the hash of each image block, valid if the whole block has been seen */
+static unsigned char *block_hash = NULL;
+static char *block_valid = NULL;
+static long long hash_blocks = 0;
+
+/* the block a write finished part way through, waiting for the rest */
+static unsigned char pending[VERITY_BLOCK_SIZE];
+static long long pending_block = -1;
+static int pending_bytes;
+
+static pthread_mutex_t verity_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static int hex_value(char c)
+{
+	if(c >= '0' && c <= '9')
+		return c - '0';
+	if(c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if(c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+
+static void print_hex(unsigned char *data, int bytes)
+{
+	int i;
+
+	for(i = 0; i < bytes; i++)
+		printf("%02x", data[i]);
+}
+
+
+/* parse the -verity-salt hex string, returning FALSE if it is invalid */
+int verity_set_salt(char *hex)
+{
+	int i, len = strlen(hex);
+
+	/* "-" is no salt, the veritysetup convention */
+	if(strcmp(hex, "-") == 0) {
+		salt_size = 0;
+		return TRUE;
+	}
+
+	if(len == 0 || len & 1 || len / 2 > VERITY_SALT_MAX)
+		return FALSE;
+
+	for(i = 0; i < len; i += 2) {
+		int high = hex_value(hex[i]), low = hex_value(hex[i + 1]);
+
+		if(high == -1 || low == -1)
+			return FALSE;
+		salt[i / 2] = high << 4 | low;
+	}
+
+	salt_size = len / 2;
+	return TRUE;
+}
+
+
+static void hash_data(unsigned char *data, unsigned char *digest)
+{
+	struct sha256_ctx ctx;
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, salt, salt_size);
+	sha256_update(&ctx, data, VERITY_BLOCK_SIZE);
+	sha256_final(&ctx, digest);
+}
+
+
+static void hash_block(long long block, unsigned char *data)
+{
+	hash_data(data, block_hash + block * SHA256_DIGEST_SIZE);
+	block_valid[block] = TRUE;
+
+	if(block == pending_block)
+		pending_block = -1;
+}
+
+
+static void grow_hashes(long long blocks)
+{
+	long long size = hash_blocks ? hash_blocks : 1024;
+
+	if(blocks <= hash_blocks)
+		return;
+
+	while(size < blocks)
+		size *= 2;
+
+	block_hash = realloc(block_hash, size * SHA256_DIGEST_SIZE);
+	block_valid = realloc(block_valid, size);
+	if(block_hash == NULL || block_valid == NULL)
+		MEM_ERROR();
+
+	memset(block_valid + hash_blocks, 0, size - hash_blocks);
+	hash_blocks = size;
+}
+
+
+/*
+ * Called for every write to the output, after the bytes have been written.
+ * The blocks wholly covered are hashed, and blocks only partly covered are
+ * marked as needing to be read back, unless the write carries on a block the
+ * last write left part written
+ */
+void verity_write(long long byte, void *buffer, int bytes)
+{
+	unsigned char *data = buffer;
+	long long block = byte >> VERITY_BLOCK_LOG;
+	int offset = byte & (VERITY_BLOCK_SIZE - 1);
+
+	if(bytes == 0)
+		return;
+
+	pthread_mutex_lock(&verity_mutex);
+	grow_hashes(((byte + bytes - 1) >> VERITY_BLOCK_LOG) + 1);
+
+	if(offset) {
+		int size = VERITY_BLOCK_SIZE - offset;
+
+		if(size > bytes)
+			size = bytes;
+
+		if(block == pending_block && offset == pending_bytes) {
+			memcpy(pending + offset, data, size);
+			pending_bytes += size;
+			if(pending_bytes == VERITY_BLOCK_SIZE)
+				hash_block(block, pending);
+		} else {
+			block_valid[block] = FALSE;
+			if(block == pending_block)
+				pending_block = -1;
+		}
+
+		data += size;
+		bytes -= size;
+		block ++;
+	}
+
+	for(; bytes >= VERITY_BLOCK_SIZE; block ++, data += VERITY_BLOCK_SIZE,
+						bytes -= VERITY_BLOCK_SIZE)
+		hash_block(block, data);
+
+	if(bytes) {
+		block_valid[block] = FALSE;
+		memcpy(pending, data, bytes);
+		pending_block = block;
+		pending_bytes = bytes;
+	}
+
+	pthread_mutex_unlock(&verity_mutex);
+}
+
+
+static void put_le(unsigned char *p, unsigned long long value, int bytes)
+{
+	int i;
+
+	for(i = 0; i < bytes; i++)
+		p[i] = value >> (i * 8);
+}
+
+
+static void write_tree(int fd, long long offset, unsigned char *buffer,
+	long long bytes)
+{
+	if(verity_append && lseek(fd, offset, SEEK_SET) == -1)
+		BAD_ERROR("Failed to write the verity hash tree, lseek failed "
+			"because %s\n", strerror(errno));
+
+	/* write_bytes() takes an int, and the lowest level can be larger */
+	while(bytes) {
+		int size = bytes > VERITY_WRITE_MAX ? VERITY_WRITE_MAX : bytes;
+
+		if(write_bytes(fd, buffer, size) == -1)
+			BAD_ERROR("Failed to write the verity hash tree\n");
+		buffer += size;
+		bytes -= size;
+	}
+}
+
+
+/*
+ * Called once the filesystem has been written, and padded to size (a
+ * multiple of the block size).  Reads back the blocks which weren't
+ * wholly written, builds the tree and writes it to the -verity file, or
+ * after the filesystem with -verity-append
+ */
+void verity_finish(int fd, long long size)
+{
+	long long blocks = size >> VERITY_BLOCK_LOG, level_blocks[64];
+	long long i, offset = 0, reread = 0;
+	unsigned char *level[64], root[SHA256_DIGEST_SIZE];
+	unsigned char sb[VERITY_BLOCK_SIZE], data[VERITY_BLOCK_SIZE];
+	int hashes = VERITY_BLOCK_SIZE / SHA256_DIGEST_SIZE, levels = 0;
+	int out_fd = fd, n;
+
+	/* the tree itself isn't hashed */
+	verity = FALSE;
+	grow_hashes(blocks);
+
+	for(i = 0; i < blocks; i++)
+		if(!block_valid[i]) {
+			if(read_fs_bytes(fd, i << VERITY_BLOCK_LOG,
+					VERITY_BLOCK_SIZE, data) == 0)
+				BAD_ERROR("Failed to read back block %lld for "
+					"the verity hash tree\n", i);
+			hash_block(i, data);
+			reread ++;
+		}
+
+	/*
+	 * Each level is the hashes of the blocks of the one below, packed
+	 * into blocks, until a level fits in one block.  The root hash is the
+	 * hash of that block, or of the only block of a one block image
+	 */
+	if(blocks == 1)
+		memcpy(root, block_hash, SHA256_DIGEST_SIZE);
+	else {
+		unsigned char *below = block_hash, *hashed = NULL;
+		long long count = blocks;
+
+		while(1) {
+			level_blocks[levels] = (count + hashes - 1) / hashes;
+			level[levels] = calloc(level_blocks[levels],
+				VERITY_BLOCK_SIZE);
+			if(level[levels] == NULL)
+				MEM_ERROR();
+			memcpy(level[levels], below, count *
+				SHA256_DIGEST_SIZE);
+			count = level_blocks[levels ++];
+			if(count == 1)
+				break;
+
+			hashed = realloc(hashed, count * SHA256_DIGEST_SIZE);
+			if(hashed == NULL)
+				MEM_ERROR();
+			for(i = 0; i < count; i++)
+				hash_data(level[levels - 1] + i *
+					VERITY_BLOCK_SIZE, hashed + i *
+					SHA256_DIGEST_SIZE);
+			below = hashed;
+		}
+
+		free(hashed);
+		hash_data(level[levels - 1], root);
+	}
+
+	memset(sb, 0, sizeof(sb));
+	memcpy(sb, VERITY_SIGNATURE, 8);
+	put_le(sb + 8, VERITY_VERSION, 4);
+	put_le(sb + 12, VERITY_HASH_TYPE, 4);
+
+	/* the uuid only needs to be unique, so take it from the root hash */
+	memcpy(sb + 16, root, 16);
+	sb[22] = (sb[22] & 0x0f) | 0x40;
+	sb[24] = (sb[24] & 0x3f) | 0x80;
+
+	strcpy((char *) sb + 32, "sha256");
+	put_le(sb + 64, VERITY_BLOCK_SIZE, 4);
+	put_le(sb + 68, VERITY_BLOCK_SIZE, 4);
+	put_le(sb + 72, blocks, 8);
+	put_le(sb + 80, salt_size, 2);
+	memcpy(sb + 88, salt, salt_size);
+
+	if(verity_append)
+		offset = size;
+	else {
+		out_fd = open(verity_file, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+		if(out_fd == -1)
+			BAD_ERROR("Failed to create verity hash tree file %s, "
+				"because %s\n", verity_file, strerror(errno));
+	}
+
+	write_tree(out_fd, offset, sb, VERITY_BLOCK_SIZE);
+	offset += VERITY_BLOCK_SIZE;
+	for(n = levels - 1; n >= 0; n--) {
+		write_tree(out_fd, offset, level[n], level_blocks[n] *
+			VERITY_BLOCK_SIZE);
+		offset += level_blocks[n] * VERITY_BLOCK_SIZE;
+		free(level[n]);
+	}
+
+	if(!verity_append && close(out_fd) == -1)
+		BAD_ERROR("Failed to write verity hash tree file %s, because "
+			"%s\n", verity_file, strerror(errno));
+
+	printf("\nVerity hash tree (sha256, %d byte blocks) of %lld blocks "
+		"written to %s", VERITY_BLOCK_SIZE, blocks, verity_append ?
+		"the filesystem image" : verity_file);
+	if(verity_append)
+		printf(", hash offset %lld", size);
+	printf("\n\tRoot hash ");
+	print_hex(root, SHA256_DIGEST_SIZE);
+	printf("\n\tSalt ");
+	if(salt_size)
+		print_hex(salt, salt_size);
+	else
+		printf("-");
+
+	if(salt_size == 0 && !verity_append) {
+		/*
+		 * the fs-verity digest is the hash of the fs-verity
+		 * descriptor, which holds the root hash and image size
+		 */
+		unsigned char desc[FSVERITY_DESC_SIZE], digest[SHA256_DIGEST_SIZE];
+		struct sha256_ctx ctx;
+
+		memset(desc, 0, sizeof(desc));
+		desc[0] = 1;
+		desc[1] = FSVERITY_HASH_SHA256;
+		desc[2] = VERITY_BLOCK_LOG;
+		put_le(desc + 8, size, 8);
+		memcpy(desc + 16, root, SHA256_DIGEST_SIZE);
+
+		sha256_init(&ctx);
+		sha256_update(&ctx, desc, sizeof(desc));
+		sha256_final(&ctx, digest);
+
+		printf("\n\tfs-verity digest sha256:");
+		print_hex(digest, SHA256_DIGEST_SIZE);
+	}
+	printf("\n\t%lld blocks read back from the image\n", reread);
+}
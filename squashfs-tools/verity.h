@@ -0,0 +1,49 @@
+#ifndef VERITY_H
+#define VERITY_H
+/*
+ * Create a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2014
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ * verity.h
+ */
+
+/* the dm-verity and fs-verity data and hash block size */
+#define VERITY_BLOCK_SIZE	4096
+#define VERITY_BLOCK_LOG	12
+#define VERITY_SALT_MAX		256
+
+/* the most of the hash tree written at once */
+#define VERITY_WRITE_MAX	(1 << 30)
+
+/* dm-verity (veritysetup) hash device superblock, little endian */
+#define VERITY_SIGNATURE	"verity\0\0"
+#define VERITY_VERSION		1
+#define VERITY_HASH_TYPE	1
+#define VERITY_SB_SIZE		512
+
+/* fs-verity file descriptor, little endian */
+#define FSVERITY_DESC_SIZE	256
+#define FSVERITY_HASH_SHA256	1
+
+extern int verity, verity_append;
+extern char *verity_file;
+extern int verity_set_salt(char *);
+extern void verity_write(long long, void *, int);
+extern void verity_finish(int, long long);
+#endif
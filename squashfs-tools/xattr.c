@@ -42,11 +42,25 @@
 #include "xattr.h"
 #include "error.h"
 #include "progressbar.h"
+#include "hash.h"
 
 /* ANDROID CHANGES START*/
 #ifdef ANDROID
 #include "android.h"
 static struct selabel_handle *sehnd = NULL;
+
+/*
+ * Xattr ids of the security contexts already looked up.  Most files share
+ * a handful of contexts, and this avoids building and duplicate checking
+ * an xattr list for every one of them
+ */
+struct context_id {
+	char *context;
+	int xattr_id;
+	struct context_id *next;
+};
+
+static struct context_id *context_ids[XATTR_HASH_SIZE];
 #endif
 /* ANDROID CHANGES END */
 
@@ -73,10 +87,13 @@ static int scache_bytes = 0;
 static int sxattr_ids = 0;
 
 /* xattr hash table for value duplicate detection */
-static struct xattr_list *dupl_value[65536];
+static struct xattr_list *dupl_value[XATTR_HASH_SIZE];
 
 /* xattr hash table for id duplicate detection */
-static struct dupl_id *dupl_id[65536];
+static struct dupl_id *dupl_id[XATTR_HASH_SIZE];
+
+/* hash table of the interned xattr names and values */
+static struct xattr_string *xattr_strings[XATTR_HASH_SIZE];
 
 /* file system globals from mksquashfs.c */
 extern int no_xattrs, noX;
@@ -89,7 +106,6 @@ extern char *mount_point;
 /* ANDROID CHANGES END */
 
 /* helper functions from mksquashfs.c */
-extern unsigned short get_checksum(char *, int, unsigned short);
 extern void write_destination(int, long long, int, void *);
 extern long long generic_write_table(int, void *, int, void *, int);
 extern int mangle(char *, char *, int, int, int, int);
@@ -106,11 +122,39 @@ extern struct xattr_list *get_xattr(int, unsigned int *, int);
 extern struct prefix prefix_table[];
 
 
+/*
+ * Return the stored copy of size bytes of data, storing it if it hasn't been
+ * seen before
+ */
+static void *intern(void *data, int size)
+{
+	unsigned long long hash = hash64(data, size, 0);
+	struct xattr_string *entry;
+
+	for(entry = xattr_strings[XATTR_HASH(hash)]; entry; entry = entry->next)
+		if(entry->hash == hash && entry->size == size &&
+				memcmp(entry->data, data, size) == 0)
+			return entry->data;
+
+	entry = malloc(sizeof(*entry) + size);
+	if(entry == NULL)
+		MEM_ERROR();
+
+	entry->hash = hash;
+	entry->size = size;
+	memcpy(entry->data, data, size);
+	entry->next = xattr_strings[XATTR_HASH(hash)];
+	xattr_strings[XATTR_HASH(hash)] = entry;
+
+	return entry->data;
+}
+
+
 static int get_prefix(struct xattr_list *xattr, char *name)
 {
 	int i;
 
-	xattr->full_name = strdup(name);
+	xattr->full_name = intern(name, strlen(name) + 1);
 
 	for(i = 0; prefix_table[i].type != -1; i++) {
 		struct prefix *p = &prefix_table[i];
@@ -129,20 +173,38 @@ static int get_prefix(struct xattr_list *xattr, char *name)
 
 /* ANDROID CHANGES START*/
 #ifdef ANDROID
-static int read_xattrs_from_context_file(char *filename, int mode,
-	struct selabel_handle *sehnd, struct xattr_list **xattrs)
+static int context_file_xattr(char *filename, int mode,
+	struct selabel_handle *sehnd)
 {
-	char *attr_val;
-	struct xattr_list *x = malloc(sizeof(*x));
-	if(x == NULL)
+	char *label = set_selabel(filename, mode, sehnd);
+	int size = strlen(label);
+	char *context = intern(label, size);
+	int hash = XATTR_HASH(hash64(context, size, 0));
+	struct context_id *entry;
+	struct xattr_list *x;
+
+	free(label);
+
+	/* interned, so the same context is the same pointer */
+	for(entry = context_ids[hash]; entry; entry = entry->next)
+		if(entry->context == context)
+			return entry->xattr_id;
+
+	x = malloc(sizeof(*x));
+	entry = malloc(sizeof(*entry));
+	if(x == NULL || entry == NULL)
 		MEM_ERROR();
 
 	x->type = get_prefix(x, "security.selinux");
-	attr_val = set_selabel(filename, mode, sehnd);
-	x->value = (void *)attr_val;
-	x->vsize = strlen(attr_val);
-	*xattrs = x;
-	return 1;
+	x->value = context;
+	x->vsize = size;
+
+	entry->context = context;
+	entry->xattr_id = generate_xattrs(1, x);
+	entry->next = context_ids[hash];
+	context_ids[hash] = entry;
+
+	return entry->xattr_id;
 }
 #endif
 /* ANDROID CHANGES END */
@@ -150,6 +212,8 @@ static int read_xattrs_from_context_file(char *filename, int mode,
 
 static int read_xattrs_from_system(char *filename, struct xattr_list **xattrs)
 {
+	static char *value = NULL;
+	static ssize_t value_size = 0;
 	ssize_t size, vsize;
 	char *xattr_names, *p;
 	int i;
@@ -201,7 +265,6 @@ static int read_xattrs_from_system(char *filename, struct xattr_list **xattrs)
 		if(xattr_list[i].type == -1) {
 			ERROR("Unrecognised xattr prefix %s\n",
 				xattr_list[i].full_name);
-			free(xattr_list[i].full_name);
 			i--;
 			continue;
 		}
@@ -214,18 +277,19 @@ static int read_xattrs_from_system(char *filename, struct xattr_list **xattrs)
 					"read_attrs, because %s", filename,
 					strerror(errno));
 				ERROR_EXIT(".  Ignoring");
-				free(xattr_list[i].full_name);
 				goto failed;
 			}
 
-			xattr_list[i].value = malloc(vsize);
-			if(xattr_list[i].value == NULL)
-				MEM_ERROR();
+			if(vsize > value_size) {
+				value = realloc(value, vsize);
+				if(value == NULL)
+					MEM_ERROR();
+				value_size = vsize;
+			}
 
 			vsize = lgetxattr(filename, xattr_list[i].full_name,
-						xattr_list[i].value, vsize);
+						value, vsize);
 			if(vsize < 0) {
-				free(xattr_list[i].value);
 				if(errno == ERANGE)
 					/* xattr grew?  Try again */
 					continue;
@@ -234,13 +298,13 @@ static int read_xattrs_from_system(char *filename, struct xattr_list **xattrs)
 						"in read_attrs, because %s",
 						filename, strerror(errno));
 					ERROR_EXIT(".  Ignoring");
-					free(xattr_list[i].full_name);
 					goto failed;
 				}
 			}
 			
 			break;
 		}
+		xattr_list[i].value = intern(value, vsize);
 		xattr_list[i].vsize = vsize;
 
 		TRACE("read_xattrs_from_system: filename %s, xattr name %s,"
@@ -252,16 +316,137 @@ static int read_xattrs_from_system(char *filename, struct xattr_list **xattrs)
 	return i;
 
 failed:
-	while(--i >= 0) {
-		free(xattr_list[i].full_name);
-		free(xattr_list[i].value);
-	}
+	/* the names and values are interned, and are not freed */
 	free(xattr_list);
 	free(xattr_names);
 	return 0;
 }
 
 
+/*
+ * Read the xattrs of filename for the directory scan, which may be running
+ * in a scanner thread.  The names and values are copied as they are read,
+ * and interned later by the main thread, see read_prefetched_xattrs().  If
+ * anything fails return -1, and the xattrs are read (and the failure
+ * reported) again when the inode is created
+ */
+int prefetch_xattrs(char *filename, struct xattr_list **xattrs)
+{
+	ssize_t size, vsize;
+	char *xattr_names, *p;
+	struct xattr_list *xattr_list = NULL;
+	int i;
+
+	if(no_xattrs)
+		return -1;
+
+/* ANDROID CHANGES START*/
+#ifdef ANDROID
+	if(context_file)
+		return -1;
+#endif
+/* ANDROID CHANGES END */
+
+	size = llistxattr(filename, NULL, 0);
+	if(size <= 0) {
+		*xattrs = NULL;
+		return size == 0 || errno == ENOTSUP ? 0 : -1;
+	}
+
+	xattr_names = malloc(size);
+	if(xattr_names == NULL)
+		MEM_ERROR();
+
+	size = llistxattr(filename, xattr_names, size);
+	if(size < 0) {
+		free(xattr_names);
+		return -1;
+	}
+
+	for(i = 0, p = xattr_names; p < xattr_names + size;
+						i++, p += strlen(p) + 1) {
+		struct xattr_list *x = realloc(xattr_list, (i + 1) *
+						sizeof(struct xattr_list));
+		if(x == NULL)
+			MEM_ERROR();
+		xattr_list = x;
+
+		x = &xattr_list[i];
+		x->full_name = strdup(p);
+		if(x->full_name == NULL)
+			MEM_ERROR();
+
+		x->value = NULL;
+		vsize = lgetxattr(filename, p, NULL, 0);
+		if(vsize >= 0) {
+			x->value = malloc(vsize);
+			if(x->value == NULL)
+				MEM_ERROR();
+			vsize = lgetxattr(filename, p, x->value, vsize);
+		}
+
+		if(vsize < 0) {
+			free_prefetched_xattrs(i + 1, xattr_list);
+			free(xattr_names);
+			return -1;
+		}
+
+		x->vsize = vsize;
+	}
+
+	free(xattr_names);
+	*xattrs = xattr_list;
+	return i;
+}
+
+
+void free_prefetched_xattrs(int xattrs, struct xattr_list *xattr_list)
+{
+	int i;
+
+	for(i = 0; i < xattrs; i++) {
+		free(xattr_list[i].full_name);
+		free(xattr_list[i].value);
+	}
+
+	if(xattrs > 0)
+		free(xattr_list);
+}
+
+
+/*
+ * Intern the xattrs read by prefetch_xattrs(), in place, dropping any with
+ * an unrecognised prefix as read_xattrs_from_system() does
+ */
+static int read_prefetched_xattrs(int xattrs, struct xattr_list *xattr_list)
+{
+	int i, j;
+
+	for(i = j = 0; i < xattrs; i++) {
+		char *name = xattr_list[i].full_name;
+		void *value = xattr_list[i].value;
+		int vsize = xattr_list[i].vsize;
+
+		xattr_list[j].type = get_prefix(&xattr_list[j], name);
+		free(name);
+
+		if(xattr_list[j].type == -1) {
+			ERROR("Unrecognised xattr prefix %s\n",
+				xattr_list[j].full_name);
+			free(value);
+			continue;
+		}
+
+		xattr_list[j].value = intern(value, vsize);
+		xattr_list[j].vsize = vsize;
+		free(value);
+		j ++;
+	}
+
+	return j;
+}
+
+
 static int get_xattr_size(struct xattr_list *xattr)
 {
 	int size = sizeof(struct squashfs_xattr_entry) +
@@ -329,30 +514,35 @@ static struct dupl_id *check_id_dupl(struct xattr_list *xattr_list, int xattrs)
 {
 	struct dupl_id *entry;
 	int i;
-	unsigned short checksum = 0;
+	unsigned long long hash = 0;
 
-	/* compute checksum over all xattrs */
+	/* compute hash over all xattrs */
 	for(i = 0; i < xattrs; i++) {
 		struct xattr_list *xattr = &xattr_list[i];
 
-		checksum = get_checksum(xattr->full_name,
-					strlen(xattr->full_name), checksum);
-		checksum = get_checksum(xattr->value,
-					xattr->vsize, checksum);
+		hash = hash64(xattr->full_name, strlen(xattr->full_name), hash);
+		hash = hash64(xattr->value, xattr->vsize, hash);
 	}
 
-	for(entry = dupl_id[checksum]; entry; entry = entry->next) {
-		if (entry->xattrs != xattrs)
+	for(entry = dupl_id[XATTR_HASH(hash)]; entry; entry = entry->next) {
+		if (entry->hash != hash || entry->xattrs != xattrs)
 			continue;
 
 		for(i = 0; i < xattrs; i++) {
 			struct xattr_list *xattr = &xattr_list[i];
 			struct xattr_list *dup_xattr = &entry->xattr_list[i];
 
-			if(strcmp(xattr->full_name, dup_xattr->full_name))
+			if(xattr->full_name != dup_xattr->full_name &&
+					strcmp(xattr->full_name,
+					dup_xattr->full_name))
 				break;
 
-			if(memcmp(xattr->value, dup_xattr->value, xattr->vsize))
+			if(xattr->vsize != dup_xattr->vsize)
+				break;
+
+			if(xattr->value != dup_xattr->value &&
+					memcmp(xattr->value, dup_xattr->value,
+					xattr->vsize))
 				break;
 		}
 		
@@ -368,8 +558,9 @@ static struct dupl_id *check_id_dupl(struct xattr_list *xattr_list, int xattrs)
 		entry->xattrs = xattrs;
 		entry->xattr_list = xattr_list;
 		entry->xattr_id = SQUASHFS_INVALID_XATTR;
-		entry->next = dupl_id[checksum];
-		dupl_id[checksum] = entry;
+		entry->hash = hash;
+		entry->next = dupl_id[XATTR_HASH(hash)];
+		dupl_id[XATTR_HASH(hash)] = entry;
 	}
 		
 	return entry;
@@ -384,12 +575,14 @@ static void check_value_dupl(struct xattr_list *xattr)
 		return;
 
 	/* Check if this is a duplicate of an existing value */
-	xattr->vchecksum = get_checksum(xattr->value, xattr->vsize, 0);
-	for(entry = dupl_value[xattr->vchecksum]; entry; entry = entry->vnext) {
-		if(entry->vsize != xattr->vsize)
+	xattr->vhash = hash64(xattr->value, xattr->vsize, 0);
+	for(entry = dupl_value[XATTR_HASH(xattr->vhash)]; entry;
+						entry = entry->vnext) {
+		if(entry->vhash != xattr->vhash || entry->vsize != xattr->vsize)
 			continue;
 		
-		if(memcmp(entry->value, xattr->value, xattr->vsize) == 0)
+		if(entry->value == xattr->value || memcmp(entry->value,
+					xattr->value, xattr->vsize) == 0)
 			break;
 	}
 
@@ -398,22 +591,19 @@ static void check_value_dupl(struct xattr_list *xattr)
 		 * No duplicate exists, add to hash table, and mark as
 		 * requiring writing
 		 */
-		xattr->vnext = dupl_value[xattr->vchecksum];
-		dupl_value[xattr->vchecksum] = xattr;
+		xattr->vnext = dupl_value[XATTR_HASH(xattr->vhash)];
+		dupl_value[XATTR_HASH(xattr->vhash)] = xattr;
 		xattr->ool_value = SQUASHFS_INVALID_BLK;
 	} else {
 		/*
 		 * Duplicate exists, make type XATTR_VALUE_OOL, and
-		 * remember where the duplicate is
+		 * remember where the duplicate is.  Values are either
+		 * interned or, when appending, point into the xattr data
+		 * read from disk, and so are never freed
 		 */
 		xattr->type |= XATTR_VALUE_OOL;
 		xattr->ool_value = entry->ool_value;
-		/* on appending don't free duplicate values because the
-		 * duplicate value already points to the non-duplicate value */
-		if(xattr->value != entry->value) {
-			free(xattr->value);
-			xattr->value = entry->value;
-		}
+		xattr->value = entry->value;
 	}
 }
 
@@ -648,6 +838,31 @@ int read_xattrs(void *d)
 	struct xattr_list *xattr_list;
 	int xattrs;
 
+	if(inode->xattrs != -1) {
+		/*
+		 * the xattrs were read by the directory scan, or from the
+		 * archive with -tar
+		 */
+		xattrs = inode->xattrs;
+		xattr_list = inode->xattr_list;
+		inode->xattrs = -1;
+		inode->xattr_list = NULL;
+
+		if((IS_PSEUDO(inode) && !IS_PSEUDO_ARCHIVE(inode)) ||
+						inode->root_entry) {
+			free_prefetched_xattrs(xattrs, xattr_list);
+			return SQUASHFS_INVALID_XATTR;
+		}
+
+		xattrs = read_prefetched_xattrs(xattrs, xattr_list);
+		if(xattrs == 0) {
+			free(xattr_list);
+			return SQUASHFS_INVALID_XATTR;
+		}
+
+		return generate_xattrs(xattrs, xattr_list);
+	}
+
 	if(no_xattrs || IS_PSEUDO(inode) || inode->root_entry)
 		return SQUASHFS_INVALID_XATTR;
 
@@ -656,19 +871,13 @@ int read_xattrs(void *d)
 	if (context_file) {
 		if (sehnd == NULL)
 			sehnd = get_sehnd(context_file);
-		if (mount_point) {
-			char *mounted_path;
-			alloc_mounted_path(mount_point, subpathname(dir_ent), &mounted_path);
-			xattrs = read_xattrs_from_context_file(mounted_path, inode->buf.st_mode,
-					sehnd, &xattr_list);
-			free(mounted_path);
-		} else {
-			xattrs = read_xattrs_from_context_file(filename, inode->buf.st_mode,
-					sehnd, &xattr_list);
-		}
-	} else {
-		xattrs = read_xattrs_from_system(filename, &xattr_list);
+		if (mount_point)
+			filename = mounted_path(mount_point,
+				subpathname(dir_ent));
+		return context_file_xattr(filename, inode->buf.st_mode, sehnd);
 	}
+
+	xattrs = read_xattrs_from_system(filename, &xattr_list);
 #else
 	xattrs = read_xattrs_from_system(filename, &xattr_list);
 #endif
@@ -47,7 +47,7 @@ struct xattr_list {
 	void			*value;
 	int			type;
 	long long		ool_value;
-	unsigned short		vchecksum;
+	unsigned long long	vhash;
 	struct xattr_list	*vnext;
 };
 
@@ -55,9 +55,25 @@ struct dupl_id {
 	struct xattr_list	*xattr_list;
 	int			xattrs;
 	int			xattr_id;
+	unsigned long long	hash;
 	struct dupl_id		*next;
 };
 
+/*
+ * Interned xattr name or value.  Names and values read from the source
+ * filesystem are stored once, and xattrs with the same name or value share
+ * the stored copy
+ */
+struct xattr_string {
+	unsigned long long	hash;
+	int			size;
+	struct xattr_string	*next;
+	char			data[0];
+};
+
+#define XATTR_HASH_SIZE 65536
+#define XATTR_HASH(hash) ((hash) & (XATTR_HASH_SIZE - 1))
+
 struct prefix {
 	char			*prefix;
 	int			type;
@@ -73,9 +89,12 @@ extern void save_xattrs();
 extern void restore_xattrs();
 extern unsigned int xattr_bytes, total_xattr_bytes;
 extern void write_xattr(char *, unsigned int);
+extern int verify_xattr(char *, unsigned int);
 extern int read_xattrs_from_disk(int, struct squashfs_super_block *);
 extern struct xattr_list *get_xattr(int, unsigned int *, int);
 extern void free_xattr(struct xattr_list *, int);
+extern int prefetch_xattrs(char *, struct xattr_list **);
+extern void free_prefetched_xattrs(int, struct xattr_list *);
 #else
 static inline int get_xattrs(int fd, struct squashfs_super_block *sBlk)
 {
@@ -115,6 +134,24 @@ static inline void write_xattr(char *pathname, unsigned int xattr)
 }
 
 
+static inline int verify_xattr(char *pathname, unsigned int xattr)
+{
+	return 1;
+}
+
+
+static inline int prefetch_xattrs(char *filename, struct xattr_list **xattrs)
+{
+	return -1;
+}
+
+
+static inline void free_prefetched_xattrs(int xattrs,
+	struct xattr_list *xattr_list)
+{
+}
+
+
 static inline int read_xattrs_from_disk(int fd, struct squashfs_super_block *sBlk)
 {
 	if(sBlk->xattr_id_table_start != SQUASHFS_INVALID_BLK) {
@@ -25,6 +25,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <lzma.h>
 
 #include "squashfs_fs.h"
@@ -45,6 +46,18 @@ static int filter_count = 1;
 static int dictionary_size = 0;
 static float dictionary_percent = 0;
 
+/*
+ * When more than one filter is tried (-Xbcj), each data block compressing
+ * thread starts a helper thread, and the filters for a block are tried in
+ * parallel by the compressing thread and any idle helpers.  This keeps
+ * the processors busy when there are fewer blocks in flight than
+ * processors (few large files, large block sizes)
+ */
+static struct xz_job *jobs = NULL;
+static pthread_mutex_t job_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_wait = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t job_done = PTHREAD_COND_INITIALIZER;
+
 
 /*
  * This function is called by the options parsing code in mksquashfs.c
@@ -380,6 +393,105 @@ failed:
  * This function returns 0 on success, and
  *			-1 on error
  */
+static void encode_filter(struct filter *filter, void *src, int size,
+	int block_size)
+{
+	filter->length = 0;
+	filter->res = lzma_stream_buffer_encode(filter->filter,
+		LZMA_CHECK_CRC32, NULL, src, size, filter->buffer,
+		&filter->length, block_size);
+}
+
+
+/*
+ * Take the next filter to try from job.  Called with job_mutex held
+ */
+static int take_filter(struct xz_job *job)
+{
+	int i = job->next ++;
+
+	if(job->next == job->count) {
+		/* no filters left to hand out, remove job from the list */
+		struct xz_job **p;
+
+		for(p = &jobs; *p != job; p = &(*p)->next_job);
+		*p = job->next_job;
+	}
+
+	return i;
+}
+
+
+void *xz_helper(void *arg)
+{
+	while(1) {
+		struct xz_job *job;
+		int i;
+
+		pthread_mutex_lock(&job_mutex);
+		while(jobs == NULL)
+			pthread_cond_wait(&job_wait, &job_mutex);
+
+		job = jobs;
+		i = take_filter(job);
+		pthread_mutex_unlock(&job_mutex);
+
+		encode_filter(&job->filter[i], job->src, job->size,
+			job->block_size);
+
+		pthread_mutex_lock(&job_mutex);
+		if(-- job->pending == 0)
+			pthread_cond_broadcast(&job_done);
+		pthread_mutex_unlock(&job_mutex);
+	}
+}
+
+
+/*
+ * Try the first count filters in parallel with the helper threads.  The
+ * job lives on this thread's stack, and so this thread mustn't be
+ * cancelled (by the mksquashfs restore thread) until the helpers have
+ * finished with it
+ */
+static void share_filters(struct xz_stream *stream, void *src, int size,
+	int block_size, int count)
+{
+	struct xz_job job, **p;
+	int i, state;
+
+	job.filter = stream->filter;
+	job.src = src;
+	job.size = size;
+	job.block_size = block_size;
+	job.count = job.pending = count;
+	job.next = 0;
+	job.next_job = NULL;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+	pthread_mutex_lock(&job_mutex);
+
+	for(p = &jobs; *p; p = &(*p)->next_job);
+	*p = &job;
+	pthread_cond_broadcast(&job_wait);
+
+	while(job.next < count) {
+		i = take_filter(&job);
+		pthread_mutex_unlock(&job_mutex);
+
+		encode_filter(&job.filter[i], src, size, block_size);
+
+		pthread_mutex_lock(&job_mutex);
+		job.pending --;
+	}
+
+	while(job.pending)
+		pthread_cond_wait(&job_done, &job_mutex);
+
+	pthread_mutex_unlock(&job_mutex);
+	pthread_setcancelstate(state, NULL);
+}
+
+
 static int xz_init(void **strm, int block_size, int datablock)
 {
 	int i, j, filters = datablock ? filter_count : 1;
@@ -394,7 +506,8 @@ static int xz_init(void **strm, int block_size, int datablock)
 		goto failed2;
 
 	stream->filter = filter;
-	stream->filters = filters;
+	stream->filters = stream->tries = filters;
+	stream->preset = LZMA_PRESET_DEFAULT;
 
 	memset(filter, 0, filters * sizeof(struct filter));
 
@@ -418,6 +531,17 @@ static int xz_init(void **strm, int block_size, int datablock)
 		}
 	}
 
+	stream->helper = 0;
+	if(filters > 1) {
+		pthread_t thread;
+
+		/* failure to start a helper only loses parallelism */
+		if(pthread_create(&thread, NULL, xz_helper, NULL) == 0) {
+			pthread_detach(thread);
+			stream->helper = 1;
+		}
+	}
+
 	return 0;
 
 failed3:
@@ -433,29 +557,35 @@ failed:
 }
 
 
-static int xz_compress(void *strm, void *dest, void *src,  int size,
-	int block_size, int *error)
+/*
+ * Compress trying the first count filters, and select the best
+ */
+static int compress_filters(struct xz_stream *stream, void *dest, void *src,
+	int size, int block_size, int count, int *error)
 {
 	int i;
         lzma_ret res = 0;
-	struct xz_stream *stream = strm;
 	struct filter *selected = NULL;
 
 	stream->filter[0].buffer = dest;
 
-	for(i = 0; i < stream->filters; i++) {
-		struct filter *filter = &stream->filter[i];
+	/* the options are only read by the encoders, and so can be shared */
+	if(lzma_lzma_preset(&stream->opt, stream->preset))
+		goto failed;
 
-        	if(lzma_lzma_preset(&stream->opt, LZMA_PRESET_DEFAULT))
-                	goto failed;
+	stream->opt.dict_size = stream->dictionary_size;
 
-		stream->opt.dict_size = stream->dictionary_size;
+	if(count > 1 && stream->helper)
+		share_filters(stream, src, size, block_size, count);
+	else
+		for(i = 0; i < count; i++)
+			encode_filter(&stream->filter[i], src, size,
+				block_size);
 
-		filter->length = 0;
-		res = lzma_stream_buffer_encode(filter->filter,
-			LZMA_CHECK_CRC32, NULL, src, size, filter->buffer,
-			&filter->length, block_size);
-	
+	for(i = 0; i < count; i++) {
+		struct filter *filter = &stream->filter[i];
+
+		res = filter->res;
 		if(res == LZMA_OK) {
 			if(!selected || selected->length > filter->length)
 				selected = filter;
@@ -484,22 +614,112 @@ failed:
 }
 
 
-static int xz_uncompress(void *dest, void *src, int size, int outsize,
-	int *error)
+static int xz_compress(void *strm, void *dest, void *src,  int size,
+	int block_size, int *error)
+{
+	struct xz_stream *stream = strm;
+
+	return compress_filters(stream, dest, src, size, block_size,
+		stream->tries, error);
+}
+
+
+static int xz_compress_fast(void *strm, void *dest, void *src, int size,
+	int block_size, int *error)
+{
+	return compress_filters(strm, dest, src, size, block_size, 1, error);
+}
+
+
+/*
+ * The efforts are presets 0 to the default preset, trying only the LZMA2
+ * filter, and then the default preset with all the filters (if there is
+ * more than one).  The dictionary size is always the one given, and so
+ * neither changes how the blocks decompress
+ */
+static int xz_efforts()
+{
+	return LZMA_PRESET_DEFAULT + 1 + (filter_count > 1);
+}
+
+
+static void xz_effort(void *strm, int effort)
+{
+	struct xz_stream *stream = strm;
+
+	stream->preset = effort < LZMA_PRESET_DEFAULT ? effort :
+		LZMA_PRESET_DEFAULT;
+	stream->tries = effort <= LZMA_PRESET_DEFAULT && filter_count > 1 ?
+		1 : stream->filters;
+}
+
+
+/*
+ * This function is called by each decompressing thread to create its
+ * decompression context.  Re-initialising the stream decoder for each
+ * block reuses the decoder memory allocated by the previous block
+ *
+ * This function returns 0 on success, and
+ *			-1 on error
+ */
+static int xz_uncompress_init(void **strm)
+{
+	lzma_stream *stream = malloc(sizeof(lzma_stream));
+
+	if(stream == NULL)
+		return -1;
+
+	*stream = (lzma_stream) LZMA_STREAM_INIT;
+	*strm = stream;
+	return 0;
+}
+
+
+static void xz_uncompress_free(void *strm)
+{
+	lzma_end(strm);
+	free(strm);
+}
+
+
+static int xz_uncompress(void *strm, void *dest, void *src, int size,
+	int outsize, int *error)
 {
+	lzma_stream *stream = strm;
 	size_t src_pos = 0;
 	size_t dest_pos = 0;
 	uint64_t memlimit = MEMLIMIT;
+	lzma_ret res;
+
+	if(stream) {
+		res = lzma_stream_decoder(stream, MEMLIMIT, 0);
+		if(res != LZMA_OK)
+			goto failed;
+
+		stream->next_in = src;
+		stream->avail_in = size;
+		stream->next_out = dest;
+		stream->avail_out = outsize;
+
+		res = lzma_code(stream, LZMA_FINISH);
+		if(res == LZMA_STREAM_END && stream->avail_in == 0)
+			return outsize - (int) stream->avail_out;
+
+		/* as lzma_stream_buffer_decode(), truncated or overflowed */
+		if(res == LZMA_OK || res == LZMA_STREAM_END)
+			res = LZMA_BUF_ERROR;
+		goto failed;
+	}
 
-	lzma_ret res = lzma_stream_buffer_decode(&memlimit, 0, NULL,
-			src, &src_pos, size, dest, &dest_pos, outsize);
+	res = lzma_stream_buffer_decode(&memlimit, 0, NULL, src, &src_pos,
+		size, dest, &dest_pos, outsize);
 
 	if(res == LZMA_OK && size == (int) src_pos)
 		return (int) dest_pos;
-	else {
-		*error = res;
-		return -1;
-	}
+
+failed:
+	*error = res;
+	return -1;
 }
 
 
@@ -527,6 +747,11 @@ void xz_usage()
 struct compressor xz_comp_ops = {
 	.init = xz_init,
 	.compress = xz_compress,
+	.compress_fast = xz_compress_fast,
+	.efforts = xz_efforts,
+	.effort = xz_effort,
+	.uncompress_init = xz_uncompress_init,
+	.uncompress_free = xz_uncompress_free,
 	.uncompress = xz_uncompress,
 	.options = xz_options,
 	.options_post = xz_options_post,
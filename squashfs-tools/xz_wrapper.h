@@ -55,12 +55,32 @@ struct filter {
 	void		*buffer;
 	lzma_filter	filter[3];
 	size_t		length;
+	lzma_ret	res;
+};
+
+/*
+ * A block being compressed with its filters shared out between the
+ * compressing thread and the helper threads.  next is the next filter
+ * to try, and pending the number of filters not yet finished
+ */
+struct xz_job {
+	struct filter	*filter;
+	void		*src;
+	int		size;
+	int		block_size;
+	int		count;
+	int		next;
+	int		pending;
+	struct xz_job	*next_job;
 };
 
 struct xz_stream {
 	struct filter	*filter;
 	int		filters;
+	int		tries;
+	int		preset;
 	int		dictionary_size;
+	int		helper;
 	lzma_options_lzma opt;
 };
 
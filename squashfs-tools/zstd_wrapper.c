@@ -0,0 +1,592 @@
+/*
+ * Copyright (c) 2017
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * zstd_wrapper.c
+ *
+ * Support for ZSTD compression http://facebook.github.io/zstd
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <zstd.h>
+#include <zstd_errors.h>
+#include <zdict.h>
+
+#include "squashfs_fs.h"
+#include "zstd_wrapper.h"
+#include "compressor.h"
+
+/* default compression level */
+static int compression_level = ZSTD_DEFAULT_COMPRESSION_LEVEL;
+
+/* window log, 0 lets zstd choose it from the block size */
+static int window_log = 0;
+
+/*
+ * dictionary used to compress and decompress every block, either read
+ * from the -Xdict file, or from the stored compression options
+ */
+static char dictionary[ZSTD_MAX_DICTIONARY_SIZE];
+static int dictionary_size = 0;
+
+/* train the dictionary from a sample of the small files (-Xdict-train) */
+static int train_dictionary = 0;
+
+/*
+ * Read the dictionary file given to -Xdict.  The dictionary is stored
+ * in the filesystem, and so it must fit in the compression options
+ * metadata block
+ */
+static int read_dictionary(char *filename)
+{
+	FILE *file = fopen(filename, "r");
+	int res;
+
+	if(file == NULL) {
+		fprintf(stderr, "zstd: -Xdict failed to open %s\n", filename);
+		return -1;
+	}
+
+	res = fread(dictionary, 1, ZSTD_MAX_DICTIONARY_SIZE, file);
+	if(ferror(file)) {
+		fprintf(stderr, "zstd: -Xdict failed to read %s\n", filename);
+		fclose(file);
+		return -1;
+	}
+
+	if(res == 0 || fgetc(file) != EOF) {
+		fprintf(stderr, "zstd: -Xdict dictionary should be 1 .. %d "
+			"bytes\n", (int) ZSTD_MAX_DICTIONARY_SIZE);
+		fclose(file);
+		return -1;
+	}
+
+	fclose(file);
+	dictionary_size = res;
+	return 0;
+}
+
+
+/*
+ * This function is called by the options parsing code in mksquashfs.c
+ * to parse any -X compressor option.
+ *
+ * This function returns:
+ *	>=0 (number of additional args parsed) on success
+ *	-1 if the option was unrecognised, or
+ *	-2 if the option was recognised, but otherwise bad in
+ *	   some way (e.g. invalid parameter)
+ *
+ * Note: this function sets internal compressor state, but does not
+ * pass back the results of the parsing other than success/failure.
+ * The zstd_dump_options() function is called later to get the options in
+ * a format suitable for writing to the filesystem.
+ */
+static int zstd_options(char *argv[], int argc)
+{
+	if(strcmp(argv[0], "-Xcompression-level") == 0) {
+		if(argc < 2) {
+			fprintf(stderr, "zstd: -Xcompression-level missing "
+				"compression level\n");
+			fprintf(stderr, "zstd: -Xcompression-level it should "
+				"be 1 >= n <= %d\n", ZSTD_maxCLevel());
+			goto failed;
+		}
+
+		compression_level = atoi(argv[1]);
+		if(compression_level < 1 ||
+				compression_level > ZSTD_maxCLevel()) {
+			fprintf(stderr, "zstd: -Xcompression-level invalid, it "
+				"should be 1 >= n <= %d\n", ZSTD_maxCLevel());
+			goto failed;
+		}
+
+		return 1;
+	} else if(strcmp(argv[0], "-Xwindow-log") == 0) {
+		if(argc < 2) {
+			fprintf(stderr, "zstd: -Xwindow-log missing window "
+				"log\n");
+			fprintf(stderr, "zstd: -Xwindow-log <window-log>\n");
+			goto failed;
+		}
+
+		window_log = atoi(argv[1]);
+		if(window_log < ZSTD_MIN_WINDOW_LOG ||
+				window_log > ZSTD_MAX_WINDOW_LOG) {
+			fprintf(stderr, "zstd: -Xwindow-log invalid, it "
+				"should be %d >= n <= %d\n",
+				ZSTD_MIN_WINDOW_LOG, ZSTD_MAX_WINDOW_LOG);
+			goto failed;
+		}
+
+		return 1;
+	} else if(strcmp(argv[0], "-Xdict") == 0) {
+		if(argc < 2) {
+			fprintf(stderr, "zstd: -Xdict missing dictionary "
+				"file\n");
+			fprintf(stderr, "zstd: -Xdict <dictionary-file>\n");
+			goto failed;
+		}
+
+		if(read_dictionary(argv[1]) == -1)
+			goto failed;
+
+		return 1;
+	} else if(strcmp(argv[0], "-Xdict-train") == 0) {
+		train_dictionary = 1;
+		return 0;
+	}
+
+	return -1;
+
+failed:
+	return -2;
+}
+
+
+/*
+ * This function is called after all options have been parsed.
+ * It is used to do post-processing on the compressor options using
+ * values that were not expected to be known at option parse time.
+ *
+ * The window doesn't need to be larger than the block size, because
+ * each block is compressed independently.
+ *
+ * This function returns 0 on successful post processing, or
+ *			-1 on error
+ */
+static int zstd_options_post(int block_size)
+{
+	if(train_dictionary && dictionary_size) {
+		fprintf(stderr, "zstd: -Xdict and -Xdict-train can't both be "
+			"specified\n");
+		return -1;
+	}
+
+	if(window_log && (1 << window_log) > block_size) {
+		fprintf(stderr, "zstd: -Xwindow-log is larger than the block "
+			"size\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * This function is called by mksquashfs to dump the parsed
+ * compressor options in a format suitable for writing to the
+ * compressor options field in the filesystem (stored immediately
+ * after the superblock).
+ *
+ * This function returns a pointer to the compression options structure
+ * to be stored (and the size), or NULL if there are no compression
+ * options
+ */
+static void *zstd_dump_options(int block_size, int *size)
+{
+	static char buffer[SQUASHFS_METADATA_SIZE] __attribute__ ((aligned));
+	struct zstd_comp_opts *comp_opts = (struct zstd_comp_opts *) buffer;
+
+	/* don't store a compression options structure if all are default */
+	if(compression_level == ZSTD_DEFAULT_COMPRESSION_LEVEL &&
+				window_log == 0 && dictionary_size == 0)
+		return NULL;
+
+	/*
+	 * Only store the compression level if that's all that's been
+	 * changed, this is understood by all zstd decompressors
+	 */
+	comp_opts->compression_level = compression_level;
+	if(window_log == 0 && dictionary_size == 0) {
+		SQUASHFS_INSWAP_COMP_LEVEL(comp_opts);
+		*size = ZSTD_LEVEL_OPTS_SIZE;
+		return comp_opts;
+	}
+
+	comp_opts->window_log = window_log;
+	comp_opts->dictionary_size = dictionary_size;
+	memcpy(buffer + sizeof(*comp_opts), dictionary, dictionary_size);
+
+	SQUASHFS_INSWAP_COMP_OPTS(comp_opts);
+
+	*size = sizeof(*comp_opts) + dictionary_size;
+	return comp_opts;
+}
+
+
+/*
+ * Check the stored compression options, and read the compression level,
+ * window log and dictionary from the options structure.  Used by both
+ * extract_options and check_options, because the dictionary is needed
+ * to decompress
+ */
+static int read_options(void *buffer, int size, int *level, int *log)
+{
+	struct zstd_comp_opts *comp_opts = buffer;
+
+	/*
+	 * we expect at least the compression level to be present, and
+	 * otherwise the full structure followed by the dictionary
+	 */
+	if(size == ZSTD_LEVEL_OPTS_SIZE) {
+		SQUASHFS_INSWAP_COMP_LEVEL(comp_opts);
+	} else if(size >= sizeof(*comp_opts)) {
+		SQUASHFS_INSWAP_COMP_OPTS(comp_opts);
+	} else
+		goto failed;
+
+	if(comp_opts->compression_level < 1 ||
+			comp_opts->compression_level > ZSTD_maxCLevel()) {
+		fprintf(stderr, "zstd: bad compression level in compression "
+			"options structure\n");
+		goto failed;
+	}
+	*level = comp_opts->compression_level;
+
+	if(size == ZSTD_LEVEL_OPTS_SIZE) {
+		*log = 0;
+		dictionary_size = 0;
+		return 0;
+	}
+
+	if(comp_opts->window_log && (comp_opts->window_log <
+			ZSTD_MIN_WINDOW_LOG || comp_opts->window_log >
+			ZSTD_MAX_WINDOW_LOG)) {
+		fprintf(stderr, "zstd: bad window log in compression options "
+			"structure\n");
+		goto failed;
+	}
+	*log = comp_opts->window_log;
+
+	if(comp_opts->dictionary_size > ZSTD_MAX_DICTIONARY_SIZE ||
+			size != sizeof(*comp_opts) +
+			comp_opts->dictionary_size) {
+		fprintf(stderr, "zstd: bad dictionary size in compression "
+			"options structure\n");
+		goto failed;
+	}
+
+	dictionary_size = comp_opts->dictionary_size;
+	memcpy(dictionary, buffer + sizeof(*comp_opts), dictionary_size);
+
+	return 0;
+
+failed:
+	fprintf(stderr, "zstd: error reading stored compressor options from "
+		"filesystem!\n");
+
+	return -1;
+}
+
+
+/*
+ * This function is a helper specifically for the append mode of
+ * mksquashfs.  Its purpose is to set the internal compressor state
+ * to the stored compressor options in the passed compressor options
+ * structure.
+ *
+ * In effect this function sets up the compressor options
+ * to the same state they were when the filesystem was originally
+ * generated, this is to ensure on appending, the compressor uses
+ * the same compression options that were used to generate the
+ * original filesystem.
+ *
+ * Note, even if there are no compressor options, this function is still
+ * called with an empty compressor structure (size == 0), to explicitly
+ * set the default options, this is to ensure any user supplied
+ * -X options on the appending mksquashfs command line are over-ridden
+ *
+ * This function returns 0 on sucessful extraction of options, and
+ *			-1 on error
+ */
+static int zstd_extract_options(int block_size, void *buffer, int size)
+{
+	/* the dictionary always comes from the filesystem when appending */
+	train_dictionary = 0;
+
+	if(size == 0) {
+		/* Set default values */
+		compression_level = ZSTD_DEFAULT_COMPRESSION_LEVEL;
+		window_log = 0;
+		dictionary_size = 0;
+		return 0;
+	}
+
+	return read_options(buffer, size, &compression_level, &window_log);
+}
+
+
+/*
+ * This function is a helper specifically for unsquashfs.
+ * Its purpose is to check that the compression options are
+ * understood by this version of zstd, and to read any dictionary
+ * needed to decompress the filesystem.
+ *
+ * This function returns 0 on sucessful checking of options, and
+ *			-1 on error
+ */
+static int zstd_check_options(int block_size, void *buffer, int size)
+{
+	int level, log;
+
+	if(size == 0) {
+		dictionary_size = 0;
+		return 0;
+	}
+
+	return read_options(buffer, size, &level, &log);
+}
+
+
+void zstd_display_options(void *buffer, int size)
+{
+	struct zstd_comp_opts *comp_opts = buffer;
+	int level, log;
+
+	if(read_options(buffer, size, &level, &log) == -1)
+		return;
+
+	printf("\tcompression-level %d\n", level);
+	if(log)
+		printf("\twindow-log %d\n", log);
+	if(size > ZSTD_LEVEL_OPTS_SIZE && comp_opts->dictionary_size)
+		printf("\tdictionary-size %d\n", comp_opts->dictionary_size);
+}
+
+
+/*
+ * This function is called by mksquashfs to find out how much sample
+ * data to read for dictionary training.  Zstd suggests about 100 times
+ * the dictionary size
+ */
+static int zstd_sample_size()
+{
+	return train_dictionary ? ZSTD_MAX_DICTIONARY_SIZE * 100 : 0;
+}
+
+
+/*
+ * This function is called by mksquashfs with the samples read, which are
+ * stored back to back in samples, with their sizes in sizes.  The
+ * trained dictionary is then used and stored in the same way as a -Xdict
+ * dictionary
+ *
+ * This function returns 0 on success, and
+ *			-1 on error
+ */
+static int zstd_train(void *samples, size_t *sizes, int count)
+{
+	size_t res = ZDICT_trainFromBuffer(dictionary, ZSTD_MAX_DICTIONARY_SIZE,
+		samples, sizes, count);
+
+	if(ZDICT_isError(res)) {
+		fprintf(stderr, "zstd: failed to train dictionary, %s\n",
+			ZDICT_getErrorName(res));
+		return -1;
+	}
+
+	dictionary_size = res;
+	return 0;
+}
+
+
+/*
+ * This function is called by mksquashfs to initialise the
+ * compressor, before compress() is called.
+ *
+ * The dictionary is loaded into each compression context, rather than
+ * shared, as the contexts are initialised by the compressor threads
+ *
+ * This function returns 0 on success, and
+ *			-1 on error
+ */
+static int zstd_init(void **strm, int block_size, int datablock)
+{
+	ZSTD_CCtx *cctx = ZSTD_createCCtx();
+	size_t res;
+
+	if(cctx == NULL)
+		return -1;
+
+	res = ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel,
+		compression_level);
+	if(!ZSTD_isError(res) && window_log)
+		res = ZSTD_CCtx_setParameter(cctx, ZSTD_c_windowLog,
+			window_log);
+	if(!ZSTD_isError(res) && dictionary_size)
+		res = ZSTD_CCtx_loadDictionary(cctx, dictionary,
+			dictionary_size);
+	if(ZSTD_isError(res)) {
+		fprintf(stderr, "zstd: failed to initialise compressor, %s\n",
+			ZSTD_getErrorName(res));
+		ZSTD_freeCCtx(cctx);
+		return -1;
+	}
+
+	*strm = cctx;
+	return 0;
+}
+
+
+/*
+ * The efforts are levels 1 to the level given.  Only the window can
+ * change how the blocks decompress, and that is either given, or is no
+ * larger than the block
+ */
+static int zstd_efforts()
+{
+	return compression_level;
+}
+
+
+static void zstd_effort(void *strm, int effort)
+{
+	/* if the level can't be changed, the stream stays at the old one */
+	ZSTD_CCtx_setParameter(strm, ZSTD_c_compressionLevel, effort + 1);
+}
+
+
+static int zstd_compress(void *strm, void *dest, void *src, int size,
+	int block_size, int *error)
+{
+	size_t res = ZSTD_compress2(strm, dest, block_size, src, size);
+
+	if(ZSTD_isError(res)) {
+		/*
+		 * Output buffer overflow.  Return out of buffer space
+		 */
+		if(ZSTD_getErrorCode(res) == ZSTD_error_dstSize_tooSmall)
+			return 0;
+
+		/*
+		 * All other errors return failure, with the compressor
+		 * specific error code in *error
+		 */
+		*error = (int) ZSTD_getErrorCode(res);
+		return -1;
+	}
+
+	return (int) res;
+}
+
+
+/*
+ * This function is called by each decompressing thread to create its
+ * decompression context, with the dictionary (if any) loaded once
+ *
+ * This function returns 0 on success, and
+ *			-1 on error
+ */
+static int zstd_uncompress_init(void **strm)
+{
+	ZSTD_DCtx *dctx = ZSTD_createDCtx();
+
+	if(dctx == NULL)
+		return -1;
+
+	if(dictionary_size && ZSTD_isError(ZSTD_DCtx_loadDictionary(dctx,
+			dictionary, dictionary_size))) {
+		ZSTD_freeDCtx(dctx);
+		return -1;
+	}
+
+	*strm = dctx;
+	return 0;
+}
+
+
+static void zstd_uncompress_free(void *strm)
+{
+	ZSTD_freeDCtx(strm);
+}
+
+
+static int zstd_uncompress(void *strm, void *dest, void *src, int size,
+	int outsize, int *error)
+{
+	size_t res;
+
+	if(strm)
+		res = ZSTD_decompressDCtx(strm, dest, outsize, src, size);
+	else if(dictionary_size) {
+		ZSTD_DCtx *dctx = ZSTD_createDCtx();
+
+		if(dctx == NULL) {
+			*error = 0;
+			return -1;
+		}
+
+		res = ZSTD_decompress_usingDict(dctx, dest, outsize, src, size,
+			dictionary, dictionary_size);
+		ZSTD_freeDCtx(dctx);
+	} else
+		res = ZSTD_decompress(dest, outsize, src, size);
+
+	if(ZSTD_isError(res)) {
+		*error = (int) ZSTD_getErrorCode(res);
+		return -1;
+	}
+
+	return (int) res;
+}
+
+
+void zstd_usage()
+{
+	fprintf(stderr, "\t  -Xcompression-level <compression-level>\n");
+	fprintf(stderr, "\t\t<compression-level> should be 1 .. %d (default "
+		"%d)\n", ZSTD_maxCLevel(), ZSTD_DEFAULT_COMPRESSION_LEVEL);
+	fprintf(stderr, "\t  -Xwindow-log <window-log>\n");
+	fprintf(stderr, "\t\t<window-log> should be %d .. %d, and the window "
+		"no larger than\n\t\tthe block size (default chosen from the "
+		"block size)\n", ZSTD_MIN_WINDOW_LOG, ZSTD_MAX_WINDOW_LOG);
+	fprintf(stderr, "\t  -Xdict <dictionary-file>\n");
+	fprintf(stderr, "\t\tCompress using the dictionary in "
+		"<dictionary-file>, which is\n\t\tstored in the filesystem.  "
+		"It should be %d bytes or smaller\n",
+		(int) ZSTD_MAX_DICTIONARY_SIZE);
+	fprintf(stderr, "\t  -Xdict-train\n");
+	fprintf(stderr, "\t\tTrain a dictionary from a sample of the files "
+		"smaller than the\n\t\tblock size, and compress using it "
+		"as -Xdict\n");
+}
+
+
+struct compressor zstd_comp_ops = {
+	.init = zstd_init,
+	.compress = zstd_compress,
+	.efforts = zstd_efforts,
+	.effort = zstd_effort,
+	.uncompress_init = zstd_uncompress_init,
+	.uncompress_free = zstd_uncompress_free,
+	.uncompress = zstd_uncompress,
+	.options = zstd_options,
+	.options_post = zstd_options_post,
+	.dump_options = zstd_dump_options,
+	.extract_options = zstd_extract_options,
+	.check_options = zstd_check_options,
+	.display_options = zstd_display_options,
+	.sample_size = zstd_sample_size,
+	.train = zstd_train,
+	.usage = zstd_usage,
+	.id = ZSTD_COMPRESSION,
+	.name = "zstd",
+	.supported = 1
+};
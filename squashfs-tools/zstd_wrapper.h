@@ -0,0 +1,78 @@
+#ifndef ZSTD_WRAPPER_H
+#define ZSTD_WRAPPER_H
+/*
+ * Squashfs
+ *
+ * Copyright (c) 2017
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * zstd_wrapper.h
+ *
+ */
+
+#ifndef linux
+#define __BYTE_ORDER BYTE_ORDER
+#define __BIG_ENDIAN BIG_ENDIAN
+#define __LITTLE_ENDIAN LITTLE_ENDIAN
+#else
+#include <endian.h>
+#endif
+
+#if __BYTE_ORDER == __BIG_ENDIAN
+extern unsigned int inswap_le16(unsigned short);
+extern unsigned int inswap_le32(unsigned int);
+
+#define SQUASHFS_INSWAP_COMP_LEVEL(s) { \
+	(s)->compression_level = inswap_le32((s)->compression_level); \
+}
+
+#define SQUASHFS_INSWAP_COMP_OPTS(s) { \
+	(s)->compression_level = inswap_le32((s)->compression_level); \
+	(s)->window_log = inswap_le16((s)->window_log); \
+	(s)->dictionary_size = inswap_le16((s)->dictionary_size); \
+}
+#else
+#define SQUASHFS_INSWAP_COMP_LEVEL(s)
+#define SQUASHFS_INSWAP_COMP_OPTS(s)
+#endif
+
+/* Default compression */
+#define ZSTD_DEFAULT_COMPRESSION_LEVEL 15
+
+/* Window logs accepted by -Xwindow-log */
+#define ZSTD_MIN_WINDOW_LOG 10
+#define ZSTD_MAX_WINDOW_LOG SQUASHFS_FILE_MAX_LOG
+
+/*
+ * The compression options, including any dictionary, are stored in one
+ * uncompressed metadata block after the superblock
+ */
+#define ZSTD_MAX_DICTIONARY_SIZE (SQUASHFS_METADATA_SIZE - \
+	sizeof(struct zstd_comp_opts))
+
+/*
+ * Filesystems storing only the compression level have a compression
+ * options structure of just the compression_level field
+ */
+#define ZSTD_LEVEL_OPTS_SIZE sizeof(int)
+
+struct zstd_comp_opts {
+	int compression_level;
+	short window_log;
+	unsigned short dictionary_size;
+};
+#endif